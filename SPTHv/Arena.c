@@ -0,0 +1,92 @@
+#include "Arena.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here calls into the OS beyond RtlSecureZeroMemory; the backing block comes from the
+ *  ARENA_PROVIDER the arena was created with, so any page-aligned buffer (with a made-up physical address)
+ *  will do in place of contiguous node memory.
+ *
+ * Arenas aren't synchronized; each one is meant to be owned by a single LP (see _AllocateLP in "Driver.c")
+ */
+
+BOOLEAN
+ArenaCreate(
+    _Out_ PARENA Arena,
+    _In_ CONST ARENA_PROVIDER* Provider,
+    _In_ CONST SIZE_T Size,
+    _In_ CONST ULONG Node
+    )
+{
+    RtlSecureZeroMemory( Arena, sizeof(ARENA) );
+
+    if ( Size == 0 || (Size & (PAGE_SIZE - 1)) != 0 )
+    {
+        return FALSE;
+    }
+
+    Arena->VA = Provider->Allocate( Size, Node, &Arena->PA );
+    if ( Arena->VA == NULL )
+    {
+        return FALSE;
+    }
+
+    // Everything we carve out of the block (VMXON region, VMCS, bitmaps) is expected to start zeroed;
+    //    doing it here, once, saves zeroing each allocation on its own
+    RtlSecureZeroMemory( Arena->VA, Size );
+
+    Arena->Provider = Provider;
+    Arena->Size = Size;
+    Arena->Node = Node;
+
+    return TRUE;
+}
+
+BOOLEAN
+ArenaCarve(
+    _Inout_ PARENA Arena,
+    _In_ CONST SIZE_T Length,
+    _In_ CONST SIZE_T Alignment,
+    _Out_ PVMX_ADDRESS Allocation
+    )
+{
+    // Carve Length bytes, aligned to Alignment (a power of two, no more than a page), off the front of the arena
+    //    (Note: the block itself is page-aligned, so aligning its offset aligns both the VA and PA)
+
+    SIZE_T offset;
+
+    Allocation->VA = NULL;
+    Allocation->PA = NULL;
+
+    if ( Arena->VA == NULL || Alignment == 0 || Alignment > PAGE_SIZE || (Alignment & (Alignment - 1)) != 0 )
+    {
+        return FALSE;
+    }
+
+    offset = (Arena->Used + Alignment - 1) & ~(Alignment - 1);
+
+    if ( offset > Arena->Size || Length > Arena->Size - offset )
+    {
+        return FALSE;
+    }
+
+    Allocation->VA = Arena->VA + offset;
+    Allocation->PA = (PVOID)(Arena->PA + offset);
+
+    Arena->Used = offset + Length;
+
+    return TRUE;
+}
+
+VOID
+ArenaDestroy(
+    _Inout_ PARENA Arena
+    )
+{
+    if ( Arena->VA != NULL )
+    {
+        Arena->Provider->Free( Arena->VA, Arena->Size );
+    }
+
+    RtlSecureZeroMemory( Arena, sizeof(ARENA) );
+}
@@ -0,0 +1,74 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <ntddk.h>
+
+#include "Utils.h"
+
+/*
+ * Where an arena's backing block comes from; in the driver this is MmAllocateContiguousNodeMemory
+ *  (see utlAllocateNodeBlock in "Utils.c"). Allocate returns a page-aligned, physically contiguous block
+ *  of Size bytes, preferably on Node, and its physical address.
+ */
+typedef PVOID (*ARENA_BLOCK_ALLOCATE)(
+	_In_ CONST SIZE_T Size,
+	_In_ CONST ULONG Node,
+	_Out_ PUINT64 PhysicalAddress
+	);
+
+typedef VOID (*ARENA_BLOCK_FREE)(
+	_In_ PVOID Block,
+	_In_ CONST SIZE_T Size
+	);
+
+typedef struct _ARENA_PROVIDER
+{
+	ARENA_BLOCK_ALLOCATE Allocate;
+	ARENA_BLOCK_FREE Free;
+} ARENA_PROVIDER, *PARENA_PROVIDER;
+
+/*
+ * One block of memory that a set of allocations are carved out of, front to back, and which is
+ *  released in one go; nothing carved out of an arena is ever freed on its own.
+ */
+typedef struct _ARENA
+{
+	CONST ARENA_PROVIDER* Provider;
+
+	PUINT8 VA;
+	UINT64 PA;
+	SIZE_T Size;
+	SIZE_T Used;
+
+	// The NUMA node the block was requested on
+	ULONG Node;
+} ARENA, *PARENA;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+ArenaCreate(
+	_Out_ PARENA Arena,
+	_In_ CONST ARENA_PROVIDER* Provider,
+	_In_ CONST SIZE_T Size,
+	_In_ CONST ULONG Node
+	);
+
+BOOLEAN
+ArenaCarve(
+	_Inout_ PARENA Arena,
+	_In_ CONST SIZE_T Length,
+	_In_ CONST SIZE_T Alignment,
+	_Out_ PVMX_ADDRESS Allocation
+	);
+
+VOID
+ArenaDestroy(
+	_Inout_ PARENA Arena
+	);
+
+#endif // __ARENA_H__
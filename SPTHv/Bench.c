@@ -0,0 +1,148 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The exit benchmark suite runs once at load (see DriverEntry), and again on every
+ *  IOCTL_SPTHV_RUN_EXIT_BENCHMARK (see "Device.c", and the SPTHvCtl tool); each run times every
+ *  payload in g_BenchPayloads on whichever LP it happens to be on, from the guest's side.
+ *
+ * Each sample is a full guest -> VMM -> guest round trip, plus the two fenced RDTSCs around it; an
+ *  interrupt landing inside one inflates that sample, which is what the P99 (rather than the Max) is for.
+ */
+
+// One payload per SPTHV_BENCH_EXIT (see "guest.asm")
+CONST struct
+{
+    GUEST_BENCH_PAYLOAD Payload;
+    VMX_BASIC_EXIT_REASON Reason;
+    UINT64 Argument;
+} g_BenchPayloads[SPTHV_BENCH_EXIT_COUNT] = {
+    { GuestBenchCPUID,  REASON_CPUID,                   0 },
+    { GuestBenchRDMSR,  REASON_RDMSR,                   BENCH_MSR },
+    { GuestBenchWRMSR,  REASON_WRMSR,                   BENCH_MSR },
+    { GuestBenchVMCALL, REASON_VMCALL,                  HYPERCALL_PING },
+    { GuestBenchIO,     REASON_IO_INSTRUCTION,          BENCH_PORT },
+    { GuestBenchCR3,    REASON_CONTROL_REGISTER_ACCESS, 0 },
+    { GuestBenchHLT,    REASON_HLT,                     0 },
+    { GuestBenchVMCALL, REASON_VMCALL,                  HYPERCALL_BENCH_XSTATE }
+};
+
+// Only one run at a time; each one changes the shared MSR and I/O bitmaps (as do intercept requests; see "Intercept.c")
+FAST_MUTEX g_BenchLock;
+
+VOID
+BenchInitialize()
+{
+    ExInitializeFastMutex( &g_BenchLock );
+}
+
+VOID
+_SetBenchIntercepts(
+    _In_ CONST BOOLEAN Intercept
+    )
+{
+    // (Note: this changes the bitmaps every LP shares; the other LPs just take a few more exits while a run is going)
+    MsrBitmapSetIntercept( g_MSRBitmap.VA, BENCH_MSR, MSR_INTERCEPT_READ_WRITE, Intercept );
+
+    if ( g_IOBitmap.VA != NULL )
+    {
+        IoBitmapSetIntercept( g_IOBitmap.VA, BENCH_PORT, Intercept );
+    }
+}
+
+NTSTATUS
+BenchRunExitSuite(
+    _In_ ULONG Iterations,
+    _Out_ PSPTHV_EXIT_BENCHMARK Benchmark
+    )
+{
+    KIRQL PreviousIRQL;
+    PROCESSOR_PRIMARY_VM_EXEC_CTRLS benchCtrls;
+
+    PUINT64 samples;
+    ULONG i;
+
+    RtlSecureZeroMemory( Benchmark, sizeof(SPTHV_EXIT_BENCHMARK) );
+
+    if ( Iterations == 0 || Iterations > SPTHV_BENCH_MAX_ITERATIONS )
+    {
+        Iterations = SPTHV_BENCH_DEFAULT_ITERATIONS;
+    }
+
+    samples = ExAllocatePoolWithTag( NonPagedPool, (SIZE_T)Iterations * sizeof(UINT64), SPTHV_POOL_TAG );
+    if ( samples == NULL )
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireFastMutex( &g_BenchLock );
+
+    _SetBenchIntercepts( TRUE );
+
+    // Stay on this LP for the duration of the run; HYPERCALL_BENCH_EXITING only changes this LP's controls
+    KeRaiseIrql( DISPATCH_LEVEL, &PreviousIRQL );
+
+    Benchmark->Iterations = Iterations;
+    Benchmark->Processor = KeGetCurrentProcessorNumberEx( NULL );
+
+    benchCtrls.All = (UINT32)GuestVmcall( HYPERCALL_BENCH_EXITING, TRUE, 0 );
+
+    for ( i = 0; i < SPTHV_BENCH_EXIT_COUNT; i++ )
+    {
+        Benchmark->Results[i].BasicExitReason = g_BenchPayloads[i].Reason;
+
+        // Without the controls they need, these payloads wouldn't exit at all (or, for HLT, would actually halt)
+        if ( (i == SPTHV_BENCH_IO && g_VMXControls.Primary.UseIOBitmaps == 0) ||
+             (i == SPTHV_BENCH_CR_ACCESS && benchCtrls.CR3LoadExiting == 0) ||
+             (i == SPTHV_BENCH_HLT && benchCtrls.HLTExiting == 0) ||
+             (i == SPTHV_BENCH_VMCALL_XSTATE && (g_XStateFeatures.Components & XSTATE_AVX) == 0) )
+        {
+            continue;
+        }
+
+        g_BenchPayloads[i].Payload( Iterations, samples, g_BenchPayloads[i].Argument );
+
+        StatsSummarize( samples, Iterations, &Benchmark->Results[i].Latency );
+        Benchmark->Results[i].Available = TRUE;
+    }
+
+    GuestVmcall( HYPERCALL_BENCH_EXITING, FALSE, 0 );
+
+    KeLowerIrql( PreviousIRQL );
+
+    _SetBenchIntercepts( FALSE );
+
+    ExReleaseFastMutex( &g_BenchLock );
+
+    ExFreePoolWithTag( samples, SPTHV_POOL_TAG );
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+BenchReport(
+    _In_ CONST SPTHV_EXIT_BENCHMARK* Benchmark
+    )
+{
+    ULONG i;
+
+    for ( i = 0; i < SPTHV_BENCH_EXIT_COUNT; i++ )
+    {
+        if ( Benchmark->Results[i].Available == FALSE )
+        {
+            continue;
+        }
+
+        KdPrint((
+            "[SPTHv] Exit %lu round trip (LP %lu, %lu iterations): %llu min, %llu median, %llu p99, %llu max cycles\r\n",
+            Benchmark->Results[i].BasicExitReason,
+            Benchmark->Processor,
+            Benchmark->Iterations,
+            Benchmark->Results[i].Latency.Min,
+            Benchmark->Results[i].Latency.Median,
+            Benchmark->Results[i].Latency.P99,
+            Benchmark->Results[i].Latency.Max
+            ));
+    }
+}
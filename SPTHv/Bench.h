@@ -0,0 +1,42 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+// The MSR and port the RDMSR/WRMSR and I/O payloads use; both are intercepted for the duration of a run only
+//	(Note: IA32_TSC_AUX holds the same value before and after, and port 80H is the POST code port, which nothing reads)
+#define BENCH_MSR							IA32_TSC_AUX
+#define BENCH_PORT							0x80
+
+
+
+//
+// Globals
+//
+
+// Held for the length of a run, and while the MSR and I/O bitmaps every LP shares are changed (see "Intercept.c")
+extern FAST_MUTEX g_BenchLock;
+
+
+
+//
+// Local functions
+//
+
+VOID
+BenchInitialize();
+
+NTSTATUS
+BenchRunExitSuite(
+	_In_ ULONG Iterations,
+	_Out_ PSPTHV_EXIT_BENCHMARK Benchmark
+	);
+
+VOID
+BenchReport(
+	_In_ CONST SPTHV_EXIT_BENCHMARK* Benchmark
+	);
+
+#endif // __BENCH_H__
@@ -0,0 +1,330 @@
+#include "CPUIDTable.h"
+
+/*
+ * Notes for testing:
+ *
+ * CpuidTableBuild reads its leaves through a CPUID_READER; given one that replays a recorded dump (leaf,
+ *  subleaf and the four registers), the table it builds, and what CpuidTableLookup answers from it, can be
+ *  compared against the dump on any machine.
+ *
+ * Each LP builds its own table, on itself, right before it's launched (see _VirtualizeLP in "Driver.c"); the
+ *  APIC IDs in leaves 01H, 04H, 0BH and 1FH differ from one LP to the next. A CPUID answered from the table
+ *  by VMExitStub never reaches VMExitDispatch, and so is neither traced nor counted in the exit stats; the
+ *  table counts those itself (`FastHits`), and VMExitStub leaves every CPUID to the dispatcher while tracing.
+ */
+
+// Every leaf with subleaves we know how to record, or which has to be answered specially; every other leaf is
+//  CPUID_SUBLEAVES_FIRST ([CPUID] "Information Returned by CPUID Instruction")
+CONST CPUID_LEAF_RULE g_CPUIDLeafRules[] = {
+    { 0x00, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x01, CPUID_SUBLEAVES_NONE, CPUID_SLOT_CR4 },
+    { 0x02, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x03, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x04, CPUID_SUBLEAVES_CACHE, 0 },
+    { 0x05, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x06, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x07, CPUID_SUBLEAVES_MAX_IN_EAX, CPUID_SLOT_CR4 },
+    { 0x09, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x0A, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x0B, CPUID_SUBLEAVES_TOPOLOGY, 0 },
+    { 0x0D, CPUID_SUBLEAVES_FIRST, CPUID_SLOT_LIVE },   // The sizes in subleaves 0 and 1 follow XCR0 (and IA32_XSS)
+    { 0x14, CPUID_SUBLEAVES_MAX_IN_EAX, 0 },
+    { 0x15, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x16, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x17, CPUID_SUBLEAVES_MAX_IN_EAX, 0 },
+    { 0x18, CPUID_SUBLEAVES_MAX_IN_EAX, 0 },
+    { 0x19, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x1A, CPUID_SUBLEAVES_NONE, 0 },
+    { 0x1D, CPUID_SUBLEAVES_MAX_IN_EAX, 0 },
+    { 0x1F, CPUID_SUBLEAVES_TOPOLOGY, 0 },
+    { 0x20, CPUID_SUBLEAVES_MAX_IN_EAX, 0 },
+
+    { CPUID_EXTENDED_BASE + 0x0, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x1, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x2, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x3, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x4, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x6, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x7, CPUID_SUBLEAVES_NONE, 0 },
+    { CPUID_EXTENDED_BASE + 0x8, CPUID_SUBLEAVES_NONE, 0 },
+};
+
+// What every LP's guest sees on top of the processor's own leaves
+CONST CPUID_OVERRIDE g_CPUIDOverrides[CPUID_OVERRIDE_COUNT] = {
+    // ECX[31] of leaf 01H is left clear by processors, for hypervisors to say they're there
+    { 0x01, CPUID_ANY_SUBLEAF, CPUID_ECX, 1UL << 31, 1UL << 31 },
+
+    // The hypervisor vendor leaf; the highest hypervisor leaf, and our signature ("SPTHvSPTHv\0\0")
+    { CPUID_HYPERVISOR_BASE, CPUID_ANY_SUBLEAF, CPUID_EAX, MAXUINT32, CPUID_HYPERVISOR_MAX_LEAF },
+    { CPUID_HYPERVISOR_BASE, CPUID_ANY_SUBLEAF, CPUID_EBX, MAXUINT32, 0x48545053 },   // "SPTH"
+    { CPUID_HYPERVISOR_BASE, CPUID_ANY_SUBLEAF, CPUID_ECX, MAXUINT32, 0x54505376 },   // "vSPT"
+    { CPUID_HYPERVISOR_BASE, CPUID_ANY_SUBLEAF, CPUID_EDX, MAXUINT32, 0x00007648 },   // "Hv\0\0"
+};
+
+VOID
+CpuidRead(
+    _In_ UINT32 Leaf,
+    _In_ UINT32 Subleaf,
+    _Out_ PCPUID_ENTRY Result,
+    _In_opt_ PVOID Context
+    )
+{
+    // The default CPUID_READER; this LP's own answer
+
+    int cpuInfo[4];
+
+    UNREFERENCED_PARAMETER( Context );
+
+    __cpuidex( cpuInfo, (int)Leaf, (int)Subleaf );
+
+    Result->Eax = (UINT32)cpuInfo[0];
+    Result->Ebx = (UINT32)cpuInfo[1];
+    Result->Ecx = (UINT32)cpuInfo[2];
+    Result->Edx = (UINT32)cpuInfo[3];
+}
+
+VOID
+CpuidApplyOverrides(
+    _In_reads_(OverrideCount) CONST CPUID_OVERRIDE* Overrides,
+    _In_ CONST ULONG OverrideCount,
+    _In_ CONST UINT32 Leaf,
+    _In_ CONST UINT32 Subleaf,
+    _Inout_ PCPUID_ENTRY Entry
+    )
+{
+    PUINT32 registers = (PUINT32)Entry;
+    ULONG i;
+
+    for ( i = 0; i < OverrideCount; i++ )
+    {
+        if ( Overrides[i].Leaf != Leaf || (Overrides[i].Subleaf != CPUID_ANY_SUBLEAF && Overrides[i].Subleaf != Subleaf) )
+        {
+            continue;
+        }
+
+        registers[Overrides[i].Register] = (registers[Overrides[i].Register] & ~Overrides[i].Mask) | (Overrides[i].Value & Overrides[i].Mask);
+    }
+}
+
+CPUID_LEAF_RULE
+_FindRule(
+    _In_ CONST UINT32 Leaf
+    )
+{
+    CPUID_LEAF_RULE rule = { Leaf, CPUID_SUBLEAVES_FIRST, 0 };
+    ULONG i;
+
+    // Nothing in the hypervisor range comes from the processor; each of our leaves has a single entry
+    if ( Leaf >= CPUID_HYPERVISOR_BASE && Leaf < CPUID_HYPERVISOR_BASE + CPUID_RANGE_LEAVES )
+    {
+        rule.Subleaves = CPUID_SUBLEAVES_NONE;
+        return rule;
+    }
+
+    for ( i = 0; i < ARRAYSIZE( g_CPUIDLeafRules ); i++ )
+    {
+        if ( g_CPUIDLeafRules[i].Leaf == Leaf )
+        {
+            return g_CPUIDLeafRules[i];
+        }
+    }
+
+    return rule;
+}
+
+VOID
+_RecordLeaf(
+    _Inout_ PCPUID_TABLE Table,
+    _In_ CONST CPUID_RANGE Range,
+    _In_ CONST UINT32 Leaf,
+    _In_ CPUID_READER Reader,
+    _In_opt_ PVOID Context
+    )
+{
+    // Record as many of Leaf's subleaves as its rule says it has (and as there's room for)
+
+    PCPUID_SLOT slot = &Table->Slots[Range][Leaf % CPUID_RANGE_LEAVES];
+    CPUID_LEAF_RULE rule = _FindRule( Leaf );
+    PCPUID_ENTRY entry;
+    UINT32 lastSubleaf = CPUID_MAX_SUBLEAVES - 1;
+    UINT32 subleaf;
+
+    slot->First = (UINT16)Table->EntryCount;
+    slot->Count = 0;
+    slot->Flags = rule.Flags | ((rule.Subleaves == CPUID_SUBLEAVES_NONE) ? CPUID_SLOT_ANY_SUBLEAF : 0);
+
+    if ( (rule.Flags & CPUID_SLOT_LIVE) != 0 )
+    {
+        return;
+    }
+
+    for ( subleaf = 0; subleaf <= lastSubleaf && Table->EntryCount < CPUID_TABLE_MAX_ENTRIES; subleaf++ )
+    {
+        entry = &Table->Entries[Table->EntryCount];
+
+        if ( Range == CPUID_RANGE_HYPERVISOR )
+        {
+            RtlSecureZeroMemory( entry, sizeof(CPUID_ENTRY) );
+        }
+        else
+        {
+            Reader( Leaf, subleaf, entry, Context );
+        }
+
+        // The first subleaf past the end is a null one (which isn't recorded; asking for it is answered live)
+        if ( (rule.Subleaves == CPUID_SUBLEAVES_CACHE && (entry->Eax & 0x1F) == 0) ||
+             (rule.Subleaves == CPUID_SUBLEAVES_TOPOLOGY && ((entry->Ecx >> 8) & 0xFF) == 0) )
+        {
+            break;
+        }
+
+        Table->EntryCount++;
+        slot->Count++;
+
+        if ( rule.Subleaves == CPUID_SUBLEAVES_NONE || rule.Subleaves == CPUID_SUBLEAVES_FIRST )
+        {
+            break;
+        }
+
+        if ( rule.Subleaves == CPUID_SUBLEAVES_MAX_IN_EAX && subleaf == 0 )
+        {
+            lastSubleaf = min( entry->Eax, CPUID_MAX_SUBLEAVES - 1 );
+        }
+    }
+}
+
+ULONG
+CpuidTableBuild(
+    _Out_ PCPUID_TABLE Table,
+    _In_opt_ CPUID_READER Reader,
+    _In_opt_ PVOID Context,
+    _In_reads_(OverrideCount) CONST CPUID_OVERRIDE* Overrides,
+    _In_ CONST ULONG OverrideCount
+    )
+{
+    /*
+     * Record every leaf of each range (up to the highest the processor reports, and CPUID_RANGE_LEAVES), and apply
+     *  Overrides to them; returns the number of entries recorded. A leaf (or subleaf) that didn't make it into
+     *  the table is answered live, so a full table is slower, never wrong.
+     *
+     *  (Note: an override for subleaf 0 of a leaf that ignores ECX applies to every subleaf of it)
+     */
+
+    CPUID_ENTRY entry;
+    PCPUID_SLOT slot;
+    UINT32 base;
+    ULONG range;
+    ULONG i, j;
+
+    RtlSecureZeroMemory( Table, sizeof(CPUID_TABLE) );
+
+    if ( Reader == NULL )
+    {
+        Reader = CpuidRead;
+    }
+
+    Reader( 0, 0, &entry, Context );
+    Table->MaxLeaf[CPUID_RANGE_BASIC] = entry.Eax;
+
+    Table->MaxLeaf[CPUID_RANGE_HYPERVISOR] = CPUID_HYPERVISOR_MAX_LEAF;
+
+    // (Note: without any extended leaves, this is whatever the highest basic leaf returns; they're all answered live then)
+    Reader( CPUID_EXTENDED_BASE, 0, &entry, Context );
+    Table->MaxLeaf[CPUID_RANGE_EXTENDED] = (entry.Eax >= CPUID_EXTENDED_BASE) ? entry.Eax : CPUID_EXTENDED_BASE - 1;
+
+    for ( range = 0; range < CPUID_RANGE_COUNT; range++ )
+    {
+        base = (UINT32)range << 30;
+
+        for ( i = 0; i < CPUID_RANGE_LEAVES && base + i <= Table->MaxLeaf[range]; i++ )
+        {
+            _RecordLeaf( Table, (CPUID_RANGE)range, base + i, Reader, Context );
+        }
+    }
+
+    for ( range = 0; range < CPUID_RANGE_COUNT; range++ )
+    {
+        for ( i = 0; i < CPUID_RANGE_LEAVES; i++ )
+        {
+            slot = &Table->Slots[range][i];
+
+            for ( j = 0; j < slot->Count; j++ )
+            {
+                CpuidApplyOverrides( Overrides, OverrideCount, ((UINT32)range << 30) + i, j, &Table->Entries[slot->First + j] );
+            }
+        }
+    }
+
+    return Table->EntryCount;
+}
+
+BOOLEAN
+CpuidTableLookup(
+    _In_ CONST CPUID_TABLE* Table,
+    _In_ CONST UINT32 Leaf,
+    _In_ CONST UINT32 Subleaf,
+    _In_ CONST UINT64 GuestCR4,
+    _Out_ PCPUID_ENTRY Result
+    )
+{
+    /*
+     * Answer CPUID(Leaf, Subleaf) from the table; FALSE if it has to be answered live (by executing CPUID, and
+     *  applying the overrides to what it returns).
+     *
+     *  (Note: this is what VMExitStub does in assembly for every slot with no flags but CPUID_SLOT_ANY_SUBLEAF)
+     */
+
+    CONST CPUID_SLOT* slot;
+    UINT32 range = Leaf >> 30;
+    UINT32 index = Leaf & 0x3FFFFFFF;
+    UINT32 subleaf = Subleaf;
+    CR4 cr4;
+
+    if ( range >= CPUID_RANGE_COUNT || index >= CPUID_RANGE_LEAVES )
+    {
+        return FALSE;
+    }
+
+    slot = &Table->Slots[range][index];
+
+    if ( (slot->Flags & CPUID_SLOT_LIVE) != 0 )
+    {
+        return FALSE;
+    }
+
+    if ( (slot->Flags & CPUID_SLOT_ANY_SUBLEAF) != 0 )
+    {
+        subleaf = 0;
+    }
+
+    if ( subleaf >= slot->Count )
+    {
+        // A hypervisor leaf we don't have is empty, rather than whatever the processor would make of it
+        if ( range == CPUID_RANGE_HYPERVISOR )
+        {
+            RtlSecureZeroMemory( Result, sizeof(CPUID_ENTRY) );
+            return TRUE;
+        }
+
+        return FALSE;
+    }
+
+    *Result = Table->Entries[slot->First + subleaf];
+
+    // The OS-enabled bits follow the guest's CR4, which it may change without exiting
+    if ( (slot->Flags & CPUID_SLOT_CR4) != 0 )
+    {
+        cr4.All = GuestCR4;
+
+        if ( Leaf == 0x01 )
+        {
+            Result->Ecx = (Result->Ecx & ~CPUID_01_ECX_OSXSAVE) | ((cr4.OSXSAVE == 1) ? CPUID_01_ECX_OSXSAVE : 0);
+        }
+        else if ( Leaf == 0x07 && subleaf == 0 )
+        {
+            Result->Ecx = (Result->Ecx & ~CPUID_07_ECX_OSPKE) | ((cr4.PKE == 1) ? CPUID_07_ECX_OSPKE : 0);
+        }
+    }
+
+    return TRUE;
+}
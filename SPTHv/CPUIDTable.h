@@ -0,0 +1,184 @@
+#ifndef __CPUIDTABLE_H__
+#define __CPUIDTABLE_H__
+
+#include <ntddk.h>
+#include <intrin.h>
+
+#include "CPU.h"
+
+/*
+ * [27.1.2] "Instructions That Cause VM Exits Unconditionally"
+ *
+ *  Every CPUID the guest executes exits, and nearly every one of them asks for a leaf whose answer never
+ *  changes; so each LP records every leaf (and subleaf) once, before it's launched, and answers from that.
+ *  The leaves are in three ranges of CPUID_RANGE_LEAVES: basic (00000000H), hypervisor (40000000H), and
+ *  extended (80000000H). Each leaf has a slot, which says where its subleaves' entries are in the table.
+ */
+#define CPUID_RANGE_LEAVES					64
+
+typedef enum _CPUID_RANGE
+{
+	CPUID_RANGE_BASIC,
+	CPUID_RANGE_HYPERVISOR,
+	CPUID_RANGE_EXTENDED,
+	CPUID_RANGE_COUNT
+} CPUID_RANGE;
+
+#define CPUID_HYPERVISOR_BASE				0x40000000
+#define CPUID_EXTENDED_BASE					0x80000000
+
+// The leaves we answer in the hypervisor range; 40000001H is there, but empty (it isn't "Hv#1", so nobody takes us for Hyper-V)
+#define CPUID_HYPERVISOR_MAX_LEAF			0x40000001
+
+// The entries each LP's table has room for, and the most subleaves recorded for any one leaf
+#define CPUID_TABLE_MAX_ENTRIES				256
+#define CPUID_MAX_SUBLEAVES					32
+
+// How many of a leaf's subleaves there are to record (see g_CPUIDLeafRules in "CPUIDTable.c")
+typedef enum _CPUID_SUBLEAVES
+{
+	CPUID_SUBLEAVES_FIRST,			// Only subleaf 0; any other is answered live (every leaf we know nothing about)
+	CPUID_SUBLEAVES_NONE,			// ECX is ignored
+	CPUID_SUBLEAVES_MAX_IN_EAX,		// Subleaf 0's EAX is the highest subleaf
+	CPUID_SUBLEAVES_CACHE,			// Up to the first with a cache type (EAX[4:0]) of 0 (leaf 04H)
+	CPUID_SUBLEAVES_TOPOLOGY		// Up to the first with a level type (ECX[15:8]) of 0 (leaves 0BH and 1FH)
+} CPUID_SUBLEAVES;
+
+// The guest-CR4-dependent bits of the CPUID_SLOT_CR4 leaves ([CPUID] "Feature Information", "Structured Extended Feature Flags")
+#define CPUID_01_ECX_OSXSAVE				(1UL << 27)
+#define CPUID_07_ECX_OSPKE					(1UL << 4)
+
+// CPUID_SLOT flags
+#define CPUID_SLOT_ANY_SUBLEAF				0x1		// ECX is ignored; every subleaf is answered with the first entry
+#define CPUID_SLOT_LIVE						0x2		// Never answered from the table; its values change (with XCR0, for leaf 0DH)
+#define CPUID_SLOT_CR4						0x4		// Reflects the guest's CR4 (OSXSAVE, OSPKE); answered from the table, patched (see CpuidTableLookup)
+
+typedef struct _CPUID_SLOT
+{
+	UINT16 First;
+	UINT8 Count;		// 0 if the leaf isn't in the table (any subleaf past Count isn't either)
+	UINT8 Flags;
+} CPUID_SLOT, *PCPUID_SLOT;
+
+// What we know about a leaf's subleaves, and how it's answered
+typedef struct _CPUID_LEAF_RULE
+{
+	UINT32 Leaf;
+	CPUID_SUBLEAVES Subleaves;
+	UINT8 Flags;
+} CPUID_LEAF_RULE, *PCPUID_LEAF_RULE;
+
+typedef struct _CPUID_ENTRY
+{
+	UINT32 Eax;
+	UINT32 Ebx;
+	UINT32 Ecx;
+	UINT32 Edx;
+} CPUID_ENTRY, *PCPUID_ENTRY;
+
+// The registers a CPUID_OVERRIDE applies to, in CPUID_ENTRY order
+typedef enum _CPUID_REGISTER
+{
+	CPUID_EAX,
+	CPUID_EBX,
+	CPUID_ECX,
+	CPUID_EDX
+} CPUID_REGISTER;
+
+#define CPUID_ANY_SUBLEAF					MAXUINT32
+
+// Replaces the Mask bits of one register of a leaf (every subleaf of it, for CPUID_ANY_SUBLEAF) with those of Value
+typedef struct _CPUID_OVERRIDE
+{
+	UINT32 Leaf;
+	UINT32 Subleaf;
+	CPUID_REGISTER Register;
+	UINT32 Mask;
+	UINT32 Value;
+} CPUID_OVERRIDE, *PCPUID_OVERRIDE;
+
+// The overrides every LP's guest sees (see g_CPUIDOverrides in "CPUIDTable.c")
+#define CPUID_OVERRIDE_COUNT				5
+
+/*
+ * One LP's recorded CPUID leaves (see CpuidTableBuild).
+ *
+ *  (Note: VMExitStub answers from this directly, so the offsets below are fixed; see "vmexit.asm")
+ */
+typedef struct _CPUID_TABLE
+{
+	CPUID_SLOT Slots[CPUID_RANGE_COUNT][CPUID_RANGE_LEAVES];
+	CPUID_ENTRY Entries[CPUID_TABLE_MAX_ENTRIES];
+
+	// The CPUID exits VMExitStub answered without going through VMExitDispatch (so they aren't in the exit stats)
+	UINT64 FastHits;
+
+	UINT32 MaxLeaf[CPUID_RANGE_COUNT];
+	ULONG EntryCount;
+} CPUID_TABLE, *PCPUID_TABLE;
+
+C_ASSERT( FIELD_OFFSET( CPUID_TABLE, Slots ) == 0x0 );
+C_ASSERT( FIELD_OFFSET( CPUID_TABLE, Entries ) == 0x300 );
+C_ASSERT( FIELD_OFFSET( CPUID_TABLE, FastHits ) == 0x1300 );
+C_ASSERT( sizeof(CPUID_SLOT) == 4 && sizeof(CPUID_ENTRY) == 16 );
+C_ASSERT( FIELD_OFFSET( CPUID_SLOT, Count ) == 2 && FIELD_OFFSET( CPUID_SLOT, Flags ) == 3 );
+C_ASSERT( CPUID_RANGE_COUNT == 3 && CPUID_RANGE_LEAVES == 64 );
+
+// Where CpuidTableBuild gets its leaves from; __cpuidex unless told otherwise (such as from a recorded dump)
+typedef VOID (*CPUID_READER)(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PCPUID_ENTRY Result,
+	_In_opt_ PVOID Context
+	);
+
+
+
+//
+// Globals
+//
+
+extern CONST CPUID_OVERRIDE g_CPUIDOverrides[CPUID_OVERRIDE_COUNT];
+
+
+
+//
+// Local functions
+//
+
+VOID
+CpuidRead(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PCPUID_ENTRY Result,
+	_In_opt_ PVOID Context
+	);
+
+VOID
+CpuidApplyOverrides(
+	_In_reads_(OverrideCount) CONST CPUID_OVERRIDE* Overrides,
+	_In_ CONST ULONG OverrideCount,
+	_In_ CONST UINT32 Leaf,
+	_In_ CONST UINT32 Subleaf,
+	_Inout_ PCPUID_ENTRY Entry
+	);
+
+ULONG
+CpuidTableBuild(
+	_Out_ PCPUID_TABLE Table,
+	_In_opt_ CPUID_READER Reader,
+	_In_opt_ PVOID Context,
+	_In_reads_(OverrideCount) CONST CPUID_OVERRIDE* Overrides,
+	_In_ CONST ULONG OverrideCount
+	);
+
+BOOLEAN
+CpuidTableLookup(
+	_In_ CONST CPUID_TABLE* Table,
+	_In_ CONST UINT32 Leaf,
+	_In_ CONST UINT32 Subleaf,
+	_In_ CONST UINT64 GuestCR4,
+	_Out_ PCPUID_ENTRY Result
+	);
+
+#endif // __CPUIDTABLE_H__
@@ -0,0 +1,487 @@
+#include "Driver.h"
+
+#include <wdmsec.h>
+
+/*
+ * Notes for testing:
+ *
+ * The device is \Device\SPTHv (\\.\SPTHv from user mode), and only SYSTEM and administrators may open it;
+ *  see "SPTHvIoctl.h" for the requests it takes, and the SPTHvCtl tool for a client.
+ */
+
+_Dispatch_type_(IRP_MJ_CREATE)
+_Dispatch_type_(IRP_MJ_CLOSE)
+DRIVER_DISPATCH _DeviceCreateClose;
+
+_Dispatch_type_(IRP_MJ_CLEANUP)
+DRIVER_DISPATCH _DeviceCleanup;
+
+_Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
+DRIVER_DISPATCH _DeviceControl;
+
+NTSTATUS
+_DeviceCreateClose(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp
+    )
+{
+    UNREFERENCED_PARAMETER( DeviceObject );
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+
+    IoCompleteRequest( Irp, IO_NO_INCREMENT );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+_DeviceCleanup(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp
+    )
+{
+    // The last handle to a file object is gone; if it was the one reading the trace rings, they're unmapped now
+
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation( Irp );
+
+    UNREFERENCED_PARAMETER( DeviceObject );
+
+    TraceUnmap( stack->FileObject );
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+
+    IoCompleteRequest( Irp, IO_NO_INCREMENT );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+_DeviceRunExitBenchmark(
+    _In_reads_bytes_(InputLength) PVOID Buffer,
+    _In_ CONST ULONG InputLength,
+    _In_ CONST ULONG OutputLength,
+    _Out_ PULONG_PTR Information
+    )
+{
+    // The input (if any) and output share the system buffer (METHOD_BUFFERED)
+
+    ULONG iterations = SPTHV_BENCH_DEFAULT_ITERATIONS;
+    NTSTATUS status;
+
+    *Information = 0;
+
+    if ( OutputLength < sizeof(SPTHV_EXIT_BENCHMARK) )
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if ( InputLength >= sizeof(SPTHV_EXIT_BENCHMARK_REQUEST) )
+    {
+        iterations = ((PSPTHV_EXIT_BENCHMARK_REQUEST)Buffer)->Iterations;
+    }
+
+    status = BenchRunExitSuite( iterations, (PSPTHV_EXIT_BENCHMARK)Buffer );
+
+    if ( NT_SUCCESS( status ) )
+    {
+        *Information = sizeof(SPTHV_EXIT_BENCHMARK);
+    }
+
+    return status;
+}
+
+NTSTATUS
+_DeviceQueryExitStats(
+    _Out_writes_bytes_(OutputLength) PVOID Buffer,
+    _In_ CONST ULONG OutputLength,
+    _Out_ PULONG_PTR Information
+    )
+{
+    // Merge every LP's exit counters into one snapshot; the LPs keep counting while we do
+
+    PSPTHV_EXIT_STATS snapshot = (PSPTHV_EXIT_STATS)Buffer;
+    ULONG i;
+
+    *Information = 0;
+
+    if ( OutputLength < sizeof(SPTHV_EXIT_STATS) )
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlSecureZeroMemory( snapshot, sizeof(SPTHV_EXIT_STATS) );
+
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        if ( g_LPInfo[i].ExitStats != NULL )
+        {
+            StatsMergeExits( snapshot, g_LPInfo[i].ExitStats );
+        }
+    }
+
+    *Information = sizeof(SPTHV_EXIT_STATS);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+_DeviceHarvestDirty(
+    _Inout_updates_bytes_(max( InputLength, OutputLength )) PVOID Buffer,
+    _In_ CONST ULONG InputLength,
+    _In_ CONST ULONG OutputLength,
+    _Out_ PULONG_PTR Information
+    )
+{
+    // The query and the bitmap share the system buffer; the query is read in full before the bitmap is written
+
+    PSPTHV_DIRTY_BITMAP bitmap = (PSPTHV_DIRTY_BITMAP)Buffer;
+    SPTHV_DIRTY_QUERY query;
+    NTSTATUS status;
+
+    *Information = 0;
+
+    if ( InputLength < sizeof(SPTHV_DIRTY_QUERY) || OutputLength < FIELD_OFFSET( SPTHV_DIRTY_BITMAP, Bits ) )
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    query = *(PSPTHV_DIRTY_QUERY)Buffer;
+
+    // (Note: checked against what fits, rather than by sizing the request, which could overflow)
+    if ( query.PageCount / SPTHV_DIRTY_PAGES_PER_WORD > (OutputLength - FIELD_OFFSET( SPTHV_DIRTY_BITMAP, Bits )) / sizeof(ULONG64) )
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    status = PmlHarvest( query.FirstPage, query.PageCount, bitmap->Bits, &bitmap->DirtyPages );
+    if ( !NT_SUCCESS( status ) )
+    {
+        return status;
+    }
+
+    bitmap->FirstPage = query.FirstPage;
+    bitmap->PageCount = query.PageCount;
+    bitmap->TrackedPages = g_DirtyBitmap.PageCount;
+
+    *Information = SPTHV_DIRTY_BITMAP_SIZE( query.PageCount );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+_DeviceProtectViewPage(
+    _In_reads_bytes_(InputLength) PVOID Buffer,
+    _In_ CONST ULONG InputLength
+    )
+{
+    PSPTHV_VIEW_PAGE_REQUEST request = (PSPTHV_VIEW_PAGE_REQUEST)Buffer;
+
+    if ( InputLength < sizeof(SPTHV_VIEW_PAGE_REQUEST) )
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if ( (request->Access & ~(SPTHV_VIEW_READ | SPTHV_VIEW_WRITE | SPTHV_VIEW_EXECUTE)) != 0 )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // (Note: VmfuncProtectPage refuses the combinations the processor would take for a misconfiguration)
+    return VmfuncProtectPage(
+        request->View,
+        request->GuestPA,
+        (request->Access & SPTHV_VIEW_READ) != 0,
+        (request->Access & SPTHV_VIEW_WRITE) != 0,
+        (request->Access & SPTHV_VIEW_EXECUTE) != 0
+        );
+}
+
+NTSTATUS
+_DeviceControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp
+    )
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation( Irp );
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( DeviceObject );
+
+    Irp->IoStatus.Information = 0;
+
+    switch ( stack->Parameters.DeviceIoControl.IoControlCode )
+    {
+        case IOCTL_SPTHV_RUN_EXIT_BENCHMARK:
+
+            status = _DeviceRunExitBenchmark(
+                Irp->AssociatedIrp.SystemBuffer,
+                stack->Parameters.DeviceIoControl.InputBufferLength,
+                stack->Parameters.DeviceIoControl.OutputBufferLength,
+                &Irp->IoStatus.Information
+                );
+
+            break;
+        case IOCTL_SPTHV_QUERY_EXIT_STATS:
+
+            status = _DeviceQueryExitStats(
+                Irp->AssociatedIrp.SystemBuffer,
+                stack->Parameters.DeviceIoControl.OutputBufferLength,
+                &Irp->IoStatus.Information
+                );
+
+            break;
+        case IOCTL_SPTHV_START_PROFILE:
+
+            status = ProfileStart(
+                (stack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(SPTHV_PROFILE_REQUEST)) ?
+                    ((PSPTHV_PROFILE_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Frequency :
+                    SPTHV_PROFILE_DEFAULT_FREQUENCY
+                );
+
+            break;
+        case IOCTL_SPTHV_STOP_PROFILE:
+
+            status = ProfileStop();
+            break;
+        case IOCTL_SPTHV_QUERY_PROFILE:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_PROFILE_QUERY) ||
+                 stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SPTHV_PROFILE_TABLE) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            // (Note: the query and the table share the system buffer; the processor is read before the table is written)
+            status = ProfileQuery(
+                ((PSPTHV_PROFILE_QUERY)Irp->AssociatedIrp.SystemBuffer)->Processor,
+                (PSPTHV_PROFILE_TABLE)Irp->AssociatedIrp.SystemBuffer
+                );
+
+            if ( NT_SUCCESS( status ) )
+            {
+                Irp->IoStatus.Information = sizeof(SPTHV_PROFILE_TABLE);
+            }
+
+            break;
+        case IOCTL_SPTHV_START_DIRTY_TRACKING:
+
+            status = PmlStart();
+            break;
+        case IOCTL_SPTHV_STOP_DIRTY_TRACKING:
+
+            status = PmlStop();
+            break;
+        case IOCTL_SPTHV_HARVEST_DIRTY:
+
+            status = _DeviceHarvestDirty(
+                Irp->AssociatedIrp.SystemBuffer,
+                stack->Parameters.DeviceIoControl.InputBufferLength,
+                stack->Parameters.DeviceIoControl.OutputBufferLength,
+                &Irp->IoStatus.Information
+                );
+
+            break;
+        case IOCTL_SPTHV_SET_TSC:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_TSC_REQUEST) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = TscSetPolicy(
+                ((PSPTHV_TSC_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Frequency,
+                ((PSPTHV_TSC_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Advance
+                );
+
+            break;
+        case IOCTL_SPTHV_QUERY_TSC:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_TSC_QUERY) ||
+                 stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SPTHV_TSC_STATE) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            // (Note: the query and the state share the system buffer; the processor is read before the state is written)
+            status = TscQuery(
+                ((PSPTHV_TSC_QUERY)Irp->AssociatedIrp.SystemBuffer)->Processor,
+                (PSPTHV_TSC_STATE)Irp->AssociatedIrp.SystemBuffer
+                );
+
+            if ( NT_SUCCESS( status ) )
+            {
+                Irp->IoStatus.Information = sizeof(SPTHV_TSC_STATE);
+            }
+
+            break;
+        case IOCTL_SPTHV_MAP_TRACE:
+
+            if ( stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SPTHV_TRACE_MAPPING) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            // (Note: we're in the context of the calling process, which is the one the rings get mapped into)
+            status = TraceMap( stack->FileObject, (PSPTHV_TRACE_MAPPING)Irp->AssociatedIrp.SystemBuffer );
+            if ( NT_SUCCESS( status ) )
+            {
+                Irp->IoStatus.Information = sizeof(SPTHV_TRACE_MAPPING);
+            }
+
+            break;
+        case IOCTL_SPTHV_UNMAP_TRACE:
+
+            status = TraceUnmap( stack->FileObject );
+            break;
+        case IOCTL_SPTHV_SET_MSR_INTERCEPT:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_MSR_INTERCEPT_REQUEST) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = InterceptSetMSRRange( (PSPTHV_MSR_INTERCEPT_REQUEST)Irp->AssociatedIrp.SystemBuffer );
+            break;
+        case IOCTL_SPTHV_SET_IO_INTERCEPT:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_IO_INTERCEPT_REQUEST) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = InterceptSetPortRange( (PSPTHV_IO_INTERCEPT_REQUEST)Irp->AssociatedIrp.SystemBuffer );
+            break;
+        case IOCTL_SPTHV_PROTECT_VIEW_PAGE:
+
+            status = _DeviceProtectViewPage(
+                Irp->AssociatedIrp.SystemBuffer,
+                stack->Parameters.DeviceIoControl.InputBufferLength
+                );
+
+            break;
+        case IOCTL_SPTHV_ENABLE_VIEW:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_VIEW_REQUEST) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = VmfuncEnableView(
+                ((PSPTHV_VIEW_REQUEST)Irp->AssociatedIrp.SystemBuffer)->View,
+                ((PSPTHV_VIEW_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Enable
+                );
+
+            break;
+        case IOCTL_SPTHV_START_VE:
+
+            status = VeStart();
+            break;
+        case IOCTL_SPTHV_STOP_VE:
+
+            status = VeStop();
+            break;
+        case IOCTL_SPTHV_SET_CONVERTIBLE:
+
+            if ( stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SPTHV_VE_CONVERTIBLE_REQUEST) )
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = VeSetConvertible(
+                ((PSPTHV_VE_CONVERTIBLE_REQUEST)Irp->AssociatedIrp.SystemBuffer)->View,
+                ((PSPTHV_VE_CONVERTIBLE_REQUEST)Irp->AssociatedIrp.SystemBuffer)->GuestPA,
+                ((PSPTHV_VE_CONVERTIBLE_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Convertible
+                );
+
+            break;
+        case IOCTL_SPTHV_START_INTERRUPTS:
+
+            status = IntrStart();
+            break;
+        case IOCTL_SPTHV_STOP_INTERRUPTS:
+
+            status = IntrStop();
+            break;
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    Irp->IoStatus.Status = status;
+
+    IoCompleteRequest( Irp, IO_NO_INCREMENT );
+
+    return status;
+}
+
+NTSTATUS
+DeviceCreate(
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    UNICODE_STRING deviceName = RTL_CONSTANT_STRING( SPTHV_DEVICE_NAME );
+    UNICODE_STRING linkName = RTL_CONSTANT_STRING( SPTHV_SYMBOLIC_LINK_NAME );
+
+    PDEVICE_OBJECT deviceObject;
+    NTSTATUS status;
+
+    // The requests we take change how every LP runs; so nobody but SYSTEM and administrators gets to make them
+    status = IoCreateDeviceSecure(
+        DriverObject,
+        0,
+        &deviceName,
+        FILE_DEVICE_UNKNOWN,
+        FILE_DEVICE_SECURE_OPEN,
+        FALSE,
+        &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+        NULL,
+        &deviceObject
+        );
+
+    if ( !NT_SUCCESS( status ) )
+    {
+        return status;
+    }
+
+    status = IoCreateSymbolicLink( &linkName, &deviceName );
+    if ( !NT_SUCCESS( status ) )
+    {
+        IoDeleteDevice( deviceObject );
+        return status;
+    }
+
+    DriverObject->MajorFunction[IRP_MJ_CREATE] = _DeviceCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLOSE] = _DeviceCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = _DeviceCleanup;
+    DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = _DeviceControl;
+
+    deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DeviceDelete(
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    UNICODE_STRING linkName = RTL_CONSTANT_STRING( SPTHV_SYMBOLIC_LINK_NAME );
+
+    if ( DriverObject->DeviceObject == NULL )
+    {
+        return;
+    }
+
+    IoDeleteSymbolicLink( &linkName );
+    IoDeleteDevice( DriverObject->DeviceObject );
+}
@@ -0,0 +1,24 @@
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+
+
+//
+// Local functions
+//
+
+NTSTATUS
+DeviceCreate(
+	_In_ PDRIVER_OBJECT DriverObject
+	);
+
+VOID
+DeviceDelete(
+	_In_ PDRIVER_OBJECT DriverObject
+	);
+
+#endif // __DEVICE_H__
@@ -0,0 +1,180 @@
+#include "Dirty.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here allocates, or touches the VMCS; a DIRTY_BITMAP over an ordinary zeroed buffer, EPT_VIEWs
+ *  built over others (see "EPT.c"), and a made-up 4KB log are all these need.
+ *
+ * The guest may write a page through any of the EPT views it switches between (see "VMFunc.c"), and each view has
+ *  dirty flags of its own; so logs are drained, and flags cleared, against every view at once.
+ *
+ * Any number of LPs may drain their logs into the same bitmap while it's being harvested; bits are only ever
+ *  set with a locked OR, and taken (and cleared) with a locked exchange, so a page dirtied while harvesting is
+ *  either in this harvest or the next one, never neither.
+ */
+
+VOID
+DirtyReset(
+    _Inout_ PDIRTY_BITMAP Bitmap
+    )
+{
+    // Only while nothing drains into it
+
+    RtlSecureZeroMemory( (PVOID)Bitmap->Bits, DIRTY_BITMAP_BYTES( Bitmap->PageCount ) );
+}
+
+VOID
+DirtyMarkRange(
+    _Inout_ PDIRTY_BITMAP Bitmap,
+    _In_ UINT64 FirstPage,
+    _In_ UINT64 PageCount
+    )
+{
+    // Set the bits of [FirstPage, FirstPage + PageCount), leaving off whatever lies past the end of the bitmap
+
+    UINT64 bits;
+    UINT64 count;
+
+    if ( FirstPage >= Bitmap->PageCount )
+    {
+        return;
+    }
+
+    PageCount = min( PageCount, Bitmap->PageCount - FirstPage );
+
+    while ( PageCount != 0 )
+    {
+        // Whatever of the range falls in this word (all 64 of its bits, for all but the ends of a large page)
+        count = min( PageCount, DIRTY_PAGES_PER_WORD - (FirstPage % DIRTY_PAGES_PER_WORD) );
+        bits = (count == DIRTY_PAGES_PER_WORD) ? MAXUINT64 : (((1ULL << count) - 1) << (FirstPage % DIRTY_PAGES_PER_WORD));
+
+        // (Note: most writes are to pages already marked; a plain read keeps those from taking the line exclusive)
+        if ( ((UINT64)Bitmap->Bits[FirstPage / DIRTY_PAGES_PER_WORD] & bits) != bits )
+        {
+            InterlockedOr64( &Bitmap->Bits[FirstPage / DIRTY_PAGES_PER_WORD], (LONG64)bits );
+        }
+
+        FirstPage += count;
+        PageCount -= count;
+    }
+}
+
+ULONG
+DirtyDrainLog(
+    _Inout_ PDIRTY_BITMAP Bitmap,
+    _In_reads_(ViewCount) CONST PEPT_VIEW* Views,
+    _In_ CONST ULONG ViewCount,
+    _In_reads_(PML_LOG_ENTRIES) CONST UINT64* Log,
+    _In_ CONST UINT16 Index
+    )
+{
+    /*
+     * Mark every page in a PML log, given the PML index it was left at; returns the number of entries drained.
+     *
+     *  (Note: only the first write to a page sets its dirty flag, and so only that one is logged; for a 2MB or 1GB
+     *  page, that means writes to the rest of it aren't logged at all, so the whole page is marked. The log doesn't
+     *  say which view the write went through, so it's the largest page any of them maps it with)
+     */
+
+    UINT64 pageSize;
+    UINT64 largest;
+    ULONG first;
+    ULONG i, v;
+
+    // The entries after Index are the ones that have been written; all of them, once the index has wrapped
+    first = (Index >= PML_LOG_ENTRIES) ? 0 : (ULONG)Index + 1;
+
+    for ( i = first; i < PML_LOG_ENTRIES; i++ )
+    {
+        largest = 0;
+
+        for ( v = 0; v < ViewCount; v++ )
+        {
+            if ( EptGetLeafEntry( Views[v], Log[i], &pageSize ) != NULL )
+            {
+                largest = max( largest, pageSize );
+            }
+        }
+
+        if ( largest == 0 )
+        {
+            continue;
+        }
+
+        DirtyMarkRange( Bitmap, ALIGN_DOWN_BY( Log[i], largest ) / EPT_PAGE_SIZE, largest / EPT_PAGE_SIZE );
+    }
+
+    return PML_LOG_ENTRIES - first;
+}
+
+UINT64
+DirtyHarvest(
+    _Inout_ PDIRTY_BITMAP Bitmap,
+    _In_reads_(ViewCount) CONST PEPT_VIEW* Views,
+    _In_ CONST ULONG ViewCount,
+    _In_ CONST UINT64 FirstPage,
+    _In_ CONST UINT64 PageCount,
+    _Out_writes_(PageCount / DIRTY_PAGES_PER_WORD) PULONG64 Bits
+    )
+{
+    /*
+     * Take (and clear) the bits of [FirstPage, FirstPage + PageCount), both multiples of DIRTY_PAGES_PER_WORD, and
+     *  clear the EPT dirty flag of every page taken, in every view, so that the next write to it is logged again.
+     *  Pages past the end of the bitmap are never dirty. Returns the number of dirty pages.
+     *
+     *  (Note: the processor may still have the dirty flags we clear cached; the caller invalidates the views once
+     *  this returns, and any write that was let through by a stale flag in the meantime was to a page that's in
+     *  this harvest anyway)
+     */
+
+    UINT64 word;
+    UINT64 page;
+    UINT64 pageSize;
+    UINT64 smallest;
+    UINT64 leafEnd = 0;
+    UINT64 dirty = 0;
+    UINT64 i;
+    ULONG bit, v;
+
+    for ( i = 0; i < PageCount / DIRTY_PAGES_PER_WORD; i++ )
+    {
+        page = FirstPage + i * DIRTY_PAGES_PER_WORD;
+
+        if ( page >= Bitmap->PageCount )
+        {
+            Bits[i] = 0;
+            continue;
+        }
+
+        word = (UINT64)InterlockedExchange64( &Bitmap->Bits[page / DIRTY_PAGES_PER_WORD], 0 );
+        Bits[i] = word;
+
+        for ( ; word != 0; word &= word - 1 )
+        {
+            _BitScanForward64( &bit, word );
+
+            page = FirstPage + i * DIRTY_PAGES_PER_WORD + bit;
+            dirty++;
+
+            // Every page of a large page is marked with it; its one flag only needs clearing once (in each view, the
+            //  next page that needs clearing is past the smallest page any of them maps this one with)
+            if ( page < leafEnd )
+            {
+                continue;
+            }
+
+            smallest = EPT_HUGE_PAGE_SIZE;
+
+            for ( v = 0; v < ViewCount; v++ )
+            {
+                EptClearDirty( Views[v], page * EPT_PAGE_SIZE, &pageSize );
+                smallest = min( smallest, (pageSize != 0) ? pageSize : EPT_PAGE_SIZE );
+            }
+
+            leafEnd = (ALIGN_DOWN_BY( page * EPT_PAGE_SIZE, smallest ) + smallest) / EPT_PAGE_SIZE;
+        }
+    }
+
+    return dirty;
+}
@@ -0,0 +1,69 @@
+#ifndef __DIRTY_H__
+#define __DIRTY_H__
+
+#include <ntddk.h>
+
+#include "EPT.h"
+
+/*
+ * [28.2.5] "Page-Modification Logging"
+ *
+ *  With PML enabled, every write that sets the dirty flag of an EPT leaf entry appends the guest-physical
+ *  address written to (with bits 11:0 clear) to a 4KB log of 512 entries; the log is filled from the last
+ *  entry down, and the PML index is the next one to be written. Once the index has gone past 0 (wrapping
+ *  to 0xFFFF), the next write that needs logging causes a "page-modification log full" VM-exit instead.
+ */
+#define PML_LOG_ENTRIES						512
+#define PML_INDEX_START						(PML_LOG_ENTRIES - 1)
+
+// The dirty bitmap has a bit per 4KB page, in words of this many
+#define DIRTY_PAGES_PER_WORD				64
+
+// The bytes a bitmap of this many pages takes up
+#define DIRTY_BITMAP_BYTES(pages)			(ALIGN_UP_BY( (pages), DIRTY_PAGES_PER_WORD ) / 8)
+
+// A bit per 4KB page of guest-physical memory below PageCount pages; set once the page has been written to
+typedef struct _DIRTY_BITMAP
+{
+	volatile LONG64* Bits;
+	UINT64 PageCount;		// A multiple of DIRTY_PAGES_PER_WORD
+} DIRTY_BITMAP, *PDIRTY_BITMAP;
+
+
+
+//
+// Local functions
+//
+
+VOID
+DirtyReset(
+	_Inout_ PDIRTY_BITMAP Bitmap
+	);
+
+VOID
+DirtyMarkRange(
+	_Inout_ PDIRTY_BITMAP Bitmap,
+	_In_ UINT64 FirstPage,
+	_In_ UINT64 PageCount
+	);
+
+ULONG
+DirtyDrainLog(
+	_Inout_ PDIRTY_BITMAP Bitmap,
+	_In_reads_(ViewCount) CONST PEPT_VIEW* Views,
+	_In_ CONST ULONG ViewCount,
+	_In_reads_(PML_LOG_ENTRIES) CONST UINT64* Log,
+	_In_ CONST UINT16 Index
+	);
+
+UINT64
+DirtyHarvest(
+	_Inout_ PDIRTY_BITMAP Bitmap,
+	_In_reads_(ViewCount) CONST PEPT_VIEW* Views,
+	_In_ CONST ULONG ViewCount,
+	_In_ CONST UINT64 FirstPage,
+	_In_ CONST UINT64 PageCount,
+	_Out_writes_(PageCount / DIRTY_PAGES_PER_WORD) PULONG64 Bits
+	);
+
+#endif // __DIRTY_H__
@@ -1,40 +1,27 @@
 #include "Driver.h"
 
-VOID
-VMExitHandler()
-{
-    VM_EXIT_REASON exitReason;
+//
+// Globals
+//
 
-    exitReason.All = 0;
+PLP_INFO g_LPInfo;
 
-    __vmx_vmread( VMCS_RO_EXIT_REASON, (size_t*)&exitReason.All );
+ULONG g_LPCount;
 
-    if ( exitReason.EntryFailure == TRUE )
-    {
-        __debugbreak();
-        goto __jmp_driverentry_ep;
-    }
+UINT64 g_SystemCR3;
 
-    switch ( exitReason.BasicReason )
-    {
-        case REASON_HLT:
+VMX_CONTROLS g_VMXControls;
 
-            // If we've broken here, this indicates a successful run-through
-            //  the underlying guest software
-            __debugbreak();
+EPT_VIEW g_EPTView;
 
-            break;
-        default:
-            __debugbreak();
-            break;
-    }
+VMX_ADDRESS g_MSRBitmap;
+
+VMX_ADDRESS g_IOBitmap;
+
+// Where each LP's arena comes from (see _AllocateLP)
+CONST ARENA_PROVIDER g_LPArenaProvider = { utlAllocateNodeBlock, utlFreeNodeBlock };
 
-    __vmx_off();
 
-__jmp_driverentry_ep:
-    // Jump to our DriverEntry's function epilogue
-    RtlRestoreContext( &g_preLaunchCtx, NULL );
-}
 
 VOID
 _FixControlRegisters()
@@ -43,131 +30,48 @@ _FixControlRegisters()
 
     // Set the reserved bits of CR0
     __writecr0(
-        FIX_BITS( g_CR0.All, __readmsr(IA32_VMX_CR0_FIXED1), __readmsr(IA32_VMX_CR0_FIXED0) )
+        FIX_BITS( __readcr0(), g_VMXCapabilities.CR0Fixed1, g_VMXCapabilities.CR0Fixed0 )
         );
 
     // Set the reserved bits of CR4 (which implicitly enables VMX operations via setting the CR4.VMXE bit)
     __writecr4(
-        FIX_BITS( g_CR4.All, __readmsr(IA32_VMX_CR4_FIXED1), __readmsr(IA32_VMX_CR4_FIXED0) )
+        FIX_BITS( __readcr4(), g_VMXCapabilities.CR4Fixed1, g_VMXCapabilities.CR4Fixed0 )
         );
 }
 
-VOID
-_SetVMCSGuestState(
-    _In_ UINT64 GuestStack,
-    _In_ UINT64 GuestEntryPoint
+BOOLEAN
+_FixControls(
+    _In_ CONST VMX_CONTROL_FIELD Field,
+    _In_ CONST UINT32 Requested,
+    _In_ CONST UINT32 Required,
+    _Out_ UINT32* Fixed
     )
 {
-    // [24.4] "Guest-State Area"
-
-    // The guest stack must be 16-byte aligned
-    NT_ASSERT( GuestStack % 16 == 0 );
-
-    // [24.4.1] "Guest Register State"
-    __vmx_vmwrite( VMCS_GUEST_CR0, __readcr0() );
-    __vmx_vmwrite( VMCS_GUEST_CR3, __readcr3() );
-    __vmx_vmwrite( VMCS_GUEST_CR4, __readcr4() );
-
-    __vmx_vmwrite( VMCS_GUEST_DR7, __readdr(7) );
-
-    __vmx_vmwrite( VMCS_GUEST_RSP, GuestStack );
-    __vmx_vmwrite( VMCS_GUEST_RIP, GuestEntryPoint );
-
-    __vmx_vmwrite( VMCS_GUEST_RFLAGS, __readeflags() );
-
-    __vmx_vmwrite( VMCS_GUEST_CS_SELECTOR, __readcs() );
-    __vmx_vmwrite( VMCS_GUEST_SS_SELECTOR, __readss() );
-    __vmx_vmwrite( VMCS_GUEST_DS_SELECTOR, __readds() );
-    __vmx_vmwrite( VMCS_GUEST_ES_SELECTOR, __reades() );
-    __vmx_vmwrite( VMCS_GUEST_FS_SELECTOR, __readfs() );
-    __vmx_vmwrite( VMCS_GUEST_GS_SELECTOR, __readgs() );
-    __vmx_vmwrite( VMCS_GUEST_LDTR_SELECTOR, __readldtr() );
-    __vmx_vmwrite( VMCS_GUEST_TR_SELECTOR, __readtr() );
-
-    __vmx_vmwrite( VMCS_GUEST_CS_BASE, __segmentbase(__readcs()) );
-    __vmx_vmwrite( VMCS_GUEST_SS_BASE, __segmentbase(__readss()) );
-    __vmx_vmwrite( VMCS_GUEST_DS_BASE, __segmentbase(__readds()) );
-    __vmx_vmwrite( VMCS_GUEST_ES_BASE, __segmentbase(__reades()) );
-    __vmx_vmwrite( VMCS_GUEST_FS_BASE, __readmsr(IA32_FS_BASE) );
-    __vmx_vmwrite( VMCS_GUEST_GS_BASE, __readmsr(IA32_GS_BASE));
-    __vmx_vmwrite( VMCS_GUEST_LDTR_BASE, __segmentbase(__readldtr()) );
-    __vmx_vmwrite( VMCS_GUEST_TR_BASE, __segmentbase(__readtr()) );
-
-    __vmx_vmwrite( VMCS_GUEST_CS_LIMIT, __segmentlimit(__readcs()) );
-    __vmx_vmwrite( VMCS_GUEST_SS_LIMIT, __segmentlimit(__readss()) );
-    __vmx_vmwrite( VMCS_GUEST_DS_LIMIT, __segmentlimit(__readds()) );
-    __vmx_vmwrite( VMCS_GUEST_ES_LIMIT, __segmentlimit(__reades()) );
-    __vmx_vmwrite( VMCS_GUEST_FS_LIMIT, __segmentlimit(__readfs()) );
-    __vmx_vmwrite( VMCS_GUEST_GS_LIMIT, __segmentlimit(__readgs()) );
-    __vmx_vmwrite( VMCS_GUEST_LDTR_LIMIT, __segmentlimit(__readldtr()) );
-    __vmx_vmwrite( VMCS_GUEST_TR_LIMIT, __segmentlimit(__readtr()) );
-
-    __vmx_vmwrite( VMCS_GUEST_CS_ACCESS_RIGHTS, (ReadAR(__readcs())).All );
-    __vmx_vmwrite( VMCS_GUEST_SS_ACCESS_RIGHTS, (ReadAR(__readss())).All );
-    __vmx_vmwrite( VMCS_GUEST_DS_ACCESS_RIGHTS, (ReadAR(__readds())).All );
-    __vmx_vmwrite( VMCS_GUEST_ES_ACCESS_RIGHTS, (ReadAR(__reades())).All );
-    __vmx_vmwrite( VMCS_GUEST_FS_ACCESS_RIGHTS, (ReadAR(__readfs())).All );
-    __vmx_vmwrite( VMCS_GUEST_GS_ACCESS_RIGHTS, (ReadAR(__readgs())).All );
-    __vmx_vmwrite( VMCS_GUEST_LDTR_ACCESS_RIGHTS, (ReadAR(__readldtr())).All );
-    __vmx_vmwrite( VMCS_GUEST_TR_ACCESS_RIGHTS, (ReadAR(__readtr())).All );
-
-    __vmx_vmwrite( VMCS_GUEST_GDTR_BASE, g_GDTR.Base );
-    __vmx_vmwrite( VMCS_GUEST_IDTR_BASE, g_IDTR.Base );
-
-    __vmx_vmwrite( VMCS_GUEST_GDTR_LIMIT, g_GDTR.Limit );
-    __vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, g_IDTR.Limit );
-
-    __vmx_vmwrite( VMCS_GUEST_IA32_DEBUGCTL_FULL, __readmsr(IA32_DEBUGCTL) );
-    __vmx_vmwrite( VMCS_GUEST_IA32_SYSENTER_CS, __readmsr(IA32_SYSENTER_CS) );
-    __vmx_vmwrite( VMCS_GUEST_IA32_SYSENTER_ESP, __readmsr(IA32_SYSENTER_ESP) );
-    __vmx_vmwrite( VMCS_GUEST_IA32_SYSENTER_EIP, __readmsr(IA32_SYSENTER_EIP) );
-}
+    /*
+     * Fix a control field to the settings this processor allows, and say so when that changes what we asked for.
+     *  A requested bit the processor can't do is only fatal if it's one of the bits in Required; everything
+     *  else is reported, and we carry on without it.
+     */
 
-VOID
-_SetVMCSHostState(
-    _In_ UINT64 HostStack,
-    _In_ UINT64 HostEntryPoint
-    )
-{
-    // [24.5] "Host-State Area"
+    UINT32 dropped, forced;
 
-    // The guest stack must be 16-byte aligned
-    NT_ASSERT( HostStack % 16 == 0 );
+    *Fixed = VMXFixControls( &g_VMXCapabilities, Field, Requested, &dropped, &forced );
 
-    __vmx_vmwrite( VMCS_HOST_CR0, __readcr0() );
-    __vmx_vmwrite( VMCS_HOST_CR3, __readcr3() );
-    __vmx_vmwrite( VMCS_HOST_CR4, __readcr4() );
+    if ( dropped != 0 )
+    {
+        KdPrint(( "[SPTHv] Control field %d: requested bits 0x%08X are unsupported, and were dropped\r\n", Field, dropped ));
+    }
 
-    __vmx_vmwrite( VMCS_HOST_RSP, HostStack );
-    __vmx_vmwrite( VMCS_HOST_RIP, HostEntryPoint );
+    if ( forced != 0 )
+    {
+        KdPrint(( "[SPTHv] Control field %d: unrequested bits 0x%08X are required, and were forced on\r\n", Field, forced ));
+    }
 
-    /*
-     * Note: "In the selector field for each of CS, SS, DS, ES, FS, GS and TR,
-     *  the RPL (bits 1:0) and the TI flag (bit 2) must be 0"
-     * (See [26.2.3] "Checks on Host Segment and Descriptor-Table Registers")
-     */
-    __vmx_vmwrite( VMCS_HOST_CS_SELECTOR, __readcs() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_SS_SELECTOR, __readss() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_DS_SELECTOR, __readds() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_ES_SELECTOR, __reades() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_FS_SELECTOR, __readfs() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_GS_SELECTOR, __readgs() & SELECTOR_INDEX_MASK );
-    __vmx_vmwrite( VMCS_HOST_TR_SELECTOR, __readtr() & SELECTOR_INDEX_MASK );
-
-    __vmx_vmwrite( VMCS_HOST_FS_BASE, __readmsr(IA32_FS_BASE) );
-    __vmx_vmwrite( VMCS_HOST_GS_BASE, __readmsr(IA32_GS_BASE) );
-
-    __vmx_vmwrite( VMCS_HOST_TR_BASE, __segmentbase(__readtr()) );
-    __vmx_vmwrite( VMCS_HOST_GDTR_BASE, g_GDTR.Base );
-    __vmx_vmwrite( VMCS_HOST_IDTR_BASE, g_IDTR.Base );
-
-    __vmx_vmwrite( VMCS_HOST_IA32_SYSENTER_CS, __readmsr(IA32_SYSENTER_CS) );
-    __vmx_vmwrite( VMCS_HOST_IA32_SYSENTER_ESP, __readmsr(IA32_SYSENTER_ESP) );
-    __vmx_vmwrite( VMCS_HOST_IA32_SYSENTER_EIP, __readmsr(IA32_SYSENTER_EIP) );
+    return (dropped & Required) == 0;
 }
 
-VOID
-_SetPinBasedControls()
+BOOLEAN
+_BuildPinBasedControls()
 {
     // [24.6.1] "Pin-Based VM-Execution Controls"
 
@@ -176,57 +80,94 @@ _SetPinBasedControls()
 
     // ...
 
-    // Fix the control bits
-    //  (Note: no pre-checking on allowed settings here)
-    pinCtrls.All = FixCtrlBits( pinCtrls.All, IA32_VMX_PINBASED_CTRLS, IA32_VMX_TRUE_PINBASED_CTRLS );
-
-    __vmx_vmwrite( VMCS_CTRL_PIN_EXEC_CTRLS, pinCtrls.All );
+    return _FixControls( VMX_CTRL_PIN_BASED, pinCtrls.All, 0, &g_VMXControls.PinBased.All );
 }
 
-VOID
-_SetProcessorPrimaryControls()
+BOOLEAN
+_BuildProcessorPrimaryControls()
 {
     // [24.6.2] "Processor-Based VM-Execution Controls"
 
     PROCESSOR_PRIMARY_VM_EXEC_CTRLS processorPrimaryCtrls;
+    UINT32 required;
+
     processorPrimaryCtrls.All = 0;
 
-    // VM-exit on `HLT` instructions, which is the first instruction (by default) set in the GuestEntry function (see "./guest.asm")
-    processorPrimaryCtrls.HLTExiting = 1; 
+    // Note: no HLT exiting; the guest is the OS itself now, and it executes HLT every time an LP goes idle
 
     // Use the provided MSR bitmap to determine when to cause VM-exits based on MSR read/write operations
-    //    Note: by default this will ignore all MSR read/write operations, as no MSRs are specified in our bitmap (zeroed)
+    //    Note: only the MSRs intercepted in our bitmap (see _BuildMSRBitmap), and those it doesn't cover, cause an exit
     processorPrimaryCtrls.UseMSRBitmaps = 1; 
 
-    // Fix the control bits
-    //  (Note: no pre-checking on allowed settings here)
-    processorPrimaryCtrls.All = FixCtrlBits( processorPrimaryCtrls.All, IA32_VMX_PROCBASED_CTLS, IA32_VMX_TRUE_PROCBASED_CTLS );
+    // Required for any of the processor secondary controls to take effect
+    processorPrimaryCtrls.ActivateSecondaryControls = 1;
+
+    // Without either of these, the guest would exit on every MSR access and #UD on RDTSCP (and friends)
+    required = processorPrimaryCtrls.All;
+
+    // Let RDTSC and RDTSCP run natively, through a per-LP offset we control (see "TSC.c"); an offset of 0 leaves the
+    //    guest's TSC exactly as it was ([25.3] "Changes to Instruction Behavior in VMX Non-Root Operation")
+    //    (Note: not required; without it, there's simply no adjusting the guest's TSC, and RDTSC still doesn't exit)
+    processorPrimaryCtrls.TSCOffsetting = 1;
 
-    __vmx_vmwrite( VMCS_CTRL_PRIMARY_EXEC_CTRLS, processorPrimaryCtrls.All );
+    // Only exit on accesses to the ports set in our I/O bitmaps (see _BuildIOBitmap)
+    //    (Note: not required; without it, and without unconditional I/O exiting, port I/O simply never exits)
+    processorPrimaryCtrls.UseIOBitmaps = 1;
+
+    return _FixControls( VMX_CTRL_PROC_PRIMARY, processorPrimaryCtrls.All, required, &g_VMXControls.Primary.All );
 }
 
-VOID
-_SetProcessorSecondaryControls()
+BOOLEAN
+_BuildProcessorSecondaryControls()
 {
     // [24.6.2] "Processor-Based VM-Execution Controls"
 
     PROCESSOR_SECONDARY_VM_EXEC_CTRLS processorSecondaryCtrls;
-    processorSecondaryCtrls.All = 0;
+    CPUID_OVERRIDE hidden[VMX_PASSTHROUGH_CONTROL_COUNT];
+    UINT32 required, unavailable;
+    ULONG i;
 
-    // ...
+    // The guest (Windows) uses each of RDTSCP, INVPCID, XSAVES, and so on, whenever its CPUID says it has them, and without
+    //  their controls they #UD in VMX non-root operation; so every one the host has is turned on, and required (see
+    //  g_VMXPassThroughControls in "VMX.c"). One the processor won't let us turn on fails the load
+    //    (Note: hiding it from the guest's CPUID wouldn't do; code that already found the instruction would still #UD on it)
+    required = VMXPassThroughControls( &g_VMXCapabilities, NULL, NULL, &unavailable, hidden );
+    required |= unavailable;
 
-    /*
-     * Fix the control bits
-     *  (Note: no pre-checking on allowed settings here.
-     *  (Additionally, in the FixCtrlBits function I have included logic to handle the case of processor secondary controls)
-     */
-    processorSecondaryCtrls.All = FixCtrlBits( processorSecondaryCtrls.All, IA32_VMX_PROCBASED_CTLS2, 0 );
+    processorSecondaryCtrls.All = required;
+
+    // For each control that fails it, say which feature flag the guest would have been left with (see VMXPassThroughControls)
+    for ( i = 0; i < VMX_PASSTHROUGH_CONTROL_COUNT; i++ )
+    {
+        if ( hidden[i].Mask != 0 )
+        {
+            KdPrint(( "[SPTHv] Secondary control 0x%08X is unsupported; the guest would #UD on CPUID.%XH.%u:%d[0x%08X]\r\n",
+                      g_VMXPassThroughControls[i].Control, hidden[i].Leaf, hidden[i].Subleaf, hidden[i].Register, hidden[i].Mask ));
+        }
+    }
 
-    __vmx_vmwrite( VMCS_CTRL_SECONDARY_EXEC_CTRLS, processorSecondaryCtrls.All );
+    // Tag the guest's translations with a VPID of its own, so VM-entries and VM-exits no longer flush the TLB ([28.1]
+    //  "Virtual Processor Identifiers (VPIDs)"); only if INVVPID can drop a whole VPID's translations, as it has to
+    //  whenever we emulate something that would have flushed them (see VMXInvalidateVPID in "VMX.c")
+    if ( g_VMXCapabilities.EPTVPIDCap.INVVPID == 1 &&
+         (g_VMXCapabilities.EPTVPIDCap.INVVPIDSingleContext == 1 || g_VMXCapabilities.EPTVPIDCap.INVVPIDAllContexts == 1) )
+    {
+        processorSecondaryCtrls.EnableVPID = 1;
+    }
+
+    // Have the guest's TSC run at a rate of our choosing (see TscSetPolicy); it starts out at a multiplier of 1.0
+    processorSecondaryCtrls.UseTSCScaling = 1;
+
+    // Translate guest-physical addresses through our identity map (see _BuildEPT)
+    //    (Note: we run fine without it; _BuildEPT turns this back off if we can't build the kind of tables we need)
+    processorSecondaryCtrls.EnableEPT = 1;
+
+    // (Note: there's no 'true' MSR for the secondary controls; and no default1 bits either, see [A.3.3])
+    return _FixControls( VMX_CTRL_PROC_SECONDARY, processorSecondaryCtrls.All, required, &g_VMXControls.Secondary.All );
 }
 
-VOID
-_SetExitControls()
+BOOLEAN
+_BuildExitControls()
 {
     // [24.7] "VM-Exit Control Fields"
 
@@ -236,15 +177,11 @@ _SetExitControls()
     // We want to be in IA-32e mode (our current mode) on VM exits
     exitCtrls.HostAddressSpaceSize = 1;
 
-    // Fix the control bits
-    //  (Note: no pre-checking on allowed settings here)
-    exitCtrls.All = FixCtrlBits( exitCtrls.All, IA32_VMX_EXIT_CTLS, IA32_VMX_TRUE_EXIT_CTLS );
-
-    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_CTRLS, exitCtrls.All );
+    return _FixControls( VMX_CTRL_EXIT, exitCtrls.All, exitCtrls.All, &g_VMXControls.Exit.All );
 }
 
-VOID
-_SetEntryControls()
+BOOLEAN
+_BuildEntryControls()
 {
     // [24.8] "VM-Entry Control Fields"
 
@@ -254,91 +191,647 @@ _SetEntryControls()
     // Want the guest in IA-32e mode on VM entries
     entryCtrls.IA32eModeGuest = 1;
 
-    // Fix the control bits
-    //  (Note: no pre-checking on allowed settings here)
-    entryCtrls.All = FixCtrlBits( entryCtrls.All, IA32_VMX_ENTRY_CTLS, IA32_VMX_TRUE_ENTRY_CTLS );
+    return _FixControls( VMX_CTRL_ENTRY, entryCtrls.All, entryCtrls.All, &g_VMXControls.Entry.All );
+}
+
+BOOLEAN
+_BuildControls()
+{
+    // Every LP runs with the same controls; so they're built (and validated) once, up front, from g_VMXCapabilities
+
+    BOOLEAN success = TRUE;
 
-    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_CTRLS, entryCtrls.All );
+    // (Note: these are all built, even after a failure, so that every dropped or forced bit gets reported)
+    success &= _BuildPinBasedControls();
+    success &= _BuildProcessorPrimaryControls();
+    success &= _BuildProcessorSecondaryControls();
+    success &= _BuildExitControls();
+    success &= _BuildEntryControls();
+
+    return success;
 }
 
-NTSTATUS
-DriverEntry(
-    _In_ PDRIVER_OBJECT DriverObject,
-    _In_ PUNICODE_STRING RegistryPath
+VOID
+_WriteControls()
+{
+    // [24.6] "VM-Execution Control Fields", [24.7] "VM-Exit Control Fields", [24.8] "VM-Entry Control Fields"
+
+    __vmx_vmwrite( VMCS_CTRL_PIN_EXEC_CTRLS, g_VMXControls.PinBased.All );
+    __vmx_vmwrite( VMCS_CTRL_PRIMARY_EXEC_CTRLS, g_VMXControls.Primary.All );
+    __vmx_vmwrite( VMCS_CTRL_SECONDARY_EXEC_CTRLS, g_VMXControls.Secondary.All );
+    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_CTRLS, g_VMXControls.Exit.All );
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_CTRLS, g_VMXControls.Entry.All );
+
+    // [24.6.4] "I/O-Bitmap Addresses"
+    if ( g_VMXControls.Primary.UseIOBitmaps == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_ADDR_IO_BITMAP_A_FULL, (UINT64)g_IOBitmap.PA + IO_BITMAP_A_OFFSET );
+        __vmx_vmwrite( VMCS_CTRL_ADDR_IO_BITMAP_B_FULL, (UINT64)g_IOBitmap.PA + IO_BITMAP_B_OFFSET );
+    }
+
+    // [24.6.11] "Extended-Page-Table Pointer (EPTP)"
+    if ( g_VMXControls.Secondary.EnableEPT == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_EPT_POINTER_FULL, g_EPTView.EPTP.All );
+    }
+
+    // [24.6.14] "VM-Function Controls"; the guest can switch to any view in the EPTP list (see "VMFunc.c")
+    if ( g_VMXControls.Secondary.EnableVMFUNC == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_VM_FUNC_CTRLS_FULL, VM_FUNCTION_EPTP_SWITCHING );
+        __vmx_vmwrite( VMCS_CTRL_EPTP_LIST_ADDR_FULL, g_EPTPList.EntriesPA );
+    }
+
+    // [24.6.5] "Time-Stamp Counter Offset and Multiplier"; every LP starts out with the processor's own TSC
+    if ( g_VMXControls.Primary.TSCOffsetting == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_TSC_OFFSET_FULL, 0 );
+    }
+
+    if ( g_VMXControls.Secondary.UseTSCScaling == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_TSC_MULTIPLIER_FULL, TSC_MULTIPLIER_ONE );
+    }
+
+    // XSAVES/XRSTORS only exit for the XSS bits set in this bitmap; we don't want any of them ([25.1.3] "Instructions That Cause VM Exits Conditionally")
+    if ( g_VMXControls.Secondary.EnableXSAVESXRSTORS == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_XSS_EXITING_BITMAP_FULL, 0 );
+    }
+
+    // Nor does PCONFIG, for any of the leaf functions (in EAX) set in this bitmap ([25.1.3])
+    if ( g_VMXControls.Secondary.EnablePCONFIG == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_PCONFIG_EXITING_BITMAP_FULL, 0 );
+    }
+}
+
+BOOLEAN
+_RequestMSRs(
+    _Inout_ CONST PLP_INFO LPInfo
     )
 {
-    KIRQL PreviousIRQL;
+    /*
+     * [18.2.2] "Architectural Performance Monitoring Version 2"
+     *
+     *  The MSRs this LP switches on its transitions (see MsrAreaBuild). The guest owns IA32_PERF_GLOBAL_CTRL: it's
+     *  stored on every VM-exit and loaded back on the next VM-entry, and cleared on every VM-exit in between, so
+     *  that none of the guest's counters count the cycles (or anything else) spent handling its exits. Only
+     *  version 2 and later of architectural performance monitoring have the MSR at all.
+     */
 
-    BOOLEAN bSavedEpAddr = FALSE;
-    UINT64 pEpAddr;
+    int cpuInfo[4];
 
-    VMX_BASIC_INFO vmxBasicInfo;
-    FEATURE_CONTROL featureControl;
+    __cpuid( cpuInfo, 0 );
+    if ( (UINT32)cpuInfo[0] < 0x0A )
+    {
+        return TRUE;
+    }
 
-    UNREFERENCED_PARAMETER( DriverObject );
-    UNREFERENCED_PARAMETER( RegistryPath );
+    __cpuid( cpuInfo, 0x0A );
+    if ( (cpuInfo[0] & 0xFF) < 2 )
+    {
+        return TRUE;
+    }
 
+    return MsrAreaAddRequest(
+        LPInfo->MSRRequests,
+        &LPInfo->MSRRequestCount,
+        IA32_PERF_GLOBAL_CTRL,
+        MSR_AREA_GUEST_SAVE | MSR_AREA_HOST_LOAD,
+        __readmsr( IA32_PERF_GLOBAL_CTRL ),
+        0
+        );
+}
 
+BOOLEAN
+_WriteMSRAreas(
+    _Inout_ CONST PLP_INFO LPInfo
+    )
+{
+    /*
+     * [24.7.2] "VM-Exit Controls for MSRs", [24.8.2] "VM-Entry Controls for MSRs"
+     *
+     *  Build this LP's MSR areas from its requests (see MsrAreaBuild), and point the VMCS at them; along with
+     *  whichever dedicated load/save controls took over from them. With no requests, every count is 0, and our
+     *  transitions don't touch a single MSR.
+     */
 
-    // Capture the GDT and IDT bases for later usage
-    __sgdt( &g_GDTR );
-    __sidt( &g_IDTR );
+    MSR_AREA_LAYOUT* layout = &LPInfo->MSRLayout;
+    ULONG i;
+
+    if ( MsrAreaBuild(
+            LPInfo->MSRRequests,
+            LPInfo->MSRRequestCount,
+            (UINT32)(g_VMXCapabilities.Controls[VMX_CTRL_EXIT] >> 32),
+            (UINT32)(g_VMXCapabilities.Controls[VMX_CTRL_ENTRY] >> 32),
+            (PMSR_AREA_ENTRY)LPInfo->GuestMSRArea.VA,
+            (PMSR_AREA_ENTRY)LPInfo->HostMSRArea.VA,
+            layout
+            ) == FALSE )
+    {
+        return FALSE;
+    }
 
-    // Capture the CR0/4 values for later usage
-    g_CR0.All = __readcr0();
-    g_CR4.All = __readcr4();
+    if ( layout->ExitCtrls.All != 0 || layout->EntryCtrls.All != 0 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_VM_EXIT_CTRLS, g_VMXControls.Exit.All | layout->ExitCtrls.All );
+        __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_CTRLS, g_VMXControls.Entry.All | layout->EntryCtrls.All );
+    }
+
+    for ( i = 0; i < layout->FieldCount; i++ )
+    {
+        __vmx_vmwrite( layout->Fields[i].Encoding, layout->Fields[i].Value );
+    }
+
+    // The guest area is stored into on exit (its first GuestStoreCount entries), and loaded back from on entry
+    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_MSR_STORE_ADDR_FULL, (UINT64)LPInfo->GuestMSRArea.PA );
+    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_MSR_STORE_COUNT, layout->GuestStoreCount );
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_MSR_LOAD_ADDR_FULL, (UINT64)LPInfo->GuestMSRArea.PA );
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_MSR_LOAD_COUNT, layout->GuestCount );
+
+    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_MSR_LOAD_ADDR_FULL, (UINT64)LPInfo->HostMSRArea.PA );
+    __vmx_vmwrite( VMCS_CTRL_VM_EXIT_MSR_LOAD_COUNT, layout->HostCount );
+
+    return TRUE;
+}
+
+BOOLEAN
+_BuildEPT()
+{
+    /*
+     * Build the EPT identity map every LP shares ([28.2] "The Extended Page Table Mechanism (EPT)"); guest-physical
+     *  addresses translate to the same host-physical addresses, RAM is write-back, and everything else is uncacheable.
+     *
+     *  Returns FALSE only if something went wrong building it; a processor that can't do the kind of EPT we
+     *  need just runs without it.
+     */
+
+    BOOLEAN result = FALSE;
+
+    PPHYSICAL_MEMORY_RANGE physicalRanges;
+    PEPT_MEMORY_RANGE ramRanges = NULL;
+    ULONG nRanges;
+    ULONG nPages;
+    ULONG i;
+
+    UINT64 topOfRAM = 0;
+    UINT64 mapLimit;
+    BOOLEAN useHugePages;
+    int cpuInfo[4];
+
+    VMX_ADDRESS pool;
+
+    // Already reported as a dropped control by _BuildControls
+    if ( g_VMXControls.Secondary.EnableEPT == 0 )
+    {
+        return TRUE;
+    }
+
+    // We only build 4-level, write-back tables ([A.10] "VPID and EPT Capabilities")
+    if ( g_VMXCapabilities.EPTVPIDCap.PageWalkLength4 == 0 || g_VMXCapabilities.EPTVPIDCap.MemTypeWB == 0 )
+    {
+        KdPrint(( "[SPTHv] EPT doesn't support 4-level, write-back tables; running without it\r\n" ));
+
+        g_VMXControls.Secondary.EnableEPT = 0;
+        return TRUE;
+    }
+
+    // Everything that's RAM (and nothing else); an array terminated by an empty range
+    physicalRanges = MmGetPhysicalMemoryRanges();
+    if ( physicalRanges == NULL )
+    {
+        return FALSE;
+    }
+
+    for ( nRanges = 0; physicalRanges[nRanges].NumberOfBytes.QuadPart != 0; nRanges++ );
+
+    ramRanges = ExAllocatePoolWithTag( NonPagedPool, max( nRanges, 1 ) * sizeof(EPT_MEMORY_RANGE), SPTHV_POOL_TAG );
+    if ( ramRanges == NULL )
+    {
+        goto __ep;
+    }
+
+    for ( i = 0; i < nRanges; i++ )
+    {
+        ramRanges[i].Base = physicalRanges[i].BaseAddress.QuadPart;
+        ramRanges[i].Length = physicalRanges[i].NumberOfBytes.QuadPart;
+
+        topOfRAM = max( topOfRAM, ramRanges[i].Base + ramRanges[i].Length );
+    }
+
+    useHugePages = (g_VMXCapabilities.EPTVPIDCap.PDPTE1GBPages == 1);
+
+    if ( useHugePages == TRUE )
+    {
+        // With 1GB pages, the whole physical address space (MMIO included) costs one PDPT per 512GB; so we map
+        //  all of it, up to MAXPHYADDR ([4.1.4] "Enumeration of Paging Features by CPUID"), or the 48 bits a
+        //  4-level walk can translate
+        __cpuid( cpuInfo, 0x80000008 );
+
+        mapLimit = 1ULL << min( cpuInfo[0] & 0xFF, 48 );
+    }
+    else
+    {
+        // Otherwise every 1GB costs a PD; so we map RAM (and whatever lives between it) in 512GB steps
+        mapLimit = ALIGN_UP_BY( max( topOfRAM, EPT_PML4E_COVERAGE ), EPT_PML4E_COVERAGE );
+    }
+
+    nPages = EptCountTablePages( ramRanges, nRanges, mapLimit, useHugePages ) + EPT_SPLIT_RESERVE_PAGES;
+
+    // Every table comes out of one contiguous block (see EPT_PAGE_POOL in "EPT.h")
+    if ( utlAllocateVMXData( (SIZE_T)nPages * PAGE_SIZE, TRUE, TRUE, &pool ) == FALSE )
+    {
+        goto __ep;
+    }
+
+    g_EPTView.Pool.VA = pool.VA;
+    g_EPTView.Pool.PA = (UINT64)pool.PA;
+    g_EPTView.Pool.PageCount = nPages;
+    g_EPTView.Pool.PagesUsed = 0;
+
+    if ( EptBuildIdentityMap( &g_EPTView, ramRanges, nRanges, mapLimit, useHugePages ) == FALSE )
+    {
+        utlFreeVMXData( &pool, TRUE );
+        RtlSecureZeroMemory( &g_EPTView, sizeof(EPT_VIEW) );
+
+        goto __ep;
+    }
+
+    KdPrint((
+        "[SPTHv] EPT identity map below 0x%llX: %llu 1GB, %llu 2MB and %llu 4KB pages, in %lu of %lu table pages\r\n",
+        mapLimit,
+        g_EPTView.HugePages,
+        g_EPTView.LargePages,
+        g_EPTView.Pages,
+        g_EPTView.Pool.PagesUsed,
+        g_EPTView.Pool.PageCount
+        ));
+
+    result = TRUE;
+
+__ep:
+    if ( ramRanges != NULL )
+    {
+        ExFreePoolWithTag( ramRanges, SPTHV_POOL_TAG );
+    }
+
+    ExFreePool( physicalRanges );
+
+    return result;
+}
+
+VOID
+_FreeEPT()
+{
+    VMX_ADDRESS pool;
 
+    if ( g_EPTView.Pool.VA == NULL )
+    {
+        return;
+    }
 
+    pool.VA = g_EPTView.Pool.VA;
+    pool.PA = (PVOID)g_EPTView.Pool.PA;
+
+    utlFreeVMXData( &pool, TRUE );
+    RtlSecureZeroMemory( &g_EPTView, sizeof(EPT_VIEW) );
+}
 
+BOOLEAN
+_BuildMSRBitmap()
+{
+    /*
+     * Build the MSR bitmap every LP shares ([24.6.9] "MSR-Bitmap Address"); this is where the MSRs we care
+     *  about get intercepted (see MsrBitmapSetIntercept and MsrBitmapSetRangeIntercept in "MSRBitmap.c").
+     *
+     *  The processor only ever reads it, so one copy serves every LP; an LP that needs a policy of its own
+     *  can be pointed at a different bitmap before it's launched (see LP_INFO.MSRBitmap).
+     */
+
+    // 4KB aligned physical address needed
+    if ( utlAllocateVMXData( MSR_BITMAP_SIZE, TRUE, TRUE, &g_MSRBitmap ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    // Every RDMSR/WRMSR of a covered MSR goes straight to the processor, and only those outside the bitmap's ranges
+    //    exit (see _ExitMSRAccess in "Exit.c"); except for writes to the TSC, which have to move the guest's TSC offset
+    //    rather than the TSC itself while we're offsetting it (see _ExitWRMSR), and whichever ranges are asked for
+    //    once we're running (see InterceptSetMSRRange in "Intercept.c")
+    if ( g_VMXControls.Primary.TSCOffsetting == 1 )
+    {
+        MsrBitmapSetIntercept( g_MSRBitmap.VA, IA32_TIME_STAMP_COUNTER, MSR_INTERCEPT_WRITE, TRUE );
+    }
+
+    return TRUE;
+}
+
+VOID
+_FreeMSRBitmap()
+{
+    if ( g_MSRBitmap.VA != NULL )
+    {
+        utlFreeVMXData( &g_MSRBitmap, TRUE );
+    }
+}
+
+BOOLEAN
+_BuildIOBitmap()
+{
+    /*
+     * Build the I/O bitmaps every LP shares ([24.6.4] "I/O-Bitmap Addresses"); this is where the ports we want
+     *  to watch get intercepted (see IoBitmapSetIntercept in "IOBitmap.c", and InterceptSetPortRange in
+     *  "Intercept.c"), while every other port (disk, NIC, and so on) is accessed without an exit.
+     */
+
+    if ( g_VMXControls.Primary.UseIOBitmaps == 0 )
+    {
+        return TRUE;
+    }
+
+    // Bitmaps A and B, back to back (4KB aligned physical addresses needed)
+    if ( utlAllocateVMXData( IO_BITMAP_SIZE, TRUE, TRUE, &g_IOBitmap ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    // No port is intercepted for now (see _ExitIOInstruction in "Exit.c" for what happens when one is)
+
+    return TRUE;
+}
+
+VOID
+_FreeIOBitmap()
+{
+    if ( g_IOBitmap.VA != NULL )
+    {
+        utlFreeVMXData( &g_IOBitmap, TRUE );
+    }
+}
+
+VOID
+_InvalidateEPT()
+{
+    // [28.3.3.4] "Guidelines for Use of the INVEPT Instruction"
+
+    INVEPT_DESCRIPTOR descriptor;
+    PEPT_VIEW view;
+    ULONG i;
+
+    descriptor.EPTP = g_EPTView.EPTP.All;
+    descriptor.Reserved0 = 0;
+
+    if ( g_VMXCapabilities.EPTVPIDCap.INVEPTAllContexts == 1 )
+    {
+        __invept( INVEPT_ALL_CONTEXTS, &descriptor );
+    }
+    else if ( g_VMXCapabilities.EPTVPIDCap.INVEPTSingleContext == 1 )
+    {
+        __invept( INVEPT_SINGLE_CONTEXT, &descriptor );
+
+        // (Note: and every other view the guest may have switched to; see "VMFunc.c")
+        for ( i = EPT_VIEW_DEFAULT + 1; i < EPT_VIEW_MAX && g_VmfuncSupported == TRUE; i++ )
+        {
+            view = VmfuncGetView( i );
+
+            if ( view != NULL )
+            {
+                descriptor.EPTP = view->EPTP.All;
+                __invept( INVEPT_SINGLE_CONTEXT, &descriptor );
+            }
+        }
+    }
+}
+
+BOOLEAN
+_AllocateLP(
+    _Inout_ CONST PLP_INFO LPInfo,
+    _In_ CONST UINT32 RevisionIdentifier
+    )
+{
     // See [31.6] "Preparation and Launching a Virtual Machine" for "the minimal steps required by the VMM to set up and launch a guest VM"
+    //    (Note: these are done at PASSIVE_LEVEL for every LP ahead of time, as we can't allocate anything once we've been broadcast to)
+
+    VMX_ADDRESS stats;
+    VMX_ADDRESS xsaveArea;
+    VMX_ADDRESS cpuidTable;
+
+
+
+    // 1. The guest is this LP carrying on with whatever it was doing, on whatever stack it was doing it on; so there's no VM stack to allocate
+
+
+
+    // All of this LP's regions are carved out of a single block, allocated on the LP's own NUMA node; this saves a
+    //    contiguous allocation (and a zeroing pass) per region, and keeps every exit's accesses to them node-local
+    if ( ArenaCreate( &LPInfo->Arena, &g_LPArenaProvider, LP_ARENA_SIZE, utlGetProcessorNode( LPInfo->Index ) ) == FALSE )
+    {
+        return FALSE;
+    }
+
 
 
+    // 2. Carve out a stack for the VMM (host); this will get loaded on VM-exits, and be used by the exit handler
+    //    (Note: it comes first, so that an overflow runs off the front of the arena rather than into our VMCS)
+    if ( ArenaCarve( &LPInfo->Arena, KERNEL_STACK_SIZE, PAGE_SIZE, &LPInfo->HostStack ) == FALSE )
+    {
+        return FALSE;
+    }
 
-    // 1. Allocate a stack for the VM, zero and initialize the allocations, and get it's physical address
-    //    (Note: this isn't necessarily required for just the test, as the guest doesn't perform any stack operations)
-    NT_ASSERT( utlAllocateVMXData( KERNEL_STACK_SIZE, FALSE, FALSE, &g_LPInfo.VMStack ) == TRUE );
+    // Stash our LP_INFO at the top of the host stack, for VMExitStub to find (see HOST_STACK_RESERVED in "Exit.h")
+    *(PLP_INFO*)((UINT64)LPInfo->HostStack.VA + KERNEL_STACK_SIZE - HOST_STACK_RESERVED) = LPInfo;
 
 
 
-    // 2. Allocate a stack for the VMM (host); this will get loaded on VM-exits, and be used by the exit handler
-    NT_ASSERT( utlAllocateVMXData( KERNEL_STACK_SIZE, FALSE, FALSE, &g_LPInfo.HostStack ) == TRUE );
+    // 3. Use the shared MSR bitmap (see _BuildMSRBitmap)
+    LPInfo->MSRBitmap = g_MSRBitmap;
 
 
 
-    // 3. Allocate an MSR bitmap (4KB contiguous physical address needed ([24.6.9] "MSR-Bitmap Address")
-    //    (Note: this isn't *required*, but it's possible to generate a vm-exit with REASON_RDMSR at launch without it)
-    NT_ASSERT( utlAllocateVMXData( PAGE_SIZE, TRUE, TRUE, &g_LPInfo.MSRBitmap ) == TRUE );
+    // 4. Carve out the VMXON Region (4KB aligned physical address needed, [24.11.5] "VMXON Region")
+    if ( ArenaCarve( &LPInfo->Arena, VMX_ALLOCATION_DEFAULT_MAX, PAGE_SIZE, &LPInfo->VMXONRegion ) == FALSE )
+    {
+        return FALSE;
+    }
 
 
 
-    // 4. Allocate the VMXON Region (4KB contiguous physical address needed, [24.11.5] "VMXON Region")
-    NT_ASSERT( utlAllocateVMXData( VMX_ALLOCATION_DEFAULT_MAX, TRUE, TRUE, &g_LPInfo.VMXONRegion ) == TRUE );
+    // 5. Carve out the VMCS Region (4KB aligned physical address needed, [24.11.5] "VMXON Region")
+    if ( ArenaCarve( &LPInfo->Arena, VMX_ALLOCATION_DEFAULT_MAX, PAGE_SIZE, &LPInfo->VMCS ) == FALSE )
+    {
+        return FALSE;
+    }
 
 
 
-    // 5. Allocate the VMCS Region (4KB contiguous physical address needed, [24.11.5] "VMXON Region")
-    NT_ASSERT( utlAllocateVMXData( VMX_ALLOCATION_DEFAULT_MAX, TRUE, TRUE, &g_LPInfo.VMCS ) == TRUE );
+    // Carve out the PML log (4KB aligned physical address needed, [24.6.18] "Controls for Page-Modification Logging")
+    if ( ArenaCarve( &LPInfo->Arena, PAGE_SIZE, PAGE_SIZE, &LPInfo->PMLBuffer ) == FALSE )
+    {
+        return FALSE;
+    }
+
+
+
+    // Carve out the virtualization-exception information area (4KB aligned physical address needed, [24.6.19] "Controls for Virtualization Exceptions")
+    if ( ArenaCarve( &LPInfo->Arena, PAGE_SIZE, PAGE_SIZE, &LPInfo->VEInfo ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    VeInfoReset( (PVE_INFO)LPInfo->VEInfo.VA );
+
+
+
+    // Carve out the guest and host MSR areas (16-byte aligned physical addresses needed, [24.7.2] "VM-Exit Controls for MSRs")
+    if ( ArenaCarve( &LPInfo->Arena, MSR_AREA_SIZE, 16, &LPInfo->GuestMSRArea ) == FALSE ||
+         ArenaCarve( &LPInfo->Arena, MSR_AREA_SIZE, 16, &LPInfo->HostMSRArea ) == FALSE )
+    {
+        return FALSE;
+    }
+
+
+
+    // Carve out the XSAVE area exit handlers save the guest's extended state to (64-byte aligned, [13.4] "XSAVE Area")
+    if ( ArenaCarve( &LPInfo->Arena, XSTATE_AREA_SIZE, XSTATE_AREA_ALIGNMENT, &xsaveArea ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    LPInfo->XState.Area = xsaveArea.VA;
+    LPInfo->XState.SavedMask = 0;
+
+
+
+    // Carve out the table this LP's CPUID leaves are recorded in (see step 12.10 of _VirtualizeLP)
+    if ( ArenaCarve( &LPInfo->Arena, sizeof(CPUID_TABLE), SYSTEM_CACHE_ALIGNMENT_SIZE, &cpuidTable ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    LPInfo->CPUIDTable = (PCPUID_TABLE)cpuidTable.VA;
+
+
+
+    // Carve out the exit counters; their own cache lines, on the LP's own node
+    if ( ArenaCarve( &LPInfo->Arena, sizeof(EXIT_STATS), SYSTEM_CACHE_ALIGNMENT_SIZE, &stats ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    LPInfo->ExitStats = (PEXIT_STATS)stats.VA;
+
+
+
+    // Reserve the window its exit handlers get at guest memory through; it's not in the arena, but address space
+    if ( utlReservePhysicalWindow( &LPInfo->PhysicalWindow ) == FALSE )
+    {
+        return FALSE;
+    }
+
+
+
+    // Give the LP a VPID of its own (see _BuildProcessorSecondaryControls)
+    if ( g_VMXControls.Secondary.EnableVPID == 1 )
+    {
+        LPInfo->VPID = VMXAllocateVPID();
+        if ( LPInfo->VPID == 0 )
+        {
+            return FALSE;
+        }
+    }
 
 
 
     // 6. Assign revision identifiers to the above regions ([24.2] "Format of the VMCS Region", [24.11.5] "VMXON Region")
-    vmxBasicInfo.All = __readmsr( IA32_VMX_BASIC );
-    ((PVMXON_REGION)g_LPInfo.VMXONRegion.VA)->RevisionIdentifier = vmxBasicInfo.RevisionIdentifier;
-    ((PVMCS)g_LPInfo.VMCS.VA)->RevisionIdentifier = vmxBasicInfo.RevisionIdentifier;
+    ((PVMXON_REGION)LPInfo->VMXONRegion.VA)->RevisionIdentifier = RevisionIdentifier;
+    ((PVMCS)LPInfo->VMCS.VA)->RevisionIdentifier = RevisionIdentifier;
+
+    LpStateAdvance( &LPInfo->State, LP_STATE_ALLOCATED );
+
+    return TRUE;
+}
+
+VOID
+_FreeLP(
+    _Inout_ CONST PLP_INFO LPInfo
+    )
+{
+    // Every region lives in the arena, which may be missing if _AllocateLP failed part way through
+    ArenaDestroy( &LPInfo->Arena );
+
+    VMXFreeVPID( LPInfo->VPID );
+    LPInfo->VPID = 0;
+
+    utlFreePhysicalWindow( &LPInfo->PhysicalWindow );
+
+    // (Note: the MSR bitmap is shared, and is freed along with the rest of the shared state; see _FreeAllLPs)
+    LPInfo->HostStack.VA = NULL;
+    LPInfo->MSRBitmap.VA = NULL;
+    LPInfo->VMXONRegion.VA = NULL;
+    LPInfo->VMCS.VA = NULL;
+    LPInfo->GuestMSRArea.VA = NULL;
+    LPInfo->HostMSRArea.VA = NULL;
+    LPInfo->XState.Area = NULL;
+    LPInfo->CPUIDTable = NULL;
+    LPInfo->VEInfo.VA = NULL;
+    LPInfo->VEEnabled = FALSE;
+}
+
+ULONG_PTR
+_VirtualizeLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    /*
+     * Note: this is an IPI broadcast worker (see KeIpiGenericCall in DriverEntry); so it runs on every
+     *  LP at the same time, at IPI_LEVEL. Nothing in here may allocate, wait, or break into the debugger
+     *  unconditionally, and a failure on one LP has to be recorded (and unwound) rather than asserted on.
+     */
+
+    KIRQL PreviousIRQL;
+
+    UINT64 startTSC, setupTSC;
+    VMX_STATUS_CODE launchStatus;
+    ULONG nFields;
+
+    PLP_INFO lpInfo;
+    FEATURE_CONTROL featureControl;
+    CR4 cr4;
+
+    UNREFERENCED_PARAMETER( Argument );
+
+    lpInfo = &g_LPInfo[KeGetCurrentProcessorNumberEx( NULL )];
+
+    // This LP's allocations failed in DriverEntry; there's nothing for us to do
+    if ( lpInfo->State != LP_STATE_ALLOCATED )
+    {
+        return 0;
+    }
+
+    startTSC = __rdtsc();
+
+    // Capture the GDT and IDT bases for later usage
+    __sgdt( &lpInfo->GDTR );
+    __sidt( &lpInfo->IDTR );
+
+    // Capture the CR0/4 values for later usage
+    lpInfo->OriginalCR0.All = __readcr0();
+    lpInfo->OriginalCR4.All = __readcr4();
 
 
 
     // 7. Raise the IRQL to prevent context switches for this LP; as the following operations are specific to the current LP
 
-    /*  Note: HIGH_LEVEL IRQL required here for how we're executing guest code.
+    /*  Note: HIGH_LEVEL IRQL is only required here while we set up, and launch, this LP.
      *
-     *   Our VM-exit handler is effectively always at HIGH_LEVEL[0], but all of the other
-     *   code, chiefly that which runs within VMX operation (like our guest), could potentially get
-     *   context-switched by an interrupt running at a higher IRQL (such as device/clock interrupts);
-     *   and this creates a particularly nasty bug with our implementation, as after the interrupt
-     *   occurs, windows will try to use the RDTSCP function (in the call chain servicing the higher-IRQL
-     *   interrupt), which isn't enabled in our processor secondary controls, which generates a #UD, and
-     *   bugchecks the guest.
+     *   Once launched, the guest carries on at the IRQL we were broadcast at, and is free to take
+     *   interrupts (device/clock interrupts, and so on) like it always would. This used to be a
+     *   particularly nasty bug[0] for us, as after the interrupt occurs, windows will try to use the
+     *   RDTSCP function (in the call chain servicing the higher-IRQL interrupt), which would #UD
+     *   and bugcheck the guest; which is why we now enable RDTSCP (and every other instruction the
+     *   host has, that needs a control to run in VMX non-root operation) in our processor secondary
+     *   controls, and refuse to load if the processor won't let us enable one (see _BuildProcessorSecondaryControls).
      *
      *  [0]: https://github.com/tandasat/HyperPlatform/issues/3#issuecomment-230494046
      */
@@ -350,7 +843,11 @@ DriverEntry(
     // 8. Check feature MSRs for hypervisor system compatibility ([23.7] "Enabling and Entering VMX Operation")
     //    (Per the specification: the lock bit along with either VMXInsideSMX or VMXOutsideSMX must be set; and we only support VMX outside of SMX)
     featureControl.All = __readmsr( IA32_FEATURE_CONTROL );
-    NT_ASSERT( featureControl.Lock == 1 && featureControl.VMXOutisdeSMX == 1 );
+    if ( featureControl.Lock == 0 || featureControl.VMXOutisdeSMX == 0 )
+    {
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+        goto __restore_lp;
+    }
 
 
 
@@ -360,119 +857,540 @@ DriverEntry(
 
 
     // 10. Enter VMX operation
-    NT_ASSERT( __vmx_on((UINT64*)&g_LPInfo.VMXONRegion.PA) == VMX_OK );
+    if ( !VMX_SUCCESS( __vmx_on( (UINT64*)&lpInfo->VMXONRegion.PA ) ) )
+    {
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+        goto __restore_lp;
+    }
+
+    LpStateAdvance( &lpInfo->State, LP_STATE_VMX_ON );
 
 
 
     // 11. Set launch state of VMCS to clear, render it inactive, and ensure all data is written (that may be cached by the processor)
-    NT_ASSERT( __vmx_vmclear( (UINT64*)&g_LPInfo.VMCS.PA ) == VMX_OK );
+    if ( !VMX_SUCCESS( __vmx_vmclear( (UINT64*)&lpInfo->VMCS.PA ) ) )
+    {
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+        goto __vmx_off_lp;
+    }
 
 
 
     // 11. Load our VMCS onto the LP, and mark it active and current
-    NT_ASSERT( __vmx_vmptrld( (UINT64*)&g_LPInfo.VMCS.PA ) == VMX_OK );
+    if ( !VMX_SUCCESS( __vmx_vmptrld( (UINT64*)&lpInfo->VMCS.PA ) ) )
+    {
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+        goto __vmx_off_lp;
+    }
+
+    LpStateAdvance( &lpInfo->State, LP_STATE_VMCS_LOADED );
 
 
 
     // 12. Configure our VMCS sections ([24.3] "Organization of VMCS Data")
 
-    // 12.1 Configure the guest state information ([24.4] "Guest-State Area")
-    _SetVMCSGuestState(
-        (UINT64)g_LPInfo.VMStack.VA + KERNEL_STACK_SIZE,
-        (UINT64)GuestEntry
-        );
+    // 12.1 Capture this LP's state once; both the guest ([24.4] "Guest-State Area") and host ([24.5] "Host-State Area") state come from it
+    setupTSC = __rdtsc();
 
-    // 12.2 Configure the host state information ([24.5] "Host-State Area")
-    _SetVMCSHostState(
-        (UINT64)g_LPInfo.HostStack.VA + KERNEL_STACK_SIZE,
-        (UINT64)VMExitHandler
-        );
+    StateCapture( &lpInfo->CPUState );
 
-    // 12.3 Configure the VMCS control fields ([31.6] "Preparation and Launching a Virtual Machine")
+    lpInfo->CPUState.HostCR3 = g_SystemCR3;     // Whatever process we were broadcast into may not outlive us
+    lpInfo->CPUState.HostRSP = (UINT64)lpInfo->HostStack.VA + KERNEL_STACK_SIZE - HOST_STACK_RESERVED;
+    lpInfo->CPUState.HostRIP = (UINT64)VMExitStub;
+
+    // The host stack must be 16-byte aligned
+    NT_ASSERT( lpInfo->CPUState.HostRSP % 16 == 0 );
 
-    // 12.3.1 Configure the pin-based controls, and set fixed bits ([24.6.1], "Pin-Based VM-Execution Controls")
-    //    (Note: we're not using this field for the time being, but in testing you may; so it's included here for posterity purposes)
-    _SetPinBasedControls();
-    
-    // 12.1.2 Configure the primary processor controls ([24.6.2] "Processor-Based VM-Execution Controls")
-    _SetProcessorPrimaryControls();
+    // 12.2 Build the guest and host state fields from the snapshot, and write them all to the VMCS in one go
+    nFields = StateBuildVMCSFields( &lpInfo->CPUState, lpInfo->VMCSFields );
 
-    // 12.1.3 Configure the processor secondary controls ([24.6.2] "Processor-Based VM-Execution Controls")
-    //    (Note: we're not using this field for the time being, but in testing you may; so it's included here for posterity purposes)
-    _SetProcessorSecondaryControls();
-    
-    // 12.4 Configure the VM-exit controls ([24.7] "VM-Exit Control Fields")
-    _SetExitControls();
+    if ( !VMX_SUCCESS( StateCommitVMCSFields( lpInfo->VMCSFields, nFields, NULL ) ) )
+    {
+        __vmx_vmread( VMCS_RO_VM_INSTR_ERR, (size_t*)&lpInfo->InstrError );
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+
+        goto __vmx_off_lp;
+    }
 
-    // 12.5 Configure the VM-entry controls ([24.8] "VM-Entry Control Fields")
-    _SetEntryControls();
+    lpInfo->VMCSSetupCycles = __rdtsc() - setupTSC;
 
-    // 12.6 Set the VMCS link pointer to reflect our usage of the shadow VMCS ([26.3.1.5] "Checks on Guest Non-Register State")
+    // 12.3 Configure the VMCS control fields ([31.6] "Preparation and Launching a Virtual Machine")
+    //    (Note: the pin-based, processor-based, VM-exit and VM-entry controls were all built in DriverEntry; see _BuildControls)
+    _WriteControls();
+
+    // 12.4 Switch whatever MSRs this LP needs to on its transitions (see _RequestMSRs)
+    if ( _RequestMSRs( lpInfo ) == FALSE || _WriteMSRAreas( lpInfo ) == FALSE )
+    {
+        LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+        goto __vmx_off_lp;
+    }
+
+    // 12.5 Set the VMCS link pointer to reflect our usage of the shadow VMCS ([26.3.1.5] "Checks on Guest Non-Register State")
     __vmx_vmwrite( VMCS_GUEST_VMCS_LINK_PTR_FULL, MAXUINT64 );
 
-    // 12.7 Set the VMCS MSR bitmaps ([24.6.9] "MSR-Bitmap Address")
-    __vmx_vmwrite( VMCS_CTRL_ADDR_MSR_BITMAPS_FULL, (UINT64)g_LPInfo.MSRBitmap.PA );
+    // 12.6 Set the VMCS MSR bitmaps ([24.6.9] "MSR-Bitmap Address")
+    __vmx_vmwrite( VMCS_CTRL_ADDR_MSR_BITMAPS_FULL, (UINT64)lpInfo->MSRBitmap.PA );
 
+    // 12.7 Drop any translations cached for our EPTP before we first use it (e.g. by a VMM that ran before us)
+    if ( g_VMXControls.Secondary.EnableEPT == 1 )
+    {
+        _InvalidateEPT();
+    }
 
+    // 12.8 Tag the guest's translations with this LP's VPID, dropping any a VMM that ran before us left under it
+    if ( g_VMXControls.Secondary.EnableVPID == 1 )
+    {
+        __vmx_vmwrite( VMCS_CTRL_VPID, lpInfo->VPID );
+        VMXInvalidateVPID( lpInfo->VPID, VPID_INVALIDATE_CONTEXT, 0 );
+    }
 
-    // Hacky code here to capture the current state so that we can close out this function after our VM-exit
-    //  and successfully load our driver without bugchecking the system
-    RtlCaptureContext( &g_preLaunchCtx );
-    goto __save_state;
-__saved_ep_addr:
-    g_preLaunchCtx.Rip = pEpAddr;
+    // 12.9 Hide the CR4.VMXE bit we forced on from the guest, and keep it from clearing it ([24.6.6] "Guest/Host Masks and Read Shadows for CR0 and CR4")
+    cr4.All = 0;
+    cr4.VMXE = 1;
+    __vmx_vmwrite( VMCS_CTRL_CR4_GUEST_HOST_MASK, cr4.All );
+    __vmx_vmwrite( VMCS_CTRL_CR4_READ_SHADOW, lpInfo->OriginalCR4.All );
 
+    // 12.10 Record this LP's CPUID leaves (on this LP; some of them are its own), and hand the table to VMExitStub
+    //    (Note: the second slot of the host stack's reservation; see HOST_STACK_RESERVED in "Exit.h")
+    CpuidTableBuild( lpInfo->CPUIDTable, NULL, NULL, g_CPUIDOverrides, CPUID_OVERRIDE_COUNT );
 
+    *(PCPUID_TABLE*)((UINT64)lpInfo->HostStack.VA + KERNEL_STACK_SIZE - HOST_STACK_RESERVED + sizeof(PLP_INFO)) = lpInfo->CPUIDTable;
 
-    // 13. Virtualize the LP (if this is successful, it will jump to VMExitHandler)
-    __debugbreak();
-    NT_ASSERT( __vmx_vmlaunch() == VMX_OK );
 
 
+    // 13. Virtualize the LP (if this is successful, we return from VMLaunchLP as the guest)
+    launchStatus = VMLaunchLP();
 
-__save_state:
-    // Save the address of the next instruction (the comparison operation below)
-    utlGetNextInstrAddr( &pEpAddr );
-    if ( bSavedEpAddr == FALSE )
+    if ( launchStatus != VMX_OK )
     {
-        bSavedEpAddr = TRUE;
-        goto __saved_ep_addr;
+        // If the VMLAUNCH instruction itself failed, we're still in VMX operation; otherwise the guest state
+        //  failed its checks, and VMExitDispatch has already taken us out of VMX operation
+        if ( lpInfo->State == LP_STATE_VMCS_LOADED )
+        {
+            __vmx_vmread( VMCS_RO_VM_INSTR_ERR, (size_t*)&lpInfo->InstrError );
+            LpStateAdvance( &lpInfo->State, LP_STATE_FAILED );
+
+            goto __vmx_off_lp;
+        }
+
+        goto __restore_lp;
     }
 
-    __debugbreak();
+    // We're the guest now
+    LpStateAdvance( &lpInfo->State, LP_STATE_VIRTUALIZED );
+    lpInfo->LaunchCycles = __rdtsc() - startTSC;
+
+    KeLowerIrql( PreviousIRQL );
+
+    return 0;
+
+
 
+__vmx_off_lp:
+    __vmx_off();
+
+__restore_lp:
     // Reset GDT/IDT limit to prevent PG bugchecks
     //   (Per the specification: there is no field for the current host GDT/IDT limits, so the hardware simply sets them to max, [] "")
-    __lidt( &g_IDTR );
-    __lgdt( &g_GDTR );
+    __lidt( &lpInfo->IDTR );
+    __lgdt( &lpInfo->GDTR );
 
     // Restore CR0/4 states to pre-vmx operation
-    __writecr0( g_CR0.All );
-    __writecr4( g_CR4.All );
+    __writecr0( lpInfo->OriginalCR0.All );
+    __writecr4( lpInfo->OriginalCR4.All );
+
+    // Restore the IRQL we were broadcast at
+    KeLowerIrql( PreviousIRQL );
+
+    return 0;
+}
+
+ULONG_PTR
+_DevirtualizeLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // Note: this is an IPI broadcast worker, just like _VirtualizeLP
+
+    UINT64 startTSC;
+    PLP_INFO lpInfo;
+
+    UNREFERENCED_PARAMETER( Argument );
+
+    lpInfo = &g_LPInfo[KeGetCurrentProcessorNumberEx( NULL )];
+
+    if ( lpInfo->State != LP_STATE_VIRTUALIZED )
+    {
+        return 0;
+    }
 
+    startTSC = __rdtsc();
 
+    // We return from this as the host, outside of VMX operation (see _Devirtualize in "Exit.c"); unless the guest
+    //  still has external interrupts queued, which it can't take at the IRQL we're broadcast at (see DriverUnload)
+    if ( GuestVmcall( HYPERCALL_DEVIRTUALIZE, 0, 0 ) == FALSE )
+    {
+        return 0;
+    }
 
-    // Cleanup
+    lpInfo->TeardownCycles = __rdtsc() - startTSC;
+    LpStateAdvance( &lpInfo->State, LP_STATE_TORN_DOWN );
+
+    return 0;
+}
 
+UINT64
+_TouchTLBProbePages(
+    _In_ volatile UINT8* Pages
+    )
+{
+    // The cycles it takes to read one byte from each of the probe pages
+    UINT64 startTSC;
+    ULONG i;
 
+    startTSC = __rdtsc();
+
+    for ( i = 0; i < TLB_PROBE_PAGES; i++ )
+    {
+        (VOID)Pages[(SIZE_T)i * PAGE_SIZE];
+    }
+
+    return __rdtsc() - startTSC;
+}
+
+VOID
+_MeasureTLBRetention()
+{
+    /*
+     * Time touching a handful of pages right after a guest -> VMM -> guest round trip, and again with no exit
+     *  in between. Without VPIDs every VM-entry and VM-exit flushes the TLB ([28.3.3.1] "Operations that
+     *  Invalidate Cached Mappings"), so the difference is the page walks an exit costs the guest afterwards;
+     *  with VPIDs the guest's translations survive the exit, and the difference should be close to nothing.
+     */
+
+    KIRQL PreviousIRQL;
+
+    PUINT8 pages;
+    ULONG i;
+    int cpuInfo[4];
+
+    UINT64 noExitTotal = 0, afterExitTotal = 0;
+
+    pages = ExAllocatePoolWithTag( NonPagedPool, TLB_PROBE_PAGES * PAGE_SIZE, SPTHV_POOL_TAG );
+    if ( pages == NULL )
+    {
+        return;
+    }
+
+    RtlSecureZeroMemory( pages, TLB_PROBE_PAGES * PAGE_SIZE );
+
+    // Stay on this LP for the duration of the measurement
+    KeRaiseIrql( DISPATCH_LEVEL, &PreviousIRQL );
+
+    _TouchTLBProbePages( pages );
+
+    for ( i = 0; i < EXIT_ROUND_TRIP_ITERATIONS; i++ )
+    {
+        noExitTotal += _TouchTLBProbePages( pages );
+
+        __cpuid( cpuInfo, 0 );
+        afterExitTotal += _TouchTLBProbePages( pages );
+    }
 
-    // Restore PASSIVE_LEVEL IRQL
     KeLowerIrql( PreviousIRQL );
 
-    KdPrint(( "[SPTHv] Successfully performed VMX operation cycle\r\n" ));
+    ExFreePoolWithTag( pages, SPTHV_POOL_TAG );
+
+    KdPrint((
+        "[SPTHv] TLB probe (%u pages, VPIDs %s): %llu cycles without an exit, %llu cycles after one (avg)\r\n",
+        TLB_PROBE_PAGES,
+        (g_VMXControls.Secondary.EnableVPID == 1) ? "on" : "off",
+        noExitTotal / EXIT_ROUND_TRIP_ITERATIONS,
+        afterExitTotal / EXIT_ROUND_TRIP_ITERATIONS
+        ));
+}
+
+VOID
+_FreeAllLPs()
+{
+    ULONG i;
+
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        _FreeLP( &g_LPInfo[i] );
+    }
+
+    ExFreePoolWithTag( g_LPInfo, SPTHV_POOL_TAG );
+    g_LPInfo = NULL;
+
+    // Only once no LP is using them
+    TraceFree();
+    ProfileFree();
+    PmlFree();
+    VmfuncFree();
+    _FreeIOBitmap();
+    _FreeMSRBitmap();
+    _FreeEPT();
+}
+
+VOID
+DriverUnload(
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    ULONG i;
+    LARGE_INTEGER retryInterval;
+    ULONG virtualized;
+
+    // No more requests from user mode
+    DeviceDelete( DriverObject );
+
+    // Let external interrupts go straight to the guest again, so that no more are queued on an LP we're leaving
+    IntrStop();
+
+    // Take every LP back out of VMX operation, all at once; an LP with interrupts still queued stays, and takes them
+    //  once we're back at PASSIVE_LEVEL, so it's just a matter of trying again
+    retryInterval.QuadPart = -10000;    // 1ms
+
+    for ( ;; )
+    {
+        KeIpiGenericCall( _DevirtualizeLP, 0 );
+
+        virtualized = 0;
+
+        for ( i = 0; i < g_LPCount; i++ )
+        {
+            virtualized += (g_LPInfo[i].State == LP_STATE_VIRTUALIZED);
+        }
+
+        if ( virtualized == 0 )
+        {
+            break;
+        }
+
+        KdPrint(( "[SPTHv] %lu LPs still have external interrupts queued; trying again\r\n", virtualized ));
+        KeDelayExecutionThread( KernelMode, FALSE, &retryInterval );
+    }
+
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        KdPrint((
+            "[SPTHv] LP %lu: state %d, teardown %llu cycles\r\n",
+            i,
+            g_LPInfo[i].State,
+            g_LPInfo[i].TeardownCycles
+            ));
+
+        // (Note: reads saved per exit is ReadsSaved / Exits)
+        KdPrint((
+            "[SPTHv] LP %lu: %llu exits, %llu VMREADs (%llu saved), %llu VMWRITEs (%llu saved)\r\n",
+            i,
+            g_LPInfo[i].ExitCache.Exits,
+            g_LPInfo[i].ExitCache.VMReads,
+            g_LPInfo[i].ExitCache.ReadsSaved,
+            g_LPInfo[i].ExitCache.VMWrites,
+            g_LPInfo[i].ExitCache.WritesSaved
+            ));
+    }
+
+    _FreeAllLPs();
+}
+
+NTSTATUS
+DriverEntry(
+    _In_ PDRIVER_OBJECT DriverObject,
+    _In_ PUNICODE_STRING RegistryPath
+    )
+{
+    ULONG i;
+    LP_STATE_SUMMARY summary;
+
+    LARGE_INTEGER qpcFrequency;
+    LARGE_INTEGER qpcStart, qpcEnd;
+
+    SPTHV_EXIT_BENCHMARK benchmark;
+
+    UNREFERENCED_PARAMETER( RegistryPath );
+
+
+
+    // DriverEntry always runs in the context of the system process; this is the address space our VMM runs in
+    g_SystemCR3 = __readcr3();
+
+    // Read every VMX capability MSR once; they're the same on every LP, and everything below is derived from them
+    VMXCaptureCapabilities( &g_VMXCapabilities, NULL, NULL );
+
+    // Build the controls every LP will run with, and refuse to load if the processor can't give us the ones we need
+    if ( _BuildControls() == FALSE )
+    {
+        KdPrint(( "[SPTHv] This processor doesn't support the VMX controls we require\r\n" ));
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // Build the EPT identity map every LP shares
+    if ( _BuildEPT() == FALSE )
+    {
+        KdPrint(( "[SPTHv] Failed to build the EPT identity map\r\n" ));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Build the MSR intercepts every LP shares
+    if ( _BuildMSRBitmap() == FALSE )
+    {
+        _FreeEPT();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    // Free our allocated data structures
-    utlFreeVMXData( &g_LPInfo.VMCS, TRUE );
+    // Build the port intercepts every LP shares
+    if ( _BuildIOBitmap() == FALSE )
+    {
+        _FreeMSRBitmap();
+        _FreeEPT();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Allocate an LP_INFO for every active LP in the system (across all processor groups)
+    g_LPCount = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+
+    g_LPInfo = ExAllocatePoolWithTag( NonPagedPool, g_LPCount * sizeof(LP_INFO), SPTHV_POOL_TAG );
+    if ( g_LPInfo == NULL )
+    {
+        _FreeIOBitmap();
+        _FreeMSRBitmap();
+        _FreeEPT();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    utlFreeVMXData( &g_LPInfo.VMXONRegion, TRUE );
+    RtlSecureZeroMemory( g_LPInfo, g_LPCount * sizeof(LP_INFO) );
 
-    utlFreeVMXData( &g_LPInfo.MSRBitmap, TRUE );
+    // Every LP's trace ring; we run just the same without them, only untraced
+    if ( TraceInitialize( g_LPCount ) == FALSE )
+    {
+        KdPrint(( "[SPTHv] Failed to allocate the trace rings\r\n" ));
+    }
 
-    utlFreeVMXData( &g_LPInfo.HostStack, FALSE );
+    // The TSC's frequency, which the guest's TSC rate (and the profiler's period) is worked out from
+    TscInitialize();
+
+    // What the guest's extended state can be borrowed with; without XSAVE, exit handlers get none of it
+    if ( XStateInitialize() == FALSE )
+    {
+        KdPrint(( "[SPTHv] XSAVE isn't enabled; exit handlers can't borrow the guest's extended state\r\n" ));
+    }
+
+    // Every LP's profile table; likewise optional
+    if ( ProfileInitialize( g_LPCount ) == FALSE )
+    {
+        KdPrint(( "[SPTHv] Failed to allocate the profile tables\r\n" ));
+    }
+
+    // Dirty-page tracking, if the processor can log page modifications; likewise optional
+    //    (Note: this turns on the EPT dirty flags, so it has to come before any LP is launched)
+    if ( PmlInitialize() == FALSE )
+    {
+        KdPrint(( "[SPTHv] Page-modification logging isn't available; running without dirty-page tracking\r\n" ));
+    }
+
+    // EPT views the guest can switch between itself, if the processor has EPTP switching; likewise optional
+    //    (Note: each view is a copy of the identity map, EPT dirty flags and all, so this has to come after PML)
+    if ( VmfuncInitialize() == FALSE )
+    {
+        KdPrint(( "[SPTHv] EPTP switching isn't available; the guest has the one EPT view\r\n" ));
+    }
+
+    // Virtualization exceptions; without the processor's help, we deliver them on the EPT violation exits ourselves
+    if ( VeInitialize() == FALSE )
+    {
+        KdPrint(( "[SPTHv] The processor can't deliver #VEs; any the guest asks for cost an exit\r\n" ));
+    }
+
+    // Taking external interrupts on exits; off until asked for (see IntrStart), as every interrupt then costs an exit
+    if ( IntrInitialize() == FALSE )
+    {
+        KdPrint(( "[SPTHv] External interrupts can't be taken on exits; they always go straight to the guest\r\n" ));
+    }
+
+    // Steps 1-6 for each LP (see _AllocateLP)
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        g_LPInfo[i].Index = i;
+        g_LPInfo[i].TraceRing = TraceGetRing( i );
+        g_LPInfo[i].Profile = ProfileGetTable( i );
+        g_LPInfo[i].TscMultiplier = TSC_MULTIPLIER_ONE;
+
+        if ( _AllocateLP( &g_LPInfo[i], g_VMXCapabilities.Basic.RevisionIdentifier ) == FALSE )
+        {
+            KdPrint(( "[SPTHv] Failed to allocate the VMX regions for LP %lu\r\n", i ));
+        }
+    }
+
+
+
+    // Every LP shares the same VM-exit handlers; these need to be in place before the first exit
+    VMExitInitializeHandlers();
+
+
+
+    // Steps 7-13 on every LP at once (see _VirtualizeLP)
+    //    (Note: KeIpiGenericCall doesn't return until every LP has finished the broadcast worker)
+    qpcStart = KeQueryPerformanceCounter( &qpcFrequency );
+
+    KeIpiGenericCall( _VirtualizeLP, 0 );
+
+    qpcEnd = KeQueryPerformanceCounter( NULL );
+
+    RtlSecureZeroMemory( &summary, sizeof(summary) );
+
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        LpStateTally( &summary, g_LPInfo[i].State, g_LPInfo[i].LaunchCycles );
+
+        KdPrint((
+            "[SPTHv] LP %lu: state %d, instruction error %llu, bring-up %llu cycles (guest/host state %llu cycles)\r\n",
+            i,
+            g_LPInfo[i].State,
+            g_LPInfo[i].InstrError,
+            g_LPInfo[i].LaunchCycles,
+            g_LPInfo[i].VMCSSetupCycles
+            ));
+    }
+
+    KdPrint((
+        "[SPTHv] Virtualized %lu of %lu LPs in %llu us (bring-up %llu - %llu cycles)\r\n",
+        summary.States[LP_STATE_VIRTUALIZED],
+        summary.Count,
+        ((qpcEnd.QuadPart - qpcStart.QuadPart) * 1000000) / qpcFrequency.QuadPart,
+        summary.MinCycles,
+        summary.MaxCycles
+        ));
+
+    // A partially virtualized system isn't of much use to anyone; back out of all of it
+    if ( summary.States[LP_STATE_VIRTUALIZED] != g_LPCount )
+    {
+        KeIpiGenericCall( _DevirtualizeLP, 0 );
+        _FreeAllLPs();
+
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // Time every exit the benchmark suite can cause once, to have a baseline in the log; IOCTL_SPTHV_RUN_EXIT_BENCHMARK reruns it
+    BenchInitialize();
+
+    if ( NT_SUCCESS( BenchRunExitSuite( SPTHV_BENCH_DEFAULT_ITERATIONS, &benchmark ) ) )
+    {
+        BenchReport( &benchmark );
+    }
+
+    _MeasureTLBRetention();
+
+    // Our device is only for measurements and diagnostics; the hypervisor runs just the same without it
+    if ( !NT_SUCCESS( DeviceCreate( DriverObject ) ) )
+    {
+        KdPrint(( "[SPTHv] Failed to create our device\r\n" ));
+    }
 
-    utlFreeVMXData( &g_LPInfo.VMStack, FALSE );
+    // We stay loaded (and every LP stays virtualized) until we're unloaded
+    DriverObject->DriverUnload = DriverUnload;
 
-    // Regardless of whether or not the driver was successful, there is no reason to keep it loaded.
-    //    Seeing this status does not necessarily indicate an error.
-    return STATUS_UNSUCCESSFUL;
+    return STATUS_SUCCESS;
 }
@@ -9,15 +9,53 @@
 #include "VMX.h"
 #include "VMCS.h"
 #include "Seg.h"
+#include "State.h"
+#include "LPState.h"
+#include "EPT.h"
+#include "EPTList.h"
+#include "VEInfo.h"
+#include "IntrQueue.h"
+#include "Dirty.h"
+#include "MSRBitmap.h"
+#include "MSRArea.h"
+#include "IOBitmap.h"
+#include "GuestWalk.h"
+#include "Stats.h"
+#include "Bench.h"
+#include "Intercept.h"
+#include "Device.h"
+#include "Trace.h"
+#include "TraceRing.h"
+#include "Profile.h"
+#include "PML.h"
+#include "VMFunc.h"
+#include "VE.h"
+#include "Interrupt.h"
+#include "TSC.h"
+#include "XState.h"
+#include "CPUIDTable.h"
+#include "Exit.h"
 
 #include "Utils.h"
+#include "Arena.h"
 
 DRIVER_INITIALIZE DriverEntry;
+DRIVER_UNLOAD DriverUnload;
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text( INIT, DriverEntry )
 #endif // ALLOC_PRAGMA
 
+// The size of the arena each LP's host stack and VMX regions are carved out of (see _AllocateLP in "Driver.c")
+//	(Note: the host stack, VMXON region, VMCS, PML log, #VE area, MSR areas, XSAVE area, CPUID table and exit counters)
+#define LP_ARENA_SIZE (KERNEL_STACK_SIZE + 4 * PAGE_SIZE + ROUND_TO_PAGES( 2 * MSR_AREA_SIZE ) + XSTATE_AREA_SIZE + ROUND_TO_PAGES( sizeof(CPUID_TABLE) ) + ROUND_TO_PAGES( sizeof(EXIT_STATS) ))
+
+// The number of times the TLB probe pages are timed in _MeasureTLBRetention
+#define EXIT_ROUND_TRIP_ITERATIONS 1000
+
+// The number of pages touched after each exit in _MeasureTLBRetention (well within any L1 DTLB)
+#define TLB_PROBE_PAGES 32
+
 //
 // External definitions
 //
@@ -29,8 +67,6 @@ RtlRestoreContext (
 	PEXCEPTION_RECORD ExceptionRecord
 	);
 
-extern void GuestEntry();
-
 
 
 //
@@ -39,38 +75,150 @@ extern void GuestEntry();
 
 typedef struct _LP_INFO
 {
-	VMX_ADDRESS VMCode;
-	VMX_ADDRESS VMStack;
-	VMX_ADDRESS HostCode;
+	ULONG Index;
+	volatile LP_STATE State;
+
+	// The node-local block every region below lives in
+	ARENA Arena;
+
 	VMX_ADDRESS HostStack;
 	VMX_ADDRESS VMXONRegion;
 	VMX_ADDRESS VMCS;
+
+	// The MSR bitmap this LP runs with; g_MSRBitmap, unless it's been given an intercept policy of its own
 	VMX_ADDRESS MSRBitmap;
+
+	// The VPID the guest's translations are tagged with on this LP; 0 if VPIDs aren't enabled
+	UINT16 VPID;
+
+	// Where this LP's exits are traced to (see TraceRingWrite in "Trace.c"); NULL if the rings couldn't be allocated
+	PSPTHV_TRACE_RING TraceRing;
+
+	// Where this LP's guest samples are counted, and how often they're taken (see "Profile.c"); a period of 0 means
+	//	the preemption timer isn't armed
+	PSPTHV_PROFILE_TABLE Profile;
+	UINT32 ProfilePeriod;
+
+	// The TSC multiplier and offset the guest's RDTSC goes through on this LP (see "TSC.c")
+	UINT64 TscMultiplier;
+	UINT64 TscOffset;
+
+	// The 4KB page this LP logs the guest's page modifications to, while dirty tracking is on (see "PML.c")
+	VMX_ADDRESS PMLBuffer;
+
+	// The 4KB page the processor (or we) describe each #VE delivered on this LP in, and whether they're delivered on it
+	//	(see "VE.c")
+	VMX_ADDRESS VEInfo;
+	BOOLEAN VEEnabled;
+
+	// The external interrupts taken on this LP's exits that the guest couldn't be handed yet, and whether it's running
+	//	with interrupt-window (or, while its TPR holds them back, CR8-load) exiting until it can (see _DeliverQueuedInterrupts
+	//	in "Exit.c")
+	INTR_QUEUE Interrupts;
+	BOOLEAN InterruptWindow;
+	BOOLEAN CR8LoadExiting;
+
+	// The MSRs switched on this LP's transitions (see _RequestMSRs in "Driver.c"), and the areas and controls they were built
+	//	into before it was launched (see _WriteMSRAreas in "Driver.c"); the guest area is both stored on exit and loaded on entry
+	MSR_AREA_REQUEST MSRRequests[MSR_AREA_MAX_REQUESTS];
+	ULONG MSRRequestCount;
+	VMX_ADDRESS GuestMSRArea;
+	VMX_ADDRESS HostMSRArea;
+	MSR_AREA_LAYOUT MSRLayout;
+
+	// The guest's extended state an exit handler has borrowed on this LP, if any (see XStateSave in "XState.c")
+	XSTATE_CONTEXT XState;
+
+	// This LP's CPUID leaves, recorded before it was launched; most CPUID exits are answered from it by VMExitStub
+	//	(see CpuidTableBuild in "CPUIDTable.c")
+	PCPUID_TABLE CPUIDTable;
+
+	// The page this LP's exit handlers get at guest memory through (see _ExitIOString in "Exit.c")
+	PHYSICAL_WINDOW PhysicalWindow;
+
+	// The guest context we leave VMX operation into (see _Devirtualize in "Exit.c")
+	CONTEXT DevirtualizeCtx;
+
+	// State captured on this LP prior to entering VMX operation, and restored if we fail to launch
+	//	(Note: each LP has its own GDT/IDT on Windows, so these can't be shared)
+	SYSTEM_TABLE_REGISTER GDTR, IDTR;
+	CR0 OriginalCR0;
+	CR4 OriginalCR4;
+
+	// VM-instruction error ([30.4] "VM Instruction Error Numbers"), or the exit reason of a failed VM-entry,
+	//	when State is LP_STATE_FAILED
+	UINT64 InstrError;
+
+	// The snapshot our guest and host state areas were built from, and the VMCS fields built from it (see "State.c")
+	CPU_STATE CPUState;
+	VMCS_FIELD_VALUE VMCSFields[STATE_VMCS_FIELD_COUNT];
+
+	// The current exit's VMCS fields (see VMExitRead in "Exit.c")
+	VMCS_CACHE ExitCache;
+
+	// This LP's exit counters, carved out of Arena (see StatsRecordExit in "Stats.c")
+	PEXIT_STATS ExitStats;
+
+	// Bring-up and teardown timings, in TSC ticks
+	UINT64 LaunchCycles;
+	UINT64 VMCSSetupCycles;
+	UINT64 TeardownCycles;
 } LP_INFO, *PLP_INFO;
 
 
 
+// The VM-execution, VM-exit and VM-entry controls every LP runs with (see _BuildControls in "Driver.c")
+typedef struct _VMX_CONTROLS
+{
+	PIN_VM_EXEC_CTRLS PinBased;
+	PROCESSOR_PRIMARY_VM_EXEC_CTRLS Primary;
+	PROCESSOR_SECONDARY_VM_EXEC_CTRLS Secondary;
+	VM_EXIT_CTRLS Exit;
+	VM_ENTRY_CTRLS Entry;
+} VMX_CONTROLS, *PVMX_CONTROLS;
+
+
+
 //
 // Globals
 //
 
-static LP_INFO g_LPInfo;
+// One entry per active LP, indexed by KeGetCurrentProcessorNumberEx
+extern PLP_INFO g_LPInfo;
+
+extern ULONG g_LPCount;
+
+// The system process' address space; which every LP uses as the host
+extern UINT64 g_SystemCR3;
 
-static CONTEXT g_preLaunchCtx;
+extern VMX_CONTROLS g_VMXControls;
 
-static SYSTEM_TABLE_REGISTER g_GDTR, g_IDTR;
+// The guest-physical identity map every LP shares (see _BuildEPT in "Driver.c")
+extern EPT_VIEW g_EPTView;
 
-static CR0 g_CR0;
+// The MSR intercepts every LP shares (see _BuildMSRBitmap in "Driver.c")
+extern VMX_ADDRESS g_MSRBitmap;
 
-static CR4 g_CR4;
+// The port intercepts every LP shares (see _BuildIOBitmap in "Driver.c")
+extern VMX_ADDRESS g_IOBitmap;
 
 
 //
 // Function definitions
 //
 
+ULONG_PTR
+_VirtualizeLP(
+	_In_ ULONG_PTR Argument
+	);
+
+ULONG_PTR
+_DevirtualizeLP(
+	_In_ ULONG_PTR Argument
+	);
+
 VOID
-VMExitHandler();
+_InvalidateEPT();
 
 NTSTATUS
 DriverEntry(
@@ -78,5 +226,10 @@ DriverEntry(
 	PUNICODE_STRING RegistryPath
 	);
 
+VOID
+DriverUnload(
+	PDRIVER_OBJECT DriverObject
+	);
+
 
 #endif // __DRIVER_H__
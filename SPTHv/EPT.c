@@ -0,0 +1,772 @@
+#include "EPT.h"
+
+/*
+ * Notes for testing:
+ *
+ * Everything in here works on an EPT_VIEW, whose tables all come out of one physically contiguous
+ *  pool (see EPT_PAGE_POOL); nothing in here allocates, maps or translates memory through the OS, so
+ *  the builder can just as well be pointed at an ordinary buffer and a made-up list of RAM ranges.
+ *
+ * None of these functions synchronize with each other, or with the processor; callers serialize
+ *  changes to a view, and invalidate (INVEPT) any view that's already in use afterwards.
+ *  The exceptions are EptClearDirty and EptClearAllDirty, which only ever clear the dirty flag (atomically,
+ *  as the processor sets it) and so may be run against a live view; the INVEPT is still the caller's to do.
+ *
+ * Every table starts out with the suppress-#VE bit set in all of its entries, and every page we map keeps it set;
+ *  `!dq` a fresh table and each entry reads 80000000`00000000, not 0.
+ *
+ * Use `!ept` (or walk by hand from the EPTP, via `!dq`) to view the tables of a running view
+ */
+
+UINT8
+_RangeMemoryType(
+    _In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+    _In_ CONST ULONG RangeCount,
+    _In_ CONST UINT64 Base,
+    _In_ CONST UINT64 Size,
+    _Out_ BOOLEAN* Uniform
+    )
+{
+    /*
+     * The memory type for [Base, Base + Size): write-back if it's all RAM, and uncacheable if none of it is.
+     *  A range that's part RAM, part not, can't be mapped by one page (Uniform is FALSE).
+     *
+     *  (Note: everything that isn't RAM is MMIO, or a hole, as far as we're concerned; and the OS has mapped
+     *  those regions itself with the memory type it wants, via PAT, which combines with our UC to UC/WC)
+     */
+
+    UINT64 covered = 0;
+    UINT64 low, high;
+    ULONG i;
+
+    for ( i = 0; i < RangeCount; i++ )
+    {
+        low = max( Base, RAMRanges[i].Base );
+        high = min( Base + Size, RAMRanges[i].Base + RAMRanges[i].Length );
+
+        if ( high > low )
+        {
+            covered += high - low;
+        }
+    }
+
+    *Uniform = (covered == 0 || covered == Size);
+
+    return (covered == Size) ? EPT_MEMORY_TYPE_WB : EPT_MEMORY_TYPE_UC;
+}
+
+PEPT_ENTRY
+_AllocateTable(
+    _Inout_ PEPT_VIEW View,
+    _Out_ UINT64* TablePA
+    )
+{
+    PEPT_ENTRY table;
+    ULONG i;
+
+    if ( View->Pool.PagesUsed >= View->Pool.PageCount )
+    {
+        return NULL;
+    }
+
+    table = (PEPT_ENTRY)(View->Pool.VA + (UINT64)View->Pool.PagesUsed * EPT_PAGE_SIZE);
+    *TablePA = View->Pool.PA + (UINT64)View->Pool.PagesUsed * EPT_PAGE_SIZE;
+
+    View->Pool.PagesUsed++;
+
+    // Nothing mapped yet; and none of it convertible, should anything ever touch it (see EPT_ENTRY_SUPPRESS_VE)
+    for ( i = 0; i < EPT_ENTRIES_PER_TABLE; i++ )
+    {
+        table[i].All = EPT_ENTRY_SUPPRESS_VE;
+    }
+
+    return table;
+}
+
+PEPT_ENTRY
+_TableFromEntry(
+    _In_ CONST PEPT_VIEW View,
+    _In_ CONST EPT_ENTRY Entry
+    )
+{
+    // Every table lives in the view's (contiguous) pool, so its VA is just an offset from the pool's
+    return (PEPT_ENTRY)(View->Pool.VA + (((UINT64)Entry.PFN << 12) - View->Pool.PA));
+}
+
+VOID
+_SetTableEntry(
+    _Out_ PEPT_ENTRY Entry,
+    _In_ CONST UINT64 TablePA
+    )
+{
+    // Entries that reference another table allow everything; the leaf entries decide what's allowed
+    EPT_ENTRY entry;
+
+    entry.All = 0;
+    entry.Read = 1;
+    entry.Write = 1;
+    entry.Execute = 1;
+    entry.PFN = TablePA >> 12;
+
+    Entry->All = entry.All;
+}
+
+VOID
+_SetLeafEntry(
+    _Out_ PEPT_ENTRY Entry,
+    _In_ CONST UINT64 PA,
+    _In_ CONST UINT8 MemoryType,
+    _In_ CONST BOOLEAN LargePage
+    )
+{
+    EPT_ENTRY entry;
+
+    entry.All = 0;
+    entry.Read = 1;
+    entry.Write = 1;
+    entry.Execute = 1;
+    entry.MemoryType = MemoryType;
+    entry.LargePage = LargePage;
+    entry.PFN = PA >> 12;
+    entry.SuppressVE = 1;
+
+    Entry->All = entry.All;
+}
+
+BOOLEAN
+_MapGigabyte(
+    _Inout_ PEPT_VIEW View,
+    _Inout_ PEPT_ENTRY PDPTE,
+    _In_ CONST UINT64 Base,
+    _In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+    _In_ CONST ULONG RangeCount
+    )
+{
+    // Map [Base, Base + 1GB) with 2MB pages, using 4KB pages for only those 2MB which need them
+
+    PEPT_ENTRY pd, pt;
+    UINT64 tablePA;
+    UINT64 pa2MB, pa4KB;
+    UINT8 memoryType;
+    BOOLEAN uniform;
+    ULONG i, j;
+
+    pd = _AllocateTable( View, &tablePA );
+    if ( pd == NULL )
+    {
+        return FALSE;
+    }
+
+    _SetTableEntry( PDPTE, tablePA );
+
+    for ( i = 0; i < EPT_ENTRIES_PER_TABLE; i++ )
+    {
+        pa2MB = Base + i * EPT_LARGE_PAGE_SIZE;
+
+        memoryType = _RangeMemoryType( RAMRanges, RangeCount, pa2MB, EPT_LARGE_PAGE_SIZE, &uniform );
+
+        if ( uniform == TRUE )
+        {
+            _SetLeafEntry( &pd[i], pa2MB, memoryType, TRUE );
+            View->LargePages++;
+            continue;
+        }
+
+        pt = _AllocateTable( View, &tablePA );
+        if ( pt == NULL )
+        {
+            return FALSE;
+        }
+
+        _SetTableEntry( &pd[i], tablePA );
+
+        for ( j = 0; j < EPT_ENTRIES_PER_TABLE; j++ )
+        {
+            pa4KB = pa2MB + j * EPT_PAGE_SIZE;
+
+            // (Note: RAM ranges are page aligned, so every 4KB page is uniform)
+            memoryType = _RangeMemoryType( RAMRanges, RangeCount, pa4KB, EPT_PAGE_SIZE, &uniform );
+
+            _SetLeafEntry( &pt[j], pa4KB, memoryType, FALSE );
+            View->Pages++;
+        }
+    }
+
+    return TRUE;
+}
+
+ULONG
+EptCountTablePages(
+    _In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+    _In_ CONST ULONG RangeCount,
+    _In_ CONST UINT64 MapLimit,
+    _In_ CONST BOOLEAN UseHugePages
+    )
+{
+    // The exact number of table pages EptBuildIdentityMap will use, with the same arguments
+
+    ULONG pages;
+    UINT64 pa1GB, pa2MB;
+    BOOLEAN uniform;
+
+    // The PML4, and one PDPT per 512GB
+    pages = 1 + (ULONG)((MapLimit + EPT_PML4E_COVERAGE - 1) / EPT_PML4E_COVERAGE);
+
+    for ( pa1GB = 0; pa1GB < MapLimit; pa1GB += EPT_HUGE_PAGE_SIZE )
+    {
+        _RangeMemoryType( RAMRanges, RangeCount, pa1GB, EPT_HUGE_PAGE_SIZE, &uniform );
+
+        if ( UseHugePages == TRUE && uniform == TRUE )
+        {
+            continue;
+        }
+
+        // A PD, and a PT for every 2MB that isn't uniform
+        pages++;
+
+        for ( pa2MB = pa1GB; pa2MB < pa1GB + EPT_HUGE_PAGE_SIZE; pa2MB += EPT_LARGE_PAGE_SIZE )
+        {
+            _RangeMemoryType( RAMRanges, RangeCount, pa2MB, EPT_LARGE_PAGE_SIZE, &uniform );
+
+            if ( uniform == FALSE )
+            {
+                pages++;
+            }
+        }
+    }
+
+    return pages;
+}
+
+BOOLEAN
+EptBuildIdentityMap(
+    _Inout_ PEPT_VIEW View,
+    _In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+    _In_ CONST ULONG RangeCount,
+    _In_ CONST UINT64 MapLimit,
+    _In_ CONST BOOLEAN UseHugePages
+    )
+{
+    /*
+     * Map every guest-physical address below MapLimit (which must be 1GB aligned) to the same host-physical
+     *  address, using the largest pages we can ([28.2.2] "EPT Translation Mechanism"): 1GB pages (if
+     *  UseHugePages is set, and the processor supports them, [A.10]), then 2MB pages, and 4KB pages only
+     *  around the edges of RAM.
+     *
+     *  The view's pool must already be set up, with at least EptCountTablePages pages in it
+     */
+
+    PEPT_ENTRY pml4e, pdpt;
+    UINT64 tablePA;
+    UINT64 pa1GB;
+    UINT8 memoryType;
+    BOOLEAN uniform;
+
+    NT_ASSERT( MapLimit % EPT_HUGE_PAGE_SIZE == 0 );
+
+    View->MapLimit = MapLimit;
+    View->HugePages = 0;
+    View->LargePages = 0;
+    View->Pages = 0;
+
+    View->PML4 = _AllocateTable( View, &tablePA );
+    if ( View->PML4 == NULL )
+    {
+        return FALSE;
+    }
+
+    // [24.6.11] "Extended-Page-Table Pointer (EPTP)"
+    View->EPTP.All = 0;
+    View->EPTP.MemoryType = EPT_MEMORY_TYPE_WB;
+    View->EPTP.PageWalkLength = EPT_PAGE_WALK_LENGTH_4;
+    View->EPTP.PFN = tablePA >> 12;
+
+    for ( pa1GB = 0; pa1GB < MapLimit; pa1GB += EPT_HUGE_PAGE_SIZE )
+    {
+        pml4e = &View->PML4[EPT_PML4_INDEX(pa1GB)];
+
+        if ( EPT_ENTRY_IS_EMPTY( *pml4e ) )
+        {
+            pdpt = _AllocateTable( View, &tablePA );
+            if ( pdpt == NULL )
+            {
+                return FALSE;
+            }
+
+            _SetTableEntry( pml4e, tablePA );
+        }
+        else
+        {
+            pdpt = _TableFromEntry( View, *pml4e );
+        }
+
+        memoryType = _RangeMemoryType( RAMRanges, RangeCount, pa1GB, EPT_HUGE_PAGE_SIZE, &uniform );
+
+        if ( UseHugePages == TRUE && uniform == TRUE )
+        {
+            _SetLeafEntry( &pdpt[EPT_PDPT_INDEX(pa1GB)], pa1GB, memoryType, TRUE );
+            View->HugePages++;
+            continue;
+        }
+
+        if ( _MapGigabyte( View, &pdpt[EPT_PDPT_INDEX(pa1GB)], pa1GB, RAMRanges, RangeCount ) == FALSE )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+_SplitEntry(
+    _Inout_ PEPT_VIEW View,
+    _Inout_ PEPT_ENTRY Entry,
+    _In_ CONST UINT64 ChildSize
+    )
+{
+    /*
+     * Replace a 1GB (or 2MB) page with a table of 512 2MB (or 4KB) pages, which map exactly what it
+     *  did, with the same permissions and memory type
+     */
+
+    PEPT_ENTRY table;
+    UINT64 tablePA;
+    ULONG i;
+
+    table = _AllocateTable( View, &tablePA );
+    if ( table == NULL )
+    {
+        return FALSE;
+    }
+
+    for ( i = 0; i < EPT_ENTRIES_PER_TABLE; i++ )
+    {
+        table[i].All = Entry->All;
+        table[i].LargePage = (ChildSize != EPT_PAGE_SIZE);
+        table[i].PFN = Entry->PFN + i * (ChildSize >> 12);
+    }
+
+    // The processor sees either the old page, or the new table; never anything in between
+    _SetTableEntry( Entry, tablePA );
+
+    if ( ChildSize == EPT_LARGE_PAGE_SIZE )
+    {
+        View->HugePages--;
+        View->LargePages += EPT_ENTRIES_PER_TABLE;
+    }
+    else
+    {
+        View->LargePages--;
+        View->Pages += EPT_ENTRIES_PER_TABLE;
+    }
+
+    return TRUE;
+}
+
+PEPT_ENTRY
+EptGetPageEntry(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Split
+    )
+{
+    /*
+     * Find the entry that maps GuestPA. If Split is set, this is always a 4KB PTE; any large page mapping
+     *  GuestPA is split down first. Otherwise, this is whichever entry maps it (which may be a PDPTE or PDE).
+     *
+     *  Returns NULL if GuestPA isn't mapped, or there's no room left in the pool to split
+     */
+
+    PEPT_ENTRY pml4e, pdpte, pde;
+
+    if ( GuestPA >= View->MapLimit )
+    {
+        return NULL;
+    }
+
+    pml4e = &View->PML4[EPT_PML4_INDEX(GuestPA)];
+    if ( EPT_ENTRY_IS_EMPTY( *pml4e ) )
+    {
+        return NULL;
+    }
+
+    pdpte = &_TableFromEntry( View, *pml4e )[EPT_PDPT_INDEX(GuestPA)];
+
+    if ( pdpte->LargePage == 1 )
+    {
+        if ( Split == FALSE )
+        {
+            return pdpte;
+        }
+
+        if ( _SplitEntry( View, pdpte, EPT_LARGE_PAGE_SIZE ) == FALSE )
+        {
+            return NULL;
+        }
+    }
+
+    pde = &_TableFromEntry( View, *pdpte )[EPT_PD_INDEX(GuestPA)];
+
+    if ( pde->LargePage == 1 )
+    {
+        if ( Split == FALSE )
+        {
+            return pde;
+        }
+
+        if ( _SplitEntry( View, pde, EPT_PAGE_SIZE ) == FALSE )
+        {
+            return NULL;
+        }
+    }
+
+    return &_TableFromEntry( View, *pde )[EPT_PT_INDEX(GuestPA)];
+}
+
+BOOLEAN
+EptSplitLargePage(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA
+    )
+{
+    // Split whichever large page maps GuestPA one level down (1GB into 2MB pages, or 2MB into 4KB pages)
+
+    PEPT_ENTRY entry;
+    PEPT_ENTRY pml4e;
+
+    entry = EptGetPageEntry( View, GuestPA, FALSE );
+    if ( entry == NULL || entry->LargePage == 0 )
+    {
+        return FALSE;
+    }
+
+    // PDPTEs are the only entries that live in a table referenced by the PML4
+    pml4e = &View->PML4[EPT_PML4_INDEX(GuestPA)];
+
+    if ( entry == &_TableFromEntry( View, *pml4e )[EPT_PDPT_INDEX(GuestPA)] )
+    {
+        return _SplitEntry( View, entry, EPT_LARGE_PAGE_SIZE );
+    }
+
+    return _SplitEntry( View, entry, EPT_PAGE_SIZE );
+}
+
+PEPT_ENTRY
+EptGetLeafEntry(
+    _In_ CONST PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _Out_ PUINT64 PageSize
+    )
+{
+    /*
+     * Find the entry that maps GuestPA, whatever its size (without splitting anything), and the size of the
+     *  page it maps. Returns NULL if GuestPA isn't mapped.
+     */
+
+    PEPT_ENTRY pml4e, pdpte, pde;
+
+    *PageSize = 0;
+
+    if ( GuestPA >= View->MapLimit )
+    {
+        return NULL;
+    }
+
+    pml4e = &View->PML4[EPT_PML4_INDEX(GuestPA)];
+    if ( EPT_ENTRY_IS_EMPTY( *pml4e ) )
+    {
+        return NULL;
+    }
+
+    pdpte = &_TableFromEntry( View, *pml4e )[EPT_PDPT_INDEX(GuestPA)];
+    if ( pdpte->LargePage == 1 )
+    {
+        *PageSize = EPT_HUGE_PAGE_SIZE;
+        return pdpte;
+    }
+
+    pde = &_TableFromEntry( View, *pdpte )[EPT_PD_INDEX(GuestPA)];
+    if ( pde->LargePage == 1 )
+    {
+        *PageSize = EPT_LARGE_PAGE_SIZE;
+        return pde;
+    }
+
+    *PageSize = EPT_PAGE_SIZE;
+
+    return &_TableFromEntry( View, *pde )[EPT_PT_INDEX(GuestPA)];
+}
+
+BOOLEAN
+_ClearDirtyEntry(
+    _Inout_ PEPT_ENTRY Entry
+    )
+{
+    // The processor sets the dirty flag with a locked update of its own; so we clear it with one too, and only when it's set
+    if ( Entry->Dirty == 0 )
+    {
+        return FALSE;
+    }
+
+    InterlockedAnd64( (volatile LONG64*)&Entry->All, ~(LONG64)EPT_ENTRY_DIRTY );
+
+    return TRUE;
+}
+
+BOOLEAN
+EptClearDirty(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _Out_ PUINT64 PageSize
+    )
+{
+    /*
+     * Clear the dirty flag of whichever page maps GuestPA, so that the next write to it sets it again (and, with
+     *  PML enabled, is logged). PageSize is the size of that page (0 if GuestPA isn't mapped).
+     *
+     *  FALSE if the flag wasn't set.
+     */
+
+    PEPT_ENTRY entry;
+
+    entry = EptGetLeafEntry( View, GuestPA, PageSize );
+    if ( entry == NULL )
+    {
+        return FALSE;
+    }
+
+    return _ClearDirtyEntry( entry );
+}
+
+UINT64
+EptClearAllDirty(
+    _Inout_ PEPT_VIEW View
+    )
+{
+    // Clear the dirty flag of every page in the view; returns the number that had it set
+
+    PEPT_ENTRY pdpt, pd, pt;
+    UINT64 cleared = 0;
+    ULONG i, j, k, l;
+
+    for ( i = 0; i < EPT_ENTRIES_PER_TABLE; i++ )
+    {
+        if ( EPT_ENTRY_IS_EMPTY( View->PML4[i] ) )
+        {
+            continue;
+        }
+
+        pdpt = _TableFromEntry( View, View->PML4[i] );
+
+        for ( j = 0; j < EPT_ENTRIES_PER_TABLE; j++ )
+        {
+            if ( EPT_ENTRY_IS_EMPTY( pdpt[j] ) )
+            {
+                continue;
+            }
+
+            if ( pdpt[j].LargePage == 1 )
+            {
+                cleared += _ClearDirtyEntry( &pdpt[j] );
+                continue;
+            }
+
+            pd = _TableFromEntry( View, pdpt[j] );
+
+            for ( k = 0; k < EPT_ENTRIES_PER_TABLE; k++ )
+            {
+                if ( EPT_ENTRY_IS_EMPTY( pd[k] ) )
+                {
+                    continue;
+                }
+
+                if ( pd[k].LargePage == 1 )
+                {
+                    cleared += _ClearDirtyEntry( &pd[k] );
+                    continue;
+                }
+
+                pt = _TableFromEntry( View, pd[k] );
+
+                for ( l = 0; l < EPT_ENTRIES_PER_TABLE; l++ )
+                {
+                    cleared += _ClearDirtyEntry( &pt[l] );
+                }
+            }
+        }
+    }
+
+    return cleared;
+}
+
+BOOLEAN
+EptSetPagePermissions(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Read,
+    _In_ CONST BOOLEAN Write,
+    _In_ CONST BOOLEAN Execute
+    )
+{
+    // Set the permissions of the 4KB page at GuestPA (splitting whatever large page maps it)
+
+    PEPT_ENTRY pte;
+    EPT_ENTRY entry;
+
+    pte = EptGetPageEntry( View, GuestPA, TRUE );
+    if ( pte == NULL )
+    {
+        return FALSE;
+    }
+
+    entry.All = pte->All;
+    entry.Read = Read;
+    entry.Write = Write;
+    entry.Execute = Execute;
+
+    pte->All = entry.All;
+
+    return TRUE;
+}
+
+BOOLEAN
+EptSetMemoryType(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST UINT8 MemoryType
+    )
+{
+    // Set the memory type of the 4KB page at GuestPA (splitting whatever large page maps it)
+
+    PEPT_ENTRY pte;
+    EPT_ENTRY entry;
+
+    pte = EptGetPageEntry( View, GuestPA, TRUE );
+    if ( pte == NULL )
+    {
+        return FALSE;
+    }
+
+    entry.All = pte->All;
+    entry.MemoryType = MemoryType;
+
+    pte->All = entry.All;
+
+    return TRUE;
+}
+
+BOOLEAN
+EptSetSuppressVE(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Suppress
+    )
+{
+    /*
+     * Make the 4KB page at GuestPA convertible (Suppress is FALSE), or not (splitting whatever large page maps it);
+     *  an access its permissions refuse is then a #VE in the guest, rather than an EPT violation exit, on any LP
+     *  that has them enabled ([25.5.7.1] "Convertible EPT Violations").
+     *
+     *  (Note: the permissions themselves are EptSetPagePermissions'; a convertible page that allows everything never faults)
+     */
+
+    PEPT_ENTRY pte;
+    EPT_ENTRY entry;
+
+    pte = EptGetPageEntry( View, GuestPA, TRUE );
+    if ( pte == NULL )
+    {
+        return FALSE;
+    }
+
+    entry.All = pte->All;
+    entry.SuppressVE = Suppress;
+
+    pte->All = entry.All;
+
+    return TRUE;
+}
+
+VOID
+_MoveTableEntry(
+    _Inout_ PEPT_ENTRY Entry,
+    _In_ CONST UINT64 Delta
+    )
+{
+    // Point an entry that references a table at the same table in a pool Delta bytes away
+    Entry->PFN = (((UINT64)Entry->PFN << 12) + Delta) >> 12;
+}
+
+BOOLEAN
+EptCopyView(
+    _Inout_ PEPT_VIEW View,
+    _In_ CONST PEPT_VIEW Source
+    )
+{
+    /*
+     * Make View (whose pool must already be set up, and at least as big as Source's) an exact copy of Source;
+     *  the same mappings, permissions and memory types, in tables of its own. Every entry that references a table
+     *  is moved to View's copy of it; leaf entries are copied as they are.
+     *
+     *  (Note: the EPTP is Source's, A/D flags and all, save for the PML4 it points at)
+     */
+
+    PEPT_ENTRY pdpt, pd;
+    UINT64 delta;
+    ULONG i, j, k;
+
+    if ( View->Pool.PageCount < Source->Pool.PagesUsed )
+    {
+        return FALSE;
+    }
+
+    RtlCopyMemory( View->Pool.VA, Source->Pool.VA, (SIZE_T)Source->Pool.PagesUsed * EPT_PAGE_SIZE );
+
+    // Every table is at the same offset in both pools; so a table entry only has to move by the distance between them
+    delta = View->Pool.PA - Source->Pool.PA;
+
+    View->Pool.PagesUsed = Source->Pool.PagesUsed;
+    View->PML4 = (PEPT_ENTRY)(View->Pool.VA + ((PUINT8)Source->PML4 - Source->Pool.VA));
+
+    // (Note: walked rather than scanned; a PTE may well map a page of the pool itself, and that mapping mustn't move)
+    for ( i = 0; i < EPT_ENTRIES_PER_TABLE; i++ )
+    {
+        if ( EPT_ENTRY_IS_EMPTY( View->PML4[i] ) )
+        {
+            continue;
+        }
+
+        _MoveTableEntry( &View->PML4[i], delta );
+        pdpt = _TableFromEntry( View, View->PML4[i] );
+
+        for ( j = 0; j < EPT_ENTRIES_PER_TABLE; j++ )
+        {
+            if ( EPT_ENTRY_IS_EMPTY( pdpt[j] ) || pdpt[j].LargePage == 1 )
+            {
+                continue;
+            }
+
+            _MoveTableEntry( &pdpt[j], delta );
+            pd = _TableFromEntry( View, pdpt[j] );
+
+            for ( k = 0; k < EPT_ENTRIES_PER_TABLE; k++ )
+            {
+                if ( !EPT_ENTRY_IS_EMPTY( pd[k] ) && pd[k].LargePage == 0 )
+                {
+                    _MoveTableEntry( &pd[k], delta );
+                }
+            }
+        }
+    }
+
+    View->EPTP.All = Source->EPTP.All;
+    View->EPTP.PFN = (((UINT64)Source->EPTP.PFN << 12) + delta) >> 12;
+
+    View->MapLimit = Source->MapLimit;
+    View->HugePages = Source->HugePages;
+    View->LargePages = Source->LargePages;
+    View->Pages = Source->Pages;
+
+    return TRUE;
+}
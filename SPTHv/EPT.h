@@ -0,0 +1,216 @@
+#ifndef __EPT_H__
+#define __EPT_H__
+
+#include <wdm.h>
+
+// [28.2.2] "EPT Translation Mechanism"
+#define EPT_ENTRIES_PER_TABLE				512
+#define EPT_PAGE_SIZE						0x1000ULL
+#define EPT_LARGE_PAGE_SIZE					0x200000ULL		// 2MB, mapped by a PDE
+#define EPT_HUGE_PAGE_SIZE					0x40000000ULL	// 1GB, mapped by a PDPTE
+#define EPT_PML4E_COVERAGE					0x8000000000ULL	// 512GB, mapped by one PDPT
+
+// The guest-physical address bits used to index each level of the EPT paging structures
+#define EPT_PML4_INDEX(pa)					(((pa) >> 39) & 0x1FF)
+#define EPT_PDPT_INDEX(pa)					(((pa) >> 30) & 0x1FF)
+#define EPT_PD_INDEX(pa)					(((pa) >> 21) & 0x1FF)
+#define EPT_PT_INDEX(pa)					(((pa) >> 12) & 0x1FF)
+
+// [28.3.7] "EPT and Memory Typing", Table 11-8 "Memory Types That Can Be Encoded With PAT"
+#define EPT_MEMORY_TYPE_UC					0
+#define EPT_MEMORY_TYPE_WC					1
+#define EPT_MEMORY_TYPE_WT					4
+#define EPT_MEMORY_TYPE_WP					5
+#define EPT_MEMORY_TYPE_WB					6
+
+// The page walk length we use (4 levels), minus one ([24.6.11] "Extended-Page-Table Pointer (EPTP)")
+#define EPT_PAGE_WALK_LENGTH_4				3
+
+// EPT_ENTRY.Dirty, for atomic updates of a live entry ([28.2.4] "Accessed and Dirty Flags for EPT")
+#define EPT_ENTRY_DIRTY						(1ULL << 9)
+
+/*
+ * EPT_ENTRY.SuppressVE ([25.5.7.1] "Convertible EPT Violations"); every entry we write has it set, mapped or not,
+ *  so that no EPT violation is turned into a #VE unless the page was made convertible (see EptSetSuppressVE).
+ *  An entry that's nothing but this bit maps nothing.
+ */
+#define EPT_ENTRY_SUPPRESS_VE				(1ULL << 63)
+#define EPT_ENTRY_IS_EMPTY(Entry)			(((Entry).All & ~EPT_ENTRY_SUPPRESS_VE) == 0)
+
+// Table pages set aside in every view's pool for splitting large pages after the identity map is built
+#define EPT_SPLIT_RESERVE_PAGES				128
+
+#pragma warning(push)
+
+#pragma warning(disable:4201) // nonstandard extension used: nameless struct/union
+#pragma warning(disable:4214) // nonstandard extension used: bit field types other than int
+
+// [24.6.11] "Extended-Page-Table Pointer (EPTP)", Table 24-8
+typedef union _EPT_POINTER
+{
+	struct
+	{
+		UINT64 MemoryType : 3;				// 0-2
+		UINT64 PageWalkLength : 3;			// 3-5		(Minus one)
+		UINT64 EnableAccessedDirty : 1;		// 6
+		UINT64 EnableSupervisorShadow : 1;	// 7
+		UINT64 Reserved0 : 4;				// 8-11
+		UINT64 PFN : 40;					// 12-51	(PML4 table)
+		UINT64 Reserved1 : 12;				// 52-63
+	};
+	UINT64 All;
+} EPT_POINTER, *PEPT_POINTER;
+
+/*
+ * [28.2.2] "EPT Translation Mechanism", Tables 28-1 through 28-6
+ *
+ *  Every level of the EPT paging structures shares this layout; the memory type, ignore-PAT and dirty
+ *  bits only mean something in entries that map a page (LargePage set in a PDPTE or PDE, or any PTE), and
+ *  the PFN is the next table's (or the page's) physical address, shifted right by 12.
+ */
+typedef union _EPT_ENTRY
+{
+	struct
+	{
+		UINT64 Read : 1;					// 0
+		UINT64 Write : 1;					// 1
+		UINT64 Execute : 1;					// 2
+		UINT64 MemoryType : 3;				// 3-5		(Leaf entries only)
+		UINT64 IgnorePAT : 1;				// 6		(Leaf entries only)
+		UINT64 LargePage : 1;				// 7		(PDPTEs and PDEs only)
+		UINT64 Accessed : 1;				// 8
+		UINT64 Dirty : 1;					// 9		(Leaf entries only)
+		UINT64 UserExecute : 1;				// 10
+		UINT64 Reserved0 : 1;				// 11
+		UINT64 PFN : 40;					// 12-51
+		UINT64 Reserved1 : 11;				// 52-62
+		UINT64 SuppressVE : 1;				// 63
+	};
+	UINT64 All;
+} EPT_ENTRY, *PEPT_ENTRY;
+
+#pragma warning(pop)
+
+C_ASSERT( sizeof(EPT_ENTRY) * EPT_ENTRIES_PER_TABLE == EPT_PAGE_SIZE );
+
+// A range of guest-physical addresses backed by RAM (see MmGetPhysicalMemoryRanges)
+typedef struct _EPT_MEMORY_RANGE
+{
+	UINT64 Base;
+	UINT64 Length;
+} EPT_MEMORY_RANGE, *PEPT_MEMORY_RANGE;
+
+/*
+ * The physically contiguous block every table of an EPT view is carved out of. Being contiguous is
+ *  what lets us walk our own tables without asking the memory manager to translate addresses.
+ */
+typedef struct _EPT_PAGE_POOL
+{
+	PUINT8 VA;
+	UINT64 PA;
+	ULONG PageCount;
+	ULONG PagesUsed;
+} EPT_PAGE_POOL, *PEPT_PAGE_POOL;
+
+// One set of EPT paging structures, and the EPTP that refers to it
+typedef struct _EPT_VIEW
+{
+	EPT_PAGE_POOL Pool;
+
+	PEPT_ENTRY PML4;
+	EPT_POINTER EPTP;
+
+	// Guest-physical addresses at or above this aren't mapped
+	UINT64 MapLimit;
+
+	// The number of leaf entries of each size in the map
+	UINT64 HugePages;
+	UINT64 LargePages;
+	UINT64 Pages;
+} EPT_VIEW, *PEPT_VIEW;
+
+
+
+//
+// Local functions
+//
+
+ULONG
+EptCountTablePages(
+	_In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+	_In_ CONST ULONG RangeCount,
+	_In_ CONST UINT64 MapLimit,
+	_In_ CONST BOOLEAN UseHugePages
+	);
+
+BOOLEAN
+EptBuildIdentityMap(
+	_Inout_ PEPT_VIEW View,
+	_In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+	_In_ CONST ULONG RangeCount,
+	_In_ CONST UINT64 MapLimit,
+	_In_ CONST BOOLEAN UseHugePages
+	);
+
+BOOLEAN
+EptCopyView(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST PEPT_VIEW Source
+	);
+
+BOOLEAN
+EptSplitLargePage(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA
+	);
+
+PEPT_ENTRY
+EptGetPageEntry(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Split
+	);
+
+PEPT_ENTRY
+EptGetLeafEntry(
+	_In_ CONST PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_Out_ PUINT64 PageSize
+	);
+
+BOOLEAN
+EptClearDirty(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_Out_ PUINT64 PageSize
+	);
+
+UINT64
+EptClearAllDirty(
+	_Inout_ PEPT_VIEW View
+	);
+
+BOOLEAN
+EptSetPagePermissions(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Read,
+	_In_ CONST BOOLEAN Write,
+	_In_ CONST BOOLEAN Execute
+	);
+
+BOOLEAN
+EptSetMemoryType(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST UINT8 MemoryType
+	);
+
+BOOLEAN
+EptSetSuppressVE(
+	_Inout_ PEPT_VIEW View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Suppress
+	);
+
+#endif // __EPT_H__
@@ -0,0 +1,165 @@
+#include "EPTList.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor or the VMCS; the list is a plain array of EPTPs, and the capabilities
+ *  checked against are passed in. It can be driven with views built (and copied, see EptCopyView in "EPT.c") in
+ *  ordinary buffers.
+ *
+ * The guest switches views with `VMFUNC` (see GuestSwitchView in "guest.asm"); once every LP is virtualized,
+ *  `dq` the list page (`g_EPTPList.Entries`) to see which views it can switch to, and `vmread 201A` (the EPTP)
+ *  on an LP to see which one it's in.
+ */
+
+BOOLEAN
+EptListIsValidEPTP(
+    _In_ CONST EPT_POINTER EPTP,
+    _In_ CONST VMX_EPT_VPID_CAP Capabilities
+    )
+{
+    // Whether EPTP would pass the checks VMFUNC (and VM-entry) make of it ([26.2.1.1] "VM-Execution Control Fields")
+
+    if ( !((EPTP.MemoryType == EPT_MEMORY_TYPE_UC && Capabilities.MemTypeUC == 1) ||
+           (EPTP.MemoryType == EPT_MEMORY_TYPE_WB && Capabilities.MemTypeWB == 1)) )
+    {
+        return FALSE;
+    }
+
+    if ( EPTP.PageWalkLength != EPT_PAGE_WALK_LENGTH_4 || Capabilities.PageWalkLength4 == 0 )
+    {
+        return FALSE;
+    }
+
+    if ( (EPTP.EnableAccessedDirty == 1 && Capabilities.AccessedDirty == 0) ||
+         (EPTP.EnableSupervisorShadow == 1 && Capabilities.SupervisorShadowStack == 0) )
+    {
+        return FALSE;
+    }
+
+    return EPTP.Reserved0 == 0 && EPTP.Reserved1 == 0 && EPTP.PFN != 0;
+}
+
+VOID
+EptListInitialize(
+    _Out_ PEPTP_LIST List,
+    _Out_writes_(EPTP_LIST_ENTRIES) PUINT64 Entries,
+    _In_ CONST UINT64 EntriesPA
+    )
+{
+    // (Note: every entry starts out 0, which VMFUNC refuses to switch to)
+
+    RtlSecureZeroMemory( List, sizeof(EPTP_LIST) );
+    RtlSecureZeroMemory( Entries, EPTP_LIST_ENTRIES * sizeof(UINT64) );
+
+    List->Entries = Entries;
+    List->EntriesPA = EntriesPA;
+}
+
+BOOLEAN
+EptListInsert(
+    _Inout_ PEPTP_LIST List,
+    _In_ CONST ULONG Index,
+    _In_ CONST PEPT_VIEW View,
+    _In_ CONST VMX_EPT_VPID_CAP Capabilities
+    )
+{
+    /*
+     * Put View in entry Index of the list, which is what the guest switches to it with; FALSE if that entry is
+     *  taken, View is already in the list, or the processor wouldn't switch to its EPTP.
+     */
+
+    if ( Index >= EPT_VIEW_MAX || List->Views[Index] != NULL )
+    {
+        return FALSE;
+    }
+
+    if ( EptListIsValidEPTP( View->EPTP, Capabilities ) == FALSE || EptListFind( List, View->EPTP.All ) != EPT_VIEW_INVALID )
+    {
+        return FALSE;
+    }
+
+    List->Views[Index] = View;
+    List->Entries[Index] = View->EPTP.All;
+
+    return TRUE;
+}
+
+BOOLEAN
+EptListRemove(
+    _Inout_ PEPTP_LIST List,
+    _In_ CONST ULONG Index
+    )
+{
+    /*
+     * Take a view out of the list; from here on, a VMFUNC to it exits. FALSE if there's no view at Index.
+     *
+     *  (Note: an LP that's already in the view stays in it until it's moved out; see HYPERCALL_EPT_VIEWS in "Exit.h")
+     */
+
+    if ( Index >= EPT_VIEW_MAX || List->Views[Index] == NULL )
+    {
+        return FALSE;
+    }
+
+    List->Entries[Index] = 0;
+    List->Views[Index] = NULL;
+
+    return TRUE;
+}
+
+VOID
+EptListRefresh(
+    _Inout_ PEPTP_LIST List
+    )
+{
+    // Pick up every view's current EPTP; after its flags (such as the A/D enable) have changed
+
+    ULONG i;
+
+    for ( i = 0; i < EPT_VIEW_MAX; i++ )
+    {
+        if ( List->Views[i] != NULL )
+        {
+            List->Entries[i] = List->Views[i]->EPTP.All;
+        }
+    }
+}
+
+ULONG
+EptListFind(
+    _In_ CONST EPTP_LIST* List,
+    _In_ CONST UINT64 EPTP
+    )
+{
+    // The index of the view whose PML4 EPTP points at (whatever its flags); EPT_VIEW_INVALID if none of them
+
+    EPT_POINTER eptp;
+    ULONG i;
+
+    eptp.All = EPTP;
+
+    for ( i = 0; i < EPT_VIEW_MAX; i++ )
+    {
+        if ( List->Views[i] != NULL && List->Views[i]->EPTP.PFN == eptp.PFN )
+        {
+            return i;
+        }
+    }
+
+    return EPT_VIEW_INVALID;
+}
+
+PEPT_VIEW
+EptListGetView(
+    _In_ CONST EPTP_LIST* List,
+    _In_ CONST ULONG Index
+    )
+{
+    if ( Index >= EPT_VIEW_MAX )
+    {
+        return NULL;
+    }
+
+    return List->Views[Index];
+}
@@ -0,0 +1,92 @@
+#ifndef __EPTLIST_H__
+#define __EPTLIST_H__
+
+#include <ntddk.h>
+
+#include "MSR.h"
+#include "EPT.h"
+
+/*
+ * [24.6.14] "VM-Function Controls", [25.5.6.3] "EPTP Switching"
+ *
+ *  With EPTP switching enabled, the guest can switch its own EPTP to any of the (up to 512) entries of the EPTP
+ *  list with `VMFUNC` (EAX = 0, ECX = the index), without a VM exit. An index past the end, or an entry that isn't
+ *  a valid EPTP, makes VMFUNC exit instead (REASON_VMFUNC); every entry we don't use is 0, which never is one.
+ *  Every view shares the one list (it's a 4KB page, referenced by every LP's VMCS), and each LP is in whichever
+ *  view it last switched to.
+ */
+#define EPTP_LIST_ENTRIES					512
+
+// The bit of the VM-function controls (and of IA32_VMX_VMFUNC) for EPTP switching, which is also its VMFUNC leaf
+#define VM_FUNCTION_EPTP_SWITCHING			(1ULL << 0)
+#define VMFUNC_LEAF_EPTP_SWITCHING			0
+
+// The views we keep in the list (see VmfuncInitialize in "VMFunc.c"); each one is a full copy of the identity map
+#define EPT_VIEW_MAX						4
+
+// The identity map every LP starts out in (g_EPTView), which is always in the list
+#define EPT_VIEW_DEFAULT					0
+
+#define EPT_VIEW_INVALID					MAXULONG
+
+// The EPTP list, and the view behind each of its entries in use
+typedef struct _EPTP_LIST
+{
+	// The list itself (EPTP_LIST_ENTRIES), which the processor reads on every VMFUNC; EntriesPA is what the VMCS points at
+	PUINT64 Entries;
+	UINT64 EntriesPA;
+
+	PEPT_VIEW Views[EPT_VIEW_MAX];
+} EPTP_LIST, *PEPTP_LIST;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+EptListIsValidEPTP(
+	_In_ CONST EPT_POINTER EPTP,
+	_In_ CONST VMX_EPT_VPID_CAP Capabilities
+	);
+
+VOID
+EptListInitialize(
+	_Out_ PEPTP_LIST List,
+	_Out_writes_(EPTP_LIST_ENTRIES) PUINT64 Entries,
+	_In_ CONST UINT64 EntriesPA
+	);
+
+BOOLEAN
+EptListInsert(
+	_Inout_ PEPTP_LIST List,
+	_In_ CONST ULONG Index,
+	_In_ CONST PEPT_VIEW View,
+	_In_ CONST VMX_EPT_VPID_CAP Capabilities
+	);
+
+BOOLEAN
+EptListRemove(
+	_Inout_ PEPTP_LIST List,
+	_In_ CONST ULONG Index
+	);
+
+VOID
+EptListRefresh(
+	_Inout_ PEPTP_LIST List
+	);
+
+ULONG
+EptListFind(
+	_In_ CONST EPTP_LIST* List,
+	_In_ CONST UINT64 EPTP
+	);
+
+PEPT_VIEW
+EptListGetView(
+	_In_ CONST EPTP_LIST* List,
+	_In_ CONST ULONG Index
+	);
+
+#endif // __EPTLIST_H__
@@ -0,0 +1,1734 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * Every VM-exit lands in VMExitStub (see "vmexit.asm"), which saves the guest GPRs onto the
+ *  exiting LP's host stack and calls VMExitDispatch below. If VMExitDispatch returns, the guest is
+ *  resumed via VMRESUME; the only way out of this loop is HYPERCALL_DEVIRTUALIZE (or a bugcheck).
+ *
+ * Set a breakpoint on VMExitDispatch and `dt SPTHv!_GUEST_REGISTERS @rcx` to view the guest GPRs
+ *
+ * Exits are dispatched through g_ExitHandlers, indexed by the basic exit reason; use
+ *  `dps SPTHv!g_ExitHandlers L0n70` to see which handler each reason currently goes to
+ */
+
+// The exit counters are indexed by basic exit reason, just like the handlers
+C_ASSERT( SPTHV_EXIT_REASON_COUNT == VMEXIT_HANDLER_COUNT );
+
+// VMExitStub answers most CPUID exits itself, and has the reason hardcoded (see "vmexit.asm")
+C_ASSERT( REASON_CPUID == 10 );
+
+// One handler per basic exit reason, shared by every LP (see VMExitInitializeHandlers and VMExitRegisterHandler)
+VMEXIT_HANDLER g_ExitHandlers[VMEXIT_HANDLER_COUNT];
+
+// The VMCS encoding of each VMCS_CACHE_FIELD
+CONST UINT32 g_VMCSCacheEncodings[VMCS_CACHE_FIELD_COUNT] = {
+    VMCS_RO_EXIT_REASON,
+    VMCS_RO_EXIT_QUAL,
+    VMCS_RO_VM_EXIT_INSTR_LEN,
+    VMCS_RO_VM_EXIT_INSTR_INFO,
+    VMCS_RO_IDT_VEC_INFO_FIELD,
+    VMCS_RO_GUEST_LIN_ADDR,
+    VMCS_RO_GUEST_PHYS_ADDR_FULL,
+    VMCS_GUEST_RIP,
+    VMCS_GUEST_RSP,
+    VMCS_GUEST_RFLAGS,
+    VMCS_GUEST_CR0,
+    VMCS_GUEST_CR3,
+    VMCS_GUEST_CR4
+};
+
+UINT64
+VMExitRead(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST VMCS_CACHE_FIELD Field
+    )
+{
+    PVMCS_CACHE cache = &LPInfo->ExitCache;
+    size_t value = 0;
+
+    if ( (cache->Valid & (1UL << Field)) != 0 )
+    {
+        cache->ReadsSaved++;
+        return cache->Values[Field];
+    }
+
+    __vmx_vmread( g_VMCSCacheEncodings[Field], &value );
+
+    cache->VMReads++;
+    cache->Values[Field] = value;
+    cache->Valid |= (1UL << Field);
+
+    return value;
+}
+
+VOID
+VMExitWrite(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST VMCS_CACHE_FIELD Field,
+    _In_ CONST UINT64 Value
+    )
+{
+    // The VMCS itself isn't written until _VMExitWriteBack, at the end of the exit
+
+    PVMCS_CACHE cache = &LPInfo->ExitCache;
+
+    NT_ASSERT( Field >= VMCS_CACHE_FIRST_WRITABLE );
+
+    if ( (cache->Dirty & (1UL << Field)) != 0 )
+    {
+        cache->WritesSaved++;
+    }
+
+    cache->Values[Field] = Value;
+    cache->Valid |= (1UL << Field);
+    cache->Dirty |= (1UL << Field);
+}
+
+VOID
+_VMExitWriteBack(
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    PVMCS_CACHE cache = &LPInfo->ExitCache;
+    ULONG field;
+
+    while ( cache->Dirty != 0 )
+    {
+        _BitScanForward( &field, cache->Dirty );
+        cache->Dirty &= ~(1UL << field);
+
+        __vmx_vmwrite( g_VMCSCacheEncodings[field], cache->Values[field] );
+        cache->VMWrites++;
+    }
+}
+
+VOID
+_AdvanceGuestRIP(
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // [27.2.5] "Information for VM Exits Due to Instruction Execution"
+    VMExitWrite(
+        LPInfo,
+        VMCS_CACHE_GUEST_RIP,
+        VMExitRead( LPInfo, VMCS_CACHE_GUEST_RIP ) + VMExitRead( LPInfo, VMCS_CACHE_EXIT_INSTR_LEN )
+        );
+}
+
+VOID
+_InjectHardwareException(
+    _In_ CONST UINT8 Vector,
+    _In_ CONST BOOLEAN DeliverErrorCode,
+    _In_opt_ CONST UINT32 ErrorCode
+    )
+{
+    // [26.6] "Event Injection"
+
+    VM_ENTRY_INT_INFO intInfo;
+
+    intInfo.All = 0;
+    intInfo.Vector = Vector;
+    intInfo.Type = INTERRUPTION_TYPE_HARDWARE_EXCEPTION;
+    intInfo.DeliverErrorCode = DeliverErrorCode;
+    intInfo.Valid = TRUE;
+
+    if ( DeliverErrorCode == TRUE )
+    {
+        __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_EXCEPT_ERR_CODE, ErrorCode );
+    }
+
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_INT_INFO_FIELD, intInfo.All );
+
+    // Note: the guest RIP isn't advanced here, as faults are reported on the faulting instruction
+}
+
+VOID
+_ReinjectVectoredEvent(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST BOOLEAN NMIUnblocking
+    )
+{
+    /*
+     * [28.2.4] "Information for VM Exits During Event Delivery"; an exit we resume from without emulating anything
+     *  (so that the guest retries the access) has to redeliver whatever event it interrupted the delivery of, or the
+     *  event is lost. If it wasn't delivering one, and an IRET had just unblocked NMIs, they're blocked again
+     *  ([28.2.3] "Information About NMI Unblocking Due to IRET"); the IRET is retried along with the access.
+     */
+
+    VM_ENTRY_INT_INFO vectoringInfo;
+    size_t value;
+
+    vectoringInfo.All = (UINT32)VMExitRead( LPInfo, VMCS_CACHE_IDT_VEC_INFO );
+
+    if ( vectoringInfo.Valid == FALSE )
+    {
+        if ( NMIUnblocking == TRUE )
+        {
+            // [24.4.2] "Guest Non-Register State", Table 24-3; bit 3 is blocking by NMI
+            __vmx_vmread( VMCS_GUEST_INT_STATE, &value );
+            __vmx_vmwrite( VMCS_GUEST_INT_STATE, value | (1 << 3) );
+        }
+
+        return;
+    }
+
+    // (Note: bit 12 of the IDT-vectoring information is undefined, where it's reserved in the VM-entry field)
+    vectoringInfo.Reserved0 = 0;
+
+    if ( vectoringInfo.DeliverErrorCode == TRUE )
+    {
+        __vmx_vmread( VMCS_RO_IDT_VEC_ERR_CODE, &value );
+        __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_EXCEPT_ERR_CODE, value );
+    }
+
+    // Software interrupts and exceptions are redelivered from the instruction that raised them
+    if ( vectoringInfo.Type == INTERRUPTION_TYPE_SOFTWARE_INTERRUPT ||
+         vectoringInfo.Type == INTERRUPTION_TYPE_PRIVILEGED_SOFTWARE_EXCEPTION ||
+         vectoringInfo.Type == INTERRUPTION_TYPE_SOFTWARE_EXCEPTION )
+    {
+        __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_INSTR_LEN, VMExitRead( LPInfo, VMCS_CACHE_EXIT_INSTR_LEN ) );
+    }
+
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_INT_INFO_FIELD, vectoringInfo.All );
+}
+
+UINT8
+_GetGuestCPL()
+{
+    // [5.5] "Privilege Levels": the CPL is the DPL of the SS segment (which is what the VMCS keeps, see [24.4.1])
+    SEG_ACCESS_RIGHTS ssAR;
+    size_t value = 0;
+
+    __vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &value );
+    ssAR.All = (UINT32)value;
+
+    return (UINT8)ssAR.DPL;
+}
+
+VOID
+_DrainPMLLog(
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // Move everything this LP has logged into the dirty bitmap (see DirtyDrainLog in "Dirty.c"), and start its log over
+
+    size_t index = 0;
+
+    __vmx_vmread( VMCS_GUEST_PML_INDEX, &index );
+
+    DirtyDrainLog( &g_DirtyBitmap, g_PmlViews, g_PmlViewCount, (CONST UINT64*)LPInfo->PMLBuffer.VA, (UINT16)index );
+
+    __vmx_vmwrite( VMCS_GUEST_PML_INDEX, PML_INDEX_START );
+}
+
+ULONG
+_GetGuestView()
+{
+    // The EPT view the LP is in (see "VMFunc.c"); EPT_VIEW_INVALID if it's in one that's since left the EPTP list
+
+    size_t eptp = 0;
+
+    if ( g_VmfuncSupported == FALSE )
+    {
+        return EPT_VIEW_DEFAULT;
+    }
+
+    __vmx_vmread( VMCS_CTRL_EPT_POINTER_FULL, &eptp );
+
+    return EptListFind( &g_EPTPList, eptp );
+}
+
+VOID
+_SetGuestView(
+    _In_ CONST PLP_INFO LPInfo,
+    _In_ CONST ULONG View
+    )
+{
+    /*
+     * Put the LP in View, which must be in the EPTP list. With #VEs on, the processor also keeps the index of the view
+     *  it's in, for the #VE information area; VMFUNC updates it, and so must we ([24.6.19] "Controls for Virtualization
+     *  Exceptions").
+     */
+
+    __vmx_vmwrite( VMCS_CTRL_EPT_POINTER_FULL, EptListGetView( &g_EPTPList, View )->EPTP.All );
+
+    if ( g_VeSupported == TRUE && LPInfo->VEEnabled == TRUE )
+    {
+        __vmx_vmwrite( VMCS_CTRL_EPTP_INDEX, View );
+    }
+}
+
+BOOLEAN
+_DeliverVirtualizationException(
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * [25.5.7] "Virtualization Exceptions"; turn the current EPT violation into a #VE, as the processor would have if
+     *  it could. FALSE if it isn't convertible (see VeInfoIsConvertible in "VEInfo.c"), and it's ours to handle.
+     *
+     *  (Note: a violation the processor could have converted never gets here, unless its area was busy; so on a processor
+     *  with the "EPT-violation #VE" control, this turns nothing into a #VE, and only confirms it's ours)
+     */
+
+    EPT_VIOLATION_QUALIFICATION qualification;
+    VM_ENTRY_INT_INFO vectoringInfo;
+    PEPT_VIEW view;
+    PEPT_ENTRY entry = NULL;
+    UINT64 guestPA, pageSize;
+    ULONG viewIndex;
+
+    qualification.All = VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL );
+    vectoringInfo.All = (UINT32)VMExitRead( LPInfo, VMCS_CACHE_IDT_VEC_INFO );
+    guestPA = VMExitRead( LPInfo, VMCS_CACHE_GUEST_PHYS_ADDR );
+
+    viewIndex = _GetGuestView();
+
+    view = (viewIndex == EPT_VIEW_INVALID) ? NULL : VmfuncGetView( viewIndex );
+    if ( view != NULL )
+    {
+        entry = EptGetLeafEntry( view, guestPA, &pageSize );
+    }
+
+    if ( VeInfoIsConvertible( (PVE_INFO)LPInfo->VEInfo.VA, entry, (BOOLEAN)vectoringInfo.Valid ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    VeInfoDeliver(
+        (PVE_INFO)LPInfo->VEInfo.VA,
+        qualification.All,
+        (qualification.GuestLinearValid == 1) ? VMExitRead( LPInfo, VMCS_CACHE_GUEST_LIN_ADDR ) : 0,
+        guestPA,
+        (UINT16)viewIndex
+        );
+
+    // A #VE is a fault; so if the access was an IRET's, NMIs are blocked again, as for any other fault it takes
+    _ReinjectVectoredEvent( LPInfo, (BOOLEAN)qualification.NMIUnblocking );
+    _InjectHardwareException( EXCEPTION_VECTOR_VE, FALSE, 0 );
+
+    return TRUE;
+}
+
+VOID
+_SetInterruptWindowExiting(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST BOOLEAN Enable
+    )
+{
+    // [25.2] "Other Causes of VM Exits"; exit as soon as the guest can take an interrupt, for the ones it's waiting on
+
+    PROCESSOR_PRIMARY_VM_EXEC_CTRLS primaryCtrls;
+    size_t value = 0;
+
+    if ( LPInfo->InterruptWindow == Enable )
+    {
+        return;
+    }
+
+    __vmx_vmread( VMCS_CTRL_PRIMARY_EXEC_CTRLS, &value );
+    primaryCtrls.All = (UINT32)value;
+    primaryCtrls.InterruptWindowExiting = Enable;
+
+    __vmx_vmwrite( VMCS_CTRL_PRIMARY_EXEC_CTRLS, primaryCtrls.All );
+
+    LPInfo->InterruptWindow = Enable;
+}
+
+VOID
+_SetCR8LoadExiting(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST BOOLEAN Enable
+    )
+{
+    /*
+     * [25.1.3] "Instructions That Cause VM Exits Conditionally"; exit on every MOV to CR8, for the interrupts the
+     *  guest's task priority is holding back (an interrupt window would open right away, and again after every exit)
+     */
+
+    PROCESSOR_PRIMARY_VM_EXEC_CTRLS primaryCtrls;
+    size_t value = 0;
+
+    if ( LPInfo->CR8LoadExiting == Enable )
+    {
+        return;
+    }
+
+    __vmx_vmread( VMCS_CTRL_PRIMARY_EXEC_CTRLS, &value );
+    primaryCtrls.All = (UINT32)value;
+    primaryCtrls.CR8LoadExiting = Enable;
+
+    __vmx_vmwrite( VMCS_CTRL_PRIMARY_EXEC_CTRLS, primaryCtrls.All );
+
+    LPInfo->CR8LoadExiting = Enable;
+}
+
+BOOLEAN
+_CanInjectInterrupt(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST UINT8 Vector
+    )
+{
+    /*
+     * Whether the next VM-entry can hand the guest Vector (see IntrQueueCanInject in "IntrQueue.c").
+     *
+     *  (Note: without a TPR shadow, the guest's MOVs to CR8 go straight to the local APIC's TPR, which we read back here)
+     */
+
+    size_t interruptibility = 0, activityState = 0, entryIntInfo = 0;
+
+    __vmx_vmread( VMCS_GUEST_INT_STATE, &interruptibility );
+    __vmx_vmread( VMCS_GUEST_ACTIVITY_STATE, &activityState );
+    __vmx_vmread( VMCS_CTRL_VM_ENTRY_INT_INFO_FIELD, &entryIntInfo );
+
+    return IntrQueueCanInject(
+        Vector,
+        VMExitRead( LPInfo, VMCS_CACHE_GUEST_RFLAGS ),
+        __readcr8(),
+        (UINT32)interruptibility,
+        (UINT32)activityState,
+        (UINT32)entryIntInfo
+        );
+}
+
+VOID
+_InjectExternalInterrupt(
+    _In_ CONST UINT8 Vector
+    )
+{
+    // [26.6] "Event Injection"; delivered through the guest's IDT, as though it had come straight from its local APIC
+
+    VM_ENTRY_INT_INFO intInfo;
+
+    intInfo.All = 0;
+    intInfo.Vector = Vector;
+    intInfo.Type = INTERRUPTION_TYPE_EXTERNAL_INTERRUPT;
+    intInfo.Valid = TRUE;
+
+    __vmx_vmwrite( VMCS_CTRL_VM_ENTRY_INT_INFO_FIELD, intInfo.All );
+}
+
+VOID
+_DeliverQueuedInterrupts(
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * Hand the guest the highest vector it's waiting on, if it can take one on this VM-entry; and exit again when it
+     *  next can, for as long as anything is left. Only one event can be injected per VM-entry, so a queue with more
+     *  than one vector in it is emptied one interrupt window at a time. While the guest's task priority is what holds
+     *  the next one back, it's the MOV to CR8 that lowers it we exit on instead.
+     */
+
+    UINT8 vector;
+    BOOLEAN waiting, belowTPR = FALSE;
+
+    if ( IntrQueuePeek( &LPInfo->Interrupts, &vector ) == TRUE && _CanInjectInterrupt( LPInfo, vector ) == TRUE )
+    {
+        IntrQueuePop( &LPInfo->Interrupts, &vector );
+        _InjectExternalInterrupt( vector );
+    }
+
+    waiting = IntrQueuePeek( &LPInfo->Interrupts, &vector );
+
+    if ( waiting == TRUE )
+    {
+        belowTPR = (BOOLEAN)(IntrQueueAboveTPR( vector, __readcr8() ) == FALSE);
+    }
+
+    _SetInterruptWindowExiting( LPInfo, (BOOLEAN)(waiting == TRUE && belowTPR == FALSE) );
+    _SetCR8LoadExiting( LPInfo, belowTPR );
+}
+
+DECLSPEC_NORETURN
+VOID
+_Devirtualize(
+    _In_ CONST PGUEST_REGISTERS GuestRegisters,
+    _Inout_ CONST PLP_INFO LPInfo
+    )
+{
+    /*
+     * Leave VMX operation on this LP, and continue running the guest's context as the host.
+     *
+     *  This uses the same trick DriverEntry originally used to get out of VMX operation: capture a
+     *  CONTEXT here, overwrite it with the guest's state, and jump into it via RtlRestoreContext.
+     */
+
+    PCONTEXT ctx = &LPInfo->DevirtualizeCtx;
+    SYSTEM_TABLE_REGISTER gdtr, idtr;
+    CR4 guestCR4;
+
+    UINT64 guestRIP, guestRSP, guestRFLAGS;
+    UINT64 guestCR0, guestCR3, guestCR4Value;
+    size_t gdtrBase = 0, gdtrLimit = 0, idtrBase = 0, idtrLimit = 0;
+
+    // The guest carries on with its own extended state (RtlRestoreContext only restores the XMM registers we give it)
+    XStateRestore( &LPInfo->XState );
+
+    // Note: these may hold writes from this exit that were never written back to the VMCS (such as an advanced RIP)
+    guestRIP = VMExitRead( LPInfo, VMCS_CACHE_GUEST_RIP );
+    guestRSP = VMExitRead( LPInfo, VMCS_CACHE_GUEST_RSP );
+    guestRFLAGS = VMExitRead( LPInfo, VMCS_CACHE_GUEST_RFLAGS );
+
+    guestCR0 = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR0 );
+    guestCR3 = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR3 );
+    guestCR4Value = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR4 );
+
+    __vmx_vmread( VMCS_GUEST_GDTR_BASE, &gdtrBase );
+    __vmx_vmread( VMCS_GUEST_GDTR_LIMIT, &gdtrLimit );
+    __vmx_vmread( VMCS_GUEST_IDTR_BASE, &idtrBase );
+    __vmx_vmread( VMCS_GUEST_IDTR_LIMIT, &idtrLimit );
+
+    RtlCaptureContext( ctx );
+
+    ctx->Rax = GuestRegisters->Rax;
+    ctx->Rcx = GuestRegisters->Rcx;
+    ctx->Rdx = GuestRegisters->Rdx;
+    ctx->Rbx = GuestRegisters->Rbx;
+    ctx->Rbp = GuestRegisters->Rbp;
+    ctx->Rsi = GuestRegisters->Rsi;
+    ctx->Rdi = GuestRegisters->Rdi;
+    ctx->R8 = GuestRegisters->R8;
+    ctx->R9 = GuestRegisters->R9;
+    ctx->R10 = GuestRegisters->R10;
+    ctx->R11 = GuestRegisters->R11;
+    ctx->R12 = GuestRegisters->R12;
+    ctx->R13 = GuestRegisters->R13;
+    ctx->R14 = GuestRegisters->R14;
+    ctx->R15 = GuestRegisters->R15;
+
+    ctx->Xmm0 = GuestRegisters->Xmm[0];
+    ctx->Xmm1 = GuestRegisters->Xmm[1];
+    ctx->Xmm2 = GuestRegisters->Xmm[2];
+    ctx->Xmm3 = GuestRegisters->Xmm[3];
+    ctx->Xmm4 = GuestRegisters->Xmm[4];
+    ctx->Xmm5 = GuestRegisters->Xmm[5];
+
+    ctx->Rsp = guestRSP;
+    ctx->Rip = guestRIP;
+    ctx->EFlags = (ULONG)guestRFLAGS;
+
+    // The host GDTR/IDTR limits were set to 0xFFFF on VM-exit ([27.5.2] "Loading Host Segment and Descriptor-Table Registers")
+    gdtr.Base = gdtrBase;
+    gdtr.Limit = (UINT16)gdtrLimit;
+    idtr.Base = idtrBase;
+    idtr.Limit = (UINT16)idtrLimit;
+
+    __lgdt( &gdtr );
+    __lidt( &idtr );
+
+    // We're running on the system address space as the host; go back to whichever one the guest was in
+    __writecr3( guestCR3 );
+
+    __vmx_off();
+
+    // Restore CR0/4 to the guest's values, less the CR4.VMXE bit we forced on
+    guestCR4.All = guestCR4Value;
+    guestCR4.VMXE = 0;
+
+    __writecr0( guestCR0 );
+    __writecr4( guestCR4.All );
+
+    RtlRestoreContext( ctx, NULL );
+}
+
+VOID
+_ExitCPUID(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * [27.1.2] "Instructions That Cause VM Exits Unconditionally"
+     *
+     *  (Note: most CPUIDs never get here; VMExitStub answers them from this LP's table. What's left is the leaves
+     *  that change (or depend on the guest's CR4), the ones not in the table, and every CPUID while tracing)
+     */
+
+    UINT32 leaf = (UINT32)GuestRegisters->Rax;
+    UINT32 subleaf = (UINT32)GuestRegisters->Rcx;
+    CPUID_ENTRY entry;
+    int cpuInfo[4];
+
+    if ( LPInfo->CPUIDTable == NULL ||
+         CpuidTableLookup( LPInfo->CPUIDTable, leaf, subleaf, VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR4 ), &entry ) == FALSE )
+    {
+        __cpuidex( cpuInfo, (int)leaf, (int)subleaf );
+
+        entry.Eax = (UINT32)cpuInfo[0];
+        entry.Ebx = (UINT32)cpuInfo[1];
+        entry.Ecx = (UINT32)cpuInfo[2];
+        entry.Edx = (UINT32)cpuInfo[3];
+
+        CpuidApplyOverrides( g_CPUIDOverrides, CPUID_OVERRIDE_COUNT, leaf, subleaf, &entry );
+    }
+
+    GuestRegisters->Rax = entry.Eax;
+    GuestRegisters->Rbx = entry.Ebx;
+    GuestRegisters->Rcx = entry.Ecx;
+    GuestRegisters->Rdx = entry.Edx;
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitVMCALL(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    PROCESSOR_PRIMARY_VM_EXEC_CTRLS primaryCtrls;
+    PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondaryCtrls;
+    PIN_VM_EXEC_CTRLS pinCtrls;
+    VM_EXIT_CTRLS exitCtrls;
+    size_t value = 0;
+    ULONG view;
+
+    // Only the guest kernel gets to talk to us; everyone else sees what they'd see without a VMM (a #UD)
+    if ( _GetGuestCPL() != 0 || (GuestRegisters->Rcx & HYPERCALL_MAGIC) != HYPERCALL_MAGIC )
+    {
+        _InjectHardwareException( EXCEPTION_VECTOR_UD, FALSE, 0 );
+        return;
+    }
+
+    switch ( GuestRegisters->Rcx )
+    {
+        case HYPERCALL_PING:
+
+            GuestRegisters->Rax = HYPERCALL_MAGIC;
+
+            break;
+        case HYPERCALL_DEVIRTUALIZE:
+
+            // Not while the guest has external interrupts queued; they've been acknowledged, and only we can hand them
+            //  to it. It takes them as soon as it can (see _DeliverQueuedInterrupts), and the caller tries again then
+            if ( LPInfo->Interrupts.Count != 0 )
+            {
+                GuestRegisters->Rax = FALSE;
+                break;
+            }
+
+            // Continue after the VMCALL, outside of VMX operation
+            GuestRegisters->Rax = TRUE;
+            _AdvanceGuestRIP( LPInfo );
+            _Devirtualize( GuestRegisters, LPInfo );
+
+            break;
+        case HYPERCALL_BENCH_EXITING:
+
+            // HLT and CR3-load exiting, on this LP only, for the benchmark payloads that need them (see "Bench.c")
+            //    (Note: the LP's own controls, rather than g_VMXControls; it may be in an interrupt window, see _DeliverQueuedInterrupts)
+            __vmx_vmread( VMCS_CTRL_PRIMARY_EXEC_CTRLS, &value );
+            primaryCtrls.All = (UINT32)value;
+            primaryCtrls.HLTExiting = g_VMXControls.Primary.HLTExiting;
+            primaryCtrls.CR3LoadExiting = g_VMXControls.Primary.CR3LoadExiting;
+
+            if ( GuestRegisters->Rdx == TRUE )
+            {
+                primaryCtrls.HLTExiting = 1;
+                primaryCtrls.CR3LoadExiting = 1;
+                primaryCtrls.All = VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PROC_PRIMARY, primaryCtrls.All, NULL, NULL );
+            }
+
+            __vmx_vmwrite( VMCS_CTRL_PRIMARY_EXEC_CTRLS, primaryCtrls.All );
+
+            // Tell the caller which of the two it got
+            GuestRegisters->Rax = primaryCtrls.All;
+
+            break;
+        case HYPERCALL_BENCH_XSTATE:
+
+            // What an exit handler that needs the vector registers pays on top of the exit, for the benchmark (see "Bench.c");
+            //    VMExitDispatch puts the guest's state back before resuming it
+            GuestRegisters->Rax = XStateSave( &LPInfo->XState, XSTATE_AVX | XSTATE_AVX512 );
+
+            break;
+        case HYPERCALL_PROFILE:
+
+            // Arm (or disarm) the preemption timer on this LP, for the profiler (see _ProfileExitPreemptionTimer in "Profile.c")
+            //    (Note: the LP's own controls, which keep its MSR controls (see _WriteMSRAreas), and HYPERCALL_INTERRUPTS')
+            __vmx_vmread( VMCS_CTRL_PIN_EXEC_CTRLS, &value );
+            pinCtrls.All = (UINT32)value;
+            pinCtrls.ActivateVMXPreemptionTimer = g_VMXControls.PinBased.ActivateVMXPreemptionTimer;
+
+            __vmx_vmread( VMCS_CTRL_VM_EXIT_CTRLS, &value );
+            exitCtrls.All = (UINT32)value;
+            exitCtrls.SaveVMXPreemptionTimer = g_VMXControls.Exit.SaveVMXPreemptionTimer;
+
+            if ( GuestRegisters->Rdx != 0 )
+            {
+                pinCtrls.ActivateVMXPreemptionTimer = 1;
+                pinCtrls.All = VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PIN_BASED, pinCtrls.All, NULL, NULL );
+
+                // Have each exit save what's left of the timer, so that it counts guest time across exits; without this,
+                //    every VM-entry would restart it from the full period ([25.5.1] "VMX-Preemption Timer")
+                exitCtrls.SaveVMXPreemptionTimer = 1;
+                exitCtrls.All = VMXFixControls( &g_VMXCapabilities, VMX_CTRL_EXIT, exitCtrls.All, NULL, NULL );
+
+                __vmx_vmwrite( VMCS_GUEST_VMX_PREEMP_TIMER_VAL, (UINT32)GuestRegisters->Rdx );
+            }
+
+            __vmx_vmwrite( VMCS_CTRL_PIN_EXEC_CTRLS, pinCtrls.All );
+            __vmx_vmwrite( VMCS_CTRL_VM_EXIT_CTRLS, exitCtrls.All );
+
+            LPInfo->ProfilePeriod = (pinCtrls.ActivateVMXPreemptionTimer == 1) ? (UINT32)GuestRegisters->Rdx : 0;
+
+            GuestRegisters->Rax = pinCtrls.All;
+
+            break;
+        case HYPERCALL_PML:
+
+            // Start (or stop) logging the guest's page modifications on this LP, for dirty-page tracking (see "PML.c")
+            if ( g_PmlSupported == FALSE )
+            {
+                GuestRegisters->Rax = 0;
+                break;
+            }
+
+            // (Note: the LP's own controls, rather than g_VMXControls; #VEs may be on too, see HYPERCALL_VE)
+            __vmx_vmread( VMCS_CTRL_SECONDARY_EXEC_CTRLS, &value );
+            secondaryCtrls.All = (UINT32)value;
+            secondaryCtrls.EnablePML = 0;
+
+            if ( GuestRegisters->Rdx == TRUE )
+            {
+                // [24.6.18] "Controls for Page-Modification Logging"; the log is filled from its last entry down
+                __vmx_vmwrite( VMCS_CTRL_PML_ADDR_FULL, (UINT64)LPInfo->PMLBuffer.PA );
+                __vmx_vmwrite( VMCS_GUEST_PML_INDEX, PML_INDEX_START );
+
+                secondaryCtrls.EnablePML = 1;
+            }
+            else
+            {
+                _DrainPMLLog( LPInfo );
+            }
+
+            __vmx_vmwrite( VMCS_CTRL_SECONDARY_EXEC_CTRLS, secondaryCtrls.All );
+
+            GuestRegisters->Rax = secondaryCtrls.All;
+
+            break;
+        case HYPERCALL_PML_FLUSH:
+
+            // (Note: only ever sent while every LP is logging; see PmlStart and PmlHarvest in "PML.c")
+            if ( g_PmlSupported == TRUE )
+            {
+                _DrainPMLLog( LPInfo );
+                _InvalidateEPT();
+            }
+
+            GuestRegisters->Rax = 0;
+
+            break;
+        case HYPERCALL_TSC:
+
+            // Take on a new TSC multiplier and offset; the same ones every other LP takes, rebased once for all of them
+            //    (see TscSetPolicy in "TSC.c")
+            LPInfo->TscOffset = GuestRegisters->R8;
+            LPInfo->TscMultiplier = GuestRegisters->Rdx;
+
+            if ( g_VMXControls.Secondary.UseTSCScaling == 1 )
+            {
+                __vmx_vmwrite( VMCS_CTRL_TSC_MULTIPLIER_FULL, LPInfo->TscMultiplier );
+            }
+
+            __vmx_vmwrite( VMCS_CTRL_TSC_OFFSET_FULL, LPInfo->TscOffset );
+
+            GuestRegisters->Rax = LPInfo->TscOffset;
+
+            break;
+        case HYPERCALL_EPT_VIEWS:
+
+            // The views (or the EPTP list) changed (see "VMFunc.c"); the LP's EPTP is whichever view it last switched to
+            //    (Note: translations are tagged by EPTP, so switching views never needs an INVEPT; changing one does)
+            view = _GetGuestView();
+
+            if ( view == EPT_VIEW_INVALID )
+            {
+                view = EPT_VIEW_DEFAULT;
+                _SetGuestView( LPInfo, view );
+            }
+
+            _InvalidateEPT();
+
+            GuestRegisters->Rax = view;
+
+            break;
+        case HYPERCALL_VE:
+
+            // Start (or stop) turning this LP's convertible EPT violations into #VEs, for the guest's handler (see "VE.c")
+            __vmx_vmread( VMCS_CTRL_SECONDARY_EXEC_CTRLS, &value );
+            secondaryCtrls.All = (UINT32)value;
+            secondaryCtrls.EPTViolationVirtExcept = 0;
+
+            LPInfo->VEEnabled = (BOOLEAN)(GuestRegisters->Rdx == TRUE);
+
+            if ( LPInfo->VEEnabled == TRUE )
+            {
+                VeInfoReset( (PVE_INFO)LPInfo->VEInfo.VA );
+
+                // [24.6.19] "Controls for Virtualization Exceptions"; without the control, _ExitEPTViolation delivers them
+                if ( g_VeSupported == TRUE )
+                {
+                    __vmx_vmwrite( VMCS_CTRL_VIRT_EXCEPT_INFO_ADDR_FULL, (UINT64)LPInfo->VEInfo.PA );
+                    __vmx_vmwrite( VMCS_CTRL_EPTP_INDEX, _GetGuestView() );
+
+                    secondaryCtrls.EPTViolationVirtExcept = 1;
+                }
+            }
+
+            __vmx_vmwrite( VMCS_CTRL_SECONDARY_EXEC_CTRLS, secondaryCtrls.All );
+
+            GuestRegisters->Rax = secondaryCtrls.All;
+
+            break;
+        case HYPERCALL_INTERRUPTS:
+
+            // Start (or stop) taking this LP's external interrupts on exits (see "Interrupt.c")
+            if ( g_IntrSupported == FALSE )
+            {
+                GuestRegisters->Rax = 0;
+                break;
+            }
+
+            // [24.6.1] "Pin-Based VM-Execution Controls"
+            __vmx_vmread( VMCS_CTRL_PIN_EXEC_CTRLS, &value );
+            pinCtrls.All = (UINT32)value;
+            pinCtrls.ExternalInterruptExiting = (GuestRegisters->Rdx == TRUE);
+
+            // [24.7.1] "VM-Exit Controls"; with the vector in the exit's interruption information, and no longer pending
+            //    at the local APIC ([27.2.2] "Information for VM Exits Due to Vectored Events")
+            __vmx_vmread( VMCS_CTRL_VM_EXIT_CTRLS, &value );
+            exitCtrls.All = (UINT32)value;
+            exitCtrls.AcknowledgeInterruptOnExit = (GuestRegisters->Rdx == TRUE);
+
+            __vmx_vmwrite( VMCS_CTRL_PIN_EXEC_CTRLS, pinCtrls.All );
+            __vmx_vmwrite( VMCS_CTRL_VM_EXIT_CTRLS, exitCtrls.All );
+
+            // (Note: anything still queued stays that way, and goes to the guest as it can take it, as before)
+
+            GuestRegisters->Rax = pinCtrls.All;
+
+            break;
+        default:
+            _InjectHardwareException( EXCEPTION_VECTOR_UD, FALSE, 0 );
+            return;
+    }
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitMSRAccess(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST BOOLEAN Write
+    )
+{
+    /*
+     * We get here for the MSRs intercepted in our MSR bitmap (see _BuildMSRBitmap in "Driver.c"), and
+     *  for those outside of the ranges the bitmap covers ([24.6.9] "MSR-Bitmap Address"); we simply pass
+     *  these through to the processor
+     *
+     *  (Note: a guest probing for an MSR the processor doesn't have, or writing one a value it won't take,
+     *  expects a #GP(0); the RDMSR or WRMSR raises it here, in VMX root operation, so it's caught and
+     *  handed to the guest instead, without moving past the instruction)
+     */
+
+    UINT64 value;
+
+    __try
+    {
+        if ( Write == TRUE )
+        {
+            value = (GuestRegisters->Rdx << 32) | (UINT32)GuestRegisters->Rax;
+            __writemsr( (UINT32)GuestRegisters->Rcx, value );
+        }
+        else
+        {
+            value = __readmsr( (UINT32)GuestRegisters->Rcx );
+            GuestRegisters->Rax = (UINT32)value;
+            GuestRegisters->Rdx = value >> 32;
+        }
+    }
+    __except ( EXCEPTION_EXECUTE_HANDLER )
+    {
+        _InjectHardwareException( EXCEPTION_VECTOR_GP, TRUE, 0 );
+        return;
+    }
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitRDMSR(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    _ExitMSRAccess( GuestRegisters, LPInfo, FALSE );
+}
+
+VOID
+_ExitWRMSR(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    UINT64 value;
+
+    // We intercept writes to the TSC while we're offsetting it (see _BuildMSRBitmap in "Driver.c"); the guest wants its
+    //    TSC to read this value from now on, which is a new offset for this LP rather than a new TSC for the processor
+    if ( (UINT32)GuestRegisters->Rcx == IA32_TIME_STAMP_COUNTER && g_VMXControls.Primary.TSCOffsetting == 1 )
+    {
+        value = (GuestRegisters->Rdx << 32) | (UINT32)GuestRegisters->Rax;
+
+        LPInfo->TscOffset = TscOffsetFor( __rdtsc(), LPInfo->TscMultiplier, value );
+        __vmx_vmwrite( VMCS_CTRL_TSC_OFFSET_FULL, LPInfo->TscOffset );
+
+        _AdvanceGuestRIP( LPInfo );
+        return;
+    }
+
+    _ExitMSRAccess( GuestRegisters, LPInfo, TRUE );
+}
+
+VOID
+_ExitCRAccess(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // [27.2.1] "Basic VM-Exit Information", Table 27-3
+
+    CR_ACCESS_QUALIFICATION qualification;
+    CR4 cr4;
+    UINT64 value;
+
+    qualification.All = VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL );
+
+    switch ( qualification.AccessType )
+    {
+        case CR_ACCESS_MOV_TO_CR:
+
+            if ( qualification.GPR == 4 )
+            {
+                value = VMExitRead( LPInfo, VMCS_CACHE_GUEST_RSP );
+            }
+            else
+            {
+                value = GuestRegisters->GPR[qualification.GPR];
+            }
+
+            if ( qualification.CRNumber == 3 )
+            {
+                // Bit 63 only tells the processor not to invalidate the PCID; it isn't part of CR3 ([4.10.4.1] "Operations that Invalidate TLBs and Paging-Structure Caches")
+                VMExitWrite( LPInfo, VMCS_CACHE_GUEST_CR3, value & ~(1ULL << 63) );
+
+                // Writing the VMCS doesn't flush anything; with VPIDs, the guest's old non-global translations would outlive the MOV
+                cr4.All = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR4 );
+
+                if ( g_VMXControls.Secondary.EnableVPID == 1 && (cr4.PCIDE == 0 || (value & (1ULL << 63)) == 0) )
+                {
+                    VMXInvalidateVPID( LPInfo->VPID, VPID_INVALIDATE_NON_GLOBAL, 0 );
+                }
+            }
+            else if ( qualification.CRNumber == 4 )
+            {
+                // We own CR4.VMXE (see the CR4 guest/host mask in "Driver.c"); the guest sees what it wrote, and keeps running with VMXE set
+                cr4.All = value;
+                __vmx_vmwrite( VMCS_CTRL_CR4_READ_SHADOW, cr4.All );
+
+                cr4.VMXE = 1;
+                VMExitWrite( LPInfo, VMCS_CACHE_GUEST_CR4, cr4.All );
+
+                // Changing paging modes (CR4.PGE, PCIDE, ...) flushes every translation, globals included ([4.10.4.1])
+                if ( g_VMXControls.Secondary.EnableVPID == 1 )
+                {
+                    VMXInvalidateVPID( LPInfo->VPID, VPID_INVALIDATE_CONTEXT, 0 );
+                }
+            }
+            else if ( qualification.CRNumber == 8 )
+            {
+                // Only while the guest's task priority holds back an interrupt it's waiting on (see _DeliverQueuedInterrupts);
+                //  CR8 is the local APIC's TPR, which we share with the guest, and the MOV after this one may be the one
+                //  that lets it through
+                __writecr8( value );
+
+                _AdvanceGuestRIP( LPInfo );
+                _DeliverQueuedInterrupts( LPInfo );
+                return;
+            }
+            else
+            {
+                goto __unhandled;
+            }
+
+            break;
+        case CR_ACCESS_MOV_FROM_CR:
+
+            if ( qualification.CRNumber != 3 )
+            {
+                goto __unhandled;
+            }
+
+            value = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR3 );
+
+            if ( qualification.GPR == 4 )
+            {
+                VMExitWrite( LPInfo, VMCS_CACHE_GUEST_RSP, value );
+            }
+            else
+            {
+                GuestRegisters->GPR[qualification.GPR] = value;
+            }
+
+            break;
+        default:
+            goto __unhandled;
+    }
+
+    _AdvanceGuestRIP( LPInfo );
+    return;
+
+__unhandled:
+    // CLTS/LMSW, CR0 accesses and reads of CR8 can't exit with our CR0 guest/host mask and processor controls
+    __debugbreak();
+    KeBugCheckEx( HYPERVISOR_ERROR, REASON_CONTROL_REGISTER_ACCESS, qualification.All, 0, LPInfo->Index );
+}
+
+VOID
+_ExitXSETBV(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // [27.1.2] "Instructions That Cause VM Exits Unconditionally"; the CPL and CR4.OSXSAVE checks come first
+
+    UINT64 value = (GuestRegisters->Rdx << 32) | (UINT32)GuestRegisters->Rax;
+
+    // A value XSETBV would refuse has to #GP the guest, rather than us
+    if ( XStateIsValidXCR0( (UINT32)GuestRegisters->Rcx, value, g_XStateFeatures.SupportedXCR0 ) == FALSE )
+    {
+        _InjectHardwareException( EXCEPTION_VECTOR_GP, TRUE, 0 );
+        return;
+    }
+
+    // The guest and host share XCR0, so just load whatever the guest asked for
+    //    (Note: whatever an exit handler borrows from then on is chosen against the new value, see XStateSave)
+    _xsetbv( (UINT32)GuestRegisters->Rcx, value );
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+UINT32
+_IOPortRead(
+    _In_ CONST UINT16 Port,
+    _In_ CONST UINT32 Size
+    )
+{
+    switch ( Size )
+    {
+        case 1:     return __inbyte( Port );
+        case 2:     return __inword( Port );
+        default:    return __indword( Port );
+    }
+}
+
+VOID
+_IOPortWrite(
+    _In_ CONST UINT16 Port,
+    _In_ CONST UINT32 Size,
+    _In_ CONST UINT32 Value
+    )
+{
+    switch ( Size )
+    {
+        case 1:     __outbyte( Port, (UINT8)Value );    break;
+        case 2:     __outword( Port, (UINT16)Value );   break;
+        default:    __outdword( Port, Value );          break;
+    }
+}
+
+UINT64
+_AddressSizeMask(
+    _In_ CONST UINT32 AddressSize
+    )
+{
+    // See IO_STRING_INSTR_INFO.AddressSize
+    switch ( AddressSize )
+    {
+        case 0:     return 0xFFFF;
+        case 1:     return 0xFFFFFFFF;
+        default:    return ~0ULL;
+    }
+}
+
+UINT64
+_UpdateStringRegister(
+    _In_ CONST UINT64 Register,
+    _In_ CONST INT64 Delta,
+    _In_ CONST UINT32 AddressSize
+    )
+{
+    // Add Delta to RCX, RSI or RDI, as a string instruction with the given address size would ([7.3.9] "String Operations")
+    //    (Note: a 16-bit update keeps the upper bits; a 32-bit one zeroes them, like any 32-bit register write)
+
+    UINT64 mask = _AddressSizeMask( AddressSize );
+
+    if ( AddressSize == 0 )
+    {
+        return (Register & ~mask) | ((Register + Delta) & mask);
+    }
+
+    return (Register + Delta) & mask;
+}
+
+volatile UINT64*
+_MapGuestEntry(
+    _In_opt_ PVOID Context,
+    _In_ UINT64 PhysicalAddress
+    )
+{
+    // GUEST_MAP_ENTRY, through the exiting LP's window; EPT maps the guest's physical memory 1:1 (see _BuildEPT in "Driver.c")
+    return (volatile UINT64*)utlMapPhysical( (PPHYSICAL_WINDOW)Context, PhysicalAddress );
+}
+
+BOOLEAN
+_TranslateIOElement(
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST GUEST_PAGING* Paging,
+    _In_ CONST UINT64 Linear,
+    _In_ CONST UINT32 Size,
+    _In_ CONST UINT32 Access,
+    _Out_writes_(2) PUINT64 PhysicalAddresses,
+    _Out_ PUINT64 FaultAddress,
+    _Out_ PUINT32 ErrorCode
+    )
+{
+    // The guest-physical addresses of an element's bytes on its first page, and on the next one if it runs onto it;
+    //    FALSE (with where the fault is, and its error code) if either page can't be accessed the way the guest wants
+
+    UINT64 next = (Linear | (PAGE_SIZE - 1)) + 1;
+
+    *FaultAddress = Linear;
+    PhysicalAddresses[1] = 0;
+
+    if ( GuestWalkTranslate( Paging, Linear, Access, _MapGuestEntry, &LPInfo->PhysicalWindow, &PhysicalAddresses[0], ErrorCode ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    if ( Linear + Size - 1 < next )
+    {
+        return TRUE;
+    }
+
+    *FaultAddress = next;
+
+    return GuestWalkTranslate( Paging, next, Access, _MapGuestEntry, &LPInfo->PhysicalWindow, &PhysicalAddresses[1], ErrorCode );
+}
+
+VOID
+_CopyIOElement(
+    _Inout_ PLP_INFO LPInfo,
+    _In_reads_(2) CONST UINT64* PhysicalAddresses,
+    _In_ CONST UINT64 Linear,
+    _In_ CONST UINT32 Size,
+    _Inout_updates_bytes_(Size) PUINT8 Value,
+    _In_ CONST BOOLEAN ToGuest
+    )
+{
+    // Copy an element to (or from) the guest's memory at the addresses _TranslateIOElement found, a page at a time
+
+    UINT32 first = (UINT32)min( Size, PAGE_SIZE - (Linear & (PAGE_SIZE - 1)) );
+    PUINT8 mapped = utlMapPhysical( &LPInfo->PhysicalWindow, PhysicalAddresses[0] );
+    UINT32 i;
+
+    for ( i = 0; i < Size; i++ )
+    {
+        // The rest of it is on the next page (Note: the window only holds one page at a time)
+        if ( i == first )
+        {
+            mapped = (PUINT8)utlMapPhysical( &LPInfo->PhysicalWindow, PhysicalAddresses[1] ) - first;
+        }
+
+        if ( ToGuest == TRUE )
+        {
+            mapped[i] = Value[i];
+        }
+        else
+        {
+            Value[i] = mapped[i];
+        }
+    }
+}
+
+VOID
+_ExitIOString(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo,
+    _In_ CONST IO_INSTRUCTION_QUALIFICATION Qualification
+    )
+{
+    /*
+     * INS/OUTS, with or without a REP prefix ([27.2.5] "Information for VM Exits Due to Instruction Execution")
+     *
+     *  The exit gives us the linear address of the first element (segment base included), so all we need
+     *  is to step through the rest, and update RCX/RSI/RDI the way the instruction would have. The memory is
+     *  the guest's, so each element is translated through the guest's paging structures (see "GuestWalk.c"),
+     *  and accessed at the guest-physical address it comes to; an element the guest's processor would fault on
+     *  becomes that same #PF in the guest (or #GP, for a non-canonical address), which re-executes the
+     *  instruction with whatever count is left. Both of an element's pages are checked before the port is
+     *  touched, so a faulting element is never half done.
+     */
+
+    IO_STRING_INSTR_INFO instrInfo;
+    SEG_ACCESS_RIGHTS ssAR;
+    GUEST_PAGING paging;
+    CR0 guestCR0;
+    CR4 guestCR4;
+
+    UINT32 size = (UINT32)Qualification.SizeOfAccess + 1;
+    UINT16 port = (UINT16)Qualification.Port;
+    UINT32 access = (Qualification.DirectionIn == 1) ? GUEST_ACCESS_WRITE : 0;
+    UINT64 count, linear, rflags, faultAddress;
+    UINT64 physicalAddresses[2];
+    size_t value = 0;
+    UINT32 element;
+    UINT32 errorCode;
+    INT64 step;
+    BOOLEAN faulted = FALSE;
+
+    // Without INS/OUTS reporting, assume the 64-bit addressing a 64-bit kernel uses
+    instrInfo.All = 0;
+    instrInfo.AddressSize = 2;
+
+    if ( g_VMXCapabilities.Basic.INSOUTSReporting == 1 )
+    {
+        instrInfo.All = (UINT32)VMExitRead( LPInfo, VMCS_CACHE_EXIT_INSTR_INFO );
+    }
+
+    count = 1;
+
+    if ( Qualification.Rep == 1 )
+    {
+        count = GuestRegisters->Rcx & _AddressSizeMask( instrInfo.AddressSize );
+    }
+
+    // RFLAGS.DF ([3.4.3.2] "DF Flag")
+    rflags = VMExitRead( LPInfo, VMCS_CACHE_GUEST_RFLAGS );
+    step = ((rflags & (1 << 10)) != 0) ? -(INT64)size : (INT64)size;
+
+    linear = VMExitRead( LPInfo, VMCS_CACHE_GUEST_LIN_ADDR );
+
+    // The guest's paging mode; [5.5] "Privilege Levels": the CPL is the DPL of the SS segment
+    __vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &value );
+    ssAR.All = (UINT32)value;
+
+    guestCR0.All = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR0 );
+    guestCR4.All = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR4 );
+
+    paging.CR3 = VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR3 );
+    paging.CPL = (UINT8)ssAR.DPL;
+    paging.FiveLevel = (guestCR4.LA57 == 1);
+    paging.WriteProtect = (guestCR0.WriteProtect == 1);
+
+    // [4.6.1] "Determination of Access Rights"; RFLAGS.AC (bit 18) lifts SMAP for explicit accesses
+    paging.SMAP = (guestCR4.SMAPEnable == 1 && (rflags & (1 << 18)) == 0);
+
+    for ( ; count != 0; count-- )
+    {
+        if ( GuestWalkIsCanonical( &paging, linear ) == FALSE || GuestWalkIsCanonical( &paging, linear + size - 1 ) == FALSE )
+        {
+            _InjectHardwareException( EXCEPTION_VECTOR_GP, TRUE, 0 );
+            break;
+        }
+
+        if ( _TranslateIOElement( LPInfo, &paging, linear, size, access, physicalAddresses, &faultAddress, &errorCode ) == FALSE )
+        {
+            faulted = TRUE;
+            break;
+        }
+
+        if ( Qualification.DirectionIn == 1 )
+        {
+            element = _IOPortRead( port, size );
+
+            _CopyIOElement( LPInfo, physicalAddresses, linear, size, (PUINT8)&element, TRUE );
+            GuestRegisters->Rdi = _UpdateStringRegister( GuestRegisters->Rdi, step, instrInfo.AddressSize );
+        }
+        else
+        {
+            element = 0;
+
+            _CopyIOElement( LPInfo, physicalAddresses, linear, size, (PUINT8)&element, FALSE );
+            _IOPortWrite( port, size, element );
+            GuestRegisters->Rsi = _UpdateStringRegister( GuestRegisters->Rsi, step, instrInfo.AddressSize );
+        }
+
+        if ( Qualification.Rep == 1 )
+        {
+            GuestRegisters->Rcx = _UpdateStringRegister( GuestRegisters->Rcx, -1, instrInfo.AddressSize );
+        }
+
+        linear += step;
+    }
+
+    utlUnmapPhysical( &LPInfo->PhysicalWindow );
+
+    if ( faulted == TRUE )
+    {
+        // CR2 isn't part of the guest state area; it's shared, so setting it here sets the guest's ([4.7] "Page-Fault Exceptions")
+        __writecr2( faultAddress );
+
+        _InjectHardwareException( EXCEPTION_VECTOR_PF, TRUE, errorCode );
+        return;
+    }
+
+    // (Note: an element that wasn't canonical has already been made a #GP, and the instruction isn't done)
+    if ( count != 0 )
+    {
+        return;
+    }
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitIOInstruction(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * [27.2.1] "Basic VM-Exit Information", Table 27-5
+     *
+     *  We only get here for the ports intercepted in our I/O bitmaps (see _BuildIOBitmap in "Driver.c");
+     *  those accesses are carried out on the guest's behalf, exactly as it asked for them.
+     */
+
+    IO_INSTRUCTION_QUALIFICATION qualification;
+    UINT32 size;
+    UINT32 value;
+
+    qualification.All = VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL );
+
+    if ( qualification.String == 1 )
+    {
+        _ExitIOString( GuestRegisters, LPInfo, qualification );
+        return;
+    }
+
+    size = (UINT32)qualification.SizeOfAccess + 1;
+
+    if ( qualification.DirectionIn == 1 )
+    {
+        value = _IOPortRead( (UINT16)qualification.Port, size );
+
+        // IN AL/AX leave the rest of RAX alone; IN EAX zeroes the upper half, like any 32-bit register write
+        switch ( size )
+        {
+            case 1:     GuestRegisters->Rax = (GuestRegisters->Rax & ~0xFFULL) | value;      break;
+            case 2:     GuestRegisters->Rax = (GuestRegisters->Rax & ~0xFFFFULL) | value;    break;
+            default:    GuestRegisters->Rax = value;                                        break;
+        }
+    }
+    else
+    {
+        _IOPortWrite( (UINT16)qualification.Port, size, (UINT32)GuestRegisters->Rax );
+    }
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitHLT(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * HLT only exits while the benchmark has HLT exiting on (see HYPERCALL_BENCH_EXITING); we just carry on
+     *  as though an interrupt had woken the LP straight away, which HLT allows for anyway
+     */
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitExternalInterrupt(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * An external interrupt arrived while the guest ran, and is ours now (see HYPERCALL_INTERRUPTS); acknowledged, so
+     *  the local APIC won't deliver it again. It goes straight back to the guest on this VM-entry, when it can take
+     *  it; or waits in the LP's queue until it can.
+     *  Nothing happened in the guest to cause this, so there's no instruction to skip.
+     */
+
+    VM_ENTRY_INT_INFO intInfo;
+    size_t value = 0;
+    UINT8 vector;
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    // [27.2.2] "Information for VM Exits Due to Vectored Events"; same format as the VM-entry field
+    __vmx_vmread( VMCS_RO_VM_EXIT_INT_INFO, &value );
+    intInfo.All = (UINT32)value;
+
+    // The interrupt may have come in while the processor was delivering one of the guest's events
+    _ReinjectVectoredEvent( LPInfo, FALSE );
+
+    if ( intInfo.Valid == FALSE )
+    {
+        return;
+    }
+
+    vector = (UINT8)intInfo.Vector;
+
+    // The fast path; nothing's waiting ahead of it, and it's injected on the VM-entry that ends this very exit
+    if ( LPInfo->Interrupts.Count == 0 && _CanInjectInterrupt( LPInfo, vector ) == TRUE )
+    {
+        _InjectExternalInterrupt( vector );
+        return;
+    }
+
+    IntrQueuePush( &LPInfo->Interrupts, vector );
+    _DeliverQueuedInterrupts( LPInfo );
+}
+
+VOID
+_ExitInterruptWindow(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // The guest can take an interrupt again, and has some waiting (see _DeliverQueuedInterrupts)
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    _DeliverQueuedInterrupts( LPInfo );
+}
+
+VOID
+_ExitINVD(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    // We can't let the guest discard caches without writing them back; the host's data is in them too
+    __wbinvd();
+
+    _AdvanceGuestRIP( LPInfo );
+}
+
+VOID
+_ExitEPTViolation(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * [28.2.3.2] "EPT Violations"
+     *
+     *  Our identity map allows everything, everywhere below its MapLimit; so in the default view, the guest can only
+     *  get here by touching a guest-physical address we never mapped (see _BuildEPT in "Driver.c"). In any other
+     *  view, it's an access the view was set up to refuse (see VmfuncProtectPage in "VMFunc.c"); the LP goes back to
+     *  the default view, and retries the access there.
+     *
+     *  With #VEs on, a refused access to a convertible page is the guest's to handle, if it can take it (see "VE.c");
+     *  one it can't is handled as above.
+     */
+
+    EPT_VIOLATION_QUALIFICATION qualification;
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    if ( LPInfo->VEEnabled == TRUE && _DeliverVirtualizationException( LPInfo ) == TRUE )
+    {
+        return;
+    }
+
+    if ( g_VmfuncSupported == TRUE )
+    {
+        if ( _GetGuestView() != EPT_VIEW_DEFAULT &&
+             VMExitRead( LPInfo, VMCS_CACHE_GUEST_PHYS_ADDR ) < g_EPTView.MapLimit )
+        {
+            qualification.All = VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL );
+
+            _SetGuestView( LPInfo, EPT_VIEW_DEFAULT );
+            _ReinjectVectoredEvent( LPInfo, (BOOLEAN)qualification.NMIUnblocking );
+
+            return;
+        }
+    }
+
+    __debugbreak();
+    KeBugCheckEx(
+        HYPERVISOR_ERROR,
+        REASON_EPT_VIOLATION,
+        VMExitRead( LPInfo, VMCS_CACHE_GUEST_PHYS_ADDR ),
+        VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL ),
+        LPInfo->Index
+        );
+}
+
+VOID
+_ExitEPTMisconfiguration(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // [28.2.3.1] "EPT Misconfigurations": one of our EPT entries is malformed; there's nothing the guest can do about this
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    __debugbreak();
+    KeBugCheckEx(
+        HYPERVISOR_ERROR,
+        REASON_EPT_MISCONFIGURATION,
+        VMExitRead( LPInfo, VMCS_CACHE_GUEST_PHYS_ADDR ),
+        0,
+        LPInfo->Index
+        );
+}
+
+VOID
+_ExitPMLLogFull(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * [28.2.5] "Page-Modification Logging": the guest wrote to a page that needed logging, with this LP's log already
+     *  full. Nothing was written yet; so once the log is drained, the guest just retries the write (along with the
+     *  delivery of whatever event the write was part of, see _ReinjectVectoredEvent).
+     */
+
+    UINT64 qualification;
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    _DrainPMLLog( LPInfo );
+
+    // [27.2.1] "Basic VM-Exit Information"; bit 12 is the only one defined for this exit, and says (as for an EPT
+    //  violation) whether the write was an IRET's that had just unblocked NMIs
+    qualification = VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL );
+
+    _ReinjectVectoredEvent( LPInfo, (BOOLEAN)((qualification >> 12) & 1) );
+}
+
+VOID
+_ExitUndefinedInstruction(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    UNREFERENCED_PARAMETER( GuestRegisters );
+    UNREFERENCED_PARAMETER( LPInfo );
+
+    // We don't expose SMX or nested VMX to the guest, so do what the processor would do without them
+    _InjectHardwareException( EXCEPTION_VECTOR_UD, FALSE, 0 );
+}
+
+VOID
+_ExitUnhandled(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    // The default handler; for exits our controls should never have caused
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    __debugbreak();
+    KeBugCheckEx(
+        HYPERVISOR_ERROR,
+        VMExitRead( LPInfo, VMCS_CACHE_EXIT_REASON ),
+        VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL ),
+        VMExitRead( LPInfo, VMCS_CACHE_GUEST_RIP ),
+        LPInfo->Index
+        );
+}
+
+VOID
+VMExitInitializeHandlers()
+{
+    // Note: this must run before any LP is virtualized; VMExitRegisterHandler is for everything after that
+
+    ULONG i;
+
+    for ( i = 0; i < VMEXIT_HANDLER_COUNT; i++ )
+    {
+        g_ExitHandlers[i] = _ExitUnhandled;
+    }
+
+    g_ExitHandlers[REASON_CPUID] = _ExitCPUID;
+    g_ExitHandlers[REASON_VMCALL] = _ExitVMCALL;
+    g_ExitHandlers[REASON_RDMSR] = _ExitRDMSR;
+    g_ExitHandlers[REASON_WRMSR] = _ExitWRMSR;
+    g_ExitHandlers[REASON_CONTROL_REGISTER_ACCESS] = _ExitCRAccess;
+    g_ExitHandlers[REASON_XSETBV] = _ExitXSETBV;
+    g_ExitHandlers[REASON_INVD] = _ExitINVD;
+    g_ExitHandlers[REASON_HLT] = _ExitHLT;
+    // (Note: REASON_PREEMPTION_TIMER_EXPIRE is registered by ProfileStart, for as long as the profiler is sampling)
+    g_ExitHandlers[REASON_IO_INSTRUCTION] = _ExitIOInstruction;
+    g_ExitHandlers[REASON_EPT_VIOLATION] = _ExitEPTViolation;
+    g_ExitHandlers[REASON_EPT_MISCONFIGURATION] = _ExitEPTMisconfiguration;
+    g_ExitHandlers[REASON_PML_LOG_FULL] = _ExitPMLLogFull;
+    g_ExitHandlers[REASON_EXTERNAL_INTERRUPT] = _ExitExternalInterrupt;
+    g_ExitHandlers[REASON_INTERRUPT_WINDOW] = _ExitInterruptWindow;
+
+    g_ExitHandlers[REASON_GETSEC] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMCLEAR] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMLAUNCH] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMPTRLD] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMPTRST] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMREAD] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMRESUME] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMWRITE] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMXOFF] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_VMXON] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_INVEPT] = _ExitUndefinedInstruction;
+    g_ExitHandlers[REASON_INVVPID] = _ExitUndefinedInstruction;
+
+    // VMFUNC only exits for an index that isn't in the EPTP list (see "VMFunc.c"); which is a #UD as far as the guest can tell
+    g_ExitHandlers[REASON_VMFUNC] = _ExitUndefinedInstruction;
+}
+
+VMEXIT_HANDLER
+VMExitRegisterHandler(
+    _In_ CONST VMX_BASIC_EXIT_REASON Reason,
+    _In_opt_ CONST VMEXIT_HANDLER Handler
+    )
+{
+    /*
+     * Replace the handler for an exit reason, and return the one it replaced (so that instrumentation can
+     *  wrap, and later restore, the original). Passing NULL restores the default handler.
+     *
+     *  This may be called while LPs are virtualized; an exit on another LP sees either the old or the new
+     *  handler, never a torn pointer.
+     */
+
+    NT_ASSERT( Reason < VMEXIT_HANDLER_COUNT );
+
+    return (VMEXIT_HANDLER)InterlockedExchangePointer(
+        (PVOID*)&g_ExitHandlers[Reason],
+        (PVOID)(Handler != NULL ? Handler : _ExitUnhandled)
+        );
+}
+
+VOID
+VMExitDispatch(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    VM_EXIT_REASON exitReason;
+    VMEXIT_HANDLER handler;
+    UINT64 exitTsc = __rdtsc();
+
+    // Nothing read during the last exit is valid for this one
+    LPInfo->ExitCache.Valid = 0;
+    LPInfo->ExitCache.Exits++;
+
+    exitReason.All = (UINT32)VMExitRead( LPInfo, VMCS_CACHE_EXIT_REASON );
+
+    if ( exitReason.EntryFailure == TRUE )
+    {
+        /*
+         * The guest state didn't pass the checks in [26.3] "Checking and Loading Guest State". The only entry
+         *  that can realistically fail this way is our first one, so go back to VMLaunchLP (the guest RIP)
+         *  as the host, with VMX operation turned off and the failure reported in RAX
+         */
+        LPInfo->InstrError = exitReason.All;
+        LpStateAdvance( &LPInfo->State, LP_STATE_FAILED );
+
+        GuestRegisters->Rax = VMX_ERROR_STATUS;
+        _Devirtualize( GuestRegisters, LPInfo );
+    }
+
+    // (Note: only while a reader has the rings mapped; the qualification and RIP reads are cached for the handler)
+    if ( g_TraceEnabled != FALSE && LPInfo->TraceRing != NULL )
+    {
+        TraceRingWrite(
+            LPInfo->TraceRing,
+            exitTsc,
+            exitReason.All,
+            VMExitRead( LPInfo, VMCS_CACHE_EXIT_QUAL ),
+            VMExitRead( LPInfo, VMCS_CACHE_GUEST_RIP )
+            );
+    }
+
+    if ( exitReason.BasicReason >= VMEXIT_HANDLER_COUNT )
+    {
+        _ExitUnhandled( GuestRegisters, LPInfo );
+    }
+
+    handler = g_ExitHandlers[exitReason.BasicReason];
+
+    /*
+     * Fast path: the exits the guest causes most often get a direct call, as long as nobody has replaced
+     *  their handlers. The comparisons are cheap and predictable, and spare the hottest exits the indirect
+     *  call (and its retpoline/CFG overhead, where enabled). Everything else takes the table.
+     */
+    if ( handler == _ExitCPUID )
+    {
+        _ExitCPUID( GuestRegisters, LPInfo );
+    }
+    else if ( handler == _ExitRDMSR )
+    {
+        _ExitRDMSR( GuestRegisters, LPInfo );
+    }
+    else if ( handler == _ExitWRMSR )
+    {
+        _ExitWRMSR( GuestRegisters, LPInfo );
+    }
+    else if ( handler == _ExitVMCALL )
+    {
+        _ExitVMCALL( GuestRegisters, LPInfo );
+    }
+    else if ( handler == _ExitEPTViolation )
+    {
+        _ExitEPTViolation( GuestRegisters, LPInfo );
+    }
+    else
+    {
+        handler( GuestRegisters, LPInfo );
+    }
+
+    // Give back whatever extended state the handler borrowed (see XStateSave); nothing, on almost every exit
+    if ( LPInfo->XState.SavedMask != 0 )
+    {
+        XStateRestore( &LPInfo->XState );
+    }
+
+    // Commit whatever the handler changed, right before VMExitStub resumes the guest
+    _VMExitWriteBack( LPInfo );
+
+    // (Note: exits that never resume the guest, such as HYPERCALL_DEVIRTUALIZE, aren't counted)
+    StatsRecordExit( LPInfo->ExitStats, exitReason.BasicReason, __rdtsc() - exitTsc );
+}
+
+VOID
+VMResumeFailure(
+    _In_ PLP_INFO LPInfo
+    )
+{
+    // VMExitStub calls this if VMRESUME falls through; the guest state is gone at this point, so there's no coming back
+    size_t instrError = 0;
+
+    __vmx_vmread( VMCS_RO_VM_INSTR_ERR, &instrError );
+
+    __debugbreak();
+    KeBugCheckEx( HYPERVISOR_ERROR, REASON_VMRESUME, instrError, 0, LPInfo->Index );
+}
@@ -0,0 +1,224 @@
+#ifndef __EXIT_H__
+#define __EXIT_H__
+
+#include <ntifs.h>
+#include <intrin.h>
+
+#include "CPU.h"
+#include "VMX.h"
+#include "VMCS.h"
+#include "Seg.h"
+
+/*
+ * Each host stack has this many bytes reserved at its very top, the first 8 of which hold the
+ *  PLP_INFO of the LP that owns the stack, and the next 8 its PCPUID_TABLE (NULL until it's been
+ *  built). VMCS_HOST_RSP points at this reservation, so that our VM-exit stub can find its per-LP
+ *  data without a single VMREAD (see "vmexit.asm").
+ *  (Note: 16 bytes, rather than 8, keeps the host RSP 16-byte aligned)
+ */
+#define HOST_STACK_RESERVED					16
+
+// Hypercalls are issued by the guest via `VMCALL` with the number in RCX (see GuestVmcall in "guest.asm")
+//	(Note: the magic in the upper 32 bits keeps us from swallowing VMCALLs that weren't meant for us)
+#define HYPERCALL_MAGIC						0x5350544800000000ULL	// 'SPTH'
+#define HYPERCALL_PING						(HYPERCALL_MAGIC | 0x0)	// Returns HYPERCALL_MAGIC in RAX
+#define HYPERCALL_DEVIRTUALIZE				(HYPERCALL_MAGIC | 0x1)	// Leaves VMX operation, and continues as the host (returns TRUE); FALSE while external interrupts are queued
+#define HYPERCALL_BENCH_EXITING				(HYPERCALL_MAGIC | 0x2)	// Turns the exits only the benchmark needs on (RDX = TRUE) or off, on this LP
+#define HYPERCALL_PROFILE					(HYPERCALL_MAGIC | 0x3)	// Samples the guest every RDX preemption timer ticks (0 stops), on this LP
+#define HYPERCALL_PML						(HYPERCALL_MAGIC | 0x4)	// Starts logging page modifications (RDX = TRUE), or drains the log and stops, on this LP
+#define HYPERCALL_PML_FLUSH					(HYPERCALL_MAGIC | 0x5)	// Drains this LP's page-modification log, and invalidates its cached EPT dirty flags
+#define HYPERCALL_TSC						(HYPERCALL_MAGIC | 0x6)	// Gives this LP's guest TSC the multiplier in RDX and the offset in R8 (the same on every LP)
+#define HYPERCALL_BENCH_XSTATE				(HYPERCALL_MAGIC | 0x7)	// Borrows the guest's AVX (and AVX-512) state, as a slow exit path would; returns the components saved
+#define HYPERCALL_EPT_VIEWS					(HYPERCALL_MAGIC | 0x8)	// Drops this LP's cached EPT views, leaving any view no longer in the EPTP list; returns the view it's in
+#define HYPERCALL_VE						(HYPERCALL_MAGIC | 0x9)	// Starts delivering #VEs for convertible EPT violations (RDX = TRUE), or stops, on this LP
+#define HYPERCALL_INTERRUPTS				(HYPERCALL_MAGIC | 0xA)	// Starts taking external interrupts on exits (RDX = TRUE), or lets them straight through, on this LP
+
+// [Table 6-1] "Exceptions and Interrupts"
+#define EXCEPTION_VECTOR_UD					6
+#define EXCEPTION_VECTOR_GP					13
+#define EXCEPTION_VECTOR_PF					14
+#define EXCEPTION_VECTOR_VE					20
+
+#pragma warning(push)
+
+#pragma warning(disable:4201) // nonstandard extension used: nameless struct/union
+
+/*
+ * The guest register state saved (and restored) by VMExitStub on every VM-exit; this lives at the
+ *  top of the exiting LP's host stack for the duration of the exit.
+ *
+ *  The GPRs are ordered by their register numbers (RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8-R15),
+ *  which lets us index them directly with the register fields found in exit qualifications
+ *  (see [27.2.1] "Basic VM-Exit Information", Table 27-3). The guest RSP lives in the VMCS; its slot
+ *  here is only a placeholder.
+ *
+ *  Only the volatile XMM registers are saved, as the C dispatcher is free to clobber them (per the
+ *  x64 calling convention), while the nonvolatile ones are preserved for us by the compiler.
+ */
+typedef struct _GUEST_REGISTERS
+{
+	M128A Xmm[6];
+	union
+	{
+		struct
+		{
+			UINT64 Rax;
+			UINT64 Rcx;
+			UINT64 Rdx;
+			UINT64 Rbx;
+			UINT64 Rsp;
+			UINT64 Rbp;
+			UINT64 Rsi;
+			UINT64 Rdi;
+			UINT64 R8;
+			UINT64 R9;
+			UINT64 R10;
+			UINT64 R11;
+			UINT64 R12;
+			UINT64 R13;
+			UINT64 R14;
+			UINT64 R15;
+		};
+		UINT64 GPR[16];
+	};
+} GUEST_REGISTERS, *PGUEST_REGISTERS;
+
+#pragma warning(pop)
+
+// VMExitStub depends on this exact layout
+C_ASSERT( sizeof(GUEST_REGISTERS) == 0xE0 );
+
+/*
+ * The VMCS fields handlers most often need, which are read (at most once) per exit and cached in the
+ *  exiting LP's VMCS_CACHE. The guest fields may also be written; these are held in the cache until
+ *  the end of the exit, and written back (once) right before the guest is resumed.
+ *
+ *  (Note: the read-only exit information fields come first; see VMCS_CACHE_FIRST_WRITABLE)
+ */
+typedef enum _VMCS_CACHE_FIELD
+{
+	VMCS_CACHE_EXIT_REASON,
+	VMCS_CACHE_EXIT_QUAL,
+	VMCS_CACHE_EXIT_INSTR_LEN,
+	VMCS_CACHE_EXIT_INSTR_INFO,
+	VMCS_CACHE_IDT_VEC_INFO,
+	VMCS_CACHE_GUEST_LIN_ADDR,
+	VMCS_CACHE_GUEST_PHYS_ADDR,
+	VMCS_CACHE_GUEST_RIP,
+	VMCS_CACHE_GUEST_RSP,
+	VMCS_CACHE_GUEST_RFLAGS,
+	VMCS_CACHE_GUEST_CR0,
+	VMCS_CACHE_GUEST_CR3,
+	VMCS_CACHE_GUEST_CR4,
+	VMCS_CACHE_FIELD_COUNT
+} VMCS_CACHE_FIELD;
+
+#define VMCS_CACHE_FIRST_WRITABLE			VMCS_CACHE_GUEST_RIP
+
+typedef struct _VMCS_CACHE
+{
+	// Bitmasks of VMCS_CACHE_FIELD; reset at the start of every exit
+	UINT32 Valid;
+	UINT32 Dirty;
+
+	UINT64 Values[VMCS_CACHE_FIELD_COUNT];
+
+	// Lifetime counters for this LP
+	UINT64 Exits;
+	UINT64 VMReads;			// VMREADs actually issued
+	UINT64 ReadsSaved;		// Reads served from the cache
+	UINT64 VMWrites;		// VMWRITEs actually issued (at write-back)
+	UINT64 WritesSaved;		// Writes to an already dirty field, coalesced into one VMWRITE
+} VMCS_CACHE, *PVMCS_CACHE;
+
+struct _LP_INFO;
+
+/*
+ * VM-exit handlers, one per basic exit reason (see g_ExitHandlers in "Exit.c").
+ *
+ *  A handler is responsible for everything the exit requires before the guest is resumed; advancing
+ *  the guest RIP, injecting an event, and so on.
+ */
+typedef VOID (*VMEXIT_HANDLER)(
+	_Inout_ PGUEST_REGISTERS GuestRegisters,
+	_Inout_ struct _LP_INFO* LPInfo
+	);
+
+#define VMEXIT_HANDLER_COUNT				(VMX_MAX_BASIC_EXIT_REASON + 1)
+
+
+
+//
+// External VMX root/non-root functions (see "vmexit.asm" and "guest.asm")
+//
+
+extern VMX_STATUS_CODE VMLaunchLP();
+
+extern void VMExitStub();
+
+extern UINT64 GuestVmcall(
+	_In_ UINT64 Hypercall,
+	_In_opt_ UINT64 Argument1,
+	_In_opt_ UINT64 Argument2
+	);
+
+// Switches the current LP to another EPT view, without an exit (see VmfuncSwitchView in "VMFunc.c")
+extern VOID GuestSwitchView(
+	_In_ ULONG View
+	);
+
+// The benchmark payloads; each times Iterations of one exiting instruction (see "Bench.c")
+typedef VOID (*GUEST_BENCH_PAYLOAD)(
+	_In_ UINT64 Iterations,
+	_Out_writes_(Iterations) PUINT64 Samples,
+	_In_opt_ UINT64 Argument
+	);
+
+extern VOID GuestBenchCPUID( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchRDMSR( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchWRMSR( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchVMCALL( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchIO( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchCR3( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+extern VOID GuestBenchHLT( _In_ UINT64 Iterations, _Out_writes_(Iterations) PUINT64 Samples, _In_opt_ UINT64 Argument );
+
+
+
+//
+// Local functions
+//
+
+VOID
+VMExitInitializeHandlers();
+
+VMEXIT_HANDLER
+VMExitRegisterHandler(
+	_In_ CONST VMX_BASIC_EXIT_REASON Reason,
+	_In_opt_ CONST VMEXIT_HANDLER Handler
+	);
+
+UINT64
+VMExitRead(
+	_Inout_ struct _LP_INFO* LPInfo,
+	_In_ CONST VMCS_CACHE_FIELD Field
+	);
+
+VOID
+VMExitWrite(
+	_Inout_ struct _LP_INFO* LPInfo,
+	_In_ CONST VMCS_CACHE_FIELD Field,
+	_In_ CONST UINT64 Value
+	);
+
+VOID
+VMExitDispatch(
+	_Inout_ PGUEST_REGISTERS GuestRegisters,
+	_Inout_ struct _LP_INFO* LPInfo
+	);
+
+VOID
+VMResumeFailure(
+	_In_ struct _LP_INFO* LPInfo
+	);
+
+#endif // __EXIT_H__
@@ -0,0 +1,125 @@
+#include "GuestWalk.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor; the paging structures are read through whatever GUEST_MAP_ENTRY it's
+ *  given, so any set of made-up tables in ordinary memory will do. Only data accesses are translated, so
+ *  execute-disable and SMEP never come into it; nor do protection keys, which a Windows guest doesn't use in
+ *  the kernel.
+ */
+
+// [4.5.1] "Ordinary Paging and HLAT Paging"; 9 bits of the linear address per level, above the 12-bit page offset
+#define GUEST_WALK_MAX_LEVELS				5
+#define GUEST_WALK_INDEX(Linear, Level)		(((Linear) >> (12 + 9 * ((Level) - 1))) & 0x1FF)
+
+BOOLEAN
+GuestWalkIsCanonical(
+    _In_ CONST GUEST_PAGING* Paging,
+    _In_ CONST UINT64 Linear
+    )
+{
+    // [3.3.7.1] "Canonical Addressing"; bits 63:47 (or 63:56, with 5-level paging) all the same
+
+    UINT32 bits = (Paging->FiveLevel == TRUE) ? 57 : 48;
+
+    return (UINT64)((INT64)(Linear << (64 - bits)) >> (64 - bits)) == Linear;
+}
+
+BOOLEAN
+GuestWalkTranslate(
+    _In_ CONST GUEST_PAGING* Paging,
+    _In_ CONST UINT64 Linear,
+    _In_ CONST UINT32 Access,
+    _In_ GUEST_MAP_ENTRY MapEntry,
+    _In_opt_ PVOID Context,
+    _Out_ PUINT64 PhysicalAddress,
+    _Out_ PUINT32 ErrorCode
+    )
+{
+    /*
+     * Translate a (canonical) linear address of the guest's to a guest-physical one, for a data access of the given
+     *  kind at the guest's CPL ([4.6] "Access Rights"); or, if the guest's processor would fault on the access
+     *  instead, return FALSE with the #PF error code it would push.
+     *
+     *  The accessed flag is set in every entry the translation went through, and the dirty flag in the last one
+     *  for a write, as the processor would ([4.8] "Accessed and Dirty Flags"); but only once the access is allowed.
+     *  (Note: an entry that can't be mapped is taken to be not present)
+     */
+
+    UINT64 entryAddresses[GUEST_WALK_MAX_LEVELS];
+    volatile UINT64* mapped;
+    UINT64 entry, table, pageSize;
+    BOOLEAN write = ((Access & GUEST_ACCESS_WRITE) != 0);
+    BOOLEAN user = (Paging->CPL == 3);
+    BOOLEAN writable = TRUE, userPage = TRUE;
+    ULONG level, walked = 0;
+    ULONG i;
+
+    *PhysicalAddress = 0;
+    *ErrorCode = (write == TRUE ? PAGE_FAULT_ERROR_WRITE : 0) | (user == TRUE ? PAGE_FAULT_ERROR_USER : 0);
+
+    table = Paging->CR3 & GUEST_PTE_ADDRESS_MASK;
+    level = (Paging->FiveLevel == TRUE) ? 5 : 4;
+
+    for ( ; ; level-- )
+    {
+        entryAddresses[walked] = table + GUEST_WALK_INDEX( Linear, level ) * sizeof(UINT64);
+
+        mapped = MapEntry( Context, entryAddresses[walked++] );
+        if ( mapped == NULL )
+        {
+            return FALSE;
+        }
+
+        entry = *mapped;
+
+        if ( (entry & GUEST_PTE_PRESENT) == 0 )
+        {
+            return FALSE;
+        }
+
+        // [4.6.1] "Determination of Access Rights"; every level has a say
+        writable &= ((entry & GUEST_PTE_WRITE) != 0);
+        userPage &= ((entry & GUEST_PTE_USER) != 0);
+
+        // A 1GB page (PDPTE) or 2MB page (PDE), or a 4KB one (PTE)
+        if ( level == 1 || ((level == 2 || level == 3) && (entry & GUEST_PTE_LARGE) != 0) )
+        {
+            break;
+        }
+
+        table = entry & GUEST_PTE_ADDRESS_MASK;
+    }
+
+    // [4.6.1]: user-mode accesses only to user-mode pages; writes only to writable ones, except for supervisor-mode
+    //    writes with CR0.WP clear; and, with SMAP on, no supervisor-mode data accesses to user-mode pages at all
+    if ( (user == TRUE && userPage == FALSE) ||
+         (write == TRUE && writable == FALSE && (user == TRUE || Paging->WriteProtect == TRUE)) ||
+         (user == FALSE && userPage == TRUE && Paging->SMAP == TRUE) )
+    {
+        *ErrorCode |= PAGE_FAULT_ERROR_PRESENT;
+        return FALSE;
+    }
+
+    // (Note: each entry is mapped again, as mapping the next one may have unmapped it)
+    for ( i = 0; i < walked; i++ )
+    {
+        mapped = MapEntry( Context, entryAddresses[i] );
+        if ( mapped == NULL )
+        {
+            continue;
+        }
+
+        InterlockedOr64(
+            (volatile LONG64*)mapped,
+            (i == walked - 1 && write == TRUE) ? (GUEST_PTE_ACCESSED | GUEST_PTE_DIRTY) : GUEST_PTE_ACCESSED
+            );
+    }
+
+    // (Note: bit 12 of a large page's entry is its PAT bit, not part of its address)
+    pageSize = 1ULL << (12 + 9 * (level - 1));
+    *PhysicalAddress = ((entry & GUEST_PTE_ADDRESS_MASK) & ~(pageSize - 1)) | (Linear & (pageSize - 1));
+
+    return TRUE;
+}
@@ -0,0 +1,68 @@
+#ifndef __GUESTWALK_H__
+#define __GUESTWALK_H__
+
+#include <ntddk.h>
+
+/*
+ * [4.5] "4-Level Paging and 5-Level Paging"
+ *
+ *  The guest's linear addresses are translated the way its processor would, through the paging structures
+ *  its CR3 points at; each level's entry maps the next level's table (or, with PS set at the PDPTE or PDE
+ *  level, a 1GB or 2MB page), and bits 51:12 of each entry hold the physical address it refers to.
+ */
+#define GUEST_PTE_PRESENT					0x001
+#define GUEST_PTE_WRITE						0x002
+#define GUEST_PTE_USER						0x004
+#define GUEST_PTE_ACCESSED					0x020
+#define GUEST_PTE_DIRTY						0x040
+#define GUEST_PTE_LARGE						0x080
+#define GUEST_PTE_ADDRESS_MASK				0x000FFFFFFFFFF000ULL
+
+// [4.7] "Page-Fault Exceptions", Figure 4-12
+#define PAGE_FAULT_ERROR_PRESENT			0x1		// The fault was a protection violation, rather than a not-present page
+#define PAGE_FAULT_ERROR_WRITE				0x2
+#define PAGE_FAULT_ERROR_USER				0x4		// The access was a user-mode (CPL 3) one
+
+// The kind of access being translated (see GuestWalkTranslate)
+#define GUEST_ACCESS_WRITE					0x1
+
+// The guest's paging mode, as of the exit being handled
+typedef struct _GUEST_PAGING
+{
+	UINT64 CR3;
+	UINT8 CPL;
+	BOOLEAN FiveLevel;		// CR4.LA57
+	BOOLEAN WriteProtect;	// CR0.WP
+	BOOLEAN SMAP;			// CR4.SMAP, with RFLAGS.AC clear
+} GUEST_PAGING, *PGUEST_PAGING;
+
+/*
+ * Maps the guest-physical address of a paging-structure entry for the walk to read (and set the accessed and
+ *  dirty flags in); NULL if it can't be mapped. Only the entry has to stay mapped, and only until the next call.
+ */
+typedef volatile UINT64* (*GUEST_MAP_ENTRY)( _In_opt_ PVOID Context, _In_ UINT64 PhysicalAddress );
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+GuestWalkIsCanonical(
+	_In_ CONST GUEST_PAGING* Paging,
+	_In_ CONST UINT64 Linear
+	);
+
+BOOLEAN
+GuestWalkTranslate(
+	_In_ CONST GUEST_PAGING* Paging,
+	_In_ CONST UINT64 Linear,
+	_In_ CONST UINT32 Access,
+	_In_ GUEST_MAP_ENTRY MapEntry,
+	_In_opt_ PVOID Context,
+	_Out_ PUINT64 PhysicalAddress,
+	_Out_ PUINT32 ErrorCode
+	);
+
+#endif // __GUESTWALK_H__
@@ -0,0 +1,87 @@
+#include "IOBitmap.h"
+
+/*
+ * Notes for testing:
+ *
+ * As with the MSR bitmap (see "MSRBitmap.c"), these functions only ever touch the bitmap they're given;
+ *  any 8KB buffer will do.
+ */
+
+BOOLEAN
+IoBitmapSetIntercept(
+    _Inout_updates_bytes_(IO_BITMAP_SIZE) PUINT8 Bitmap,
+    _In_ CONST UINT32 Port,
+    _In_ CONST BOOLEAN Intercept
+    )
+{
+    return IoBitmapSetRangeIntercept( Bitmap, Port, Port, Intercept );
+}
+
+BOOLEAN
+IoBitmapSetRangeIntercept(
+    _Inout_updates_bytes_(IO_BITMAP_SIZE) PUINT8 Bitmap,
+    _In_ CONST UINT32 FirstPort,
+    _In_ CONST UINT32 LastPort,
+    _In_ CONST BOOLEAN Intercept
+    )
+{
+    // Start (or stop) intercepting every access to [FirstPort, LastPort]
+
+    UINT32 port;
+
+    if ( FirstPort > LastPort || LastPort > IO_PORT_LAST )
+    {
+        return FALSE;
+    }
+
+    for ( port = FirstPort; port <= LastPort; port++ )
+    {
+        // Whole bytes at a time, where the range allows it
+        if ( (port % 8) == 0 && LastPort - port >= 7 )
+        {
+            Bitmap[port / 8] = (Intercept == TRUE) ? 0xFF : 0x00;
+            port += 7;
+        }
+        else if ( Intercept == TRUE )
+        {
+            Bitmap[port / 8] |= (UINT8)(1 << (port % 8));
+        }
+        else
+        {
+            Bitmap[port / 8] &= (UINT8)~(1 << (port % 8));
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+IoBitmapIsIntercepted(
+    _In_reads_bytes_(IO_BITMAP_SIZE) CONST UINT8* Bitmap,
+    _In_ CONST UINT32 Port,
+    _In_ CONST UINT32 Size
+    )
+{
+    /*
+     * Whether a Size byte access at Port exits; this is the case if the bit for any of the ports it touches
+     *  is set, and always if the access wraps around the end of the I/O address space ([25.1.3] "Instructions
+     *  That Cause VM Exits Conditionally")
+     */
+
+    UINT32 port;
+
+    if ( Port + Size - 1 > IO_PORT_LAST )
+    {
+        return TRUE;
+    }
+
+    for ( port = Port; port < Port + Size; port++ )
+    {
+        if ( (Bitmap[port / 8] & (1 << (port % 8))) != 0 )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,47 @@
+#ifndef __IOBITMAP_H__
+#define __IOBITMAP_H__
+
+#include <ntddk.h>
+
+/*
+ * [24.6.4] "I/O-Bitmap Addresses"
+ *
+ *  I/O bitmap A covers ports 0000H - 7FFFH, and I/O bitmap B covers ports 8000H - FFFFH; one bit per
+ *  port, and a set bit makes any access touching that port exit. We keep the two back to back, in one
+ *  8KB block, so that the bit for any port is simply bit `Port` of the block.
+ */
+#define IO_BITMAP_SIZE						0x2000
+#define IO_BITMAP_A_OFFSET					0x0000
+#define IO_BITMAP_B_OFFSET					0x1000
+
+#define IO_PORT_LAST						0xFFFF
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+IoBitmapSetIntercept(
+	_Inout_updates_bytes_(IO_BITMAP_SIZE) PUINT8 Bitmap,
+	_In_ CONST UINT32 Port,
+	_In_ CONST BOOLEAN Intercept
+	);
+
+BOOLEAN
+IoBitmapSetRangeIntercept(
+	_Inout_updates_bytes_(IO_BITMAP_SIZE) PUINT8 Bitmap,
+	_In_ CONST UINT32 FirstPort,
+	_In_ CONST UINT32 LastPort,
+	_In_ CONST BOOLEAN Intercept
+	);
+
+BOOLEAN
+IoBitmapIsIntercepted(
+	_In_reads_bytes_(IO_BITMAP_SIZE) CONST UINT8* Bitmap,
+	_In_ CONST UINT32 Port,
+	_In_ CONST UINT32 Size
+	);
+
+#endif // __IOBITMAP_H__
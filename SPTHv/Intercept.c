@@ -0,0 +1,113 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * Intercepts are set with IOCTL_SPTHV_SET_MSR_INTERCEPT and IOCTL_SPTHV_SET_IO_INTERCEPT (see the `intercept`
+ *  command of the SPTHvCtl tool), and show up as RDMSR/WRMSR or I/O instruction exits in the exit counters and the
+ *  trace rings; the accesses themselves go through to the processor just as before (see _ExitMSRAccess and
+ *  _ExitIOInstruction in "Exit.c").
+ *
+ * The bitmaps are shared by every LP, and changed while the LPs are running; an LP that's partway through an
+ *  access may or may not see the change ([24.6.9] "MSR-Bitmap Address"), but the next access will.
+ *
+ * A run of the exit benchmark suite stops intercepting BENCH_MSR and BENCH_PORT once it's done, whoever asked
+ *  for them before.
+ */
+
+C_ASSERT( SPTHV_MSR_INTERCEPT_READ == MSR_INTERCEPT_READ );
+C_ASSERT( SPTHV_MSR_INTERCEPT_WRITE == MSR_INTERCEPT_WRITE );
+
+/*
+ * The MSRs whose guest values are in the VMCS while we're in root mode, rather than in the processor ([24.4.1]
+ *  "Guest Register State", [24.8.1] "VM-Entry Controls for Entering with State"); passing an access to one of
+ *  these through from the exit handler would read (or write) ours instead. The TSC is in here as well, as a read
+ *  in root mode doesn't get the guest's offset (or multiplier), and writes to it are already ours to handle.
+ */
+CONST struct
+{
+    UINT32 First;
+    UINT32 Last;
+} g_GuestStateMSRs[] = {
+    { IA32_TIME_STAMP_COUNTER,  IA32_TIME_STAMP_COUNTER },
+    { IA32_SYSENTER_CS,         IA32_SYSENTER_EIP },
+    { IA32_DEBUGCTL,            IA32_DEBUGCTL },
+    { IA32_PAT,                 IA32_PAT },
+    { IA32_PERF_GLOBAL_CTRL,    IA32_PERF_GLOBAL_CTRL },
+    { IA32_EFER,                IA32_EFER },
+    { IA32_FS_BASE,             IA32_GS_BASE }
+};
+
+NTSTATUS
+InterceptSetMSRRange(
+    _In_ CONST SPTHV_MSR_INTERCEPT_REQUEST* Request
+    )
+{
+    // Start (or stop) intercepting the given accesses to every MSR in the request's range, on every LP
+
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG i;
+
+    if ( Request->Accesses == 0 || (Request->Accesses & ~(SPTHV_MSR_INTERCEPT_READ | SPTHV_MSR_INTERCEPT_WRITE)) != 0 )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for ( i = 0; i < ARRAYSIZE( g_GuestStateMSRs ); i++ )
+    {
+        if ( Request->FirstMsr <= g_GuestStateMSRs[i].Last && Request->LastMsr >= g_GuestStateMSRs[i].First )
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+    }
+
+    ExAcquireFastMutex( &g_BenchLock );
+
+    // (Note: a range that isn't entirely within one of the ranges the bitmap covers changes nothing)
+    if ( MsrBitmapSetRangeIntercept(
+            g_MSRBitmap.VA,
+            Request->FirstMsr,
+            Request->LastMsr,
+            Request->Accesses,
+            (Request->Intercept != FALSE)
+            ) == FALSE )
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+
+    ExReleaseFastMutex( &g_BenchLock );
+
+    return status;
+}
+
+NTSTATUS
+InterceptSetPortRange(
+    _In_ CONST SPTHV_IO_INTERCEPT_REQUEST* Request
+    )
+{
+    // Start (or stop) intercepting accesses to every port in the request's range, on every LP
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // (Note: without I/O bitmaps, the processor either exits on every I/O instruction or on none; see _BuildIOBitmap)
+    if ( g_IOBitmap.VA == NULL )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_BenchLock );
+
+    if ( IoBitmapSetRangeIntercept(
+            g_IOBitmap.VA,
+            Request->FirstPort,
+            Request->LastPort,
+            (Request->Intercept != FALSE)
+            ) == FALSE )
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+
+    ExReleaseFastMutex( &g_BenchLock );
+
+    return status;
+}
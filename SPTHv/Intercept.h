@@ -0,0 +1,24 @@
+#ifndef __INTERCEPT_H__
+#define __INTERCEPT_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+
+
+//
+// Local functions
+//
+
+NTSTATUS
+InterceptSetMSRRange(
+	_In_ CONST SPTHV_MSR_INTERCEPT_REQUEST* Request
+	);
+
+NTSTATUS
+InterceptSetPortRange(
+	_In_ CONST SPTHV_IO_INTERCEPT_REQUEST* Request
+	);
+
+#endif // __INTERCEPT_H__
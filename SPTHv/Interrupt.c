@@ -0,0 +1,132 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The queue, and when the guest can be handed an interrupt, live in "IntrQueue.c"; everything in here is the
+ *  bookkeeping around them, which needs the LPs to be virtualized.
+ *
+ * Without IntrStart, external interrupts never exit at all; the guest takes them through its own IDT, exactly as
+ *  it would without us. With it, each one exits, and is injected right back on the same VM-entry; it only waits in
+ *  the LP's queue while the guest has interrupts blocked (or its task priority holds it back), which is also the
+ *  only time an LP runs with interrupt-window (or CR8-load) exiting (see _DeliverQueuedInterrupts in "Exit.c").
+ *  The exit stats (see "Stats.c") count both kinds of exit, with their cycles, which is the latency every
+ *  interrupt pays.
+ *
+ *  (Note: none of them is handled in VMX root operation; the only handlers for them are the guest's own, in its
+ *  IDT, which might well lower the IRQL and switch threads right out from under the exit)
+ *
+ * From user mode, this is all driven with IOCTL_SPTHV_START_INTERRUPTS and IOCTL_SPTHV_STOP_INTERRUPTS (see the
+ *  `intr` command of the SPTHvCtl tool).
+ */
+
+BOOLEAN g_IntrSupported;
+
+// Only one start or stop at a time
+FAST_MUTEX g_IntrLock;
+BOOLEAN g_IntrRunning;
+
+BOOLEAN
+IntrInitialize()
+{
+    /*
+     * Work out whether external interrupts can be taken on exits, and handed back to the guest; any time after the
+     *  controls are built. Nothing changes until IntrStart.
+     */
+
+    PIN_VM_EXEC_CTRLS pinCtrls;
+    PROCESSOR_PRIMARY_VM_EXEC_CTRLS primaryCtrls;
+    VM_EXIT_CTRLS exitCtrls;
+    UINT32 dropped, droppedAny = 0;
+
+    ExInitializeFastMutex( &g_IntrLock );
+
+    // [24.6.1] "Pin-Based VM-Execution Controls"
+    pinCtrls = g_VMXControls.PinBased;
+    pinCtrls.ExternalInterruptExiting = 1;
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PIN_BASED, pinCtrls.All, &dropped, NULL );
+    droppedAny |= dropped;
+
+    // [24.6.2] "Processor-Based VM-Execution Controls"; for the interrupts the guest can't take right away, and
+    //  those its task priority is holding back (see _DeliverQueuedInterrupts in "Exit.c")
+    primaryCtrls = g_VMXControls.Primary;
+    primaryCtrls.InterruptWindowExiting = 1;
+    primaryCtrls.CR8LoadExiting = 1;
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PROC_PRIMARY, primaryCtrls.All, &dropped, NULL );
+    droppedAny |= dropped;
+
+    // [24.7.1] "VM-Exit Controls"; the vector comes with the exit, rather than staying pending at the local APIC
+    exitCtrls = g_VMXControls.Exit;
+    exitCtrls.AcknowledgeInterruptOnExit = 1;
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_EXIT, exitCtrls.All, &dropped, NULL );
+    droppedAny |= dropped;
+
+    g_IntrSupported = (droppedAny == 0);
+
+    return g_IntrSupported;
+}
+
+ULONG_PTR
+_IntrEnableLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; Argument is TRUE to start taking external interrupts on exits, FALSE to stop
+    GuestVmcall( HYPERCALL_INTERRUPTS, Argument, 0 );
+
+    return 0;
+}
+
+NTSTATUS
+IntrStart()
+{
+    // Take every LP's external interrupts on exits from here on (see _ExitExternalInterrupt in "Exit.c")
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if ( g_IntrSupported == FALSE )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_IntrLock );
+
+    if ( g_IntrRunning == TRUE )
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto __unlock;
+    }
+
+    KeIpiGenericCall( _IntrEnableLP, TRUE );
+
+    g_IntrRunning = TRUE;
+
+__unlock:
+    ExReleaseFastMutex( &g_IntrLock );
+
+    return status;
+}
+
+NTSTATUS
+IntrStop()
+{
+    /*
+     * Let every LP's external interrupts go straight to the guest again.
+     *
+     *  (Note: whatever is still queued on an LP has already been acknowledged, and is delivered as the guest unblocks
+     *  interrupts (and lowers its IRQL), as before; an LP won't leave VMX operation until it's all been delivered, see
+     *  HYPERCALL_DEVIRTUALIZE in "Exit.c")
+     */
+
+    ExAcquireFastMutex( &g_IntrLock );
+
+    if ( g_IntrRunning == TRUE )
+    {
+        KeIpiGenericCall( _IntrEnableLP, FALSE );
+        g_IntrRunning = FALSE;
+    }
+
+    ExReleaseFastMutex( &g_IntrLock );
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,31 @@
+#ifndef __INTERRUPT_H__
+#define __INTERRUPT_H__
+
+#include <ntddk.h>
+
+#include "IntrQueue.h"
+
+
+//
+// Globals
+//
+
+// Whether external interrupts can be taken on exits, acknowledged, and handed back (see IntrInitialize)
+extern BOOLEAN g_IntrSupported;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+IntrInitialize();
+
+NTSTATUS
+IntrStart();
+
+NTSTATUS
+IntrStop();
+
+#endif // __INTERRUPT_H__
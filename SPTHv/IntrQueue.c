@@ -0,0 +1,145 @@
+#include "IntrQueue.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor or the VMCS; the queue is a plain bitmap, and whether the guest can take an
+ *  interrupt is worked out from the guest state fields (and CR8) it's given. It can be driven with made-up values of
+ *  those.
+ *
+ * Once external interrupts go through us on an LP (see IntrStart in "Interrupt.c"), `dt` its `Interrupts` for
+ *  what's waiting on it; anything that stays there means the guest has kept interrupts blocked.
+ */
+
+VOID
+IntrQueueReset(
+    _Out_ PINTR_QUEUE Queue
+    )
+{
+    RtlSecureZeroMemory( Queue, sizeof(INTR_QUEUE) );
+}
+
+BOOLEAN
+IntrQueuePush(
+    _Inout_ PINTR_QUEUE Queue,
+    _In_ CONST UINT8 Vector
+    )
+{
+    // Queue Vector for the guest; FALSE if it was already waiting (it's delivered the once)
+
+    if ( (Queue->Pending[Vector / 64] & (1ULL << (Vector % 64))) != 0 )
+    {
+        Queue->Coalesced++;
+        return FALSE;
+    }
+
+    Queue->Pending[Vector / 64] |= 1ULL << (Vector % 64);
+    Queue->Count++;
+
+    return TRUE;
+}
+
+BOOLEAN
+IntrQueuePeek(
+    _In_ CONST INTR_QUEUE* Queue,
+    _Out_ PUINT8 Vector
+    )
+{
+    // The highest vector waiting, left in the queue; FALSE if there are none
+
+    ULONG bit;
+    LONG i;
+
+    *Vector = 0;
+
+    for ( i = ARRAYSIZE( Queue->Pending ) - 1; i >= 0; i-- )
+    {
+        if ( _BitScanReverse64( &bit, Queue->Pending[i] ) != 0 )
+        {
+            *Vector = (UINT8)(i * 64 + bit);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+IntrQueuePop(
+    _Inout_ PINTR_QUEUE Queue,
+    _Out_ PUINT8 Vector
+    )
+{
+    // Take the highest vector waiting; FALSE if there are none
+
+    if ( IntrQueuePeek( Queue, Vector ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    Queue->Pending[*Vector / 64] &= ~(1ULL << (*Vector % 64));
+    Queue->Count--;
+
+    return TRUE;
+}
+
+BOOLEAN
+IntrQueueAboveTPR(
+    _In_ CONST UINT8 Vector,
+    _In_ CONST UINT64 GuestCR8
+    )
+{
+    /*
+     * Whether the guest's task priority lets Vector through ([10.8.3.1] "Task and Processor Priorities"); only a
+     *  priority class above the TPR's is delivered. On Windows, CR8 is the IRQL.
+     *
+     *  (Note: the rest of the processor priority, the highest vector in service, is the local APIC's to enforce;
+     *  Vector was already past it when it was acknowledged)
+     */
+
+    return INTR_PRIORITY_CLASS( Vector ) > (GuestCR8 & INTR_CR8_TPR_MASK);
+}
+
+BOOLEAN
+IntrQueueCanInject(
+    _In_ CONST UINT8 Vector,
+    _In_ CONST UINT64 GuestRFlags,
+    _In_ CONST UINT64 GuestCR8,
+    _In_ CONST UINT32 Interruptibility,
+    _In_ CONST UINT32 ActivityState,
+    _In_ CONST UINT32 EntryIntInfo
+    )
+{
+    /*
+     * Whether the next VM-entry can inject Vector as an external interrupt ([26.3.1.5] "Checks on Guest Non-Register
+     *  State"); the guest has interrupts enabled, isn't in the shadow of an STI or MOV SS, isn't shut down or waiting
+     *  for a SIPI, and nothing else is being injected already (EntryIntInfo is the VM-entry interruption-information
+     *  field, as this exit has left it). Event injection ignores the TPR, so that's checked here too (see
+     *  IntrQueueAboveTPR); the local APIC would have held Vector back until the guest lowered it.
+     *
+     *  (Note: a guest in HLT can take one; it's woken up by it, as it would be without us)
+     */
+
+    if ( IntrQueueAboveTPR( Vector, GuestCR8 ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    if ( (GuestRFlags & INTR_RFLAGS_IF) == 0 )
+    {
+        return FALSE;
+    }
+
+    if ( (Interruptibility & (INTR_STATE_BLOCKING_BY_STI | INTR_STATE_BLOCKING_BY_MOV_SS)) != 0 )
+    {
+        return FALSE;
+    }
+
+    if ( ActivityState != INTR_ACTIVITY_ACTIVE && ActivityState != INTR_ACTIVITY_HLT )
+    {
+        return FALSE;
+    }
+
+    // Bit 31 is the valid bit (see VM_ENTRY_INT_INFO in "VMCS.h")
+    return (EntryIntInfo & (1UL << 31)) == 0;
+}
@@ -0,0 +1,89 @@
+#ifndef __INTRQUEUE_H__
+#define __INTRQUEUE_H__
+
+#include <ntddk.h>
+
+/*
+ * External interrupts taken on an exit, with acknowledge-interrupt-on-exit set, are already off the local APIC's
+ *  hands; if the guest can't be handed one right away, it waits in its LP's queue until the guest can take it
+ *  (see IntrQueueCanInject). Like the APIC's own IRR, the queue has a bit per vector, so a vector that's already
+ *  waiting isn't queued twice, and the highest vector (the highest priority class, [10.8.3.1] "Task and Processor
+ *  Priorities") goes first.
+ */
+#define INTR_VECTOR_COUNT					256
+
+// [Table 6-1] "Exceptions and Interrupts"; the vectors below this are exceptions, which are never external interrupts
+#define INTR_FIRST_VECTOR					32
+
+typedef struct _INTR_QUEUE
+{
+	UINT64 Pending[INTR_VECTOR_COUNT / 64];
+	ULONG Count;
+
+	// Vectors that were already waiting when they came in again (the guest only sees them once)
+	UINT64 Coalesced;
+} INTR_QUEUE, *PINTR_QUEUE;
+
+// [24.4.2] "Guest Non-Register State", Table 24-3 "Format of Interruptibility State"
+#define INTR_STATE_BLOCKING_BY_STI			0x1
+#define INTR_STATE_BLOCKING_BY_MOV_SS		0x2
+
+// [24.4.2] "Guest Non-Register State"; activity states
+#define INTR_ACTIVITY_ACTIVE				0
+#define INTR_ACTIVITY_HLT					1
+#define INTR_ACTIVITY_SHUTDOWN				2
+#define INTR_ACTIVITY_WAIT_FOR_SIPI			3
+
+// RFLAGS.IF ([3.4.3.3] "System Flags and IOPL Field")
+#define INTR_RFLAGS_IF						(1ULL << 9)
+
+// [10.8.6.1] "Interaction of Task Priorities between CR8 and APIC"; CR8 holds bits 7:4 of the TPR, the priority class
+#define INTR_CR8_TPR_MASK					0xF
+#define INTR_PRIORITY_CLASS(Vector)			((Vector) >> 4)
+
+
+
+//
+// Local functions
+//
+
+VOID
+IntrQueueReset(
+	_Out_ PINTR_QUEUE Queue
+	);
+
+BOOLEAN
+IntrQueuePush(
+	_Inout_ PINTR_QUEUE Queue,
+	_In_ CONST UINT8 Vector
+	);
+
+BOOLEAN
+IntrQueuePop(
+	_Inout_ PINTR_QUEUE Queue,
+	_Out_ PUINT8 Vector
+	);
+
+BOOLEAN
+IntrQueuePeek(
+	_In_ CONST INTR_QUEUE* Queue,
+	_Out_ PUINT8 Vector
+	);
+
+BOOLEAN
+IntrQueueAboveTPR(
+	_In_ CONST UINT8 Vector,
+	_In_ CONST UINT64 GuestCR8
+	);
+
+BOOLEAN
+IntrQueueCanInject(
+	_In_ CONST UINT8 Vector,
+	_In_ CONST UINT64 GuestRFlags,
+	_In_ CONST UINT64 GuestCR8,
+	_In_ CONST UINT32 Interruptibility,
+	_In_ CONST UINT32 ActivityState,
+	_In_ CONST UINT32 EntryIntInfo
+	);
+
+#endif // __INTRQUEUE_H__
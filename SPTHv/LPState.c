@@ -0,0 +1,85 @@
+#include "LPState.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor; an LP's state is only ever written by the LP itself, from inside a broadcast
+ *  (see _VirtualizeLP in "Driver.c"), or by DriverEntry while no broadcast is running. So a thread per LP, each
+ *  walking its own state through a bring-up and a teardown, is a faithful stand-in for the broadcasts.
+ *
+ * `dt` an LP_INFO's `State` to see how far an LP got; LP_STATE_FAILED with an `InstrError` tells you where it stopped.
+ */
+
+// The states each one can be left for; bring-up only ever goes forward, and one step at a time
+static CONST UINT32 g_LpStateTransitions[LP_STATE_COUNT] = {
+    (1UL << LP_STATE_ALLOCATED),                                    // LP_STATE_UNINITIALIZED
+    (1UL << LP_STATE_VMX_ON) | (1UL << LP_STATE_FAILED),            // LP_STATE_ALLOCATED
+    (1UL << LP_STATE_VMCS_LOADED) | (1UL << LP_STATE_FAILED),       // LP_STATE_VMX_ON
+    (1UL << LP_STATE_VIRTUALIZED) | (1UL << LP_STATE_FAILED),       // LP_STATE_VMCS_LOADED
+    (1UL << LP_STATE_TORN_DOWN),                                    // LP_STATE_VIRTUALIZED
+    0,                                                              // LP_STATE_TORN_DOWN
+    0                                                               // LP_STATE_FAILED
+};
+
+BOOLEAN
+LpStateAdvance(
+    _Inout_ volatile LP_STATE* State,
+    _In_ CONST LP_STATE To
+    )
+{
+    /*
+     * Move an LP on to To; FALSE (with the state left as it was) if To can't follow the state it's in.
+     *
+     *  (Note: a failed LP stays that way; so does a torn down one, whose VMX regions may already have been freed)
+     */
+
+    LP_STATE from = *State;
+
+    if ( (ULONG)from >= LP_STATE_COUNT || (ULONG)To >= LP_STATE_COUNT )
+    {
+        return FALSE;
+    }
+
+    if ( (g_LpStateTransitions[from] & (1UL << To)) == 0 )
+    {
+        return FALSE;
+    }
+
+    *State = To;
+
+    return TRUE;
+}
+
+VOID
+LpStateTally(
+    _Inout_ PLP_STATE_SUMMARY Summary,
+    _In_ CONST LP_STATE State,
+    _In_ CONST UINT64 LaunchCycles
+    )
+{
+    // Count one LP into Summary (which starts out zeroed), once the broadcast it was part of has finished
+
+    Summary->Count++;
+
+    if ( (ULONG)State < LP_STATE_COUNT )
+    {
+        Summary->States[State]++;
+    }
+
+    if ( State != LP_STATE_VIRTUALIZED )
+    {
+        return;
+    }
+
+    if ( Summary->States[LP_STATE_VIRTUALIZED] == 1 || LaunchCycles < Summary->MinCycles )
+    {
+        Summary->MinCycles = LaunchCycles;
+    }
+
+    if ( LaunchCycles > Summary->MaxCycles )
+    {
+        Summary->MaxCycles = LaunchCycles;
+    }
+
+    Summary->TotalCycles += LaunchCycles;
+}
@@ -0,0 +1,50 @@
+#ifndef __LPSTATE_H__
+#define __LPSTATE_H__
+
+#include <ntddk.h>
+
+// The states each LP moves through while being virtualized (see _VirtualizeLP and _DevirtualizeLP in "Driver.c")
+typedef enum _LP_STATE
+{
+	LP_STATE_UNINITIALIZED,
+	LP_STATE_ALLOCATED,		// All of the VMX regions and stacks for this LP have been allocated
+	LP_STATE_VMX_ON,		// VMXON succeeded on this LP
+	LP_STATE_VMCS_LOADED,	// The VMCS is current on this LP, and is being configured/launched
+	LP_STATE_VIRTUALIZED,	// The LP is running as our guest, with every VM-exit going to VMExitStub
+	LP_STATE_TORN_DOWN,		// HYPERCALL_DEVIRTUALIZE took the LP back out of VMX operation
+	LP_STATE_FAILED,		// Something failed along the way; see `InstrError`
+	LP_STATE_COUNT
+} LP_STATE;
+
+// What a broadcast left every LP in, and how long the ones that got virtualized took to get there (see LpStateTally)
+typedef struct _LP_STATE_SUMMARY
+{
+	ULONG Count;
+	ULONG States[LP_STATE_COUNT];
+
+	// Bring-up timings of the virtualized LPs, in TSC ticks; MinCycles is 0 if none were
+	UINT64 MinCycles;
+	UINT64 MaxCycles;
+	UINT64 TotalCycles;
+} LP_STATE_SUMMARY, *PLP_STATE_SUMMARY;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+LpStateAdvance(
+	_Inout_ volatile LP_STATE* State,
+	_In_ CONST LP_STATE To
+	);
+
+VOID
+LpStateTally(
+	_Inout_ PLP_STATE_SUMMARY Summary,
+	_In_ CONST LP_STATE State,
+	_In_ CONST UINT64 LaunchCycles
+	);
+
+#endif // __LPSTATE_H__
@@ -36,11 +36,28 @@
 #define IA32_VMX_ENTRY_CTLS             0x484
 #define IA32_VMX_TRUE_ENTRY_CTLS        0x490
 
+// Remaining VMX capability MSRs ([Appendix A] "VMX Capability Reporting Facility")
+#define IA32_VMX_MISC                   0x485
+#define IA32_VMX_VMCS_ENUM              0x48A
+#define IA32_VMX_EPT_VPID_CAP           0x48C
+#define IA32_VMX_VMFUNC                 0x491
+
+// MSRs with dedicated VM-entry/VM-exit load and save controls ([24.7.1] "VM-Exit Controls", [24.8.1] "VM-Entry Controls")
+#define IA32_PAT                        0x277
+#define IA32_PERF_GLOBAL_CTRL           0x38F
+#define IA32_EFER                       0xC0000080
+
 // Special segment MSRs
 #define IA32_FS_BASE                    0xC0000100
 #define IA32_GS_BASE                    0xC0000101
 #define IA32_KERNEL_GS_BASE             0xC0000102
 
+// The TSC itself (what RDTSC returns)
+#define IA32_TIME_STAMP_COUNTER         0x10
+
+// Auxiliary TSC (the value RDTSCP returns in ECX)
+#define IA32_TSC_AUX                    0xC0000103
+
 
 #pragma warning(push)
 
@@ -68,6 +85,65 @@ typedef union _VMX_BASIC_INFORMATION
     UINT64 All;
 } VMX_BASIC_INFO;
 
+// [A.6] "Miscellaneous Data"
+typedef union _VMX_MISC_INFORMATION
+{
+    struct
+    {
+        UINT64 PreemptionTimerRate : 5;                 // 0-4      (The timer counts down by 1 every 2^X TSC ticks)
+        UINT64 StoreLMA : 1;                            // 5
+        UINT64 ActivityHLT : 1;                         // 6
+        UINT64 ActivityShutdown : 1;                    // 7
+        UINT64 ActivityWaitForSIPI : 1;                 // 8
+        UINT64 Reserved0 : 5;                           // 9-13
+        UINT64 IntelPTInVMX : 1;                        // 14
+        UINT64 RDMSRSMBASEInSMM : 1;                    // 15
+        UINT64 CR3TargetCount : 9;                      // 16-24
+        UINT64 MaxMSRListSize : 3;                      // 25-27    (512 * (X + 1) MSRs per list)
+        UINT64 SMMMonitorCtlB2 : 1;                     // 28
+        UINT64 VMWRITEAllFields : 1;                    // 29
+        UINT64 ZeroLengthInjection : 1;                 // 30
+        UINT64 Reserved1 : 1;                           // 31
+        UINT64 MSEGRevisionIdentifier : 32;             // 32-63
+    };
+    UINT64 All;
+} VMX_MISC_INFO;
+
+// [A.10] "VPID and EPT Capabilities"
+typedef union _VMX_EPT_VPID_CAPABILITIES
+{
+    struct
+    {
+        UINT64 ExecuteOnly : 1;                         // 0
+        UINT64 Reserved0 : 5;                           // 1-5
+        UINT64 PageWalkLength4 : 1;                     // 6
+        UINT64 Reserved1 : 1;                           // 7
+        UINT64 MemTypeUC : 1;                           // 8
+        UINT64 Reserved2 : 5;                           // 9-13
+        UINT64 MemTypeWB : 1;                           // 14
+        UINT64 Reserved3 : 1;                           // 15
+        UINT64 PDE2MBPages : 1;                         // 16
+        UINT64 PDPTE1GBPages : 1;                       // 17
+        UINT64 Reserved4 : 2;                           // 18-19
+        UINT64 INVEPT : 1;                              // 20
+        UINT64 AccessedDirty : 1;                       // 21
+        UINT64 AdvancedExitInfo : 1;                    // 22
+        UINT64 SupervisorShadowStack : 1;               // 23
+        UINT64 Reserved5 : 1;                           // 24
+        UINT64 INVEPTSingleContext : 1;                 // 25
+        UINT64 INVEPTAllContexts : 1;                   // 26
+        UINT64 Reserved6 : 5;                           // 27-31
+        UINT64 INVVPID : 1;                             // 32
+        UINT64 Reserved7 : 7;                           // 33-39
+        UINT64 INVVPIDIndividualAddress : 1;            // 40
+        UINT64 INVVPIDSingleContext : 1;                // 41
+        UINT64 INVVPIDAllContexts : 1;                  // 42
+        UINT64 INVVPIDSingleContextRetainGlobals : 1;   // 43
+        UINT64 Reserved8 : 20;                          // 44-63
+    };
+    UINT64 All;
+} VMX_EPT_VPID_CAP;
+
 // [35.1] "IA-32 Architectural MSRs", Table 35-2
 typedef union _FEATURE_CONTROL
 {
@@ -0,0 +1,364 @@
+#include "MSRArea.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor or the VMCS; MsrAreaBuild takes the allowed 1-settings of the VM-exit and
+ *  VM-entry controls (the high halves of their capability MSRs) as plain values, and fills in whatever two
+ *  arrays of MSR_AREA_MAX_ENTRIES it's given. Its output can be checked against any made-up set of requests.
+ *
+ * The areas are built once per LP, before it's launched (see _WriteMSRAreas in "Driver.c"). An MSR the
+ *  processor refuses to load fails the VM-entry with REASON_MSR_LOADING_ENTRY_FAILURE; the exit qualification
+ *  is then the (1-based) index of the entry at fault ([26.4] "Loading MSRs").
+ */
+
+BOOLEAN
+MsrAreaAddRequest(
+    _Inout_updates_(MSR_AREA_MAX_REQUESTS) PMSR_AREA_REQUEST Requests,
+    _Inout_ PULONG RequestCount,
+    _In_ CONST UINT32 Index,
+    _In_ CONST UINT32 Flags,
+    _In_ CONST UINT64 GuestValue,
+    _In_ CONST UINT64 HostValue
+    )
+{
+    // (Note: a second request for the same MSR is only merged into the first once the areas are built)
+
+    if ( *RequestCount >= MSR_AREA_MAX_REQUESTS || Flags == 0 )
+    {
+        return FALSE;
+    }
+
+    Requests[*RequestCount].Index = Index;
+    Requests[*RequestCount].Flags = Flags;
+    Requests[*RequestCount].GuestValue = GuestValue;
+    Requests[*RequestCount].HostValue = HostValue;
+
+    (*RequestCount)++;
+
+    return TRUE;
+}
+
+BOOLEAN
+_MergeRequests(
+    _In_reads_(RequestCount) CONST MSR_AREA_REQUEST* Requests,
+    _In_ CONST ULONG RequestCount,
+    _In_ CONST ULONG First,
+    _Out_ PMSR_AREA_REQUEST Merged
+    )
+{
+    /*
+     * Merge every request for the MSR of Requests[First] into one; FALSE if Requests[First] isn't the first of
+     *  them (the MSR has already been merged). The flags are combined, and each side's value comes from the
+     *  last request to ask for that side.
+     */
+
+    ULONG i;
+
+    for ( i = 0; i < First; i++ )
+    {
+        if ( Requests[i].Index == Requests[First].Index )
+        {
+            return FALSE;
+        }
+    }
+
+    *Merged = Requests[First];
+
+    for ( i = First + 1; i < RequestCount; i++ )
+    {
+        if ( Requests[i].Index != Merged->Index )
+        {
+            continue;
+        }
+
+        if ( (Requests[i].Flags & (MSR_AREA_GUEST_LOAD | MSR_AREA_GUEST_SAVE)) != 0 )
+        {
+            Merged->GuestValue = Requests[i].GuestValue;
+        }
+
+        if ( (Requests[i].Flags & MSR_AREA_HOST_LOAD) != 0 )
+        {
+            Merged->HostValue = Requests[i].HostValue;
+        }
+
+        Merged->Flags |= Requests[i].Flags;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+_DedicatedGuest(
+    _In_ CONST MSR_AREA_REQUEST* Request,
+    _In_ CONST UINT32 AllowedExitCtrls,
+    _In_ CONST UINT32 AllowedEntryCtrls,
+    _Inout_ PMSR_AREA_LAYOUT Layout
+    )
+{
+    // Load (and save) the guest's side of Request through a dedicated control, if it has one the processor allows
+
+    VM_EXIT_CTRLS exitCtrls, allowedExit;
+    VM_ENTRY_CTRLS entryCtrls, allowedEntry;
+    UINT64 encoding;
+
+    BOOLEAN save = ((Request->Flags & MSR_AREA_GUEST_SAVE) != 0);
+
+    exitCtrls.All = 0;
+    entryCtrls.All = 0;
+    allowedExit.All = AllowedExitCtrls;
+    allowedEntry.All = AllowedEntryCtrls;
+
+    switch ( Request->Index )
+    {
+        case IA32_EFER:
+
+            // (Note: the guest's EFER.LMA then has to agree with the "IA-32e mode guest" entry control, [26.3.1.1])
+            entryCtrls.LoadEFER = 1;
+            exitCtrls.SaveEFER = save;
+            encoding = VMCS_GUEST_IA32_EFER_FULL;
+
+            break;
+        case IA32_PAT:
+
+            entryCtrls.LoadPAT = 1;
+            exitCtrls.SavePAT = save;
+            encoding = VMCS_GUEST_IA32_PAT_FULL;
+
+            break;
+        case IA32_PERF_GLOBAL_CTRL:
+
+            // There's no saving it on exit; a guest that owns it goes through the areas
+            if ( save == TRUE )
+            {
+                return FALSE;
+            }
+
+            entryCtrls.LoadPerfGlobalCtrl = 1;
+            encoding = VMCS_GUEST_IA32_PERF_GLB_CTRL_FULL;
+
+            break;
+        default:
+
+            return FALSE;
+    }
+
+    if ( (entryCtrls.All & ~allowedEntry.All) != 0 || (exitCtrls.All & ~allowedExit.All) != 0 )
+    {
+        return FALSE;
+    }
+
+    Layout->EntryCtrls.All |= entryCtrls.All;
+    Layout->ExitCtrls.All |= exitCtrls.All;
+
+    Layout->Fields[Layout->FieldCount].Encoding = encoding;
+    Layout->Fields[Layout->FieldCount].Value = Request->GuestValue;
+    Layout->FieldCount++;
+
+    return TRUE;
+}
+
+BOOLEAN
+_DedicatedHost(
+    _In_ CONST MSR_AREA_REQUEST* Request,
+    _In_ CONST UINT32 AllowedExitCtrls,
+    _Inout_ PMSR_AREA_LAYOUT Layout
+    )
+{
+    // Load the host's side of Request through a dedicated control, if it has one the processor allows
+
+    VM_EXIT_CTRLS exitCtrls;
+    UINT64 encoding;
+
+    exitCtrls.All = 0;
+
+    switch ( Request->Index )
+    {
+        case IA32_EFER:
+
+            exitCtrls.LoadEFER = 1;
+            encoding = VMCS_HOST_IA32_EFER_FULL;
+
+            break;
+        case IA32_PAT:
+
+            exitCtrls.LoadPAT = 1;
+            encoding = VMCS_HOST_IA32_PAT_FULL;
+
+            break;
+        case IA32_PERF_GLOBAL_CTRL:
+
+            exitCtrls.LoadPerfGlobalCtrl = 1;
+            encoding = VMCS_HOST_IA32_PERF_GLB_CTRL_FULL;
+
+            break;
+        default:
+
+            return FALSE;
+    }
+
+    if ( (exitCtrls.All & ~AllowedExitCtrls) != 0 )
+    {
+        return FALSE;
+    }
+
+    Layout->ExitCtrls.All |= exitCtrls.All;
+
+    Layout->Fields[Layout->FieldCount].Encoding = encoding;
+    Layout->Fields[Layout->FieldCount].Value = Request->HostValue;
+    Layout->FieldCount++;
+
+    return TRUE;
+}
+
+BOOLEAN
+_AppendEntry(
+    _Inout_updates_(MSR_AREA_MAX_ENTRIES) PMSR_AREA_ENTRY Area,
+    _Inout_ PULONG Count,
+    _In_ CONST UINT32 Index,
+    _In_ CONST UINT64 Data
+    )
+{
+    if ( *Count >= MSR_AREA_MAX_ENTRIES )
+    {
+        return FALSE;
+    }
+
+    Area[*Count].Index = Index;
+    Area[*Count].Reserved = 0;
+    Area[*Count].Data = Data;
+
+    (*Count)++;
+
+    return TRUE;
+}
+
+VOID
+_SortEntries(
+    _Inout_updates_(Count) PMSR_AREA_ENTRY Area,
+    _In_ CONST ULONG Count
+    )
+{
+    // By index; an insertion sort, as there are never more than a handful of entries
+
+    MSR_AREA_ENTRY entry;
+    ULONG i, j;
+
+    for ( i = 1; i < Count; i++ )
+    {
+        entry = Area[i];
+
+        for ( j = i; j > 0 && Area[j - 1].Index > entry.Index; j-- )
+        {
+            Area[j] = Area[j - 1];
+        }
+
+        Area[j] = entry;
+    }
+}
+
+BOOLEAN
+MsrAreaBuild(
+    _In_reads_(RequestCount) CONST MSR_AREA_REQUEST* Requests,
+    _In_ CONST ULONG RequestCount,
+    _In_ CONST UINT32 AllowedExitCtrls,
+    _In_ CONST UINT32 AllowedEntryCtrls,
+    _Out_writes_(MSR_AREA_MAX_ENTRIES) PMSR_AREA_ENTRY GuestArea,
+    _Out_writes_(MSR_AREA_MAX_ENTRIES) PMSR_AREA_ENTRY HostArea,
+    _Out_ PMSR_AREA_LAYOUT Layout
+    )
+{
+    /*
+     * Turn an LP's requests into the shortest areas that do what they ask; FALSE if they don't fit.
+     *
+     *  1. Requests for the same MSR are merged into one (see _MergeRequests)
+     *  2. Each side of an MSR with a dedicated control the processor allows goes through that control instead
+     *  3. The guest MSRs stored on exit go first in the guest area, so that one area serves as both the VM-exit
+     *     MSR-store area and the VM-entry MSR-load area; those only loaded on entry come after them
+     *  4. Each run of entries is sorted by index, so that MsrAreaFind can look one up
+     */
+
+    MSR_AREA_REQUEST merged;
+    ULONG pass;
+    ULONG i;
+
+    RtlSecureZeroMemory( Layout, sizeof(MSR_AREA_LAYOUT) );
+
+    // (Note: the stored entries are placed in the first pass, the load-only ones in the second)
+    for ( pass = 0; pass < 2; pass++ )
+    {
+        for ( i = 0; i < RequestCount; i++ )
+        {
+            if ( _MergeRequests( Requests, RequestCount, i, &merged ) == FALSE )
+            {
+                continue;
+            }
+
+            if ( (merged.Flags & (MSR_AREA_GUEST_LOAD | MSR_AREA_GUEST_SAVE)) != 0 &&
+                 ((merged.Flags & MSR_AREA_GUEST_SAVE) != 0) == (pass == 0) &&
+                 _DedicatedGuest( &merged, AllowedExitCtrls, AllowedEntryCtrls, Layout ) == FALSE )
+            {
+                if ( _AppendEntry( GuestArea, &Layout->GuestCount, merged.Index, merged.GuestValue ) == FALSE )
+                {
+                    return FALSE;
+                }
+            }
+
+            if ( pass == 0 &&
+                 (merged.Flags & MSR_AREA_HOST_LOAD) != 0 &&
+                 _DedicatedHost( &merged, AllowedExitCtrls, Layout ) == FALSE )
+            {
+                if ( _AppendEntry( HostArea, &Layout->HostCount, merged.Index, merged.HostValue ) == FALSE )
+                {
+                    return FALSE;
+                }
+            }
+        }
+
+        if ( pass == 0 )
+        {
+            Layout->GuestStoreCount = Layout->GuestCount;
+        }
+    }
+
+    _SortEntries( GuestArea, Layout->GuestStoreCount );
+    _SortEntries( GuestArea + Layout->GuestStoreCount, Layout->GuestCount - Layout->GuestStoreCount );
+    _SortEntries( HostArea, Layout->HostCount );
+
+    return TRUE;
+}
+
+PMSR_AREA_ENTRY
+MsrAreaFind(
+    _In_reads_(Count) CONST MSR_AREA_ENTRY* Area,
+    _In_ CONST ULONG Count,
+    _In_ CONST UINT32 Index
+    )
+{
+    // Binary search of a run of entries sorted by index (see MsrAreaBuild); NULL if Index isn't in it
+
+    ULONG low = 0;
+    ULONG high = Count;
+    ULONG middle;
+
+    while ( low < high )
+    {
+        middle = low + (high - low) / 2;
+
+        if ( Area[middle].Index == Index )
+        {
+            return (PMSR_AREA_ENTRY)&Area[middle];
+        }
+
+        if ( Area[middle].Index < Index )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,108 @@
+#ifndef __MSRAREA_H__
+#define __MSRAREA_H__
+
+#include <ntddk.h>
+
+#include "State.h"
+
+/*
+ * [24.7.2] "VM-Exit Controls for MSRs", [24.8.2] "VM-Entry Controls for MSRs"
+ *
+ *  The MSR-store and MSR-load areas are arrays of 16-byte entries (16-byte aligned), which the processor works
+ *  through in order on every VM-exit (storing the guest's values, then loading the host's) and VM-entry
+ *  (loading the guest's). Each entry is a full RDMSR/WRMSR's worth of work on every transition; an MSR with a
+ *  dedicated control (IA32_EFER, IA32_PAT and IA32_PERF_GLOBAL_CTRL) costs a great deal less through that.
+ *
+ *  The VM-exit MSR-store area and the VM-entry MSR-load area may be the same memory ([31.7] "Using VMX
+ *  Instructions in a VMM"); every guest MSR stored on exit is then loaded back on the next entry, without us
+ *  copying it.
+ */
+typedef struct _MSR_AREA_ENTRY
+{
+	UINT32 Index;
+	UINT32 Reserved;
+	UINT64 Data;
+} MSR_AREA_ENTRY, *PMSR_AREA_ENTRY;
+
+C_ASSERT( sizeof(MSR_AREA_ENTRY) == 16 );
+
+// The entries each of an LP's two areas has room for (see _AllocateLP in "Driver.c"); far fewer than the processor's
+//	limit of 512 * (IA32_VMX_MISC[27:25] + 1), as every one of them is paid for on every transition
+#define MSR_AREA_MAX_ENTRIES				32
+#define MSR_AREA_SIZE						(MSR_AREA_MAX_ENTRIES * sizeof(MSR_AREA_ENTRY))
+
+// The MSRs an LP may ask to have switched on its transitions (see MsrAreaAddRequest)
+#define MSR_AREA_MAX_REQUESTS				MSR_AREA_MAX_ENTRIES
+
+// MSR_AREA_REQUEST flags
+#define MSR_AREA_GUEST_LOAD					0x1		// Load GuestValue into the MSR on every VM-entry
+#define MSR_AREA_GUEST_SAVE					0x2		// The guest owns the MSR: store it on every VM-exit, and load it back on every VM-entry (GuestValue is its initial value)
+#define MSR_AREA_HOST_LOAD					0x4		// Load HostValue into the MSR on every VM-exit
+
+// One MSR to switch on VM-entry and/or VM-exit; requests for the same MSR are merged (see MsrAreaBuild)
+typedef struct _MSR_AREA_REQUEST
+{
+	UINT32 Index;
+	UINT32 Flags;
+	UINT64 GuestValue;
+	UINT64 HostValue;
+} MSR_AREA_REQUEST, *PMSR_AREA_REQUEST;
+
+// The guest- and host-state fields the dedicated controls load from (the guest and host side of each of the three MSRs)
+#define MSR_AREA_MAX_DEDICATED_FIELDS		6
+
+/*
+ * What MsrAreaBuild made of an LP's requests: the dedicated controls to set on top of g_VMXControls (and the
+ *  state fields they load from), and how many entries went in each area.
+ *
+ *  The guest area is loaded on VM-entry (all GuestCount entries of it), and the first GuestStoreCount of its
+ *  entries are also stored on VM-exit. The host area is loaded on VM-exit.
+ */
+typedef struct _MSR_AREA_LAYOUT
+{
+	VM_EXIT_CTRLS ExitCtrls;
+	VM_ENTRY_CTRLS EntryCtrls;
+
+	VMCS_FIELD_VALUE Fields[MSR_AREA_MAX_DEDICATED_FIELDS];
+	ULONG FieldCount;
+
+	ULONG GuestCount;
+	ULONG GuestStoreCount;
+	ULONG HostCount;
+} MSR_AREA_LAYOUT, *PMSR_AREA_LAYOUT;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+MsrAreaAddRequest(
+	_Inout_updates_(MSR_AREA_MAX_REQUESTS) PMSR_AREA_REQUEST Requests,
+	_Inout_ PULONG RequestCount,
+	_In_ CONST UINT32 Index,
+	_In_ CONST UINT32 Flags,
+	_In_ CONST UINT64 GuestValue,
+	_In_ CONST UINT64 HostValue
+	);
+
+BOOLEAN
+MsrAreaBuild(
+	_In_reads_(RequestCount) CONST MSR_AREA_REQUEST* Requests,
+	_In_ CONST ULONG RequestCount,
+	_In_ CONST UINT32 AllowedExitCtrls,
+	_In_ CONST UINT32 AllowedEntryCtrls,
+	_Out_writes_(MSR_AREA_MAX_ENTRIES) PMSR_AREA_ENTRY GuestArea,
+	_Out_writes_(MSR_AREA_MAX_ENTRIES) PMSR_AREA_ENTRY HostArea,
+	_Out_ PMSR_AREA_LAYOUT Layout
+	);
+
+PMSR_AREA_ENTRY
+MsrAreaFind(
+	_In_reads_(Count) CONST MSR_AREA_ENTRY* Area,
+	_In_ CONST ULONG Count,
+	_In_ CONST UINT32 Index
+	);
+
+#endif // __MSRAREA_H__
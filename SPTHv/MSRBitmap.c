@@ -0,0 +1,162 @@
+#include "MSRBitmap.h"
+
+/*
+ * Notes for testing:
+ *
+ * These functions only ever touch the bitmap they're given; any 4KB buffer will do.
+ *
+ * A bitmap the processor is using may be changed at any time, but an LP that's partway through an
+ *  RDMSR/WRMSR may or may not see the change ([24.6.9] "MSR-Bitmap Address"); build the bitmap before
+ *  the LPs using it are launched (see _BuildMSRBitmap in "Driver.c").
+ */
+
+BOOLEAN
+MsrBitmapIsCovered(
+    _In_ CONST UINT32 Msr
+    )
+{
+    return (Msr <= MSR_BITMAP_LOW_LAST) || (Msr >= MSR_BITMAP_HIGH_FIRST && Msr <= MSR_BITMAP_HIGH_LAST);
+}
+
+BOOLEAN
+_BitOffsets(
+    _In_ CONST UINT32 Msr,
+    _Out_ PUINT32 ReadBit,
+    _Out_ PUINT32 WriteBit
+    )
+{
+    // The bit offsets (from the start of the bitmap) of Msr's read and write intercepts
+
+    if ( Msr <= MSR_BITMAP_LOW_LAST )
+    {
+        *ReadBit = MSR_BITMAP_READ_LOW * 8 + Msr;
+        *WriteBit = MSR_BITMAP_WRITE_LOW * 8 + Msr;
+    }
+    else if ( Msr >= MSR_BITMAP_HIGH_FIRST && Msr <= MSR_BITMAP_HIGH_LAST )
+    {
+        *ReadBit = MSR_BITMAP_READ_HIGH * 8 + (Msr - MSR_BITMAP_HIGH_FIRST);
+        *WriteBit = MSR_BITMAP_WRITE_HIGH * 8 + (Msr - MSR_BITMAP_HIGH_FIRST);
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID
+_SetBit(
+    _Inout_ PUINT8 Bitmap,
+    _In_ CONST UINT32 Bit,
+    _In_ CONST BOOLEAN Set
+    )
+{
+    if ( Set == TRUE )
+    {
+        Bitmap[Bit / 8] |= (UINT8)(1 << (Bit % 8));
+    }
+    else
+    {
+        Bitmap[Bit / 8] &= (UINT8)~(1 << (Bit % 8));
+    }
+}
+
+BOOLEAN
+MsrBitmapSetIntercept(
+    _Inout_updates_bytes_(MSR_BITMAP_SIZE) PUINT8 Bitmap,
+    _In_ CONST UINT32 Msr,
+    _In_ CONST UINT32 Intercepts,
+    _In_ CONST BOOLEAN Intercept
+    )
+{
+    // Start (or stop) intercepting the given accesses to Msr; FALSE if Msr isn't one the bitmap covers
+
+    UINT32 readBit, writeBit;
+
+    if ( _BitOffsets( Msr, &readBit, &writeBit ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    if ( (Intercepts & MSR_INTERCEPT_READ) != 0 )
+    {
+        _SetBit( Bitmap, readBit, Intercept );
+    }
+
+    if ( (Intercepts & MSR_INTERCEPT_WRITE) != 0 )
+    {
+        _SetBit( Bitmap, writeBit, Intercept );
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+MsrBitmapSetRangeIntercept(
+    _Inout_updates_bytes_(MSR_BITMAP_SIZE) PUINT8 Bitmap,
+    _In_ CONST UINT32 FirstMsr,
+    _In_ CONST UINT32 LastMsr,
+    _In_ CONST UINT32 Intercepts,
+    _In_ CONST BOOLEAN Intercept
+    )
+{
+    /*
+     * Start (or stop) intercepting the given accesses to every MSR in [FirstMsr, LastMsr]. The range has to
+     *  lie entirely within one of the covered halves; otherwise nothing is changed, and we return FALSE.
+     */
+
+    UINT32 msr;
+
+    if ( FirstMsr > LastMsr || MsrBitmapIsCovered( FirstMsr ) == FALSE || MsrBitmapIsCovered( LastMsr ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    if ( (FirstMsr <= MSR_BITMAP_LOW_LAST) != (LastMsr <= MSR_BITMAP_LOW_LAST) )
+    {
+        return FALSE;
+    }
+
+    for ( msr = FirstMsr; ; msr++ )
+    {
+        MsrBitmapSetIntercept( Bitmap, msr, Intercepts, Intercept );
+
+        // (Note: checked here, rather than in the loop condition, so LastMsr can't overflow msr)
+        if ( msr == LastMsr )
+        {
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+UINT32
+MsrBitmapGetIntercepts(
+    _In_reads_bytes_(MSR_BITMAP_SIZE) CONST UINT8* Bitmap,
+    _In_ CONST UINT32 Msr
+    )
+{
+    // The accesses to Msr that cause an exit (MSR_INTERCEPT_*); every access, for MSRs the bitmap doesn't cover
+
+    UINT32 readBit, writeBit;
+    UINT32 intercepts = 0;
+
+    if ( _BitOffsets( Msr, &readBit, &writeBit ) == FALSE )
+    {
+        return MSR_INTERCEPT_READ_WRITE;
+    }
+
+    if ( (Bitmap[readBit / 8] & (1 << (readBit % 8))) != 0 )
+    {
+        intercepts |= MSR_INTERCEPT_READ;
+    }
+
+    if ( (Bitmap[writeBit / 8] & (1 << (writeBit % 8))) != 0 )
+    {
+        intercepts |= MSR_INTERCEPT_WRITE;
+    }
+
+    return intercepts;
+}
@@ -0,0 +1,63 @@
+#ifndef __MSRBITMAP_H__
+#define __MSRBITMAP_H__
+
+#include <ntddk.h>
+
+/*
+ * [24.6.9] "MSR-Bitmap Address"
+ *
+ *  The 4KB MSR bitmap is four 1KB bitmaps, one bit per MSR; a set bit makes the access exit. MSRs
+ *  outside of the two ranges the bitmap covers always cause an exit.
+ */
+#define MSR_BITMAP_SIZE						0x1000
+
+#define MSR_BITMAP_READ_LOW					0x000	// Reads of 00000000H - 00001FFFH
+#define MSR_BITMAP_READ_HIGH				0x400	// Reads of C0000000H - C0001FFFH
+#define MSR_BITMAP_WRITE_LOW				0x800	// Writes to 00000000H - 00001FFFH
+#define MSR_BITMAP_WRITE_HIGH				0xC00	// Writes to C0000000H - C0001FFFH
+
+#define MSR_BITMAP_LOW_FIRST				0x00000000
+#define MSR_BITMAP_LOW_LAST					0x00001FFF
+#define MSR_BITMAP_HIGH_FIRST				0xC0000000
+#define MSR_BITMAP_HIGH_LAST				0xC0001FFF
+
+// Which accesses to intercept (see MsrBitmapSetIntercept)
+#define MSR_INTERCEPT_READ					0x1
+#define MSR_INTERCEPT_WRITE					0x2
+#define MSR_INTERCEPT_READ_WRITE			(MSR_INTERCEPT_READ | MSR_INTERCEPT_WRITE)
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+MsrBitmapIsCovered(
+	_In_ CONST UINT32 Msr
+	);
+
+BOOLEAN
+MsrBitmapSetIntercept(
+	_Inout_updates_bytes_(MSR_BITMAP_SIZE) PUINT8 Bitmap,
+	_In_ CONST UINT32 Msr,
+	_In_ CONST UINT32 Intercepts,
+	_In_ CONST BOOLEAN Intercept
+	);
+
+BOOLEAN
+MsrBitmapSetRangeIntercept(
+	_Inout_updates_bytes_(MSR_BITMAP_SIZE) PUINT8 Bitmap,
+	_In_ CONST UINT32 FirstMsr,
+	_In_ CONST UINT32 LastMsr,
+	_In_ CONST UINT32 Intercepts,
+	_In_ CONST BOOLEAN Intercept
+	);
+
+UINT32
+MsrBitmapGetIntercepts(
+	_In_reads_bytes_(MSR_BITMAP_SIZE) CONST UINT8* Bitmap,
+	_In_ CONST UINT32 Msr
+	);
+
+#endif // __MSRBITMAP_H__
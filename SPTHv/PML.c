@@ -0,0 +1,268 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The bitmap itself (and draining logs into it) lives in "Dirty.c"; everything in here is the bookkeeping
+ *  around it, which needs the LPs to be virtualized.
+ *
+ * Tracking is started, harvested and stopped with IOCTL_SPTHV_START_DIRTY_TRACKING, IOCTL_SPTHV_HARVEST_DIRTY
+ *  and IOCTL_SPTHV_STOP_DIRTY_TRACKING (see the `dirty` command of the SPTHvCtl tool). Each LP logs into its
+ *  own page (`PMLBuffer`), which is drained on every "page-modification log full" exit (see _ExitPMLLogFull
+ *  in "Exit.c"), and whenever we ask with HYPERCALL_PML_FLUSH.
+ *
+ * Every EPT view the guest can switch to (see "VMFunc.c") has dirty flags of its own, copied from the default
+ *  view's; so the flags are cleared in all of them, whether or not they're in the EPTP list right now, and a
+ *  page written through any of them is logged afresh after every harvest.
+ */
+
+C_ASSERT( SPTHV_DIRTY_PAGES_PER_WORD == DIRTY_PAGES_PER_WORD );
+
+BOOLEAN g_PmlSupported;
+
+DIRTY_BITMAP g_DirtyBitmap;
+
+PEPT_VIEW g_PmlViews[EPT_VIEW_MAX];
+ULONG g_PmlViewCount;
+
+// Only one start, stop or harvest at a time
+FAST_MUTEX g_PmlLock;
+BOOLEAN g_PmlRunning;
+
+BOOLEAN
+PmlInitialize()
+{
+    /*
+     * Work out whether we can log page modifications, and if so, allocate the dirty bitmap and turn on the EPT
+     *  accessed and dirty flags PML depends on. This has to run before any LP is launched, as the flags are
+     *  turned on in the EPTP every LP shares.
+     */
+
+    PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondaryCtrls;
+    PPHYSICAL_MEMORY_RANGE physicalRanges;
+    UINT64 topOfRAM = 0;
+    UINT32 dropped;
+    ULONG i;
+
+    ExInitializeFastMutex( &g_PmlLock );
+
+    // Only writes that set an EPT dirty flag are logged; so we need EPT, with the flags ([A.10] "VPID and EPT Capabilities")
+    if ( g_VMXControls.Secondary.EnableEPT == 0 || g_VMXCapabilities.EPTVPIDCap.AccessedDirty == 0 )
+    {
+        return FALSE;
+    }
+
+    // [24.6.2] "Processor-Based VM-Execution Controls"; not every processor that has the flags has PML
+    secondaryCtrls = g_VMXControls.Secondary;
+    secondaryCtrls.EnablePML = 1;
+
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PROC_SECONDARY, secondaryCtrls.All, &dropped, NULL );
+    if ( dropped != 0 )
+    {
+        return FALSE;
+    }
+
+    // The bitmap covers RAM; there's no point in tracking writes to MMIO
+    physicalRanges = MmGetPhysicalMemoryRanges();
+    if ( physicalRanges == NULL )
+    {
+        return FALSE;
+    }
+
+    for ( i = 0; physicalRanges[i].NumberOfBytes.QuadPart != 0; i++ )
+    {
+        topOfRAM = max( topOfRAM, (UINT64)(physicalRanges[i].BaseAddress.QuadPart + physicalRanges[i].NumberOfBytes.QuadPart) );
+    }
+
+    ExFreePool( physicalRanges );
+
+    g_DirtyBitmap.PageCount = ALIGN_UP_BY( topOfRAM / PAGE_SIZE, DIRTY_PAGES_PER_WORD );
+    g_DirtyBitmap.Bits = ExAllocatePoolWithTag( NonPagedPool, DIRTY_BITMAP_BYTES( g_DirtyBitmap.PageCount ), SPTHV_POOL_TAG );
+
+    if ( g_DirtyBitmap.Bits == NULL )
+    {
+        g_DirtyBitmap.PageCount = 0;
+        return FALSE;
+    }
+
+    DirtyReset( &g_DirtyBitmap );
+
+    // [28.2.4] "Accessed and Dirty Flags for EPT"; the processor sets these in our leaf entries from now on
+    //    (Note: it also counts its own updates of the guest's paging-structure A/D bits as writes)
+    g_EPTView.EPTP.EnableAccessedDirty = 1;
+
+    g_PmlSupported = TRUE;
+
+    return TRUE;
+}
+
+VOID
+PmlFree()
+{
+    // Only once no LP is logging
+
+    if ( g_DirtyBitmap.Bits != NULL )
+    {
+        ExFreePoolWithTag( (PVOID)g_DirtyBitmap.Bits, SPTHV_POOL_TAG );
+        g_DirtyBitmap.Bits = NULL;
+    }
+
+    g_DirtyBitmap.PageCount = 0;
+    g_PmlSupported = FALSE;
+}
+
+ULONG_PTR
+_PmlEnableLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; Argument is TRUE to start logging, FALSE to stop
+    GuestVmcall( HYPERCALL_PML, Argument, 0 );
+
+    return 0;
+}
+
+ULONG_PTR
+_PmlFlushLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; drains the LP's log, and drops the EPT dirty flags it has cached
+
+    UNREFERENCED_PARAMETER( Argument );
+
+    GuestVmcall( HYPERCALL_PML_FLUSH, 0, 0 );
+
+    return 0;
+}
+
+VOID
+_PmlGetViews()
+{
+    // Every view there is, the default one first; the views are only built (or freed) while no LP is logging
+
+    PEPT_VIEW view;
+    ULONG i;
+
+    g_PmlViewCount = 0;
+
+    for ( i = EPT_VIEW_DEFAULT; i < EPT_VIEW_MAX; i++ )
+    {
+        view = VmfuncGetView( i );
+
+        if ( view != NULL )
+        {
+            g_PmlViews[g_PmlViewCount++] = view;
+        }
+    }
+}
+
+NTSTATUS
+PmlStart()
+{
+    /*
+     * Start tracking every page written to from here on.
+     *
+     *  Every page whose dirty flag is already set has to have it cleared, or writes to it would never be logged;
+     *  a page written to between clearing it and the flush below may go unreported, but its contents are
+     *  whatever they are once we return (which is where any snapshot this is tracking against starts).
+     */
+
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG i;
+
+    if ( g_PmlSupported == FALSE )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_PmlLock );
+
+    if ( g_PmlRunning == TRUE )
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto __unlock;
+    }
+
+    DirtyReset( &g_DirtyBitmap );
+    _PmlGetViews();
+
+    KeIpiGenericCall( _PmlEnableLP, TRUE );
+
+    for ( i = 0; i < g_PmlViewCount; i++ )
+    {
+        EptClearAllDirty( g_PmlViews[i] );
+    }
+
+    KeIpiGenericCall( _PmlFlushLP, 0 );
+
+    g_PmlRunning = TRUE;
+
+__unlock:
+    ExReleaseFastMutex( &g_PmlLock );
+
+    return status;
+}
+
+NTSTATUS
+PmlStop()
+{
+    ExAcquireFastMutex( &g_PmlLock );
+
+    if ( g_PmlRunning == TRUE )
+    {
+        KeIpiGenericCall( _PmlEnableLP, FALSE );
+        g_PmlRunning = FALSE;
+    }
+
+    ExReleaseFastMutex( &g_PmlLock );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PmlHarvest(
+    _In_ CONST UINT64 FirstPage,
+    _In_ CONST UINT64 PageCount,
+    _Out_writes_(PageCount / DIRTY_PAGES_PER_WORD) PULONG64 Bits,
+    _Out_ PUINT64 DirtyPages
+    )
+{
+    /*
+     * Take the pages in [FirstPage, FirstPage + PageCount) written to since tracking started (or they were last
+     *  harvested), and start tracking them afresh.
+     *
+     *  1. Every LP drains what it's logged so far into the bitmap
+     *  2. The bitmap's bits are taken, and the dirty flags of those pages cleared, in every view (see DirtyHarvest)
+     *  3. Every LP drops the dirty flags it had cached, so that the next write to any of those pages is logged
+     *     (draining whatever's been logged since 1., into the next harvest)
+     */
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    *DirtyPages = 0;
+
+    if ( (FirstPage % DIRTY_PAGES_PER_WORD) != 0 || (PageCount % DIRTY_PAGES_PER_WORD) != 0 || FirstPage + PageCount < FirstPage )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex( &g_PmlLock );
+
+    if ( g_PmlRunning == FALSE )
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto __unlock;
+    }
+
+    KeIpiGenericCall( _PmlFlushLP, 0 );
+
+    *DirtyPages = DirtyHarvest( &g_DirtyBitmap, g_PmlViews, g_PmlViewCount, FirstPage, PageCount, Bits );
+
+    KeIpiGenericCall( _PmlFlushLP, 0 );
+
+__unlock:
+    ExReleaseFastMutex( &g_PmlLock );
+
+    return status;
+}
@@ -0,0 +1,50 @@
+#ifndef __PML_H__
+#define __PML_H__
+
+#include <ntddk.h>
+
+#include "Dirty.h"
+#include "EPTList.h"
+
+
+//
+// Globals
+//
+
+// Whether the processor can log page modifications for us (see PmlInitialize)
+extern BOOLEAN g_PmlSupported;
+
+// Every page of RAM written to since dirty tracking started (or was last harvested); every LP drains its log into it
+extern DIRTY_BITMAP g_DirtyBitmap;
+
+// Every EPT view the guest may write through while tracking, the default one first (see PmlStart)
+extern PEPT_VIEW g_PmlViews[EPT_VIEW_MAX];
+extern ULONG g_PmlViewCount;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+PmlInitialize();
+
+VOID
+PmlFree();
+
+NTSTATUS
+PmlStart();
+
+NTSTATUS
+PmlStop();
+
+NTSTATUS
+PmlHarvest(
+	_In_ CONST UINT64 FirstPage,
+	_In_ CONST UINT64 PageCount,
+	_Out_writes_(PageCount / DIRTY_PAGES_PER_WORD) PULONG64 Bits,
+	_Out_ PUINT64 DirtyPages
+	);
+
+#endif // __PML_H__
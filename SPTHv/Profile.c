@@ -0,0 +1,314 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * ProfileRecord only ever touches the table it's given; any zeroed SPTHV_PROFILE_TABLE will do. Tables are
+ *  only written by the LP that owns them (from _ProfileExitPreemptionTimer, which is only registered as the
+ *  preemption timer's exit handler while sampling), and only read once sampling has stopped, so there's nothing
+ *  to synchronize.
+ *
+ * Sampling is started and stopped with IOCTL_SPTHV_START_PROFILE and IOCTL_SPTHV_STOP_PROFILE (see the
+ *  `profile` command of the SPTHvCtl tool); use `dt SPTHv!_SPTHV_PROFILE_TABLE poi(SPTHv!g_ProfileTables)`
+ *  to look at LP 0's table from the debugger.
+ */
+
+C_ASSERT( (SPTHV_PROFILE_TABLE_ENTRIES & (SPTHV_PROFILE_TABLE_ENTRIES - 1)) == 0 );
+
+// Every LP's table, back to back (see ProfileInitialize)
+PSPTHV_PROFILE_TABLE g_ProfileTables;
+ULONG g_ProfileTableCount;
+
+// Only one start or stop at a time; and no queries while sampling
+FAST_MUTEX g_ProfileLock;
+BOOLEAN g_ProfileRunning;
+
+BOOLEAN
+ProfileInitialize(
+    _In_ CONST ULONG TableCount
+    )
+{
+    SIZE_T size = (SIZE_T)TableCount * sizeof(SPTHV_PROFILE_TABLE);
+    ULONG i;
+
+    ExInitializeFastMutex( &g_ProfileLock );
+
+    g_ProfileTables = ExAllocatePoolWithTag( NonPagedPool, size, SPTHV_POOL_TAG );
+    if ( g_ProfileTables == NULL )
+    {
+        return FALSE;
+    }
+
+    RtlSecureZeroMemory( g_ProfileTables, size );
+
+    for ( i = 0; i < TableCount; i++ )
+    {
+        g_ProfileTables[i].Processor = i;
+        g_ProfileTables[i].ProcessorCount = TableCount;
+    }
+
+    g_ProfileTableCount = TableCount;
+
+    return TRUE;
+}
+
+VOID
+ProfileFree()
+{
+    // Only once no LP is sampling
+
+    if ( g_ProfileTables != NULL )
+    {
+        ExFreePoolWithTag( g_ProfileTables, SPTHV_POOL_TAG );
+        g_ProfileTables = NULL;
+    }
+
+    g_ProfileTableCount = 0;
+}
+
+PSPTHV_PROFILE_TABLE
+ProfileGetTable(
+    _In_ CONST ULONG Index
+    )
+{
+    if ( g_ProfileTables == NULL || Index >= g_ProfileTableCount )
+    {
+        return NULL;
+    }
+
+    return &g_ProfileTables[Index];
+}
+
+BOOLEAN
+ProfileRecord(
+    _Inout_ PSPTHV_PROFILE_TABLE Table,
+    _In_ CONST UINT64 Rip,
+    _In_ CONST UINT64 Cr3,
+    _In_ CONST ULONG Mode
+    )
+{
+    /*
+     * Count one sample; open addressing with linear probing, keyed on all of RIP, CR3 and mode. Once the table
+     *  is as full as PROFILE_TABLE_MAX_USED lets it get, samples with new keys are dropped (and counted).
+     *  FALSE if the sample was dropped.
+     */
+
+    PSPTHV_PROFILE_ENTRY entry;
+    UINT64 hash;
+    ULONG index;
+    ULONG probe;
+
+    // (Note: multiplicative hashing; the high bits of the product are the well-mixed ones)
+    hash = (Rip * 0x9E3779B97F4A7C15ULL) ^ ((Cr3 >> PAGE_SHIFT) * 0xC2B2AE3D27D4EB4FULL) ^ Mode;
+    index = (ULONG)(hash >> 32);
+
+    for ( probe = 0; probe < SPTHV_PROFILE_TABLE_ENTRIES; probe++ )
+    {
+        entry = &Table->Entries[(index + probe) & (SPTHV_PROFILE_TABLE_ENTRIES - 1)];
+
+        if ( entry->Count == 0 )
+        {
+            if ( Table->Used >= PROFILE_TABLE_MAX_USED )
+            {
+                break;
+            }
+
+            entry->Rip = Rip;
+            entry->Cr3 = Cr3;
+            entry->Mode = Mode;
+            entry->Count = 1;
+
+            Table->Used++;
+            Table->Samples++;
+
+            return TRUE;
+        }
+
+        if ( entry->Rip == Rip && entry->Cr3 == Cr3 && entry->Mode == Mode )
+        {
+            entry->Count++;
+            Table->Samples++;
+
+            return TRUE;
+        }
+    }
+
+    Table->Dropped++;
+
+    return FALSE;
+}
+
+VOID
+_ProfileExitPreemptionTimer(
+    _Inout_ PGUEST_REGISTERS GuestRegisters,
+    _Inout_ PLP_INFO LPInfo
+    )
+{
+    /*
+     * The profiler's timer ran out (see HYPERCALL_PROFILE); count where the guest was, and rearm it. Nothing
+     *  happened in the guest to cause this, so there's no instruction to skip.
+     */
+
+    SEG_ACCESS_RIGHTS csAR;
+    SEG_ACCESS_RIGHTS ssAR;
+    size_t value = 0;
+    ULONG mode;
+
+    UNREFERENCED_PARAMETER( GuestRegisters );
+
+    __vmx_vmread( VMCS_GUEST_CS_ACCESS_RIGHTS, &value );
+    csAR.All = (UINT32)value;
+
+    // [5.5] "Privilege Levels": the CPL is the DPL of the SS segment
+    __vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &value );
+    ssAR.All = (UINT32)value;
+
+    mode = ssAR.DPL & SPTHV_PROFILE_MODE_CPL_MASK;
+
+    if ( csAR.LongModeCS == 0 )
+    {
+        mode |= SPTHV_PROFILE_MODE_COMPATIBILITY;
+    }
+
+    if ( LPInfo->Profile != NULL )
+    {
+        // (Note: the PCID lives in the low bits of CR3; the address space is what we're after)
+        ProfileRecord(
+            LPInfo->Profile,
+            VMExitRead( LPInfo, VMCS_CACHE_GUEST_RIP ),
+            VMExitRead( LPInfo, VMCS_CACHE_GUEST_CR3 ) & ~(UINT64)(PAGE_SIZE - 1),
+            mode
+            );
+    }
+
+    // (Note: a period of 0 leaves the timer at 0; it won't expire again once the pin-based control is off)
+    __vmx_vmwrite( VMCS_GUEST_VMX_PREEMP_TIMER_VAL, LPInfo->ProfilePeriod );
+}
+
+ULONG_PTR
+_ProfileArmLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; Argument is the timer period (0 disarms the timer)
+    GuestVmcall( HYPERCALL_PROFILE, Argument, 0 );
+
+    return 0;
+}
+
+NTSTATUS
+ProfileStart(
+    _In_ ULONG Frequency
+    )
+{
+    PIN_VM_EXEC_CTRLS pinCtrls;
+    UINT32 dropped;
+    UINT64 period;
+    ULONG i;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if ( Frequency == 0 || Frequency > SPTHV_PROFILE_MAX_FREQUENCY )
+    {
+        Frequency = SPTHV_PROFILE_DEFAULT_FREQUENCY;
+    }
+
+    if ( g_ProfileTables == NULL )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // [24.6.1] "Pin-Based VM-Execution Controls"; not every processor has the timer
+    pinCtrls = g_VMXControls.PinBased;
+    pinCtrls.ActivateVMXPreemptionTimer = 1;
+
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PIN_BASED, pinCtrls.All, &dropped, NULL );
+    if ( dropped != 0 )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_ProfileLock );
+
+    if ( g_ProfileRunning == TRUE )
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto __unlock;
+    }
+
+    // [25.5.1] "VMX-Preemption Timer"; the timer counts down by one every 2^PreemptionTimerRate TSC ticks (of the
+    //    processor's TSC, whatever rate the guest's runs at)
+    period = (g_TscHostFrequency / Frequency) >> g_VMXCapabilities.Misc.PreemptionTimerRate;
+    period = max( period, 1 );
+    period = min( period, MAXUINT32 );
+
+    // Every sample from here on is from this run (nothing is sampling now, so the tables are ours)
+    for ( i = 0; i < g_ProfileTableCount; i++ )
+    {
+        RtlSecureZeroMemory( g_ProfileTables[i].Entries, sizeof(g_ProfileTables[i].Entries) );
+
+        g_ProfileTables[i].Used = 0;
+        g_ProfileTables[i].Samples = 0;
+        g_ProfileTables[i].Dropped = 0;
+        g_ProfileTables[i].Period = (ULONG)period;
+    }
+
+    g_ProfileRunning = TRUE;
+
+    // The handler has to be in place before the first LP's timer can run out
+    VMExitRegisterHandler( REASON_PREEMPTION_TIMER_EXPIRE, _ProfileExitPreemptionTimer );
+
+    KeIpiGenericCall( _ProfileArmLP, (ULONG_PTR)period );
+
+__unlock:
+    ExReleaseFastMutex( &g_ProfileLock );
+
+    return status;
+}
+
+NTSTATUS
+ProfileStop()
+{
+    ExAcquireFastMutex( &g_ProfileLock );
+
+    if ( g_ProfileRunning == TRUE )
+    {
+        KeIpiGenericCall( _ProfileArmLP, 0 );
+        g_ProfileRunning = FALSE;
+
+        // No LP's timer is running any more (the broadcast has returned), so nothing can still be on its way to the handler
+        VMExitRegisterHandler( REASON_PREEMPTION_TIMER_EXPIRE, NULL );
+    }
+
+    ExReleaseFastMutex( &g_ProfileLock );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ProfileQuery(
+    _In_ CONST ULONG Processor,
+    _Out_ PSPTHV_PROFILE_TABLE Table
+    )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    ExAcquireFastMutex( &g_ProfileLock );
+
+    // The LPs would be writing to the tables as we copied them
+    if ( g_ProfileRunning == TRUE )
+    {
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if ( ProfileGetTable( Processor ) == NULL )
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        RtlCopyMemory( Table, ProfileGetTable( Processor ), sizeof(SPTHV_PROFILE_TABLE) );
+    }
+
+    ExReleaseFastMutex( &g_ProfileLock );
+
+    return status;
+}
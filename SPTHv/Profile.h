@@ -0,0 +1,52 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+// No more than this share of a table is ever filled, which keeps every probe sequence short (and finite)
+#define PROFILE_TABLE_MAX_USED				(SPTHV_PROFILE_TABLE_ENTRIES / 4 * 3)
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+ProfileInitialize(
+	_In_ CONST ULONG TableCount
+	);
+
+VOID
+ProfileFree();
+
+PSPTHV_PROFILE_TABLE
+ProfileGetTable(
+	_In_ CONST ULONG Index
+	);
+
+BOOLEAN
+ProfileRecord(
+	_Inout_ PSPTHV_PROFILE_TABLE Table,
+	_In_ CONST UINT64 Rip,
+	_In_ CONST UINT64 Cr3,
+	_In_ CONST ULONG Mode
+	);
+
+NTSTATUS
+ProfileStart(
+	_In_ ULONG Frequency
+	);
+
+NTSTATUS
+ProfileStop();
+
+NTSTATUS
+ProfileQuery(
+	_In_ CONST ULONG Processor,
+	_Out_ PSPTHV_PROFILE_TABLE Table
+	);
+
+#endif // __PROFILE_H__
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ProfileReport.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches anything but the tables and entries it's given; any SPTHV_PROFILE_TABLEs will do,
+ *  made up or read back with IOCTL_SPTHV_QUERY_PROFILE. Lines are formatted into a buffer rather than printed,
+ *  so the output of the `profile` command of the SPTHvCtl tool can be checked as it is.
+ */
+
+int
+_CompareProfileKeys(
+    _In_ CONST VOID* Left,
+    _In_ CONST VOID* Right
+    )
+{
+    CONST SPTHV_PROFILE_ENTRY* left = Left;
+    CONST SPTHV_PROFILE_ENTRY* right = Right;
+
+    if ( left->Cr3 != right->Cr3 )
+    {
+        return (left->Cr3 < right->Cr3) ? -1 : 1;
+    }
+
+    if ( left->Mode != right->Mode )
+    {
+        return (left->Mode < right->Mode) ? -1 : 1;
+    }
+
+    if ( left->Rip != right->Rip )
+    {
+        return (left->Rip < right->Rip) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int
+_CompareProfileCounts(
+    _In_ CONST VOID* Left,
+    _In_ CONST VOID* Right
+    )
+{
+    // Most samples first
+    CONST SPTHV_PROFILE_ENTRY* left = Left;
+    CONST SPTHV_PROFILE_ENTRY* right = Right;
+
+    if ( left->Count != right->Count )
+    {
+        return (left->Count > right->Count) ? -1 : 1;
+    }
+
+    return _CompareProfileKeys( Left, Right );
+}
+
+ULONG
+ProfileAddTable(
+    _Inout_updates_(Count + SPTHV_PROFILE_TABLE_ENTRIES) PSPTHV_PROFILE_ENTRY Entries,
+    _In_ CONST ULONG Count,
+    _In_ CONST SPTHV_PROFILE_TABLE* Table
+    )
+{
+    // Append the entries one LP's table has in use to the Count already in Entries; returns how many there are now
+
+    ULONG count = Count;
+    ULONG i;
+
+    for ( i = 0; i < SPTHV_PROFILE_TABLE_ENTRIES; i++ )
+    {
+        if ( Table->Entries[i].Count != 0 )
+        {
+            Entries[count++] = Table->Entries[i];
+        }
+    }
+
+    return count;
+}
+
+ULONG
+ProfileMergeEntries(
+    _Inout_updates_(Count) PSPTHV_PROFILE_ENTRY Entries,
+    _In_ CONST ULONG Count
+    )
+{
+    // Sort Entries by key, and fold those with the same key (from different LPs) into one; returns how many are left
+
+    ULONG merged = 0;
+    ULONG i;
+
+    if ( Count == 0 )
+    {
+        return 0;
+    }
+
+    qsort( Entries, Count, sizeof(SPTHV_PROFILE_ENTRY), _CompareProfileKeys );
+
+    for ( i = 1; i < Count; i++ )
+    {
+        if ( _CompareProfileKeys( &Entries[merged], &Entries[i] ) == 0 )
+        {
+            Entries[merged].Count += Entries[i].Count;
+        }
+        else
+        {
+            Entries[++merged] = Entries[i];
+        }
+    }
+
+    return merged + 1;
+}
+
+VOID
+ProfileSortByCount(
+    _Inout_updates_(Count) PSPTHV_PROFILE_ENTRY Entries,
+    _In_ CONST ULONG Count
+    )
+{
+    // Most samples first; ties in key order, so the same profile always comes out the same way
+    qsort( Entries, Count, sizeof(SPTHV_PROFILE_ENTRY), _CompareProfileCounts );
+}
+
+CONST CHAR*
+ProfileModeName(
+    _In_ CONST ULONG Mode
+    )
+{
+    if ( (Mode & SPTHV_PROFILE_MODE_CPL_MASK) == 0 )
+    {
+        return "kernel";
+    }
+
+    return ((Mode & SPTHV_PROFILE_MODE_COMPATIBILITY) != 0) ? "user32" : "user";
+}
+
+VOID
+ProfileFormatFolded(
+    _Out_writes_z_(PROFILE_REPORT_LINE_LENGTH) CHAR* Line,
+    _In_ CONST SPTHV_PROFILE_ENTRY* Entry
+    )
+{
+    // One "stack" (address space;mode;RIP) and its samples, in the format flame graph tools take
+    snprintf(
+        Line,
+        PROFILE_REPORT_LINE_LENGTH,
+        "cr3-%llx;%s;%llx %llu",
+        Entry->Cr3,
+        ProfileModeName( Entry->Mode ),
+        Entry->Rip,
+        Entry->Count
+        );
+}
+
+VOID
+ProfileFormatFlat(
+    _Out_writes_z_(PROFILE_REPORT_LINE_LENGTH) CHAR* Line,
+    _In_ CONST SPTHV_PROFILE_ENTRY* Entry,
+    _In_ CONST ULONG64 Samples
+    )
+{
+    // One row of the flat profile; its share is of Samples, every sample taken on every LP
+    snprintf(
+        Line,
+        PROFILE_REPORT_LINE_LENGTH,
+        "%12llu %6.2f%% %-7s %18llx %18llx",
+        Entry->Count,
+        (Samples != 0) ? (100.0 * Entry->Count) / Samples : 0.0,
+        ProfileModeName( Entry->Mode ),
+        Entry->Cr3,
+        Entry->Rip
+        );
+}
@@ -0,0 +1,59 @@
+#ifndef __PROFILEREPORT_H__
+#define __PROFILEREPORT_H__
+
+// What the SPTHvCtl tool makes of the guest profile every LP kept (see "Profile.c"); built into the tool, not the driver
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+#include "SPTHvIoctl.h"
+
+// Long enough for any line ProfileFormatFolded or ProfileFormatFlat writes
+#define PROFILE_REPORT_LINE_LENGTH			128
+
+
+
+//
+// Local functions
+//
+
+ULONG
+ProfileAddTable(
+	_Inout_updates_(Count + SPTHV_PROFILE_TABLE_ENTRIES) PSPTHV_PROFILE_ENTRY Entries,
+	_In_ CONST ULONG Count,
+	_In_ CONST SPTHV_PROFILE_TABLE* Table
+	);
+
+ULONG
+ProfileMergeEntries(
+	_Inout_updates_(Count) PSPTHV_PROFILE_ENTRY Entries,
+	_In_ CONST ULONG Count
+	);
+
+VOID
+ProfileSortByCount(
+	_Inout_updates_(Count) PSPTHV_PROFILE_ENTRY Entries,
+	_In_ CONST ULONG Count
+	);
+
+CONST CHAR*
+ProfileModeName(
+	_In_ CONST ULONG Mode
+	);
+
+VOID
+ProfileFormatFolded(
+	_Out_writes_z_(PROFILE_REPORT_LINE_LENGTH) CHAR* Line,
+	_In_ CONST SPTHV_PROFILE_ENTRY* Entry
+	);
+
+VOID
+ProfileFormatFlat(
+	_Out_writes_z_(PROFILE_REPORT_LINE_LENGTH) CHAR* Line,
+	_In_ CONST SPTHV_PROFILE_ENTRY* Entry,
+	_In_ CONST ULONG64 Samples
+	);
+
+#endif // __PROFILEREPORT_H__
@@ -0,0 +1,383 @@
+#ifndef __SPTHV_IOCTL_H__
+#define __SPTHV_IOCTL_H__
+
+/*
+ * The interface between the driver and user mode (see "Device.c", and the SPTHvCtl tool).
+ *
+ *  This header is shared by both sides, so it may only use types that <wdm.h> and <windows.h> (with
+ *  <winioctl.h>) both provide.
+ */
+
+#define SPTHV_DEVICE_NAME					L"\\Device\\SPTHv"
+#define SPTHV_SYMBOLIC_LINK_NAME			L"\\DosDevices\\SPTHv"
+#define SPTHV_USER_DEVICE_NAME				L"\\\\.\\SPTHv"
+
+#define SPTHV_DEVICE_TYPE					0x8000
+
+// Runs the exit benchmark suite on whichever LP the request lands on (SPTHV_EXIT_BENCHMARK_REQUEST in, SPTHV_EXIT_BENCHMARK out)
+#define IOCTL_SPTHV_RUN_EXIT_BENCHMARK		CTL_CODE( SPTHV_DEVICE_TYPE, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Maps every LP's trace ring into the caller (SPTHV_TRACE_MAPPING out); only one handle may have them mapped at a time
+#define IOCTL_SPTHV_MAP_TRACE				CTL_CODE( SPTHV_DEVICE_TYPE, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Unmaps the trace rings (closing the handle that mapped them does the same)
+#define IOCTL_SPTHV_UNMAP_TRACE				CTL_CODE( SPTHV_DEVICE_TYPE, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Merges every LP's exit counters into one snapshot (SPTHV_EXIT_STATS out)
+#define IOCTL_SPTHV_QUERY_EXIT_STATS		CTL_CODE( SPTHV_DEVICE_TYPE, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS )
+
+// Starts sampling the guest on every LP with the VMX-preemption timer (SPTHV_PROFILE_REQUEST in)
+#define IOCTL_SPTHV_START_PROFILE			CTL_CODE( SPTHV_DEVICE_TYPE, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Stops sampling; the samples taken are kept until the next start
+#define IOCTL_SPTHV_STOP_PROFILE			CTL_CODE( SPTHV_DEVICE_TYPE, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Copies out one LP's samples, once sampling has stopped (SPTHV_PROFILE_QUERY in, SPTHV_PROFILE_TABLE out)
+#define IOCTL_SPTHV_QUERY_PROFILE			CTL_CODE( SPTHV_DEVICE_TYPE, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS )
+
+// Starts tracking the guest-physical pages of RAM written to, on every LP
+#define IOCTL_SPTHV_START_DIRTY_TRACKING	CTL_CODE( SPTHV_DEVICE_TYPE, 0x807, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Stops tracking
+#define IOCTL_SPTHV_STOP_DIRTY_TRACKING		CTL_CODE( SPTHV_DEVICE_TYPE, 0x808, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Takes the pages in a range written to since tracking started (or they were last harvested), and resets them
+//	(SPTHV_DIRTY_QUERY in, SPTHV_DIRTY_BITMAP out)
+#define IOCTL_SPTHV_HARVEST_DIRTY			CTL_CODE( SPTHV_DEVICE_TYPE, 0x809, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Sets the rate the guest's TSC runs at, and moves it forward, on every LP (SPTHV_TSC_REQUEST in)
+#define IOCTL_SPTHV_SET_TSC					CTL_CODE( SPTHV_DEVICE_TYPE, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Reads one LP's TSC multiplier and offset (SPTHV_TSC_QUERY in, SPTHV_TSC_STATE out)
+#define IOCTL_SPTHV_QUERY_TSC				CTL_CODE( SPTHV_DEVICE_TYPE, 0x80B, METHOD_BUFFERED, FILE_READ_ACCESS )
+
+// Starts (or stops) intercepting accesses to a range of MSRs, on every LP (SPTHV_MSR_INTERCEPT_REQUEST in)
+#define IOCTL_SPTHV_SET_MSR_INTERCEPT		CTL_CODE( SPTHV_DEVICE_TYPE, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Starts (or stops) intercepting accesses to a range of I/O ports, on every LP (SPTHV_IO_INTERCEPT_REQUEST in)
+#define IOCTL_SPTHV_SET_IO_INTERCEPT		CTL_CODE( SPTHV_DEVICE_TYPE, 0x80D, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Sets what the guest may do with a page while it's in one EPT view (SPTHV_VIEW_PAGE_REQUEST in)
+#define IOCTL_SPTHV_PROTECT_VIEW_PAGE		CTL_CODE( SPTHV_DEVICE_TYPE, 0x80E, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Puts an EPT view in the list the guest switches views with, or takes it out (SPTHV_VIEW_REQUEST in)
+#define IOCTL_SPTHV_ENABLE_VIEW				CTL_CODE( SPTHV_DEVICE_TYPE, 0x80F, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Starts delivering #VEs to the guest for the accesses convertible pages refuse, on every LP (the guest has to have
+//	a #VE handler first)
+#define IOCTL_SPTHV_START_VE				CTL_CODE( SPTHV_DEVICE_TYPE, 0x810, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Stops delivering them
+#define IOCTL_SPTHV_STOP_VE					CTL_CODE( SPTHV_DEVICE_TYPE, 0x811, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Makes the accesses one EPT view refuses to a page #VEs, or exits again (SPTHV_VE_CONVERTIBLE_REQUEST in)
+#define IOCTL_SPTHV_SET_CONVERTIBLE			CTL_CODE( SPTHV_DEVICE_TYPE, 0x812, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Starts taking external interrupts on exits, and handing them back to the guest, on every LP
+#define IOCTL_SPTHV_START_INTERRUPTS		CTL_CODE( SPTHV_DEVICE_TYPE, 0x813, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// Lets them go straight to the guest again
+#define IOCTL_SPTHV_STOP_INTERRUPTS			CTL_CODE( SPTHV_DEVICE_TYPE, 0x814, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS )
+
+// The number of times each exit is timed when the request doesn't say (or doesn't fit in the limits)
+#define SPTHV_BENCH_DEFAULT_ITERATIONS		1000
+#define SPTHV_BENCH_MAX_ITERATIONS			100000
+
+// The exits the benchmark suite times, one guest payload each (see "guest.asm")
+typedef enum _SPTHV_BENCH_EXIT
+{
+	SPTHV_BENCH_CPUID,
+	SPTHV_BENCH_RDMSR,
+	SPTHV_BENCH_WRMSR,
+	SPTHV_BENCH_VMCALL,
+	SPTHV_BENCH_IO,
+	SPTHV_BENCH_CR_ACCESS,
+	SPTHV_BENCH_HLT,
+	SPTHV_BENCH_VMCALL_XSTATE,		// A VMCALL whose handler saves (and restores) the guest's AVX state; the slow path, against SPTHV_BENCH_VMCALL
+	SPTHV_BENCH_EXIT_COUNT
+} SPTHV_BENCH_EXIT;
+
+// A latency distribution, in TSC ticks
+typedef struct _SPTHV_LATENCY_SUMMARY
+{
+	ULONG64 Count;
+	ULONG64 Min;
+	ULONG64 Median;
+	ULONG64 P99;
+	ULONG64 Max;
+	ULONG64 Mean;
+} SPTHV_LATENCY_SUMMARY, *PSPTHV_LATENCY_SUMMARY;
+
+typedef struct _SPTHV_EXIT_BENCHMARK_REQUEST
+{
+	ULONG Iterations;
+} SPTHV_EXIT_BENCHMARK_REQUEST, *PSPTHV_EXIT_BENCHMARK_REQUEST;
+
+typedef struct _SPTHV_EXIT_BENCH_RESULT
+{
+	ULONG BasicExitReason;	// [Appendix C] "VMX Basic Exit Reasons"
+	ULONG Available;		// 0 if this exit can't be caused on this processor (the controls it needs are missing)
+	SPTHV_LATENCY_SUMMARY Latency;
+} SPTHV_EXIT_BENCH_RESULT, *PSPTHV_EXIT_BENCH_RESULT;
+
+typedef struct _SPTHV_EXIT_BENCHMARK
+{
+	ULONG Iterations;
+	ULONG Processor;
+	SPTHV_EXIT_BENCH_RESULT Results[SPTHV_BENCH_EXIT_COUNT];
+} SPTHV_EXIT_BENCHMARK, *PSPTHV_EXIT_BENCHMARK;
+
+/*
+ * Trace rings (see "Trace.c")
+ *
+ *  Every LP has a ring of fixed-size records that its exit handler (the only producer) appends one record
+ *  per exit to, and that a single reader in user mode drains. Head and Tail count records, and never wrap;
+ *  the record a count refers to is Records[count % SPTHV_TRACE_RING_RECORDS].
+ *
+ *  The producer fills Records[Head % ...] and only then publishes it by advancing Head (a release store);
+ *  the reader copies out everything in [Tail, Head) and only then hands the slots back by advancing Tail.
+ *  A full ring (Head - Tail == SPTHV_TRACE_RING_RECORDS) never blocks the producer; the record is dropped,
+ *  and Overruns counts it.
+ *
+ *  Each side's index lives on its own cache line, so neither side's writes invalidate the line the other
+ *  one writes to.
+ */
+#define SPTHV_TRACE_RING_RECORDS			4096	// Has to be a power of two
+
+typedef struct _SPTHV_TRACE_RECORD
+{
+	ULONG64 Tsc;			// When the exit reached the handler
+	ULONG64 Qualification;
+	ULONG64 GuestRip;
+	ULONG ExitReason;		// [24.9.1] "Basic VM-Exit Information", the full field
+	ULONG Reserved;
+} SPTHV_TRACE_RECORD, *PSPTHV_TRACE_RECORD;
+
+typedef struct _SPTHV_TRACE_RING
+{
+	// Written only by the producer
+	volatile ULONG64 Head;
+	volatile ULONG64 Overruns;
+	ULONG64 ProducerReserved[6];
+
+	// Written only by the reader
+	volatile ULONG64 Tail;
+	ULONG64 ReaderReserved[7];
+
+	SPTHV_TRACE_RECORD Records[SPTHV_TRACE_RING_RECORDS];
+} SPTHV_TRACE_RING, *PSPTHV_TRACE_RING;
+
+// Where the rings were mapped; LP i's ring is at Base + i * RingStride
+typedef struct _SPTHV_TRACE_MAPPING
+{
+	ULONG64 Base;
+	ULONG RingCount;
+	ULONG RingStride;
+} SPTHV_TRACE_MAPPING, *PSPTHV_TRACE_MAPPING;
+
+/*
+ * Exit counters (see StatsRecordExit in "Stats.c")
+ *
+ *  Every LP counts its own exits, per basic exit reason, along with how long each took from the exit
+ *  handler being entered to the guest being resumed (in TSC ticks). Histogram bucket i counts the exits
+ *  that took [2^i, 2^(i + 1)) ticks; bucket 0 also takes those that took none, and the last bucket takes
+ *  everything past it.
+ */
+#define SPTHV_EXIT_REASON_COUNT				69		// [Appendix C] "VMX Basic Exit Reasons", 0 - 68
+#define SPTHV_EXIT_HISTOGRAM_BUCKETS		32
+
+typedef struct _SPTHV_EXIT_REASON_STATS
+{
+	ULONG64 Count;
+	ULONG64 TotalCycles;
+	ULONG64 MinCycles;		// 0 if Count is
+	ULONG64 MaxCycles;
+	ULONG64 Histogram[SPTHV_EXIT_HISTOGRAM_BUCKETS];
+} SPTHV_EXIT_REASON_STATS, *PSPTHV_EXIT_REASON_STATS;
+
+// Every LP's counters, merged; each LP keeps counting while this is taken, so it's only ever approximately consistent
+typedef struct _SPTHV_EXIT_STATS
+{
+	ULONG ProcessorCount;	// The number of LPs merged
+	ULONG Reserved;
+	SPTHV_EXIT_REASON_STATS Reasons[SPTHV_EXIT_REASON_COUNT];
+} SPTHV_EXIT_STATS, *PSPTHV_EXIT_STATS;
+
+/*
+ * Guest profiles (see "Profile.c")
+ *
+ *  While sampling, every LP takes a VMX-preemption timer exit at (roughly) the requested rate of guest
+ *  time, and counts the guest's RIP, CR3 and mode into a hash table of its own. Only the RIP is sampled;
+ *  the guest's stack isn't walked.
+ */
+#define SPTHV_PROFILE_DEFAULT_FREQUENCY		1000	// Samples per second, per LP
+#define SPTHV_PROFILE_MAX_FREQUENCY			100000
+
+#define SPTHV_PROFILE_TABLE_ENTRIES			4096	// Has to be a power of two
+
+// SPTHV_PROFILE_ENTRY.Mode; the guest's CPL, along with whether it was running 32-bit code
+#define SPTHV_PROFILE_MODE_CPL_MASK			0x3
+#define SPTHV_PROFILE_MODE_COMPATIBILITY	0x4
+
+typedef struct _SPTHV_PROFILE_REQUEST
+{
+	ULONG Frequency;
+} SPTHV_PROFILE_REQUEST, *PSPTHV_PROFILE_REQUEST;
+
+typedef struct _SPTHV_PROFILE_QUERY
+{
+	ULONG Processor;
+} SPTHV_PROFILE_QUERY, *PSPTHV_PROFILE_QUERY;
+
+// An entry is unused while its Count is 0
+typedef struct _SPTHV_PROFILE_ENTRY
+{
+	ULONG64 Rip;
+	ULONG64 Cr3;			// Without the PCID (or flag) bits
+	ULONG64 Count;
+	ULONG Mode;
+	ULONG Reserved;
+} SPTHV_PROFILE_ENTRY, *PSPTHV_PROFILE_ENTRY;
+
+typedef struct _SPTHV_PROFILE_TABLE
+{
+	ULONG Processor;
+	ULONG ProcessorCount;
+	ULONG Used;				// Entries in use
+	ULONG Period;			// In preemption timer ticks
+	ULONG64 Samples;		// Every sample counted in Entries
+	ULONG64 Dropped;		// Samples with no room left for them
+	SPTHV_PROFILE_ENTRY Entries[SPTHV_PROFILE_TABLE_ENTRIES];
+} SPTHV_PROFILE_TABLE, *PSPTHV_PROFILE_TABLE;
+
+/*
+ * Dirty-page tracking (see "PML.c")
+ *
+ *  One bit per 4KB guest-physical page of RAM; a page written to through a 2MB or 1GB mapping dirties every
+ *  page of it. Ranges are harvested a bitmap word at a time, so they start (and are sized) in multiples of
+ *  SPTHV_DIRTY_PAGES_PER_WORD pages.
+ */
+#define SPTHV_DIRTY_PAGES_PER_WORD			64
+
+// The output buffer a harvest of PageCount pages needs
+#define SPTHV_DIRTY_BITMAP_SIZE(PageCount)	(FIELD_OFFSET( SPTHV_DIRTY_BITMAP, Bits ) + ((PageCount) / SPTHV_DIRTY_PAGES_PER_WORD) * sizeof(ULONG64))
+
+typedef struct _SPTHV_DIRTY_QUERY
+{
+	ULONG64 FirstPage;
+	ULONG64 PageCount;		// At most as many as the output buffer has room for
+} SPTHV_DIRTY_QUERY, *PSPTHV_DIRTY_QUERY;
+
+typedef struct _SPTHV_DIRTY_BITMAP
+{
+	ULONG64 FirstPage;
+	ULONG64 PageCount;
+	ULONG64 TrackedPages;	// Pages at or above this are never dirty
+	ULONG64 DirtyPages;		// The bits set in Bits
+	ULONG64 Bits[ANYSIZE_ARRAY];	// Bit n of word w is page FirstPage + w * SPTHV_DIRTY_PAGES_PER_WORD + n
+} SPTHV_DIRTY_BITMAP, *PSPTHV_DIRTY_BITMAP;
+
+/*
+ * Guest TSC (see "TSC.c")
+ *
+ *  RDTSC and RDTSCP never exit; the guest reads ((TSC * Multiplier) >> 48) + Offset, where the multiplier is
+ *  a 16.48 fixed-point ratio of the guest's TSC rate to the processor's.
+ */
+typedef struct _SPTHV_TSC_REQUEST
+{
+	ULONG64 Frequency;		// In Hz; 0 for the processor's own
+	ULONG64 Advance;		// Guest ticks to move the TSC forward by
+} SPTHV_TSC_REQUEST, *PSPTHV_TSC_REQUEST;
+
+typedef struct _SPTHV_TSC_QUERY
+{
+	ULONG Processor;
+} SPTHV_TSC_QUERY, *PSPTHV_TSC_QUERY;
+
+typedef struct _SPTHV_TSC_STATE
+{
+	ULONG Processor;
+	ULONG ProcessorCount;
+	BOOLEAN OffsettingEnabled;
+	BOOLEAN ScalingEnabled;
+	UCHAR Reserved[6];
+	ULONG64 HostFrequency;
+	ULONG64 GuestFrequency;
+	ULONG64 Multiplier;
+	ULONG64 Offset;
+	ULONG64 HostTsc;		// The processor's TSC when the query was made
+	ULONG64 GuestTsc;		// What the guest would have read on Processor at that moment
+} SPTHV_TSC_STATE, *PSPTHV_TSC_STATE;
+
+/*
+ * Intercepts (see "Intercept.c")
+ *
+ *  An intercepted access exits, and the exit handler carries it out just as the guest asked; all it costs the
+ *  guest is the exit, which is counted (and traced) like any other. MSR ranges have to lie within one of the two
+ *  ranges the MSR bitmap covers (00000000H - 00001FFFH and C0000000H - C0001FFFH), and may not include an MSR
+ *  whose guest value lives in the VMCS rather than in the processor (such as IA32_EFER or IA32_FS_BASE). Port
+ *  ranges may be anywhere in 0000H - FFFFH, but only take effect if the processor has I/O bitmaps.
+ */
+#define SPTHV_MSR_INTERCEPT_READ			0x1
+#define SPTHV_MSR_INTERCEPT_WRITE			0x2
+
+typedef struct _SPTHV_MSR_INTERCEPT_REQUEST
+{
+	ULONG FirstMsr;
+	ULONG LastMsr;
+	ULONG Accesses;			// SPTHV_MSR_INTERCEPT_*
+	BOOLEAN Intercept;		// FALSE to stop intercepting them
+	UCHAR Reserved[3];
+} SPTHV_MSR_INTERCEPT_REQUEST, *PSPTHV_MSR_INTERCEPT_REQUEST;
+
+typedef struct _SPTHV_IO_INTERCEPT_REQUEST
+{
+	ULONG FirstPort;
+	ULONG LastPort;
+	BOOLEAN Intercept;		// FALSE to stop intercepting them
+	UCHAR Reserved[3];
+} SPTHV_IO_INTERCEPT_REQUEST, *PSPTHV_IO_INTERCEPT_REQUEST;
+
+/*
+ * EPT views (see "VMFunc.c")
+ *
+ *  Every LP starts out in view 0, the identity map of guest-physical memory. If the processor has EPTP switching,
+ *  views 1 - 3 start out as copies of it, and the guest switches between those in the list with VMFUNC (leaf 0,
+ *  ECX = the view), without an exit. A page's permissions are set in one view at a time. A page can't be writable
+ *  without being readable, nor execute-only unless the processor supports it. View 0 is always in the list; an
+ *  LP in a view taken out of it is put back in view 0.
+ */
+#define SPTHV_VIEW_READ						0x1
+#define SPTHV_VIEW_WRITE					0x2
+#define SPTHV_VIEW_EXECUTE					0x4
+
+typedef struct _SPTHV_VIEW_PAGE_REQUEST
+{
+	ULONG64 GuestPA;		// Any address in the 4KB page
+	ULONG View;
+	ULONG Access;			// SPTHV_VIEW_*; 0 for none at all
+} SPTHV_VIEW_PAGE_REQUEST, *PSPTHV_VIEW_PAGE_REQUEST;
+
+typedef struct _SPTHV_VIEW_REQUEST
+{
+	ULONG View;
+	BOOLEAN Enable;			// FALSE to take it out of the list
+	UCHAR Reserved[3];
+} SPTHV_VIEW_REQUEST, *PSPTHV_VIEW_REQUEST;
+
+/*
+ * Virtualization exceptions (see "VE.c")
+ *
+ *  A page is watched by taking away the accesses to watch for in a view other than view 0 (see SPTHV_VIEW_PAGE_REQUEST),
+ *  and making it convertible there. While #VEs are started, each of those accesses is a #VE in the guest instead of
+ *  an exit; the guest's handler has to let the access through (by switching views, say).
+ */
+typedef struct _SPTHV_VE_CONVERTIBLE_REQUEST
+{
+	ULONG64 GuestPA;		// Any address in the 4KB page
+	ULONG View;
+	BOOLEAN Convertible;	// FALSE to have the accesses exit again
+	UCHAR Reserved[3];
+} SPTHV_VE_CONVERTIBLE_REQUEST, *PSPTHV_VE_CONVERTIBLE_REQUEST;
+
+#endif // __SPTHV_IOCTL_H__
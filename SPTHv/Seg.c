@@ -6,119 +6,167 @@
  * Get the GDT base via `r gdtr`
  * Get the GDT limit via `r gdtl`
  * Get a full list of the segments in the GDT via `dg 0 <value in gdtl>`
- *  At this point you can match up that the `__segmentbase` and `ReadAR` functions
- *  perform the actions they claim to
+ *  At this point you can match up that the table built by `SegDecodeGDT` (and the values
+ *  returned by `SegLookup`) match the descriptors the debugger shows
+ *
+ * SegDecodeGDT only reads the GDT image it's handed (it doesn't execute SGDT, LAR or LSL itself),
+ *  so it can just as well be pointed at a synthetic GDT
  */
 
-UINT64
-__segmentbase(
-    _In_ CONST UINT16 selector
+SEG_ACCESS_RIGHTS
+_DecodeAccessRights(
+    _In_ CONST SEG_DESC Descriptor
     )
 {
-    UINT64 baseAddress = 0;
-    SYSTEM_TABLE_REGISTER gdtr = { 0 };
+    /*
+     * The access rights in the VMCS are the same bits LAR returns (descriptor bits 40-55, [24.4.1] "Guest Register State",
+     *  Table 24-2), less the upper limit bits (48-51); which land in the reserved bits 8-11
+     */
 
-    PSEG_DESC pGDT;
-    PSEG_DESC pGDTE;
-    PSYS_SEG_DESC pGDTE64;
-    SEG_SEL segmentSelector;
+    SEG_ACCESS_RIGHTS ar;
 
-    __sgdt(&gdtr);
+    ar.All = (UINT32)(Descriptor.All >> 40) & 0xF0FF;
 
-    pGDT = (PSEG_DESC)gdtr.Base;
+    // A descriptor which isn't present can't be loaded, so the segment register can't be holding it ([3.4.5] "Segment Descriptors")
+    ar.Unusable = (Descriptor.Present == 0);
 
-    segmentSelector.All = selector;
+    return ar;
+}
 
-    // Why lookup null entries if we don't have to
-    //    (The Windows 10 kernel LDT null, so this will filter out LDT entries creating a potentially superfluous check on L55)
-    if ( segmentSelector.Index == 0 )
+UINT32
+_DecodeLimit(
+    _In_ CONST SEG_DESC Descriptor
+    )
+{
+    // The same byte-granular limit LSL returns ([3.4.5] "Segment Descriptors")
+
+    UINT32 limit = (UINT32)((Descriptor.Limit2 << 16) | Descriptor.Limit);
+
+    if ( Descriptor.Granularity == 1 )
     {
-        return 0;
+        limit = (limit << 12) | 0xFFF;
     }
 
-    pGDTE = &pGDT[segmentSelector.Index];
-
-    // Compose the 32-bit base address, which is split into two parts
-    baseAddress = (pGDTE->Base2 << 24) | pGDTE->Base;
+    return limit;
+}
 
+ULONG
+SegDecodeGDT(
+    _In_reads_bytes_(Limit + 1) CONST VOID* GDT,
+    _In_ CONST UINT16 Limit,
+    _Out_writes_(MaxEntries) PSEGMENT_INFO Table,
+    _In_ CONST ULONG MaxEntries
+    )
+{
     /*
-     * Check if this entry is a system entry (double the size, and has more information)
-     *    Note: others say to ignore LDT entries, or to only account for TSS entries; but I have found no reason
-     *    as for why we should do that in the SDM, so I'm leaving this superflous check
-     *    on the GDTE type here until further notice. If you're reading this comment, it means I was either right, or
-     *    we have a bad error in the VMCS logic that will potentially cause bugs later :^)
+     * Decode every descriptor in the GDT, in a single pass, into a table indexed by selector index.
+     *  Returns the number of entries in the table.
+     *
+     *  Entries which can't be loaded into a segment register (the null descriptor, the upper halves of
+     *  system descriptors, and anything not present) are marked unusable.
      */
 
-    // If this is a system segment descriptor, and it's for either a TSS or LDT, we obtain the full 64-bit base address
-    if ( pGDTE->DescType == DESCRIPTOR_TYPE_SYSTEM
-        && ((pGDTE->Type == SYS_SEG_DESC_TYPE_TSS_BUSY || pGDTE->Type == SYS_SEG_DESC_TYPE_TSS_AVAILABLE)
-        || pGDTE->Type == SYS_SEG_DESC_TYPE_LDT) )
+    CONST SEG_DESC* pGDT = (CONST SEG_DESC*)GDT;
+    CONST SYS_SEG_DESC* pGDTE64;
+    ULONG nEntries;
+    ULONG i;
+
+    // The limit is the offset of the last valid byte ([3.5.1] "Segment Descriptor Tables")
+    nEntries = min( ((ULONG)Limit + 1) / sizeof(SEG_DESC), MaxEntries );
+
+    for ( i = 0; i < nEntries; i++ )
     {
+        Table[i].Base = ((UINT64)pGDT[i].Base2 << 24) | pGDT[i].Base;
+        Table[i].Limit = _DecodeLimit( pGDT[i] );
+        Table[i].AccessRights = _DecodeAccessRights( pGDT[i] );
+
         /*
-         *  In IA-32e mode, there are two types of system descriptors: system-segment descriptors and gate descriptors.[0]
-         *  System descriptors point to system segments, such as the LDT and TSS, while gate descriptors hold pointers to 
-         *  entry points in code segments, such as call, interrupt, and trap gates.
-         *
-         *  Both the LDT and TSS have the same expanded structural definition[1], and they are the only two system segment
-         *  descriptors we will ever encounter; as we only obtain the bases for CS/SS/DS/ES/FS/GS/LDTR/TR
-         *  (see setting of VMCS guest/host state areas in "Driver.c").
-         *
-         *  [0]: [3.5] "System Descriptor Types"
-         *    [1]: [7.2.3] "TSS Descriptor in 64-bit Mode"
-        */
-
-        // Obtain the 64-bit system segment descriptor
-        pGDTE64 = (PSYS_SEG_DESC)pGDTE;
-
-        // Compose the final 64-bit base address (if necessary)
-        //  by adding the third extension to the base address
-        baseAddress |= ((UINT64)pGDTE64->Base3 << 32);
+         * "The first entry of the GDT is not used by the processor. A segment that points to this entry of
+         *  the GDT ... is used as a 'null segment selector'" ([3.4.2] "Segment Selectors")
+         */
+        if ( i == 0 )
+        {
+            Table[i].Base = 0;
+            Table[i].AccessRights.All = 0;
+            Table[i].AccessRights.Unusable = TRUE;
+            continue;
+        }
+
+        // Code and data descriptors are 8 bytes, and only have a 32-bit base
+        if ( pGDT[i].DescType == DESCRIPTOR_TYPE_CODE_DATA || pGDT[i].Type == 0 )
+        {
+            continue;
+        }
+
+        /*
+         * In IA-32e mode, every system descriptor in the GDT is 16 bytes ([3.5] "System Descriptor Types"); the second
+         *  half of which isn't a descriptor in its own right. Only the LDT and TSS descriptors hold a base address
+         *  (call gates hold an entry point instead, [7.2.3] "TSS Descriptor in 64-bit Mode")
+         */
+        if ( i + 1 >= ((ULONG)Limit + 1) / sizeof(SEG_DESC) )
+        {
+            // The upper half is past the end of the GDT; nothing can load this
+            Table[i].AccessRights.Unusable = TRUE;
+            continue;
+        }
+
+        pGDTE64 = (CONST SYS_SEG_DESC*)&pGDT[i];
+
+        if ( pGDT[i].Type == SYS_SEG_DESC_TYPE_TSS_BUSY
+            || pGDT[i].Type == SYS_SEG_DESC_TYPE_TSS_AVAILABLE
+            || pGDT[i].Type == SYS_SEG_DESC_TYPE_LDT )
+        {
+            Table[i].Base |= ((UINT64)pGDTE64->Base3 << 32);
+        }
+
+        // Skip (and mark unusable) the upper half
+        if ( i + 1 < nEntries )
+        {
+            i++;
+
+            Table[i].Base = 0;
+            Table[i].Limit = 0;
+            Table[i].AccessRights.All = 0;
+            Table[i].AccessRights.Unusable = TRUE;
+        }
     }
 
-    return baseAddress;
+    return nEntries;
 }
 
-SEG_ACCESS_RIGHTS
-ReadAR(
-    _In_ CONST UINT16 selector
+VOID
+SegLookup(
+    _In_reads_(Count) CONST SEGMENT_INFO* Table,
+    _In_ CONST ULONG Count,
+    _In_ CONST UINT16 Selector,
+    _Out_ PSEGMENT_INFO Info
     )
 {
     // [3.2] "Using Segments"
 
-    SEG_ACCESS_RIGHTS ar;
+    SEG_SEL segmentSelector;
+
+    segmentSelector.All = Selector;
 
     /*
      *  [Access rights] "Bit 16 indicates an unusable segment ... a segment
      *  register is unusable if it has been loaded with a null selector." [0]
      *
-     *  "The first entry of the GDT is not used by the processor. A segment
-     *  that points to this entry of the GDT (that is, a segment selector with
-     *  an index of 0 and the TI flag set to 0) is used as a 'null segment selector'"[1]
+     *  The kernel segments won't ever index via the LDT (TI is always zero), so anything with the TI bit set
+     *  (or an index past the end of our table) is treated the same way as a null selector.
      *
      *  [0]: [24.4.1] "Guest Register State"
-     *  [1]: [3.4.2] "Segment Selectors"
      */
-    if ( selector == 0 )
-    {
-        /*
-         *  We get here because the kernel segments won't ever index via the LDT (always zero), which means the TI
-         *  bits will always be zero (indicating a GDT index), the RPL bits will always be zero, and the index being
-         *  clear signifies a null segment selector; which should be indicated via setting the unusable bit
-         */
-        ar.All = 0;
-        ar.Unusable = TRUE;
-    }
-    else
+    if ( segmentSelector.Index == 0 || segmentSelector.TI == 1 || segmentSelector.Index >= Count )
     {
-        // This will simply execute a `LAR` instruction with the provided selector
-        ar = __readar(selector);
-
-        ar.Unusable = FALSE;
-        ar.Reserved0 = 0;
-        ar.Reserved1 = 0;
+        Info->Base = 0;
+        Info->Limit = 0;
+        Info->AccessRights.All = 0;
+        Info->AccessRights.Unusable = TRUE;
+        return;
     }
 
-    return ar;
+    *Info = Table[segmentSelector.Index];
 
     // See also [26.3.2.2] "Loading Guest Segment Registers and Descriptor-Table Registers"
 }
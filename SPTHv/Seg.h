@@ -100,6 +100,21 @@ typedef struct _SYSTEM_TABLE_REGISTER
 #pragma warning(pop)
 
 
+// Everything the VMCS needs to know about a segment, decoded from its descriptor (see SegDecodeGDT)
+typedef struct _SEGMENT_INFO
+{
+    UINT64 Base;
+    UINT32 Limit;
+    SEG_ACCESS_RIGHTS AccessRights;
+} SEGMENT_INFO, *PSEGMENT_INFO;
+
+/*
+ * The number of GDT entries we decode, which is plenty for Windows (its GDT is 0x80 bytes, or 16 entries);
+ *  selectors beyond this are reported as unusable
+ */
+#define SEGMENT_TABLE_MAX_ENTRIES           32
+
+
 
 //
 // External segment intrinsic functions (see "Seg.asm")
@@ -132,15 +147,20 @@ extern SEG_ACCESS_RIGHTS __readar(
 // Local functions
 //
 
-SEG_ACCESS_RIGHTS
-ReadAR(
-    _In_ CONST UINT16 selector
+ULONG
+SegDecodeGDT(
+    _In_reads_bytes_(Limit + 1) CONST VOID* GDT,
+    _In_ CONST UINT16 Limit,
+    _Out_writes_(MaxEntries) PSEGMENT_INFO Table,
+    _In_ CONST ULONG MaxEntries
     );
 
-// Seg.c
-UINT64
-__segmentbase(
-    _In_ CONST UINT16 selector
+VOID
+SegLookup(
+    _In_reads_(Count) CONST SEGMENT_INFO* Table,
+    _In_ CONST ULONG Count,
+    _In_ CONST UINT16 Selector,
+    _Out_ PSEGMENT_INFO Info
     );
 
 #endif // __SEG_H__
@@ -0,0 +1,204 @@
+#include "State.h"
+
+/*
+ * Notes for testing:
+ *
+ * The VMCS guest and host state areas are programmed in three steps: StateCapture reads everything
+ *  we need from the LP (once; the GDT is decoded in a single pass, see SegDecodeGDT in "Seg.c"),
+ *  StateBuildVMCSFields turns that snapshot into a list of field/value pairs using the table below,
+ *  and StateCommitVMCSFields writes that list to the current VMCS.
+ *
+ * StateBuildVMCSFields doesn't touch the processor, so its output can be compared against a
+ *  known-good VMCS; `dt SPTHv!_VMCS_FIELD_VALUE <LPInfo->VMCSFields> -a65` dumps the list it built
+ */
+
+#define STATE_FIELD(encoding, member, flags) \
+    { encoding, (UINT16)FIELD_OFFSET(CPU_STATE, member), (UINT8)RTL_FIELD_SIZE(CPU_STATE, member), flags }
+
+#define STATE_SEGMENT_FIELDS(prefix, segment) \
+    STATE_FIELD( VMCS_GUEST_##prefix##_SELECTOR, Segments[segment].Selector, 0 ), \
+    STATE_FIELD( VMCS_GUEST_##prefix##_BASE, Segments[segment].Base, 0 ), \
+    STATE_FIELD( VMCS_GUEST_##prefix##_LIMIT, Segments[segment].Limit, 0 ), \
+    STATE_FIELD( VMCS_GUEST_##prefix##_ACCESS_RIGHTS, Segments[segment].AccessRights, 0 )
+
+// Every guest and host state field we program, and where its value comes from
+CONST VMCS_FIELD_DESCRIPTOR g_VMCSStateFields[STATE_VMCS_FIELD_COUNT] = {
+    // [24.4.1] "Guest Register State"
+    //    (Note: the guest is this very LP, carrying on from where it was before; which means the guest
+    //    RSP and RIP can only be set from within VMLaunchLP, see "vmexit.asm")
+    STATE_FIELD( VMCS_GUEST_CR0, CR0, 0 ),
+    STATE_FIELD( VMCS_GUEST_CR3, CR3, 0 ),
+    STATE_FIELD( VMCS_GUEST_CR4, CR4, 0 ),
+    STATE_FIELD( VMCS_GUEST_DR7, DR7, 0 ),
+    STATE_FIELD( VMCS_GUEST_RFLAGS, RFLAGS, 0 ),
+
+    STATE_SEGMENT_FIELDS( ES, SEGMENT_ES ),
+    STATE_SEGMENT_FIELDS( CS, SEGMENT_CS ),
+    STATE_SEGMENT_FIELDS( SS, SEGMENT_SS ),
+    STATE_SEGMENT_FIELDS( DS, SEGMENT_DS ),
+    STATE_SEGMENT_FIELDS( FS, SEGMENT_FS ),
+    STATE_SEGMENT_FIELDS( GS, SEGMENT_GS ),
+    STATE_SEGMENT_FIELDS( LDTR, SEGMENT_LDTR ),
+    STATE_SEGMENT_FIELDS( TR, SEGMENT_TR ),
+
+    STATE_FIELD( VMCS_GUEST_GDTR_BASE, GDTR.Base, 0 ),
+    STATE_FIELD( VMCS_GUEST_GDTR_LIMIT, GDTR.Limit, 0 ),
+    STATE_FIELD( VMCS_GUEST_IDTR_BASE, IDTR.Base, 0 ),
+    STATE_FIELD( VMCS_GUEST_IDTR_LIMIT, IDTR.Limit, 0 ),
+
+    STATE_FIELD( VMCS_GUEST_IA32_DEBUGCTL_FULL, DebugCtl, 0 ),
+    STATE_FIELD( VMCS_GUEST_IA32_SYSENTER_CS, SysenterCS, 0 ),
+    STATE_FIELD( VMCS_GUEST_IA32_SYSENTER_ESP, SysenterESP, 0 ),
+    STATE_FIELD( VMCS_GUEST_IA32_SYSENTER_EIP, SysenterEIP, 0 ),
+
+    // [24.5] "Host-State Area"
+    STATE_FIELD( VMCS_HOST_CR0, CR0, 0 ),
+    STATE_FIELD( VMCS_HOST_CR3, HostCR3, 0 ),
+    STATE_FIELD( VMCS_HOST_CR4, CR4, 0 ),
+
+    STATE_FIELD( VMCS_HOST_RSP, HostRSP, 0 ),
+    STATE_FIELD( VMCS_HOST_RIP, HostRIP, 0 ),
+
+    STATE_FIELD( VMCS_HOST_ES_SELECTOR, Segments[SEGMENT_ES].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_CS_SELECTOR, Segments[SEGMENT_CS].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_SS_SELECTOR, Segments[SEGMENT_SS].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_DS_SELECTOR, Segments[SEGMENT_DS].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_FS_SELECTOR, Segments[SEGMENT_FS].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_GS_SELECTOR, Segments[SEGMENT_GS].Selector, STATE_FIELD_HOST_SELECTOR ),
+    STATE_FIELD( VMCS_HOST_TR_SELECTOR, Segments[SEGMENT_TR].Selector, STATE_FIELD_HOST_SELECTOR ),
+
+    STATE_FIELD( VMCS_HOST_FS_BASE, Segments[SEGMENT_FS].Base, 0 ),
+    STATE_FIELD( VMCS_HOST_GS_BASE, Segments[SEGMENT_GS].Base, 0 ),
+    STATE_FIELD( VMCS_HOST_TR_BASE, Segments[SEGMENT_TR].Base, 0 ),
+    STATE_FIELD( VMCS_HOST_GDTR_BASE, GDTR.Base, 0 ),
+    STATE_FIELD( VMCS_HOST_IDTR_BASE, IDTR.Base, 0 ),
+
+    STATE_FIELD( VMCS_HOST_IA32_SYSENTER_CS, SysenterCS, 0 ),
+    STATE_FIELD( VMCS_HOST_IA32_SYSENTER_ESP, SysenterESP, 0 ),
+    STATE_FIELD( VMCS_HOST_IA32_SYSENTER_EIP, SysenterEIP, 0 ),
+};
+
+VOID
+StateCapture(
+    _Out_ PCPU_STATE State
+    )
+{
+    // Note: this must be called after the control registers are fixed for VMX operation, as the host runs with those values
+
+    SEGMENT_INFO gdtTable[SEGMENT_TABLE_MAX_ENTRIES];
+    SEGMENT_INFO segmentInfo;
+    ULONG nGDTEntries;
+    ULONG i;
+
+    RtlSecureZeroMemory( State, sizeof(CPU_STATE) );
+
+    State->CR0 = __readcr0();
+    State->CR3 = __readcr3();
+    State->CR4 = __readcr4();
+    State->DR7 = __readdr(7);
+    State->RFLAGS = __readeflags();
+
+    State->Segments[SEGMENT_ES].Selector = __reades();
+    State->Segments[SEGMENT_CS].Selector = __readcs();
+    State->Segments[SEGMENT_SS].Selector = __readss();
+    State->Segments[SEGMENT_DS].Selector = __readds();
+    State->Segments[SEGMENT_FS].Selector = __readfs();
+    State->Segments[SEGMENT_GS].Selector = __readgs();
+    State->Segments[SEGMENT_LDTR].Selector = __readldtr();
+    State->Segments[SEGMENT_TR].Selector = __readtr();
+
+    __sgdt( &State->GDTR );
+    __sidt( &State->IDTR );
+
+    // Decode the whole GDT once, and look each of our selectors up in it
+    nGDTEntries = SegDecodeGDT( (CONST VOID*)State->GDTR.Base, State->GDTR.Limit, gdtTable, SEGMENT_TABLE_MAX_ENTRIES );
+
+    for ( i = 0; i < SEGMENT_COUNT; i++ )
+    {
+        SegLookup( gdtTable, nGDTEntries, State->Segments[i].Selector, &segmentInfo );
+
+        State->Segments[i].Base = segmentInfo.Base;
+        State->Segments[i].Limit = segmentInfo.Limit;
+        State->Segments[i].AccessRights = segmentInfo.AccessRights;
+    }
+
+    // The FS and GS bases in the GDT are only the lower 32 bits; the real ones live in MSRs ([3.4.4] "Segment Loading Instructions in IA-32e Mode")
+    State->Segments[SEGMENT_FS].Base = __readmsr( IA32_FS_BASE );
+    State->Segments[SEGMENT_GS].Base = __readmsr( IA32_GS_BASE );
+
+    State->DebugCtl = __readmsr( IA32_DEBUGCTL );
+    State->SysenterCS = __readmsr( IA32_SYSENTER_CS );
+    State->SysenterESP = __readmsr( IA32_SYSENTER_ESP );
+    State->SysenterEIP = __readmsr( IA32_SYSENTER_EIP );
+}
+
+ULONG
+StateBuildVMCSFields(
+    _In_ CONST CPU_STATE* State,
+    _Out_writes_(STATE_VMCS_FIELD_COUNT) PVMCS_FIELD_VALUE Fields
+    )
+{
+    // Note: no processor state is read (or written) in here; everything comes from the snapshot
+
+    ULONG i;
+    CONST UINT8* source;
+    UINT64 value;
+
+    for ( i = 0; i < STATE_VMCS_FIELD_COUNT; i++ )
+    {
+        source = (CONST UINT8*)State + g_VMCSStateFields[i].Offset;
+
+        switch ( g_VMCSStateFields[i].Size )
+        {
+            case sizeof(UINT16):
+                value = *(CONST UINT16*)source;
+                break;
+            case sizeof(UINT32):
+                value = *(CONST UINT32*)source;
+                break;
+            default:
+                RtlCopyMemory( &value, source, sizeof(value) );
+                break;
+        }
+
+        if ( (g_VMCSStateFields[i].Flags & STATE_FIELD_HOST_SELECTOR) != 0 )
+        {
+            value &= SELECTOR_INDEX_MASK;
+        }
+
+        Fields[i].Encoding = g_VMCSStateFields[i].Encoding;
+        Fields[i].Value = value;
+    }
+
+    return STATE_VMCS_FIELD_COUNT;
+}
+
+VMX_STATUS_CODE
+StateCommitVMCSFields(
+    _In_reads_(Count) CONST VMCS_FIELD_VALUE* Fields,
+    _In_ CONST ULONG Count,
+    _Out_opt_ PULONG FailedIndex
+    )
+{
+    // Write every field to the current VMCS, stopping at the first one the processor rejects
+
+    ULONG i;
+    VMX_STATUS_CODE status;
+
+    for ( i = 0; i < Count; i++ )
+    {
+        status = __vmx_vmwrite( Fields[i].Encoding, Fields[i].Value );
+
+        if ( !VMX_SUCCESS( status ) )
+        {
+            if ( FailedIndex != NULL )
+            {
+                *FailedIndex = i;
+            }
+
+            return status;
+        }
+    }
+
+    return VMX_OK;
+}
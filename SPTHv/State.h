@@ -0,0 +1,114 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <ntifs.h>
+#include <intrin.h>
+
+#include "CPU.h"
+#include "MSR.h"
+#include "VMX.h"
+#include "VMCS.h"
+#include "Seg.h"
+
+// The segment registers, in the order the VMCS encodes them ([Appendix B] "Field Encoding in VMCS")
+typedef enum _SEGMENT_REGISTER
+{
+	SEGMENT_ES,
+	SEGMENT_CS,
+	SEGMENT_SS,
+	SEGMENT_DS,
+	SEGMENT_FS,
+	SEGMENT_GS,
+	SEGMENT_LDTR,
+	SEGMENT_TR,
+	SEGMENT_COUNT
+} SEGMENT_REGISTER;
+
+// Everything the VMCS needs to know about a segment register ([24.4.1] "Guest Register State")
+typedef struct _SEGMENT_STATE
+{
+	UINT16 Selector;
+	UINT64 Base;
+	UINT32 Limit;
+	SEG_ACCESS_RIGHTS AccessRights;
+} SEGMENT_STATE, *PSEGMENT_STATE;
+
+/*
+ * A snapshot of the current LP's state, captured once (see StateCapture), from which both the guest
+ *  and host state areas of the VMCS are built.
+ *
+ *  The host fields which don't come from the LP itself (its stack, entry point and address space) are
+ *  filled in by the caller before the VMCS fields are built.
+ */
+typedef struct _CPU_STATE
+{
+	UINT64 CR0;
+	UINT64 CR3;
+	UINT64 CR4;
+	UINT64 DR7;
+	UINT64 RFLAGS;
+
+	SEGMENT_STATE Segments[SEGMENT_COUNT];
+
+	SYSTEM_TABLE_REGISTER GDTR;
+	SYSTEM_TABLE_REGISTER IDTR;
+
+	UINT64 DebugCtl;
+	UINT64 SysenterCS;
+	UINT64 SysenterESP;
+	UINT64 SysenterEIP;
+
+	UINT64 HostCR3;
+	UINT64 HostRSP;
+	UINT64 HostRIP;
+} CPU_STATE, *PCPU_STATE;
+
+// VMCS_FIELD_DESCRIPTOR flags
+#define STATE_FIELD_HOST_SELECTOR			0x1		// Clear the RPL and TI bits ([26.2.3] "Checks on Host Segment and Descriptor-Table Registers")
+
+/*
+ * One VMCS field, and where in a CPU_STATE its value comes from; see g_VMCSStateFields in "State.c"
+ */
+typedef struct _VMCS_FIELD_DESCRIPTOR
+{
+	UINT32 Encoding;
+	UINT16 Offset;
+	UINT8 Size;
+	UINT8 Flags;
+} VMCS_FIELD_DESCRIPTOR, *PVMCS_FIELD_DESCRIPTOR;
+
+// A VMCS field, and the value to be written to it
+typedef struct _VMCS_FIELD_VALUE
+{
+	UINT64 Encoding;
+	UINT64 Value;
+} VMCS_FIELD_VALUE, *PVMCS_FIELD_VALUE;
+
+// The number of guest and host state fields we program (the size of g_VMCSStateFields)
+#define STATE_VMCS_FIELD_COUNT				65
+
+
+
+//
+// Local functions
+//
+
+VOID
+StateCapture(
+	_Out_ PCPU_STATE State
+	);
+
+ULONG
+StateBuildVMCSFields(
+	_In_ CONST CPU_STATE* State,
+	_Out_writes_(STATE_VMCS_FIELD_COUNT) PVMCS_FIELD_VALUE Fields
+	);
+
+VMX_STATUS_CODE
+StateCommitVMCSFields(
+	_In_reads_(Count) CONST VMCS_FIELD_VALUE* Fields,
+	_In_ CONST ULONG Count,
+	_Out_opt_ PULONG FailedIndex
+	);
+
+#endif // __STATE_H__
@@ -0,0 +1,223 @@
+#include "Stats.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches anything but the samples it's given (no allocations, no OS calls beyond
+ *  RtlSecureZeroMemory), so recorded samples can be fed straight into StatsSummarize.
+ *
+ * The same goes for the exit counters; an EXIT_STATS from anywhere can be recorded into with
+ *  StatsRecordExit, and merged into a zeroed SPTHV_EXIT_STATS with StatsMergeExits.
+ */
+
+VOID
+_SiftDown(
+    _Inout_ PUINT64 Samples,
+    _In_ SIZE_T Root,
+    _In_ CONST SIZE_T Count
+    )
+{
+    SIZE_T child;
+    UINT64 swap;
+
+    while ( (child = Root * 2 + 1) < Count )
+    {
+        if ( child + 1 < Count && Samples[child + 1] > Samples[child] )
+        {
+            child++;
+        }
+
+        if ( Samples[Root] >= Samples[child] )
+        {
+            return;
+        }
+
+        swap = Samples[Root];
+        Samples[Root] = Samples[child];
+        Samples[child] = swap;
+
+        Root = child;
+    }
+}
+
+VOID
+StatsSortSamples(
+    _Inout_updates_(Count) PUINT64 Samples,
+    _In_ CONST SIZE_T Count
+    )
+{
+    // Heapsort; in place, with no recursion, and no worse than O(n log n) (we may be at DISPATCH_LEVEL, on a small stack)
+
+    SIZE_T i;
+    UINT64 swap;
+
+    if ( Count < 2 )
+    {
+        return;
+    }
+
+    for ( i = Count / 2; i-- > 0; )
+    {
+        _SiftDown( Samples, i, Count );
+    }
+
+    for ( i = Count - 1; i > 0; i-- )
+    {
+        swap = Samples[0];
+        Samples[0] = Samples[i];
+        Samples[i] = swap;
+
+        _SiftDown( Samples, 0, i );
+    }
+}
+
+UINT64
+StatsPercentile(
+    _In_reads_(Count) CONST UINT64* SortedSamples,
+    _In_ CONST SIZE_T Count,
+    _In_ CONST ULONG Percentile
+    )
+{
+    // The nearest-rank percentile: the smallest sample at least Percentile% of all samples are less than or equal to
+
+    SIZE_T rank;
+
+    if ( Count == 0 )
+    {
+        return 0;
+    }
+
+    rank = (Count * min( Percentile, 100 ) + 99) / 100;
+
+    return SortedSamples[(rank == 0) ? 0 : rank - 1];
+}
+
+VOID
+StatsSummarize(
+    _Inout_updates_(Count) PUINT64 Samples,
+    _In_ CONST SIZE_T Count,
+    _Out_ PSPTHV_LATENCY_SUMMARY Summary
+    )
+{
+    // Summarize Samples (which are sorted in the process)
+
+    UINT64 total = 0;
+    SIZE_T i;
+
+    RtlSecureZeroMemory( Summary, sizeof(SPTHV_LATENCY_SUMMARY) );
+
+    if ( Count == 0 )
+    {
+        return;
+    }
+
+    StatsSortSamples( Samples, Count );
+
+    for ( i = 0; i < Count; i++ )
+    {
+        total += Samples[i];
+    }
+
+    Summary->Count = Count;
+    Summary->Min = Samples[0];
+    Summary->Median = StatsPercentile( Samples, Count, 50 );
+    Summary->P99 = StatsPercentile( Samples, Count, 99 );
+    Summary->Max = Samples[Count - 1];
+    Summary->Mean = total / Count;
+}
+
+ULONG
+StatsHistogramBucket(
+    _In_ CONST UINT64 Cycles
+    )
+{
+    // The log2 bucket Cycles falls in (see SPTHV_EXIT_HISTOGRAM_BUCKETS)
+
+    ULONG msb;
+
+    if ( _BitScanReverse64( &msb, Cycles ) == 0 )
+    {
+        return 0;
+    }
+
+    return (msb < SPTHV_EXIT_HISTOGRAM_BUCKETS) ? msb : (SPTHV_EXIT_HISTOGRAM_BUCKETS - 1);
+}
+
+VOID
+StatsRecordExit(
+    _Inout_ PEXIT_STATS Stats,
+    _In_ CONST ULONG Reason,
+    _In_ CONST UINT64 Cycles
+    )
+{
+    // Count one exit; only ever called by the LP that owns Stats, so there's nothing to synchronize with
+
+    PSPTHV_EXIT_REASON_STATS reason;
+
+    if ( Reason >= SPTHV_EXIT_REASON_COUNT )
+    {
+        return;
+    }
+
+    reason = &Stats->Reasons[Reason];
+
+    if ( reason->Count == 0 || Cycles < reason->MinCycles )
+    {
+        reason->MinCycles = Cycles;
+    }
+
+    if ( Cycles > reason->MaxCycles )
+    {
+        reason->MaxCycles = Cycles;
+    }
+
+    reason->Count++;
+    reason->TotalCycles += Cycles;
+    reason->Histogram[StatsHistogramBucket( Cycles )]++;
+}
+
+VOID
+StatsMergeExits(
+    _Inout_ PSPTHV_EXIT_STATS Snapshot,
+    _In_ CONST EXIT_STATS* Stats
+    )
+{
+    /*
+     * Add one LP's counters to Snapshot (which starts out zeroed). The LP may be counting while we read; each
+     *  counter is read whole (they're aligned 64-bit values), but they may not all be from the same moment.
+     */
+
+    ULONG i, j;
+
+    for ( i = 0; i < SPTHV_EXIT_REASON_COUNT; i++ )
+    {
+        CONST SPTHV_EXIT_REASON_STATS* from = &Stats->Reasons[i];
+        PSPTHV_EXIT_REASON_STATS to = &Snapshot->Reasons[i];
+        UINT64 count = from->Count;
+
+        if ( count == 0 )
+        {
+            continue;
+        }
+
+        if ( to->Count == 0 || from->MinCycles < to->MinCycles )
+        {
+            to->MinCycles = from->MinCycles;
+        }
+
+        if ( from->MaxCycles > to->MaxCycles )
+        {
+            to->MaxCycles = from->MaxCycles;
+        }
+
+        to->Count += count;
+        to->TotalCycles += from->TotalCycles;
+
+        for ( j = 0; j < SPTHV_EXIT_HISTOGRAM_BUCKETS; j++ )
+        {
+            to->Histogram[j] += from->Histogram[j];
+        }
+    }
+
+    Snapshot->ProcessorCount++;
+}
@@ -0,0 +1,58 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+
+// One LP's exit counters; cache-line aligned (and so sized), so that no two LPs ever write the same line
+typedef struct DECLSPEC_CACHEALIGN _EXIT_STATS
+{
+	SPTHV_EXIT_REASON_STATS Reasons[SPTHV_EXIT_REASON_COUNT];
+} EXIT_STATS, *PEXIT_STATS;
+
+
+//
+// Local functions
+//
+
+VOID
+StatsSortSamples(
+	_Inout_updates_(Count) PUINT64 Samples,
+	_In_ CONST SIZE_T Count
+	);
+
+UINT64
+StatsPercentile(
+	_In_reads_(Count) CONST UINT64* SortedSamples,
+	_In_ CONST SIZE_T Count,
+	_In_ CONST ULONG Percentile
+	);
+
+VOID
+StatsSummarize(
+	_Inout_updates_(Count) PUINT64 Samples,
+	_In_ CONST SIZE_T Count,
+	_Out_ PSPTHV_LATENCY_SUMMARY Summary
+	);
+
+ULONG
+StatsHistogramBucket(
+	_In_ CONST UINT64 Cycles
+	);
+
+VOID
+StatsRecordExit(
+	_Inout_ PEXIT_STATS Stats,
+	_In_ CONST ULONG Reason,
+	_In_ CONST UINT64 Cycles
+	);
+
+VOID
+StatsMergeExits(
+	_Inout_ PSPTHV_EXIT_STATS Snapshot,
+	_In_ CONST EXIT_STATS* Stats
+	);
+
+#endif // __STATS_H__
@@ -0,0 +1,162 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The multiplier and offset math lives in "TscMath.c"; everything in here is the calibration and bookkeeping.
+ *
+ * Every LP starts out with a multiplier of 1.0 and an offset of 0, so the guest sees the processor's own TSC.
+ *  A new policy is set with IOCTL_SPTHV_SET_TSC (see the `tsc` command of the SPTHvCtl tool); TscSetPolicy
+ *  works out one offset, from one reading of the TSC, and every LP takes that same offset, so their guest TSCs
+ *  read the same afterwards. The offset carries on from the furthest-along LP's guest TSC, so none of them jumps
+ *  backwards. The guest writing IA32_TIME_STAMP_COUNTER moves only that LP's offset, as a write would move only
+ *  that LP's TSC (until the next policy brings them back together).
+ */
+
+UINT64 g_TscHostFrequency;
+
+// The policy every LP was last given (see TscSetPolicy); only one change at a time
+FAST_MUTEX g_TscLock;
+UINT64 g_TscGuestFrequency;
+UINT64 g_TscMultiplier;
+
+UINT64
+TscMeasureFrequency()
+{
+    // Time the TSC against the performance counter (whose frequency we're told) for TSC_CALIBRATION_US
+
+    LARGE_INTEGER qpcFrequency, qpcStart, qpcEnd;
+    UINT64 tscStart, tscEnd;
+
+    qpcStart = KeQueryPerformanceCounter( &qpcFrequency );
+    tscStart = __rdtsc();
+
+    KeStallExecutionProcessor( TSC_CALIBRATION_US );
+
+    qpcEnd = KeQueryPerformanceCounter( NULL );
+    tscEnd = __rdtsc();
+
+    return ((tscEnd - tscStart) * (UINT64)qpcFrequency.QuadPart) / (UINT64)(qpcEnd.QuadPart - qpcStart.QuadPart);
+}
+
+VOID
+TscInitialize()
+{
+    ExInitializeFastMutex( &g_TscLock );
+
+    g_TscHostFrequency = TscMeasureFrequency();
+    g_TscGuestFrequency = g_TscHostFrequency;
+    g_TscMultiplier = TSC_MULTIPLIER_ONE;
+}
+
+ULONG_PTR
+_TscApplyLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; Argument is the offset every LP takes, along with g_TscMultiplier
+    GuestVmcall( HYPERCALL_TSC, g_TscMultiplier, Argument );
+
+    return 0;
+}
+
+NTSTATUS
+TscSetPolicy(
+    _In_ CONST UINT64 GuestFrequency,
+    _In_ CONST UINT64 Advance
+    )
+{
+    /*
+     * Have the guest's TSC run at GuestFrequency (0 for the processor's own rate) on every LP, after moving it
+     *  forward by Advance ticks. It's never moved back past what any LP's guest TSC reads as the policy is set.
+     */
+
+    UINT64 frequency = (GuestFrequency != 0) ? GuestFrequency : g_TscHostFrequency;
+    UINT64 multiplier = TSC_MULTIPLIER_ONE;
+    UINT64 hostTsc, offset, latest = 0;
+    ULONG i;
+
+    if ( g_VMXControls.Primary.TSCOffsetting == 0 )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ( frequency != g_TscHostFrequency )
+    {
+        // Any rate but the processor's own needs scaling ([24.6.2] "Processor-Based VM-Execution Controls")
+        if ( g_VMXControls.Secondary.UseTSCScaling == 0 )
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        multiplier = TscComputeMultiplier( frequency, g_TscHostFrequency );
+        if ( multiplier == 0 )
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    ExAcquireFastMutex( &g_TscLock );
+
+    // Rebase every LP's guest TSC at the same moment, and carry on from whichever one is furthest along; with the
+    //  same multiplier, the larger offset is the later guest TSC
+    //    (Note: an LP still runs on its old policy until the IPI gets there; slowing the TSC down can set it back
+    //     by the few ticks that takes, unless Advance covers them)
+    hostTsc = __rdtsc();
+
+    for ( i = 0; i < g_LPCount; i++ )
+    {
+        offset = TscRebase( hostTsc, g_LPInfo[i].TscMultiplier, g_LPInfo[i].TscOffset, multiplier );
+
+        if ( i == 0 || (INT64)(offset - latest) > 0 )
+        {
+            latest = offset;
+        }
+    }
+
+    g_TscGuestFrequency = frequency;
+    g_TscMultiplier = multiplier;
+
+    KeIpiGenericCall( _TscApplyLP, (ULONG_PTR)(latest + Advance) );
+
+    ExReleaseFastMutex( &g_TscLock );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TscQuery(
+    _In_ CONST ULONG Processor,
+    _Out_ PSPTHV_TSC_STATE State
+    )
+{
+    PLP_INFO lpInfo;
+
+    RtlSecureZeroMemory( State, sizeof(SPTHV_TSC_STATE) );
+
+    if ( Processor >= g_LPCount )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    lpInfo = &g_LPInfo[Processor];
+
+    ExAcquireFastMutex( &g_TscLock );
+
+    State->Processor = Processor;
+    State->ProcessorCount = g_LPCount;
+    State->OffsettingEnabled = (BOOLEAN)g_VMXControls.Primary.TSCOffsetting;
+    State->ScalingEnabled = (BOOLEAN)g_VMXControls.Secondary.UseTSCScaling;
+    State->HostFrequency = g_TscHostFrequency;
+    State->GuestFrequency = g_TscGuestFrequency;
+    State->Multiplier = lpInfo->TscMultiplier;
+    State->Offset = lpInfo->TscOffset;
+
+    // (Note: read on whichever LP we're running on, rather than on Processor; an invariant TSC reads the same on every LP)
+    State->HostTsc = __rdtsc();
+    State->GuestTsc = TscGuestValue( State->HostTsc, State->Multiplier, State->Offset );
+
+    ExReleaseFastMutex( &g_TscLock );
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#ifndef __TSC_H__
+#define __TSC_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+#include "TscMath.h"
+
+// How long the TSC is timed against the performance counter for, to find its frequency (in microseconds)
+#define TSC_CALIBRATION_US					10000
+
+
+
+//
+// Globals
+//
+
+// The processor's TSC frequency, in Hz (see TscInitialize)
+extern UINT64 g_TscHostFrequency;
+
+
+
+//
+// Local functions
+//
+
+UINT64
+TscMeasureFrequency();
+
+VOID
+TscInitialize();
+
+NTSTATUS
+TscSetPolicy(
+	_In_ CONST UINT64 GuestFrequency,
+	_In_ CONST UINT64 Advance
+	);
+
+NTSTATUS
+TscQuery(
+	_In_ CONST ULONG Processor,
+	_Out_ PSPTHV_TSC_STATE State
+	);
+
+#endif // __TSC_H__
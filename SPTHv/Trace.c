@@ -0,0 +1,220 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The rings themselves are written (and read) by "TraceRing.c", which has no part in the mapping; see
+ *  there, and the `trace` command of the SPTHvCtl tool for a reader.
+ *
+ * Every LP's ring lives in one nonpaged block, which is mapped into the reader's process on
+ *  IOCTL_SPTHV_MAP_TRACE (see "Device.c"); each LP_INFO points at its own (`TraceRing`). Nothing is
+ *  traced until a reader has the rings mapped.
+ */
+
+volatile LONG g_TraceEnabled;
+
+// Every LP's ring, TRACE_RING_STRIDE apart, and the MDL describing them (see TraceInitialize)
+PVOID g_TraceRings;
+ULONG g_TraceRingCount;
+PMDL g_TraceMdl;
+
+// The one reader the rings are mapped into, if any (see TraceMap)
+FAST_MUTEX g_TraceLock;
+PFILE_OBJECT g_TraceOwner;
+PEPROCESS g_TraceProcess;
+PVOID g_TraceUserBase;
+
+BOOLEAN
+TraceInitialize(
+    _In_ CONST ULONG RingCount
+    )
+{
+    SIZE_T size = (SIZE_T)RingCount * TRACE_RING_STRIDE;
+
+    ExInitializeFastMutex( &g_TraceLock );
+
+    // (Note: more than a page, so the pool hands back a page-aligned block)
+    g_TraceRings = ExAllocatePoolWithTag( NonPagedPool, size, SPTHV_POOL_TAG );
+    if ( g_TraceRings == NULL )
+    {
+        return FALSE;
+    }
+
+    RtlSecureZeroMemory( g_TraceRings, size );
+
+    g_TraceMdl = IoAllocateMdl( g_TraceRings, (ULONG)size, FALSE, FALSE, NULL );
+    if ( g_TraceMdl == NULL )
+    {
+        ExFreePoolWithTag( g_TraceRings, SPTHV_POOL_TAG );
+        g_TraceRings = NULL;
+        return FALSE;
+    }
+
+    MmBuildMdlForNonPagedPool( g_TraceMdl );
+
+    g_TraceRingCount = RingCount;
+
+    return TRUE;
+}
+
+VOID
+TraceFree()
+{
+    // Only once no LP is tracing, and the rings are no longer mapped (our device is gone by now)
+
+    if ( g_TraceMdl != NULL )
+    {
+        IoFreeMdl( g_TraceMdl );
+        g_TraceMdl = NULL;
+    }
+
+    if ( g_TraceRings != NULL )
+    {
+        ExFreePoolWithTag( g_TraceRings, SPTHV_POOL_TAG );
+        g_TraceRings = NULL;
+    }
+
+    g_TraceRingCount = 0;
+}
+
+PSPTHV_TRACE_RING
+TraceGetRing(
+    _In_ CONST ULONG Index
+    )
+{
+    if ( g_TraceRings == NULL || Index >= g_TraceRingCount )
+    {
+        return NULL;
+    }
+
+    return (PSPTHV_TRACE_RING)((PUCHAR)g_TraceRings + (SIZE_T)Index * TRACE_RING_STRIDE);
+}
+
+NTSTATUS
+TraceMap(
+    _In_ PFILE_OBJECT Owner,
+    _Out_ PSPTHV_TRACE_MAPPING Mapping
+    )
+{
+    // Map every ring into the calling process (we're called in its context), and start tracing
+
+    PVOID base = NULL;
+    ULONG i;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlSecureZeroMemory( Mapping, sizeof(SPTHV_TRACE_MAPPING) );
+
+    if ( g_TraceRings == NULL )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_TraceLock );
+
+    // The rings are single-consumer; a second reader would race the first one for Tail
+    if ( g_TraceOwner != NULL )
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto __unlock;
+    }
+
+    // Nothing is written while tracing is off, so every Head is stable; the new reader starts with empty rings
+    for ( i = 0; i < g_TraceRingCount; i++ )
+    {
+        PSPTHV_TRACE_RING ring = TraceGetRing( i );
+
+        ring->Tail = ring->Head;
+        ring->Overruns = 0;
+    }
+
+    // (Note: mapping into user mode raises, rather than returning NULL, on failure)
+    __try
+    {
+        base = MmMapLockedPagesSpecifyCache(
+            g_TraceMdl,
+            UserMode,
+            MmCached,
+            NULL,
+            FALSE,
+            NormalPagePriority | MdlMappingNoExecute
+            );
+    }
+    __except ( EXCEPTION_EXECUTE_HANDLER )
+    {
+        base = NULL;
+    }
+
+    if ( base == NULL )
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto __unlock;
+    }
+
+    g_TraceOwner = Owner;
+    g_TraceUserBase = base;
+    g_TraceProcess = PsGetCurrentProcess();
+    ObReferenceObject( g_TraceProcess );
+
+    Mapping->Base = (ULONG64)(ULONG_PTR)base;
+    Mapping->RingCount = g_TraceRingCount;
+    Mapping->RingStride = (ULONG)TRACE_RING_STRIDE;
+
+    InterlockedExchange( &g_TraceEnabled, TRUE );
+
+__unlock:
+    ExReleaseFastMutex( &g_TraceLock );
+
+    return status;
+}
+
+NTSTATUS
+TraceUnmap(
+    _In_ PFILE_OBJECT Owner
+    )
+{
+    /*
+     * Stop tracing, and unmap the rings from the reader; only the handle that mapped them may unmap them.
+     *
+     *  This is also called when that handle is cleaned up, which may happen in another process (if the
+     *  handle was duplicated), so we attach to the one the rings were mapped into.
+     */
+
+    KAPC_STATE apcState;
+    BOOLEAN attached = FALSE;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    ExAcquireFastMutex( &g_TraceLock );
+
+    if ( g_TraceOwner == NULL || g_TraceOwner != Owner )
+    {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto __unlock;
+    }
+
+    // (Note: an exit that's already past the check may still write one last record; the kernel mapping stays)
+    InterlockedExchange( &g_TraceEnabled, FALSE );
+
+    if ( PsGetCurrentProcess() != g_TraceProcess )
+    {
+        KeStackAttachProcess( g_TraceProcess, &apcState );
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages( g_TraceUserBase, g_TraceMdl );
+
+    if ( attached == TRUE )
+    {
+        KeUnstackDetachProcess( &apcState );
+    }
+
+    ObDereferenceObject( g_TraceProcess );
+
+    g_TraceOwner = NULL;
+    g_TraceProcess = NULL;
+    g_TraceUserBase = NULL;
+
+__unlock:
+    ExReleaseFastMutex( &g_TraceLock );
+
+    return status;
+}
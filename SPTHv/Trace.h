@@ -0,0 +1,44 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <ntddk.h>
+
+#include "SPTHvIoctl.h"
+
+// The distance between consecutive LPs' rings; whole pages, so every ring starts page-aligned
+#define TRACE_RING_STRIDE					ROUND_TO_PAGES( sizeof(SPTHV_TRACE_RING) )
+
+// Nonzero while the rings are mapped into a reader (see TraceMap); nothing is traced otherwise
+extern volatile LONG g_TraceEnabled;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+TraceInitialize(
+	_In_ CONST ULONG RingCount
+	);
+
+VOID
+TraceFree();
+
+PSPTHV_TRACE_RING
+TraceGetRing(
+	_In_ CONST ULONG Index
+	);
+
+NTSTATUS
+TraceMap(
+	_In_ PFILE_OBJECT Owner,
+	_Out_ PSPTHV_TRACE_MAPPING Mapping
+	);
+
+NTSTATUS
+TraceUnmap(
+	_In_ PFILE_OBJECT Owner
+	);
+
+#endif // __TRACE_H__
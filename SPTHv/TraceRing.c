@@ -0,0 +1,87 @@
+#include "TraceRing.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches anything but the ring it's given, and nothing takes a lock; any zeroed
+ *  SPTHV_TRACE_RING will do, with one thread calling TraceRingWrite and another calling TraceRingRead.
+ *  This file is built into both the driver and the SPTHvCtl tool, so it may only use what <ntddk.h> and
+ *  <windows.h> both provide.
+ */
+
+C_ASSERT( (SPTHV_TRACE_RING_RECORDS & (SPTHV_TRACE_RING_RECORDS - 1)) == 0 );
+
+BOOLEAN
+TraceRingWrite(
+    _Inout_ PSPTHV_TRACE_RING Ring,
+    _In_ CONST UINT64 Tsc,
+    _In_ CONST UINT32 ExitReason,
+    _In_ CONST UINT64 Qualification,
+    _In_ CONST UINT64 GuestRip
+    )
+{
+    /*
+     * Append one record; this runs in root mode, where we can neither take a lock nor wait on the reader,
+     *  so a full ring just drops the record (and counts it). FALSE if the record was dropped.
+     *
+     *  (Note: Tail is written from user mode, so it isn't to be trusted; a Tail that's ahead of Head only
+     *  looks like a full ring, and the index is masked regardless)
+     */
+
+    PSPTHV_TRACE_RECORD record;
+    UINT64 head = Ring->Head;
+    UINT64 tail = (UINT64)ReadAcquire64( (volatile LONG64*)&Ring->Tail );
+
+    if ( head - tail >= SPTHV_TRACE_RING_RECORDS )
+    {
+        Ring->Overruns++;
+        return FALSE;
+    }
+
+    record = &Ring->Records[head & (SPTHV_TRACE_RING_RECORDS - 1)];
+
+    record->Tsc = Tsc;
+    record->Qualification = Qualification;
+    record->GuestRip = GuestRip;
+    record->ExitReason = ExitReason;
+    record->Reserved = 0;
+
+    // Publish the record only once it's been written in full
+    WriteRelease64( (volatile LONG64*)&Ring->Head, (LONG64)(head + 1) );
+
+    return TRUE;
+}
+
+ULONG
+TraceRingRead(
+    _Inout_ PSPTHV_TRACE_RING Ring,
+    _Out_writes_(MaxRecords) PSPTHV_TRACE_RECORD Batch,
+    _In_ CONST ULONG MaxRecords
+    )
+{
+    // Copy out up to MaxRecords of what the producer has published, then hand their slots back; the number copied
+
+    UINT64 tail = Ring->Tail;
+    UINT64 head = (UINT64)ReadAcquire64( (volatile LONG64*)&Ring->Head );
+    ULONG count;
+    ULONG i;
+
+    if ( head - tail > SPTHV_TRACE_RING_RECORDS )
+    {
+        // Can't happen with a well-behaved producer; start over from what's there now, rather than read garbage
+        WriteRelease64( (volatile LONG64*)&Ring->Tail, (LONG64)head );
+        return 0;
+    }
+
+    count = (ULONG)min( head - tail, MaxRecords );
+
+    for ( i = 0; i < count; i++ )
+    {
+        Batch[i] = Ring->Records[(tail + i) & (SPTHV_TRACE_RING_RECORDS - 1)];
+    }
+
+    // Only once they've been copied; the producer may overwrite them from here on
+    WriteRelease64( (volatile LONG64*)&Ring->Tail, (LONG64)(tail + count) );
+
+    return count;
+}
@@ -0,0 +1,35 @@
+#ifndef __TRACERING_H__
+#define __TRACERING_H__
+
+// Both halves of the trace ring protocol; the driver writes, and the SPTHvCtl tool reads (see "SPTHvIoctl.h")
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+#include "SPTHvIoctl.h"
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+TraceRingWrite(
+	_Inout_ PSPTHV_TRACE_RING Ring,
+	_In_ CONST UINT64 Tsc,
+	_In_ CONST UINT32 ExitReason,
+	_In_ CONST UINT64 Qualification,
+	_In_ CONST UINT64 GuestRip
+	);
+
+ULONG
+TraceRingRead(
+	_Inout_ PSPTHV_TRACE_RING Ring,
+	_Out_writes_(MaxRecords) PSPTHV_TRACE_RECORD Batch,
+	_In_ CONST ULONG MaxRecords
+	);
+
+#endif // __TRACERING_H__
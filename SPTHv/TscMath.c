@@ -0,0 +1,124 @@
+#include "TscMath.h"
+
+/*
+ * Notes for testing:
+ *
+ * These are plain 64-bit (and 128-bit, via _umul128) arithmetic, and touch nothing else; they're the same math the
+ *  processor does on every RDTSC.
+ */
+
+UINT64
+_DivideU128(
+    _In_ UINT64 High,
+    _In_ UINT64 Low,
+    _In_ CONST UINT64 Divisor
+    )
+{
+    // (High:Low) / Divisor, for High < Divisor (so that the quotient fits in 64 bits); restoring long division
+
+    UINT64 quotient = 0;
+    UINT64 carry;
+    ULONG i;
+
+    for ( i = 0; i < 64; i++ )
+    {
+        carry = High >> 63;
+        High = (High << 1) | (Low >> 63);
+        Low <<= 1;
+        quotient <<= 1;
+
+        if ( carry != 0 || High >= Divisor )
+        {
+            High -= Divisor;
+            quotient |= 1;
+        }
+    }
+
+    return quotient;
+}
+
+UINT64
+TscComputeMultiplier(
+    _In_ CONST UINT64 GuestFrequency,
+    _In_ CONST UINT64 HostFrequency
+    )
+{
+    /*
+     * The 16.48 fixed-point multiplier that turns a TSC running at HostFrequency into one running at GuestFrequency,
+     *  rounded to the nearest representable value; 0 if there isn't one (a ratio of 65536 or more, or of 0).
+     */
+
+    UINT64 high, low;
+
+    if ( HostFrequency == 0 || GuestFrequency == 0 )
+    {
+        return 0;
+    }
+
+    // (GuestFrequency << 48) + HostFrequency / 2, as 128 bits
+    high = GuestFrequency >> (64 - TSC_MULTIPLIER_SHIFT);
+    low = GuestFrequency << TSC_MULTIPLIER_SHIFT;
+
+    low += HostFrequency / 2;
+    high += (low < HostFrequency / 2);
+
+    if ( high >= HostFrequency )
+    {
+        return 0;
+    }
+
+    return _DivideU128( high, low, HostFrequency );
+}
+
+UINT64
+TscScale(
+    _In_ CONST UINT64 HostTsc,
+    _In_ CONST UINT64 Multiplier
+    )
+{
+    // Bits 111:48 of the 128-bit product; exactly what the processor keeps ([25.3])
+
+    UINT64 high, low;
+
+    low = _umul128( HostTsc, Multiplier, &high );
+
+    return (high << (64 - TSC_MULTIPLIER_SHIFT)) | (low >> TSC_MULTIPLIER_SHIFT);
+}
+
+UINT64
+TscGuestValue(
+    _In_ CONST UINT64 HostTsc,
+    _In_ CONST UINT64 Multiplier,
+    _In_ CONST UINT64 Offset
+    )
+{
+    // What RDTSC returns in the guest when the TSC reads HostTsc (the addition wraps, as the processor's does)
+    return TscScale( HostTsc, Multiplier ) + Offset;
+}
+
+UINT64
+TscOffsetFor(
+    _In_ CONST UINT64 HostTsc,
+    _In_ CONST UINT64 Multiplier,
+    _In_ CONST UINT64 GuestTsc
+    )
+{
+    // The offset that has the guest read GuestTsc when the TSC reads HostTsc
+    return GuestTsc - TscScale( HostTsc, Multiplier );
+}
+
+UINT64
+TscRebase(
+    _In_ CONST UINT64 HostTsc,
+    _In_ CONST UINT64 OldMultiplier,
+    _In_ CONST UINT64 OldOffset,
+    _In_ CONST UINT64 NewMultiplier
+    )
+{
+    /*
+     * The offset to pair NewMultiplier with, so that the guest's TSC carries on from the value it has at HostTsc,
+     *  rather than jumping to wherever NewMultiplier alone would put it.
+     */
+
+    return TscOffsetFor( HostTsc, NewMultiplier, TscGuestValue( HostTsc, OldMultiplier, OldOffset ) );
+}
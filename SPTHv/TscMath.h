@@ -0,0 +1,56 @@
+#ifndef __TSC_MATH_H__
+#define __TSC_MATH_H__
+
+#include <ntddk.h>
+
+/*
+ * [25.3] "Changes to Instruction Behavior in VMX Non-Root Operation"
+ *
+ *  With TSC offsetting (and scaling) on, RDTSC, RDTSCP and RDMSR of IA32_TIME_STAMP_COUNTER return, without
+ *  exiting, the TSC multiplied by the TSC multiplier, shifted right by 48 (keeping bits 63:0), plus the TSC
+ *  offset; the multiplier is a 16.48 fixed-point ratio of the guest's TSC rate to the processor's.
+ */
+#define TSC_MULTIPLIER_SHIFT				48
+#define TSC_MULTIPLIER_ONE					(1ULL << TSC_MULTIPLIER_SHIFT)
+
+
+
+//
+// Local functions
+//
+
+UINT64
+TscComputeMultiplier(
+	_In_ CONST UINT64 GuestFrequency,
+	_In_ CONST UINT64 HostFrequency
+	);
+
+UINT64
+TscScale(
+	_In_ CONST UINT64 HostTsc,
+	_In_ CONST UINT64 Multiplier
+	);
+
+UINT64
+TscGuestValue(
+	_In_ CONST UINT64 HostTsc,
+	_In_ CONST UINT64 Multiplier,
+	_In_ CONST UINT64 Offset
+	);
+
+UINT64
+TscOffsetFor(
+	_In_ CONST UINT64 HostTsc,
+	_In_ CONST UINT64 Multiplier,
+	_In_ CONST UINT64 GuestTsc
+	);
+
+UINT64
+TscRebase(
+	_In_ CONST UINT64 HostTsc,
+	_In_ CONST UINT64 OldMultiplier,
+	_In_ CONST UINT64 OldOffset,
+	_In_ CONST UINT64 NewMultiplier
+	);
+
+#endif // __TSC_MATH_H__
@@ -1,4 +1,6 @@
 #include "Utils.h"
+#include "CPU.h"
+#include "GuestWalk.h"
 
 BOOLEAN
 utlAllocateVMXData (
@@ -64,6 +66,197 @@ utlFreeVMXData(
 	Allocation->PA = NULL;
 }
 
+PVOID
+utlAllocateNodeBlock(
+	_In_ CONST SIZE_T Size,
+	_In_ CONST ULONG Node,
+	_Out_ PUINT64 PhysicalAddress
+	)
+{
+	// A physically contiguous, page-aligned block, on Node if at all possible (see ARENA_PROVIDER in "Arena.h")
+
+	PVOID block;
+	PHYSICAL_ADDRESS LowBound, HighBound, Boundary;
+
+	LowBound.QuadPart = 0;
+	HighBound.QuadPart = ~0;
+	Boundary.QuadPart = 0;
+
+	*PhysicalAddress = 0;
+
+	block = MmAllocateContiguousNodeMemory( Size, LowBound, HighBound, Boundary, PAGE_READWRITE, Node | MM_ANY_NODE_OK );
+	if ( block == NULL )
+	{
+		return NULL;
+	}
+
+	*PhysicalAddress = MmGetPhysicalAddress( block ).QuadPart;
+
+	return block;
+}
+
+VOID
+utlFreeNodeBlock(
+	_In_ PVOID Block,
+	_In_ CONST SIZE_T Size
+	)
+{
+	UNREFERENCED_PARAMETER( Size );
+
+	MmFreeContiguousMemory( Block );
+}
+
+ULONG
+utlGetProcessorNode(
+	_In_ CONST ULONG ProcessorIndex
+	)
+{
+	// The NUMA node of the LP with the given (system-wide) index; 0 if it can't be found
+
+	PROCESSOR_NUMBER procNumber;
+	GROUP_AFFINITY nodeAffinity;
+	USHORT node, highestNode;
+
+	if ( !NT_SUCCESS( KeGetProcessorNumberFromIndex( ProcessorIndex, &procNumber ) ) )
+	{
+		return 0;
+	}
+
+	highestNode = KeQueryHighestNodeNumber();
+
+	for ( node = 0; node <= highestNode; node++ )
+	{
+		KeQueryNodeActiveAffinity( node, &nodeAffinity, NULL );
+
+		if ( nodeAffinity.Group == procNumber.Group && (nodeAffinity.Mask & ((KAFFINITY)1 << procNumber.Number)) != 0 )
+		{
+			return node;
+		}
+	}
+
+	return 0;
+}
+
+volatile UINT64*
+_utlFindPTE(
+	_In_ CONST PVOID VA
+	)
+{
+	/*
+	 * The PTE that maps VA in the current address space, found by walking its paging structures from CR3 (each of
+	 *  which the kernel has mapped somewhere); NULL if VA isn't mapped by a 4KB page's PTE. The system PTEs
+	 *  MmAllocateMappingAddress hands out always are, so their PTE is there even before anything is mapped.
+	 */
+
+	PHYSICAL_ADDRESS entryAddress;
+	volatile UINT64* entry;
+	UINT64 table;
+	CR4 cr4;
+	ULONG level;
+
+	cr4.All = __readcr4();
+	table = __readcr3() & GUEST_PTE_ADDRESS_MASK;
+
+	for ( level = (cr4.LA57 == 1) ? 5 : 4; ; level-- )
+	{
+		entryAddress.QuadPart = table + ((((UINT64)VA) >> (12 + 9 * (level - 1))) & 0x1FF) * sizeof(UINT64);
+
+		entry = MmGetVirtualForPhysical( entryAddress );
+		if ( entry == NULL || level == 1 )
+		{
+			return entry;
+		}
+
+		if ( (*entry & GUEST_PTE_PRESENT) == 0 || (*entry & GUEST_PTE_LARGE) != 0 )
+		{
+			return NULL;
+		}
+
+		table = *entry & GUEST_PTE_ADDRESS_MASK;
+	}
+}
+
+BOOLEAN
+utlReservePhysicalWindow(
+	_Out_ PPHYSICAL_WINDOW Window
+	)
+{
+	/*
+	 * Reserve a page of system address space, with nothing mapped in it, and find its PTE; from the system process,
+	 *  so that the PTE is found through the same address space the host runs in (see g_SystemCR3)
+	 */
+
+	Window->PTE = NULL;
+	Window->VA = MmAllocateMappingAddress( PAGE_SIZE, SPTHV_POOL_TAG );
+
+	if ( Window->VA == NULL )
+	{
+		return FALSE;
+	}
+
+	Window->PTE = _utlFindPTE( Window->VA );
+
+	if ( Window->PTE == NULL || *Window->PTE != 0 )
+	{
+		utlFreePhysicalWindow( Window );
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+VOID
+utlFreePhysicalWindow(
+	_Inout_ PPHYSICAL_WINDOW Window
+	)
+{
+	// (Note: it has to be unmapped by now; see utlUnmapPhysical)
+	if ( Window->VA != NULL )
+	{
+		MmFreeMappingAddress( Window->VA, SPTHV_POOL_TAG );
+	}
+
+	Window->VA = NULL;
+	Window->PTE = NULL;
+}
+
+PVOID
+utlMapPhysical(
+	_Inout_ PPHYSICAL_WINDOW Window,
+	_In_ CONST UINT64 PhysicalAddress
+	)
+{
+	/*
+	 * Point the window at the 4KB page PhysicalAddress is in, and return where PhysicalAddress is in it. Only from the
+	 *  LP the window belongs to, with interrupts off (as they are in root mode), and only until the next call; the
+	 *  page is mapped write-back ([11.12.3] "Selecting a Memory Type from the PAT", PAT entry 0), so it had better be RAM.
+	 */
+
+	UINT64 pte = (PhysicalAddress & GUEST_PTE_ADDRESS_MASK) | GUEST_PTE_PRESENT | GUEST_PTE_WRITE | GUEST_PTE_ACCESSED | GUEST_PTE_DIRTY;
+
+	if ( *Window->PTE != pte )
+	{
+		*Window->PTE = pte;
+		__invlpg( Window->VA );
+	}
+
+	return Window->VA + (PhysicalAddress & (PAGE_SIZE - 1));
+}
+
+VOID
+utlUnmapPhysical(
+	_Inout_ PPHYSICAL_WINDOW Window
+	)
+{
+	// Leave nothing mapped (nor cached in the TLB) once we're done with the window for now
+
+	if ( *Window->PTE != 0 )
+	{
+		*Window->PTE = 0;
+		__invlpg( Window->VA );
+	}
+}
+
 void
 utlGetNextInstrAddr(
 	_Inout_ UINT64* CONST pAddr
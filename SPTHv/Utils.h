@@ -11,6 +11,14 @@ typedef struct _VMX_ADDRESS
 	PVOID PA;
 } VMX_ADDRESS, *PVMX_ADDRESS;
 
+// A page of kernel address space whose PTE is ours to point at any physical page, for getting at memory from root
+//	mode, where nothing can be mapped the usual way (see utlMapPhysical)
+typedef struct _PHYSICAL_WINDOW
+{
+	PUINT8 VA;
+	volatile UINT64* PTE;
+} PHYSICAL_WINDOW, *PPHYSICAL_WINDOW;
+
 BOOLEAN
 utlAllocateVMXData (
 	_In_ CONST SIZE_T Length,
@@ -25,6 +33,45 @@ utlFreeVMXData(
 	_In_ CONST BOOLEAN Contiguous
 	);
 
+PVOID
+utlAllocateNodeBlock(
+	_In_ CONST SIZE_T Size,
+	_In_ CONST ULONG Node,
+	_Out_ PUINT64 PhysicalAddress
+	);
+
+VOID
+utlFreeNodeBlock(
+	_In_ PVOID Block,
+	_In_ CONST SIZE_T Size
+	);
+
+ULONG
+utlGetProcessorNode(
+	_In_ CONST ULONG ProcessorIndex
+	);
+
+BOOLEAN
+utlReservePhysicalWindow(
+	_Out_ PPHYSICAL_WINDOW Window
+	);
+
+VOID
+utlFreePhysicalWindow(
+	_Inout_ PPHYSICAL_WINDOW Window
+	);
+
+PVOID
+utlMapPhysical(
+	_Inout_ PPHYSICAL_WINDOW Window,
+	_In_ CONST UINT64 PhysicalAddress
+	);
+
+VOID
+utlUnmapPhysical(
+	_Inout_ PPHYSICAL_WINDOW Window
+	);
+
 void
 utlGetNextInstrAddr (
 	_Inout_ UINT64* CONST pAddr
@@ -0,0 +1,158 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The area's format, and which violations are convertible, live in "VEInfo.c"; everything in here is the bookkeeping
+ *  around them, which needs the LPs to be virtualized.
+ *
+ * A page is watched by taking away the accesses to watch for in some view (see VmfuncProtectPage in "VMFunc.c"), and
+ *  making it convertible there with VeSetConvertible. Once VeStart has run, each of those accesses is a #VE on the LP
+ *  that made it, which never leaves the guest on a processor with the "EPT-violation #VE" control; without it, the
+ *  access still exits, and we deliver the #VE from _ExitEPTViolation (see "Exit.c") instead.
+ *
+ * The guest must have a #VE handler in its IDT before VeStart, that calls VeInfoTake (on VeGetInfo) and lets the
+ *  access through (by switching to a view that allows it, say; see VmfuncSwitchView). A violation we can't deliver
+ *  (the handler hasn't taken the last one yet, or the processor was delivering another event) is handled as it would
+ *  be without #VE; an LP outside the default view goes back to it, and retries the access there.
+ *
+ *  (Note: so watched pages belong in a view other than the default one; there, nothing is lost but the #VE)
+ *
+ * From user mode, #VEs are started and stopped with IOCTL_SPTHV_START_VE and IOCTL_SPTHV_STOP_VE, and pages made
+ *  convertible with IOCTL_SPTHV_SET_CONVERTIBLE (see the `ve` command of the SPTHvCtl tool).
+ */
+
+C_ASSERT( VE_INFO_EXIT_REASON == REASON_EPT_VIOLATION );
+
+BOOLEAN g_VeSupported;
+
+// Only one start or stop at a time
+FAST_MUTEX g_VeLock;
+BOOLEAN g_VeRunning;
+
+BOOLEAN
+VeInitialize()
+{
+    /*
+     * Work out whether the processor can deliver #VEs for us. Either way, the guest can have them once the LPs are
+     *  launched, as long as there's EPT; VeStart turns them on in each LP's controls.
+     */
+
+    PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondaryCtrls;
+    UINT32 dropped;
+
+    ExInitializeFastMutex( &g_VeLock );
+
+    if ( g_VMXControls.Secondary.EnableEPT == 0 )
+    {
+        return FALSE;
+    }
+
+    // [24.6.2] "Processor-Based VM-Execution Controls"
+    secondaryCtrls = g_VMXControls.Secondary;
+    secondaryCtrls.EPTViolationVirtExcept = 1;
+
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PROC_SECONDARY, secondaryCtrls.All, &dropped, NULL );
+
+    g_VeSupported = (dropped == 0);
+
+    return g_VeSupported;
+}
+
+ULONG_PTR
+_VeEnableLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; Argument is TRUE to start delivering #VEs, FALSE to stop
+    GuestVmcall( HYPERCALL_VE, Argument, 0 );
+
+    return 0;
+}
+
+NTSTATUS
+VeStart()
+{
+    // Start delivering #VEs on every LP, for every convertible EPT violation (see VeSetConvertible)
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if ( g_VMXControls.Secondary.EnableEPT == 0 )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex( &g_VeLock );
+
+    if ( g_VeRunning == TRUE )
+    {
+        status = STATUS_DEVICE_BUSY;
+        goto __unlock;
+    }
+
+    KeIpiGenericCall( _VeEnableLP, TRUE );
+
+    g_VeRunning = TRUE;
+
+__unlock:
+    ExReleaseFastMutex( &g_VeLock );
+
+    return status;
+}
+
+NTSTATUS
+VeStop()
+{
+    // (Note: convertible pages stay that way; every violation they cause exits from here on, as it did before VeStart)
+
+    ExAcquireFastMutex( &g_VeLock );
+
+    if ( g_VeRunning == TRUE )
+    {
+        KeIpiGenericCall( _VeEnableLP, FALSE );
+        g_VeRunning = FALSE;
+    }
+
+    ExReleaseFastMutex( &g_VeLock );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VeSetConvertible(
+    _In_ CONST ULONG View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Convertible
+    )
+{
+    // Have the accesses View refuses to the 4KB page at GuestPA be #VEs (Convertible is TRUE), or exits
+
+    if ( g_VMXControls.Secondary.EnableEPT == 0 )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return VmfuncSetSuppressVE( View, GuestPA, (BOOLEAN)(Convertible == FALSE) );
+}
+
+PVE_INFO
+VeGetInfo()
+{
+    /*
+     * The current LP's area, for the guest's #VE handler (see VeInfoTake in "VEInfo.c"); NULL if the LP has no #VEs
+     *  delivered to it.
+     *
+     *  (Note: with interrupts disabled, or at DISPATCH_LEVEL or above, so that it stays the current LP's)
+     */
+
+    PLP_INFO lpInfo;
+
+    if ( g_LPInfo == NULL )
+    {
+        return NULL;
+    }
+
+    lpInfo = &g_LPInfo[KeGetCurrentProcessorNumberEx( NULL )];
+
+    return (lpInfo->VEEnabled == TRUE) ? (PVE_INFO)lpInfo->VEInfo.VA : NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef __VE_H__
+#define __VE_H__
+
+#include <ntddk.h>
+
+#include "VEInfo.h"
+
+
+//
+// Globals
+//
+
+// Whether the processor turns convertible EPT violations into #VEs itself (see VeInitialize); if not, we do it on the exit
+extern BOOLEAN g_VeSupported;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+VeInitialize();
+
+NTSTATUS
+VeStart();
+
+NTSTATUS
+VeStop();
+
+NTSTATUS
+VeSetConvertible(
+	_In_ CONST ULONG View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Convertible
+	);
+
+PVE_INFO
+VeGetInfo();
+
+#endif // __VE_H__
@@ -0,0 +1,111 @@
+#include "VEInfo.h"
+
+/*
+ * Notes for testing:
+ *
+ * Nothing in here touches the processor or the VMCS; an area is a plain structure, and whether a violation is
+ *  convertible only depends on the EPT entry that caused it (see EptGetLeafEntry in "EPT.c"). It can be driven
+ *  with an area in an ordinary buffer, and entries from a view built in one.
+ *
+ * Once #VEs are enabled on an LP (see VeStart in "VE.c"), `dd` its area (`VEInfo`); the second dword is
+ *  FFFFFFFF while the guest's handler has yet to take the last one.
+ */
+
+VOID
+VeInfoReset(
+    _Out_ PVE_INFO Info
+    )
+{
+    // Free, with nothing in it
+    RtlSecureZeroMemory( Info, sizeof(VE_INFO) );
+}
+
+BOOLEAN
+VeInfoIsBusy(
+    _In_ CONST VE_INFO* Info
+    )
+{
+    return *(volatile CONST UINT32*)&Info->Busy == VE_INFO_BUSY;
+}
+
+BOOLEAN
+VeInfoIsConvertible(
+    _In_ CONST VE_INFO* Info,
+    _In_opt_ CONST EPT_ENTRY* Entry,
+    _In_ CONST BOOLEAN EventDelivery
+    )
+{
+    /*
+     * Whether an EPT violation caused by Entry (NULL if the address isn't mapped at all) may be delivered to the guest
+     *  as a #VE; the checks the processor makes ([25.5.7.1] "Convertible EPT Violations"), for the violations it left
+     *  for us to deliver.
+     *
+     *  (Note: we never deliver one in the middle of delivering another event, as the processor would have to combine
+     *  the two ([6.15] "Exception and Interrupt Reference", Interrupt 8); that event is redelivered instead)
+     */
+
+    if ( Entry == NULL || Entry->SuppressVE == 1 )
+    {
+        return FALSE;
+    }
+
+    return VeInfoIsBusy( Info ) == FALSE && EventDelivery == FALSE;
+}
+
+BOOLEAN
+VeInfoDeliver(
+    _Inout_ PVE_INFO Info,
+    _In_ CONST UINT64 ExitQualification,
+    _In_ CONST UINT64 GuestLinearAddress,
+    _In_ CONST UINT64 GuestPhysicalAddress,
+    _In_ CONST UINT16 EPTPIndex
+    )
+{
+    /*
+     * Fill in the area as the processor would for a #VE ([25.5.7.2] "Delivery of Virtualization Exceptions"), and mark
+     *  it busy; FALSE if it's already busy (the guest has yet to take the last one), in which case it's left as it is.
+     *
+     *  (Note: the #VE itself is the caller's to inject)
+     */
+
+    if ( VeInfoIsBusy( Info ) == TRUE )
+    {
+        return FALSE;
+    }
+
+    Info->ExitReason = VE_INFO_EXIT_REASON;
+    Info->ExitQualification = ExitQualification;
+    Info->GuestLinearAddress = GuestLinearAddress;
+    Info->GuestPhysicalAddress = GuestPhysicalAddress;
+    Info->EPTPIndex = EPTPIndex;
+
+    *(volatile UINT32*)&Info->Busy = VE_INFO_BUSY;
+
+    return TRUE;
+}
+
+BOOLEAN
+VeInfoTake(
+    _Inout_ PVE_INFO Info,
+    _Out_ PVE_INFO Record
+    )
+{
+    /*
+     * For the guest's #VE handler; copy out what the last #VE was about, and free the area for the next one. FALSE
+     *  if it isn't busy (there's nothing to take).
+     *
+     *  (Note: the area is the current LP's, and the next #VE can be delivered as soon as it's free; so it's copied first)
+     */
+
+    if ( VeInfoIsBusy( Info ) == FALSE )
+    {
+        RtlSecureZeroMemory( Record, sizeof(VE_INFO) );
+        return FALSE;
+    }
+
+    *Record = *Info;
+
+    *(volatile UINT32*)&Info->Busy = 0;
+
+    return TRUE;
+}
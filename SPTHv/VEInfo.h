@@ -0,0 +1,76 @@
+#ifndef __VEINFO_H__
+#define __VEINFO_H__
+
+#include <ntddk.h>
+
+#include "EPT.h"
+
+/*
+ * [25.5.7] "Virtualization Exceptions"
+ *
+ *  With the "EPT-violation #VE" control set, an EPT violation caused by an entry whose suppress-#VE bit is clear
+ *  isn't a VM exit; the processor writes what the exit would have told us to the LP's virtualization-exception
+ *  information area, marks the area busy, and delivers a #VE (vector 20) to the guest through its own IDT. Until
+ *  the guest's handler clears the busy word again, every EPT violation on that LP exits as it would without #VE.
+ */
+#define VE_INFO_BUSY						0xFFFFFFFF
+
+// The exit reason every area is written with (REASON_EPT_VIOLATION; there's no other kind of #VE)
+#define VE_INFO_EXIT_REASON					48
+
+// [25.5.7.2] "Delivery of Virtualization Exceptions", Table 25-1 "Format of the Virtualization-Exception Information Area"
+typedef struct _VE_INFO
+{
+	UINT32 ExitReason;
+	UINT32 Busy;						// VE_INFO_BUSY from delivery until the guest is done with it; any other value means free
+	UINT64 ExitQualification;			// As for an EPT violation exit (EPT_VIOLATION_QUALIFICATION)
+	UINT64 GuestLinearAddress;			// (Only if the qualification says it's valid)
+	UINT64 GuestPhysicalAddress;
+	UINT16 EPTPIndex;					// The view the LP was in (its index in the EPTP list)
+} VE_INFO, *PVE_INFO;
+
+C_ASSERT( FIELD_OFFSET( VE_INFO, Busy ) == 0x4 );
+C_ASSERT( FIELD_OFFSET( VE_INFO, ExitQualification ) == 0x8 );
+C_ASSERT( FIELD_OFFSET( VE_INFO, GuestLinearAddress ) == 0x10 );
+C_ASSERT( FIELD_OFFSET( VE_INFO, GuestPhysicalAddress ) == 0x18 );
+C_ASSERT( FIELD_OFFSET( VE_INFO, EPTPIndex ) == 0x20 );
+
+
+
+//
+// Local functions
+//
+
+VOID
+VeInfoReset(
+	_Out_ PVE_INFO Info
+	);
+
+BOOLEAN
+VeInfoIsBusy(
+	_In_ CONST VE_INFO* Info
+	);
+
+BOOLEAN
+VeInfoIsConvertible(
+	_In_ CONST VE_INFO* Info,
+	_In_opt_ CONST EPT_ENTRY* Entry,
+	_In_ CONST BOOLEAN EventDelivery
+	);
+
+BOOLEAN
+VeInfoDeliver(
+	_Inout_ PVE_INFO Info,
+	_In_ CONST UINT64 ExitQualification,
+	_In_ CONST UINT64 GuestLinearAddress,
+	_In_ CONST UINT64 GuestPhysicalAddress,
+	_In_ CONST UINT16 EPTPIndex
+	);
+
+BOOLEAN
+VeInfoTake(
+	_Inout_ PVE_INFO Info,
+	_Out_ PVE_INFO Record
+	);
+
+#endif // __VEINFO_H__
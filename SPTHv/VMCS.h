@@ -97,6 +97,8 @@
 #define VMCS_CTRL_TSC_MULTIPLIER_HIGH               0x2033    // Must have "use TSC scaling" bit set
 #define VMCS_CTRL_ENCLV_EXITING_BITMAP_FULL         0x2036    // Must have "enable ENCLV exiting" bit set
 #define VMCS_CTRL_ENCLV_EXITING_BITMAP_HIGH         0x2037    // Must have "enable ENCLV exiting" bit set
+#define VMCS_CTRL_PCONFIG_EXITING_BITMAP_FULL       0x203E    // Must have "enable PCONFIG" bit set
+#define VMCS_CTRL_PCONFIG_EXITING_BITMAP_HIGH       0x203F    // Must have "enable PCONFIG" bit set
 
 
 /* 64-Bit Read-Only Data Fields (B.2.2) */
@@ -372,10 +374,19 @@ typedef union _PROCESSOR_SECONDARY_VM_EXEC_CTRLS
         UINT32 ModeBasedEPTExecuteCtrl : 1;         // 22
         UINT32 Reserved1 : 2;                       // 23-24
         UINT32 UseTSCScaling : 1;                   // 25
+        UINT32 EnableUserWaitPause : 1;             // 26
+        UINT32 EnablePCONFIG : 1;                   // 27
     };
     UINT32 All;
 } PROCESSOR_SECONDARY_VM_EXEC_CTRLS;
 
+// The secondary controls without which an instruction #UDs in VMX non-root operation (see g_VMXPassThroughControls in "VMX.c")
+#define SECONDARY_CTRL_ENABLE_RDTSCP                (1UL << 3)
+#define SECONDARY_CTRL_ENABLE_INVPCID               (1UL << 12)
+#define SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS        (1UL << 20)
+#define SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE       (1UL << 26)
+#define SECONDARY_CTRL_ENABLE_PCONFIG               (1UL << 27)
+
 // [24.7.1] "VM-Exit Controls", Table 24-10
 typedef union _VM_EXIT_CTRLS
 {
@@ -438,6 +449,116 @@ typedef union _VM_EXIT_REASON
     UINT32 All;
 } VM_EXIT_REASON;
 
+// [24.8.3] "VM-Entry Controls for Event Injection", Table 24-14
+//	(The same format is used by the VM-exit interruption-information field; see [24.9.2], Table 24-15)
+typedef union _VM_ENTRY_INT_INFO
+{
+    struct
+    {
+        UINT32 Vector : 8;                          // 0-7
+        UINT32 Type : 3;                            // 8-10      (See INTERRUPTION_TYPE)
+        UINT32 DeliverErrorCode : 1;                // 11
+        UINT32 Reserved0 : 19;                      // 12-30
+        UINT32 Valid : 1;                           // 31
+    };
+    UINT32 All;
+} VM_ENTRY_INT_INFO;
+
+// [24.8.3] "VM-Entry Controls for Event Injection", Table 24-14
+typedef enum _INTERRUPTION_TYPE
+{
+    INTERRUPTION_TYPE_EXTERNAL_INTERRUPT,
+    INTERRUPTION_TYPE_RESERVED,
+    INTERRUPTION_TYPE_NMI,
+    INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
+    INTERRUPTION_TYPE_SOFTWARE_INTERRUPT,
+    INTERRUPTION_TYPE_PRIVILEGED_SOFTWARE_EXCEPTION,
+    INTERRUPTION_TYPE_SOFTWARE_EXCEPTION,
+    INTERRUPTION_TYPE_OTHER_EVENT
+} INTERRUPTION_TYPE;
+
+// [27.2.1] "Basic VM-Exit Information", Table 27-3
+typedef union _CR_ACCESS_QUALIFICATION
+{
+    struct
+    {
+        UINT64 CRNumber : 4;                        // 0-3
+        UINT64 AccessType : 2;                      // 4-5       (See CR_ACCESS_TYPE)
+        UINT64 LMSWOperandType : 1;                 // 6
+        UINT64 Reserved0 : 1;                       // 7
+        UINT64 GPR : 4;                             // 8-11      (Register numbers; RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8-R15)
+        UINT64 Reserved1 : 4;                       // 12-15
+        UINT64 LMSWSourceData : 16;                 // 16-31
+    };
+    UINT64 All;
+} CR_ACCESS_QUALIFICATION;
+
+// [27.2.1] "Basic VM-Exit Information", Table 27-3
+typedef enum _CR_ACCESS_TYPE
+{
+    CR_ACCESS_MOV_TO_CR,
+    CR_ACCESS_MOV_FROM_CR,
+    CR_ACCESS_CLTS,
+    CR_ACCESS_LMSW
+} CR_ACCESS_TYPE;
+
+// [27.2.1] "Basic VM-Exit Information", Table 27-7
+typedef union _EPT_VIOLATION_QUALIFICATION
+{
+    struct
+    {
+        UINT64 Read : 1;                            // 0        (The access was a data read)
+        UINT64 Write : 1;                           // 1        (The access was a data write)
+        UINT64 Execute : 1;                         // 2        (The access was an instruction fetch)
+        UINT64 Readable : 1;                        // 3        (The guest-physical address was readable)
+        UINT64 Writable : 1;                        // 4        (The guest-physical address was writable)
+        UINT64 Executable : 1;                      // 5        (The guest-physical address was executable)
+        UINT64 UserExecutable : 1;                  // 6
+        UINT64 GuestLinearValid : 1;                // 7
+        UINT64 LinearTranslation : 1;               // 8        (Only valid when GuestLinearValid is set)
+        UINT64 UserModeLinear : 1;                  // 9
+        UINT64 ReadWritePage : 1;                   // 10
+        UINT64 ExecuteDisablePage : 1;              // 11
+        UINT64 NMIUnblocking : 1;                   // 12
+        UINT64 ShadowStack : 1;                     // 13
+        UINT64 SupervisorShadowStack : 1;           // 14
+        UINT64 Reserved0 : 49;                      // 15-63
+    };
+    UINT64 All;
+} EPT_VIOLATION_QUALIFICATION;
+
+// [27.2.1] "Basic VM-Exit Information", Table 27-5
+typedef union _IO_INSTRUCTION_QUALIFICATION
+{
+    struct
+    {
+        UINT64 SizeOfAccess : 3;                    // 0-2      (Size minus one; 0 = 1 byte, 1 = 2 bytes, 3 = 4 bytes)
+        UINT64 DirectionIn : 1;                     // 3        (0 = OUT, 1 = IN)
+        UINT64 String : 1;                          // 4        (INS/OUTS)
+        UINT64 Rep : 1;                             // 5
+        UINT64 OperandImmediate : 1;                // 6        (0 = DX, 1 = immediate)
+        UINT64 Reserved0 : 9;                       // 7-15
+        UINT64 Port : 16;                           // 16-31
+        UINT64 Reserved1 : 32;                      // 32-63
+    };
+    UINT64 All;
+} IO_INSTRUCTION_QUALIFICATION;
+
+// [27.2.5] "Information for VM Exits Due to Instruction Execution", Table 27-8
+//    (Note: only reported when IA32_VMX_BASIC[54] is set; see VMX_BASIC_INFO.INSOUTSReporting)
+typedef union _IO_STRING_INSTR_INFO
+{
+    struct
+    {
+        UINT32 Undefined0 : 7;                      // 0-6
+        UINT32 AddressSize : 3;                     // 7-9      (0 = 16-bit, 1 = 32-bit, 2 = 64-bit)
+        UINT32 Undefined1 : 5;                      // 10-14
+        UINT32 SegmentRegister : 3;                 // 15-17    (ES, CS, SS, DS, FS, GS)
+        UINT32 Undefined2 : 14;                     // 18-31
+    };
+    UINT32 All;
+} IO_STRING_INSTR_INFO;
+
 #pragma warning(pop)
 
 #endif // __VMCS_H__
@@ -0,0 +1,345 @@
+#include "Driver.h"
+
+/*
+ * Notes for testing:
+ *
+ * The list and the views themselves are managed in "EPTList.c" and "EPT.c"; everything in here is the bookkeeping
+ *  around them, which needs the LPs to be virtualized.
+ *
+ * Every view starts out as an exact copy of the identity map, and VmfuncProtectPage is what makes them differ (an
+ *  execute-only view of a page, and a read/write view of the same page, say). The guest switches between them on
+ *  its own LP with VmfuncSwitchView, which is a single VMFUNC and no exit at all; only changes to the views (or to
+ *  which of them are in the list) go through us, with HYPERCALL_EPT_VIEWS on every LP.
+ *
+ * From user mode, views are changed with IOCTL_SPTHV_PROTECT_VIEW_PAGE and IOCTL_SPTHV_ENABLE_VIEW (see the `view`
+ *  command of the SPTHvCtl tool).
+ *
+ * An access the LP's current view doesn't allow exits as an EPT violation, which puts the LP back in the default
+ *  view (see _ExitEPTViolation in "Exit.c"); whoever switched it out of there gets to switch it back.
+ *
+ *  (Note: each view has EPT dirty flags of its own; dirty-page tracking (see "PML.c") clears them in every view)
+ */
+
+BOOLEAN g_VmfuncSupported;
+
+EPTP_LIST g_EPTPList;
+
+// The views other than the default one, each in a pool of its own (view i is g_EPTAltViews[i - 1])
+EPT_VIEW g_EPTAltViews[EPT_VIEW_MAX - 1];
+
+// The page the EPTP list lives in; every LP's VMCS points at it
+VMX_ADDRESS g_EPTPListPage;
+
+// Only one change to the views (or the list) at a time
+FAST_MUTEX g_VmfuncLock;
+
+BOOLEAN
+VmfuncInitialize()
+{
+    /*
+     * Work out whether the guest can switch between EPT views with VMFUNC, and if so, build every view and the EPTP
+     *  list they're in. This has to run before any LP is launched (EPTP switching is turned on in the controls every
+     *  LP is launched with), and after PmlInitialize (each view's EPTP is a copy of g_EPTView's, A/D enable and all).
+     */
+
+    PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondaryCtrls;
+    VMX_ADDRESS pool;
+    UINT32 dropped;
+    ULONG i;
+
+    ExInitializeFastMutex( &g_VmfuncLock );
+
+    // [A.11] "VM Functions"; there's nothing to switch between without EPT
+    if ( g_VMXControls.Secondary.EnableEPT == 0 || (g_VMXCapabilities.VMFunc & VM_FUNCTION_EPTP_SWITCHING) == 0 )
+    {
+        return FALSE;
+    }
+
+    // [24.6.2] "Processor-Based VM-Execution Controls"
+    secondaryCtrls = g_VMXControls.Secondary;
+    secondaryCtrls.EnableVMFUNC = 1;
+
+    VMXFixControls( &g_VMXCapabilities, VMX_CTRL_PROC_SECONDARY, secondaryCtrls.All, &dropped, NULL );
+    if ( dropped != 0 )
+    {
+        return FALSE;
+    }
+
+    // [24.6.14] "VM-Function Controls"; the list is a page (4KB aligned physical address needed)
+    if ( utlAllocateVMXData( PAGE_SIZE, TRUE, TRUE, &g_EPTPListPage ) == FALSE )
+    {
+        return FALSE;
+    }
+
+    EptListInitialize( &g_EPTPList, (PUINT64)g_EPTPListPage.VA, (UINT64)g_EPTPListPage.PA );
+
+    if ( EptListInsert( &g_EPTPList, EPT_VIEW_DEFAULT, &g_EPTView, g_VMXCapabilities.EPTVPIDCap ) == FALSE )
+    {
+        VmfuncFree();
+        return FALSE;
+    }
+
+    // Every other view is a copy of the identity map, with the same room to split large pages in
+    //    (Note: we make do with however many of them there's memory for)
+    for ( i = 1; i < EPT_VIEW_MAX; i++ )
+    {
+        if ( utlAllocateVMXData( (SIZE_T)g_EPTView.Pool.PageCount * PAGE_SIZE, TRUE, TRUE, &pool ) == FALSE )
+        {
+            break;
+        }
+
+        g_EPTAltViews[i - 1].Pool.VA = pool.VA;
+        g_EPTAltViews[i - 1].Pool.PA = (UINT64)pool.PA;
+        g_EPTAltViews[i - 1].Pool.PageCount = g_EPTView.Pool.PageCount;
+
+        // (Note: a view that didn't make it into the list is still freed by VmfuncFree)
+        if ( EptCopyView( &g_EPTAltViews[i - 1], &g_EPTView ) == FALSE ||
+             EptListInsert( &g_EPTPList, i, &g_EPTAltViews[i - 1], g_VMXCapabilities.EPTVPIDCap ) == FALSE )
+        {
+            break;
+        }
+    }
+
+    KdPrint(( "[SPTHv] %lu EPT views, of %lu table pages each, for the guest to switch between with VMFUNC\r\n", i, g_EPTView.Pool.PageCount ));
+
+    g_VMXControls.Secondary.EnableVMFUNC = 1;
+    g_VmfuncSupported = TRUE;
+
+    return TRUE;
+}
+
+VOID
+VmfuncFree()
+{
+    // Only once no LP is using them
+
+    VMX_ADDRESS pool;
+    ULONG i;
+
+    for ( i = 0; i < ARRAYSIZE( g_EPTAltViews ); i++ )
+    {
+        if ( g_EPTAltViews[i].Pool.VA == NULL )
+        {
+            continue;
+        }
+
+        pool.VA = g_EPTAltViews[i].Pool.VA;
+        pool.PA = (PVOID)g_EPTAltViews[i].Pool.PA;
+
+        utlFreeVMXData( &pool, TRUE );
+        RtlSecureZeroMemory( &g_EPTAltViews[i], sizeof(EPT_VIEW) );
+    }
+
+    if ( g_EPTPListPage.VA != NULL )
+    {
+        utlFreeVMXData( &g_EPTPListPage, TRUE );
+    }
+
+    RtlSecureZeroMemory( &g_EPTPList, sizeof(EPTP_LIST) );
+    g_VmfuncSupported = FALSE;
+}
+
+PEPT_VIEW
+VmfuncGetView(
+    _In_ CONST ULONG View
+    )
+{
+    // Whichever view has the index View, whether it's in the list right now or not; NULL if there's no such view
+
+    if ( View == EPT_VIEW_DEFAULT )
+    {
+        return &g_EPTView;
+    }
+
+    if ( View >= EPT_VIEW_MAX || g_EPTAltViews[View - 1].PML4 == NULL )
+    {
+        return NULL;
+    }
+
+    return &g_EPTAltViews[View - 1];
+}
+
+ULONG_PTR
+_VmfuncViewsLP(
+    _In_ ULONG_PTR Argument
+    )
+{
+    // KeIpiGenericCall broadcast worker; drops whatever the LP has cached of every view, and takes it out of any view that's left the list
+
+    UNREFERENCED_PARAMETER( Argument );
+
+    GuestVmcall( HYPERCALL_EPT_VIEWS, 0, 0 );
+
+    return 0;
+}
+
+NTSTATUS
+VmfuncProtectPage(
+    _In_ CONST ULONG View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Read,
+    _In_ CONST BOOLEAN Write,
+    _In_ CONST BOOLEAN Execute
+    )
+{
+    /*
+     * Set what the guest may do with the 4KB page at GuestPA while it's in View (splitting whatever large page maps it
+     *  there), and have every LP drop what it's cached of the view.
+     *
+     *  (Note: the page's other views are left as they are; that's the point of having more than one. Without EPTP
+     *  switching, there's only the default view; and an access it refuses is a #VE, or nothing at all, see "VE.c")
+     */
+
+    NTSTATUS status = STATUS_SUCCESS;
+    PEPT_VIEW view;
+
+    // [28.3.3.1] "EPT Misconfigurations"; a page can't be writable without being readable, or execute-only unless the processor says so
+    if ( (Write == TRUE && Read == FALSE) ||
+         (Execute == TRUE && Read == FALSE && g_VMXCapabilities.EPTVPIDCap.ExecuteOnly == 0) )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex( &g_VmfuncLock );
+
+    view = VmfuncGetView( View );
+
+    if ( view == NULL || GuestPA >= view->MapLimit )
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto __unlock;
+    }
+
+    // (Note: this only fails once the view's pool has no room left to split in)
+    if ( EptSetPagePermissions( view, GuestPA, Read, Write, Execute ) == FALSE )
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto __unlock;
+    }
+
+    KeIpiGenericCall( _VmfuncViewsLP, 0 );
+
+__unlock:
+    ExReleaseFastMutex( &g_VmfuncLock );
+
+    return status;
+}
+
+NTSTATUS
+VmfuncSetSuppressVE(
+    _In_ CONST ULONG View,
+    _In_ CONST UINT64 GuestPA,
+    _In_ CONST BOOLEAN Suppress
+    )
+{
+    /*
+     * Make the 4KB page at GuestPA convertible in View, or not (see EptSetSuppressVE in "EPT.c"), and have every LP
+     *  drop what it's cached of the view; like VmfuncProtectPage, this is for the default view too, with or without
+     *  EPTP switching.
+     */
+
+    NTSTATUS status = STATUS_SUCCESS;
+    PEPT_VIEW view;
+
+    ExAcquireFastMutex( &g_VmfuncLock );
+
+    view = VmfuncGetView( View );
+
+    if ( view == NULL || GuestPA >= view->MapLimit )
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto __unlock;
+    }
+
+    if ( EptSetSuppressVE( view, GuestPA, Suppress ) == FALSE )
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto __unlock;
+    }
+
+    KeIpiGenericCall( _VmfuncViewsLP, 0 );
+
+__unlock:
+    ExReleaseFastMutex( &g_VmfuncLock );
+
+    return status;
+}
+
+NTSTATUS
+VmfuncEnableView(
+    _In_ CONST ULONG View,
+    _In_ CONST BOOLEAN Enable
+    )
+{
+    /*
+     * Put View back in the EPTP list, or take it out; once it's out, a VMFUNC to it exits (and the guest gets the #UD
+     *  it would get without VM functions), and every LP that was in it is put back in the default view.
+     *
+     *  (Note: the default view is where every LP goes back to, so it's always in the list)
+     */
+
+    NTSTATUS status = STATUS_SUCCESS;
+    PEPT_VIEW view;
+
+    if ( g_VmfuncSupported == FALSE )
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ( View == EPT_VIEW_DEFAULT )
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex( &g_VmfuncLock );
+
+    view = VmfuncGetView( View );
+    if ( view == NULL )
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto __unlock;
+    }
+
+    if ( Enable == TRUE )
+    {
+        if ( EptListGetView( &g_EPTPList, View ) == NULL &&
+             EptListInsert( &g_EPTPList, View, view, g_VMXCapabilities.EPTVPIDCap ) == FALSE )
+        {
+            status = STATUS_UNSUCCESSFUL;
+            goto __unlock;
+        }
+    }
+    else
+    {
+        EptListRemove( &g_EPTPList, View );
+    }
+
+    KeIpiGenericCall( _VmfuncViewsLP, 0 );
+
+__unlock:
+    ExReleaseFastMutex( &g_VmfuncLock );
+
+    return status;
+}
+
+BOOLEAN
+VmfuncSwitchView(
+    _In_ CONST ULONG View
+    )
+{
+    /*
+     * Switch the current LP to View, without an exit; FALSE if View isn't in the EPTP list. The LP stays in it until
+     *  it switches again (or the view leaves the list, or the LP is put back by an EPT violation).
+     *
+     *  (Note: any IRQL; but not while View may be leaving the list, see VmfuncEnableView)
+     */
+
+    if ( g_VmfuncSupported == FALSE || EptListGetView( &g_EPTPList, View ) == NULL )
+    {
+        return FALSE;
+    }
+
+    GuestSwitchView( View );
+
+    return TRUE;
+}
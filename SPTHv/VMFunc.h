@@ -0,0 +1,63 @@
+#ifndef __VMFUNC_H__
+#define __VMFUNC_H__
+
+#include <ntddk.h>
+
+#include "EPTList.h"
+
+
+//
+// Globals
+//
+
+// Whether the guest can switch between our EPT views with VMFUNC (see VmfuncInitialize)
+extern BOOLEAN g_VmfuncSupported;
+
+// The EPTP list every LP shares; entry EPT_VIEW_DEFAULT is g_EPTView, and the others are copies of it
+extern EPTP_LIST g_EPTPList;
+
+
+
+//
+// Local functions
+//
+
+BOOLEAN
+VmfuncInitialize();
+
+VOID
+VmfuncFree();
+
+PEPT_VIEW
+VmfuncGetView(
+	_In_ CONST ULONG View
+	);
+
+NTSTATUS
+VmfuncProtectPage(
+	_In_ CONST ULONG View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Read,
+	_In_ CONST BOOLEAN Write,
+	_In_ CONST BOOLEAN Execute
+	);
+
+NTSTATUS
+VmfuncSetSuppressVE(
+	_In_ CONST ULONG View,
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN Suppress
+	);
+
+NTSTATUS
+VmfuncEnableView(
+	_In_ CONST ULONG View,
+	_In_ CONST BOOLEAN Enable
+	);
+
+BOOLEAN
+VmfuncSwitchView(
+	_In_ CONST ULONG View
+	);
+
+#endif // __VMFUNC_H__
@@ -1,20 +1,290 @@
 #include "VMX.h"
+#include "VMCS.h"
+
+//
+// Globals
+//
+
+VMX_CAPABILITIES g_VMXCapabilities;
+
+// One bit per VPID; set while it's in use (see VMXAllocateVPID)
+LONG64 g_VPIDsInUse[VPID_COUNT / 64];
+
+// [CPUID] "Feature Information", "Structured Extended Feature Flags", "Processor Extended State Enumeration"
+CONST VMX_PASSTHROUGH_CONTROL g_VMXPassThroughControls[VMX_PASSTHROUGH_CONTROL_COUNT] =
+{
+	{ SECONDARY_CTRL_ENABLE_RDTSCP,				0x80000001,	0,	CPUID_EDX,	(1UL << 27) },		// RDTSCP
+	{ SECONDARY_CTRL_ENABLE_INVPCID,			0x00000007,	0,	CPUID_EBX,	(1UL << 10) },		// INVPCID
+	{ SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS,		0x0000000D,	1,	CPUID_EAX,	(1UL << 3) },		// XSAVES
+	{ SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE,	0x00000007,	0,	CPUID_ECX,	(1UL << 5) },		// WAITPKG
+	{ SECONDARY_CTRL_ENABLE_PCONFIG,			0x00000007,	0,	CPUID_EDX,	(1UL << 18) },		// PCONFIG
+};
+
+
+
+UINT64
+_ReadMSR(
+	_In_ UINT32 Msr,
+	_In_opt_ PVOID Context
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+
+	return _MSR( Msr );
+}
+
+VOID
+VMXCaptureCapabilities(
+	_Out_ PVMX_CAPABILITIES Capabilities,
+	_In_opt_ VMX_MSR_READER Reader,
+	_In_opt_ PVOID Context
+	)
+{
+	/*
+	 * Read every VMX capability MSR into Capabilities, once.
+	 *
+	 *  RDMSR is serializing (and, under a nested hypervisor, a VM-exit of its own), so this is done a single
+	 *  time at load rather than every time a control field is fixed. The capability MSRs report the same
+	 *  values on every LP, so one snapshot serves them all.
+	 *
+	 *  Some of these MSRs only exist if an earlier one says so; reading one that doesn't exist is a #GP,
+	 *  so we follow the same chain of checks the SDM does ([Appendix A] "VMX Capability Reporting Facility")
+	 */
+
+	PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondaryAllowed1;
+
+	if ( Reader == NULL )
+	{
+		Reader = _ReadMSR;
+	}
+
+	RtlSecureZeroMemory( Capabilities, sizeof(VMX_CAPABILITIES) );
+
+	Capabilities->Basic.All = Reader( IA32_VMX_BASIC, Context );
+	Capabilities->Misc.All = Reader( IA32_VMX_MISC, Context );
+
+	// [A.2] "Reserved Controls and Default Settings": the 'true' MSRs are only there if IA32_VMX_BASIC[55] is set
+	if ( Capabilities->Basic.TrueControls == 1 )
+	{
+		Capabilities->Controls[VMX_CTRL_PIN_BASED] = Reader( IA32_VMX_TRUE_PINBASED_CTRLS, Context );
+		Capabilities->Controls[VMX_CTRL_PROC_PRIMARY] = Reader( IA32_VMX_TRUE_PROCBASED_CTLS, Context );
+		Capabilities->Controls[VMX_CTRL_EXIT] = Reader( IA32_VMX_TRUE_EXIT_CTLS, Context );
+		Capabilities->Controls[VMX_CTRL_ENTRY] = Reader( IA32_VMX_TRUE_ENTRY_CTLS, Context );
+	}
+	else
+	{
+		Capabilities->Controls[VMX_CTRL_PIN_BASED] = Reader( IA32_VMX_PINBASED_CTRLS, Context );
+		Capabilities->Controls[VMX_CTRL_PROC_PRIMARY] = Reader( IA32_VMX_PROCBASED_CTLS, Context );
+		Capabilities->Controls[VMX_CTRL_EXIT] = Reader( IA32_VMX_EXIT_CTLS, Context );
+		Capabilities->Controls[VMX_CTRL_ENTRY] = Reader( IA32_VMX_ENTRY_CTLS, Context );
+	}
+
+	// [A.3.3] "Secondary Processor-Based VM-Execution Controls": only there if the primary controls allow "activate secondary controls" (bit 63)
+	//    (Note: there's no 'true' version of this one)
+	if ( (Capabilities->Controls[VMX_CTRL_PROC_PRIMARY] & (1ULL << 63)) != 0 )
+	{
+		Capabilities->Controls[VMX_CTRL_PROC_SECONDARY] = Reader( IA32_VMX_PROCBASED_CTLS2, Context );
+	}
+
+	Capabilities->CR0Fixed0 = Reader( IA32_VMX_CR0_FIXED0, Context );
+	Capabilities->CR0Fixed1 = Reader( IA32_VMX_CR0_FIXED1, Context );
+	Capabilities->CR4Fixed0 = Reader( IA32_VMX_CR4_FIXED0, Context );
+	Capabilities->CR4Fixed1 = Reader( IA32_VMX_CR4_FIXED1, Context );
+
+	Capabilities->VMCSEnum = Reader( IA32_VMX_VMCS_ENUM, Context );
+
+	secondaryAllowed1.All = (UINT32)(Capabilities->Controls[VMX_CTRL_PROC_SECONDARY] >> 32);
+
+	// [A.10] "VPID and EPT Capabilities": only there if either EPT or VPIDs may be enabled
+	if ( secondaryAllowed1.EnableEPT == 1 || secondaryAllowed1.EnableVPID == 1 )
+	{
+		Capabilities->EPTVPIDCap.All = Reader( IA32_VMX_EPT_VPID_CAP, Context );
+	}
+
+	// [A.11] "VM Functions": only there if VM functions may be enabled
+	if ( secondaryAllowed1.EnableVMFUNC == 1 )
+	{
+		Capabilities->VMFunc = Reader( IA32_VMX_VMFUNC, Context );
+	}
+}
+
+UINT32
+VMXFixControls(
+	_In_ CONST VMX_CAPABILITIES* Capabilities,
+	_In_ CONST VMX_CONTROL_FIELD Field,
+	_In_ CONST UINT32 Requested,
+	_Out_opt_ UINT32* Dropped,
+	_Out_opt_ UINT32* Forced
+	)
+{
+	/*
+	 * Fix a requested control value to what this processor allows, reporting what changed: bits we asked
+	 *  for which the processor doesn't support (Dropped), and bits we didn't ask for which it requires (Forced)
+	 */
+
+	UINT32 fixed = _FIX_CTRL_BITS( Requested, Capabilities->Controls[Field] );
+
+	if ( Dropped != NULL )
+	{
+		*Dropped = Requested & ~fixed;
+	}
+
+	if ( Forced != NULL )
+	{
+		*Forced = fixed & ~Requested;
+	}
+
+	return fixed;
+}
 
 UINT32
-FixCtrlBits(
-	_In_ UINT32 CtrlVal,
-	_In_ UINT32 StandardMSR,
-	_In_ UINT32 TrueMSR
+VMXPassThroughControls(
+	_In_ CONST VMX_CAPABILITIES* Capabilities,
+	_In_opt_ CPUID_READER Reader,
+	_In_opt_ PVOID Context,
+	_Out_opt_ UINT32* Unavailable,
+	_Out_writes_opt_(VMX_PASSTHROUGH_CONTROL_COUNT) PCPUID_OVERRIDE Hidden
 	)
 {
-	VMX_BASIC_INFO basicInfo = { 0 };
+	/*
+	 * The secondary controls for every instruction in g_VMXPassThroughControls the host has, that this processor lets
+	 *  us set; and those it doesn't (Unavailable), which would leave the guest to #UD on an instruction its CPUID says
+	 *  it has. Hidden gets one override per entry, that clears the feature flag of each of those from the guest's
+	 *  CPUID (and leaves it alone, with a Mask of 0, for the rest).
+	 *
+	 *  (Note: a leaf past the highest one in its range isn't asked for, as CPUID answers those with some other leaf)
+	 */
+
+	CPUID_ENTRY entry;
+	UINT32 maxBasic, maxExtended;
+	UINT32 wanted = 0, fixed;
+	UINT32 features[VMX_PASSTHROUGH_CONTROL_COUNT] = { 0 };
+	ULONG i;
+
+	if ( Reader == NULL )
+	{
+		Reader = CpuidRead;
+	}
+
+	Reader( 0, 0, &entry, Context );
+	maxBasic = entry.Eax;
+
+	Reader( CPUID_EXTENDED_BASE, 0, &entry, Context );
+	maxExtended = entry.Eax;
+
+	for ( i = 0; i < VMX_PASSTHROUGH_CONTROL_COUNT; i++ )
+	{
+		if ( g_VMXPassThroughControls[i].Leaf > ((g_VMXPassThroughControls[i].Leaf >= CPUID_EXTENDED_BASE) ? maxExtended : maxBasic) )
+		{
+			continue;
+		}
+
+		Reader( g_VMXPassThroughControls[i].Leaf, g_VMXPassThroughControls[i].Subleaf, &entry, Context );
+
+		if ( ((PUINT32)&entry)[g_VMXPassThroughControls[i].Register] & g_VMXPassThroughControls[i].Feature )
+		{
+			wanted |= g_VMXPassThroughControls[i].Control;
+			features[i] = g_VMXPassThroughControls[i].Feature;
+		}
+	}
+
+	// [A.3.3] "Secondary Processor-Based VM-Execution Controls"
+	fixed = VMXFixControls( Capabilities, VMX_CTRL_PROC_SECONDARY, wanted, NULL, NULL );
+
+	if ( Unavailable != NULL )
+	{
+		*Unavailable = wanted & ~fixed;
+	}
+
+	for ( i = 0; Hidden != NULL && i < VMX_PASSTHROUGH_CONTROL_COUNT; i++ )
+	{
+		Hidden[i].Leaf = g_VMXPassThroughControls[i].Leaf;
+		Hidden[i].Subleaf = g_VMXPassThroughControls[i].Subleaf;
+		Hidden[i].Register = g_VMXPassThroughControls[i].Register;
+		Hidden[i].Mask = ((fixed & g_VMXPassThroughControls[i].Control) == 0) ? features[i] : 0;
+		Hidden[i].Value = 0;
+	}
+
+	return wanted & fixed;
+}
+
+UINT16
+VMXAllocateVPID()
+{
+	// The lowest VPID not already in use, or 0 (the host's) if there are none left
 
-	basicInfo.All = _MSR( IA32_VMX_BASIC );
+	ULONG vpid;
+
+	for ( vpid = 1; vpid < VPID_COUNT; vpid++ )
+	{
+		if ( InterlockedBitTestAndSet64( &g_VPIDsInUse[vpid / 64], vpid % 64 ) == 0 )
+		{
+			return (UINT16)vpid;
+		}
+	}
+
+	return 0;
+}
+
+VOID
+VMXFreeVPID(
+	_In_ CONST UINT16 VPID
+	)
+{
+	if ( VPID != 0 )
+	{
+		InterlockedBitTestAndReset64( &g_VPIDsInUse[VPID / 64], VPID % 64 );
+	}
+}
+
+VMX_STATUS_CODE
+VMXInvalidateVPID(
+	_In_ CONST UINT16 VPID,
+	_In_ CONST VPID_INVALIDATION Scope,
+	_In_opt_ CONST UINT64 LinearAddress
+	)
+{
+	/*
+	 * Invalidate the translations Scope describes ([28.3.3.3] "Guidelines for Use of the INVVPID Instruction"),
+	 *  using the narrowest INVVPID type this processor supports which covers all of them ([A.10] "VPID and EPT
+	 *  Capabilities"). Invalidating more than was asked for is always correct; it just costs the guest TLB misses.
+	 *
+	 *  (Note: an INVLPG invalidates the address's global translations as well ([4.10.4.1] "Operations that
+	 *   Invalidate TLBs and Paging-Structure Caches"), so the single-context type that retains globals is only
+	 *   wide enough to stand in for a MOV to CR3; an address falls back to single-context, or all-contexts)
+	 */
+
+	INVVPID_DESCRIPTOR descriptor;
+	VMX_EPT_VPID_CAP cap = g_VMXCapabilities.EPTVPIDCap;
+
+	descriptor.VPID = VPID;
+	descriptor.Reserved0 = 0;
+	descriptor.LinearAddress = LinearAddress;
+
+	if ( cap.INVVPID == 0 )
+	{
+		return VMX_ERROR;
+	}
+
+	if ( Scope == VPID_INVALIDATE_ADDRESS && cap.INVVPIDIndividualAddress == 1 )
+	{
+		return __invvpid( INVVPID_INDIVIDUAL_ADDRESS, &descriptor );
+	}
+
+	if ( Scope == VPID_INVALIDATE_NON_GLOBAL && cap.INVVPIDSingleContextRetainGlobals == 1 )
+	{
+		return __invvpid( INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS, &descriptor );
+	}
+
+	if ( Scope != VPID_INVALIDATE_ALL && cap.INVVPIDSingleContext == 1 )
+	{
+		return __invvpid( INVVPID_SINGLE_CONTEXT, &descriptor );
+	}
 
-	if ( basicInfo.TrueControls == 0 || StandardMSR == IA32_VMX_PROCBASED_CTLS2 )
+	if ( cap.INVVPIDAllContexts == 1 )
 	{
-		return _FIX_CTRL_BITS(CtrlVal, _MSR(StandardMSR));
+		return __invvpid( INVVPID_ALL_CONTEXTS, &descriptor );
 	}
 
-	return _FIX_CTRL_BITS(CtrlVal, _MSR(TrueMSR));
+	return VMX_ERROR;
 }
@@ -3,6 +3,7 @@
 
 #include <intrin.h>
 #include "MSR.h"
+#include "CPUIDTable.h"
 
 #define VMX_ALLOCATION_DEFAULT_MAX 0x1000
 
@@ -154,11 +155,184 @@ typedef enum _VMX_BASIC_EXIT_REASON
 	REASON_TPAUSE
 } VMX_BASIC_EXIT_REASON;
 
+#define VMX_MAX_BASIC_EXIT_REASON REASON_TPAUSE
+
+// The VMCS control fields whose allowed settings are reported via capability MSRs ([A.3] - [A.5])
+typedef enum _VMX_CONTROL_FIELD
+{
+	VMX_CTRL_PIN_BASED,
+	VMX_CTRL_PROC_PRIMARY,
+	VMX_CTRL_PROC_SECONDARY,
+	VMX_CTRL_EXIT,
+	VMX_CTRL_ENTRY,
+	VMX_CTRL_COUNT
+} VMX_CONTROL_FIELD;
+
+/*
+ * Every VMX capability MSR we make use of, read once (see VMXCaptureCapabilities) and shared by every LP.
+ *
+ *  Each entry in Controls is the raw capability MSR for that control field; the 'true' MSR wherever the
+ *  processor supports it. The low 32 bits are the allowed 0-settings (bits which must be 1), and the
+ *  high 32 bits are the allowed 1-settings (bits which may be 1) ([A.3.1] "Pin-Based VM-Execution Controls").
+ *
+ *  MSRs the processor doesn't support (per the capabilities that come before them) are left zeroed.
+ */
+typedef struct _VMX_CAPABILITIES
+{
+	VMX_BASIC_INFO Basic;
+	VMX_MISC_INFO Misc;
+
+	UINT64 Controls[VMX_CTRL_COUNT];
+
+	UINT64 CR0Fixed0;
+	UINT64 CR0Fixed1;
+	UINT64 CR4Fixed0;
+	UINT64 CR4Fixed1;
+
+	UINT64 VMCSEnum;
+	VMX_EPT_VPID_CAP EPTVPIDCap;
+	UINT64 VMFunc;
+} VMX_CAPABILITIES, *PVMX_CAPABILITIES;
+
+/*
+ * [25.3] "Changes to Instruction Behavior in VMX Non-Root Operation"
+ *
+ *  A few instructions never exit, but #UD in VMX non-root operation unless a secondary control is set. Our guest is
+ *  the OS we were loaded into, which uses every one of them its CPUID reports, at any IRQL (RDTSCP in its interrupt
+ *  paths, say); so each is paired with the feature flag that says the host has it (see VMXPassThroughControls).
+ */
+typedef struct _VMX_PASSTHROUGH_CONTROL
+{
+	UINT32 Control;					// The secondary control (SECONDARY_CTRL_*, see "VMCS.h")
+	UINT32 Leaf;
+	UINT32 Subleaf;
+	CPUID_REGISTER Register;
+	UINT32 Feature;					// The feature flag, in Register
+} VMX_PASSTHROUGH_CONTROL, *PVMX_PASSTHROUGH_CONTROL;
+
+#define VMX_PASSTHROUGH_CONTROL_COUNT		5
+
+// Where VMXCaptureCapabilities gets its MSRs from; __readmsr unless told otherwise (such as from a recorded dump)
+typedef UINT64 (*VMX_MSR_READER)(
+	_In_ UINT32 Msr,
+	_In_opt_ PVOID Context
+	);
+
+
+
+// [30.3] "VMX Instructions", INVEPT; "INVEPT Descriptor"
+typedef enum _INVEPT_TYPE
+{
+	INVEPT_SINGLE_CONTEXT = 1,
+	INVEPT_ALL_CONTEXTS
+} INVEPT_TYPE;
+
+typedef struct _INVEPT_DESCRIPTOR
+{
+	UINT64 EPTP;
+	UINT64 Reserved0;
+} INVEPT_DESCRIPTOR, *PINVEPT_DESCRIPTOR;
+
+// [30.3] "VMX Instructions", INVVPID; "INVVPID Descriptor"
+typedef enum _INVVPID_TYPE
+{
+	INVVPID_INDIVIDUAL_ADDRESS,
+	INVVPID_SINGLE_CONTEXT,
+	INVVPID_ALL_CONTEXTS,
+	INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS
+} INVVPID_TYPE;
+
+typedef struct _INVVPID_DESCRIPTOR
+{
+	UINT64 VPID : 16;
+	UINT64 Reserved0 : 48;
+	UINT64 LinearAddress;
+} INVVPID_DESCRIPTOR, *PINVVPID_DESCRIPTOR;
+
+// What a call to VMXInvalidateVPID has to invalidate, from narrowest to broadest; a scope the processor can't
+//	invalidate on its own is widened to the narrowest INVVPID type that covers all of it (which, for an address,
+//	isn't the one retaining globals)
+typedef enum _VPID_INVALIDATION
+{
+	VPID_INVALIDATE_ADDRESS,		// The translations for one linear address, in one VPID (an INVLPG)
+	VPID_INVALIDATE_NON_GLOBAL,		// Every non-global translation in one VPID (a MOV to CR3)
+	VPID_INVALIDATE_CONTEXT,		// Every translation in one VPID
+	VPID_INVALIDATE_ALL				// Every translation in every VPID
+} VPID_INVALIDATION;
+
+// VPIDs are 16 bits wide, and 0 belongs to the host ([28.1] "Virtual Processor Identifiers (VPIDs)")
+#define VPID_COUNT							0x10000
+
+
+
+//
+// External VMX instruction functions not already provided by intrinsics (see "vmxintrin.asm")
+//
+
+extern VMX_STATUS_CODE __invept(
+	_In_ INVEPT_TYPE Type,
+	_In_ PINVEPT_DESCRIPTOR Descriptor
+	);
+
+extern VMX_STATUS_CODE __invvpid(
+	_In_ INVVPID_TYPE Type,
+	_In_ PINVVPID_DESCRIPTOR Descriptor
+	);
+
+
+
+//
+// Globals
+//
+
+extern VMX_CAPABILITIES g_VMXCapabilities;
+
+extern CONST VMX_PASSTHROUGH_CONTROL g_VMXPassThroughControls[VMX_PASSTHROUGH_CONTROL_COUNT];
+
+
+
+//
+// Local functions
+//
+
+VOID
+VMXCaptureCapabilities(
+	_Out_ PVMX_CAPABILITIES Capabilities,
+	_In_opt_ VMX_MSR_READER Reader,
+	_In_opt_ PVOID Context
+	);
+
+UINT32
+VMXFixControls(
+	_In_ CONST VMX_CAPABILITIES* Capabilities,
+	_In_ CONST VMX_CONTROL_FIELD Field,
+	_In_ CONST UINT32 Requested,
+	_Out_opt_ UINT32* Dropped,
+	_Out_opt_ UINT32* Forced
+	);
+
 UINT32
-FixCtrlBits(
-	_In_ UINT32 CtrlVal,
-	_In_ UINT32 StandardMSR,
-	_In_ UINT32 TrueMSR
+VMXPassThroughControls(
+	_In_ CONST VMX_CAPABILITIES* Capabilities,
+	_In_opt_ CPUID_READER Reader,
+	_In_opt_ PVOID Context,
+	_Out_opt_ UINT32* Unavailable,
+	_Out_writes_opt_(VMX_PASSTHROUGH_CONTROL_COUNT) PCPUID_OVERRIDE Hidden
+	);
+
+UINT16
+VMXAllocateVPID();
+
+VOID
+VMXFreeVPID(
+	_In_ CONST UINT16 VPID
+	);
+
+VMX_STATUS_CODE
+VMXInvalidateVPID(
+	_In_ CONST UINT16 VPID,
+	_In_ CONST VPID_INVALIDATION Scope,
+	_In_opt_ CONST UINT64 LinearAddress
 	);
 
 #endif // __VMX_H__
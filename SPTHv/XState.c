@@ -0,0 +1,233 @@
+#include "XState.h"
+#include "CPU.h"
+
+/*
+ * Notes for testing:
+ *
+ * XStateSelectMask, XStateIsValidXCR0 and XStateSelectInstruction are plain bit arithmetic on values the caller
+ *  reads (from CPUID and XGETBV); they touch nothing else. XStateSave and XStateRestore only ever touch the
+ *  context they're given, and the components it says; the exit benchmark suite times one round of them on
+ *  every run (see HYPERCALL_BENCH_XSTATE in "Exit.c").
+ *
+ * Nothing on the common exit path touches the guest's extended state; VMExitStub saves XMM0-5 (the volatile
+ *  registers our compiled code may use), and every other register is left exactly as the guest had it. An exit
+ *  handler that needs more than that (the upper halves of the YMM/ZMM registers, the opmasks, x87) asks for
+ *  exactly those components with XStateSave, and the guest's values go back before it's resumed.
+ */
+
+XSTATE_FEATURES g_XStateFeatures;
+
+UINT64
+XStateSelectMask(
+    _In_ CONST UINT64 Requested,
+    _In_ CONST UINT64 XCR0,
+    _In_ CONST UINT64 Components
+    )
+{
+    /*
+     * The smallest mask that covers the registers Requested's components make up, of those the guest has
+     *  enabled in XCR0 (an XSAVE of anything else would #GP, or save nothing) and that fit our area.
+     *
+     *  (Note: a YMM register is its XMM register plus its AVX upper half, and ZMM0-15 are their YMM register
+     *  plus their ZMM_Hi256 upper half; ZMM16-31 (Hi16_ZMM) and the opmasks stand on their own)
+     */
+
+    UINT64 mask = Requested & XSTATE_VMM_COMPONENTS;
+
+    if ( (mask & XSTATE_ZMM_HI256) != 0 )
+    {
+        mask |= XSTATE_AVX;
+    }
+
+    if ( (mask & XSTATE_AVX) != 0 )
+    {
+        mask |= XSTATE_SSE;
+    }
+
+    return mask & XCR0 & Components;
+}
+
+BOOLEAN
+XStateIsValidXCR0(
+    _In_ CONST UINT32 Index,
+    _In_ CONST UINT64 Value,
+    _In_ CONST UINT64 SupportedXCR0
+    )
+{
+    // Whether XSETBV would load Value into XCR[Index], rather than #GP ([13.3] "Enabling the XSAVE Feature Set and XSAVE-Enabled Features")
+
+    // XCR0 is the only one that can be written
+    if ( Index != 0 )
+    {
+        return FALSE;
+    }
+
+    if ( (Value & ~SupportedXCR0) != 0 || (Value & XSTATE_X87) == 0 )
+    {
+        return FALSE;
+    }
+
+    if ( (Value & XSTATE_AVX) != 0 && (Value & XSTATE_SSE) == 0 )
+    {
+        return FALSE;
+    }
+
+    // AVX-512 is all three components or none of them, and needs AVX
+    if ( (Value & XSTATE_AVX512) != 0 &&
+         ((Value & XSTATE_AVX512) != XSTATE_AVX512 || (Value & (XSTATE_SSE | XSTATE_AVX)) != (XSTATE_SSE | XSTATE_AVX)) )
+    {
+        return FALSE;
+    }
+
+    // MPX's and AMX's two components each go together
+    if ( ((Value & XSTATE_BNDREGS) != 0) != ((Value & XSTATE_BNDCSR) != 0) ||
+         ((Value & XSTATE_TILECFG) != 0) != ((Value & XSTATE_TILEDATA) != 0) )
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+XSTATE_INSTRUCTION
+XStateSelectInstruction(
+    _In_ CONST UINT32 Leaf0DSubleaf1EAX
+    )
+{
+    // CPUID.(EAX=0DH,ECX=1):EAX[3] is XSAVES/XRSTORS (and IA32_XSS), and [0] is XSAVEOPT
+
+    if ( (Leaf0DSubleaf1EAX & (1 << 3)) != 0 )
+    {
+        return XSTATE_INSTRUCTION_XSAVES;
+    }
+
+    if ( (Leaf0DSubleaf1EAX & (1 << 0)) != 0 )
+    {
+        return XSTATE_INSTRUCTION_XSAVEOPT;
+    }
+
+    return XSTATE_INSTRUCTION_XSAVE;
+}
+
+BOOLEAN
+XStateInitialize()
+{
+    // Work out which components (and which instructions) exit handlers can borrow the guest's extended state with
+
+    int cpuInfo[4];
+    UINT64 component;
+    CR4 cr4;
+    ULONG i;
+
+    RtlSecureZeroMemory( &g_XStateFeatures, sizeof(XSTATE_FEATURES) );
+
+    // The guest (and so the host) has to have turned XSAVE on; XGETBV and XSETBV #UD otherwise
+    cr4.All = __readcr4();
+    if ( cr4.OSXSAVE == 0 )
+    {
+        return FALSE;
+    }
+
+    __cpuidex( cpuInfo, XSTATE_CPUID_LEAF, 0 );
+    g_XStateFeatures.SupportedXCR0 = ((UINT64)(UINT32)cpuInfo[3] << 32) | (UINT32)cpuInfo[0];
+
+    // x87 and SSE live in the legacy region; every other component is wherever CPUID.(EAX=0DH,ECX=i) says (EBX), in the standard format
+    g_XStateFeatures.Components = XSTATE_X87 | XSTATE_SSE;
+
+    for ( i = 2; i < 64; i++ )
+    {
+        component = 1ULL << i;
+
+        if ( (XSTATE_VMM_COMPONENTS & g_XStateFeatures.SupportedXCR0 & component) == 0 )
+        {
+            continue;
+        }
+
+        __cpuidex( cpuInfo, XSTATE_CPUID_LEAF, i );
+
+        if ( (UINT64)(UINT32)cpuInfo[1] + (UINT32)cpuInfo[0] <= XSTATE_AREA_SIZE )
+        {
+            g_XStateFeatures.Components |= component;
+        }
+    }
+
+    // (Note: AVX-512 is no use in part)
+    if ( (g_XStateFeatures.Components & XSTATE_AVX512) != XSTATE_AVX512 )
+    {
+        g_XStateFeatures.Components &= ~XSTATE_AVX512;
+    }
+
+    __cpuidex( cpuInfo, XSTATE_CPUID_LEAF, 1 );
+    g_XStateFeatures.Instruction = XStateSelectInstruction( (UINT32)cpuInfo[0] );
+
+    return TRUE;
+}
+
+UINT64
+XStateSave(
+    _Inout_ PXSTATE_CONTEXT Context,
+    _In_ CONST UINT64 Requested
+    )
+{
+    /*
+     * Save the guest's values of the components an exit handler is about to use (see XStateSelectMask), and return
+     *  the ones it may now use; it mustn't touch any others. Whatever it saved is put back by XStateRestore.
+     *
+     *  (Note: only the first call of an exit saves anything; XSAVES lays the area out for the components it
+     *  saves, so there's no adding to it afterwards. A handler asks for everything it needs up front)
+     */
+
+    UINT64 mask;
+
+    if ( Context->SavedMask != 0 )
+    {
+        return Context->SavedMask & XStateSelectMask( Requested, MAXUINT64, MAXUINT64 );
+    }
+
+    if ( g_XStateFeatures.Instruction == XSTATE_INSTRUCTION_NONE || Context->Area == NULL )
+    {
+        return 0;
+    }
+
+    // (Note: the guest's XCR0 is ours too, so that's the one to read)
+    mask = XStateSelectMask( Requested, _xgetbv( 0 ), g_XStateFeatures.Components );
+    if ( mask == 0 )
+    {
+        return 0;
+    }
+
+    switch ( g_XStateFeatures.Instruction )
+    {
+        case XSTATE_INSTRUCTION_XSAVES:     _xsaves64( Context->Area, mask );       break;
+        case XSTATE_INSTRUCTION_XSAVEOPT:   _xsaveopt64( Context->Area, mask );     break;
+        default:                            _xsave64( Context->Area, mask );        break;
+    }
+
+    Context->SavedMask = mask;
+
+    return mask;
+}
+
+VOID
+XStateRestore(
+    _Inout_ PXSTATE_CONTEXT Context
+    )
+{
+    // Put back whatever XStateSave saved this exit (components the guest had in their initial state are reinitialized)
+
+    if ( Context->SavedMask == 0 )
+    {
+        return;
+    }
+
+    if ( g_XStateFeatures.Instruction == XSTATE_INSTRUCTION_XSAVES )
+    {
+        _xrstors64( Context->Area, Context->SavedMask );
+    }
+    else
+    {
+        _xrstor64( Context->Area, Context->SavedMask );
+    }
+
+    Context->SavedMask = 0;
+}
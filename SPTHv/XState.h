@@ -0,0 +1,122 @@
+#ifndef __XSTATE_H__
+#define __XSTATE_H__
+
+#include <ntddk.h>
+#include <intrin.h>
+
+/*
+ * [13.1] "XSAVE-Supported Features and State-Component Bitmaps"
+ *
+ *  Each bit of XCR0 (and of the masks XSAVE and XRSTOR take) is a state component; an XSAVE area holds the
+ *  components asked for, and nothing else. The VMM only ever borrows the user components below; the x87,
+ *  SSE (XMM0-15 and MXCSR), AVX (the upper halves of YMM0-15) and AVX-512 (opmasks, the upper halves of
+ *  ZMM0-15, and ZMM16-31) state.
+ */
+#define XSTATE_X87							(1ULL << 0)
+#define XSTATE_SSE							(1ULL << 1)
+#define XSTATE_AVX							(1ULL << 2)
+#define XSTATE_BNDREGS						(1ULL << 3)
+#define XSTATE_BNDCSR						(1ULL << 4)
+#define XSTATE_OPMASK						(1ULL << 5)
+#define XSTATE_ZMM_HI256					(1ULL << 6)
+#define XSTATE_HI16_ZMM						(1ULL << 7)
+#define XSTATE_TILECFG						(1ULL << 17)
+#define XSTATE_TILEDATA						(1ULL << 18)
+
+#define XSTATE_AVX512						(XSTATE_OPMASK | XSTATE_ZMM_HI256 | XSTATE_HI16_ZMM)
+
+// Every component XStateSave may be asked for
+#define XSTATE_VMM_COMPONENTS				(XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_AVX512)
+
+// [13.2] "Enumeration of CPU Support for XSAVE Instructions and XSAVE-Supported Features"
+#define XSTATE_CPUID_LEAF					0xD
+
+// [13.4] "XSAVE Area"; the legacy region and header come first, and the area has to be 64-byte aligned
+#define XSTATE_LEGACY_HEADER_SIZE			576
+#define XSTATE_AREA_ALIGNMENT				64
+
+// Each LP's XSAVE area (see _AllocateLP in "Driver.c"); the standard-format VMM components end well within it (at 2688 bytes)
+#define XSTATE_AREA_SIZE					PAGE_SIZE
+
+// The save/restore instructions we use; the best the processor has (see XStateSelectInstruction)
+typedef enum _XSTATE_INSTRUCTION
+{
+	XSTATE_INSTRUCTION_NONE,		// No XSAVE at all; nothing can be borrowed
+	XSTATE_INSTRUCTION_XSAVE,		// XSAVE/XRSTOR
+	XSTATE_INSTRUCTION_XSAVEOPT,	// XSAVEOPT/XRSTOR; skips components in their initial state, or unmodified since the last XRSTOR
+	XSTATE_INSTRUCTION_XSAVES		// XSAVES/XRSTORS; as XSAVEOPT, into the compacted format (only the components saved take up room)
+} XSTATE_INSTRUCTION;
+
+// What the processor tells us about XSAVE (see XStateInitialize)
+typedef struct _XSTATE_FEATURES
+{
+	// The XCR0 bits the processor supports (CPUID.(EAX=0DH,ECX=0):EDX:EAX)
+	UINT64 SupportedXCR0;
+
+	// The VMM components whose standard-format offset and size fit in XSTATE_AREA_SIZE (see XStateInitialize)
+	UINT64 Components;
+
+	XSTATE_INSTRUCTION Instruction;
+} XSTATE_FEATURES, *PXSTATE_FEATURES;
+
+/*
+ * The guest's extended state an exit handler has borrowed on an LP; the guest's values of SavedMask's components
+ *  are in Area until XStateRestore puts them back (which VMExitDispatch does before resuming the guest).
+ *
+ *  (Note: XMM0-5 are saved by VMExitStub on every exit, and are the guest's in GUEST_REGISTERS; the copies in Area
+ *  may already have been overwritten by the time it's saved)
+ */
+typedef struct _XSTATE_CONTEXT
+{
+	PVOID Area;
+	UINT64 SavedMask;
+} XSTATE_CONTEXT, *PXSTATE_CONTEXT;
+
+
+
+//
+// Globals
+//
+
+extern XSTATE_FEATURES g_XStateFeatures;
+
+
+
+//
+// Local functions
+//
+
+UINT64
+XStateSelectMask(
+	_In_ CONST UINT64 Requested,
+	_In_ CONST UINT64 XCR0,
+	_In_ CONST UINT64 Components
+	);
+
+BOOLEAN
+XStateIsValidXCR0(
+	_In_ CONST UINT32 Index,
+	_In_ CONST UINT64 Value,
+	_In_ CONST UINT64 SupportedXCR0
+	);
+
+XSTATE_INSTRUCTION
+XStateSelectInstruction(
+	_In_ CONST UINT32 Leaf0DSubleaf1EAX
+	);
+
+BOOLEAN
+XStateInitialize();
+
+UINT64
+XStateSave(
+	_Inout_ PXSTATE_CONTEXT Context,
+	_In_ CONST UINT64 Requested
+	);
+
+VOID
+XStateRestore(
+	_Inout_ PXSTATE_CONTEXT Context
+	);
+
+#endif // __XSTATE_H__
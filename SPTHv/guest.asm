@@ -1,7 +1,207 @@
+; 
+; This is the assembly source file for code which is only ever meant to be run by the guest
+;  (that is, in VMX non-root operation); chiefly the hypercall interface to our VMM
+; 
+
+;
+; Benchmark payloads (see "Bench.c")
+;
+;  Each of these runs `rcx` iterations of a single exiting instruction, and stores the number of
+;  TSC ticks each one took to the UINT64 array at `rdx`; `r8` is an argument for the instruction
+;  (an MSR, port or hypercall number). Every iteration is bracketed by a fenced RDTSC, so that nothing
+;  before or after it bleeds into the measurement
+;
+
+BENCH_PROLOGUE MACRO
+	push rbx
+	push rsi
+	push rdi
+	mov rsi, rcx		; Iterations
+	mov rdi, rdx		; Samples
+	mov r9, r8			; Argument
+ENDM
+
+BENCH_EPILOGUE MACRO
+	pop rdi
+	pop rsi
+	pop rbx
+	ret
+ENDM
+
+BENCH_START MACRO
+	lfence
+	rdtsc
+	lfence
+	shl rdx, 32
+	or rax, rdx
+	mov r10, rax
+ENDM
+
+BENCH_STOP MACRO
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r10
+	mov [rdi], rax
+	add rdi, 8
+ENDM
+
 .code
 
-GuestEntry PROC
-	HLT
-GuestEntry ENDP
+;
+; Issue a hypercall to the VMM (see HYPERCALL_* in "Exit.h")
+;
+;  The hypercall number is already in RCX, and its arguments in RDX and R8, per the
+;  calling convention; the VMM returns its result in RAX
+;
+GuestVmcall PROC
+	vmcall
+	ret
+GuestVmcall ENDP
+
+;
+; Switch this LP to another EPT view (see VmfuncSwitchView in "VMFunc.c")
+;
+;  VMFUNC leaf 0 (EPTP switching) takes the index of the view in the EPTP list in ECX, which is
+;  where the calling convention already put it; there's no exit, unless the entry isn't valid
+;
+GuestSwitchView PROC
+	xor eax, eax
+	db 0Fh, 01h, 0D4h			; VMFUNC
+	ret
+GuestSwitchView ENDP
+
+GuestBenchCPUID PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+_loop:
+	BENCH_START
+	xor eax, eax
+	xor ecx, ecx
+	cpuid
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchCPUID ENDP
+
+GuestBenchRDMSR PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+_loop:
+	BENCH_START
+	mov ecx, r9d
+	rdmsr
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchRDMSR ENDP
+
+GuestBenchWRMSR PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+	; Write back whatever the MSR already holds
+	mov ecx, r9d
+	rdmsr
+	mov r11d, eax
+	mov ebx, edx
+
+_loop:
+	BENCH_START
+	mov ecx, r9d
+	mov eax, r11d
+	mov edx, ebx
+	wrmsr
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchWRMSR ENDP
+
+GuestBenchVMCALL PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+_loop:
+	BENCH_START
+	mov rcx, r9
+	xor edx, edx
+	xor r8d, r8d
+	vmcall
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchVMCALL ENDP
+
+GuestBenchIO PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+_loop:
+	BENCH_START
+	mov edx, r9d
+	xor eax, eax
+	out dx, al
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchIO ENDP
+
+GuestBenchCR3 PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+	; Reload CR3 with the value it already holds
+	mov r11, cr3
+
+_loop:
+	BENCH_START
+	mov cr3, r11
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchCR3 ENDP
+
+GuestBenchHLT PROC
+	BENCH_PROLOGUE
+	test rsi, rsi
+	jz _done
+
+_loop:
+	BENCH_START
+	hlt
+	BENCH_STOP
+	dec rsi
+	jnz _loop
+
+_done:
+	BENCH_EPILOGUE
+GuestBenchHLT ENDP
 
 end
@@ -0,0 +1,248 @@
+; 
+; This is the assembly source file for the VMM (host) side of our VMX operation; that is, launching
+;  the current LP as a guest, and the entry point for every VM-exit thereafter (VMCS_HOST_RIP)
+; 
+
+EXTERN VMExitDispatch : PROC
+EXTERN VMResumeFailure : PROC
+EXTERN g_TraceEnabled : DWORD
+
+; [Appendix B] "Field Encoding in VMCS" (see "VMCS.h")
+VMCS_RO_EXIT_REASON			EQU		4402h
+VMCS_RO_VM_EXIT_INSTR_LEN	EQU		440Ch
+VMCS_GUEST_RSP				EQU		681Ch
+VMCS_GUEST_RIP				EQU		681Eh
+
+; [Appendix C] "VMX Basic Exit Reasons" (see "VMX.h")
+REASON_CPUID		EQU		10
+
+; CPUID_TABLE (see "CPUIDTable.h")
+CPUID_RANGE_COUNT			EQU		3
+CPUID_RANGE_LEAVES			EQU		64
+CPUID_SLOT_ANY_SUBLEAF		EQU		1h
+CPUID_SLOT_LIVE				EQU		2h
+CPUID_SLOT_CR4				EQU		4h
+CPUID_TABLE_ENTRIES			EQU		300h
+CPUID_TABLE_FAST_HITS		EQU		1300h
+
+; VMX_STATUS_CODE (see "VMX.h")
+VMX_OK				EQU		0
+VMX_ERROR_STATUS	EQU		1
+VMX_ERROR			EQU		2
+
+.code
+
+;
+; Launch the current LP as a guest, using its current (and fully configured) VMCS
+;
+;  The guest picks up right where we left off, on the same stack, so that (as the guest) this
+;  function simply returns VMX_OK to its caller. If the VMLAUNCH fails, we're still the host,
+;  and return VMX_ERROR_STATUS or VMX_ERROR (see [30.2] "Conventions")
+;
+VMLaunchLP PROC
+	pushfq
+	push rbx
+	push rbp
+	push rsi
+	push rdi
+	push r12
+	push r13
+	push r14
+	push r15
+
+	; The guest resumes at _guest_resume, with the stack as it is right now
+	mov rcx, VMCS_GUEST_RSP
+	vmwrite rcx, rsp
+	mov rcx, VMCS_GUEST_RIP
+	lea rdx, _guest_resume
+	vmwrite rcx, rdx
+
+	; VMLAUNCH leaves the GPRs alone, so the guest starts with RAX = VMX_OK
+	xor eax, eax
+	vmlaunch
+
+	; We only get here if VMLAUNCH failed (CF indicates VMfailInvalid, ZF indicates VMfailValid)
+	mov eax, VMX_ERROR
+	jc _ep
+	mov eax, VMX_ERROR_STATUS
+
+_guest_resume:
+_ep:
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rdi
+	pop rsi
+	pop rbp
+	pop rbx
+	popfq
+	ret
+VMLaunchLP ENDP
+
+
+;
+; The VM-exit entry point (VMCS_HOST_RIP)
+;
+;  RSP is the top of this LP's host stack (less HOST_STACK_RESERVED), where the PLP_INFO lives.
+;  The guest GPRs and volatile XMM registers are saved into a GUEST_REGISTERS frame on the stack
+;  (see "Exit.h"), the dispatcher is called, and the guest is resumed with whatever the dispatcher
+;  left in the frame. There's deliberately nothing else in here; it runs on every single exit.
+;
+;  The one exception is a CPUID whose answer is in this LP's table (see CpuidTableLookup in
+;  "CPUIDTable.c"); that's answered right here, with three scratch registers, and the guest resumed
+;  without ever building the frame. Anything the table can't answer on its own (a live or CR4-patched
+;  leaf, a subleaf it doesn't have, or any CPUID while tracing) goes through the dispatcher.
+;
+VMExitStub PROC
+	push rbx
+	push rdx
+	push r8
+
+	mov r8, [rsp+20h]			; PCPUID_TABLE (the second slot of the reservation, above our three pushes)
+	test r8, r8
+	jz _cpuid_slow
+
+	; (Note: anything but a plain CPUID exit, such as an entry failure, has more than the basic reason set)
+	mov edx, VMCS_RO_EXIT_REASON
+	vmread rbx, rdx
+	cmp ebx, REASON_CPUID
+	jne _cpuid_slow
+
+	cmp g_TraceEnabled, 0
+	jne _cpuid_slow
+
+	; The slot of leaf EAX; its range is EAX[31:30], and its index within the range EAX[29:0]
+	mov edx, eax
+	shr edx, 30
+	cmp edx, CPUID_RANGE_COUNT
+	jae _cpuid_slow
+	mov ebx, eax
+	and ebx, 3FFFFFFFh
+	cmp ebx, CPUID_RANGE_LEAVES
+	jae _cpuid_slow
+	imul edx, edx, CPUID_RANGE_LEAVES
+	add edx, ebx
+
+	; CPUID_SLOT; First is [15:0], Count [23:16] and Flags [31:24]
+	mov edx, dword ptr [r8+rdx*4]
+	test edx, (CPUID_SLOT_LIVE or CPUID_SLOT_CR4) shl 24
+	jnz _cpuid_slow
+	mov ebx, edx
+	shr ebx, 16
+	and ebx, 0FFh
+	jz _cpuid_slow
+
+	; The entry of subleaf ECX (or the only one, if the leaf ignores ECX)
+	test edx, CPUID_SLOT_ANY_SUBLEAF shl 24
+	jnz _cpuid_any_subleaf
+	cmp ecx, ebx
+	jae _cpuid_slow
+	movzx ebx, dx
+	add ebx, ecx
+	jmp _cpuid_hit
+
+_cpuid_any_subleaf:
+	movzx ebx, dx
+
+_cpuid_hit:
+	inc qword ptr [r8+CPUID_TABLE_FAST_HITS]
+	shl rbx, 4
+	lea r8, [r8+rbx+CPUID_TABLE_ENTRIES]
+
+	; Step the guest past the CPUID ([27.2.5] "Information for VM Exits Due to Instruction Execution")
+	mov edx, VMCS_GUEST_RIP
+	vmread rbx, rdx
+	mov edx, VMCS_RO_VM_EXIT_INSTR_LEN
+	vmread rdx, rdx
+	add rbx, rdx
+	mov edx, VMCS_GUEST_RIP
+	vmwrite rdx, rbx
+
+	; (Note: CPUID clears the upper halves of all four, just like these 32-bit loads)
+	mov eax, dword ptr [r8+0]
+	mov ebx, dword ptr [r8+4]
+	mov ecx, dword ptr [r8+8]
+	mov edx, dword ptr [r8+12]
+
+	pop r8
+	add rsp, 10h				; The guest's RDX and RBX, which we just replaced
+
+	vmresume
+
+	; We only get here if VMRESUME failed
+	jmp _vmresume_failure
+
+_cpuid_slow:
+	pop r8
+	pop rdx
+	pop rbx
+
+	push r15
+	push r14
+	push r13
+	push r12
+	push r11
+	push r10
+	push r9
+	push r8
+	push rdi
+	push rsi
+	push rbp
+	push -1						; Placeholder for RSP (the guest RSP lives in the VMCS)
+	push rbx
+	push rdx
+	push rcx
+	push rax
+
+	sub rsp, 60h
+	movaps xmmword ptr [rsp+00h], xmm0
+	movaps xmmword ptr [rsp+10h], xmm1
+	movaps xmmword ptr [rsp+20h], xmm2
+	movaps xmmword ptr [rsp+30h], xmm3
+	movaps xmmword ptr [rsp+40h], xmm4
+	movaps xmmword ptr [rsp+50h], xmm5
+
+	mov rcx, rsp				; PGUEST_REGISTERS
+	mov rdx, [rsp+0E0h]			; PLP_INFO (just above the GUEST_REGISTERS frame)
+
+	sub rsp, 20h				; Home space for the dispatcher
+	call VMExitDispatch
+	add rsp, 20h
+
+	movaps xmm0, xmmword ptr [rsp+00h]
+	movaps xmm1, xmmword ptr [rsp+10h]
+	movaps xmm2, xmmword ptr [rsp+20h]
+	movaps xmm3, xmmword ptr [rsp+30h]
+	movaps xmm4, xmmword ptr [rsp+40h]
+	movaps xmm5, xmmword ptr [rsp+50h]
+	add rsp, 60h
+
+	pop rax
+	pop rcx
+	pop rdx
+	pop rbx
+	add rsp, 8					; Skip the RSP placeholder
+	pop rbp
+	pop rsi
+	pop rdi
+	pop r8
+	pop r9
+	pop r10
+	pop r11
+	pop r12
+	pop r13
+	pop r14
+	pop r15
+
+	vmresume
+
+	; We only get here if VMRESUME failed
+_vmresume_failure:
+	mov rcx, [rsp]				; PLP_INFO
+	sub rsp, 20h
+	call VMResumeFailure
+	int 3
+VMExitStub ENDP
+
+end
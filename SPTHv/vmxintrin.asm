@@ -0,0 +1,57 @@
+; 
+; This is the assembly source file for the VMX instructions that are not already
+;  supported by the Microsoft provided intrinsic functions (see "intrin.h")
+;
+;  Each of these returns a VMX_STATUS_CODE (see "VMX.h"), in the same way the
+;  intrinsics do ([30.2] "Conventions")
+; 
+
+VMX_OK				EQU		0
+VMX_ERROR_STATUS	EQU		1
+VMX_ERROR			EQU		2
+
+.code
+
+;
+; Invalidate cached EPT mappings ([30.3] "VMX Instructions", INVEPT)
+;
+;  rcx = INVEPT_TYPE, rdx = PINVEPT_DESCRIPTOR
+;
+__invept PROC
+	invept rcx, oword ptr [rdx]
+	jz _fail_status
+	jc _fail
+	mov eax, VMX_OK
+	ret
+
+_fail_status:
+	mov eax, VMX_ERROR_STATUS
+	ret
+
+_fail:
+	mov eax, VMX_ERROR
+	ret
+__invept ENDP
+
+;
+; Invalidate cached linear mappings tagged with a VPID ([30.3] "VMX Instructions", INVVPID)
+;
+;  rcx = INVVPID_TYPE, rdx = PINVVPID_DESCRIPTOR
+;
+__invvpid PROC
+	invvpid rcx, oword ptr [rdx]
+	jz _fail_status
+	jc _fail
+	mov eax, VMX_OK
+	ret
+
+_fail_status:
+	mov eax, VMX_ERROR_STATUS
+	ret
+
+_fail:
+	mov eax, VMX_ERROR
+	ret
+__invvpid ENDP
+
+end
@@ -0,0 +1,1051 @@
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "..\SPTHv\SPTHvIoctl.h"
+#include "..\SPTHv\TraceRing.h"
+#include "..\SPTHv\ProfileReport.h"
+
+/*
+ * SPTHvCtl: talks to a loaded SPTHv over its device (see "SPTHvIoctl.h")
+ *
+ *  SPTHvCtl bench [iterations]		Run the exit benchmark suite, and print each exit's latency distribution
+ *  SPTHvCtl trace [seconds]		Map the trace rings, and print every exit traced until the time is up
+ *  SPTHvCtl stats					Print every LP's exit counters, merged, costliest exit reason first
+ *  SPTHvCtl profile [seconds] [hz] [flat|folded]
+ *									Sample the guest on every LP, and print a flat profile (or folded stacks, for
+ *									flame graph tools; each "stack" is address space;mode;RIP)
+ *  SPTHvCtl dirty [seconds]		Track the pages of RAM written to until the time is up, and print them as ranges
+ *  SPTHvCtl tsc [hz] [advance]		Print every LP's guest TSC multiplier and offset; after setting the guest's TSC rate
+ *									(and moving it forward by advance ticks), if given
+ *  SPTHvCtl intercept msr first last [r|w|rw] [off]
+ *									Start (or stop) intercepting reads and/or writes of the MSRs in [first, last] on
+ *									every LP, so that they show up in the exit counters and the trace
+ *  SPTHvCtl intercept io first last [off]
+ *									Likewise, for the I/O ports in [first, last]
+ *  SPTHvCtl view protect view address r|w|x|-
+ *									Set what the guest may do with the page at address while it's in an EPT view
+ *									(any of r, w and x, such as "rw" or "x"; "-" for nothing at all)
+ *  SPTHvCtl view enable|disable view
+ *									Put an EPT view in the list the guest switches views with (VMFUNC), or take it out
+ *  SPTHvCtl ve start|stop			Start (or stop) delivering #VEs to the guest, on every LP; the guest has to have a
+ *									#VE handler before they're started
+ *  SPTHvCtl ve convertible view address [off]
+ *									Have the accesses an EPT view refuses to the page at address be #VEs (or exits
+ *									again, with off)
+ *  SPTHvCtl intr start|stop		Start (or stop) taking external interrupts on exits on every LP, and handing them
+ *									back to the guest; each one then shows up in the exit counters and the trace
+ */
+
+// The most records taken off one ring before moving on to the next one
+#define TRACE_BATCH_RECORDS		256
+
+// How long to wait before polling again, when every ring was empty
+#define TRACE_POLL_INTERVAL_MS	10
+
+// The most pages harvested with one request (4GB worth; a 128KB bitmap)
+#define DIRTY_HARVEST_PAGES		0x100000
+
+static CONST CHAR* g_BenchExitNames[SPTHV_BENCH_EXIT_COUNT] = {
+	"CPUID",
+	"RDMSR",
+	"WRMSR",
+	"VMCALL",
+	"I/O",
+	"CR access",
+	"HLT",
+	"VMCALL/AVX",
+};
+
+static
+VOID
+_Usage(
+	VOID
+	)
+{
+	printf( "usage: SPTHvCtl bench [iterations]\n" );
+	printf( "       SPTHvCtl trace [seconds]\n" );
+	printf( "       SPTHvCtl stats\n" );
+	printf( "       SPTHvCtl profile [seconds] [hz] [flat|folded]\n" );
+	printf( "       SPTHvCtl dirty [seconds]\n" );
+	printf( "       SPTHvCtl tsc [hz] [advance]\n" );
+	printf( "       SPTHvCtl intercept msr first last [r|w|rw] [off]\n" );
+	printf( "       SPTHvCtl intercept io first last [off]\n" );
+	printf( "       SPTHvCtl view protect view address r|w|x|-\n" );
+	printf( "       SPTHvCtl view enable|disable view\n" );
+	printf( "       SPTHvCtl ve start|stop\n" );
+	printf( "       SPTHvCtl ve convertible view address [off]\n" );
+	printf( "       SPTHvCtl intr start|stop\n" );
+	printf( "    iterations defaults to %u (at most %u); seconds defaults to 5\n", SPTHV_BENCH_DEFAULT_ITERATIONS, SPTHV_BENCH_MAX_ITERATIONS );
+	printf( "    hz defaults to %u (at most %u)\n", SPTHV_PROFILE_DEFAULT_FREQUENCY, SPTHV_PROFILE_MAX_FREQUENCY );
+}
+
+static
+int
+_RunExitBenchmark(
+	_In_ HANDLE Device,
+	_In_ ULONG Iterations
+	)
+{
+	SPTHV_EXIT_BENCHMARK_REQUEST request;
+	SPTHV_EXIT_BENCHMARK benchmark;
+	DWORD returned = 0;
+	ULONG i;
+
+	request.Iterations = Iterations;
+	ZeroMemory( &benchmark, sizeof(benchmark) );
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_RUN_EXIT_BENCHMARK, &request, sizeof(request), &benchmark, sizeof(benchmark), &returned, NULL ) == FALSE )
+	{
+		printf( "DeviceIoControl failed (%lu)\n", GetLastError() );
+		return 1;
+	}
+
+	if ( returned < sizeof(benchmark) )
+	{
+		printf( "Short reply from the driver (%lu bytes)\n", returned );
+		return 1;
+	}
+
+	printf( "%lu iterations on processor %lu (TSC ticks)\n\n", benchmark.Iterations, benchmark.Processor );
+	printf( "%-10s %6s %10s %10s %10s %10s %10s\n", "exit", "reason", "min", "median", "p99", "max", "mean" );
+
+	for ( i = 0; i < SPTHV_BENCH_EXIT_COUNT; i++ )
+	{
+		CONST SPTHV_EXIT_BENCH_RESULT* result = &benchmark.Results[i];
+
+		if ( result->Available == 0 )
+		{
+			printf( "%-10s %6lu %10s\n", g_BenchExitNames[i], result->BasicExitReason, "(unavailable)" );
+			continue;
+		}
+
+		printf( "%-10s %6lu %10llu %10llu %10llu %10llu %10llu\n",
+			g_BenchExitNames[i],
+			result->BasicExitReason,
+			result->Latency.Min,
+			result->Latency.Median,
+			result->Latency.P99,
+			result->Latency.Max,
+			result->Latency.Mean );
+	}
+
+	return 0;
+}
+
+static
+int
+_RunTrace(
+	_In_ HANDLE Device,
+	_In_ ULONG Seconds
+	)
+{
+	SPTHV_TRACE_MAPPING mapping;
+	SPTHV_TRACE_RECORD batch[TRACE_BATCH_RECORDS];
+	DWORD returned = 0;
+	ULONGLONG deadline;
+	ULONG64 total = 0;
+	ULONG i, j;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_MAP_TRACE, NULL, 0, &mapping, sizeof(mapping), &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to map the trace rings (%lu)\n", GetLastError() );
+		return 1;
+	}
+
+	printf( "%-4s %20s %8s %18s %18s\n", "lp", "tsc", "reason", "qualification", "guest rip" );
+
+	deadline = GetTickCount64() + (ULONGLONG)Seconds * 1000;
+
+	while ( GetTickCount64() < deadline )
+	{
+		ULONG drained = 0;
+
+		for ( i = 0; i < mapping.RingCount; i++ )
+		{
+			PSPTHV_TRACE_RING ring = (PSPTHV_TRACE_RING)(ULONG_PTR)(mapping.Base + (ULONG64)i * mapping.RingStride);
+			ULONG count = TraceRingRead( ring, batch, TRACE_BATCH_RECORDS );
+
+			for ( j = 0; j < count; j++ )
+			{
+				printf( "%-4lu %20llu %8lu %18llx %18llx\n", i, batch[j].Tsc, batch[j].ExitReason & 0xFFFF, batch[j].Qualification, batch[j].GuestRip );
+			}
+
+			drained += count;
+		}
+
+		total += drained;
+
+		if ( drained == 0 )
+		{
+			Sleep( TRACE_POLL_INTERVAL_MS );
+		}
+	}
+
+	printf( "\n%llu records\n", total );
+
+	for ( i = 0; i < mapping.RingCount; i++ )
+	{
+		PSPTHV_TRACE_RING ring = (PSPTHV_TRACE_RING)(ULONG_PTR)(mapping.Base + (ULONG64)i * mapping.RingStride);
+
+		if ( ring->Overruns != 0 )
+		{
+			printf( "LP %lu dropped %llu records (the ring was full)\n", i, ring->Overruns );
+		}
+	}
+
+	DeviceIoControl( Device, IOCTL_SPTHV_UNMAP_TRACE, NULL, 0, NULL, 0, &returned, NULL );
+
+	return 0;
+}
+
+static
+int
+_QueryExitStats(
+	_In_ HANDLE Device
+	)
+{
+	static SPTHV_EXIT_STATS stats;
+	ULONG order[SPTHV_EXIT_REASON_COUNT];
+	ULONG64 total = 0;
+	DWORD returned = 0;
+	ULONG i, j, count = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_QUERY_EXIT_STATS, NULL, 0, &stats, sizeof(stats), &returned, NULL ) == FALSE )
+	{
+		printf( "DeviceIoControl failed (%lu)\n", GetLastError() );
+		return 1;
+	}
+
+	// Only the reasons seen at all, sorted by the total time spent handling them
+	for ( i = 0; i < SPTHV_EXIT_REASON_COUNT; i++ )
+	{
+		if ( stats.Reasons[i].Count == 0 )
+		{
+			continue;
+		}
+
+		for ( j = count; j > 0 && stats.Reasons[order[j - 1]].TotalCycles < stats.Reasons[i].TotalCycles; j-- )
+		{
+			order[j] = order[j - 1];
+		}
+
+		order[j] = i;
+		count++;
+		total += stats.Reasons[i].TotalCycles;
+	}
+
+	printf( "%lu LPs (TSC ticks, exit handler entry to VMRESUME)\n\n", stats.ProcessorCount );
+	printf( "%6s %14s %7s %10s %10s %10s\n", "reason", "count", "time%", "mean", "min", "max" );
+
+	for ( i = 0; i < count; i++ )
+	{
+		CONST SPTHV_EXIT_REASON_STATS* reason = &stats.Reasons[order[i]];
+
+		printf( "%6lu %14llu %6.2f%% %10llu %10llu %10llu\n",
+			order[i],
+			reason->Count,
+			(total != 0) ? (100.0 * reason->TotalCycles) / total : 0.0,
+			reason->TotalCycles / reason->Count,
+			reason->MinCycles,
+			reason->MaxCycles );
+
+		// The log2 histogram, as "<lower bound>:<count>" for every bucket that has anything in it
+		printf( "       " );
+
+		for ( j = 0; j < SPTHV_EXIT_HISTOGRAM_BUCKETS; j++ )
+		{
+			if ( reason->Histogram[j] != 0 )
+			{
+				printf( " %llu:%llu", (j == 0) ? 0ULL : (1ULL << j), reason->Histogram[j] );
+			}
+		}
+
+		printf( "\n" );
+	}
+
+	return 0;
+}
+
+static
+int
+_RunProfile(
+	_In_ HANDLE Device,
+	_In_ ULONG Seconds,
+	_In_ ULONG Frequency,
+	_In_ BOOL Folded
+	)
+{
+	static SPTHV_PROFILE_TABLE table;
+	SPTHV_PROFILE_REQUEST request;
+	SPTHV_PROFILE_QUERY query;
+	PSPTHV_PROFILE_ENTRY entries = NULL;
+	CHAR line[PROFILE_REPORT_LINE_LENGTH];
+	ULONG64 samples = 0, dropped = 0;
+	ULONG count = 0, processorCount = 1;
+	DWORD returned = 0;
+	ULONG i;
+
+	request.Frequency = Frequency;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_START_PROFILE, &request, sizeof(request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to start sampling (%lu)\n", GetLastError() );
+		return 1;
+	}
+
+	Sleep( Seconds * 1000 );
+
+	DeviceIoControl( Device, IOCTL_SPTHV_STOP_PROFILE, NULL, 0, NULL, 0, &returned, NULL );
+
+	// Every LP's table, one at a time; the first one tells us how many more there are
+	for ( query.Processor = 0; query.Processor < processorCount; query.Processor++ )
+	{
+		if ( DeviceIoControl( Device, IOCTL_SPTHV_QUERY_PROFILE, &query, sizeof(query), &table, sizeof(table), &returned, NULL ) == FALSE )
+		{
+			printf( "Failed to read LP %lu's samples (%lu)\n", query.Processor, GetLastError() );
+			free( entries );
+			return 1;
+		}
+
+		if ( entries == NULL )
+		{
+			processorCount = table.ProcessorCount;
+
+			entries = malloc( (SIZE_T)processorCount * SPTHV_PROFILE_TABLE_ENTRIES * sizeof(SPTHV_PROFILE_ENTRY) );
+			if ( entries == NULL )
+			{
+				printf( "Out of memory\n" );
+				return 1;
+			}
+		}
+
+		count = ProfileAddTable( entries, count, &table );
+
+		samples += table.Samples;
+		dropped += table.Dropped;
+	}
+
+	count = ProfileMergeEntries( entries, count );
+
+	if ( Folded == TRUE )
+	{
+		// One line per "stack", in the format flame graph tools take
+		for ( i = 0; i < count; i++ )
+		{
+			ProfileFormatFolded( line, &entries[i] );
+			printf( "%s\n", line );
+		}
+	}
+	else
+	{
+		ProfileSortByCount( entries, count );
+
+		printf( "%llu samples on %lu LPs (%llu dropped)\n\n", samples, processorCount, dropped );
+		printf( "%12s %7s %-7s %18s %18s\n", "samples", "%", "mode", "cr3", "rip" );
+
+		for ( i = 0; i < count; i++ )
+		{
+			ProfileFormatFlat( line, &entries[i], samples );
+			printf( "%s\n", line );
+		}
+	}
+
+	free( entries );
+
+	return 0;
+}
+
+static
+int
+_RunDirty(
+	_In_ HANDLE Device,
+	_In_ ULONG Seconds
+	)
+{
+	PSPTHV_DIRTY_BITMAP bitmap;
+	SPTHV_DIRTY_QUERY query;
+	ULONG64 trackedPages = DIRTY_HARVEST_PAGES;
+	ULONG64 dirtyPages = 0, runs = 0;
+	ULONG64 runStart = 0, page;
+	BOOL inRun = FALSE, dirty;
+	DWORD size = SPTHV_DIRTY_BITMAP_SIZE( DIRTY_HARVEST_PAGES );
+	DWORD returned = 0;
+	ULONG64 i;
+
+	bitmap = malloc( size );
+	if ( bitmap == NULL )
+	{
+		printf( "Out of memory\n" );
+		return 1;
+	}
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_START_DIRTY_TRACKING, NULL, 0, NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to start dirty-page tracking (%lu)\n", GetLastError() );
+		free( bitmap );
+		return 1;
+	}
+
+	Sleep( Seconds * 1000 );
+
+	// Everything tracked, a chunk at a time; the first one tells us how much there is
+	for ( query.FirstPage = 0; query.FirstPage < trackedPages; query.FirstPage += DIRTY_HARVEST_PAGES )
+	{
+		query.PageCount = DIRTY_HARVEST_PAGES;
+
+		if ( DeviceIoControl( Device, IOCTL_SPTHV_HARVEST_DIRTY, &query, sizeof(query), bitmap, size, &returned, NULL ) == FALSE )
+		{
+			printf( "Failed to harvest the pages from %llx (%lu)\n", query.FirstPage * 0x1000, GetLastError() );
+			break;
+		}
+
+		trackedPages = bitmap->TrackedPages;
+		dirtyPages += bitmap->DirtyPages;
+
+		// Coalesce the bits into runs of dirty pages, carrying a run over into the next chunk
+		for ( i = 0; i < bitmap->PageCount; i++ )
+		{
+			page = bitmap->FirstPage + i;
+			dirty = (bitmap->Bits[i / SPTHV_DIRTY_PAGES_PER_WORD] >> (i % SPTHV_DIRTY_PAGES_PER_WORD)) & 1;
+
+			if ( dirty == TRUE && inRun == FALSE )
+			{
+				runStart = page;
+				inRun = TRUE;
+			}
+			else if ( dirty == FALSE && inRun == TRUE )
+			{
+				printf( "%016llx-%016llx %10llu pages\n", runStart * 0x1000, page * 0x1000 - 1, page - runStart );
+				inRun = FALSE;
+				runs++;
+			}
+		}
+	}
+
+	if ( inRun == TRUE )
+	{
+		page = min( query.FirstPage, trackedPages );
+
+		printf( "%016llx-%016llx %10llu pages\n", runStart * 0x1000, page * 0x1000 - 1, page - runStart );
+		runs++;
+	}
+
+	DeviceIoControl( Device, IOCTL_SPTHV_STOP_DIRTY_TRACKING, NULL, 0, NULL, 0, &returned, NULL );
+
+	printf( "\n%llu of %llu pages dirty (%llu MB) in %llu ranges, over %lu seconds\n",
+		dirtyPages,
+		trackedPages,
+		(dirtyPages * 0x1000) >> 20,
+		runs,
+		Seconds );
+
+	free( bitmap );
+
+	return 0;
+}
+
+static
+int
+_RunTsc(
+	_In_ HANDLE Device,
+	_In_ ULONG Frequency,
+	_In_ ULONG Advance
+	)
+{
+	SPTHV_TSC_REQUEST request;
+	SPTHV_TSC_QUERY query;
+	SPTHV_TSC_STATE state;
+	ULONG processorCount = 1;
+	DWORD returned = 0;
+
+	if ( Frequency != 0 )
+	{
+		request.Frequency = Frequency;
+		request.Advance = Advance;
+
+		if ( DeviceIoControl( Device, IOCTL_SPTHV_SET_TSC, &request, sizeof(request), NULL, 0, &returned, NULL ) == FALSE )
+		{
+			printf( "Failed to set the guest's TSC rate (%lu)\n", GetLastError() );
+			return 1;
+		}
+	}
+
+	// Every LP's state, one at a time; the first one tells us how many more there are
+	for ( query.Processor = 0; query.Processor < processorCount; query.Processor++ )
+	{
+		if ( DeviceIoControl( Device, IOCTL_SPTHV_QUERY_TSC, &query, sizeof(query), &state, sizeof(state), &returned, NULL ) == FALSE )
+		{
+			printf( "Failed to read LP %lu's TSC (%lu)\n", query.Processor, GetLastError() );
+			return 1;
+		}
+
+		if ( query.Processor == 0 )
+		{
+			processorCount = state.ProcessorCount;
+
+			printf( "TSC %llu Hz, guest %llu Hz (offsetting %s, scaling %s)\n\n",
+				state.HostFrequency,
+				state.GuestFrequency,
+				(state.OffsettingEnabled == TRUE) ? "on" : "off",
+				(state.ScalingEnabled == TRUE) ? "on" : "off" );
+			printf( "%4s %18s %18s %20s\n", "LP", "multiplier", "offset", "guest TSC" );
+		}
+
+		// (Note: the multiplier is 16.48 fixed-point)
+		printf( "%4lu %18.12f %18llx %20llu\n",
+			state.Processor,
+			(double)state.Multiplier / (double)(1ULL << 48),
+			state.Offset,
+			state.GuestTsc );
+	}
+
+	return 0;
+}
+
+static
+BOOL
+_ParseNumber(
+	_In_ int argc,
+	_In_ char* argv[],
+	_In_ int Index,
+	_In_ ULONG Max,
+	_Inout_ PULONG Value
+	)
+{
+	// Optional numeric argument Index; left as it is if it's not there, FALSE if it's there but out of range
+
+	ULONG value;
+
+	if ( argc <= Index )
+	{
+		return TRUE;
+	}
+
+	value = strtoul( argv[Index], NULL, 0 );
+	if ( value == 0 || (Max != 0 && value > Max) )
+	{
+		return FALSE;
+	}
+
+	*Value = value;
+
+	return TRUE;
+}
+
+static
+int
+_SetMSRIntercept(
+	_In_ HANDLE Device,
+	_In_ CONST SPTHV_MSR_INTERCEPT_REQUEST* Request
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_SET_MSR_INTERCEPT, (PVOID)Request, sizeof(*Request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to change the intercepts of MSRs %08lx - %08lx (%lu)\n", Request->FirstMsr, Request->LastMsr, GetLastError() );
+		return 1;
+	}
+
+	printf( "%s %s of MSRs %08lx - %08lx\n",
+		(Request->Intercept == TRUE) ? "Intercepting" : "No longer intercepting",
+		(Request->Accesses == SPTHV_MSR_INTERCEPT_READ) ? "reads" :
+			(Request->Accesses == SPTHV_MSR_INTERCEPT_WRITE) ? "writes" : "reads and writes",
+		Request->FirstMsr,
+		Request->LastMsr );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseMSRIntercept(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PSPTHV_MSR_INTERCEPT_REQUEST Request
+	)
+{
+	// intercept msr first last [r|w|rw] [off]; MSR 0 is a perfectly good MSR, so this doesn't go through _ParseNumber
+
+	int i;
+
+	ZeroMemory( Request, sizeof(*Request) );
+
+	if ( argc < 5 || strcmp( argv[2], "msr" ) != 0 )
+	{
+		return FALSE;
+	}
+
+	Request->FirstMsr = strtoul( argv[3], NULL, 0 );
+	Request->LastMsr = strtoul( argv[4], NULL, 0 );
+	Request->Accesses = SPTHV_MSR_INTERCEPT_READ | SPTHV_MSR_INTERCEPT_WRITE;
+	Request->Intercept = TRUE;
+
+	for ( i = 5; i < argc; i++ )
+	{
+		if ( strcmp( argv[i], "r" ) == 0 )
+		{
+			Request->Accesses = SPTHV_MSR_INTERCEPT_READ;
+		}
+		else if ( strcmp( argv[i], "w" ) == 0 )
+		{
+			Request->Accesses = SPTHV_MSR_INTERCEPT_WRITE;
+		}
+		else if ( strcmp( argv[i], "rw" ) == 0 )
+		{
+			Request->Accesses = SPTHV_MSR_INTERCEPT_READ | SPTHV_MSR_INTERCEPT_WRITE;
+		}
+		else if ( strcmp( argv[i], "off" ) == 0 )
+		{
+			Request->Intercept = FALSE;
+		}
+		else
+		{
+			return FALSE;
+		}
+	}
+
+	return (Request->FirstMsr <= Request->LastMsr);
+}
+
+static
+int
+_SetIOIntercept(
+	_In_ HANDLE Device,
+	_In_ CONST SPTHV_IO_INTERCEPT_REQUEST* Request
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_SET_IO_INTERCEPT, (PVOID)Request, sizeof(*Request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to change the intercepts of ports %04lx - %04lx (%lu)\n", Request->FirstPort, Request->LastPort, GetLastError() );
+		return 1;
+	}
+
+	printf( "%s ports %04lx - %04lx\n",
+		(Request->Intercept == TRUE) ? "Intercepting" : "No longer intercepting",
+		Request->FirstPort,
+		Request->LastPort );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseIOIntercept(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PSPTHV_IO_INTERCEPT_REQUEST Request
+	)
+{
+	// intercept io first last [off]; as with MSRs, port 0 is a perfectly good port
+
+	ZeroMemory( Request, sizeof(*Request) );
+
+	if ( argc < 5 || argc > 6 || strcmp( argv[2], "io" ) != 0 )
+	{
+		return FALSE;
+	}
+
+	Request->FirstPort = strtoul( argv[3], NULL, 0 );
+	Request->LastPort = strtoul( argv[4], NULL, 0 );
+	Request->Intercept = TRUE;
+
+	if ( argc == 6 )
+	{
+		if ( strcmp( argv[5], "off" ) != 0 )
+		{
+			return FALSE;
+		}
+
+		Request->Intercept = FALSE;
+	}
+
+	return (Request->FirstPort <= Request->LastPort && Request->LastPort <= 0xFFFF);
+}
+
+static
+int
+_ProtectViewPage(
+	_In_ HANDLE Device,
+	_In_ CONST SPTHV_VIEW_PAGE_REQUEST* Request
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_PROTECT_VIEW_PAGE, (PVOID)Request, sizeof(*Request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to change page %llx in view %lu (%lu)\n", Request->GuestPA, Request->View, GetLastError() );
+		return 1;
+	}
+
+	printf( "Page %llx in view %lu: %c%c%c\n",
+		Request->GuestPA & ~0xFFFULL,
+		Request->View,
+		((Request->Access & SPTHV_VIEW_READ) != 0) ? 'r' : '-',
+		((Request->Access & SPTHV_VIEW_WRITE) != 0) ? 'w' : '-',
+		((Request->Access & SPTHV_VIEW_EXECUTE) != 0) ? 'x' : '-' );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseViewProtect(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PSPTHV_VIEW_PAGE_REQUEST Request
+	)
+{
+	// view protect view address r|w|x|-; view 0 and page 0 are both perfectly good, so this doesn't go through _ParseNumber
+
+	CONST CHAR* access;
+
+	ZeroMemory( Request, sizeof(*Request) );
+
+	if ( argc != 6 || strcmp( argv[2], "protect" ) != 0 )
+	{
+		return FALSE;
+	}
+
+	Request->View = strtoul( argv[3], NULL, 0 );
+	Request->GuestPA = strtoull( argv[4], NULL, 0 );
+
+	if ( strcmp( argv[5], "-" ) == 0 )
+	{
+		return TRUE;
+	}
+
+	for ( access = argv[5]; *access != '\0'; access++ )
+	{
+		if ( *access == 'r' )
+		{
+			Request->Access |= SPTHV_VIEW_READ;
+		}
+		else if ( *access == 'w' )
+		{
+			Request->Access |= SPTHV_VIEW_WRITE;
+		}
+		else if ( *access == 'x' )
+		{
+			Request->Access |= SPTHV_VIEW_EXECUTE;
+		}
+		else
+		{
+			return FALSE;
+		}
+	}
+
+	return (Request->Access != 0);
+}
+
+static
+int
+_EnableView(
+	_In_ HANDLE Device,
+	_In_ CONST SPTHV_VIEW_REQUEST* Request
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_ENABLE_VIEW, (PVOID)Request, sizeof(*Request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to %s view %lu (%lu)\n", (Request->Enable == TRUE) ? "enable" : "disable", Request->View, GetLastError() );
+		return 1;
+	}
+
+	printf( "View %lu %s\n", Request->View, (Request->Enable == TRUE) ? "can be switched to" : "is out of the list" );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseViewEnable(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PSPTHV_VIEW_REQUEST Request
+	)
+{
+	// view enable|disable view
+
+	ZeroMemory( Request, sizeof(*Request) );
+
+	if ( argc != 4 || (strcmp( argv[2], "enable" ) != 0 && strcmp( argv[2], "disable" ) != 0) )
+	{
+		return FALSE;
+	}
+
+	Request->View = strtoul( argv[3], NULL, 0 );
+	Request->Enable = (strcmp( argv[2], "enable" ) == 0);
+
+	return TRUE;
+}
+
+static
+int
+_StartVE(
+	_In_ HANDLE Device,
+	_In_ CONST BOOL Start
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, (Start == TRUE) ? IOCTL_SPTHV_START_VE : IOCTL_SPTHV_STOP_VE, NULL, 0, NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to %s #VEs (%lu)\n", (Start == TRUE) ? "start" : "stop", GetLastError() );
+		return 1;
+	}
+
+	printf( "#VEs %s\n", (Start == TRUE) ? "started" : "stopped" );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseVEStart(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PBOOL Start
+	)
+{
+	// ve start|stop
+
+	*Start = (argc == 3 && strcmp( argv[2], "start" ) == 0);
+
+	return (*Start == TRUE || (argc == 3 && strcmp( argv[2], "stop" ) == 0));
+}
+
+static
+int
+_SetConvertible(
+	_In_ HANDLE Device,
+	_In_ CONST SPTHV_VE_CONVERTIBLE_REQUEST* Request
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, IOCTL_SPTHV_SET_CONVERTIBLE, (PVOID)Request, sizeof(*Request), NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to change page %llx in view %lu (%lu)\n", Request->GuestPA, Request->View, GetLastError() );
+		return 1;
+	}
+
+	printf( "Page %llx in view %lu: %s\n",
+		Request->GuestPA & ~0xFFFULL,
+		Request->View,
+		(Request->Convertible == TRUE) ? "#VE" : "exit" );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseVEConvertible(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PSPTHV_VE_CONVERTIBLE_REQUEST Request
+	)
+{
+	// ve convertible view address [off]; as with view protect, view 0 and page 0 are both perfectly good
+
+	ZeroMemory( Request, sizeof(*Request) );
+
+	if ( (argc != 5 && argc != 6) || strcmp( argv[2], "convertible" ) != 0 )
+	{
+		return FALSE;
+	}
+
+	Request->View = strtoul( argv[3], NULL, 0 );
+	Request->GuestPA = strtoull( argv[4], NULL, 0 );
+	Request->Convertible = TRUE;
+
+	if ( argc == 6 )
+	{
+		if ( strcmp( argv[5], "off" ) != 0 )
+		{
+			return FALSE;
+		}
+
+		Request->Convertible = FALSE;
+	}
+
+	return TRUE;
+}
+
+static
+int
+_StartInterrupts(
+	_In_ HANDLE Device,
+	_In_ CONST BOOL Start
+	)
+{
+	DWORD returned = 0;
+
+	if ( DeviceIoControl( Device, (Start == TRUE) ? IOCTL_SPTHV_START_INTERRUPTS : IOCTL_SPTHV_STOP_INTERRUPTS, NULL, 0, NULL, 0, &returned, NULL ) == FALSE )
+	{
+		printf( "Failed to %s taking external interrupts on exits (%lu)\n", (Start == TRUE) ? "start" : "stop", GetLastError() );
+		return 1;
+	}
+
+	printf( "External interrupts %s\n", (Start == TRUE) ? "taken on exits" : "go straight to the guest" );
+
+	return 0;
+}
+
+static
+BOOL
+_ParseInterruptStart(
+	_In_ int argc,
+	_In_ char* argv[],
+	_Out_ PBOOL Start
+	)
+{
+	// intr start|stop
+
+	*Start = (argc == 3 && strcmp( argv[2], "start" ) == 0);
+
+	return (*Start == TRUE || (argc == 3 && strcmp( argv[2], "stop" ) == 0));
+}
+
+int
+main(
+	int argc,
+	char* argv[]
+	)
+{
+	HANDLE device;
+	ULONG iterations = SPTHV_BENCH_DEFAULT_ITERATIONS;
+	ULONG seconds = 5;
+	ULONG frequency = SPTHV_PROFILE_DEFAULT_FREQUENCY;
+	ULONG tscFrequency = 0, tscAdvance = 0;
+	SPTHV_MSR_INTERCEPT_REQUEST msrIntercept;
+	SPTHV_IO_INTERCEPT_REQUEST ioIntercept;
+	SPTHV_VIEW_PAGE_REQUEST viewPage;
+	SPTHV_VIEW_REQUEST view;
+	SPTHV_VE_CONVERTIBLE_REQUEST convertible;
+	BOOL veStart = FALSE;
+	BOOL interruptStart = FALSE;
+	BOOL folded = FALSE;
+	int status;
+
+	if ( argc < 2 )
+	{
+		_Usage();
+		return 1;
+	}
+
+	if ( strcmp( argv[1], "bench" ) == 0 )
+	{
+		status = _ParseNumber( argc, argv, 2, SPTHV_BENCH_MAX_ITERATIONS, &iterations );
+	}
+	else if ( strcmp( argv[1], "trace" ) == 0 )
+	{
+		status = _ParseNumber( argc, argv, 2, 0, &seconds );
+	}
+	else if ( strcmp( argv[1], "stats" ) == 0 )
+	{
+		status = TRUE;
+	}
+	else if ( strcmp( argv[1], "dirty" ) == 0 )
+	{
+		status = _ParseNumber( argc, argv, 2, 0, &seconds );
+	}
+	else if ( strcmp( argv[1], "tsc" ) == 0 )
+	{
+		status = _ParseNumber( argc, argv, 2, 0, &tscFrequency ) && _ParseNumber( argc, argv, 3, 0, &tscAdvance );
+	}
+	else if ( strcmp( argv[1], "intercept" ) == 0 )
+	{
+		status = _ParseMSRIntercept( argc, argv, &msrIntercept ) || _ParseIOIntercept( argc, argv, &ioIntercept );
+	}
+	else if ( strcmp( argv[1], "view" ) == 0 )
+	{
+		status = _ParseViewProtect( argc, argv, &viewPage ) || _ParseViewEnable( argc, argv, &view );
+	}
+	else if ( strcmp( argv[1], "ve" ) == 0 )
+	{
+		status = _ParseVEConvertible( argc, argv, &convertible ) || _ParseVEStart( argc, argv, &veStart );
+	}
+	else if ( strcmp( argv[1], "intr" ) == 0 )
+	{
+		status = _ParseInterruptStart( argc, argv, &interruptStart );
+	}
+	else if ( strcmp( argv[1], "profile" ) == 0 )
+	{
+		status = _ParseNumber( argc, argv, 2, 0, &seconds ) && _ParseNumber( argc, argv, 3, SPTHV_PROFILE_MAX_FREQUENCY, &frequency );
+
+		if ( argc > 4 )
+		{
+			folded = (strcmp( argv[4], "folded" ) == 0);
+			status &= (folded == TRUE || strcmp( argv[4], "flat" ) == 0);
+		}
+	}
+	else
+	{
+		status = FALSE;
+	}
+
+	if ( status == FALSE )
+	{
+		_Usage();
+		return 1;
+	}
+
+	device = CreateFileW( SPTHV_USER_DEVICE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( device == INVALID_HANDLE_VALUE )
+	{
+		printf( "Failed to open %ls (%lu); is SPTHv loaded, and are we elevated?\n", SPTHV_USER_DEVICE_NAME, GetLastError() );
+		return 1;
+	}
+
+	if ( strcmp( argv[1], "trace" ) == 0 )
+	{
+		status = _RunTrace( device, seconds );
+	}
+	else if ( strcmp( argv[1], "stats" ) == 0 )
+	{
+		status = _QueryExitStats( device );
+	}
+	else if ( strcmp( argv[1], "profile" ) == 0 )
+	{
+		status = _RunProfile( device, seconds, frequency, folded );
+	}
+	else if ( strcmp( argv[1], "dirty" ) == 0 )
+	{
+		status = _RunDirty( device, seconds );
+	}
+	else if ( strcmp( argv[1], "tsc" ) == 0 )
+	{
+		status = _RunTsc( device, tscFrequency, tscAdvance );
+	}
+	else if ( strcmp( argv[1], "intercept" ) == 0 )
+	{
+		status = (strcmp( argv[2], "io" ) == 0) ? _SetIOIntercept( device, &ioIntercept ) : _SetMSRIntercept( device, &msrIntercept );
+	}
+	else if ( strcmp( argv[1], "view" ) == 0 )
+	{
+		status = (strcmp( argv[2], "protect" ) == 0) ? _ProtectViewPage( device, &viewPage ) : _EnableView( device, &view );
+	}
+	else if ( strcmp( argv[1], "ve" ) == 0 )
+	{
+		status = (strcmp( argv[2], "convertible" ) == 0) ? _SetConvertible( device, &convertible ) : _StartVE( device, veStart );
+	}
+	else if ( strcmp( argv[1], "intr" ) == 0 )
+	{
+		status = _StartInterrupts( device, interruptStart );
+	}
+	else
+	{
+		status = _RunExitBenchmark( device, iterations );
+	}
+
+	CloseHandle( device );
+
+	return status;
+}
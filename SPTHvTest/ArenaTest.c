@@ -0,0 +1,247 @@
+#include <sys/mman.h>
+
+#include "Arena.h"
+#include "Test.h"
+
+/*
+ * Arenas over an mmap-backed ARENA_PROVIDER standing in for MmAllocateContiguousNodeMemory: each block is handed
+ *  out dirty, at a made-up physical address that isn't its virtual one, so that zeroing and VA/PA alignment are
+ *  both checked for real. The provider counts what it's asked for, so that leaks and double frees show up too.
+ */
+
+#define FAKE_BLOCK_PA					0x3F200000ULL
+
+typedef struct _FAKE_PROVIDER_STATE
+{
+	ULONG Allocations;
+	ULONG Frees;
+	ULONG LastNode;
+	BOOLEAN Fail;
+
+	PVOID Block;
+	SIZE_T Size;
+} FAKE_PROVIDER_STATE;
+
+static FAKE_PROVIDER_STATE g_Provider;
+
+static
+PVOID
+_FakeAllocate(
+	_In_ CONST SIZE_T Size,
+	_In_ CONST ULONG Node,
+	_Out_ PUINT64 PhysicalAddress
+	)
+{
+	PVOID block;
+
+	g_Provider.LastNode = Node;
+
+	if ( g_Provider.Fail == TRUE )
+	{
+		return NULL;
+	}
+
+	block = mmap( NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if ( block == MAP_FAILED )
+	{
+		return NULL;
+	}
+
+	// Whatever was in there before
+	RtlFillMemory( block, Size, 0xCC );
+
+	g_Provider.Allocations++;
+	g_Provider.Block = block;
+	g_Provider.Size = Size;
+
+	*PhysicalAddress = FAKE_BLOCK_PA;
+
+	return block;
+}
+
+static
+VOID
+_FakeFree(
+	_In_ PVOID Block,
+	_In_ CONST SIZE_T Size
+	)
+{
+	TEST_CHECK( Block == g_Provider.Block );
+	TEST_CHECK_EQUAL( Size, g_Provider.Size );
+
+	g_Provider.Frees++;
+
+	munmap( Block, Size );
+}
+
+static CONST ARENA_PROVIDER g_FakeProvider = { _FakeAllocate, _FakeFree };
+
+static
+VOID
+TestCreate()
+{
+	ARENA arena;
+	SIZE_T i;
+	ULONG dirty = 0;
+
+	RtlZeroMemory( &g_Provider, sizeof(g_Provider) );
+
+	// Only whole pages
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, 0, 0 ) == FALSE );
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, PAGE_SIZE + 8, 0 ) == FALSE );
+	TEST_CHECK_EQUAL( g_Provider.Allocations, 0 );
+
+	// The provider can fail; the arena is left empty, and destroying it is harmless
+	g_Provider.Fail = TRUE;
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, 4 * PAGE_SIZE, 1 ) == FALSE );
+	TEST_CHECK( arena.VA == NULL );
+	ArenaDestroy( &arena );
+	TEST_CHECK_EQUAL( g_Provider.Frees, 0 );
+	g_Provider.Fail = FALSE;
+
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, 4 * PAGE_SIZE, 3 ) == TRUE );
+	TEST_CHECK_EQUAL( g_Provider.LastNode, 3 );
+	TEST_CHECK_EQUAL( arena.Node, 3 );
+	TEST_CHECK_EQUAL( arena.PA, FAKE_BLOCK_PA );
+	TEST_CHECK_EQUAL( arena.Size, 4 * PAGE_SIZE );
+	TEST_CHECK_EQUAL( arena.Used, 0 );
+
+	// Zeroed, all of it
+	for ( i = 0; i < arena.Size; i++ )
+	{
+		dirty += (arena.VA[i] != 0);
+	}
+
+	TEST_CHECK_EQUAL( dirty, 0 );
+
+	// Freed exactly once
+	ArenaDestroy( &arena );
+	ArenaDestroy( &arena );
+	TEST_CHECK_EQUAL( g_Provider.Frees, 1 );
+	TEST_CHECK( arena.VA == NULL && arena.Used == 0 );
+}
+
+static
+VOID
+TestCarve()
+{
+	ARENA arena;
+	VMX_ADDRESS a, b, c, d;
+
+	RtlZeroMemory( &g_Provider, sizeof(g_Provider) );
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, 2 * PAGE_SIZE, 0 ) == TRUE );
+
+	// Front to back; each aligned in both address spaces, and at the same offset in each
+	TEST_CHECK( ArenaCarve( &arena, 24, 8, &a ) == TRUE );
+	TEST_CHECK( ArenaCarve( &arena, 100, 64, &b ) == TRUE );
+	TEST_CHECK( ArenaCarve( &arena, PAGE_SIZE, PAGE_SIZE, &c ) == TRUE );
+
+	TEST_CHECK( a.VA == arena.VA );
+	TEST_CHECK_EQUAL( (ULONG_PTR)b.VA - (ULONG_PTR)arena.VA, 64 );
+	TEST_CHECK_EQUAL( (ULONG_PTR)b.PA, FAKE_BLOCK_PA + 64 );
+	TEST_CHECK_EQUAL( (ULONG_PTR)c.VA - (ULONG_PTR)arena.VA, PAGE_SIZE );
+	TEST_CHECK_EQUAL( (ULONG_PTR)c.PA, FAKE_BLOCK_PA + PAGE_SIZE );
+	TEST_CHECK_EQUAL( arena.Used, 2 * PAGE_SIZE );
+
+	// Full: not even a byte more, and a failed carve doesn't use anything up
+	TEST_CHECK( ArenaCarve( &arena, 1, 1, &d ) == FALSE );
+	TEST_CHECK( d.VA == NULL && d.PA == NULL );
+	TEST_CHECK_EQUAL( arena.Used, 2 * PAGE_SIZE );
+
+	// (Note: an empty carve still fits)
+	TEST_CHECK( ArenaCarve( &arena, 0, 1, &d ) == TRUE );
+
+	ArenaDestroy( &arena );
+	TEST_CHECK_EQUAL( g_Provider.Frees, 1 );
+}
+
+static
+VOID
+TestCarveRejects()
+{
+	ARENA arena;
+	VMX_ADDRESS allocation;
+
+	RtlZeroMemory( &g_Provider, sizeof(g_Provider) );
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, PAGE_SIZE, 0 ) == TRUE );
+
+	// Alignments must be powers of two, no more than a page
+	TEST_CHECK( ArenaCarve( &arena, 8, 0, &allocation ) == FALSE );
+	TEST_CHECK( ArenaCarve( &arena, 8, 24, &allocation ) == FALSE );
+	TEST_CHECK( ArenaCarve( &arena, 8, 2 * PAGE_SIZE, &allocation ) == FALSE );
+	TEST_CHECK_EQUAL( arena.Used, 0 );
+
+	// A length that would wrap around the end of the address space
+	TEST_CHECK( ArenaCarve( &arena, (SIZE_T)-8, 8, &allocation ) == FALSE );
+
+	// Aligning the next offset takes it to the very end, where nothing more fits
+	TEST_CHECK( ArenaCarve( &arena, PAGE_SIZE - 1, 1, &allocation ) == TRUE );
+	TEST_CHECK( ArenaCarve( &arena, 1, 16, &allocation ) == FALSE );
+	TEST_CHECK_EQUAL( arena.Used, PAGE_SIZE - 1 );
+
+	ArenaDestroy( &arena );
+
+	// Nothing can be carved out of an arena that was never created (or already destroyed)
+	TEST_CHECK( ArenaCarve( &arena, 8, 8, &allocation ) == FALSE );
+}
+
+static
+VOID
+TestLPLayout()
+{
+	/*
+	 * The shape of _AllocateLP's carves ("Driver.c"): page-aligned regions first, then 16-byte MSR areas, a 64-byte
+	 *  aligned XSAVE area, and cache-aligned tables, in an arena sized as LP_ARENA_SIZE is (each piece that isn't
+	 *  a whole number of pages rounded up on its own). Everything has to fit, however the alignment falls.
+	 */
+
+	static CONST struct { SIZE_T Length; SIZE_T Alignment; } carves[] = {
+		{ 6 * PAGE_SIZE, PAGE_SIZE },		// Host stack
+		{ PAGE_SIZE, PAGE_SIZE },			// VMXON region
+		{ PAGE_SIZE, PAGE_SIZE },			// VMCS
+		{ PAGE_SIZE, PAGE_SIZE },			// PML buffer
+		{ PAGE_SIZE, PAGE_SIZE },			// #VE information area
+		{ 0x210, 16 },						// Guest MSR area
+		{ 0x210, 16 },						// Host MSR area
+		{ 0x3000, 64 },						// XSAVE area
+		{ 0x1A48, 64 },						// CPUID table
+		{ 0x2230, 64 },						// Exit stats
+	};
+
+	ARENA arena;
+	VMX_ADDRESS allocation;
+	SIZE_T size;
+	ULONG i;
+
+	size = 10 * PAGE_SIZE + ROUND_TO_PAGES( 2 * 0x210 ) + 0x3000 + ROUND_TO_PAGES( 0x1A48 ) + ROUND_TO_PAGES( 0x2230 );
+
+	RtlZeroMemory( &g_Provider, sizeof(g_Provider) );
+	TEST_CHECK( ArenaCreate( &arena, &g_FakeProvider, size, 0 ) == TRUE );
+
+	for ( i = 0; i < ARRAYSIZE( carves ); i++ )
+	{
+		TEST_CHECK( ArenaCarve( &arena, carves[i].Length, carves[i].Alignment, &allocation ) == TRUE );
+		TEST_CHECK_EQUAL( (ULONG_PTR)allocation.VA % carves[i].Alignment, 0 );
+		TEST_CHECK_EQUAL( (ULONG_PTR)allocation.PA % carves[i].Alignment, 0 );
+
+		// Zeroed, and ours to write to
+		TEST_CHECK_EQUAL( ((PUINT8)allocation.VA)[carves[i].Length - 1], 0 );
+		((PUINT8)allocation.VA)[carves[i].Length - 1] = 0xAA;
+	}
+
+	TEST_CHECK( arena.Used <= arena.Size );
+
+	ArenaDestroy( &arena );
+	TEST_CHECK_EQUAL( g_Provider.Frees, 1 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestCreate );
+	TEST_RUN( TestCarve );
+	TEST_RUN( TestCarveRejects );
+	TEST_RUN( TestLPLayout );
+
+	return TEST_EXIT_CODE();
+}
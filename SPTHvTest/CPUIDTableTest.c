@@ -0,0 +1,491 @@
+#include <string.h>
+
+#include "CPUIDTable.h"
+#include "Test.h"
+
+/*
+ * Each LP's CPUID table, built from recorded dumps rather than from the processor it runs on: every leaf and
+ *  subleaf CpuidTableLookup answers has to be what the dump says (with our overrides, and the guest's CR4 bits), and
+ *  everything it doesn't answer is left to be answered live. A full table has to be the same, with less in it.
+ */
+
+// A recorded CPUID(Leaf, Subleaf)
+typedef struct _CPUID_RECORD
+{
+	UINT32 Leaf;
+	UINT32 Subleaf;
+	CPUID_ENTRY Entry;
+} CPUID_RECORD, *PCPUID_RECORD;
+
+typedef struct _CPUID_DUMP
+{
+	CONST CPUID_RECORD* Records;
+	ULONG Count;
+
+	// Whether CpuidTableBuild asked for anything that isn't the processor's to answer (or that it answers live)
+	BOOLEAN ReadHypervisor;
+	BOOLEAN ReadLive;
+} CPUID_DUMP, *PCPUID_DUMP;
+
+/*
+ * Recorded from an Intel Xeon (family 6, model CFH), under a hypervisor of its own. Trimmed: a leaf that ignores ECX
+ *  has its subleaf 0 only, and the subleaves past the end of a list (zeros, or for 0BH and 1FH, ECX echoed back) are
+ *  left out, but for the first of 0BH's and 1FH's.
+ */
+static CONST CPUID_RECORD g_XeonDump[] = {
+	{ 0x00000000,  0, { 0x00000020, 0x756E6547, 0x6C65746E, 0x49656E69 } },
+	{ 0x00000001,  0, { 0x000C06F2, 0x00010800, 0xFFFA3203, 0x0F8BFBFF } },
+	{ 0x00000002,  0, { 0x00FEFF01, 0x000000F0, 0x00000000, 0x00000000 } },
+	{ 0x00000003,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000004,  0, { 0x00000121, 0x02C0003F, 0x0000003F, 0x00000000 } },
+	{ 0x00000004,  1, { 0x00000122, 0x01C0003F, 0x0000003F, 0x00000000 } },
+	{ 0x00000004,  2, { 0x00000143, 0x03C0003F, 0x000007FF, 0x00000000 } },
+	{ 0x00000004,  3, { 0x00000163, 0x04C0003F, 0x0003BFFF, 0x00000004 } },
+	{ 0x00000005,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000006,  0, { 0x00000004, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000007,  0, { 0x00000002, 0xF1BF27EB, 0x1B415FDE, 0xBFD14410 } },
+	{ 0x00000007,  1, { 0x00001C30, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000007,  2, { 0x00000000, 0x00000000, 0x00000000, 0x0000001F } },
+	{ 0x00000008,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000009,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000000A,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000000B,  0, { 0x00000000, 0x00000001, 0x00000100, 0x00000000 } },
+	{ 0x0000000B,  1, { 0x00000005, 0x00000001, 0x00000201, 0x00000000 } },
+	{ 0x0000000B,  2, { 0x00000000, 0x00000000, 0x00000002, 0x00000000 } },
+	{ 0x0000000C,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000000D,  0, { 0x000602E7, 0x00002B00, 0x00002B00, 0x00000000 } },
+	{ 0x0000000D,  1, { 0x0000001F, 0x00002A00, 0x00001800, 0x00000000 } },
+	{ 0x0000000D,  2, { 0x00000100, 0x00000240, 0x00000000, 0x00000000 } },
+	{ 0x0000000D,  5, { 0x00000040, 0x00000440, 0x00000000, 0x00000000 } },
+	{ 0x0000000D,  6, { 0x00000200, 0x00000480, 0x00000000, 0x00000000 } },
+	{ 0x0000000D,  7, { 0x00000400, 0x00000680, 0x00000000, 0x00000000 } },
+	{ 0x0000000D,  9, { 0x00000008, 0x00000A80, 0x00000000, 0x00000000 } },
+	{ 0x0000000D, 11, { 0x00000010, 0x00000000, 0x00000001, 0x00000000 } },
+	{ 0x0000000D, 12, { 0x00000018, 0x00000000, 0x00000001, 0x00000000 } },
+	{ 0x0000000D, 17, { 0x00000040, 0x00000AC0, 0x00000002, 0x00000000 } },
+	{ 0x0000000D, 18, { 0x00002000, 0x00000B00, 0x00000006, 0x00000000 } },
+	{ 0x0000000E,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000000F,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000010,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000011,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000012,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000013,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000014,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000015,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000016,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000017,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000018,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000019,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000001A,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000001B,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000001C,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000001D,  0, { 0x00000001, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000001D,  1, { 0x04002000, 0x00080040, 0x00000010, 0x00000000 } },
+	{ 0x0000001E,  0, { 0x00000000, 0x00004010, 0x00000000, 0x00000000 } },
+	{ 0x0000001F,  0, { 0x00000000, 0x00000001, 0x00000100, 0x00000000 } },
+	{ 0x0000001F,  1, { 0x00000005, 0x00000001, 0x00000201, 0x00000000 } },
+	{ 0x0000001F,  2, { 0x00000000, 0x00000000, 0x00000002, 0x00000000 } },
+	{ 0x00000020,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x80000000,  0, { 0x80000008, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x80000001,  0, { 0x00000000, 0x00000000, 0x00000121, 0x2C100800 } },
+	{ 0x80000002,  0, { 0x65746E49, 0x2952286C, 0x6F655820, 0x2952286E } },
+	{ 0x80000003,  0, { 0x6F725020, 0x73736563, 0x0000726F, 0x00000000 } },
+	{ 0x80000004,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x80000005,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x80000006,  0, { 0x00000000, 0x00000000, 0x08007040, 0x00000000 } },
+	{ 0x80000007,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000100 } },
+	{ 0x80000008,  0, { 0x002E392E, 0x0100D200, 0x00000000, 0x00000000 } },
+};
+
+// A smaller processor, made up: leaves up to 0BH, and no extended leaves at all
+static CONST CPUID_RECORD g_SmallDump[] = {
+	{ 0x00000000,  0, { 0x0000000B, 0x756E6547, 0x6C65746E, 0x49656E69 } },
+	{ 0x00000001,  0, { 0x000306C3, 0x02100800, 0x7FFAFBBF, 0xBFEBFBFF } },
+	{ 0x00000002,  0, { 0x76036301, 0x00F0B5FF, 0x00000000, 0x00C10000 } },
+	{ 0x00000003,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000004,  0, { 0x1C004121, 0x01C0003F, 0x0000003F, 0x00000000 } },
+	{ 0x00000004,  1, { 0x1C004122, 0x01C0003F, 0x0000003F, 0x00000000 } },
+	{ 0x00000004,  2, { 0x1C004143, 0x01C0003F, 0x000001FF, 0x00000000 } },
+	{ 0x00000005,  0, { 0x00000040, 0x00000040, 0x00000003, 0x00042120 } },
+	{ 0x00000006,  0, { 0x00000077, 0x00000002, 0x00000009, 0x00000000 } },
+	{ 0x00000007,  0, { 0x00000000, 0x000027AB, 0x00000000, 0x00000000 } },
+	{ 0x00000008,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x00000009,  0, { 0x00000000, 0x00000000, 0x00000000, 0x00000000 } },
+	{ 0x0000000A,  0, { 0x07300403, 0x00000000, 0x00000000, 0x00000603 } },
+	{ 0x0000000B,  0, { 0x00000001, 0x00000002, 0x00000100, 0x00000003 } },
+	{ 0x0000000B,  1, { 0x00000004, 0x00000008, 0x00000201, 0x00000003 } },
+	{ 0x0000000B,  2, { 0x00000000, 0x00000000, 0x00000002, 0x00000003 } },
+};
+
+#define CR4_OSXSAVE						(1ULL << 18)
+#define CR4_PKE							(1ULL << 22)
+
+static CPUID_TABLE g_Table;
+
+static
+VOID
+_ReplayDump(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PCPUID_ENTRY Result,
+	_In_opt_ PVOID Context
+	)
+{
+	/*
+	 * Answer as the recorded processor would have: what was recorded; subleaf 0 for a leaf that ignores ECX; zeros for
+	 *  a subleaf past the end of a list; and for a leaf above the highest there is, the highest basic leaf
+	 *  ([CPUID] "If a value entered for CPUID.EAX is higher than the maximum input value ...").
+	 */
+
+	PCPUID_DUMP dump = (PCPUID_DUMP)Context;
+	UINT32 maxLeaf = dump->Records[0].Entry.Eax;
+	ULONG i, records = 0;
+
+	if ( Leaf >= CPUID_HYPERVISOR_BASE && Leaf < CPUID_EXTENDED_BASE )
+	{
+		dump->ReadHypervisor = TRUE;
+	}
+
+	if ( Leaf == 0x0D )
+	{
+		dump->ReadLive = TRUE;
+	}
+
+	for ( i = 0; i < dump->Count; i++ )
+	{
+		if ( dump->Records[i].Leaf == Leaf && dump->Records[i].Subleaf == Subleaf )
+		{
+			*Result = dump->Records[i].Entry;
+			return;
+		}
+
+		records += (dump->Records[i].Leaf == Leaf);
+	}
+
+	if ( records == 0 )
+	{
+		_ReplayDump( maxLeaf, Subleaf, Result, Context );
+		return;
+	}
+
+	RtlZeroMemory( Result, sizeof(CPUID_ENTRY) );
+
+	if ( records == 1 )
+	{
+		_ReplayDump( Leaf, 0, Result, Context );
+	}
+}
+
+static
+VOID
+_ReplayGreedy(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PCPUID_ENTRY Result,
+	_In_opt_ PVOID Context
+	)
+{
+	// The Xeon, but with more caches (leaf 04H) and subleaves (every leaf that says how many in EAX) than anything has room for
+
+	_ReplayDump( Leaf, Subleaf, Result, Context );
+
+	if ( Leaf == 0x04 || Leaf == 0x07 || Leaf == 0x14 || Leaf == 0x17 || Leaf == 0x18 || Leaf == 0x1D || Leaf == 0x20 )
+	{
+		Result->Eax = (Subleaf == 0 && Leaf != 0x04) ? 40 : (Leaf << 16) | (Subleaf << 8) | 0x1;
+		Result->Ebx = Subleaf;
+	}
+}
+
+static
+VOID
+_Expected(
+	_In_ CPUID_READER Reader,
+	_In_ PCPUID_DUMP Dump,
+	_In_ CONST UINT32 Leaf,
+	_In_ CONST UINT32 Subleaf,
+	_In_ CONST UINT64 GuestCR4,
+	_Out_ PCPUID_ENTRY Result
+	)
+{
+	// What the guest has to see for CPUID(Leaf, Subleaf), however it's answered
+
+	CPUID_DUMP scratch = *Dump;
+
+	if ( Leaf >= CPUID_HYPERVISOR_BASE && Leaf < CPUID_EXTENDED_BASE )
+	{
+		RtlZeroMemory( Result, sizeof(CPUID_ENTRY) );
+	}
+	else
+	{
+		Reader( Leaf, Subleaf, Result, &scratch );
+	}
+
+	CpuidApplyOverrides( g_CPUIDOverrides, CPUID_OVERRIDE_COUNT, Leaf, Subleaf, Result );
+
+	if ( Leaf == 0x01 )
+	{
+		Result->Ecx = (Result->Ecx & ~CPUID_01_ECX_OSXSAVE) | (((GuestCR4 & CR4_OSXSAVE) != 0) ? CPUID_01_ECX_OSXSAVE : 0);
+	}
+	else if ( Leaf == 0x07 && Subleaf == 0 )
+	{
+		Result->Ecx = (Result->Ecx & ~CPUID_07_ECX_OSPKE) | (((GuestCR4 & CR4_PKE) != 0) ? CPUID_07_ECX_OSPKE : 0);
+	}
+}
+
+static
+ULONG
+_CheckTable(
+	_In_ CPUID_READER Reader,
+	_In_ PCPUID_DUMP Dump,
+	_In_ CONST UINT64 GuestCR4
+	)
+{
+	/*
+	 * Every subleaf (and then some) of every leaf in each range, and a few outside them: whatever's answered from
+	 *  the table has to be right; returns how many were.
+	 */
+
+	CONST UINT32 bases[] = { 0, CPUID_HYPERVISOR_BASE, CPUID_EXTENDED_BASE };
+	CPUID_ENTRY entry, expected;
+	ULONG answered = 0, wrong = 0;
+	UINT32 leaf, subleaf;
+	ULONG range;
+
+	for ( range = 0; range < ARRAYSIZE( bases ); range++ )
+	{
+		for ( leaf = bases[range]; leaf < bases[range] + CPUID_RANGE_LEAVES + 2; leaf++ )
+		{
+			for ( subleaf = 0; subleaf <= CPUID_MAX_SUBLEAVES + 8; subleaf++ )
+			{
+				if ( CpuidTableLookup( &g_Table, leaf, (subleaf > CPUID_MAX_SUBLEAVES) ? MAXUINT32 - subleaf : subleaf, GuestCR4, &entry ) == FALSE )
+				{
+					continue;
+				}
+
+				_Expected( Reader, Dump, leaf, (subleaf > CPUID_MAX_SUBLEAVES) ? MAXUINT32 - subleaf : subleaf, GuestCR4, &expected );
+
+				wrong += (memcmp( &entry, &expected, sizeof(CPUID_ENTRY) ) != 0);
+				answered++;
+			}
+		}
+	}
+
+	TEST_CHECK_EQUAL( wrong, 0 );
+
+	// Nothing past the three ranges
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0xC0000000, 0, GuestCR4, &entry ) == FALSE );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0xFFFFFFFF, 0, GuestCR4, &entry ) == FALSE );
+
+	return answered;
+}
+
+static
+BOOLEAN
+_Answered(
+	_In_ CONST UINT32 Leaf,
+	_In_ CONST UINT32 Subleaf
+	)
+{
+	CPUID_ENTRY entry;
+
+	return CpuidTableLookup( &g_Table, Leaf, Subleaf, CR4_OSXSAVE, &entry );
+}
+
+static
+VOID
+TestXeon()
+{
+	CPUID_DUMP dump = { g_XeonDump, ARRAYSIZE( g_XeonDump ), FALSE, FALSE };
+	CPUID_ENTRY entry;
+	ULONG answered;
+
+	TEST_CHECK_EQUAL( CpuidTableBuild( &g_Table, _ReplayDump, &dump, g_CPUIDOverrides, CPUID_OVERRIDE_COUNT ), g_Table.EntryCount );
+
+	TEST_CHECK_EQUAL( g_Table.MaxLeaf[CPUID_RANGE_BASIC], 0x20 );
+	TEST_CHECK_EQUAL( g_Table.MaxLeaf[CPUID_RANGE_HYPERVISOR], CPUID_HYPERVISOR_MAX_LEAF );
+	TEST_CHECK_EQUAL( g_Table.MaxLeaf[CPUID_RANGE_EXTENDED], 0x80000008 );
+
+	// The hypervisor leaves are ours, and leaf 0DH's sizes change with XCR0; neither is the processor's to answer here
+	TEST_CHECK( dump.ReadHypervisor == FALSE );
+	TEST_CHECK( dump.ReadLive == FALSE );
+
+	// Every basic leaf but 0DH (one entry each, but for 04H's four caches, 07H's three subleaves, and 0BH's, 1DH's and 1FH's two)
+	TEST_CHECK_EQUAL( g_Table.EntryCount, (0x20 + 1 - 1) + 3 + 2 + 1 + 1 + 1 + 2 + 9 );
+
+	answered = _CheckTable( _ReplayDump, &dump, CR4_OSXSAVE );
+	TEST_CHECK( answered > 0 );
+	answered = _CheckTable( _ReplayDump, &dump, CR4_PKE );
+	TEST_CHECK( answered > 0 );
+
+	// A leaf that ignores ECX is answered whatever it is
+	TEST_CHECK( _Answered( 0x00, 0 ) && _Answered( 0x01, 7 ) && _Answered( 0x06, MAXUINT32 ) );
+	TEST_CHECK( _Answered( 0x80000002, 3 ) && _Answered( 0x80000008, 0 ) );
+
+	// A list is answered up to its end, and live from there
+	TEST_CHECK( _Answered( 0x04, 3 ) && _Answered( 0x04, 4 ) == FALSE );
+	TEST_CHECK( _Answered( 0x07, 2 ) && _Answered( 0x07, 3 ) == FALSE );
+	TEST_CHECK( _Answered( 0x0B, 1 ) && _Answered( 0x0B, 2 ) == FALSE );
+	TEST_CHECK( _Answered( 0x1F, 1 ) && _Answered( 0x1F, 2 ) == FALSE );
+	TEST_CHECK( _Answered( 0x1D, 1 ) && _Answered( 0x1D, 2 ) == FALSE );
+
+	// A leaf we know nothing about has its subleaf 0 recorded, and nothing else
+	TEST_CHECK( _Answered( 0x1E, 0 ) && _Answered( 0x1E, 1 ) == FALSE );
+
+	// Past the highest leaf of a range, and leaf 0DH, are always live
+	TEST_CHECK( _Answered( 0x21, 0 ) == FALSE );
+	TEST_CHECK( _Answered( 0x80000009, 0 ) == FALSE );
+	TEST_CHECK( _Answered( 0x0D, 0 ) == FALSE && _Answered( 0x0D, 1 ) == FALSE );
+
+	// We're there (ECX[31] of leaf 01H), and who we are
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x01, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx & (1UL << 31), 1UL << 31 );
+	TEST_CHECK_EQUAL( entry.Eax, 0x000C06F2 );
+
+	TEST_CHECK( CpuidTableLookup( &g_Table, CPUID_HYPERVISOR_BASE, 5, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Eax, CPUID_HYPERVISOR_MAX_LEAF );
+	TEST_CHECK( memcmp( &entry.Ebx, "SPTHvSPTHv\0\0", 12 ) == 0 );
+
+	// The rest of the hypervisor range is empty, rather than the processor's
+	TEST_CHECK( CpuidTableLookup( &g_Table, CPUID_HYPERVISOR_BASE + 1, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Eax | entry.Ebx | entry.Ecx | entry.Edx, 0 );
+	TEST_CHECK( CpuidTableLookup( &g_Table, CPUID_HYPERVISOR_BASE + 0x3F, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Eax | entry.Ebx | entry.Ecx | entry.Edx, 0 );
+	TEST_CHECK( _Answered( CPUID_HYPERVISOR_BASE + CPUID_RANGE_LEAVES, 0 ) == FALSE );
+
+	// OSXSAVE and OSPKE are the guest's CR4, whatever the processor said
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x01, 0, CR4_OSXSAVE, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx & CPUID_01_ECX_OSXSAVE, CPUID_01_ECX_OSXSAVE );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x01, 0, CR4_PKE, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx & CPUID_01_ECX_OSXSAVE, 0 );
+
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 0, CR4_PKE, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx & CPUID_07_ECX_OSPKE, CPUID_07_ECX_OSPKE );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 0, CR4_OSXSAVE, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx & CPUID_07_ECX_OSPKE, 0 );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 1, CR4_PKE, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx, 0 );
+}
+
+static
+VOID
+TestSmall()
+{
+	CPUID_DUMP dump = { g_SmallDump, ARRAYSIZE( g_SmallDump ), FALSE, FALSE };
+
+	CpuidTableBuild( &g_Table, _ReplayDump, &dump, g_CPUIDOverrides, CPUID_OVERRIDE_COUNT );
+
+	// CPUID(80000000H) is leaf 0BH's answer; there's no extended leaf to record
+	TEST_CHECK_EQUAL( g_Table.MaxLeaf[CPUID_RANGE_BASIC], 0x0B );
+	TEST_CHECK_EQUAL( g_Table.MaxLeaf[CPUID_RANGE_EXTENDED], CPUID_EXTENDED_BASE - 1 );
+
+	TEST_CHECK( _CheckTable( _ReplayDump, &dump, CR4_OSXSAVE | CR4_PKE ) > 0 );
+
+	// Leaves 00H-0BH, with three caches and two topology levels, and our two
+	TEST_CHECK_EQUAL( g_Table.EntryCount, 0x0C + 2 + 1 + 2 );
+
+	TEST_CHECK( _Answered( 0x04, 2 ) && _Answered( 0x04, 3 ) == FALSE );
+	TEST_CHECK( _Answered( 0x07, 0 ) && _Answered( 0x07, 1 ) == FALSE );
+	TEST_CHECK( _Answered( 0x0C, 0 ) == FALSE && _Answered( 0x1F, 0 ) == FALSE );
+	TEST_CHECK( _Answered( CPUID_EXTENDED_BASE, 0 ) == FALSE && _Answered( 0x80000001, 0 ) == FALSE );
+	TEST_CHECK( _Answered( CPUID_HYPERVISOR_BASE, 0 ) );
+}
+
+static
+VOID
+TestFullTable()
+{
+	CPUID_DUMP dump = { g_XeonDump, ARRAYSIZE( g_XeonDump ), FALSE, FALSE };
+	CONST CPUID_SLOT* slot;
+	ULONG range, i, overlaps = 0, end = 0;
+
+	TEST_CHECK_EQUAL( CpuidTableBuild( &g_Table, _ReplayGreedy, &dump, g_CPUIDOverrides, CPUID_OVERRIDE_COUNT ), CPUID_TABLE_MAX_ENTRIES );
+
+	// Fewer answered, never a wrong one
+	TEST_CHECK( _CheckTable( _ReplayGreedy, &dump, CR4_OSXSAVE ) > 0 );
+
+	// No leaf lists more than CPUID_MAX_SUBLEAVES, however many it says it has
+	TEST_CHECK( _Answered( 0x04, CPUID_MAX_SUBLEAVES - 1 ) && _Answered( 0x04, CPUID_MAX_SUBLEAVES ) == FALSE );
+	TEST_CHECK( _Answered( 0x07, CPUID_MAX_SUBLEAVES - 1 ) && _Answered( 0x07, CPUID_MAX_SUBLEAVES ) == FALSE );
+
+	// The basic leaves and ours made it in, and the first of the extended ones; the rest are live
+	TEST_CHECK( _Answered( 0x20, 5 ) && _Answered( CPUID_HYPERVISOR_BASE, 0 ) && _Answered( CPUID_EXTENDED_BASE, 0 ) );
+	TEST_CHECK( _Answered( 0x80000008, 0 ) == FALSE );
+
+	// The slots' entries are in order, and none of them overlaps another's (or runs off the end)
+	for ( range = 0; range < CPUID_RANGE_COUNT; range++ )
+	{
+		for ( i = 0; i < CPUID_RANGE_LEAVES; i++ )
+		{
+			slot = &g_Table.Slots[range][i];
+
+			if ( slot->Count == 0 )
+			{
+				continue;
+			}
+
+			overlaps += (slot->First < end);
+			end = (ULONG)slot->First + slot->Count;
+		}
+	}
+
+	TEST_CHECK_EQUAL( overlaps, 0 );
+	TEST_CHECK_EQUAL( end, CPUID_TABLE_MAX_ENTRIES );
+}
+
+static
+VOID
+TestOverrides()
+{
+	CONST CPUID_OVERRIDE overrides[] = {
+		{ 0x07, 0, CPUID_EBX, 0x0000FF00, 0x00001200 },
+		{ 0x07, 1, CPUID_EAX, MAXUINT32, 0xAAAAAAAA },
+		{ 0x07, CPUID_ANY_SUBLEAF, CPUID_EDX, 0x1, 0x0 },
+		{ 0x80000001, CPUID_ANY_SUBLEAF, CPUID_ECX, 0x100, 0x0 },
+	};
+	CPUID_DUMP dump = { g_XeonDump, ARRAYSIZE( g_XeonDump ), FALSE, FALSE };
+	CPUID_ENTRY entry;
+
+	entry.Eax = 0x11111111;
+	entry.Ebx = 0x12345678;
+	entry.Ecx = 0x22222222;
+	entry.Edx = 0xFFFFFFFF;
+
+	// Only the Mask bits of the one register, of the one subleaf asked for (or of any subleaf)
+	CpuidApplyOverrides( overrides, ARRAYSIZE( overrides ), 0x07, 0, &entry );
+	TEST_CHECK_EQUAL( entry.Eax, 0x11111111 );
+	TEST_CHECK_EQUAL( entry.Ebx, 0x12341278 );
+	TEST_CHECK_EQUAL( entry.Ecx, 0x22222222 );
+	TEST_CHECK_EQUAL( entry.Edx, 0xFFFFFFFE );
+
+	CpuidApplyOverrides( overrides, ARRAYSIZE( overrides ), 0x07, 1, &entry );
+	TEST_CHECK_EQUAL( entry.Eax, 0xAAAAAAAA );
+	TEST_CHECK_EQUAL( entry.Ebx, 0x12341278 );
+
+	// A table built with them has them in every entry they apply to
+	CpuidTableBuild( &g_Table, _ReplayDump, &dump, overrides, ARRAYSIZE( overrides ) );
+
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ebx, (0xF1BF27EB & ~0x0000FF00) | 0x00001200 );
+	TEST_CHECK_EQUAL( entry.Edx, 0xBFD14410 );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 1, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Eax, 0xAAAAAAAA );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x07, 2, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Edx, 0x0000001E );
+	TEST_CHECK( CpuidTableLookup( &g_Table, 0x80000001, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Ecx, 0x00000021 );
+
+	// And without ours, nobody's there
+	TEST_CHECK( CpuidTableLookup( &g_Table, CPUID_HYPERVISOR_BASE, 0, 0, &entry ) == TRUE );
+	TEST_CHECK_EQUAL( entry.Eax | entry.Ebx | entry.Ecx | entry.Edx, 0 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestXeon );
+	TEST_RUN( TestSmall );
+	TEST_RUN( TestFullTable );
+	TEST_RUN( TestOverrides );
+
+	return TEST_EXIT_CODE();
+}
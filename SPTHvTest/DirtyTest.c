@@ -0,0 +1,442 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Dirty.h"
+#include "Test.h"
+
+/*
+ * The dirty bitmap PML logs drain into, over the EPT identity map of 2GB of guest-physical memory with a page of each
+ *  size in it: 4KB pages in the first 2MB, 2MB pages up to 1GB, and a 1GB page after that. Pages are marked directly and
+ *  from made-up logs (at every index the processor can leave one at), harvested back out, and then marked from a
+ *  thread per online CPU while a harvester takes them; every page marked has to come out of exactly one harvest.
+ *  A second view, a copy of the first with one of its 2MB pages split, has to be drained and harvested along with it.
+ */
+
+#define FAKE_POOL_PA					0x12340000ULL
+#define FAKE_ALT_POOL_PA				0x56780000ULL
+
+static CONST EPT_MEMORY_RANGE g_RAM[] = {
+	{ 0x0000000000001000ULL, 0x000000000009E000ULL },		// 4KB pages, in the first 2MB
+	{ 0x0000000000100000ULL, 0x000000007FF00000ULL },		// 2MB pages up to 1GB, and a 1GB page after it
+};
+
+#define MAP_LIMIT						0x80000000ULL
+#define MAP_PAGES						(MAP_LIMIT / EPT_PAGE_SIZE)
+
+#define SMALL_PAGE						0x5000ULL
+#define LARGE_PAGE						0x400000ULL
+#define HUGE_PAGE						0x40000000ULL
+
+#define STRESS_PAGES					0x20000		// Marked, between all the markers
+
+static EPT_VIEW g_View;
+static EPT_VIEW g_AltView;
+static PEPT_VIEW g_Views[2] = { &g_View, &g_AltView };
+static DIRTY_BITMAP g_Bitmap;
+static UINT64 g_Log[PML_LOG_ENTRIES];
+static UINT64 g_Harvested[MAP_PAGES / DIRTY_PAGES_PER_WORD];
+
+static
+VOID
+_BuildView()
+{
+	ULONG pages = EptCountTablePages( g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE );
+
+	RtlZeroMemory( &g_View, sizeof(g_View) );
+
+	g_View.Pool.VA = aligned_alloc( EPT_PAGE_SIZE, (SIZE_T)pages * EPT_PAGE_SIZE );
+	g_View.Pool.PA = FAKE_POOL_PA;
+	g_View.Pool.PageCount = pages;
+
+	TEST_CHECK( EptBuildIdentityMap( &g_View, g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE ) == TRUE );
+
+	// A bit for every page the view maps, and a word past them that has to stay clear
+	g_Bitmap.PageCount = MAP_PAGES;
+	g_Bitmap.Bits = calloc( 1, DIRTY_BITMAP_BYTES( g_Bitmap.PageCount ) + sizeof(UINT64) );
+}
+
+static
+VOID
+_FreeView()
+{
+	free( (PVOID)g_Bitmap.Bits );
+	free( g_View.Pool.VA );
+
+	g_Bitmap.Bits = NULL;
+	g_View.Pool.VA = NULL;
+}
+
+static
+BOOLEAN
+_IsMarked(
+	_In_ CONST UINT64 Page
+	)
+{
+	return ((UINT64)g_Bitmap.Bits[Page / DIRTY_PAGES_PER_WORD] >> (Page % DIRTY_PAGES_PER_WORD)) & 1;
+}
+
+static
+UINT64
+_CountMarked()
+{
+	UINT64 count = 0;
+	UINT64 i;
+
+	for ( i = 0; i < g_Bitmap.PageCount / DIRTY_PAGES_PER_WORD; i++ )
+	{
+		count += __builtin_popcountll( (UINT64)g_Bitmap.Bits[i] );
+	}
+
+	return count;
+}
+
+static
+VOID
+_SetDirty(
+	_In_ CONST UINT64 GuestPA
+	)
+{
+	// As the processor would, on the first write to the page
+	UINT64 pageSize;
+
+	EptGetLeafEntry( &g_View, GuestPA, &pageSize )->Dirty = 1;
+}
+
+static
+BOOLEAN
+_IsDirty(
+	_In_ CONST UINT64 GuestPA
+	)
+{
+	UINT64 pageSize;
+
+	return EptGetLeafEntry( &g_View, GuestPA, &pageSize )->Dirty == 1;
+}
+
+static
+VOID
+TestMarkRange()
+{
+	_BuildView();
+
+	// Within a word
+	DirtyMarkRange( &g_Bitmap, 3, 5 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[0], 0xF8 );
+
+	// Across a word boundary, and marking some pages again
+	DirtyMarkRange( &g_Bitmap, 60, 10 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[0], 0xF0000000000000F8ULL );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[1], 0x3F );
+	DirtyMarkRange( &g_Bitmap, 62, 3 );
+	TEST_CHECK_EQUAL( _CountMarked(), 15 );
+
+	// Whole words, and the ends of the words on either side
+	DirtyReset( &g_Bitmap );
+	DirtyMarkRange( &g_Bitmap, 127, 130 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[1], 0x8000000000000000ULL );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[2], MAXUINT64 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[3], MAXUINT64 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[4], 0x1 );
+	TEST_CHECK_EQUAL( _CountMarked(), 130 );
+
+	// Nothing past the end of the bitmap, and nothing at all for no pages
+	DirtyReset( &g_Bitmap );
+	DirtyMarkRange( &g_Bitmap, MAP_PAGES - 2, 10 );
+	DirtyMarkRange( &g_Bitmap, MAP_PAGES, 1 );
+	DirtyMarkRange( &g_Bitmap, 1000, 0 );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[MAP_PAGES / DIRTY_PAGES_PER_WORD - 1], 0xC000000000000000ULL );
+	TEST_CHECK_EQUAL( g_Bitmap.Bits[MAP_PAGES / DIRTY_PAGES_PER_WORD], 0 );
+	TEST_CHECK_EQUAL( _CountMarked(), 2 );
+
+	_FreeView();
+}
+
+static
+VOID
+TestDrainLog()
+{
+	ULONG i;
+
+	_BuildView();
+
+	// Filled from the last entry down; the index is the next one the processor would have written
+	g_Log[PML_LOG_ENTRIES - 1] = SMALL_PAGE;
+	g_Log[PML_LOG_ENTRIES - 2] = LARGE_PAGE + 0x3000;
+	g_Log[PML_LOG_ENTRIES - 3] = MAP_LIMIT;					// Not mapped; skipped, but drained
+	g_Log[PML_LOG_ENTRIES - 4] = HUGE_PAGE + 0x123000;
+
+	// Nothing logged yet
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 1, g_Log, PML_INDEX_START ), 0 );
+	TEST_CHECK_EQUAL( _CountMarked(), 0 );
+
+	// A 4KB page is just that page; a 2MB page is the whole of it
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 1, g_Log, PML_INDEX_START - 2 ), 2 );
+	TEST_CHECK( _IsMarked( SMALL_PAGE / EPT_PAGE_SIZE ) == TRUE );
+	TEST_CHECK( _IsMarked( LARGE_PAGE / EPT_PAGE_SIZE ) == TRUE );
+	TEST_CHECK( _IsMarked( (LARGE_PAGE + EPT_LARGE_PAGE_SIZE) / EPT_PAGE_SIZE - 1 ) == TRUE );
+	TEST_CHECK( _IsMarked( (LARGE_PAGE + EPT_LARGE_PAGE_SIZE) / EPT_PAGE_SIZE ) == FALSE );
+	TEST_CHECK_EQUAL( _CountMarked(), 1 + EPT_LARGE_PAGE_SIZE / EPT_PAGE_SIZE );
+
+	// And a 1GB page the whole of that
+	DirtyReset( &g_Bitmap );
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 1, g_Log, PML_INDEX_START - 4 ), 4 );
+	TEST_CHECK( _IsMarked( HUGE_PAGE / EPT_PAGE_SIZE ) == TRUE );
+	TEST_CHECK( _IsMarked( HUGE_PAGE / EPT_PAGE_SIZE - 1 ) == FALSE );
+	TEST_CHECK_EQUAL( _CountMarked(), 1 + (EPT_LARGE_PAGE_SIZE + EPT_HUGE_PAGE_SIZE) / EPT_PAGE_SIZE );
+
+	// A full log has wrapped the index past 0; every entry in it is drained
+	DirtyReset( &g_Bitmap );
+
+	for ( i = 0; i < PML_LOG_ENTRIES; i++ )
+	{
+		g_Log[i] = (UINT64)i * EPT_PAGE_SIZE;
+	}
+
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 1, g_Log, 0xFFFF ), PML_LOG_ENTRIES );
+
+	// (Note: the first 2MB is all 4KB pages, so these are exactly the pages logged)
+	TEST_CHECK_EQUAL( _CountMarked(), PML_LOG_ENTRIES );
+	TEST_CHECK( _IsMarked( 0 ) == TRUE );
+	TEST_CHECK( _IsMarked( PML_LOG_ENTRIES - 1 ) == TRUE );
+
+	// One entry short of full
+	DirtyReset( &g_Bitmap );
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 1, g_Log, 0 ), PML_LOG_ENTRIES - 1 );
+	TEST_CHECK( _IsMarked( 0 ) == FALSE );
+	TEST_CHECK_EQUAL( _CountMarked(), PML_LOG_ENTRIES - 1 );
+
+	_FreeView();
+}
+
+static
+VOID
+TestHarvest()
+{
+	_BuildView();
+
+	// Pages of each size, as draining their logs would have left them
+	_SetDirty( SMALL_PAGE );
+	_SetDirty( LARGE_PAGE );
+	_SetDirty( HUGE_PAGE );
+	DirtyMarkRange( &g_Bitmap, SMALL_PAGE / EPT_PAGE_SIZE, 1 );
+	DirtyMarkRange( &g_Bitmap, LARGE_PAGE / EPT_PAGE_SIZE, EPT_LARGE_PAGE_SIZE / EPT_PAGE_SIZE );
+
+	// (Note: as if only its first page had been logged so far; it's still its own flag, right after the last one)
+	_SetDirty( LARGE_PAGE + EPT_LARGE_PAGE_SIZE );
+	DirtyMarkRange( &g_Bitmap, (LARGE_PAGE + EPT_LARGE_PAGE_SIZE) / EPT_PAGE_SIZE, 1 );
+	DirtyMarkRange( &g_Bitmap, HUGE_PAGE / EPT_PAGE_SIZE, EPT_HUGE_PAGE_SIZE / EPT_PAGE_SIZE );
+
+	// And one written to after the last drain; it isn't in the bitmap, so its flag stays set for the next log
+	_SetDirty( 0x9E000 );
+
+	// Part of the bitmap: only those bits are taken, and only those pages' flags cleared
+	TEST_CHECK_EQUAL( DirtyHarvest( &g_Bitmap, g_Views, 1, 0, 2 * DIRTY_PAGES_PER_WORD, g_Harvested ), 1 );
+	TEST_CHECK_EQUAL( g_Harvested[0], 1ULL << (SMALL_PAGE / EPT_PAGE_SIZE) );
+	TEST_CHECK_EQUAL( g_Harvested[1], 0 );
+	TEST_CHECK( _IsDirty( SMALL_PAGE ) == FALSE );
+	TEST_CHECK( _IsDirty( LARGE_PAGE ) == TRUE );
+
+	// Everything else, in one go
+	TEST_CHECK_EQUAL( DirtyHarvest( &g_Bitmap, g_Views, 1, 0, MAP_PAGES, g_Harvested ),
+					  (EPT_LARGE_PAGE_SIZE + EPT_HUGE_PAGE_SIZE) / EPT_PAGE_SIZE + 1 );
+	TEST_CHECK_EQUAL( g_Harvested[LARGE_PAGE / EPT_PAGE_SIZE / DIRTY_PAGES_PER_WORD], MAXUINT64 );
+	TEST_CHECK_EQUAL( g_Harvested[HUGE_PAGE / EPT_PAGE_SIZE / DIRTY_PAGES_PER_WORD], MAXUINT64 );
+	TEST_CHECK_EQUAL( g_Harvested[0], 0 );
+	TEST_CHECK_EQUAL( _CountMarked(), 0 );
+
+	TEST_CHECK( _IsDirty( LARGE_PAGE ) == FALSE );
+	TEST_CHECK( _IsDirty( LARGE_PAGE + EPT_LARGE_PAGE_SIZE ) == FALSE );
+	TEST_CHECK( _IsDirty( HUGE_PAGE ) == FALSE );
+	TEST_CHECK( _IsDirty( 0x9E000 ) == TRUE );
+	TEST_CHECK_EQUAL( EptClearAllDirty( &g_View ), 1 );
+
+	// Taken means gone
+	TEST_CHECK_EQUAL( DirtyHarvest( &g_Bitmap, g_Views, 1, 0, MAP_PAGES, g_Harvested ), 0 );
+
+	// Words past the end of the bitmap are never dirty, whatever is in the buffer
+	DirtyMarkRange( &g_Bitmap, MAP_PAGES - 1, 1 );
+	RtlFillMemory( g_Harvested, sizeof(g_Harvested), 0xCC );
+	TEST_CHECK_EQUAL( DirtyHarvest( &g_Bitmap, g_Views, 1, MAP_PAGES - DIRTY_PAGES_PER_WORD, 3 * DIRTY_PAGES_PER_WORD, g_Harvested ), 1 );
+	TEST_CHECK_EQUAL( g_Harvested[0], 0x8000000000000000ULL );
+	TEST_CHECK_EQUAL( g_Harvested[1], 0 );
+	TEST_CHECK_EQUAL( g_Harvested[2], 0 );
+	TEST_CHECK_EQUAL( g_Harvested[3], 0xCCCCCCCCCCCCCCCCULL );
+
+	_FreeView();
+}
+
+static
+VOID
+TestAltView()
+{
+	/*
+	 * The default view maps LARGE_PAGE with a 2MB page, and the other view with 4KB pages; whichever of them the guest
+	 *  wrote it through, the default view's one flag means the whole of it has to be marked, and both views' flags
+	 *  have to be cleared for the next write to be logged again.
+	 */
+
+	UINT64 pageSize;
+	ULONG pages;
+
+	_BuildView();
+
+	pages = (ULONG)g_View.Pool.PageCount + 1;
+
+	RtlZeroMemory( &g_AltView, sizeof(g_AltView) );
+	g_AltView.Pool.VA = aligned_alloc( EPT_PAGE_SIZE, (SIZE_T)pages * EPT_PAGE_SIZE );
+	g_AltView.Pool.PA = FAKE_ALT_POOL_PA;
+	g_AltView.Pool.PageCount = pages;
+
+	TEST_CHECK( EptCopyView( &g_AltView, &g_View ) == TRUE );
+	TEST_CHECK( EptSetPagePermissions( &g_AltView, LARGE_PAGE + 0x3000, TRUE, TRUE, TRUE ) == TRUE );
+
+	// Drained against the split view alone, only the page logged is marked; against both, all of the 2MB page
+	g_Log[PML_LOG_ENTRIES - 1] = LARGE_PAGE + 0x3000;
+
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, &g_Views[1], 1, g_Log, PML_INDEX_START - 1 ), 1 );
+	TEST_CHECK_EQUAL( _CountMarked(), 1 );
+
+	TEST_CHECK_EQUAL( DirtyDrainLog( &g_Bitmap, g_Views, 2, g_Log, PML_INDEX_START - 1 ), 1 );
+	TEST_CHECK_EQUAL( _CountMarked(), EPT_LARGE_PAGE_SIZE / EPT_PAGE_SIZE );
+
+	// Written through both views; every flag of the page in either one is cleared
+	_SetDirty( LARGE_PAGE );
+	EptGetLeafEntry( &g_AltView, LARGE_PAGE + 0x3000, &pageSize )->Dirty = 1;
+	EptGetLeafEntry( &g_AltView, LARGE_PAGE + 0x1FF000, &pageSize )->Dirty = 1;
+
+	TEST_CHECK_EQUAL( DirtyHarvest( &g_Bitmap, g_Views, 2, 0, MAP_PAGES, g_Harvested ), EPT_LARGE_PAGE_SIZE / EPT_PAGE_SIZE );
+	TEST_CHECK( _IsDirty( LARGE_PAGE ) == FALSE );
+	TEST_CHECK_EQUAL( EptClearAllDirty( &g_AltView ), 0 );
+
+	free( g_AltView.Pool.VA );
+	g_AltView.Pool.VA = NULL;
+
+	_FreeView();
+}
+
+typedef struct _FAKE_LP
+{
+	pthread_t Thread;
+	ULONG Index;
+	ULONG Count;
+} FAKE_LP, *PFAKE_LP;
+
+static volatile LONG g_MarkersDone;
+
+static
+PVOID
+_Marker(
+	_In_ PVOID Argument
+	)
+{
+	// Each LP marks its own share of the pages, a page at a time, as its exit handler would drain them
+	PFAKE_LP lp = Argument;
+	UINT64 page;
+
+	for ( page = lp->Index; page < STRESS_PAGES; page += lp->Count )
+	{
+		DirtyMarkRange( &g_Bitmap, page * 3, 1 );
+	}
+
+	InterlockedIncrement( &g_MarkersDone );
+
+	return NULL;
+}
+
+static
+VOID
+_Collect(
+	_Inout_updates_(MAP_PAGES) PUINT8 Seen
+	)
+{
+	UINT64 word;
+	ULONG bit;
+	ULONG i;
+
+	DirtyHarvest( &g_Bitmap, g_Views, 1, 0, MAP_PAGES, g_Harvested );
+
+	for ( i = 0; i < ARRAYSIZE( g_Harvested ); i++ )
+	{
+		for ( word = g_Harvested[i]; word != 0; word &= word - 1 )
+		{
+			_BitScanForward64( &bit, word );
+			Seen[(UINT64)i * DIRTY_PAGES_PER_WORD + bit]++;
+		}
+	}
+}
+
+static
+VOID
+TestMarkWhileHarvesting()
+{
+	PFAKE_LP lps;
+	PUINT8 seen;
+	ULONG count, i;
+	ULONG twice = 0, never = 0, stray = 0;
+	UINT64 page;
+
+	_BuildView();
+
+	count = (ULONG)sysconf( _SC_NPROCESSORS_ONLN );
+	count = min( max( count, 2 ), 64 );
+
+	lps = calloc( count, sizeof(FAKE_LP) );
+	seen = calloc( MAP_PAGES, sizeof(UINT8) );
+	g_MarkersDone = 0;
+
+	for ( i = 0; i < count; i++ )
+	{
+		lps[i].Index = i;
+		lps[i].Count = count;
+		pthread_create( &lps[i].Thread, NULL, _Marker, &lps[i] );
+	}
+
+	while ( ReadAcquire( &g_MarkersDone ) < (LONG)count )
+	{
+		_Collect( seen );
+	}
+
+	for ( i = 0; i < count; i++ )
+	{
+		pthread_join( lps[i].Thread, NULL );
+	}
+
+	// Whatever was marked after the last harvest above
+	_Collect( seen );
+
+	for ( page = 0; page < MAP_PAGES; page++ )
+	{
+		if ( page % 3 == 0 && page / 3 < STRESS_PAGES )
+		{
+			twice += (seen[page] > 1);
+			never += (seen[page] == 0);
+		}
+		else
+		{
+			stray += (seen[page] != 0);
+		}
+	}
+
+	TEST_CHECK_EQUAL( twice, 0 );
+	TEST_CHECK_EQUAL( never, 0 );
+	TEST_CHECK_EQUAL( stray, 0 );
+	TEST_CHECK_EQUAL( _CountMarked(), 0 );
+
+	free( seen );
+	free( lps );
+
+	_FreeView();
+}
+
+int
+main()
+{
+	TEST_RUN( TestMarkRange );
+	TEST_RUN( TestDrainLog );
+	TEST_RUN( TestHarvest );
+	TEST_RUN( TestAltView );
+	TEST_RUN( TestMarkWhileHarvesting );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "EPTList.h"
+#include "Test.h"
+
+/*
+ * The EPTP list the guest switches views with, over views built in ordinary buffers: the identity map of 1GB of
+ *  guest-physical memory, and copies of it. Views are put in and taken out of the list as VmfuncEnableView would,
+ *  checked against made-up EPT capabilities; the list page has to hold exactly the EPTPs of the views in it (and 0
+ *  everywhere else), since that's all the processor looks at. Then two copies are made to differ from each other
+ *  the way VmfuncProtectPage would (an execute-only view of a page, and a read/write one).
+ */
+
+#define FAKE_POOL_PA					0x12340000ULL
+#define FAKE_POOL_STRIDE				0x01000000ULL		// Between one view's pool and the next one's
+#define FAKE_LIST_PA					0x56780000ULL
+
+static CONST EPT_MEMORY_RANGE g_RAM[] = {
+	{ 0x0000000000001000ULL, 0x000000000009E000ULL },
+	{ 0x0000000000100000ULL, 0x000000003FF00000ULL },
+};
+
+#define MAP_LIMIT						0x40000000ULL
+
+#define HOOKED_PAGE						0x00345000ULL
+
+static EPT_VIEW g_Views[EPT_VIEW_MAX + 1];
+static UINT64 g_ListPage[EPTP_LIST_ENTRIES];
+static EPTP_LIST g_List;
+
+// What the processor's IA32_VMX_EPT_VPID_CAP would say; write-back and UC, 4-level walks, A/D flags, execute-only pages
+static VMX_EPT_VPID_CAP g_Capabilities;
+
+static
+VOID
+_BuildViews()
+{
+	/*
+	 * View 0 is the identity map (as g_EPTView is), and every other one a copy of it (as VmfuncInitialize makes them);
+	 *  one spare, past EPT_VIEW_MAX, for the list to refuse.
+	 */
+
+	ULONG pages = EptCountTablePages( g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE ) + EPT_SPLIT_RESERVE_PAGES;
+	ULONG i;
+
+	for ( i = 0; i < ARRAYSIZE( g_Views ); i++ )
+	{
+		RtlZeroMemory( &g_Views[i], sizeof(EPT_VIEW) );
+
+		g_Views[i].Pool.VA = aligned_alloc( EPT_PAGE_SIZE, (SIZE_T)pages * EPT_PAGE_SIZE );
+		g_Views[i].Pool.PA = FAKE_POOL_PA + i * FAKE_POOL_STRIDE;
+		g_Views[i].Pool.PageCount = pages;
+
+		if ( i == 0 )
+		{
+			TEST_CHECK( EptBuildIdentityMap( &g_Views[0], g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE ) == TRUE );
+		}
+		else
+		{
+			TEST_CHECK( EptCopyView( &g_Views[i], &g_Views[0] ) == TRUE );
+		}
+	}
+
+	g_Capabilities.All = 0;
+	g_Capabilities.ExecuteOnly = 1;
+	g_Capabilities.PageWalkLength4 = 1;
+	g_Capabilities.MemTypeUC = 1;
+	g_Capabilities.MemTypeWB = 1;
+	g_Capabilities.AccessedDirty = 1;
+
+	// (Note: whatever was in the page before, every entry of the list starts out 0)
+	memset( g_ListPage, 0xCC, sizeof(g_ListPage) );
+	EptListInitialize( &g_List, g_ListPage, FAKE_LIST_PA );
+}
+
+static
+VOID
+_FreeViews()
+{
+	ULONG i;
+
+	for ( i = 0; i < ARRAYSIZE( g_Views ); i++ )
+	{
+		free( g_Views[i].Pool.VA );
+		g_Views[i].Pool.VA = NULL;
+	}
+}
+
+static
+BOOLEAN
+_ListHolds(
+	_In_reads_(EPT_VIEW_MAX) CONST ULONG* Views
+	)
+{
+	// Whether entry i of the list page is view Views[i]'s EPTP (0 where Views[i] is EPT_VIEW_INVALID), and every entry past them 0
+
+	ULONG i;
+
+	for ( i = 0; i < EPTP_LIST_ENTRIES; i++ )
+	{
+		if ( i < EPT_VIEW_MAX && Views[i] != EPT_VIEW_INVALID )
+		{
+			if ( g_ListPage[i] != g_Views[Views[i]].EPTP.All || EptListGetView( &g_List, i ) != &g_Views[Views[i]] )
+			{
+				return FALSE;
+			}
+		}
+		else if ( g_ListPage[i] != 0 || (i < EPT_VIEW_MAX && EptListGetView( &g_List, i ) != NULL) )
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static
+VOID
+TestIsValidEPTP()
+{
+	EPT_POINTER eptp;
+	VMX_EPT_VPID_CAP capabilities;
+
+	_BuildViews();
+
+	eptp = g_Views[0].EPTP;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == TRUE );
+
+	// Write-back or UC, and only if the processor has it
+	eptp.MemoryType = EPT_MEMORY_TYPE_UC;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == TRUE );
+
+	capabilities = g_Capabilities;
+	capabilities.MemTypeUC = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, capabilities ) == FALSE );
+
+	eptp.MemoryType = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	eptp = g_Views[0].EPTP;
+	capabilities = g_Capabilities;
+	capabilities.MemTypeWB = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, capabilities ) == FALSE );
+
+	// A 4-level walk, which the processor has to support
+	eptp.PageWalkLength = EPT_PAGE_WALK_LENGTH_4 + 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	eptp = g_Views[0].EPTP;
+	capabilities = g_Capabilities;
+	capabilities.PageWalkLength4 = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, capabilities ) == FALSE );
+
+	// A/D flags and supervisor shadow-stack control, only if the processor has them
+	eptp.EnableAccessedDirty = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == TRUE );
+
+	capabilities = g_Capabilities;
+	capabilities.AccessedDirty = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, capabilities ) == FALSE );
+
+	eptp = g_Views[0].EPTP;
+	eptp.EnableSupervisorShadow = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	capabilities = g_Capabilities;
+	capabilities.SupervisorShadowStack = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, capabilities ) == TRUE );
+
+	// Nothing reserved, and a PML4 somewhere; an unused entry of the list (0) is never a valid EPTP
+	eptp = g_Views[0].EPTP;
+	eptp.Reserved0 = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	eptp = g_Views[0].EPTP;
+	eptp.Reserved1 = 1;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	eptp = g_Views[0].EPTP;
+	eptp.PFN = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	eptp.All = 0;
+	TEST_CHECK( EptListIsValidEPTP( eptp, g_Capabilities ) == FALSE );
+
+	_FreeViews();
+}
+
+static
+VOID
+TestInsertRemove()
+{
+	ULONG none[EPT_VIEW_MAX] = { EPT_VIEW_INVALID, EPT_VIEW_INVALID, EPT_VIEW_INVALID, EPT_VIEW_INVALID };
+	ULONG all[EPT_VIEW_MAX] = { 0, 1, 2, 3 };
+	ULONG some[EPT_VIEW_MAX] = { 0, 1, EPT_VIEW_INVALID, 3 };
+	ULONG swapped[EPT_VIEW_MAX] = { 0, 1, 3, EPT_VIEW_INVALID };
+	ULONG i;
+
+	_BuildViews();
+
+	TEST_CHECK_EQUAL( g_List.Entries, g_ListPage );
+	TEST_CHECK_EQUAL( g_List.EntriesPA, FAKE_LIST_PA );
+	TEST_CHECK( _ListHolds( none ) );
+
+	// As VmfuncInitialize fills it
+	for ( i = 0; i < EPT_VIEW_MAX; i++ )
+	{
+		TEST_CHECK( EptListInsert( &g_List, i, &g_Views[i], g_Capabilities ) == TRUE );
+	}
+
+	TEST_CHECK( _ListHolds( all ) );
+
+	// Only EPT_VIEW_MAX entries are ours; and only one view per entry, and one entry per view
+	TEST_CHECK( EptListInsert( &g_List, EPT_VIEW_MAX, &g_Views[EPT_VIEW_MAX], g_Capabilities ) == FALSE );
+	TEST_CHECK( EptListInsert( &g_List, EPTP_LIST_ENTRIES, &g_Views[EPT_VIEW_MAX], g_Capabilities ) == FALSE );
+	TEST_CHECK( EptListInsert( &g_List, 2, &g_Views[EPT_VIEW_MAX], g_Capabilities ) == FALSE );
+	TEST_CHECK( _ListHolds( all ) );
+
+	// Taking a view out zeroes its entry, and nothing else
+	TEST_CHECK( EptListRemove( &g_List, 2 ) == TRUE );
+	TEST_CHECK( _ListHolds( some ) );
+
+	TEST_CHECK( EptListRemove( &g_List, 2 ) == FALSE );
+	TEST_CHECK( EptListRemove( &g_List, EPT_VIEW_MAX ) == FALSE );
+	TEST_CHECK( _ListHolds( some ) );
+
+	// A view already in the list can't go in again, at another entry; its EPTP would be there twice
+	TEST_CHECK( EptListInsert( &g_List, 2, &g_Views[1], g_Capabilities ) == FALSE );
+	TEST_CHECK( EptListInsert( &g_List, 2, &g_Views[3], g_Capabilities ) == FALSE );
+	TEST_CHECK( _ListHolds( some ) );
+
+	// Unless it's out of the list first
+	TEST_CHECK( EptListRemove( &g_List, 3 ) == TRUE );
+	TEST_CHECK( EptListInsert( &g_List, 2, &g_Views[3], g_Capabilities ) == TRUE );
+	TEST_CHECK( _ListHolds( swapped ) );
+
+	// Nor can a view the processor wouldn't switch to
+	TEST_CHECK( EptListRemove( &g_List, 2 ) == TRUE );
+	g_Views[3].EPTP.EnableSupervisorShadow = 1;
+	TEST_CHECK( EptListInsert( &g_List, 2, &g_Views[3], g_Capabilities ) == FALSE );
+	TEST_CHECK( EptListGetView( &g_List, 2 ) == NULL );
+	TEST_CHECK_EQUAL( g_ListPage[2], 0 );
+
+	TEST_CHECK( EptListGetView( &g_List, EPT_VIEW_MAX ) == NULL );
+	TEST_CHECK( EptListGetView( &g_List, EPT_VIEW_INVALID ) == NULL );
+
+	_FreeViews();
+}
+
+static
+VOID
+TestFindRefresh()
+{
+	ULONG all[EPT_VIEW_MAX] = { 0, 1, 2, 3 };
+	EPT_POINTER eptp;
+	ULONG i;
+
+	_BuildViews();
+
+	for ( i = 0; i < EPT_VIEW_MAX; i++ )
+	{
+		TEST_CHECK( EptListInsert( &g_List, i, &g_Views[i], g_Capabilities ) == TRUE );
+	}
+
+	// By the PML4 it points at, as an LP's EPTP would be read back out of its VMCS
+	for ( i = 0; i < EPT_VIEW_MAX; i++ )
+	{
+		TEST_CHECK_EQUAL( EptListFind( &g_List, g_Views[i].EPTP.All ), i );
+	}
+
+	TEST_CHECK_EQUAL( EptListFind( &g_List, g_Views[EPT_VIEW_MAX].EPTP.All ), EPT_VIEW_INVALID );
+	TEST_CHECK_EQUAL( EptListFind( &g_List, 0 ), EPT_VIEW_INVALID );
+
+	// Whatever its flags
+	eptp = g_Views[2].EPTP;
+	eptp.EnableAccessedDirty = !eptp.EnableAccessedDirty;
+	eptp.MemoryType = EPT_MEMORY_TYPE_UC;
+	TEST_CHECK_EQUAL( EptListFind( &g_List, eptp.All ), 2 );
+
+	// Dirty-page tracking turns the A/D flags on in every view's EPTP; the list has to follow
+	for ( i = 0; i < EPT_VIEW_MAX; i++ )
+	{
+		g_Views[i].EPTP.EnableAccessedDirty = 1;
+	}
+
+	TEST_CHECK( _ListHolds( all ) == FALSE );
+	EptListRefresh( &g_List );
+	TEST_CHECK( _ListHolds( all ) );
+	TEST_CHECK_EQUAL( g_ListPage[1] & (1ULL << 6), 1ULL << 6 );
+
+	// A view out of the list isn't found, and isn't put back by a refresh
+	TEST_CHECK( EptListRemove( &g_List, 1 ) == TRUE );
+	TEST_CHECK_EQUAL( EptListFind( &g_List, g_Views[1].EPTP.All ), EPT_VIEW_INVALID );
+
+	EptListRefresh( &g_List );
+	TEST_CHECK_EQUAL( g_ListPage[1], 0 );
+	TEST_CHECK( EptListGetView( &g_List, 1 ) == NULL );
+
+	_FreeViews();
+}
+
+static
+VOID
+TestViewsDiffer()
+{
+	/*
+	 * An execute-only view of a page (1) and a read/write view of the same page (2), as an introspection agent would
+	 *  flip between them; the identity map (0) and the spare view (3) have to keep allowing everything.
+	 */
+
+	PEPT_ENTRY entry;
+	UINT64 pageSize;
+	ULONG i;
+
+	_BuildViews();
+
+	for ( i = 0; i < EPT_VIEW_MAX; i++ )
+	{
+		TEST_CHECK( EptListInsert( &g_List, i, &g_Views[i], g_Capabilities ) == TRUE );
+	}
+
+	TEST_CHECK( EptSetPagePermissions( EptListGetView( &g_List, 1 ), HOOKED_PAGE, FALSE, FALSE, TRUE ) == TRUE );
+	TEST_CHECK( EptSetPagePermissions( EptListGetView( &g_List, 2 ), HOOKED_PAGE, TRUE, TRUE, FALSE ) == TRUE );
+
+	entry = EptGetLeafEntry( &g_Views[1], HOOKED_PAGE, &pageSize );
+	TEST_CHECK( entry->Read == 0 && entry->Write == 0 && entry->Execute == 1 );
+	TEST_CHECK_EQUAL( pageSize, EPT_PAGE_SIZE );
+
+	entry = EptGetLeafEntry( &g_Views[2], HOOKED_PAGE, &pageSize );
+	TEST_CHECK( entry->Read == 1 && entry->Write == 1 && entry->Execute == 0 );
+
+	for ( i = 0; i < EPT_VIEW_MAX; i += 3 )
+	{
+		entry = EptGetLeafEntry( &g_Views[i], HOOKED_PAGE, &pageSize );
+		TEST_CHECK( entry->Read == 1 && entry->Write == 1 && entry->Execute == 1 );
+		TEST_CHECK_EQUAL( pageSize, EPT_LARGE_PAGE_SIZE );
+	}
+
+	// The page next to it is the same in every view
+	for ( i = 1; i < 3; i++ )
+	{
+		entry = EptGetLeafEntry( &g_Views[i], HOOKED_PAGE + EPT_PAGE_SIZE, &pageSize );
+		TEST_CHECK( entry->Read == 1 && entry->Write == 1 && entry->Execute == 1 );
+	}
+
+	// Splitting the large page in a view didn't change which PML4 its EPTP points at
+	TEST_CHECK_EQUAL( EptListFind( &g_List, g_ListPage[1] ), 1 );
+	TEST_CHECK_EQUAL( EptListFind( &g_List, g_ListPage[2] ), 2 );
+
+	_FreeViews();
+}
+
+int
+main()
+{
+	TEST_RUN( TestIsValidEPTP );
+	TEST_RUN( TestInsertRemove );
+	TEST_RUN( TestFindRefresh );
+	TEST_RUN( TestViewsDiffer );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+
+#include "EPT.h"
+#include "Test.h"
+
+/*
+ * The EPT identity map, built over a simulated physical memory map (the RAM ranges MmGetPhysicalMemoryRanges reports
+ *  on a 16GB desktop, holes and all) into an ordinary buffer standing in for the view's contiguous pool, at a made-up
+ *  physical address. Every guest-physical page is then walked, and has to map to itself with the right memory type.
+ */
+
+// Where the pools pretend to be, physically; nothing in "EPT.c" ever dereferences a physical address
+#define FAKE_POOL_PA					0x12340000ULL
+#define FAKE_COPY_POOL_PA				0x2ABC00000ULL
+
+static CONST EPT_MEMORY_RANGE g_DesktopRAM[] = {
+	{ 0x0000000000001000ULL, 0x000000000009E000ULL },		// Below the legacy video/BIOS area
+	{ 0x0000000000100000ULL, 0x000000003FF00000ULL },		// Up to exactly 1GB
+	{ 0x0000000040400000ULL, 0x000000003A4F7000ULL },		// Ends part way through a 2MB page
+	{ 0x000000007A8FF000ULL, 0x0000000000001000ULL },		// A single page, on its own
+	{ 0x000000007B000000ULL, 0x0000000000800000ULL },		// 2MB aligned at both ends
+	{ 0x0000000100000000ULL, 0x000000037F000000ULL },		// Everything above 4GB, less the last 16MB
+};
+
+#define DESKTOP_MAP_LIMIT				0x480000000ULL
+
+// RAM on either side of the first 512GB boundary, so that there are two PDPTs
+static CONST EPT_MEMORY_RANGE g_LargeRAM[] = {
+	{ 0x0000000000001000ULL, 0x000000000009E000ULL },
+	{ 0x0000007FC0000000ULL, 0x0000000080000000ULL },
+};
+
+#define LARGE_MAP_LIMIT					0x8040000000ULL
+
+static
+BOOLEAN
+_InRAM(
+	_In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+	_In_ CONST ULONG RangeCount,
+	_In_ CONST UINT64 PA
+	)
+{
+	ULONG i;
+
+	for ( i = 0; i < RangeCount; i++ )
+	{
+		if ( PA >= RAMRanges[i].Base && PA < RAMRanges[i].Base + RAMRanges[i].Length )
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static
+VOID
+_CreateView(
+	_Out_ PEPT_VIEW View,
+	_In_ CONST ULONG PageCount,
+	_In_ CONST UINT64 PA
+	)
+{
+	RtlZeroMemory( View, sizeof(EPT_VIEW) );
+
+	View->Pool.VA = aligned_alloc( EPT_PAGE_SIZE, (SIZE_T)PageCount * EPT_PAGE_SIZE );
+	View->Pool.PA = PA;
+	View->Pool.PageCount = PageCount;
+}
+
+static
+VOID
+_BuildView(
+	_Out_ PEPT_VIEW View,
+	_In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+	_In_ CONST ULONG RangeCount,
+	_In_ CONST UINT64 MapLimit,
+	_In_ CONST BOOLEAN UseHugePages,
+	_In_ CONST ULONG SparePages
+	)
+{
+	ULONG pages = EptCountTablePages( RAMRanges, RangeCount, MapLimit, UseHugePages );
+
+	_CreateView( View, pages + SparePages, FAKE_POOL_PA );
+
+	TEST_CHECK( EptBuildIdentityMap( View, RAMRanges, RangeCount, MapLimit, UseHugePages ) == TRUE );
+
+	// The count is exact; DriverEntry sizes the pool with it
+	TEST_CHECK_EQUAL( View->Pool.PagesUsed, pages );
+}
+
+static
+VOID
+_FreeView(
+	_Inout_ PEPT_VIEW View
+	)
+{
+	free( View->Pool.VA );
+	View->Pool.VA = NULL;
+}
+
+static
+ULONG
+_CheckIdentity(
+	_In_ CONST PEPT_VIEW View,
+	_In_reads_(RangeCount) CONST EPT_MEMORY_RANGE* RAMRanges,
+	_In_ CONST ULONG RangeCount,
+	_In_ CONST UINT64 Start,
+	_In_ CONST UINT64 End,
+	_In_ CONST UINT64 Step
+	)
+{
+	/*
+	 * Walk [Start, End), every Step bytes: each address must map to itself, readable, writable and executable, and be
+	 *  write-back if (and only if) it's RAM. The number of addresses that don't (reported once per run of them).
+	 */
+
+	PEPT_ENTRY entry;
+	UINT64 pa, pageSize, mapped;
+	UINT8 expectedType;
+	ULONG wrong = 0;
+	BOOLEAN previousWrong = FALSE;
+
+	for ( pa = Start; pa < End; pa += Step )
+	{
+		entry = EptGetLeafEntry( View, pa, &pageSize );
+
+		if ( entry == NULL )
+		{
+			wrong++;
+			continue;
+		}
+
+		mapped = ((UINT64)entry->PFN << 12) + (pa & (pageSize - 1));
+		expectedType = _InRAM( RAMRanges, RangeCount, pa ) ? EPT_MEMORY_TYPE_WB : EPT_MEMORY_TYPE_UC;
+
+		if ( mapped != pa || entry->MemoryType != expectedType
+			|| entry->Read != 1 || entry->Write != 1 || entry->Execute != 1 || entry->SuppressVE != 1
+			|| ((UINT64)entry->PFN << 12) % pageSize != 0
+			|| entry->LargePage != (pageSize != EPT_PAGE_SIZE) )
+		{
+			if ( previousWrong == FALSE )
+			{
+				fprintf( stderr, "%llx maps to %llx (type %u, page size %llx)\n",
+					(unsigned long long)pa, (unsigned long long)mapped, (unsigned)entry->MemoryType, (unsigned long long)pageSize );
+			}
+
+			previousWrong = TRUE;
+			wrong++;
+			continue;
+		}
+
+		previousWrong = FALSE;
+	}
+
+	return wrong;
+}
+
+static
+VOID
+TestIdentityMap()
+{
+	EPT_VIEW view;
+	UINT64 pageSize;
+	BOOLEAN useHugePages;
+
+	for ( useHugePages = FALSE; useHugePages <= TRUE; useHugePages++ )
+	{
+		_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, useHugePages, 0 );
+
+		// Every 4KB page, RAM or not, below the limit
+		TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0, DESKTOP_MAP_LIMIT, EPT_PAGE_SIZE ), 0 );
+
+		// Nothing else
+		TEST_CHECK( EptGetLeafEntry( &view, DESKTOP_MAP_LIMIT, &pageSize ) == NULL );
+		TEST_CHECK_EQUAL( pageSize, 0 );
+
+		TEST_CHECK_EQUAL( view.HugePages * EPT_HUGE_PAGE_SIZE + view.LargePages * EPT_LARGE_PAGE_SIZE + view.Pages * EPT_PAGE_SIZE, DESKTOP_MAP_LIMIT );
+
+		// 4KB pages only for the 2MB pages RAM starts or ends inside of: the first, and 7A800000H (which has both a
+		//	range's end and a single page in it); RAM ending at 47F000000H is still 2MB aligned
+		TEST_CHECK_EQUAL( view.Pages, 2 * EPT_ENTRIES_PER_TABLE );
+
+		// 2-4GB is all MMIO, and 4-17GB all RAM; the first two GB, and the last, are part of each
+		TEST_CHECK_EQUAL( view.HugePages, useHugePages ? 2 + 13 : 0 );
+
+		TEST_CHECK_EQUAL( view.EPTP.MemoryType, EPT_MEMORY_TYPE_WB );
+		TEST_CHECK_EQUAL( view.EPTP.PageWalkLength, EPT_PAGE_WALK_LENGTH_4 );
+		TEST_CHECK_EQUAL( (UINT64)view.EPTP.PFN << 12, FAKE_POOL_PA );
+
+		_FreeView( &view );
+	}
+}
+
+static
+VOID
+TestIdentityMapPast512GB()
+{
+	EPT_VIEW view;
+	BOOLEAN useHugePages;
+
+	for ( useHugePages = FALSE; useHugePages <= TRUE; useHugePages++ )
+	{
+		_BuildView( &view, g_LargeRAM, ARRAYSIZE( g_LargeRAM ), LARGE_MAP_LIMIT, useHugePages, 0 );
+
+		// (Note: every 2MB is enough to catch a page in the wrong PDPT)
+		TEST_CHECK_EQUAL( _CheckIdentity( &view, g_LargeRAM, ARRAYSIZE( g_LargeRAM ), 0, LARGE_MAP_LIMIT, EPT_LARGE_PAGE_SIZE ), 0 );
+		TEST_CHECK_EQUAL( _CheckIdentity( &view, g_LargeRAM, ARRAYSIZE( g_LargeRAM ), 0, EPT_LARGE_PAGE_SIZE, EPT_PAGE_SIZE ), 0 );
+
+		TEST_CHECK( EPT_ENTRY_IS_EMPTY( view.PML4[0] ) == FALSE );
+		TEST_CHECK( EPT_ENTRY_IS_EMPTY( view.PML4[1] ) == FALSE );
+		TEST_CHECK( EPT_ENTRY_IS_EMPTY( view.PML4[2] ) == TRUE );
+
+		// The PML4 and both PDPTs; then a PD for each GB without a 1GB page, and the PT for the first 2MB
+		TEST_CHECK_EQUAL( view.Pool.PagesUsed, 3 + (useHugePages ? 1 : 513) + 1 );
+
+		_FreeView( &view );
+	}
+
+	// The limit is rounded up to the next PDPT, but not past it
+	TEST_CHECK_EQUAL( EptCountTablePages( g_LargeRAM, ARRAYSIZE( g_LargeRAM ), EPT_PML4E_COVERAGE, TRUE ), 1 + 1 + 1 + 1 );
+}
+
+static
+VOID
+TestSplit()
+{
+	EPT_VIEW view;
+	PEPT_ENTRY entry;
+	UINT64 pageSize, hugePages, largePages, pages;
+	ULONG used;
+
+	_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, EPT_SPLIT_RESERVE_PAGES );
+
+	hugePages = view.HugePages;
+	largePages = view.LargePages;
+	pages = view.Pages;
+	used = view.Pool.PagesUsed;
+
+	// A 4KB page out of a 1GB page: a PD, then a PT
+	entry = EptGetPageEntry( &view, 0x123456000ULL, TRUE );
+	TEST_CHECK( entry != NULL );
+	TEST_CHECK_EQUAL( (UINT64)entry->PFN << 12, 0x123456000ULL );
+	TEST_CHECK_EQUAL( entry->LargePage, 0 );
+
+	TEST_CHECK_EQUAL( view.Pool.PagesUsed, used + 2 );
+	TEST_CHECK_EQUAL( view.HugePages, hugePages - 1 );
+	TEST_CHECK_EQUAL( view.LargePages, largePages + EPT_ENTRIES_PER_TABLE - 1 );
+	TEST_CHECK_EQUAL( view.Pages, pages + EPT_ENTRIES_PER_TABLE );
+
+	// The split GB still maps exactly what it did
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x100000000ULL, 0x140000000ULL, EPT_PAGE_SIZE ), 0 );
+
+	// Asking again splits nothing
+	TEST_CHECK( EptGetPageEntry( &view, 0x123457000ULL, TRUE ) == entry + 1 );
+	TEST_CHECK_EQUAL( view.Pool.PagesUsed, used + 2 );
+
+	// Without splitting, whatever maps it; a 1GB page further up
+	entry = EptGetPageEntry( &view, 0x200000000ULL, FALSE );
+	TEST_CHECK( entry != NULL && entry->LargePage == 1 );
+	TEST_CHECK( EptGetLeafEntry( &view, 0x200000000ULL, &pageSize ) == entry );
+	TEST_CHECK_EQUAL( pageSize, EPT_HUGE_PAGE_SIZE );
+
+	// One level at a time
+	TEST_CHECK( EptSplitLargePage( &view, 0x200000000ULL ) == TRUE );
+	TEST_CHECK( EptGetLeafEntry( &view, 0x200000000ULL, &pageSize ) != NULL );
+	TEST_CHECK_EQUAL( pageSize, EPT_LARGE_PAGE_SIZE );
+
+	TEST_CHECK( EptSplitLargePage( &view, 0x200000000ULL ) == TRUE );
+	TEST_CHECK( EptGetLeafEntry( &view, 0x200000000ULL, &pageSize ) != NULL );
+	TEST_CHECK_EQUAL( pageSize, EPT_PAGE_SIZE );
+
+	// A 4KB page can't be split, nor can what isn't mapped
+	TEST_CHECK( EptSplitLargePage( &view, 0x200000000ULL ) == FALSE );
+	TEST_CHECK( EptSplitLargePage( &view, DESKTOP_MAP_LIMIT ) == FALSE );
+	TEST_CHECK( EptGetPageEntry( &view, DESKTOP_MAP_LIMIT, TRUE ) == NULL );
+
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x200000000ULL, 0x240000000ULL, EPT_PAGE_SIZE ), 0 );
+	TEST_CHECK_EQUAL( view.HugePages * EPT_HUGE_PAGE_SIZE + view.LargePages * EPT_LARGE_PAGE_SIZE + view.Pages * EPT_PAGE_SIZE, DESKTOP_MAP_LIMIT );
+
+	_FreeView( &view );
+}
+
+static
+VOID
+TestSplitPoolExhausted()
+{
+	EPT_VIEW view;
+	UINT64 pageSize;
+
+	// No room at all: nothing changes
+	_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, 0 );
+
+	TEST_CHECK( EptSetPagePermissions( &view, 0x123456000ULL, TRUE, FALSE, FALSE ) == FALSE );
+	TEST_CHECK( EptGetLeafEntry( &view, 0x123456000ULL, &pageSize ) != NULL );
+	TEST_CHECK_EQUAL( pageSize, EPT_HUGE_PAGE_SIZE );
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x100000000ULL, 0x140000000ULL, EPT_PAGE_SIZE ), 0 );
+
+	_FreeView( &view );
+
+	// Room for one level: the 1GB page is split, and the map is still whole
+	_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, 1 );
+
+	TEST_CHECK( EptSetPagePermissions( &view, 0x123456000ULL, TRUE, FALSE, FALSE ) == FALSE );
+	TEST_CHECK( EptGetLeafEntry( &view, 0x123456000ULL, &pageSize ) != NULL );
+	TEST_CHECK_EQUAL( pageSize, EPT_LARGE_PAGE_SIZE );
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x100000000ULL, 0x140000000ULL, EPT_PAGE_SIZE ), 0 );
+	TEST_CHECK_EQUAL( view.HugePages * EPT_HUGE_PAGE_SIZE + view.LargePages * EPT_LARGE_PAGE_SIZE + view.Pages * EPT_PAGE_SIZE, DESKTOP_MAP_LIMIT );
+
+	_FreeView( &view );
+}
+
+static
+VOID
+TestPageAttributes()
+{
+	EPT_VIEW view;
+	PEPT_ENTRY entry;
+	UINT64 pageSize;
+
+	_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, EPT_SPLIT_RESERVE_PAGES );
+
+	// Only the page asked for changes; not its neighbours, and not where it maps to
+	TEST_CHECK( EptSetPagePermissions( &view, 0x7B001000ULL, TRUE, FALSE, FALSE ) == TRUE );
+	TEST_CHECK( EptSetMemoryType( &view, 0x7B002000ULL, EPT_MEMORY_TYPE_WC ) == TRUE );
+	TEST_CHECK( EptSetSuppressVE( &view, 0x7B003000ULL, FALSE ) == TRUE );
+
+	entry = EptGetLeafEntry( &view, 0x7B001000ULL, &pageSize );
+	TEST_CHECK_EQUAL( pageSize, EPT_PAGE_SIZE );
+	TEST_CHECK( entry->Read == 1 && entry->Write == 0 && entry->Execute == 0 );
+	TEST_CHECK_EQUAL( (UINT64)entry->PFN << 12, 0x7B001000ULL );
+
+	entry = EptGetLeafEntry( &view, 0x7B002000ULL, &pageSize );
+	TEST_CHECK_EQUAL( entry->MemoryType, EPT_MEMORY_TYPE_WC );
+	TEST_CHECK( entry->Write == 1 );
+
+	entry = EptGetLeafEntry( &view, 0x7B003000ULL, &pageSize );
+	TEST_CHECK_EQUAL( entry->SuppressVE, 0 );
+
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x7B000000ULL, 0x7B001000ULL, EPT_PAGE_SIZE ), 0 );
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0x7B004000ULL, 0x7B200000ULL, EPT_PAGE_SIZE ), 0 );
+
+	_FreeView( &view );
+}
+
+static
+VOID
+TestClearDirty()
+{
+	EPT_VIEW view;
+	UINT64 pageSize;
+
+	_BuildView( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, EPT_SPLIT_RESERVE_PAGES );
+
+	// As the processor would, on a page of each size
+	EptGetLeafEntry( &view, 0x1000ULL, &pageSize )->Dirty = 1;
+	EptGetLeafEntry( &view, 0x7B000000ULL, &pageSize )->Dirty = 1;
+	EptGetLeafEntry( &view, 0x300000000ULL, &pageSize )->Dirty = 1;
+
+	TEST_CHECK( EptClearDirty( &view, 0x7B000000ULL, &pageSize ) == TRUE );
+	TEST_CHECK_EQUAL( pageSize, EPT_LARGE_PAGE_SIZE );
+	TEST_CHECK( EptClearDirty( &view, 0x7B000000ULL, &pageSize ) == FALSE );
+
+	TEST_CHECK( EptClearDirty( &view, DESKTOP_MAP_LIMIT, &pageSize ) == FALSE );
+	TEST_CHECK_EQUAL( pageSize, 0 );
+
+	TEST_CHECK_EQUAL( EptClearAllDirty( &view ), 2 );
+	TEST_CHECK_EQUAL( EptClearAllDirty( &view ), 0 );
+
+	// Nothing but the dirty flag
+	TEST_CHECK_EQUAL( _CheckIdentity( &view, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), 0, DESKTOP_MAP_LIMIT, EPT_LARGE_PAGE_SIZE ), 0 );
+
+	_FreeView( &view );
+}
+
+static
+VOID
+TestCopyView()
+{
+	EPT_VIEW source, copy, small;
+	PEPT_ENTRY sourceEntry, copyEntry;
+	UINT64 pa, sourceSize, copySize;
+	ULONG mismatches = 0;
+
+	_BuildView( &source, g_DesktopRAM, ARRAYSIZE( g_DesktopRAM ), DESKTOP_MAP_LIMIT, TRUE, EPT_SPLIT_RESERVE_PAGES );
+	TEST_CHECK( EptSetPagePermissions( &source, 0x123456000ULL, TRUE, FALSE, TRUE ) == TRUE );
+
+	// A pool smaller than what the source uses can't take a copy
+	_CreateView( &small, source.Pool.PagesUsed - 1, FAKE_COPY_POOL_PA );
+	TEST_CHECK( EptCopyView( &small, &source ) == FALSE );
+	_FreeView( &small );
+
+	_CreateView( &copy, source.Pool.PageCount, FAKE_COPY_POOL_PA );
+	TEST_CHECK( EptCopyView( &copy, &source ) == TRUE );
+
+	// Its own tables, in its own pool...
+	TEST_CHECK_EQUAL( ((UINT64)copy.EPTP.PFN << 12) - FAKE_COPY_POOL_PA, ((UINT64)source.EPTP.PFN << 12) - FAKE_POOL_PA );
+	TEST_CHECK( (PUINT8)copy.PML4 >= copy.Pool.VA && (PUINT8)copy.PML4 < copy.Pool.VA + copy.Pool.PagesUsed * EPT_PAGE_SIZE );
+
+	// ...mapping exactly what the source does
+	for ( pa = 0; pa < DESKTOP_MAP_LIMIT; pa += EPT_LARGE_PAGE_SIZE )
+	{
+		sourceEntry = EptGetLeafEntry( &source, pa, &sourceSize );
+		copyEntry = EptGetLeafEntry( &copy, pa, &copySize );
+
+		mismatches += (copyEntry == NULL || copyEntry->All != sourceEntry->All || copySize != sourceSize);
+	}
+
+	TEST_CHECK_EQUAL( mismatches, 0 );
+	TEST_CHECK_EQUAL( copy.HugePages, source.HugePages );
+	TEST_CHECK_EQUAL( copy.Pages, source.Pages );
+
+	copyEntry = EptGetLeafEntry( &copy, 0x123456000ULL, &copySize );
+	TEST_CHECK( copyEntry->Read == 1 && copyEntry->Write == 0 && copyEntry->Execute == 1 );
+
+	// Changing the copy leaves the source alone
+	TEST_CHECK( EptSetPagePermissions( &copy, 0x300000000ULL, FALSE, FALSE, FALSE ) == TRUE );
+	TEST_CHECK( EptGetLeafEntry( &source, 0x300000000ULL, &sourceSize )->Read == 1 );
+	TEST_CHECK_EQUAL( sourceSize, EPT_HUGE_PAGE_SIZE );
+
+	_FreeView( &copy );
+	_FreeView( &source );
+}
+
+int
+main()
+{
+	TEST_RUN( TestIdentityMap );
+	TEST_RUN( TestIdentityMapPast512GB );
+	TEST_RUN( TestSplit );
+	TEST_RUN( TestSplitPoolExhausted );
+	TEST_RUN( TestPageAttributes );
+	TEST_RUN( TestClearDirty );
+	TEST_RUN( TestCopyView );
+
+	return TEST_EXIT_CODE();
+}
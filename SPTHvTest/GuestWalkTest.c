@@ -0,0 +1,371 @@
+#include <stdlib.h>
+
+#include "GuestWalk.h"
+#include "Test.h"
+
+/*
+ * GuestWalkTranslate against made-up paging structures, in a buffer standing in for guest-physical memory: 4KB,
+ *  2MB and 1GB pages, under 4-level and 5-level paging; not-present entries at every level; and each of the access
+ *  rights checks, with the #PF error code the processor would push for each ([4.7] "Page-Fault Exceptions").
+ */
+
+#define FAKE_MEMORY_SIZE				0x100000
+#define FAKE_TABLES_BASE				0x10000	// Tables are handed out from here up; below is left for "data"
+
+#define PTE_TABLE						(GUEST_PTE_PRESENT | GUEST_PTE_WRITE | GUEST_PTE_USER)
+
+typedef struct _FAKE_MEMORY
+{
+	PUINT8 Bytes;
+	UINT64 NextTable;
+	ULONG Maps;
+} FAKE_MEMORY, *PFAKE_MEMORY;
+
+static FAKE_MEMORY g_Memory;
+
+static
+volatile UINT64*
+_FakeMapEntry(
+	_In_opt_ PVOID Context,
+	_In_ UINT64 PhysicalAddress
+	)
+{
+	UNREFERENCED_PARAMETER( Context );
+
+	g_Memory.Maps++;
+
+	// Past the end of "memory", or not an entry's address; as a real mapping would, fail rather than read garbage
+	if ( PhysicalAddress + sizeof(UINT64) > FAKE_MEMORY_SIZE || (PhysicalAddress % sizeof(UINT64)) != 0 )
+	{
+		return NULL;
+	}
+
+	return (volatile UINT64*)(g_Memory.Bytes + PhysicalAddress);
+}
+
+static
+PUINT64
+_Entry(
+	_In_ CONST UINT64 Table,
+	_In_ CONST UINT64 Linear,
+	_In_ CONST ULONG Level
+	)
+{
+	return (PUINT64)(g_Memory.Bytes + Table + ((Linear >> (12 + 9 * (Level - 1))) & 0x1FF) * sizeof(UINT64));
+}
+
+static
+UINT64
+_Reset(
+	VOID
+	)
+{
+	// Wipes "memory", and returns a fresh top-level table
+
+	RtlZeroMemory( g_Memory.Bytes, FAKE_MEMORY_SIZE );
+
+	g_Memory.NextTable = FAKE_TABLES_BASE + PAGE_SIZE;
+	g_Memory.Maps = 0;
+
+	return FAKE_TABLES_BASE;
+}
+
+static
+PUINT64
+_MapPage(
+	_In_ CONST GUEST_PAGING* Paging,
+	_In_ CONST UINT64 Linear,
+	_In_ CONST UINT64 PhysicalAddress,
+	_In_ CONST ULONG LeafLevel,
+	_In_ CONST UINT64 LeafFlags,
+	_In_ CONST UINT64 TableFlags
+	)
+{
+	// Maps Linear with a leaf entry at LeafLevel (1 for 4KB, 2 for 2MB, 3 for 1GB), making whatever tables it needs
+	//	with TableFlags; returns the leaf entry
+
+	UINT64 table = Paging->CR3 & GUEST_PTE_ADDRESS_MASK;
+	PUINT64 entry;
+	ULONG level;
+
+	for ( level = (Paging->FiveLevel == TRUE) ? 5 : 4; level > LeafLevel; level-- )
+	{
+		entry = _Entry( table, Linear, level );
+
+		if ( (*entry & GUEST_PTE_PRESENT) == 0 )
+		{
+			TEST_CHECK( g_Memory.NextTable + PAGE_SIZE <= FAKE_MEMORY_SIZE );
+
+			*entry = g_Memory.NextTable | TableFlags;
+			g_Memory.NextTable += PAGE_SIZE;
+		}
+
+		table = *entry & GUEST_PTE_ADDRESS_MASK;
+	}
+
+	entry = _Entry( table, Linear, LeafLevel );
+	*entry = PhysicalAddress | LeafFlags | ((LeafLevel > 1) ? GUEST_PTE_LARGE : 0);
+
+	return entry;
+}
+
+static
+BOOLEAN
+_Translate(
+	_In_ CONST GUEST_PAGING* Paging,
+	_In_ CONST UINT64 Linear,
+	_In_ CONST UINT32 Access,
+	_Out_ PUINT64 PhysicalAddress,
+	_Out_ PUINT32 ErrorCode
+	)
+{
+	return GuestWalkTranslate( Paging, Linear, Access, _FakeMapEntry, NULL, PhysicalAddress, ErrorCode );
+}
+
+static
+VOID
+TestTranslate4KB()
+{
+	GUEST_PAGING paging = { 0 };
+	UINT64 linear = 0xFFFFF80012345678ULL;
+	UINT64 pa;
+	UINT32 errorCode;
+	PUINT64 leaf;
+	UINT64 table;
+	ULONG level;
+
+	// (Note: the low bits of CR3 are flags, or the PCID)
+	paging.CR3 = _Reset() | 0x18;
+	paging.WriteProtect = TRUE;
+
+	leaf = _MapPage( &paging, linear, 0x7000, 1, GUEST_PTE_PRESENT | GUEST_PTE_WRITE, GUEST_PTE_PRESENT | GUEST_PTE_WRITE );
+
+	// A read; every entry it went through is accessed, but nothing is dirty
+	TEST_CHECK( _Translate( &paging, linear, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0x7678 );
+
+	table = FAKE_TABLES_BASE;
+
+	for ( level = 4; level >= 1; level-- )
+	{
+		TEST_CHECK_EQUAL( *_Entry( table, linear, level ) & (GUEST_PTE_ACCESSED | GUEST_PTE_DIRTY), GUEST_PTE_ACCESSED );
+		table = *_Entry( table, linear, level ) & GUEST_PTE_ADDRESS_MASK;
+	}
+
+	// A write dirties the leaf, and only the leaf
+	TEST_CHECK( _Translate( &paging, linear, GUEST_ACCESS_WRITE, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( *leaf & GUEST_PTE_DIRTY, GUEST_PTE_DIRTY );
+	TEST_CHECK_EQUAL( *_Entry( FAKE_TABLES_BASE, linear, 4 ) & GUEST_PTE_DIRTY, 0 );
+
+	// The last byte of the page, and the first of the next one (which isn't mapped)
+	TEST_CHECK( _Translate( &paging, linear | 0xFFF, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0x7FFF );
+	TEST_CHECK( _Translate( &paging, (linear | 0xFFF) + 1, 0, &pa, &errorCode ) == FALSE );
+	TEST_CHECK_EQUAL( pa, 0 );
+}
+
+static
+VOID
+TestLargePages()
+{
+	GUEST_PAGING paging = { 0 };
+	UINT64 pa;
+	UINT32 errorCode;
+
+	paging.CR3 = _Reset();
+
+	// 2MB, with its PAT bit (12) set; that bit isn't part of the address
+	_MapPage( &paging, 0x40200000, 0x80000000 | 0x1000, 2, GUEST_PTE_PRESENT | GUEST_PTE_WRITE, PTE_TABLE );
+	TEST_CHECK( _Translate( &paging, 0x40200000 + 0x1ABCDE, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0x80000000 + 0x1ABCDE );
+
+	// 1GB
+	_MapPage( &paging, 0x7FC0000000ULL, 0x340000000ULL, 3, GUEST_PTE_PRESENT, PTE_TABLE );
+	TEST_CHECK( _Translate( &paging, 0x7FC0000000ULL + 0x3FFFFFFF, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0x340000000ULL + 0x3FFFFFFF );
+
+	// PS means nothing in a PML4E; it's followed like any other table pointer
+	paging.CR3 = _Reset();
+	_MapPage( &paging, 0x1000, 0x5000, 1, GUEST_PTE_PRESENT, PTE_TABLE );
+	*_Entry( FAKE_TABLES_BASE, 0x1000, 4 ) |= GUEST_PTE_LARGE;
+
+	TEST_CHECK( _Translate( &paging, 0x1000, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0x5000 );
+}
+
+static
+VOID
+TestNotPresent()
+{
+	GUEST_PAGING paging = { 0 };
+	UINT64 linear = 0x00007FF612340000ULL;
+	UINT64 pa;
+	UINT32 errorCode;
+	UINT64 table;
+	ULONG level, missing;
+
+	// Knock out each level in turn; the error code says not present, and which kind of access it was
+	for ( missing = 4; missing >= 1; missing-- )
+	{
+		paging.CR3 = _Reset();
+		paging.CPL = 3;
+
+		_MapPage( &paging, linear, 0x3000, 1, PTE_TABLE, PTE_TABLE );
+
+		table = FAKE_TABLES_BASE;
+
+		for ( level = 4; level > missing; level-- )
+		{
+			table = *_Entry( table, linear, level ) & GUEST_PTE_ADDRESS_MASK;
+		}
+
+		*_Entry( table, linear, missing ) &= ~(UINT64)GUEST_PTE_PRESENT;
+
+		TEST_CHECK( _Translate( &paging, linear, GUEST_ACCESS_WRITE, &pa, &errorCode ) == FALSE );
+		TEST_CHECK_EQUAL( errorCode, PAGE_FAULT_ERROR_WRITE | PAGE_FAULT_ERROR_USER );
+
+		// Nothing is marked accessed by a translation that faults
+		TEST_CHECK_EQUAL( *_Entry( FAKE_TABLES_BASE, linear, 4 ) & GUEST_PTE_ACCESSED, 0 );
+	}
+
+	paging.CPL = 0;
+
+	TEST_CHECK( _Translate( &paging, linear, 0, &pa, &errorCode ) == FALSE );
+	TEST_CHECK_EQUAL( errorCode, 0 );
+
+	// A table that isn't in memory at all can't be mapped; that's not present as well
+	paging.CR3 = _Reset();
+	*_Entry( FAKE_TABLES_BASE, linear, 4 ) = (FAKE_MEMORY_SIZE + PAGE_SIZE) | PTE_TABLE;
+
+	TEST_CHECK( _Translate( &paging, linear, 0, &pa, &errorCode ) == FALSE );
+	TEST_CHECK_EQUAL( errorCode, 0 );
+}
+
+static
+VOID
+TestAccessRights()
+{
+	static CONST struct
+	{
+		UINT64 LeafFlags;
+		UINT64 TableFlags;
+		UINT8 CPL;
+		BOOLEAN WriteProtect;
+		BOOLEAN SMAP;
+		UINT32 Access;
+		BOOLEAN Allowed;
+		UINT32 ErrorCode;
+	} cases[] = {
+		// A read-only page: supervisor writes fault only with CR0.WP set; user-mode writes always do
+		{ GUEST_PTE_PRESENT,						PTE_TABLE,	0, TRUE,  FALSE, GUEST_ACCESS_WRITE, FALSE, 0x3 },
+		{ GUEST_PTE_PRESENT,						PTE_TABLE,	0, FALSE, FALSE, GUEST_ACCESS_WRITE, TRUE,  0 },
+		{ GUEST_PTE_PRESENT | GUEST_PTE_USER,		PTE_TABLE,	3, FALSE, FALSE, GUEST_ACCESS_WRITE, FALSE, 0x7 },
+		{ GUEST_PTE_PRESENT | GUEST_PTE_USER,		PTE_TABLE,	3, FALSE, FALSE, 0,                  TRUE,  0 },
+
+		// Read-only (or supervisor-only) at a table level is just as read-only (or supervisor-only)
+		{ PTE_TABLE,	GUEST_PTE_PRESENT | GUEST_PTE_USER,		3, TRUE,  FALSE, GUEST_ACCESS_WRITE, FALSE, 0x7 },
+		{ PTE_TABLE,	GUEST_PTE_PRESENT | GUEST_PTE_WRITE,	3, TRUE,  FALSE, 0,                  FALSE, 0x5 },
+
+		// A supervisor-mode page is out of reach of user mode, reads included
+		{ GUEST_PTE_PRESENT | GUEST_PTE_WRITE,		PTE_TABLE,	3, TRUE,  FALSE, 0,                  FALSE, 0x5 },
+
+		// A user-mode page is in reach of supervisor mode, unless SMAP is on (and RFLAGS.AC clear)
+		{ PTE_TABLE,								PTE_TABLE,	0, TRUE,  FALSE, GUEST_ACCESS_WRITE, TRUE,  0 },
+		{ PTE_TABLE,								PTE_TABLE,	0, TRUE,  TRUE,  0,                  FALSE, 0x1 },
+		{ PTE_TABLE,								PTE_TABLE,	0, TRUE,  TRUE,  GUEST_ACCESS_WRITE, FALSE, 0x3 },
+
+		// SMAP has nothing to say about user-mode accesses
+		{ PTE_TABLE,								PTE_TABLE,	3, TRUE,  TRUE,  GUEST_ACCESS_WRITE, TRUE,  0 },
+	};
+
+	GUEST_PAGING paging = { 0 };
+	UINT64 linear = 0x0000000140001000ULL;
+	UINT64 pa;
+	UINT32 errorCode;
+	PUINT64 leaf;
+	ULONG i;
+
+	for ( i = 0; i < ARRAYSIZE( cases ); i++ )
+	{
+		paging.CR3 = _Reset();
+		paging.CPL = cases[i].CPL;
+		paging.WriteProtect = cases[i].WriteProtect;
+		paging.SMAP = cases[i].SMAP;
+
+		leaf = _MapPage( &paging, linear, 0x9000, 1, cases[i].LeafFlags, cases[i].TableFlags );
+
+		TEST_CHECK( _Translate( &paging, linear + 8, cases[i].Access, &pa, &errorCode ) == cases[i].Allowed );
+
+		if ( cases[i].Allowed == TRUE )
+		{
+			TEST_CHECK_EQUAL( pa, 0x9008 );
+		}
+		else
+		{
+			TEST_CHECK_EQUAL( errorCode, cases[i].ErrorCode );
+			TEST_CHECK_EQUAL( *leaf & (GUEST_PTE_ACCESSED | GUEST_PTE_DIRTY), 0 );
+		}
+	}
+}
+
+static
+VOID
+TestFiveLevel()
+{
+	GUEST_PAGING paging = { 0 };
+	UINT64 linear = 0xFF12345678ABC000ULL;
+	UINT64 pa;
+	UINT32 errorCode;
+
+	paging.CR3 = _Reset();
+	paging.FiveLevel = TRUE;
+
+	// Bits 56:48 pick the PML5E; the same address under 4-level paging isn't canonical at all
+	_MapPage( &paging, linear, 0xA000, 1, GUEST_PTE_PRESENT, PTE_TABLE );
+	TEST_CHECK( _Entry( FAKE_TABLES_BASE, linear, 5 ) == (PUINT64)(g_Memory.Bytes + FAKE_TABLES_BASE + 0x112 * 8) );
+
+	TEST_CHECK( GuestWalkIsCanonical( &paging, linear ) == TRUE );
+	TEST_CHECK( _Translate( &paging, linear + 0x123, 0, &pa, &errorCode ) == TRUE );
+	TEST_CHECK_EQUAL( pa, 0xA123 );
+	TEST_CHECK_EQUAL( g_Memory.Maps, 5 + 5 );
+
+	paging.FiveLevel = FALSE;
+	TEST_CHECK( GuestWalkIsCanonical( &paging, linear ) == FALSE );
+}
+
+static
+VOID
+TestCanonical()
+{
+	GUEST_PAGING paging = { 0 };
+
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0 ) == TRUE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0x00007FFFFFFFFFFFULL ) == TRUE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0xFFFF800000000000ULL ) == TRUE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0x0000800000000000ULL ) == FALSE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0xFFFF7FFFFFFFFFFFULL ) == FALSE );
+
+	paging.FiveLevel = TRUE;
+
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0x0000800000000000ULL ) == TRUE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0x00FFFFFFFFFFFFFFULL ) == TRUE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0x0100000000000000ULL ) == FALSE );
+	TEST_CHECK( GuestWalkIsCanonical( &paging, 0xFF00000000000000ULL ) == TRUE );
+}
+
+int
+main()
+{
+	g_Memory.Bytes = aligned_alloc( PAGE_SIZE, FAKE_MEMORY_SIZE );
+
+	TEST_RUN( TestTranslate4KB );
+	TEST_RUN( TestLargePages );
+	TEST_RUN( TestNotPresent );
+	TEST_RUN( TestAccessRights );
+	TEST_RUN( TestFiveLevel );
+	TEST_RUN( TestCanonical );
+
+	free( g_Memory.Bytes );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,134 @@
+#include "IOBitmap.h"
+#include "Test.h"
+
+/*
+ * The I/O bitmaps, as the 8KB block we keep them in: bitmap A (ports 0000H - 7FFFH) and bitmap B (8000H - FFFFH)
+ *  back to back ([24.6.4] "I/O-Bitmap Addresses"). Checked against the raw bits on either side of the split at
+ *  8000H, for single ports, ranges across it, and accesses that straddle it (or wrap around the end).
+ */
+
+static UINT8 g_Bitmap[IO_BITMAP_SIZE];
+
+static
+ULONG
+_CountBits(
+	VOID
+	)
+{
+	ULONG count = 0;
+	ULONG i;
+
+	for ( i = 0; i < IO_BITMAP_SIZE; i++ )
+	{
+		count += __builtin_popcount( g_Bitmap[i] );
+	}
+
+	return count;
+}
+
+static
+VOID
+TestSplit()
+{
+	RtlZeroMemory( g_Bitmap, sizeof(g_Bitmap) );
+
+	// The last port of bitmap A is the last bit of its last byte
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, 0x7FFF, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_A_OFFSET + 0xFFF], 0x80 );
+	TEST_CHECK_EQUAL( _CountBits(), 1 );
+
+	// The first port of bitmap B is the first bit of its first byte
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, 0x8000, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0x01 );
+	TEST_CHECK_EQUAL( _CountBits(), 2 );
+
+	// And the very first and last ports
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, 0x0000, TRUE ) == TRUE );
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, IO_PORT_LAST, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_A_OFFSET], 0x01 );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET + 0xFFF], 0x80 );
+
+	// Stopping one leaves its neighbour across the split alone
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, 0x7FFF, FALSE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_A_OFFSET + 0xFFF], 0 );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0x01 );
+	TEST_CHECK_EQUAL( _CountBits(), 3 );
+
+	// Past the last port
+	TEST_CHECK( IoBitmapSetIntercept( g_Bitmap, IO_PORT_LAST + 1, TRUE ) == FALSE );
+	TEST_CHECK_EQUAL( _CountBits(), 3 );
+}
+
+static
+VOID
+TestRangeAcrossSplit()
+{
+	RtlZeroMemory( g_Bitmap, sizeof(g_Bitmap) );
+
+	// Whole bytes on either side
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0x7FF8, 0x8007, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_A_OFFSET + 0xFFF], 0xFF );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0xFF );
+	TEST_CHECK_EQUAL( _CountBits(), 16 );
+
+	// Part of a byte on either side
+	RtlZeroMemory( g_Bitmap, sizeof(g_Bitmap) );
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0x7FFD, 0x8002, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_A_OFFSET + 0xFFF], 0xE0 );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0x07 );
+	TEST_CHECK_EQUAL( _CountBits(), 6 );
+
+	// Stopping part of it, starting on a byte boundary but not running to the end of one
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0x8000, 0x8001, FALSE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0x04 );
+
+	// One port short of a whole byte
+	RtlZeroMemory( g_Bitmap, sizeof(g_Bitmap) );
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0x8000, 0x8006, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( g_Bitmap[IO_BITMAP_B_OFFSET], 0x7F );
+
+	// Every port there is, and then none
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0, IO_PORT_LAST, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits(), IO_BITMAP_SIZE * 8 );
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0, IO_PORT_LAST, FALSE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits(), 0 );
+
+	// Backwards, or off the end; nothing changes
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0x8001, 0x8000, TRUE ) == FALSE );
+	TEST_CHECK( IoBitmapSetRangeIntercept( g_Bitmap, 0xFFF8, IO_PORT_LAST + 1, TRUE ) == FALSE );
+	TEST_CHECK_EQUAL( _CountBits(), 0 );
+}
+
+static
+VOID
+TestIsIntercepted()
+{
+	RtlZeroMemory( g_Bitmap, sizeof(g_Bitmap) );
+
+	IoBitmapSetIntercept( g_Bitmap, 0x8000, TRUE );
+
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x8000, 1 ) == TRUE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x7FFF, 1 ) == FALSE );
+
+	// An access that touches a port in bitmap B from bitmap A exits
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x7FFF, 2 ) == TRUE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x7FFD, 4 ) == TRUE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x7FFC, 4 ) == FALSE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0x8001, 4 ) == FALSE );
+
+	// One that wraps around the end of the I/O address space always does, whatever the bits say
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, IO_PORT_LAST, 1 ) == FALSE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, IO_PORT_LAST, 2 ) == TRUE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0xFFFD, 4 ) == TRUE );
+	TEST_CHECK( IoBitmapIsIntercepted( g_Bitmap, 0xFFFC, 4 ) == FALSE );
+}
+
+int
+main()
+{
+	TEST_RUN( TestSplit );
+	TEST_RUN( TestRangeAcrossSplit );
+	TEST_RUN( TestIsIntercepted );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "IntrQueue.h"
+#include "Test.h"
+
+/*
+ * An LP's queue of external interrupts waiting for the guest: vectors coalesce, come back out highest first whichever
+ *  word of the bitmap they're in, and a peek leaves them where they are. Then whether the next VM-entry can hand one
+ *  to the guest, for each thing that holds it back (the TPR in CR8 among them). Then a run of random pushes and pops
+ *  against a plain array of flags.
+ */
+
+#define DEVICE_VECTOR					0x61
+#define CLOCK_VECTOR					0xD1
+
+static INTR_QUEUE g_Queue;
+
+static
+VOID
+TestPushPop()
+{
+	UINT8 vector;
+
+	memset( &g_Queue, 0xCC, sizeof(g_Queue) );
+	IntrQueueReset( &g_Queue );
+
+	TEST_CHECK_EQUAL( g_Queue.Count, 0 );
+	TEST_CHECK_EQUAL( g_Queue.Coalesced, 0 );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == FALSE );
+	TEST_CHECK( IntrQueuePeek( &g_Queue, &vector ) == FALSE );
+
+	// One of each word, lowest first; they come back highest first
+	TEST_CHECK( IntrQueuePush( &g_Queue, INTR_FIRST_VECTOR ) == TRUE );
+	TEST_CHECK( IntrQueuePush( &g_Queue, DEVICE_VECTOR ) == TRUE );
+	TEST_CHECK( IntrQueuePush( &g_Queue, 0x80 ) == TRUE );
+	TEST_CHECK( IntrQueuePush( &g_Queue, 0x7F ) == TRUE );
+	TEST_CHECK( IntrQueuePush( &g_Queue, 0xFF ) == TRUE );
+	TEST_CHECK_EQUAL( g_Queue.Count, 5 );
+
+	// Again, while it's still waiting; the guest sees it once
+	TEST_CHECK( IntrQueuePush( &g_Queue, DEVICE_VECTOR ) == FALSE );
+	TEST_CHECK_EQUAL( g_Queue.Count, 5 );
+	TEST_CHECK_EQUAL( g_Queue.Coalesced, 1 );
+
+	// A peek doesn't take it
+	TEST_CHECK( IntrQueuePeek( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0xFF );
+	TEST_CHECK( IntrQueuePeek( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0xFF );
+	TEST_CHECK_EQUAL( g_Queue.Count, 5 );
+
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0xFF );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0x80 );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0x7F );
+	TEST_CHECK_EQUAL( g_Queue.Count, 2 );
+
+	// Taken, so it goes in again
+	TEST_CHECK( IntrQueuePush( &g_Queue, 0xFF ) == TRUE );
+	TEST_CHECK_EQUAL( g_Queue.Coalesced, 1 );
+
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0xFF );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, DEVICE_VECTOR );
+	TEST_CHECK( IntrQueuePeek( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, INTR_FIRST_VECTOR );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, INTR_FIRST_VECTOR );
+
+	TEST_CHECK_EQUAL( g_Queue.Count, 0 );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == FALSE );
+	TEST_CHECK_EQUAL( g_Queue.Pending[0] | g_Queue.Pending[1] | g_Queue.Pending[2] | g_Queue.Pending[3], 0 );
+
+	// The lowest and highest bits of the bitmap
+	TEST_CHECK( IntrQueuePush( &g_Queue, 0 ) == TRUE );
+	TEST_CHECK( IntrQueuePop( &g_Queue, &vector ) == TRUE );
+	TEST_CHECK_EQUAL( vector, 0 );
+	TEST_CHECK_EQUAL( g_Queue.Count, 0 );
+}
+
+static
+VOID
+TestAboveTPR()
+{
+	// [10.8.3.1] "Task and Processor Priorities"; only a class above the TPR's goes through
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 0 ) == TRUE );
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 5 ) == TRUE );
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 6 ) == FALSE );
+	TEST_CHECK( IntrQueueAboveTPR( 0x5F, 5 ) == FALSE );
+	TEST_CHECK( IntrQueueAboveTPR( 0x60, 5 ) == TRUE );
+	TEST_CHECK( IntrQueueAboveTPR( 0x6F, 6 ) == FALSE );
+
+	// HIGH_LEVEL holds back everything
+	TEST_CHECK( IntrQueueAboveTPR( 0xFF, 15 ) == FALSE );
+	TEST_CHECK( IntrQueueAboveTPR( 0xFF, 14 ) == TRUE );
+
+	// Only CR8's low 4 bits are the TPR
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 0x10 ) == TRUE );
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 0xFFFFFFFFFFFFFFF0ULL ) == TRUE );
+	TEST_CHECK( IntrQueueAboveTPR( DEVICE_VECTOR, 0xFFFFFFFFFFFFFFF6ULL ) == FALSE );
+}
+
+static
+VOID
+TestCanInject()
+{
+	// A guest running at PASSIVE_LEVEL with interrupts enabled, and nothing in the way
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_ACTIVE, 0 ) == TRUE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF | 0x2, 0, 0, INTR_ACTIVITY_ACTIVE, 0 ) == TRUE );
+
+	// Interrupts disabled
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, 0x2, 0, 0, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, ~INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+
+	// In the shadow of an STI or a MOV SS; blocking by SMI or NMI doesn't hold back an interrupt
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, INTR_STATE_BLOCKING_BY_STI, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, INTR_STATE_BLOCKING_BY_MOV_SS, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0x4 | 0x8, INTR_ACTIVITY_ACTIVE, 0 ) == TRUE );
+
+	// Halted is fine (the interrupt wakes it); shut down or waiting for a SIPI isn't
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_HLT, 0 ) == TRUE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_SHUTDOWN, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_WAIT_FOR_SIPI, 0 ) == FALSE );
+
+	// Something's already being injected; only the valid bit says so
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_ACTIVE, 0x80000000 | 0x30E ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 0, 0, INTR_ACTIVITY_ACTIVE, 0x7FFFFFFF ) == TRUE );
+
+	// The TPR: a device interrupt waits out DISPATCH_LEVEL's betters, the clock doesn't
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 2, 0, INTR_ACTIVITY_ACTIVE, 0 ) == TRUE );
+	TEST_CHECK( IntrQueueCanInject( DEVICE_VECTOR, INTR_RFLAGS_IF, 6, 0, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( CLOCK_VECTOR, INTR_RFLAGS_IF, 6, 0, INTR_ACTIVITY_ACTIVE, 0 ) == TRUE );
+	TEST_CHECK( IntrQueueCanInject( CLOCK_VECTOR, INTR_RFLAGS_IF, 13, 0, INTR_ACTIVITY_ACTIVE, 0 ) == FALSE );
+	TEST_CHECK( IntrQueueCanInject( CLOCK_VECTOR, INTR_RFLAGS_IF, 13, 0, INTR_ACTIVITY_HLT, 0 ) == FALSE );
+}
+
+static
+VOID
+TestRandom()
+{
+	// Random pushes and pops, against a flag per vector; pops have to take the highest one flagged
+	BOOLEAN flags[INTR_VECTOR_COUNT];
+	ULONG i, count = 0, coalesced = 0, wrong = 0;
+	UINT8 vector, peeked;
+	LONG expected;
+
+	memset( flags, 0, sizeof(flags) );
+	IntrQueueReset( &g_Queue );
+	srand( 25 );
+
+	for ( i = 0; i < 1000000; i++ )
+	{
+		if ( rand() % 3 != 0 )
+		{
+			vector = (UINT8)rand();
+
+			wrong += (IntrQueuePush( &g_Queue, vector ) != (flags[vector] == FALSE));
+			coalesced += (flags[vector] == TRUE);
+			count += (flags[vector] == FALSE);
+			flags[vector] = TRUE;
+			continue;
+		}
+
+		for ( expected = INTR_VECTOR_COUNT - 1; expected >= 0 && flags[expected] == FALSE; expected-- );
+
+		if ( expected < 0 )
+		{
+			wrong += (IntrQueuePeek( &g_Queue, &peeked ) != FALSE || IntrQueuePop( &g_Queue, &vector ) != FALSE);
+			continue;
+		}
+
+		wrong += (IntrQueuePeek( &g_Queue, &peeked ) != TRUE || peeked != expected);
+		wrong += (IntrQueuePop( &g_Queue, &vector ) != TRUE || vector != expected);
+		flags[expected] = FALSE;
+		count--;
+
+		wrong += (g_Queue.Count != count);
+	}
+
+	TEST_CHECK_EQUAL( wrong, 0 );
+	TEST_CHECK_EQUAL( g_Queue.Count, count );
+	TEST_CHECK_EQUAL( g_Queue.Coalesced, coalesced );
+	TEST_CHECK( coalesced > 1000 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestPushPop );
+	TEST_RUN( TestAboveTPR );
+	TEST_RUN( TestCanInject );
+	TEST_RUN( TestRandom );
+
+	return TEST_EXIT_CODE();
+}
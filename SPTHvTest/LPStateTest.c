@@ -0,0 +1,319 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "LPState.h"
+#include "Test.h"
+
+/*
+ * The bring-up and teardown broadcasts (see _VirtualizeLP and _DevirtualizeLP in "Driver.c"), with a thread per LP
+ *  standing in for the IPI: every thread is released at once, and a broadcast only returns once all of them are
+ *  done, as KeIpiGenericCall does. Some LPs are made to fail part way through bring-up, as a VMXON or VMPTRLD would.
+ */
+
+#define BROADCAST_ROUNDS		64
+
+typedef struct _FAKE_LP
+{
+	volatile LP_STATE State;
+	UINT64 LaunchCycles;
+
+	// The state this LP fails in, instead of moving on from it; LP_STATE_COUNT if it doesn't
+	LP_STATE FailIn;
+
+	// Steps LpStateAdvance took or refused that it shouldn't have (checked once the broadcast is over)
+	ULONG Mistakes;
+} FAKE_LP, *PFAKE_LP;
+
+typedef struct _FAKE_BROADCAST
+{
+	pthread_barrier_t Start;
+	PFAKE_LP LP;
+	BOOLEAN Teardown;
+} FAKE_BROADCAST, *PFAKE_BROADCAST;
+
+typedef struct _FAKE_IPI
+{
+	PFAKE_BROADCAST Broadcast;
+	ULONG Index;
+} FAKE_IPI, *PFAKE_IPI;
+
+static
+VOID
+_VirtualizeFakeLP(
+	_Inout_ PFAKE_LP LP
+	)
+{
+	static CONST LP_STATE steps[] = { LP_STATE_VMX_ON, LP_STATE_VMCS_LOADED, LP_STATE_VIRTUALIZED };
+	UINT64 startTSC;
+	ULONG i;
+
+	// This LP's allocations failed; there's nothing for us to do
+	if ( LP->State != LP_STATE_ALLOCATED )
+	{
+		return;
+	}
+
+	startTSC = __rdtsc();
+
+	for ( i = 0; i < ARRAYSIZE( steps ); i++ )
+	{
+		if ( LP->FailIn == LP->State )
+		{
+			LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_FAILED ) == FALSE);
+			return;
+		}
+
+		// Skipping a step is never allowed
+		if ( i + 1 < ARRAYSIZE( steps ) )
+		{
+			LP->Mistakes += (LpStateAdvance( &LP->State, steps[i + 1] ) == TRUE);
+		}
+
+		LP->Mistakes += (LpStateAdvance( &LP->State, steps[i] ) == FALSE);
+	}
+
+	LP->LaunchCycles = __rdtsc() - startTSC + 1;
+
+	// Nor is going back
+	LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_VMX_ON ) == TRUE);
+}
+
+static
+VOID
+_DevirtualizeFakeLP(
+	_Inout_ PFAKE_LP LP
+	)
+{
+	if ( LP->State != LP_STATE_VIRTUALIZED )
+	{
+		// (Note: an LP that failed stays that way)
+		LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_TORN_DOWN ) == TRUE);
+		return;
+	}
+
+	LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_TORN_DOWN ) == FALSE);
+
+	// Once torn down, an LP stays that way too
+	LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_VIRTUALIZED ) == TRUE);
+	LP->Mistakes += (LpStateAdvance( &LP->State, LP_STATE_FAILED ) == TRUE);
+}
+
+static
+PVOID
+_FakeIPIWorker(
+	_In_ PVOID Argument
+	)
+{
+	PFAKE_IPI ipi = Argument;
+
+	pthread_barrier_wait( &ipi->Broadcast->Start );
+
+	if ( ipi->Broadcast->Teardown == TRUE )
+	{
+		_DevirtualizeFakeLP( &ipi->Broadcast->LP[ipi->Index] );
+	}
+	else
+	{
+		_VirtualizeFakeLP( &ipi->Broadcast->LP[ipi->Index] );
+	}
+
+	return NULL;
+}
+
+static
+VOID
+_FakeIpiGenericCall(
+	_Inout_ PFAKE_LP LP,
+	_In_ CONST ULONG Count,
+	_In_ CONST BOOLEAN Teardown
+	)
+{
+	FAKE_BROADCAST broadcast;
+	pthread_t* threads;
+	PFAKE_IPI ipis;
+	ULONG i;
+
+	threads = calloc( Count, sizeof(pthread_t) );
+	ipis = calloc( Count, sizeof(FAKE_IPI) );
+
+	broadcast.LP = LP;
+	broadcast.Teardown = Teardown;
+	pthread_barrier_init( &broadcast.Start, NULL, Count );
+
+	for ( i = 0; i < Count; i++ )
+	{
+		ipis[i].Broadcast = &broadcast;
+		ipis[i].Index = i;
+		pthread_create( &threads[i], NULL, _FakeIPIWorker, &ipis[i] );
+	}
+
+	for ( i = 0; i < Count; i++ )
+	{
+		pthread_join( threads[i], NULL );
+	}
+
+	pthread_barrier_destroy( &broadcast.Start );
+	free( ipis );
+	free( threads );
+}
+
+static
+VOID
+TestTransitions()
+{
+	// Exactly the transitions bring-up and teardown take are allowed, from every state
+	static CONST UINT32 allowed[LP_STATE_COUNT] = {
+		(1UL << LP_STATE_ALLOCATED),
+		(1UL << LP_STATE_VMX_ON) | (1UL << LP_STATE_FAILED),
+		(1UL << LP_STATE_VMCS_LOADED) | (1UL << LP_STATE_FAILED),
+		(1UL << LP_STATE_VIRTUALIZED) | (1UL << LP_STATE_FAILED),
+		(1UL << LP_STATE_TORN_DOWN),
+		0,
+		0
+	};
+
+	volatile LP_STATE state;
+	ULONG from, to;
+
+	for ( from = 0; from < LP_STATE_COUNT; from++ )
+	{
+		for ( to = 0; to < LP_STATE_COUNT; to++ )
+		{
+			state = (LP_STATE)from;
+
+			TEST_CHECK_EQUAL( LpStateAdvance( &state, (LP_STATE)to ), (allowed[from] >> to) & 1 );
+			TEST_CHECK_EQUAL( state, ((allowed[from] >> to) & 1) ? to : from );
+		}
+	}
+
+	// Nothing past the end of the enumeration, either way
+	state = LP_STATE_ALLOCATED;
+	TEST_CHECK( LpStateAdvance( &state, LP_STATE_COUNT ) == FALSE );
+
+	state = LP_STATE_COUNT;
+	TEST_CHECK( LpStateAdvance( &state, LP_STATE_FAILED ) == FALSE );
+	TEST_CHECK_EQUAL( state, LP_STATE_COUNT );
+}
+
+static
+VOID
+TestTally()
+{
+	LP_STATE_SUMMARY summary;
+
+	RtlSecureZeroMemory( &summary, sizeof(summary) );
+
+	LpStateTally( &summary, LP_STATE_FAILED, 0 );
+	TEST_CHECK_EQUAL( summary.MinCycles, 0 );
+
+	LpStateTally( &summary, LP_STATE_VIRTUALIZED, 700 );
+	LpStateTally( &summary, LP_STATE_VIRTUALIZED, 300 );
+	LpStateTally( &summary, LP_STATE_VIRTUALIZED, 900 );
+	LpStateTally( &summary, LP_STATE_UNINITIALIZED, 0 );
+
+	// (Note: only the virtualized LPs' timings count)
+	LpStateTally( &summary, LP_STATE_TORN_DOWN, 5 );
+
+	TEST_CHECK_EQUAL( summary.Count, 6 );
+	TEST_CHECK_EQUAL( summary.States[LP_STATE_VIRTUALIZED], 3 );
+	TEST_CHECK_EQUAL( summary.States[LP_STATE_FAILED], 1 );
+	TEST_CHECK_EQUAL( summary.States[LP_STATE_UNINITIALIZED], 1 );
+	TEST_CHECK_EQUAL( summary.States[LP_STATE_TORN_DOWN], 1 );
+	TEST_CHECK_EQUAL( summary.MinCycles, 300 );
+	TEST_CHECK_EQUAL( summary.MaxCycles, 900 );
+	TEST_CHECK_EQUAL( summary.TotalCycles, 1900 );
+}
+
+static
+VOID
+TestBroadcasts()
+{
+	/*
+	 * A thread per online CPU (at least a few, so that there's contention even on a small machine), brought up and
+	 *  torn down over and over; in each round, a different handful of them fail, each in a different state, and
+	 *  one never got its allocations.
+	 */
+
+	LP_STATE_SUMMARY summary;
+	PFAKE_LP lps;
+	ULONG count, round, i, failures;
+
+	count = (ULONG)sysconf( _SC_NPROCESSORS_ONLN );
+	count = min( max( count, 4 ), 256 );
+
+	lps = calloc( count, sizeof(FAKE_LP) );
+
+	for ( round = 0; round < BROADCAST_ROUNDS; round++ )
+	{
+		failures = 0;
+
+		for ( i = 0; i < count; i++ )
+		{
+			lps[i].State = LP_STATE_UNINITIALIZED;
+			lps[i].LaunchCycles = 0;
+			lps[i].Mistakes = 0;
+			lps[i].FailIn = LP_STATE_COUNT;
+
+			if ( (i + round) % 7 == 0 )
+			{
+				lps[i].FailIn = (LP_STATE)(LP_STATE_ALLOCATED + (i + round) % 3);
+				failures++;
+			}
+
+			// (Note: DriverEntry's steps 1-6, before the broadcast)
+			if ( (i + round) % 11 != 5 )
+			{
+				TEST_CHECK( LpStateAdvance( &lps[i].State, LP_STATE_ALLOCATED ) == TRUE );
+			}
+			else if ( lps[i].FailIn != LP_STATE_COUNT )
+			{
+				lps[i].FailIn = LP_STATE_COUNT;
+				failures--;
+			}
+		}
+
+		_FakeIpiGenericCall( lps, count, FALSE );
+
+		RtlSecureZeroMemory( &summary, sizeof(summary) );
+
+		for ( i = 0; i < count; i++ )
+		{
+			TEST_CHECK_EQUAL( lps[i].Mistakes, 0 );
+			LpStateTally( &summary, lps[i].State, lps[i].LaunchCycles );
+		}
+
+		TEST_CHECK_EQUAL( summary.Count, count );
+		TEST_CHECK_EQUAL( summary.States[LP_STATE_FAILED], failures );
+		TEST_CHECK_EQUAL( summary.States[LP_STATE_VIRTUALIZED] + summary.States[LP_STATE_FAILED] + summary.States[LP_STATE_UNINITIALIZED], count );
+		TEST_CHECK( summary.States[LP_STATE_VIRTUALIZED] == 0 || summary.MinCycles != 0 );
+		TEST_CHECK( summary.MinCycles <= summary.MaxCycles );
+
+		// A partial bring-up is backed out of, just like a full one is at unload
+		_FakeIpiGenericCall( lps, count, TRUE );
+
+		RtlSecureZeroMemory( &summary, sizeof(summary) );
+
+		for ( i = 0; i < count; i++ )
+		{
+			TEST_CHECK_EQUAL( lps[i].Mistakes, 0 );
+			LpStateTally( &summary, lps[i].State, 0 );
+		}
+
+		TEST_CHECK_EQUAL( summary.States[LP_STATE_VIRTUALIZED], 0 );
+		TEST_CHECK_EQUAL( summary.States[LP_STATE_FAILED], failures );
+		TEST_CHECK_EQUAL( summary.States[LP_STATE_TORN_DOWN] + summary.States[LP_STATE_FAILED] + summary.States[LP_STATE_UNINITIALIZED], count );
+	}
+
+	free( lps );
+}
+
+int
+main()
+{
+	TEST_RUN( TestTransitions );
+	TEST_RUN( TestTally );
+	TEST_RUN( TestBroadcasts );
+
+	return TEST_EXIT_CODE();
+}
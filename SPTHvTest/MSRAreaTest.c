@@ -0,0 +1,276 @@
+#include "MSRArea.h"
+#include "Test.h"
+
+/*
+ * The VM-entry/VM-exit MSR areas an LP's requests are built into, as the processor would walk them: requests for the
+ *  same MSR merged into one entry, the guest entries stored on exit ahead of those only loaded on entry (each run
+ *  sorted), and every side of IA32_EFER, IA32_PAT and IA32_PERF_GLOBAL_CTRL the processor has a control for kept out
+ *  of the areas altogether. Then again with none of those controls allowed, and with more requests than fit.
+ */
+
+#define IA32_STAR						0xC0000081
+#define IA32_LSTAR						0xC0000082
+#define IA32_CSTAR						0xC0000083
+#define IA32_KERNEL_GS_BASE				0xC0000102
+
+// Every VM-exit and VM-entry control allowed to be 1
+#define ALL_CONTROLS					MAXUINT32
+
+static MSR_AREA_REQUEST g_Requests[MSR_AREA_MAX_REQUESTS + 1];
+static MSR_AREA_ENTRY g_GuestArea[MSR_AREA_MAX_ENTRIES];
+static MSR_AREA_ENTRY g_HostArea[MSR_AREA_MAX_ENTRIES];
+
+static
+BOOLEAN
+_Build(
+	_In_ CONST ULONG RequestCount,
+	_In_ CONST UINT32 AllowedExitCtrls,
+	_In_ CONST UINT32 AllowedEntryCtrls,
+	_Out_ PMSR_AREA_LAYOUT Layout
+	)
+{
+	// (Note: filled with garbage first; nothing past the counts may be relied on)
+	RtlFillMemory( g_GuestArea, sizeof(g_GuestArea), 0xCC );
+	RtlFillMemory( g_HostArea, sizeof(g_HostArea), 0xCC );
+
+	return MsrAreaBuild( g_Requests, RequestCount, AllowedExitCtrls, AllowedEntryCtrls, g_GuestArea, g_HostArea, Layout );
+}
+
+static
+UINT64
+_FieldValue(
+	_In_ CONST MSR_AREA_LAYOUT* Layout,
+	_In_ CONST UINT64 Encoding
+	)
+{
+	ULONG i;
+
+	for ( i = 0; i < Layout->FieldCount; i++ )
+	{
+		if ( Layout->Fields[i].Encoding == Encoding )
+		{
+			return Layout->Fields[i].Value;
+		}
+	}
+
+	return 0xBAD;
+}
+
+static
+VOID
+TestAddRequest()
+{
+	ULONG count = 0;
+	ULONG i;
+
+	TEST_CHECK( MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_GUEST_LOAD, 0x1111, 0x2222 ) == TRUE );
+	TEST_CHECK_EQUAL( count, 1 );
+	TEST_CHECK_EQUAL( g_Requests[0].Index, IA32_LSTAR );
+	TEST_CHECK_EQUAL( g_Requests[0].Flags, MSR_AREA_GUEST_LOAD );
+	TEST_CHECK_EQUAL( g_Requests[0].GuestValue, 0x1111 );
+	TEST_CHECK_EQUAL( g_Requests[0].HostValue, 0x2222 );
+
+	// A request to do nothing isn't one
+	TEST_CHECK( MsrAreaAddRequest( g_Requests, &count, IA32_STAR, 0, 0, 0 ) == FALSE );
+	TEST_CHECK_EQUAL( count, 1 );
+
+	// Up to the limit, and not one more
+	for ( i = 1; i < MSR_AREA_MAX_REQUESTS; i++ )
+	{
+		TEST_CHECK( MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_HOST_LOAD, 0, i ) == TRUE );
+	}
+
+	TEST_CHECK( MsrAreaAddRequest( g_Requests, &count, IA32_STAR, MSR_AREA_HOST_LOAD, 0, 0 ) == FALSE );
+	TEST_CHECK_EQUAL( count, MSR_AREA_MAX_REQUESTS );
+	TEST_CHECK_EQUAL( g_Requests[MSR_AREA_MAX_REQUESTS].Index, 0 );
+}
+
+static
+VOID
+TestMergeAndOrder()
+{
+	MSR_AREA_LAYOUT layout;
+	ULONG count = 0;
+
+	RtlZeroMemory( g_Requests, sizeof(g_Requests) );
+
+	// Out of order, with the same MSR asked for more than once
+	MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_GUEST_LOAD, 0x1, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_KERNEL_GS_BASE, MSR_AREA_GUEST_SAVE | MSR_AREA_HOST_LOAD, 0x2, 0x3 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_STAR, MSR_AREA_GUEST_LOAD, 0x4, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_HOST_LOAD, 0xFFFF, 0x5 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_CSTAR, MSR_AREA_GUEST_LOAD, 0x6, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_GUEST_LOAD, 0x7, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_CSTAR, MSR_AREA_GUEST_SAVE, 0x8, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_HOST_LOAD, 0, 0x9 );
+
+	TEST_CHECK( _Build( count, ALL_CONTROLS, ALL_CONTROLS, &layout ) == TRUE );
+
+	// One entry per MSR and side; none of these has a dedicated control
+	TEST_CHECK_EQUAL( layout.GuestCount, 4 );
+	TEST_CHECK_EQUAL( layout.HostCount, 2 );
+	TEST_CHECK_EQUAL( layout.FieldCount, 0 );
+	TEST_CHECK_EQUAL( layout.ExitCtrls.All, 0 );
+	TEST_CHECK_EQUAL( layout.EntryCtrls.All, 0 );
+
+	// Stored on exit (including CSTAR, which a later request handed to the guest), sorted; then loaded only, sorted
+	TEST_CHECK_EQUAL( layout.GuestStoreCount, 2 );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Index, IA32_CSTAR );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Data, 0x8 );
+	TEST_CHECK_EQUAL( g_GuestArea[1].Index, IA32_KERNEL_GS_BASE );
+	TEST_CHECK_EQUAL( g_GuestArea[1].Data, 0x2 );
+	TEST_CHECK_EQUAL( g_GuestArea[2].Index, IA32_STAR );
+	TEST_CHECK_EQUAL( g_GuestArea[2].Data, 0x4 );
+	TEST_CHECK_EQUAL( g_GuestArea[3].Index, IA32_LSTAR );
+	TEST_CHECK_EQUAL( g_GuestArea[3].Reserved, 0 );
+
+	// Each side's value is the last one asked for; a host-only request's guest value is never used
+	TEST_CHECK_EQUAL( g_GuestArea[3].Data, 0x7 );
+
+	TEST_CHECK_EQUAL( g_HostArea[0].Index, IA32_LSTAR );
+	TEST_CHECK_EQUAL( g_HostArea[0].Data, 0x9 );
+	TEST_CHECK_EQUAL( g_HostArea[1].Index, IA32_KERNEL_GS_BASE );
+	TEST_CHECK_EQUAL( g_HostArea[1].Data, 0x3 );
+	TEST_CHECK_EQUAL( g_HostArea[1].Reserved, 0 );
+
+	// Each run can be searched on its own
+	TEST_CHECK( MsrAreaFind( g_GuestArea, layout.GuestStoreCount, IA32_KERNEL_GS_BASE ) == &g_GuestArea[1] );
+	TEST_CHECK( MsrAreaFind( g_GuestArea, layout.GuestStoreCount, IA32_CSTAR ) == &g_GuestArea[0] );
+	TEST_CHECK( MsrAreaFind( g_GuestArea, layout.GuestStoreCount, IA32_STAR ) == NULL );
+	TEST_CHECK( MsrAreaFind( g_GuestArea + 2, layout.GuestCount - 2, IA32_LSTAR ) == &g_GuestArea[3] );
+	TEST_CHECK( MsrAreaFind( g_HostArea, layout.HostCount, IA32_LSTAR ) == &g_HostArea[0] );
+	TEST_CHECK( MsrAreaFind( g_HostArea, 0, IA32_LSTAR ) == NULL );
+
+	// Nothing asked for, nothing to do
+	TEST_CHECK( _Build( 0, ALL_CONTROLS, ALL_CONTROLS, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.GuestCount + layout.HostCount + layout.FieldCount, 0 );
+}
+
+static
+VOID
+TestDedicatedControls()
+{
+	MSR_AREA_LAYOUT layout;
+	VM_EXIT_CTRLS exitCtrls, allowedExit;
+	VM_ENTRY_CTRLS entryCtrls, allowedEntry;
+	ULONG count = 0;
+
+	RtlZeroMemory( g_Requests, sizeof(g_Requests) );
+
+	MsrAreaAddRequest( g_Requests, &count, IA32_EFER, MSR_AREA_GUEST_SAVE | MSR_AREA_HOST_LOAD, 0xD01, 0x501 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_PAT, MSR_AREA_GUEST_LOAD, 0x0007040600070406ULL, 0 );
+	MsrAreaAddRequest( g_Requests, &count, IA32_LSTAR, MSR_AREA_GUEST_LOAD, 0x1, 0 );
+
+	// What the driver asks for on every LP (see _RequestMSRs in "Driver.c")
+	MsrAreaAddRequest( g_Requests, &count, IA32_PERF_GLOBAL_CTRL, MSR_AREA_GUEST_SAVE | MSR_AREA_HOST_LOAD, 0xF, 0 );
+
+	// Everything allowed: the areas hold only what has no control (IA32_PERF_GLOBAL_CTRL can't be saved by one)
+	TEST_CHECK( _Build( count, ALL_CONTROLS, ALL_CONTROLS, &layout ) == TRUE );
+
+	exitCtrls.All = 0;
+	exitCtrls.SaveEFER = 1;
+	exitCtrls.LoadEFER = 1;
+	exitCtrls.LoadPerfGlobalCtrl = 1;
+
+	entryCtrls.All = 0;
+	entryCtrls.LoadEFER = 1;
+	entryCtrls.LoadPAT = 1;
+
+	TEST_CHECK_EQUAL( layout.ExitCtrls.All, exitCtrls.All );
+	TEST_CHECK_EQUAL( layout.EntryCtrls.All, entryCtrls.All );
+
+	TEST_CHECK_EQUAL( layout.FieldCount, 4 );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_GUEST_IA32_EFER_FULL ), 0xD01 );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_HOST_IA32_EFER_FULL ), 0x501 );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_GUEST_IA32_PAT_FULL ), 0x0007040600070406ULL );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_HOST_IA32_PERF_GLB_CTRL_FULL ), 0 );
+
+	TEST_CHECK_EQUAL( layout.GuestStoreCount, 1 );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Index, IA32_PERF_GLOBAL_CTRL );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Data, 0xF );
+	TEST_CHECK_EQUAL( layout.GuestCount, 2 );
+	TEST_CHECK_EQUAL( g_GuestArea[1].Index, IA32_LSTAR );
+	TEST_CHECK_EQUAL( layout.HostCount, 0 );
+
+	// A guest IA32_PERF_GLOBAL_CTRL that's only loaded does have a control
+	g_Requests[3].Flags = MSR_AREA_GUEST_LOAD;
+	TEST_CHECK( _Build( count, ALL_CONTROLS, ALL_CONTROLS, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.GuestCount, 1 );
+	TEST_CHECK_EQUAL( layout.EntryCtrls.LoadPerfGlobalCtrl, 1 );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_GUEST_IA32_PERF_GLB_CTRL_FULL ), 0xF );
+	g_Requests[3].Flags = MSR_AREA_GUEST_SAVE | MSR_AREA_HOST_LOAD;
+
+	// No controls at all: everything goes through the areas
+	TEST_CHECK( _Build( count, 0, 0, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.ExitCtrls.All | layout.EntryCtrls.All, 0 );
+	TEST_CHECK_EQUAL( layout.FieldCount, 0 );
+	TEST_CHECK_EQUAL( layout.GuestStoreCount, 2 );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Index, IA32_PERF_GLOBAL_CTRL );
+	TEST_CHECK_EQUAL( g_GuestArea[1].Index, IA32_EFER );
+	TEST_CHECK_EQUAL( layout.GuestCount, 4 );
+	TEST_CHECK_EQUAL( g_GuestArea[2].Index, IA32_PAT );
+	TEST_CHECK_EQUAL( g_GuestArea[3].Index, IA32_LSTAR );
+	TEST_CHECK_EQUAL( layout.HostCount, 2 );
+	TEST_CHECK_EQUAL( g_HostArea[0].Index, IA32_PERF_GLOBAL_CTRL );
+	TEST_CHECK_EQUAL( g_HostArea[1].Index, IA32_EFER );
+	TEST_CHECK_EQUAL( g_HostArea[1].Data, 0x501 );
+
+	// Loading the guest's IA32_EFER is allowed, saving it isn't: a guest that owns it has to go through the areas,
+	//	and its host side still can use its own control
+	allowedExit.All = 0;
+	allowedExit.LoadEFER = 1;
+	allowedEntry.All = 0;
+	allowedEntry.LoadEFER = 1;
+
+	TEST_CHECK( _Build( count, allowedExit.All, allowedEntry.All, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.EntryCtrls.All, 0 );
+	TEST_CHECK_EQUAL( layout.ExitCtrls.All, allowedExit.All );
+	TEST_CHECK_EQUAL( layout.FieldCount, 1 );
+	TEST_CHECK_EQUAL( _FieldValue( &layout, VMCS_HOST_IA32_EFER_FULL ), 0x501 );
+	TEST_CHECK( MsrAreaFind( g_GuestArea, layout.GuestStoreCount, IA32_EFER ) != NULL );
+	TEST_CHECK( MsrAreaFind( g_HostArea, layout.HostCount, IA32_EFER ) == NULL );
+}
+
+static
+VOID
+TestTooMany()
+{
+	MSR_AREA_LAYOUT layout;
+	ULONG i;
+
+	RtlZeroMemory( g_Requests, sizeof(g_Requests) );
+
+	// One more MSR than an area holds (past what MsrAreaAddRequest would take, too)
+	for ( i = 0; i < MSR_AREA_MAX_ENTRIES + 1; i++ )
+	{
+		g_Requests[i].Index = IA32_KERNEL_GS_BASE + 0x100 + i;
+		g_Requests[i].Flags = MSR_AREA_HOST_LOAD;
+	}
+
+	TEST_CHECK( _Build( MSR_AREA_MAX_ENTRIES, 0, 0, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.HostCount, MSR_AREA_MAX_ENTRIES );
+	TEST_CHECK( _Build( MSR_AREA_MAX_ENTRIES + 1, 0, 0, &layout ) == FALSE );
+
+	// All of them for the one MSR is just one entry
+	for ( i = 0; i < MSR_AREA_MAX_ENTRIES + 1; i++ )
+	{
+		g_Requests[i].Index = IA32_LSTAR;
+		g_Requests[i].Flags = MSR_AREA_GUEST_LOAD;
+		g_Requests[i].GuestValue = i;
+	}
+
+	TEST_CHECK( _Build( MSR_AREA_MAX_ENTRIES + 1, 0, 0, &layout ) == TRUE );
+	TEST_CHECK_EQUAL( layout.GuestCount, 1 );
+	TEST_CHECK_EQUAL( g_GuestArea[0].Data, MSR_AREA_MAX_ENTRIES );
+}
+
+int
+main()
+{
+	TEST_RUN( TestAddRequest );
+	TEST_RUN( TestMergeAndOrder );
+	TEST_RUN( TestDedicatedControls );
+	TEST_RUN( TestTooMany );
+
+	return TEST_EXIT_CODE();
+}
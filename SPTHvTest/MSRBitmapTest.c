@@ -0,0 +1,232 @@
+#include "MSRBitmap.h"
+#include "Test.h"
+
+/*
+ * MSR bitmap intercepts, checked against the raw bits the processor looks at ([24.6.9] "MSR-Bitmap Address"): the
+ *  first and last MSR of each covered range, in each of the four 1KB quadrants, and ranges that run up to (and
+ *  past) the ends of the covered ranges. The bitmap sits between two guard areas, which nothing may touch.
+ */
+
+#define GUARD_SIZE						64
+#define GUARD_BYTE						0x5A
+
+typedef struct _GUARDED_BITMAP
+{
+	UINT8 Before[GUARD_SIZE];
+	UINT8 Bitmap[MSR_BITMAP_SIZE];
+	UINT8 After[GUARD_SIZE];
+} GUARDED_BITMAP, *PGUARDED_BITMAP;
+
+static
+VOID
+_Reset(
+	_Out_ PGUARDED_BITMAP Guarded
+	)
+{
+	RtlFillMemory( Guarded, sizeof(GUARDED_BITMAP), GUARD_BYTE );
+	RtlZeroMemory( Guarded->Bitmap, MSR_BITMAP_SIZE );
+}
+
+static
+ULONG
+_CountBits(
+	_In_ CONST GUARDED_BITMAP* Guarded
+	)
+{
+	// Every bit set in the bitmap; and the guards had better still be as they were
+
+	ULONG count = 0;
+	ULONG i;
+
+	for ( i = 0; i < GUARD_SIZE; i++ )
+	{
+		TEST_CHECK_EQUAL( Guarded->Before[i], GUARD_BYTE );
+		TEST_CHECK_EQUAL( Guarded->After[i], GUARD_BYTE );
+	}
+
+	for ( i = 0; i < MSR_BITMAP_SIZE; i++ )
+	{
+		count += __builtin_popcount( Guarded->Bitmap[i] );
+	}
+
+	return count;
+}
+
+static
+BOOLEAN
+_IsBitSet(
+	_In_ CONST GUARDED_BITMAP* Guarded,
+	_In_ CONST UINT32 Quadrant,
+	_In_ CONST UINT32 Index
+	)
+{
+	return (Guarded->Bitmap[Quadrant + Index / 8] & (1 << (Index % 8))) != 0;
+}
+
+static
+VOID
+TestQuadrants()
+{
+	static CONST struct { UINT32 Msr; UINT32 ReadQuadrant; UINT32 WriteQuadrant; UINT32 Index; } msrs[] = {
+		{ 0x00000000, MSR_BITMAP_READ_LOW,  MSR_BITMAP_WRITE_LOW,  0x0000 },
+		{ 0x00001FFF, MSR_BITMAP_READ_LOW,  MSR_BITMAP_WRITE_LOW,  0x1FFF },
+		{ 0xC0000000, MSR_BITMAP_READ_HIGH, MSR_BITMAP_WRITE_HIGH, 0x0000 },
+		{ 0xC0001FFF, MSR_BITMAP_READ_HIGH, MSR_BITMAP_WRITE_HIGH, 0x1FFF },
+	};
+
+	GUARDED_BITMAP guarded;
+	ULONG i;
+
+	for ( i = 0; i < ARRAYSIZE( msrs ); i++ )
+	{
+		_Reset( &guarded );
+
+		TEST_CHECK( MsrBitmapIsCovered( msrs[i].Msr ) == TRUE );
+		TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, msrs[i].Msr ), 0 );
+
+		// Reads only: one bit, in the read quadrant
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i].Msr, MSR_INTERCEPT_READ, TRUE ) == TRUE );
+		TEST_CHECK_EQUAL( _CountBits( &guarded ), 1 );
+		TEST_CHECK( _IsBitSet( &guarded, msrs[i].ReadQuadrant, msrs[i].Index ) == TRUE );
+		TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, msrs[i].Msr ), MSR_INTERCEPT_READ );
+
+		// And writes: one more, in the write quadrant
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i].Msr, MSR_INTERCEPT_WRITE, TRUE ) == TRUE );
+		TEST_CHECK_EQUAL( _CountBits( &guarded ), 2 );
+		TEST_CHECK( _IsBitSet( &guarded, msrs[i].WriteQuadrant, msrs[i].Index ) == TRUE );
+		TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, msrs[i].Msr ), MSR_INTERCEPT_READ_WRITE );
+
+		// Clearing one leaves the other alone
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i].Msr, MSR_INTERCEPT_READ, FALSE ) == TRUE );
+		TEST_CHECK_EQUAL( _CountBits( &guarded ), 1 );
+		TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, msrs[i].Msr ), MSR_INTERCEPT_WRITE );
+
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i].Msr, MSR_INTERCEPT_READ_WRITE, FALSE ) == TRUE );
+		TEST_CHECK_EQUAL( _CountBits( &guarded ), 0 );
+	}
+}
+
+static
+VOID
+TestNotCovered()
+{
+	// Just past (or before) either covered range, and the very last MSR; these always exit, whatever the bitmap says
+	static CONST UINT32 msrs[] = { 0x00002000, 0xBFFFFFFF, 0xC0002000, 0xFFFFFFFF };
+
+	GUARDED_BITMAP guarded;
+	ULONG i;
+
+	_Reset( &guarded );
+
+	for ( i = 0; i < ARRAYSIZE( msrs ); i++ )
+	{
+		TEST_CHECK( MsrBitmapIsCovered( msrs[i] ) == FALSE );
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i], MSR_INTERCEPT_READ_WRITE, TRUE ) == FALSE );
+		TEST_CHECK( MsrBitmapSetIntercept( guarded.Bitmap, msrs[i], MSR_INTERCEPT_READ_WRITE, FALSE ) == FALSE );
+		TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, msrs[i] ), MSR_INTERCEPT_READ_WRITE );
+	}
+
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 0 );
+
+	// (Note: a bitmap with every bit set still says the same about these)
+	RtlFillMemory( guarded.Bitmap, MSR_BITMAP_SIZE, 0xFF );
+	TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, 0x00002000 ), MSR_INTERCEPT_READ_WRITE );
+}
+
+static
+VOID
+TestRange()
+{
+	GUARDED_BITMAP guarded;
+	ULONG i;
+
+	// All of the low range: the whole of the read quadrant, and nothing else
+	_Reset( &guarded );
+	TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, MSR_BITMAP_LOW_FIRST, MSR_BITMAP_LOW_LAST, MSR_INTERCEPT_READ, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 0x2000 );
+
+	for ( i = 0; i < 0x400; i++ )
+	{
+		TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_READ_LOW + i], 0xFF );
+	}
+
+	// All of the high range, for writes: up to the very last byte of the bitmap, and no further
+	_Reset( &guarded );
+	TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, MSR_BITMAP_HIGH_FIRST, MSR_BITMAP_HIGH_LAST, MSR_INTERCEPT_WRITE, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 0x2000 );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_WRITE_HIGH], 0xFF );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_SIZE - 1], 0xFF );
+
+	// A range ending on the last covered MSR of the low range, both accesses; it stops at the end of each quadrant
+	_Reset( &guarded );
+	TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, 0x1FF8, MSR_BITMAP_LOW_LAST, MSR_INTERCEPT_READ_WRITE, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 16 );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_READ_LOW + 0x3FF], 0xFF );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_WRITE_LOW + 0x3FF], 0xFF );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_READ_HIGH], 0 );
+	TEST_CHECK_EQUAL( guarded.Bitmap[MSR_BITMAP_WRITE_HIGH], 0 );
+
+	// Then stopping part of it, across a byte boundary
+	TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, 0x1FFC, 0x1FFD, MSR_INTERCEPT_READ, FALSE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 14 );
+	TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, 0x1FFB ), MSR_INTERCEPT_READ_WRITE );
+	TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, 0x1FFC ), MSR_INTERCEPT_WRITE );
+	TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, 0x1FFE ), MSR_INTERCEPT_READ_WRITE );
+
+	// A single MSR
+	_Reset( &guarded );
+	TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, 0xC0000080, 0xC0000080, MSR_INTERCEPT_READ, TRUE ) == TRUE );
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 1 );
+	TEST_CHECK_EQUAL( MsrBitmapGetIntercepts( guarded.Bitmap, 0xC0000080 ), MSR_INTERCEPT_READ );
+}
+
+static
+VOID
+TestRangeRejects()
+{
+	// Ranges that aren't entirely within one covered range change nothing at all, not even the part that is
+
+	static CONST struct { UINT32 First; UINT32 Last; } ranges[] = {
+		{ 0x00001FFE, 0x00002000 },		// Off the end of the low range
+		{ 0x00001FF0, 0xC0000010 },		// Across the gap, from one covered range into the other
+		{ 0xBFFFFFFF, 0xC0000001 },		// Into the high range from below
+		{ 0xC0001FFF, 0xC0002000 },		// Off the end of the high range
+		{ 0x00002000, 0xBFFFFFFF },		// Nothing but the gap
+		{ 0x00000000, 0xFFFFFFFF },		// Everything
+		{ 0x00000010, 0x0000000F },		// Backwards
+		{ 0xC0000001, 0xC0000000 },
+	};
+
+	GUARDED_BITMAP guarded;
+	ULONG i;
+
+	_Reset( &guarded );
+
+	for ( i = 0; i < ARRAYSIZE( ranges ); i++ )
+	{
+		TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, ranges[i].First, ranges[i].Last, MSR_INTERCEPT_READ_WRITE, TRUE ) == FALSE );
+	}
+
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), 0 );
+
+	// Nor does stopping them
+	RtlFillMemory( guarded.Bitmap, MSR_BITMAP_SIZE, 0xFF );
+
+	for ( i = 0; i < ARRAYSIZE( ranges ); i++ )
+	{
+		TEST_CHECK( MsrBitmapSetRangeIntercept( guarded.Bitmap, ranges[i].First, ranges[i].Last, MSR_INTERCEPT_READ_WRITE, FALSE ) == FALSE );
+	}
+
+	TEST_CHECK_EQUAL( _CountBits( &guarded ), MSR_BITMAP_SIZE * 8 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestQuadrants );
+	TEST_RUN( TestNotCovered );
+	TEST_RUN( TestRange );
+	TEST_RUN( TestRangeRejects );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,204 @@
+#include <string.h>
+
+#include "ProfileReport.h"
+#include "Test.h"
+
+/*
+ * The `profile` command of the SPTHvCtl tool, minus the IOCTLs: made-up tables from a few LPs are collected and merged
+ *  as the tool does, and the folded and flat lines it would print are checked as they are.
+ */
+
+static SPTHV_PROFILE_TABLE g_Tables[2];
+static SPTHV_PROFILE_ENTRY g_Entries[2 * SPTHV_PROFILE_TABLE_ENTRIES];
+
+static
+VOID
+_SetEntry(
+	_Inout_ PSPTHV_PROFILE_TABLE Table,
+	_In_ CONST ULONG Slot,
+	_In_ CONST UINT64 Cr3,
+	_In_ CONST ULONG Mode,
+	_In_ CONST UINT64 Rip,
+	_In_ CONST UINT64 Count
+	)
+{
+	Table->Entries[Slot].Cr3 = Cr3;
+	Table->Entries[Slot].Mode = Mode;
+	Table->Entries[Slot].Rip = Rip;
+	Table->Entries[Slot].Count = Count;
+
+	Table->Used++;
+	Table->Samples += Count;
+}
+
+static
+ULONG
+_CollectTables()
+{
+	/*
+	 * Two LPs that sampled some of the same places: the same RIP in the same address space and mode on both; the same
+	 *  RIP in another address space, and in another mode; and a few places only one of them saw.
+	 */
+
+	ULONG count = 0;
+
+	RtlZeroMemory( g_Tables, sizeof(g_Tables) );
+	RtlZeroMemory( g_Entries, sizeof(g_Entries) );
+
+	_SetEntry( &g_Tables[0], 7, 0x1AD000, 0, 0xFFFFF80012345678ULL, 40 );
+	_SetEntry( &g_Tables[0], 100, 0x1AD000, 0, 0xFFFFF80012340000ULL, 5 );
+	_SetEntry( &g_Tables[0], SPTHV_PROFILE_TABLE_ENTRIES - 1, 0x7654000, 3, 0x7FF612340000ULL, 25 );
+
+	_SetEntry( &g_Tables[1], 0, 0x1AD000, 0, 0xFFFFF80012345678ULL, 2 );
+	_SetEntry( &g_Tables[1], 9, 0x7654000, 0, 0xFFFFF80012345678ULL, 3 );
+	_SetEntry( &g_Tables[1], 3000, 0x7654000, 3 | SPTHV_PROFILE_MODE_COMPATIBILITY, 0x401000, 25 );
+	_SetEntry( &g_Tables[1], 4000, 0x7654000, 3, 0x7FF612340000ULL, 100 );
+
+	count = ProfileAddTable( g_Entries, count, &g_Tables[0] );
+	TEST_CHECK_EQUAL( count, 3 );
+
+	count = ProfileAddTable( g_Entries, count, &g_Tables[1] );
+	TEST_CHECK_EQUAL( count, 7 );
+
+	return count;
+}
+
+static
+VOID
+TestAddTable()
+{
+	ULONG count = _CollectTables();
+
+	// Only the entries in use, in slot order, after whatever was already there
+	TEST_CHECK_EQUAL( g_Entries[0].Count, 40 );
+	TEST_CHECK_EQUAL( g_Entries[2].Rip, 0x7FF612340000ULL );
+	TEST_CHECK_EQUAL( g_Entries[3].Count, 2 );
+	TEST_CHECK_EQUAL( g_Entries[6].Count, 100 );
+	TEST_CHECK_EQUAL( g_Entries[count].Count, 0 );
+
+	// An empty table adds nothing
+	RtlZeroMemory( &g_Tables[0], sizeof(g_Tables[0]) );
+	TEST_CHECK_EQUAL( ProfileAddTable( g_Entries, count, &g_Tables[0] ), count );
+}
+
+static
+VOID
+TestMerge()
+{
+	ULONG count = _CollectTables();
+	UINT64 total = 0;
+	ULONG i;
+
+	count = ProfileMergeEntries( g_Entries, count );
+
+	// Only the exact same place (address space, mode and RIP) on both LPs is folded together
+	TEST_CHECK_EQUAL( count, 5 );
+
+	// In key order: by CR3, then mode, then RIP
+	TEST_CHECK_EQUAL( g_Entries[0].Cr3, 0x1AD000 );
+	TEST_CHECK_EQUAL( g_Entries[0].Rip, 0xFFFFF80012340000ULL );
+	TEST_CHECK_EQUAL( g_Entries[0].Count, 5 );
+
+	TEST_CHECK_EQUAL( g_Entries[1].Rip, 0xFFFFF80012345678ULL );
+	TEST_CHECK_EQUAL( g_Entries[1].Count, 42 );
+
+	TEST_CHECK_EQUAL( g_Entries[2].Cr3, 0x7654000 );
+	TEST_CHECK_EQUAL( g_Entries[2].Mode, 0 );
+	TEST_CHECK_EQUAL( g_Entries[2].Count, 3 );
+
+	TEST_CHECK_EQUAL( g_Entries[3].Mode, 3 );
+	TEST_CHECK_EQUAL( g_Entries[3].Count, 125 );
+
+	TEST_CHECK_EQUAL( g_Entries[4].Mode, 3 | SPTHV_PROFILE_MODE_COMPATIBILITY );
+	TEST_CHECK_EQUAL( g_Entries[4].Count, 25 );
+
+	// Not a sample gained or lost
+	for ( i = 0; i < count; i++ )
+	{
+		total += g_Entries[i].Count;
+	}
+
+	TEST_CHECK_EQUAL( total, g_Tables[0].Samples + g_Tables[1].Samples );
+
+	// Nothing, or one entry
+	TEST_CHECK_EQUAL( ProfileMergeEntries( g_Entries, 0 ), 0 );
+	TEST_CHECK_EQUAL( ProfileMergeEntries( g_Entries, 1 ), 1 );
+}
+
+static
+VOID
+TestSortByCount()
+{
+	ULONG count = ProfileMergeEntries( g_Entries, _CollectTables() );
+
+	ProfileSortByCount( g_Entries, count );
+
+	TEST_CHECK_EQUAL( g_Entries[0].Count, 125 );
+	TEST_CHECK_EQUAL( g_Entries[1].Count, 42 );
+	TEST_CHECK_EQUAL( g_Entries[2].Count, 25 );
+	TEST_CHECK_EQUAL( g_Entries[3].Count, 5 );
+	TEST_CHECK_EQUAL( g_Entries[4].Count, 3 );
+
+	// Ties come out in key order
+	g_Entries[3].Count = 25;
+	ProfileSortByCount( g_Entries, count );
+
+	TEST_CHECK_EQUAL( g_Entries[2].Count, 25 );
+	TEST_CHECK_EQUAL( g_Entries[2].Cr3, 0x1AD000 );
+	TEST_CHECK_EQUAL( g_Entries[3].Cr3, 0x7654000 );
+}
+
+static
+VOID
+TestFormat()
+{
+	SPTHV_PROFILE_ENTRY entry;
+	CHAR line[PROFILE_REPORT_LINE_LENGTH];
+
+	TEST_CHECK( strcmp( ProfileModeName( 0 ), "kernel" ) == 0 );
+	TEST_CHECK( strcmp( ProfileModeName( 0 | SPTHV_PROFILE_MODE_COMPATIBILITY ), "kernel" ) == 0 );
+	TEST_CHECK( strcmp( ProfileModeName( 3 ), "user" ) == 0 );
+	TEST_CHECK( strcmp( ProfileModeName( 3 | SPTHV_PROFILE_MODE_COMPATIBILITY ), "user32" ) == 0 );
+
+	RtlZeroMemory( &entry, sizeof(entry) );
+	entry.Cr3 = 0x1AD000;
+	entry.Mode = 0;
+	entry.Rip = 0xFFFFF80012345678ULL;
+	entry.Count = 42;
+
+	ProfileFormatFolded( line, &entry );
+	TEST_CHECK( strcmp( line, "cr3-1ad000;kernel;fffff80012345678 42" ) == 0 );
+
+	entry.Mode = 3;
+	entry.Count = 25;
+
+	ProfileFormatFlat( line, &entry, 200 );
+	TEST_CHECK( strcmp( line, "          25  12.50% user                1ad000   fffff80012345678" ) == 0 );
+
+	// No samples at all is 0%, not a division by zero
+	ProfileFormatFlat( line, &entry, 0 );
+	TEST_CHECK( strcmp( line, "          25   0.00% user                1ad000   fffff80012345678" ) == 0 );
+
+	// The longest line there can be still fits
+	entry.Cr3 = ~0ULL;
+	entry.Rip = ~0ULL;
+	entry.Count = ~0ULL;
+	entry.Mode = 3 | SPTHV_PROFILE_MODE_COMPATIBILITY;
+
+	ProfileFormatFolded( line, &entry );
+	TEST_CHECK( strcmp( line, "cr3-ffffffffffffffff;user32;ffffffffffffffff 18446744073709551615" ) == 0 );
+
+	ProfileFormatFlat( line, &entry, 1 );
+	TEST_CHECK( strlen( line ) < PROFILE_REPORT_LINE_LENGTH - 1 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestAddTable );
+	TEST_RUN( TestMerge );
+	TEST_RUN( TestSortByCount );
+	TEST_RUN( TestFormat );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,172 @@
+#include "Seg.h"
+#include "Test.h"
+
+/*
+ * SegDecodeGDT and SegLookup against synthetic GDTs: the descriptors Windows x64 actually has, and the ones it
+ *  doesn't but a GDT may (LDTs, call gates, non-present segments, and a system descriptor cut off by the limit).
+ */
+
+// [3.4.5] "Segment Descriptors"; indexed by selector index
+static CONST UINT64 g_GDT[] = {
+	0xFFFFFFFFFFFFFFFFULL,				// 0x00: null (whatever is in it)
+	0x00CF9B000000FFFFULL,				// 0x08: ring 0, 32-bit code, 4GB
+	0x00209B0000000000ULL,				// 0x10: ring 0, 64-bit code
+	0x00CF93000000FFFFULL,				// 0x18: ring 0, data, 4GB
+	0x00CFF3000000FFFFULL,				// 0x20: ring 3, data, 4GB
+	0x0040F30000003C00ULL,				// 0x28: ring 3, data, byte granular
+	0xAB008B1234560067ULL,				// 0x30: busy TSS...
+	0x00000000FFFFF803ULL,				// 0x38: ...upper half
+	0xCD0082ABCDEF0FFFULL,				// 0x40: LDT...
+	0x00000000FFFFE000ULL,				// 0x48: ...upper half
+	0x00008C0010001234ULL,				// 0x50: 64-bit call gate (selector 0x10, offset 0x1234)...
+	0x00000000FFFFF804ULL,				// 0x58: ...upper half
+	0x00CF13000000FFFFULL,				// 0x60: ring 0, data, not present
+	0x00008B2000000067ULL				// 0x68: available TSS, whose upper half is past the limit
+};
+
+static
+VOID
+TestDecodeCodeAndData()
+{
+	SEGMENT_INFO table[SEGMENT_TABLE_MAX_ENTRIES];
+	ULONG count;
+
+	RtlFillMemory( table, sizeof(table), 0xCC );
+	count = SegDecodeGDT( g_GDT, sizeof(g_GDT) - 1, table, SEGMENT_TABLE_MAX_ENTRIES );
+
+	TEST_CHECK_EQUAL( count, ARRAYSIZE( g_GDT ) );
+
+	// The null descriptor's contents don't matter; it's always unusable
+	TEST_CHECK_EQUAL( table[0].Base, 0 );
+	TEST_CHECK_EQUAL( table[0].AccessRights.All, 0x10000 );
+
+	// Page granular: the limit is scaled up, with the low 12 bits set
+	TEST_CHECK_EQUAL( table[1].Limit, 0xFFFFFFFF );
+	TEST_CHECK_EQUAL( table[1].AccessRights.All, 0xC09B );
+
+	// The L bit lands in bit 13; the upper limit bits don't land in bits 8-11
+	TEST_CHECK_EQUAL( table[2].AccessRights.All, 0x209B );
+	TEST_CHECK_EQUAL( table[2].AccessRights.LongModeCS, 1 );
+	TEST_CHECK_EQUAL( table[3].AccessRights.Reserved0, 0 );
+
+	TEST_CHECK_EQUAL( table[4].AccessRights.DPL, 3 );
+
+	// Byte granular
+	TEST_CHECK_EQUAL( table[5].Limit, 0x3C00 );
+	TEST_CHECK_EQUAL( table[5].AccessRights.Granularity, 0 );
+
+	// Not present, so it can't be in a segment register
+	TEST_CHECK_EQUAL( table[12].AccessRights.Unusable, 1 );
+	TEST_CHECK_EQUAL( table[12].AccessRights.Present, 0 );
+}
+
+static
+VOID
+TestDecodeSystemDescriptors()
+{
+	SEGMENT_INFO table[SEGMENT_TABLE_MAX_ENTRIES];
+	ULONG count;
+
+	count = SegDecodeGDT( g_GDT, sizeof(g_GDT) - 1, table, SEGMENT_TABLE_MAX_ENTRIES );
+
+	TEST_CHECK_EQUAL( count, ARRAYSIZE( g_GDT ) );
+
+	// A TSS's base is 64 bits, over both halves of its descriptor; the upper half is no descriptor at all
+	TEST_CHECK_EQUAL( table[6].Base, 0xFFFFF803AB123456ULL );
+	TEST_CHECK_EQUAL( table[6].Limit, 0x67 );
+	TEST_CHECK_EQUAL( table[6].AccessRights.All, 0x8B );
+	TEST_CHECK_EQUAL( table[7].Base, 0 );
+	TEST_CHECK_EQUAL( table[7].AccessRights.All, 0x10000 );
+
+	// So is an LDT's
+	TEST_CHECK_EQUAL( table[8].Base, 0xFFFFE000CDABCDEFULL );
+	TEST_CHECK_EQUAL( table[8].Limit, 0xFFF );
+	TEST_CHECK_EQUAL( table[8].AccessRights.SegType, SYS_SEG_DESC_TYPE_LDT );
+	TEST_CHECK_EQUAL( table[9].AccessRights.Unusable, 1 );
+
+	// A call gate holds an entry point, not a base; but its upper half is still skipped
+	TEST_CHECK_EQUAL( table[10].Base >> 32, 0 );
+	TEST_CHECK_EQUAL( table[11].AccessRights.Unusable, 1 );
+	TEST_CHECK_EQUAL( table[11].Base, 0 );
+
+	// A system descriptor with no room for its upper half can't be loaded
+	TEST_CHECK_EQUAL( table[13].AccessRights.Unusable, 1 );
+	TEST_CHECK_EQUAL( table[13].Base, 0x200000 );
+}
+
+static
+VOID
+TestDecodeBounds()
+{
+	SEGMENT_INFO table[SEGMENT_TABLE_MAX_ENTRIES];
+	ULONG count;
+
+	// The limit is the last byte in the GDT, not its size
+	count = SegDecodeGDT( g_GDT, 4 * sizeof(UINT64) - 1, table, SEGMENT_TABLE_MAX_ENTRIES );
+	TEST_CHECK_EQUAL( count, 4 );
+
+	// A limit that isn't a multiple of 8 bytes (less one) leaves the partial descriptor out
+	count = SegDecodeGDT( g_GDT, 4 * sizeof(UINT64) + 3, table, SEGMENT_TABLE_MAX_ENTRIES );
+	TEST_CHECK_EQUAL( count, 4 );
+
+	// The table we're given is full before the GDT ends
+	count = SegDecodeGDT( g_GDT, sizeof(g_GDT) - 1, table, 3 );
+	TEST_CHECK_EQUAL( count, 3 );
+
+	// A TSS in the last slot of the table keeps its (whole) base, even though there's nowhere to put its upper half
+	RtlFillMemory( table, sizeof(table), 0xCC );
+	count = SegDecodeGDT( g_GDT, sizeof(g_GDT) - 1, table, 7 );
+	TEST_CHECK_EQUAL( count, 7 );
+	TEST_CHECK_EQUAL( table[6].Base, 0xFFFFF803AB123456ULL );
+	TEST_CHECK_EQUAL( table[6].AccessRights.Unusable, 0 );
+
+	// Nothing but the null descriptor
+	count = SegDecodeGDT( g_GDT, sizeof(UINT64) - 1, table, SEGMENT_TABLE_MAX_ENTRIES );
+	TEST_CHECK_EQUAL( count, 1 );
+	TEST_CHECK_EQUAL( table[0].AccessRights.Unusable, 1 );
+}
+
+static
+VOID
+TestLookup()
+{
+	SEGMENT_INFO table[SEGMENT_TABLE_MAX_ENTRIES];
+	SEGMENT_INFO info;
+	ULONG count;
+
+	count = SegDecodeGDT( g_GDT, sizeof(g_GDT) - 1, table, SEGMENT_TABLE_MAX_ENTRIES );
+
+	// The RPL doesn't change which descriptor a selector picks
+	SegLookup( table, count, 0x23, &info );
+	TEST_CHECK_EQUAL( info.AccessRights.All, table[4].AccessRights.All );
+	TEST_CHECK_EQUAL( info.Limit, 0xFFFFFFFF );
+
+	SegLookup( table, count, 0x30, &info );
+	TEST_CHECK_EQUAL( info.Base, 0xFFFFF803AB123456ULL );
+
+	// Null selectors (with any RPL), LDT selectors, and selectors past the end of the table are unusable
+	SegLookup( table, count, 0x0, &info );
+	TEST_CHECK_EQUAL( info.AccessRights.All, 0x10000 );
+
+	SegLookup( table, count, 0x3, &info );
+	TEST_CHECK_EQUAL( info.AccessRights.All, 0x10000 );
+
+	SegLookup( table, count, 0x18 | 0x4, &info );
+	TEST_CHECK_EQUAL( info.AccessRights.All, 0x10000 );
+	TEST_CHECK_EQUAL( info.Base, 0 );
+
+	SegLookup( table, count, (UINT16)(count << 3), &info );
+	TEST_CHECK_EQUAL( info.AccessRights.All, 0x10000 );
+	TEST_CHECK_EQUAL( info.Limit, 0 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestDecodeCodeAndData );
+	TEST_RUN( TestDecodeSystemDescriptors );
+	TEST_RUN( TestDecodeBounds );
+	TEST_RUN( TestLookup );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,313 @@
+#include "State.h"
+#include "Test.h"
+
+/*
+ * StateCapture, against a Windows x64-style GDT (see `dg 0 7f` on a real one) and fake control/segment registers and
+ *  MSRs; then StateBuildVMCSFields on what it captured, and StateCommitVMCSFields into a fake VMWRITE which records
+ *  what was written (and can be made to fail part way through, as VMWRITE does on an unsupported field).
+ */
+
+extern CONST VMCS_FIELD_DESCRIPTOR g_VMCSStateFields[STATE_VMCS_FIELD_COUNT];
+
+#define FAKE_TSS_BASE					0xFFFFF80312345678ULL
+#define FAKE_IDT_BASE					0xFFFFF80300001000ULL
+#define FAKE_FS_BASE					0x000000D3A6F3B000ULL
+#define FAKE_GS_BASE					0xFFFFF80300250000ULL
+
+// [3.4.5] "Segment Descriptors"; indexed by selector index
+static CONST UINT64 g_FakeGDT[] = {
+	0,									// 0x00: null
+	0x00CF9B000000FFFFULL,				// 0x08: ring 0, 32-bit code
+	0x00209B0000000000ULL,				// 0x10: ring 0, 64-bit code
+	0x00CF93000000FFFFULL,				// 0x18: ring 0, data
+	0x00CFFB000000FFFFULL,				// 0x20: ring 3, 32-bit code
+	0x00CFF3000000FFFFULL,				// 0x28: ring 3, data
+	0x0020FB0000000000ULL,				// 0x30: ring 3, 64-bit code
+	0,									// 0x38
+	0x12008B3456780067ULL,				// 0x40: busy TSS (bits 0-31 of its base)...
+	0x00000000FFFFF803ULL,				// 0x48: ...and bits 32-63
+	0x0040F30000003C00ULL				// 0x50: ring 3, data (the 32-bit TEB)
+};
+
+static SIZE_T g_WrittenFields[STATE_VMCS_FIELD_COUNT];
+static SIZE_T g_WrittenValues[STATE_VMCS_FIELD_COUNT];
+static ULONG g_WriteCount;
+
+// The field VMWRITE fails on; ~0 for none
+static SIZE_T g_FailField = ~(SIZE_T)0;
+
+UINT64 __readcr0( VOID ) { return 0x80050033; }
+UINT64 __readcr3( VOID ) { return 0x1AD000; }
+UINT64 __readcr4( VOID ) { return 0x3506F8; }
+UINT64 __readdr( UINT Register ) { return (Register == 7) ? 0x400 : 0; }
+
+UINT16 __reades() { return 0x2B; }
+UINT16 __readcs() { return 0x10; }
+UINT16 __readss() { return 0x18; }
+UINT16 __readds() { return 0x2B; }
+UINT16 __readfs() { return 0x53; }
+UINT16 __readgs() { return 0x2B; }
+UINT16 __readldtr() { return 0; }
+UINT16 __readtr() { return 0x40; }
+
+void
+__sgdt(
+	_Inout_ PSYSTEM_TABLE_REGISTER pGDTR
+	)
+{
+	pGDTR->Base = (UINT64)(ULONG_PTR)g_FakeGDT;
+	pGDTR->Limit = sizeof(g_FakeGDT) - 1;
+}
+
+VOID
+__sidt(
+	_In_ PVOID Destination
+	)
+{
+	((PSYSTEM_TABLE_REGISTER)Destination)->Base = FAKE_IDT_BASE;
+	((PSYSTEM_TABLE_REGISTER)Destination)->Limit = 0xFFF;
+}
+
+UINT64
+__readmsr(
+	_In_ ULONG Register
+	)
+{
+	switch ( Register )
+	{
+		case IA32_FS_BASE:		return FAKE_FS_BASE;
+		case IA32_GS_BASE:		return FAKE_GS_BASE;
+		case IA32_DEBUGCTL:		return 0x1;
+		case IA32_SYSENTER_CS:	return 0x10;
+		case IA32_SYSENTER_ESP:	return 0xFFFFF80300300000ULL;
+		case IA32_SYSENTER_EIP:	return 0xFFFFF80300400000ULL;
+		default:				return 0;
+	}
+}
+
+UCHAR
+__vmx_vmwrite(
+	_In_ SIZE_T Field,
+	_In_ SIZE_T Value
+	)
+{
+	if ( Field == g_FailField )
+	{
+		return VMX_ERROR_STATUS;
+	}
+
+	if ( g_WriteCount < STATE_VMCS_FIELD_COUNT )
+	{
+		g_WrittenFields[g_WriteCount] = Field;
+		g_WrittenValues[g_WriteCount] = Value;
+	}
+
+	g_WriteCount++;
+
+	return VMX_OK;
+}
+
+static
+UINT64
+_FieldValue(
+	_In_reads_(Count) CONST VMCS_FIELD_VALUE* Fields,
+	_In_ CONST ULONG Count,
+	_In_ CONST UINT64 Encoding
+	)
+{
+	ULONG i;
+
+	for ( i = 0; i < Count; i++ )
+	{
+		if ( Fields[i].Encoding == Encoding )
+		{
+			return Fields[i].Value;
+		}
+	}
+
+	TEST_CHECK( !"field not built" );
+	return 0;
+}
+
+static
+VOID
+TestCapture()
+{
+	CPU_STATE state;
+
+	StateCapture( &state );
+
+	TEST_CHECK_EQUAL( state.CR0, 0x80050033 );
+	TEST_CHECK_EQUAL( state.CR3, 0x1AD000 );
+	TEST_CHECK_EQUAL( state.CR4, 0x3506F8 );
+	TEST_CHECK_EQUAL( state.DR7, 0x400 );
+
+	// (Note: the real RFLAGS; bit 1 is always set)
+	TEST_CHECK( (state.RFLAGS & 0x2) != 0 );
+
+	TEST_CHECK_EQUAL( state.GDTR.Limit, sizeof(g_FakeGDT) - 1 );
+	TEST_CHECK_EQUAL( state.IDTR.Base, FAKE_IDT_BASE );
+
+	// 64-bit code: the limit is ignored, but still decoded the way LSL would
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_CS].Selector, 0x10 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_CS].Base, 0 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_CS].Limit, 0 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_CS].AccessRights.All, 0x209B );
+
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_SS].Limit, 0xFFFFFFFF );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_SS].AccessRights.All, 0xC093 );
+
+	// The RPL doesn't change which descriptor a selector picks
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_DS].AccessRights.All, 0xC0F3 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_ES].AccessRights.All, 0xC0F3 );
+
+	// FS and GS come from the MSRs, not their (32-bit) descriptor bases
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_FS].Base, FAKE_FS_BASE );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_FS].Limit, 0x3C00 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_GS].Base, FAKE_GS_BASE );
+
+	// The TSS is a 16-byte descriptor with a 64-bit base
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_TR].Base, FAKE_TSS_BASE );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_TR].Limit, 0x67 );
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_TR].AccessRights.All, 0x8B );
+
+	// A null LDTR is unusable
+	TEST_CHECK_EQUAL( state.Segments[SEGMENT_LDTR].AccessRights.All, 0x10000 );
+
+	TEST_CHECK_EQUAL( state.SysenterESP, 0xFFFFF80300300000ULL );
+	TEST_CHECK_EQUAL( state.DebugCtl, 0x1 );
+}
+
+static
+VOID
+TestFieldTable()
+{
+	// Every field is programmed once, from a member no wider than the field ([Appendix B] "Field Encoding in VMCS")
+
+	ULONG i, j, width;
+
+	for ( i = 0; i < STATE_VMCS_FIELD_COUNT; i++ )
+	{
+		// (Note: the "high" half of a 64-bit field is never written on its own)
+		TEST_CHECK_EQUAL( g_VMCSStateFields[i].Encoding & 0x1, 0 );
+
+		switch ( (g_VMCSStateFields[i].Encoding >> 13) & 0x3 )
+		{
+			case 0:		width = sizeof(UINT16); break;
+			case 2:		width = sizeof(UINT32); break;
+			default:	width = sizeof(UINT64); break;
+		}
+
+		// The 32-bit SYSENTER_CS field is read from its (64-bit) MSR, which only ever holds a selector
+		if ( g_VMCSStateFields[i].Encoding != VMCS_GUEST_IA32_SYSENTER_CS && g_VMCSStateFields[i].Encoding != VMCS_HOST_IA32_SYSENTER_CS )
+		{
+			TEST_CHECK( g_VMCSStateFields[i].Size <= width );
+		}
+
+		TEST_CHECK( g_VMCSStateFields[i].Offset + g_VMCSStateFields[i].Size <= sizeof(CPU_STATE) );
+
+		for ( j = i + 1; j < STATE_VMCS_FIELD_COUNT; j++ )
+		{
+			TEST_CHECK( g_VMCSStateFields[i].Encoding != g_VMCSStateFields[j].Encoding );
+		}
+	}
+}
+
+static
+VOID
+TestBuild()
+{
+	CPU_STATE state;
+	VMCS_FIELD_VALUE fields[STATE_VMCS_FIELD_COUNT];
+	ULONG count;
+
+	StateCapture( &state );
+
+	state.HostCR3 = 0x1AE000;
+	state.HostRSP = 0xFFFFB00000006FF0ULL;
+	state.HostRIP = 0xFFFFF80400001000ULL;
+
+	RtlFillMemory( fields, sizeof(fields), 0xCC );
+	count = StateBuildVMCSFields( &state, fields );
+
+	TEST_CHECK_EQUAL( count, STATE_VMCS_FIELD_COUNT );
+
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_CR3 ), 0x1AD000 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_CR3 ), 0x1AE000 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_CR0 ), 0x80050033 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_RSP ), 0xFFFFB00000006FF0ULL );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_RIP ), 0xFFFFF80400001000ULL );
+
+	// Narrow members aren't padded out with whatever follows them
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_GDTR_LIMIT ), sizeof(g_FakeGDT) - 1 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_IDTR_LIMIT ), 0xFFF );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_CS_ACCESS_RIGHTS ), 0x209B );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_TR_LIMIT ), 0x67 );
+
+	// The guest keeps its RPL; the host's is cleared ([26.2.3] "Checks on Host Segment and Descriptor-Table Registers")
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_DS_SELECTOR ), 0x2B );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_DS_SELECTOR ), 0x28 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_FS_SELECTOR ), 0x53 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_FS_SELECTOR ), 0x50 );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_TR_SELECTOR ), 0x40 );
+
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_TR_BASE ), FAKE_TSS_BASE );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_FS_BASE ), FAKE_FS_BASE );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_HOST_GS_BASE ), FAKE_GS_BASE );
+	TEST_CHECK_EQUAL( _FieldValue( fields, count, VMCS_GUEST_LDTR_ACCESS_RIGHTS ), 0x10000 );
+}
+
+static
+VOID
+TestCommit()
+{
+	CPU_STATE state;
+	VMCS_FIELD_VALUE fields[STATE_VMCS_FIELD_COUNT];
+	ULONG count, failedIndex, i;
+
+	StateCapture( &state );
+	count = StateBuildVMCSFields( &state, fields );
+
+	// Everything is written, in table order
+	g_WriteCount = 0;
+	g_FailField = ~(SIZE_T)0;
+	failedIndex = (ULONG)-1;
+
+	TEST_CHECK_EQUAL( StateCommitVMCSFields( fields, count, &failedIndex ), VMX_OK );
+	TEST_CHECK_EQUAL( g_WriteCount, count );
+	TEST_CHECK_EQUAL( failedIndex, (ULONG)-1 );
+
+	for ( i = 0; i < count; i++ )
+	{
+		TEST_CHECK_EQUAL( g_WrittenFields[i], fields[i].Encoding );
+		TEST_CHECK_EQUAL( g_WrittenValues[i], fields[i].Value );
+	}
+
+	// The first field VMWRITE rejects stops the commit, and is reported
+	g_WriteCount = 0;
+	g_FailField = VMCS_HOST_TR_SELECTOR;
+
+	TEST_CHECK_EQUAL( StateCommitVMCSFields( fields, count, &failedIndex ), VMX_ERROR_STATUS );
+	TEST_CHECK_EQUAL( fields[failedIndex].Encoding, VMCS_HOST_TR_SELECTOR );
+	TEST_CHECK_EQUAL( g_WriteCount, failedIndex );
+
+	// Without anywhere to report it
+	g_WriteCount = 0;
+
+	TEST_CHECK_EQUAL( StateCommitVMCSFields( fields, count, NULL ), VMX_ERROR_STATUS );
+	TEST_CHECK_EQUAL( g_WriteCount, failedIndex );
+
+	// Nothing to write
+	TEST_CHECK_EQUAL( StateCommitVMCSFields( fields, 0, NULL ), VMX_OK );
+}
+
+int
+main()
+{
+	TEST_RUN( TestCapture );
+	TEST_RUN( TestFieldTable );
+	TEST_RUN( TestBuild );
+	TEST_RUN( TestCommit );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,396 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Stats.h"
+#include "Test.h"
+
+/*
+ * The benchmark suite's aggregation (see BenchRunExitSuite in "Bench.c"): StatsSortSamples against qsort, and
+ *  StatsPercentile and StatsSummarize against distributions whose nearest-rank percentiles are known, including
+ *  the single interrupted sample the P99 is there to leave out.
+ *
+ * The exit counters (see _DeviceQueryExitStats in "Device.c"): StatsRecordExit into each LP's EXIT_STATS, and
+ *  StatsMergeExits into a snapshot, both on their own and with a thread per LP counting while snapshots are taken.
+ */
+
+#define SNAPSHOT_EXITS			200000		// Recorded by each LP
+
+static
+int
+_CompareSamples(
+	CONST VOID* A,
+	CONST VOID* B
+	)
+{
+	UINT64 a = *(CONST UINT64*)A, b = *(CONST UINT64*)B;
+
+	return (a > b) - (a < b);
+}
+
+static
+VOID
+TestSort()
+{
+	static UINT64 samples[1001], expected[1001];
+	SIZE_T counts[] = { 0, 1, 2, 3, 64, 1000, 1001 };
+	ULONG i, j;
+
+	srand( 1 );
+
+	for ( i = 0; i < ARRAYSIZE( counts ); i++ )
+	{
+		for ( j = 0; j < counts[i]; j++ )
+		{
+			// Plenty of duplicates, and values past 32 bits
+			samples[j] = ((UINT64)(rand() % 50) << 33) | (rand() % 4);
+		}
+
+		memcpy( expected, samples, counts[i] * sizeof(UINT64) );
+		qsort( expected, counts[i], sizeof(UINT64), _CompareSamples );
+
+		StatsSortSamples( samples, counts[i] );
+		TEST_CHECK( memcmp( samples, expected, counts[i] * sizeof(UINT64) ) == 0 );
+	}
+
+	// Backwards, already sorted, and all the same
+	for ( j = 0; j < 1000; j++ )
+	{
+		samples[j] = 1000 - j;
+	}
+
+	StatsSortSamples( samples, 1000 );
+
+	for ( j = 0; j < 1000; j++ )
+	{
+		TEST_CHECK_EQUAL( samples[j], j + 1 );
+	}
+
+	StatsSortSamples( samples, 1000 );
+	TEST_CHECK_EQUAL( samples[0], 1 );
+	TEST_CHECK_EQUAL( samples[999], 1000 );
+
+	for ( j = 0; j < 1000; j++ )
+	{
+		samples[j] = 7;
+	}
+
+	StatsSortSamples( samples, 1000 );
+	TEST_CHECK_EQUAL( samples[0], 7 );
+	TEST_CHECK_EQUAL( samples[999], 7 );
+}
+
+static
+VOID
+TestPercentile()
+{
+	static UINT64 samples[1000];
+	UINT64 three[] = { 10, 20, 30 };
+	ULONG i;
+
+	for ( i = 0; i < 1000; i++ )
+	{
+		samples[i] = i + 1;
+	}
+
+	// Nearest rank: ceil(Count * Percentile / 100), counting from 1
+	TEST_CHECK_EQUAL( StatsPercentile( samples, 100, 50 ), 50 );
+	TEST_CHECK_EQUAL( StatsPercentile( samples, 100, 99 ), 99 );
+	TEST_CHECK_EQUAL( StatsPercentile( samples, 1000, 99 ), 990 );
+	TEST_CHECK_EQUAL( StatsPercentile( samples, 1000, 50 ), 500 );
+	TEST_CHECK_EQUAL( StatsPercentile( samples, 1000, 100 ), 1000 );
+
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 50 ), 20 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 34 ), 20 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 33 ), 10 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 99 ), 30 );
+
+	// The ends: 0% is the smallest sample, and anything past 100% the largest
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 0 ), 10 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 3, 250 ), 30 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 1, 99 ), 10 );
+	TEST_CHECK_EQUAL( StatsPercentile( three, 0, 50 ), 0 );
+}
+
+static
+VOID
+TestSummarize()
+{
+	static UINT64 samples[1000];
+	UINT64 five[] = { 500, 100, 400, 200, 300 };
+	UINT64 two[] = { 3, 2 };
+	SPTHV_LATENCY_SUMMARY summary;
+	ULONG i;
+
+	RtlFillMemory( &summary, sizeof(summary), 0xCC );
+	StatsSummarize( five, ARRAYSIZE( five ), &summary );
+
+	TEST_CHECK_EQUAL( summary.Count, 5 );
+	TEST_CHECK_EQUAL( summary.Min, 100 );
+	TEST_CHECK_EQUAL( summary.Median, 300 );
+	TEST_CHECK_EQUAL( summary.P99, 500 );
+	TEST_CHECK_EQUAL( summary.Max, 500 );
+	TEST_CHECK_EQUAL( summary.Mean, 300 );
+
+	// The samples come back sorted
+	TEST_CHECK_EQUAL( five[0], 100 );
+	TEST_CHECK_EQUAL( five[4], 500 );
+
+	// The mean rounds down; the median of an even count is the lower of the middle two
+	StatsSummarize( two, ARRAYSIZE( two ), &summary );
+	TEST_CHECK_EQUAL( summary.Mean, 2 );
+	TEST_CHECK_EQUAL( summary.Median, 2 );
+
+	// One interrupt landing inside a sample shows up in the max and the mean, but not in the P99
+	for ( i = 0; i < 1000; i++ )
+	{
+		samples[i] = 1000 + (i % 10);
+	}
+
+	samples[417] = 5000000;
+
+	StatsSummarize( samples, 1000, &summary );
+	TEST_CHECK_EQUAL( summary.Min, 1000 );
+	TEST_CHECK_EQUAL( summary.Median, 1004 );
+	TEST_CHECK_EQUAL( summary.P99, 1009 );
+	TEST_CHECK_EQUAL( summary.Max, 5000000 );
+	TEST_CHECK_EQUAL( summary.Mean, (1004500 - 1007 + 5000000) / 1000 );
+
+	// Nothing to summarize; every field is zeroed
+	RtlFillMemory( &summary, sizeof(summary), 0xCC );
+	StatsSummarize( samples, 0, &summary );
+
+	TEST_CHECK_EQUAL( summary.Count, 0 );
+	TEST_CHECK_EQUAL( summary.Min, 0 );
+	TEST_CHECK_EQUAL( summary.Max, 0 );
+	TEST_CHECK_EQUAL( summary.Mean, 0 );
+}
+
+static
+VOID
+TestHistogramBucket()
+{
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 0 ), 0 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 1 ), 0 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 2 ), 1 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 3 ), 1 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 1023 ), 9 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 1024 ), 10 );
+
+	// Everything from 2^31 up shares the last bucket
+	TEST_CHECK_EQUAL( StatsHistogramBucket( (1ULL << (SPTHV_EXIT_HISTOGRAM_BUCKETS - 1)) - 1 ), SPTHV_EXIT_HISTOGRAM_BUCKETS - 2 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 1ULL << (SPTHV_EXIT_HISTOGRAM_BUCKETS - 1) ), SPTHV_EXIT_HISTOGRAM_BUCKETS - 1 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( 1ULL << SPTHV_EXIT_HISTOGRAM_BUCKETS ), SPTHV_EXIT_HISTOGRAM_BUCKETS - 1 );
+	TEST_CHECK_EQUAL( StatsHistogramBucket( ~0ULL ), SPTHV_EXIT_HISTOGRAM_BUCKETS - 1 );
+}
+
+static
+VOID
+TestRecordExit()
+{
+	// (Note: the second one is the next LP's, which nothing should ever write to)
+	static EXIT_STATS lps[2], untouched;
+	PEXIT_STATS stats = &lps[0];
+	CONST SPTHV_EXIT_REASON_STATS* cpuid = &stats->Reasons[10];
+
+	RtlZeroMemory( lps, sizeof(lps) );
+	RtlZeroMemory( &untouched, sizeof(untouched) );
+
+	StatsRecordExit( stats, 10, 700 );
+	StatsRecordExit( stats, 10, 300 );
+	StatsRecordExit( stats, 10, 5000 );
+	StatsRecordExit( stats, 10, 300 );
+
+	TEST_CHECK_EQUAL( cpuid->Count, 4 );
+	TEST_CHECK_EQUAL( cpuid->TotalCycles, 6300 );
+	TEST_CHECK_EQUAL( cpuid->MinCycles, 300 );
+	TEST_CHECK_EQUAL( cpuid->MaxCycles, 5000 );
+	TEST_CHECK_EQUAL( cpuid->Histogram[8], 2 );
+	TEST_CHECK_EQUAL( cpuid->Histogram[9], 1 );
+	TEST_CHECK_EQUAL( cpuid->Histogram[12], 1 );
+
+	// The first exit sets the minimum, even when it's larger than the (zeroed) one before it
+	StatsRecordExit( stats, 0, 40 );
+	TEST_CHECK_EQUAL( stats->Reasons[0].MinCycles, 40 );
+	TEST_CHECK_EQUAL( stats->Reasons[0].MaxCycles, 40 );
+
+	// A reason past the last one we know of is ignored, rather than written past the end
+	StatsRecordExit( stats, SPTHV_EXIT_REASON_COUNT, 1 );
+	StatsRecordExit( stats, ~0U, 1 );
+	TEST_CHECK_EQUAL( stats->Reasons[SPTHV_EXIT_REASON_COUNT - 1].Count, 0 );
+	TEST_CHECK( memcmp( &lps[1], &untouched, sizeof(untouched) ) == 0 );
+}
+
+static
+VOID
+TestMergeExits()
+{
+	static EXIT_STATS lps[3];
+	static SPTHV_EXIT_STATS snapshot;
+	CONST SPTHV_EXIT_REASON_STATS* merged = &snapshot.Reasons[48];
+	ULONG i, j;
+
+	RtlZeroMemory( lps, sizeof(lps) );
+	RtlZeroMemory( &snapshot, sizeof(snapshot) );
+
+	// LP 0 only ever took one kind of exit, LP 1 another as well, and LP 2 none at all
+	StatsRecordExit( &lps[0], 48, 900 );
+	StatsRecordExit( &lps[0], 48, 1100 );
+	StatsRecordExit( &lps[1], 48, 2000 );
+	StatsRecordExit( &lps[1], 48, 600 );
+	StatsRecordExit( &lps[1], 12, 100 );
+
+	// Merged in an order where the first LP with any 48s isn't the one with the smallest
+	StatsMergeExits( &snapshot, &lps[2] );
+	StatsMergeExits( &snapshot, &lps[0] );
+	StatsMergeExits( &snapshot, &lps[1] );
+
+	TEST_CHECK_EQUAL( snapshot.ProcessorCount, 3 );
+
+	TEST_CHECK_EQUAL( merged->Count, 4 );
+	TEST_CHECK_EQUAL( merged->TotalCycles, 4600 );
+	TEST_CHECK_EQUAL( merged->MinCycles, 600 );
+	TEST_CHECK_EQUAL( merged->MaxCycles, 2000 );
+	TEST_CHECK_EQUAL( merged->Histogram[9], 2 );
+	TEST_CHECK_EQUAL( merged->Histogram[10], 2 );
+
+	TEST_CHECK_EQUAL( snapshot.Reasons[12].Count, 1 );
+	TEST_CHECK_EQUAL( snapshot.Reasons[12].MinCycles, 100 );
+
+	// Nothing else picked anything up; in particular, no zero minimum from the LPs that never took the exit
+	for ( i = 0; i < SPTHV_EXIT_REASON_COUNT; i++ )
+	{
+		if ( i == 48 || i == 12 )
+		{
+			continue;
+		}
+
+		TEST_CHECK_EQUAL( snapshot.Reasons[i].Count, 0 );
+		TEST_CHECK_EQUAL( snapshot.Reasons[i].MinCycles, 0 );
+		TEST_CHECK_EQUAL( snapshot.Reasons[i].MaxCycles, 0 );
+
+		for ( j = 0; j < SPTHV_EXIT_HISTOGRAM_BUCKETS; j++ )
+		{
+			TEST_CHECK_EQUAL( snapshot.Reasons[i].Histogram[j], 0 );
+		}
+	}
+}
+
+typedef struct _FAKE_LP
+{
+	PEXIT_STATS Stats;
+	ULONG Index;
+	volatile LONG Done;
+} FAKE_LP, *PFAKE_LP;
+
+static
+PVOID
+_CountExits(
+	_In_ PVOID Argument
+	)
+{
+	// Two kinds of exit, at cycle counts that depend on the LP (so that the merged minimum and maximum are known)
+	PFAKE_LP lp = Argument;
+	ULONG i;
+
+	for ( i = 0; i < SNAPSHOT_EXITS; i++ )
+	{
+		StatsRecordExit( lp->Stats, 10, 100 + lp->Index + (i % 64) );
+		StatsRecordExit( lp->Stats, 30, 4000 );
+	}
+
+	InterlockedExchange( &lp->Done, TRUE );
+
+	return NULL;
+}
+
+static
+VOID
+TestSnapshotWhileCounting()
+{
+	/*
+	 * Snapshots taken while every LP is counting are only approximately consistent, but no counter in one may be
+	 *  behind the same counter in an earlier one; once every LP is done, the snapshot is exact.
+	 */
+
+	static SPTHV_EXIT_STATS snapshot, previous;
+	PEXIT_STATS stats;
+	PFAKE_LP lps;
+	pthread_t* threads;
+	ULONG count, i, done, snapshots = 0;
+
+	count = (ULONG)sysconf( _SC_NPROCESSORS_ONLN );
+	count = min( max( count, 2 ), 64 );
+
+	stats = aligned_alloc( SYSTEM_CACHE_ALIGNMENT_SIZE, count * sizeof(EXIT_STATS) );
+	lps = calloc( count, sizeof(FAKE_LP) );
+	threads = calloc( count, sizeof(pthread_t) );
+
+	RtlZeroMemory( stats, count * sizeof(EXIT_STATS) );
+	RtlZeroMemory( &previous, sizeof(previous) );
+
+	for ( i = 0; i < count; i++ )
+	{
+		lps[i].Stats = &stats[i];
+		lps[i].Index = i;
+		pthread_create( &threads[i], NULL, _CountExits, &lps[i] );
+	}
+
+	do
+	{
+		done = 0;
+
+		for ( i = 0; i < count; i++ )
+		{
+			done += (ReadAcquire( &lps[i].Done ) != FALSE);
+		}
+
+		RtlZeroMemory( &snapshot, sizeof(snapshot) );
+
+		for ( i = 0; i < count; i++ )
+		{
+			StatsMergeExits( &snapshot, &stats[i] );
+		}
+
+		TEST_CHECK_EQUAL( snapshot.ProcessorCount, count );
+		TEST_CHECK( snapshot.Reasons[10].Count >= previous.Reasons[10].Count );
+		TEST_CHECK( snapshot.Reasons[10].TotalCycles >= previous.Reasons[10].TotalCycles );
+		TEST_CHECK( snapshot.Reasons[30].Count >= previous.Reasons[30].Count );
+		TEST_CHECK( snapshot.Reasons[30].Histogram[11] >= previous.Reasons[30].Histogram[11] );
+
+		previous = snapshot;
+		snapshots++;
+	} while ( done < count );
+
+	for ( i = 0; i < count; i++ )
+	{
+		pthread_join( threads[i], NULL );
+	}
+
+	// Every LP was done before the last snapshot started
+	TEST_CHECK_EQUAL( snapshot.Reasons[10].Count, (UINT64)count * SNAPSHOT_EXITS );
+	TEST_CHECK_EQUAL( snapshot.Reasons[10].MinCycles, 100 );
+	TEST_CHECK_EQUAL( snapshot.Reasons[10].MaxCycles, 100 + (count - 1) + 63 );
+	TEST_CHECK_EQUAL( snapshot.Reasons[30].Count, (UINT64)count * SNAPSHOT_EXITS );
+	TEST_CHECK_EQUAL( snapshot.Reasons[30].TotalCycles, (UINT64)count * SNAPSHOT_EXITS * 4000 );
+	TEST_CHECK_EQUAL( snapshot.Reasons[30].Histogram[11], (UINT64)count * SNAPSHOT_EXITS );
+	TEST_CHECK( snapshots != 0 );
+
+	free( threads );
+	free( lps );
+	free( stats );
+}
+
+int
+main()
+{
+	TEST_RUN( TestSort );
+	TEST_RUN( TestPercentile );
+	TEST_RUN( TestSummarize );
+	TEST_RUN( TestHistogramBucket );
+	TEST_RUN( TestRecordExit );
+	TEST_RUN( TestMergeExits );
+	TEST_RUN( TestSnapshotWhileCounting );
+
+	return TEST_EXIT_CODE();
+}
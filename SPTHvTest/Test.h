@@ -0,0 +1,45 @@
+#ifndef __SPTHV_TEST_H__
+#define __SPTHV_TEST_H__
+
+#include <stdio.h>
+
+/*
+ * What every test program shares; each one is a main() that runs its tests with TEST_RUN, and exits with
+ *  TEST_EXIT_CODE() for ctest to pick up. A failed check is printed, and the test carries on.
+ */
+
+static ULONG g_TestFailures;
+
+#define TEST_CHECK(Expression)																\
+	do																						\
+	{																						\
+		if ( !(Expression) )																\
+		{																					\
+			fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Expression );	\
+			g_TestFailures++;																\
+		}																					\
+	} while ( 0 )
+
+#define TEST_CHECK_EQUAL(Actual, Expected)													\
+	do																						\
+	{																						\
+		UINT64 actual_ = (UINT64)(Actual), expected_ = (UINT64)(Expected);					\
+		if ( actual_ != expected_ )															\
+		{																					\
+			fprintf( stderr, "%s:%d: %s is 0x%llx, expected 0x%llx\n",						\
+				__FILE__, __LINE__, #Actual, (unsigned long long)actual_, (unsigned long long)expected_ );	\
+			g_TestFailures++;																\
+		}																					\
+	} while ( 0 )
+
+#define TEST_RUN(Test)																		\
+	do																						\
+	{																						\
+		ULONG failures_ = g_TestFailures;													\
+		Test();																				\
+		printf( "%s %s\n", (g_TestFailures == failures_) ? "PASS" : "FAIL", #Test );		\
+	} while ( 0 )
+
+#define TEST_EXIT_CODE()		((g_TestFailures == 0) ? 0 : 1)
+
+#endif // __SPTHV_TEST_H__
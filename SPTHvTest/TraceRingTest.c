@@ -0,0 +1,314 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "TraceRing.h"
+#include "Test.h"
+
+/*
+ * The trace ring protocol (see "SPTHvIoctl.h"), with TraceRingWrite on the producer side and TraceRingRead on the
+ *  reader's, as the driver and the SPTHvCtl tool use them. A thread per online CPU stands in for each LP's exit
+ *  handler, writing into its own ring as fast as it can, while a single reader drains every ring; every record that
+ *  comes out has to be one that went in, whole and in order, and every one that didn't has to be counted as dropped.
+ */
+
+#define STRESS_RECORDS			200000		// Written by each producer
+#define STRESS_BATCH_RECORDS	256
+
+typedef struct _FAKE_LP
+{
+	PSPTHV_TRACE_RING Ring;
+	ULONG Index;
+
+	// What the producer saw: how many writes TraceRingWrite refused, and whether it's done writing
+	UINT64 Dropped;
+	volatile LONG Done;
+
+	// What the reader saw
+	UINT64 Received;
+	UINT64 Missing;			// Sequence numbers skipped over
+	UINT64 NextSequence;
+	ULONG Corrupt;
+} FAKE_LP, *PFAKE_LP;
+
+static
+UINT64
+_Qualification(
+	_In_ CONST ULONG Index,
+	_In_ CONST UINT64 Sequence
+	)
+{
+	// Something a torn (or stale) record won't match by accident
+	return (Sequence * 0x9E3779B97F4A7C15ULL) ^ ((UINT64)Index << 48);
+}
+
+static
+VOID
+_WriteSequence(
+	_Inout_ PSPTHV_TRACE_RING Ring,
+	_In_ CONST ULONG Index,
+	_In_ CONST UINT64 Sequence,
+	_In_ CONST BOOLEAN Expected
+	)
+{
+	UINT64 qualification = _Qualification( Index, Sequence );
+
+	TEST_CHECK( TraceRingWrite( Ring, Sequence, Index, qualification, ~qualification ) == Expected );
+}
+
+static
+BOOLEAN
+_CheckRecord(
+	_In_ CONST SPTHV_TRACE_RECORD* Record,
+	_In_ CONST ULONG Index
+	)
+{
+	// The sequence number is the TSC; everything else follows from it
+	UINT64 qualification = _Qualification( Index, Record->Tsc );
+
+	return Record->ExitReason == Index &&
+	       Record->Qualification == qualification &&
+	       Record->GuestRip == ~qualification &&
+	       Record->Reserved == 0;
+}
+
+static
+VOID
+TestWriteRead()
+{
+	static SPTHV_TRACE_RING ring;
+	static SPTHV_TRACE_RECORD batch[SPTHV_TRACE_RING_RECORDS];
+	UINT64 sequence = 0, expected = 0;
+	ULONG count, i, round;
+
+	RtlZeroMemory( &ring, sizeof(ring) );
+
+	// Nothing published yet
+	TEST_CHECK_EQUAL( TraceRingRead( &ring, batch, STRESS_BATCH_RECORDS ), 0 );
+
+	// A full ring drops (and counts) the next record, without touching any published one
+	for ( i = 0; i < SPTHV_TRACE_RING_RECORDS; i++ )
+	{
+		_WriteSequence( &ring, 1, sequence++, TRUE );
+	}
+
+	_WriteSequence( &ring, 1, 0xDEAD, FALSE );
+	TEST_CHECK_EQUAL( ring.Overruns, 1 );
+	TEST_CHECK_EQUAL( ring.Head, SPTHV_TRACE_RING_RECORDS );
+
+	// A partial read frees exactly that many slots
+	TEST_CHECK_EQUAL( TraceRingRead( &ring, batch, 10 ), 10 );
+	TEST_CHECK_EQUAL( ring.Tail, 10 );
+
+	for ( i = 0; i < 10; i++ )
+	{
+		TEST_CHECK( _CheckRecord( &batch[i], 1 ) == TRUE );
+		TEST_CHECK_EQUAL( batch[i].Tsc, expected++ );
+	}
+
+	for ( i = 0; i < 10; i++ )
+	{
+		_WriteSequence( &ring, 1, sequence++, TRUE );
+	}
+
+	_WriteSequence( &ring, 1, 0xDEAD, FALSE );
+	TEST_CHECK_EQUAL( ring.Overruns, 2 );
+
+	// Round and round the ring a few times, in reads of varying sizes; every record comes out once, in order
+	for ( round = 0; sequence < 5 * SPTHV_TRACE_RING_RECORDS; round++ )
+	{
+		count = TraceRingRead( &ring, batch, 1 + round % 1000 );
+		TEST_CHECK_EQUAL( count, 1 + round % 1000 );
+
+		// (Note: a ring that isn't full any more would never fill up again, below)
+		if ( count != 1 + round % 1000 )
+		{
+			break;
+		}
+
+		for ( i = 0; i < count; i++ )
+		{
+			TEST_CHECK( _CheckRecord( &batch[i], 1 ) == TRUE );
+			TEST_CHECK_EQUAL( batch[i].Tsc, expected++ );
+		}
+
+		for ( i = 0; i < count; i++ )
+		{
+			_WriteSequence( &ring, 1, sequence++, TRUE );
+		}
+	}
+
+	count = TraceRingRead( &ring, batch, SPTHV_TRACE_RING_RECORDS );
+	TEST_CHECK_EQUAL( count, SPTHV_TRACE_RING_RECORDS );
+	TEST_CHECK_EQUAL( batch[SPTHV_TRACE_RING_RECORDS - 1].Tsc, sequence - 1 );
+	TEST_CHECK_EQUAL( ring.Tail, ring.Head );
+	TEST_CHECK_EQUAL( ring.Overruns, 2 );
+}
+
+static
+VOID
+TestHostileTail()
+{
+	/*
+	 * Tail is written from user mode; whatever it's set to, the producer never writes outside the ring or over
+	 *  a record the reader hasn't been handed yet, and the reader starts over rather than reading garbage.
+	 */
+
+	static SPTHV_TRACE_RING ring;
+	static SPTHV_TRACE_RECORD batch[STRESS_BATCH_RECORDS];
+
+	RtlZeroMemory( &ring, sizeof(ring) );
+
+	_WriteSequence( &ring, 2, 0, TRUE );
+	_WriteSequence( &ring, 2, 1, TRUE );
+
+	// Ahead of Head: looks like a full ring to the producer
+	ring.Tail = ring.Head + 5;
+	_WriteSequence( &ring, 2, 2, FALSE );
+	TEST_CHECK_EQUAL( ring.Head, 2 );
+	TEST_CHECK_EQUAL( ring.Overruns, 1 );
+
+	TEST_CHECK_EQUAL( TraceRingRead( &ring, batch, STRESS_BATCH_RECORDS ), 0 );
+	TEST_CHECK_EQUAL( ring.Tail, ring.Head );
+
+	// More than a ring behind
+	_WriteSequence( &ring, 2, 3, TRUE );
+	ring.Tail = 0;
+	ring.Head = SPTHV_TRACE_RING_RECORDS + 1;
+
+	TEST_CHECK_EQUAL( TraceRingRead( &ring, batch, STRESS_BATCH_RECORDS ), 0 );
+	TEST_CHECK_EQUAL( ring.Tail, SPTHV_TRACE_RING_RECORDS + 1 );
+}
+
+static
+PVOID
+_Producer(
+	_In_ PVOID Argument
+	)
+{
+	PFAKE_LP lp = Argument;
+	UINT64 sequence, qualification;
+
+	for ( sequence = 0; sequence < STRESS_RECORDS; sequence++ )
+	{
+		qualification = _Qualification( lp->Index, sequence );
+
+		if ( TraceRingWrite( lp->Ring, sequence, lp->Index, qualification, ~qualification ) == FALSE )
+		{
+			lp->Dropped++;
+		}
+	}
+
+	InterlockedExchange( &lp->Done, TRUE );
+
+	return NULL;
+}
+
+static
+ULONG
+_Drain(
+	_Inout_ PFAKE_LP LP
+	)
+{
+	SPTHV_TRACE_RECORD batch[STRESS_BATCH_RECORDS];
+	ULONG count, i;
+
+	count = TraceRingRead( LP->Ring, batch, STRESS_BATCH_RECORDS );
+
+	for ( i = 0; i < count; i++ )
+	{
+		if ( _CheckRecord( &batch[i], LP->Index ) == FALSE || batch[i].Tsc < LP->NextSequence || batch[i].Tsc >= STRESS_RECORDS )
+		{
+			LP->Corrupt++;
+			continue;
+		}
+
+		LP->Missing += batch[i].Tsc - LP->NextSequence;
+		LP->NextSequence = batch[i].Tsc + 1;
+	}
+
+	LP->Received += count;
+
+	return count;
+}
+
+static
+VOID
+TestStress()
+{
+	PFAKE_LP lps;
+	pthread_t* threads;
+	PSPTHV_TRACE_RING rings;
+	UINT64 overruns = 0;
+	ULONG count, i, done, sweeps = 0;
+
+	count = (ULONG)sysconf( _SC_NPROCESSORS_ONLN );
+	count = min( max( count, 2 ), 64 );
+
+	rings = aligned_alloc( 64, count * sizeof(SPTHV_TRACE_RING) );
+	lps = calloc( count, sizeof(FAKE_LP) );
+	threads = calloc( count, sizeof(pthread_t) );
+
+	RtlZeroMemory( rings, count * sizeof(SPTHV_TRACE_RING) );
+
+	for ( i = 0; i < count; i++ )
+	{
+		lps[i].Ring = &rings[i];
+		lps[i].Index = i;
+		pthread_create( &threads[i], NULL, _Producer, &lps[i] );
+	}
+
+	// Drain until every producer is done and every ring is empty; every so often, fall behind on purpose
+	do
+	{
+		done = 0;
+
+		for ( i = 0; i < count; i++ )
+		{
+			BOOLEAN finished = (ReadAcquire( &lps[i].Done ) != FALSE);
+
+			if ( _Drain( &lps[i] ) == 0 && finished == TRUE )
+			{
+				done++;
+			}
+		}
+
+		if ( ++sweeps % 64 == 0 )
+		{
+			usleep( 1000 );
+		}
+	} while ( done < count );
+
+	for ( i = 0; i < count; i++ )
+	{
+		pthread_join( threads[i], NULL );
+
+		// Every record either came out whole, in order, or was counted as dropped; and only those were
+		TEST_CHECK_EQUAL( lps[i].Corrupt, 0 );
+		TEST_CHECK_EQUAL( lps[i].Received + lps[i].Ring->Overruns, STRESS_RECORDS );
+		TEST_CHECK_EQUAL( lps[i].Ring->Overruns, lps[i].Dropped );
+		TEST_CHECK_EQUAL( lps[i].Missing + (STRESS_RECORDS - lps[i].NextSequence), lps[i].Dropped );
+
+		// The first ring's worth always gets in
+		TEST_CHECK( lps[i].Received >= SPTHV_TRACE_RING_RECORDS );
+
+		overruns += lps[i].Ring->Overruns;
+	}
+
+	// (Note: otherwise the loss accounting above was never exercised)
+	TEST_CHECK( overruns != 0 );
+
+	free( threads );
+	free( lps );
+	free( rings );
+}
+
+int
+main()
+{
+	TEST_RUN( TestWriteRead );
+	TEST_RUN( TestHostileTail );
+	TEST_RUN( TestStress );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+
+#include "TscMath.h"
+#include "Test.h"
+
+/*
+ * The guest TSC math, against 128-bit arithmetic done the obvious way: the multiplier has to be the exact ratio rounded
+ *  to the nearest 2^-48 (or 0 where there isn't one), and scaling has to keep the bits the processor keeps. Then a
+ *  run of multiplier changes, each rebased at the moment it's taken, has to leave the guest's TSC never going
+ *  backwards; and LPs whose guest TSCs have drifted apart have to read the same again after one shared rebase.
+ */
+
+#define GHZ								1000000000ULL
+
+static
+UINT64
+_ReferenceMultiplier(
+	_In_ CONST UINT64 GuestFrequency,
+	_In_ CONST UINT64 HostFrequency
+	)
+{
+	unsigned __int128 multiplier;
+
+	multiplier = (((unsigned __int128)GuestFrequency << TSC_MULTIPLIER_SHIFT) + HostFrequency / 2) / HostFrequency;
+
+	return (multiplier >> 64 != 0) ? 0 : (UINT64)multiplier;
+}
+
+static
+UINT64
+_Random64()
+{
+	return ((UINT64)rand() << 62) ^ ((UINT64)rand() << 31) ^ (UINT64)rand();
+}
+
+static
+VOID
+TestComputeMultiplier()
+{
+	UINT64 host, guest;
+	ULONG i, wrong = 0;
+
+	// A ratio of 1.0, whatever the rate
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 3 * GHZ, 3 * GHZ ), TSC_MULTIPLIER_ONE );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 1, 1 ), TSC_MULTIPLIER_ONE );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( MAXUINT64, MAXUINT64 ), TSC_MULTIPLIER_ONE );
+
+	// Exact ratios, either way
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 1 * GHZ, 2 * GHZ ), TSC_MULTIPLIER_ONE / 2 );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 3 * GHZ, 1 * GHZ ), 3 * TSC_MULTIPLIER_ONE );
+
+	// Rounded to the nearest, not down: 1/3 is 0x5555...55.5 in 2^-48ths, 2/3 is 0xAAAA...AA.A
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 1 * GHZ, 3 * GHZ ), 0x555555555555ULL );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 2 * GHZ, 3 * GHZ ), 0xAAAAAAAAAAABULL );
+
+	// Just under 2^16 is the largest multiplier there is; 2^16 itself needs bit 64
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 65536 * 3 * GHZ - 1, 3 * GHZ ), _ReferenceMultiplier( 65536 * 3 * GHZ - 1, 3 * GHZ ) );
+	TEST_CHECK( TscComputeMultiplier( 65536 * 3 * GHZ - 1, 3 * GHZ ) > 0xFFFF000000000000ULL );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 65536 * 3 * GHZ, 3 * GHZ ), 0 );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 65535 * 3 * GHZ, 3 * GHZ ), 65535 * TSC_MULTIPLIER_ONE );
+
+	// No rate at all
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 0, 3 * GHZ ), 0 );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 3 * GHZ, 0 ), 0 );
+
+	/*
+	 * Adding half the host rate, to round, carries out of the low 64 bits: (0xFFFF << 48) + 2^49 / 2 wraps. The
+	 *  ratio is tiny, and has to come out right anyway.
+	 */
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 0xFFFF, 1ULL << 49 ), _ReferenceMultiplier( 0xFFFF, 1ULL << 49 ) );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 0xFFFF, 1ULL << 49 ), 0x8000 );
+	TEST_CHECK_EQUAL( TscComputeMultiplier( 0x1FFFF, (1ULL << 50) + 1 ), _ReferenceMultiplier( 0x1FFFF, (1ULL << 50) + 1 ) );
+
+	// And where it's the carry that rounds the ratio up: (2^64 - 1) / 2^49 is 2^15 less half a 2^-48th
+	TEST_CHECK_EQUAL( TscComputeMultiplier( MAXUINT64, 1ULL << 49 ), 1ULL << 63 );
+
+	// Everywhere else
+	srand( 18 );
+
+	for ( i = 0; i < 100000; i++ )
+	{
+		host = _Random64() >> (rand() % 64);
+		guest = _Random64() >> (rand() % 64);
+
+		if ( host == 0 || guest == 0 )
+		{
+			continue;
+		}
+
+		wrong += (TscComputeMultiplier( guest, host ) != _ReferenceMultiplier( guest, host ));
+	}
+
+	TEST_CHECK_EQUAL( wrong, 0 );
+}
+
+static
+VOID
+TestScale()
+{
+	UINT64 tsc, multiplier;
+	ULONG i, wrong = 0;
+
+	TEST_CHECK_EQUAL( TscScale( 123456789, TSC_MULTIPLIER_ONE ), 123456789 );
+	TEST_CHECK_EQUAL( TscScale( MAXUINT64, TSC_MULTIPLIER_ONE ), MAXUINT64 );
+	TEST_CHECK_EQUAL( TscScale( 1000, TSC_MULTIPLIER_ONE / 2 ), 500 );
+
+	// Truncated, not rounded
+	TEST_CHECK_EQUAL( TscScale( 1001, TSC_MULTIPLIER_ONE / 2 ), 500 );
+
+	// Bits 111:48 of the product; the rest of the high half is dropped, as the processor drops it
+	TEST_CHECK_EQUAL( TscScale( MAXUINT64, 2 * TSC_MULTIPLIER_ONE ), MAXUINT64 - 1 );
+	TEST_CHECK_EQUAL( TscScale( 1ULL << 63, 4 * TSC_MULTIPLIER_ONE ), 0 );
+
+	srand( 18 );
+
+	for ( i = 0; i < 100000; i++ )
+	{
+		tsc = _Random64();
+		multiplier = _Random64();
+
+		wrong += (TscScale( tsc, multiplier ) != (UINT64)(((unsigned __int128)tsc * multiplier) >> TSC_MULTIPLIER_SHIFT));
+	}
+
+	TEST_CHECK_EQUAL( wrong, 0 );
+}
+
+static
+VOID
+TestOffset()
+{
+	UINT64 multiplier = TscComputeMultiplier( 1 * GHZ, 3 * GHZ );
+	UINT64 offset;
+
+	// The guest reads whatever it's told to, at the moment it's told; the offset wraps as it has to
+	offset = TscOffsetFor( 3000000000ULL, multiplier, 5 );
+	TEST_CHECK_EQUAL( TscGuestValue( 3000000000ULL, multiplier, offset ), 5 );
+	TEST_CHECK( offset > (1ULL << 63) );
+
+	offset = TscOffsetFor( 7, TSC_MULTIPLIER_ONE, MAXUINT64 );
+	TEST_CHECK_EQUAL( TscGuestValue( 7, TSC_MULTIPLIER_ONE, offset ), MAXUINT64 );
+	TEST_CHECK_EQUAL( TscGuestValue( 8, TSC_MULTIPLIER_ONE, offset ), 0 );
+}
+
+static
+VOID
+TestRebase()
+{
+	/*
+	 * An LP whose policy changes every so often, to a random rate (as `tsc` would set it), sometimes moving the TSC
+	 *  forward too; every RDTSC in between, at a host TSC that only ever goes up, has to read no less than the one
+	 *  before it, and exactly what it read a moment before at the moment of each change.
+	 */
+
+	UINT64 host = 0x123456789ULL;
+	UINT64 multiplier = TSC_MULTIPLIER_ONE;
+	UINT64 offset = 0;
+	UINT64 guest, previous = 0, before, advance;
+	UINT64 newMultiplier;
+	ULONG i, backwards = 0, jumps = 0, changes = 0;
+
+	srand( 18 );
+
+	for ( i = 0; i < 1000000; i++ )
+	{
+		host += rand() % 5000;
+
+		if ( rand() % 100 == 0 )
+		{
+			newMultiplier = TscComputeMultiplier( 1 + (UINT64)rand() % (10 * GHZ), 3 * GHZ );
+			advance = (rand() % 4 == 0) ? (UINT64)rand() : 0;
+			before = TscGuestValue( host, multiplier, offset );
+
+			// As TscSetPolicy does, for a single LP
+			offset = TscRebase( host, multiplier, offset, newMultiplier ) + advance;
+			multiplier = newMultiplier;
+
+			jumps += (TscGuestValue( host, multiplier, offset ) != before + advance);
+			changes++;
+		}
+
+		guest = TscGuestValue( host, multiplier, offset );
+		backwards += (guest < previous);
+		previous = guest;
+	}
+
+	TEST_CHECK( changes > 1000 );
+	TEST_CHECK_EQUAL( jumps, 0 );
+	TEST_CHECK_EQUAL( backwards, 0 );
+
+	// Down to the slowest rate there is, and back up, at a TSC that's been running a long while
+	host = 0x7FFFFFFFFFFF1234ULL;
+	before = TscGuestValue( host, TSC_MULTIPLIER_ONE, 0 );
+	offset = TscRebase( host, TSC_MULTIPLIER_ONE, 0, 1 );
+	TEST_CHECK_EQUAL( TscGuestValue( host, 1, offset ), before );
+	TEST_CHECK( TscGuestValue( host + 1, 1, offset ) >= before );
+
+	offset = TscRebase( host + 1000, 1, offset, 65535 * TSC_MULTIPLIER_ONE );
+	TEST_CHECK_EQUAL( TscGuestValue( host + 1000, 65535 * TSC_MULTIPLIER_ONE, offset ), before );
+	TEST_CHECK_EQUAL( TscGuestValue( host + 1001, 65535 * TSC_MULTIPLIER_ONE, offset ), before + 65535 );
+}
+
+static
+VOID
+TestSharedOffset()
+{
+	/*
+	 * LPs whose guests have each written their own TSC (so their offsets differ), given one new rate as TscSetPolicy
+	 *  gives it: one offset, rebased from one reading of the TSC, from the furthest-along LP. None of them may read
+	 *  less than it did at that reading, and that one LP has to read exactly what it did.
+	 */
+
+	UINT64 multipliers[4] = { TSC_MULTIPLIER_ONE, TSC_MULTIPLIER_ONE, 3 * TSC_MULTIPLIER_ONE / 2, TSC_MULTIPLIER_ONE / 3 };
+	UINT64 offsets[4] = { 0, 5000, (UINT64)-20000, 123456789 };
+	UINT64 host = 0x40000000000ULL;
+	UINT64 newMultiplier, offset, latest = 0, before;
+	ULONG i, round, exact;
+
+	srand( 4 );
+
+	for ( round = 0; round < 1000; round++ )
+	{
+		host += rand() % 100000;
+		newMultiplier = TscComputeMultiplier( 1 + (UINT64)rand() % (10 * GHZ), 3 * GHZ );
+		exact = 0;
+
+		for ( i = 0; i < ARRAYSIZE( offsets ); i++ )
+		{
+			offset = TscRebase( host, multipliers[i], offsets[i], newMultiplier );
+
+			if ( i == 0 || (INT64)(offset - latest) > 0 )
+			{
+				latest = offset;
+			}
+		}
+
+		for ( i = 0; i < ARRAYSIZE( offsets ); i++ )
+		{
+			before = TscGuestValue( host, multipliers[i], offsets[i] );
+
+			multipliers[i] = newMultiplier;
+			offsets[i] = latest;
+
+			TEST_CHECK( TscGuestValue( host, multipliers[i], offsets[i] ) >= before );
+			exact += (TscGuestValue( host, multipliers[i], offsets[i] ) == before);
+		}
+
+		// The furthest-along LP carries on from exactly where it was
+		TEST_CHECK( exact >= 1 );
+
+		// One guest writes its TSC again before the next round
+		offsets[round % ARRAYSIZE( offsets )] = TscOffsetFor( host, newMultiplier, TscGuestValue( host, newMultiplier, latest ) + rand() );
+	}
+}
+
+int
+main()
+{
+	TEST_RUN( TestComputeMultiplier );
+	TEST_RUN( TestScale );
+	TEST_RUN( TestOffset );
+	TEST_RUN( TestRebase );
+	TEST_RUN( TestSharedOffset );
+
+	return TEST_EXIT_CODE();
+}
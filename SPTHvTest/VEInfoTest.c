@@ -0,0 +1,248 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "VEInfo.h"
+#include "Test.h"
+
+/*
+ * An LP's virtualization-exception information area, in an ordinary buffer, and the EPT entries of a view built in
+ *  one (1GB of guest-physical memory): which violations may become #VEs, what the area says about one once it's
+ *  delivered, and the guest's handler taking it back out. Then an LP delivering #VEs as fast as a handler on another
+ *  thread takes them; every one has to be taken exactly once, in order, and whole.
+ */
+
+#define FAKE_POOL_PA					0x12340000ULL
+
+static CONST EPT_MEMORY_RANGE g_RAM[] = {
+	{ 0x0000000000001000ULL, 0x000000000009E000ULL },
+	{ 0x0000000000100000ULL, 0x000000003FF00000ULL },
+};
+
+#define MAP_LIMIT						0x40000000ULL
+
+#define WATCHED_PAGE					0x00345000ULL
+
+#define STRESS_DELIVERIES				200000
+
+static EPT_VIEW g_View;
+static VE_INFO g_Area;
+
+static
+VOID
+_BuildView()
+{
+	ULONG pages = EptCountTablePages( g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE ) + EPT_SPLIT_RESERVE_PAGES;
+
+	RtlZeroMemory( &g_View, sizeof(g_View) );
+
+	g_View.Pool.VA = aligned_alloc( EPT_PAGE_SIZE, (SIZE_T)pages * EPT_PAGE_SIZE );
+	g_View.Pool.PA = FAKE_POOL_PA;
+	g_View.Pool.PageCount = pages;
+
+	TEST_CHECK( EptBuildIdentityMap( &g_View, g_RAM, ARRAYSIZE( g_RAM ), MAP_LIMIT, TRUE ) == TRUE );
+}
+
+static
+VOID
+_FreeView()
+{
+	free( g_View.Pool.VA );
+	g_View.Pool.VA = NULL;
+}
+
+static
+BOOLEAN
+_IsConvertible(
+	_In_ CONST UINT64 GuestPA,
+	_In_ CONST BOOLEAN EventDelivery
+	)
+{
+	// As _DeliverVE in "Exit.c" asks, for a violation at GuestPA
+	UINT64 pageSize;
+
+	return VeInfoIsConvertible( &g_Area, EptGetLeafEntry( &g_View, GuestPA, &pageSize ), EventDelivery );
+}
+
+static
+VOID
+TestLayout()
+{
+	// [Table 25-1] "Format of the Virtualization-Exception Information Area"; what the processor writes, where it writes it
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, ExitReason ), 0x0 );
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, Busy ), 0x4 );
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, ExitQualification ), 0x8 );
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, GuestLinearAddress ), 0x10 );
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, GuestPhysicalAddress ), 0x18 );
+	TEST_CHECK_EQUAL( FIELD_OFFSET( VE_INFO, EPTPIndex ), 0x20 );
+	TEST_CHECK_EQUAL( sizeof(((PVE_INFO)0)->EPTPIndex), 2 );
+
+	memset( &g_Area, 0xCC, sizeof(g_Area) );
+	VeInfoReset( &g_Area );
+
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == FALSE );
+	TEST_CHECK_EQUAL( g_Area.ExitReason | g_Area.Busy | g_Area.ExitQualification | g_Area.GuestPhysicalAddress, 0 );
+
+	// Only FFFFFFFF is busy; the guest may leave anything else there
+	g_Area.Busy = VE_INFO_BUSY - 1;
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == FALSE );
+	g_Area.Busy = VE_INFO_BUSY;
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == TRUE );
+}
+
+static
+VOID
+TestConvertible()
+{
+	_BuildView();
+	VeInfoReset( &g_Area );
+
+	// Every entry we build suppresses #VEs, mapped or not; only a page made convertible isn't
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, FALSE ) == FALSE );
+	TEST_CHECK( _IsConvertible( 0x0, FALSE ) == FALSE );
+	TEST_CHECK( _IsConvertible( 0xA0000, FALSE ) == FALSE );
+
+	TEST_CHECK( EptSetSuppressVE( &g_View, WATCHED_PAGE, FALSE ) == TRUE );
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, FALSE ) == TRUE );
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE + 0xFFF, FALSE ) == TRUE );
+
+	// Only that page, not the rest of the large page it was split out of
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE - EPT_PAGE_SIZE, FALSE ) == FALSE );
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE + EPT_PAGE_SIZE, FALSE ) == FALSE );
+
+	// Not past the map (nothing maps it, so nothing says it's convertible)
+	TEST_CHECK( _IsConvertible( MAP_LIMIT, FALSE ) == FALSE );
+	TEST_CHECK( VeInfoIsConvertible( &g_Area, NULL, FALSE ) == FALSE );
+
+	// Not while the processor was delivering another event through the guest's IDT
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, TRUE ) == FALSE );
+
+	// Not while the guest has yet to take the last one
+	g_Area.Busy = VE_INFO_BUSY;
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, FALSE ) == FALSE );
+	g_Area.Busy = 0;
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, FALSE ) == TRUE );
+
+	// And not once it's been made to suppress them again
+	TEST_CHECK( EptSetSuppressVE( &g_View, WATCHED_PAGE, TRUE ) == TRUE );
+	TEST_CHECK( _IsConvertible( WATCHED_PAGE, FALSE ) == FALSE );
+
+	_FreeView();
+}
+
+static
+VOID
+TestDeliverTake()
+{
+	VE_INFO record;
+
+	VeInfoReset( &g_Area );
+
+	// A write to a watched page, through a known linear address, while the LP was in view 2
+	TEST_CHECK( VeInfoDeliver( &g_Area, 0x182, 0xFFFFF80012345678ULL, WATCHED_PAGE | 0x678, 2 ) == TRUE );
+
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == TRUE );
+	TEST_CHECK_EQUAL( g_Area.ExitReason, VE_INFO_EXIT_REASON );
+	TEST_CHECK_EQUAL( g_Area.ExitQualification, 0x182 );
+	TEST_CHECK_EQUAL( g_Area.GuestLinearAddress, 0xFFFFF80012345678ULL );
+	TEST_CHECK_EQUAL( g_Area.GuestPhysicalAddress, WATCHED_PAGE | 0x678 );
+	TEST_CHECK_EQUAL( g_Area.EPTPIndex, 2 );
+
+	// The next one waits for the guest, and leaves the first one alone
+	TEST_CHECK( VeInfoDeliver( &g_Area, 0x181, 0, 0x1000, 0 ) == FALSE );
+	TEST_CHECK_EQUAL( g_Area.ExitQualification, 0x182 );
+	TEST_CHECK_EQUAL( g_Area.GuestPhysicalAddress, WATCHED_PAGE | 0x678 );
+
+	// The handler gets it whole, and frees the area
+	memset( &record, 0xCC, sizeof(record) );
+	TEST_CHECK( VeInfoTake( &g_Area, &record ) == TRUE );
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == FALSE );
+
+	TEST_CHECK_EQUAL( record.ExitReason, VE_INFO_EXIT_REASON );
+	TEST_CHECK_EQUAL( record.Busy, VE_INFO_BUSY );
+	TEST_CHECK_EQUAL( record.ExitQualification, 0x182 );
+	TEST_CHECK_EQUAL( record.GuestLinearAddress, 0xFFFFF80012345678ULL );
+	TEST_CHECK_EQUAL( record.GuestPhysicalAddress, WATCHED_PAGE | 0x678 );
+	TEST_CHECK_EQUAL( record.EPTPIndex, 2 );
+
+	// Nothing left to take
+	memset( &record, 0xCC, sizeof(record) );
+	TEST_CHECK( VeInfoTake( &g_Area, &record ) == FALSE );
+	TEST_CHECK_EQUAL( record.ExitQualification | record.GuestPhysicalAddress | record.Busy, 0 );
+
+	// And the next one goes in
+	TEST_CHECK( VeInfoDeliver( &g_Area, 0x184, 0, 0x2000, 3 ) == TRUE );
+	TEST_CHECK_EQUAL( g_Area.GuestLinearAddress, 0 );
+	TEST_CHECK_EQUAL( g_Area.EPTPIndex, 3 );
+}
+
+static
+PVOID
+_Deliverer(
+	PVOID Argument
+	)
+{
+	// The LP; each violation is delivered as soon as the area is free (until then, it would have exited instead)
+
+	UINT64 i;
+
+	UNREFERENCED_PARAMETER( Argument );
+
+	for ( i = 1; i <= STRESS_DELIVERIES; i++ )
+	{
+		while ( VeInfoDeliver( &g_Area, i, ~i, i << 12, (UINT16)i ) == FALSE )
+		{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static
+VOID
+TestDeliverWhileTaking()
+{
+	pthread_t deliverer;
+	VE_INFO record;
+	UINT64 next = 1;
+	ULONG torn = 0, outOfOrder = 0;
+
+	VeInfoReset( &g_Area );
+
+	TEST_CHECK( pthread_create( &deliverer, NULL, _Deliverer, NULL ) == 0 );
+
+	// The guest's handler, on another CPU; each record has to be one whole delivery, the next one
+	while ( next <= STRESS_DELIVERIES )
+	{
+		if ( VeInfoTake( &g_Area, &record ) == FALSE )
+		{
+			sched_yield();
+			continue;
+		}
+
+		torn += (record.GuestLinearAddress != ~record.ExitQualification || record.GuestPhysicalAddress != record.ExitQualification << 12 ||
+				 record.EPTPIndex != (UINT16)record.ExitQualification);
+		outOfOrder += (record.ExitQualification != next);
+
+		next = record.ExitQualification + 1;
+	}
+
+	pthread_join( deliverer, NULL );
+
+	TEST_CHECK_EQUAL( torn, 0 );
+	TEST_CHECK_EQUAL( outOfOrder, 0 );
+	TEST_CHECK( VeInfoIsBusy( &g_Area ) == FALSE );
+}
+
+int
+main()
+{
+	TEST_RUN( TestLayout );
+	TEST_RUN( TestConvertible );
+	TEST_RUN( TestDeliverTake );
+	TEST_RUN( TestDeliverWhileTaking );
+
+	return TEST_EXIT_CODE();
+}
@@ -0,0 +1,565 @@
+#include "VMX.h"
+#include "VMCS.h"
+#include "Test.h"
+
+/*
+ * VMXCaptureCapabilities against capability MSRs recorded on real processors (`rdmsr -a 0x480` and on, from msr-tools),
+ *  and VMXFixControls against what it captured. A recorded MSR the processor didn't have is a #GP to read, so the
+ *  reader fails the test if it's asked for one. VMXPassThroughControls is checked against those, and a made-up host's
+ *  CPUID; every instruction the host has has to get its control, or be hidden from the guest. VMXInvalidateVPID is
+ *  checked for the INVVPID type it picks, for every scope, with each combination of supported types.
+ */
+
+typedef struct _MSR_DUMP_ENTRY
+{
+	UINT32 Msr;
+	UINT64 Value;
+} MSR_DUMP_ENTRY, *PMSR_DUMP_ENTRY;
+
+typedef struct _MSR_DUMP
+{
+	CONST MSR_DUMP_ENTRY* Entries;
+	ULONG Count;
+
+	// One bit per MSR in 480H-49FH the capture read
+	UINT32 Read;
+	ULONG Faults;
+} MSR_DUMP, *PMSR_DUMP;
+
+// A Coffee Lake desktop part: 'true' controls, EPT, VPIDs and VM functions
+static CONST MSR_DUMP_ENTRY g_CoffeeLake[] = {
+	{ IA32_VMX_BASIC,					0x00DA040000000004ULL },
+	{ IA32_VMX_PINBASED_CTRLS,			0x0000007F00000016ULL },
+	{ IA32_VMX_PROCBASED_CTLS,			0xFFF9FFFE0401E172ULL },
+	{ IA32_VMX_EXIT_CTLS,				0x01FFFFFF00036DFFULL },
+	{ IA32_VMX_ENTRY_CTLS,				0x0003FFFF000011FFULL },
+	{ IA32_VMX_MISC,					0x00000000300481E5ULL },
+	{ IA32_VMX_CR0_FIXED0,				0x0000000080000021ULL },
+	{ IA32_VMX_CR0_FIXED1,				0x00000000FFFFFFFFULL },
+	{ IA32_VMX_CR4_FIXED0,				0x0000000000002000ULL },
+	{ IA32_VMX_CR4_FIXED1,				0x00000000003727FFULL },
+	{ IA32_VMX_VMCS_ENUM,				0x000000000000002EULL },
+	{ IA32_VMX_PROCBASED_CTLS2,			0x005FFCFF00000000ULL },
+	{ IA32_VMX_EPT_VPID_CAP,			0x00000F0106734141ULL },
+	{ IA32_VMX_TRUE_PINBASED_CTRLS,		0x0000007F00000016ULL },
+	{ IA32_VMX_TRUE_PROCBASED_CTLS,		0xFFF9FFFE04006172ULL },
+	{ IA32_VMX_TRUE_EXIT_CTLS,			0x01FFFFFF00036DFBULL },
+	{ IA32_VMX_TRUE_ENTRY_CTLS,			0x0003FFFF000011FBULL },
+	{ IA32_VMX_VMFUNC,					0x0000000000000001ULL },
+};
+
+// A Core 2 (Merom) part: no 'true' controls, and no secondary controls at all
+static CONST MSR_DUMP_ENTRY g_Merom[] = {
+	{ IA32_VMX_BASIC,					0x005A08000000000DULL },
+	{ IA32_VMX_PINBASED_CTRLS,			0x0000003F00000016ULL },
+	{ IA32_VMX_PROCBASED_CTLS,			0x77B9FFFE0401E172ULL },
+	{ IA32_VMX_EXIT_CTLS,				0x0003FFFF00036DFFULL },
+	{ IA32_VMX_ENTRY_CTLS,				0x00003FFF000011FFULL },
+	{ IA32_VMX_MISC,					0x00000000000403C0ULL },
+	{ IA32_VMX_CR0_FIXED0,				0x0000000080000021ULL },
+	{ IA32_VMX_CR0_FIXED1,				0x00000000FFFFFFFFULL },
+	{ IA32_VMX_CR4_FIXED0,				0x0000000000002000ULL },
+	{ IA32_VMX_CR4_FIXED1,				0x00000000000027FFULL },
+	{ IA32_VMX_VMCS_ENUM,				0x000000000000002CULL },
+};
+
+// A nested hypervisor's view: secondary controls with VPIDs, but neither EPT nor VM functions
+static CONST MSR_DUMP_ENTRY g_NestedVPIDOnly[] = {
+	{ IA32_VMX_BASIC,					0x00DA040000000004ULL },
+	{ IA32_VMX_MISC,					0x00000000000401E5ULL },
+	{ IA32_VMX_TRUE_PINBASED_CTRLS,		0x0000007F00000016ULL },
+	{ IA32_VMX_TRUE_PROCBASED_CTLS,		0xFFF9FFFE04006172ULL },
+	{ IA32_VMX_TRUE_EXIT_CTLS,			0x01FFFFFF00036DFBULL },
+	{ IA32_VMX_TRUE_ENTRY_CTLS,			0x0003FFFF000011FBULL },
+	{ IA32_VMX_CR0_FIXED0,				0x0000000080000021ULL },
+	{ IA32_VMX_CR0_FIXED1,				0x00000000FFFFFFFFULL },
+	{ IA32_VMX_CR4_FIXED0,				0x0000000000002000ULL },
+	{ IA32_VMX_CR4_FIXED1,				0x00000000003727FFULL },
+	{ IA32_VMX_VMCS_ENUM,				0x000000000000002EULL },
+	{ IA32_VMX_PROCBASED_CTLS2,			0x0000002000000000ULL },
+	{ IA32_VMX_EPT_VPID_CAP,			0x0000060100000000ULL },
+};
+
+UINT64
+__readmsr(
+	_In_ ULONG Register
+	)
+{
+	// (Note: every capture in here goes through a recorded dump)
+	TEST_CHECK( !"__readmsr" );
+	return 0;
+}
+
+// The last INVVPID executed, if any
+static ULONG g_InvvpidCount;
+static INVVPID_TYPE g_InvvpidType;
+static INVVPID_DESCRIPTOR g_InvvpidDescriptor;
+
+VMX_STATUS_CODE
+__invvpid(
+	_In_ INVVPID_TYPE Type,
+	_In_ PINVVPID_DESCRIPTOR Descriptor
+	)
+{
+	g_InvvpidCount++;
+	g_InvvpidType = Type;
+	g_InvvpidDescriptor = *Descriptor;
+
+	return VMX_OK;
+}
+
+static
+UINT64
+_ReadDump(
+	_In_ UINT32 Msr,
+	_In_opt_ PVOID Context
+	)
+{
+	PMSR_DUMP dump = Context;
+	ULONG i;
+
+	if ( Msr >= IA32_VMX_BASIC && Msr < IA32_VMX_BASIC + 32 )
+	{
+		dump->Read |= 1UL << (Msr - IA32_VMX_BASIC);
+	}
+
+	for ( i = 0; i < dump->Count; i++ )
+	{
+		if ( dump->Entries[i].Msr == Msr )
+		{
+			return dump->Entries[i].Value;
+		}
+	}
+
+	fprintf( stderr, "#GP reading MSR %x\n", Msr );
+	dump->Faults++;
+
+	return 0;
+}
+
+#define _MSR_BIT(msr)		(1UL << ((msr) - IA32_VMX_BASIC))
+
+static
+VOID
+TestCaptureTrueControls()
+{
+	VMX_CAPABILITIES caps;
+	MSR_DUMP dump = { g_CoffeeLake, ARRAYSIZE( g_CoffeeLake ), 0, 0 };
+
+	RtlFillMemory( &caps, sizeof(caps), 0xCC );
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	TEST_CHECK_EQUAL( dump.Faults, 0 );
+
+	// The 'true' MSRs replace the legacy ones; those aren't even read
+	TEST_CHECK_EQUAL( caps.Basic.TrueControls, 1 );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_PIN_BASED], 0x0000007F00000016ULL );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_PROC_PRIMARY], 0xFFF9FFFE04006172ULL );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_EXIT], 0x01FFFFFF00036DFBULL );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_ENTRY], 0x0003FFFF000011FBULL );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_PROC_SECONDARY], 0x005FFCFF00000000ULL );
+	TEST_CHECK_EQUAL( dump.Read & (_MSR_BIT( IA32_VMX_PINBASED_CTRLS ) | _MSR_BIT( IA32_VMX_PROCBASED_CTLS ) | _MSR_BIT( IA32_VMX_EXIT_CTLS ) | _MSR_BIT( IA32_VMX_ENTRY_CTLS )), 0 );
+
+	TEST_CHECK_EQUAL( caps.Misc.PreemptionTimerRate, 5 );
+	TEST_CHECK_EQUAL( caps.CR0Fixed0, 0x80000021 );
+	TEST_CHECK_EQUAL( caps.CR4Fixed1, 0x3727FF );
+	TEST_CHECK_EQUAL( caps.VMCSEnum, 0x2E );
+
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.All, 0x00000F0106734141ULL );
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.INVVPIDIndividualAddress, 1 );
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.PDPTE1GBPages, 1 );
+	TEST_CHECK_EQUAL( caps.VMFunc, 1 );
+}
+
+static
+VOID
+TestCaptureLegacyControls()
+{
+	VMX_CAPABILITIES caps;
+	MSR_DUMP dump = { g_Merom, ARRAYSIZE( g_Merom ), 0, 0 };
+
+	RtlFillMemory( &caps, sizeof(caps), 0xCC );
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	// No 'true' MSRs, no IA32_VMX_PROCBASED_CTLS2 (primary bit 63 is clear), and so nothing that depends on it
+	TEST_CHECK_EQUAL( dump.Faults, 0 );
+	TEST_CHECK_EQUAL( caps.Basic.TrueControls, 0 );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_PROC_PRIMARY], 0x77B9FFFE0401E172ULL );
+	TEST_CHECK_EQUAL( caps.Controls[VMX_CTRL_PROC_SECONDARY], 0 );
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.All, 0 );
+	TEST_CHECK_EQUAL( caps.VMFunc, 0 );
+	TEST_CHECK_EQUAL( dump.Read & _MSR_BIT( IA32_VMX_PROCBASED_CTLS2 ), 0 );
+}
+
+static
+VOID
+TestCaptureVPIDWithoutEPT()
+{
+	VMX_CAPABILITIES caps;
+	MSR_DUMP dump = { g_NestedVPIDOnly, ARRAYSIZE( g_NestedVPIDOnly ), 0, 0 };
+
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	// VPIDs alone are enough for IA32_VMX_EPT_VPID_CAP to be there; not for IA32_VMX_VMFUNC
+	TEST_CHECK_EQUAL( dump.Faults, 0 );
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.INVVPID, 1 );
+	TEST_CHECK_EQUAL( caps.EPTVPIDCap.INVVPIDSingleContext, 1 );
+	TEST_CHECK_EQUAL( caps.VMFunc, 0 );
+	TEST_CHECK_EQUAL( dump.Read & _MSR_BIT( IA32_VMX_VMFUNC ), 0 );
+}
+
+static
+VOID
+TestFixControls()
+{
+	VMX_CAPABILITIES caps;
+	MSR_DUMP dump = { g_CoffeeLake, ARRAYSIZE( g_CoffeeLake ), 0, 0 };
+	PROCESSOR_PRIMARY_VM_EXEC_CTRLS primary;
+	PROCESSOR_SECONDARY_VM_EXEC_CTRLS secondary;
+	UINT32 dropped, forced, fixed;
+
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	// Nothing asked for: only the default1 bits, which the 'true' MSR has fewer of (no CR3-load/store exiting)
+	fixed = VMXFixControls( &caps, VMX_CTRL_PROC_PRIMARY, 0, &dropped, &forced );
+	TEST_CHECK_EQUAL( fixed, 0x04006172 );
+	TEST_CHECK_EQUAL( dropped, 0 );
+	TEST_CHECK_EQUAL( forced, 0x04006172 );
+
+	primary.All = fixed;
+	TEST_CHECK_EQUAL( primary.CR3LoadExiting, 0 );
+
+	// A control this processor doesn't have is dropped; one it does is kept, and not reported
+	primary.All = 0;
+	primary.ActivateSecondaryControls = 1;
+	primary.UseMSRBitmaps = 1;
+
+	fixed = VMXFixControls( &caps, VMX_CTRL_PROC_PRIMARY, primary.All | (1UL << 0), &dropped, &forced );
+	TEST_CHECK_EQUAL( fixed, primary.All | 0x04006172 );
+	TEST_CHECK_EQUAL( dropped, 1UL << 0 );
+	TEST_CHECK_EQUAL( forced, 0x04006172 & ~primary.All );
+
+	// The secondary controls have no default1 bits; and a client part has no virtual-interrupt delivery
+	secondary.All = 0;
+	secondary.EnableEPT = 1;
+	secondary.EnablePML = 1;
+	secondary.VirtualInterruptDelivery = 1;
+
+	fixed = VMXFixControls( &caps, VMX_CTRL_PROC_SECONDARY, secondary.All, &dropped, NULL );
+	TEST_CHECK_EQUAL( dropped, 1UL << 9 );
+
+	secondary.All = fixed;
+	TEST_CHECK_EQUAL( secondary.EnableEPT, 1 );
+	TEST_CHECK_EQUAL( secondary.EnablePML, 1 );
+	TEST_CHECK_EQUAL( secondary.VirtualInterruptDelivery, 0 );
+
+	// Neither report is required
+	TEST_CHECK_EQUAL( VMXFixControls( &caps, VMX_CTRL_PIN_BASED, 0, NULL, NULL ), 0x16 );
+}
+
+// A host's CPUID, as far as VMXPassThroughControls is concerned; every other leaf is all zeroes
+typedef struct _FAKE_CPUID
+{
+	UINT32 MaxBasic;
+	UINT32 MaxExtended;
+	CPUID_ENTRY Leaf07;				// Subleaf 0
+	CPUID_ENTRY Leaf0D;				// Subleaf 1
+	CPUID_ENTRY Leaf80000001;
+
+	// The leaves asked for past the highest ones (which a processor answers with some other leaf)
+	ULONG OutOfRange;
+} FAKE_CPUID, *PFAKE_CPUID;
+
+#define _CPUID_07_EBX_INVPCID	(1UL << 10)
+#define _CPUID_07_ECX_WAITPKG	(1UL << 5)
+#define _CPUID_07_EDX_PCONFIG	(1UL << 18)
+#define _CPUID_0D_EAX_XSAVES	(1UL << 3)
+#define _CPUID_EXT_EDX_RDTSCP	(1UL << 27)
+
+static
+VOID
+_ReadFakeCPUID(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PCPUID_ENTRY Result,
+	_In_opt_ PVOID Context
+	)
+{
+	PFAKE_CPUID cpuid = Context;
+
+	RtlZeroMemory( Result, sizeof(*Result) );
+
+	if ( (Leaf < CPUID_EXTENDED_BASE && Leaf > cpuid->MaxBasic) || (Leaf > CPUID_EXTENDED_BASE && Leaf > cpuid->MaxExtended) )
+	{
+		cpuid->OutOfRange++;
+	}
+
+	if ( Leaf == 0 )
+	{
+		Result->Eax = cpuid->MaxBasic;
+	}
+	else if ( Leaf == CPUID_EXTENDED_BASE )
+	{
+		Result->Eax = cpuid->MaxExtended;
+	}
+	else if ( Leaf == 0x07 && Subleaf == 0 )
+	{
+		*Result = cpuid->Leaf07;
+	}
+	else if ( Leaf == 0x0D && Subleaf == 1 )
+	{
+		*Result = cpuid->Leaf0D;
+	}
+	else if ( Leaf == 0x80000001 )
+	{
+		*Result = cpuid->Leaf80000001;
+	}
+}
+
+static
+VOID
+_FakeHost(
+	_Out_ PFAKE_CPUID Cpuid
+	)
+{
+	// Every pass-through instruction there is, and a few neighbouring feature flags that have nothing to do with them
+	RtlZeroMemory( Cpuid, sizeof(*Cpuid) );
+
+	Cpuid->MaxBasic = 0x16;
+	Cpuid->MaxExtended = 0x80000008;
+	Cpuid->Leaf07.Ebx = _CPUID_07_EBX_INVPCID | 0x1;
+	Cpuid->Leaf07.Ecx = _CPUID_07_ECX_WAITPKG | 0x4;
+	Cpuid->Leaf07.Edx = _CPUID_07_EDX_PCONFIG | 0x400;
+	Cpuid->Leaf0D.Eax = _CPUID_0D_EAX_XSAVES | 0x7;
+	Cpuid->Leaf80000001.Edx = _CPUID_EXT_EDX_RDTSCP | (1UL << 29);
+}
+
+static
+UINT32
+_HiddenMask(
+	_In_ CONST CPUID_OVERRIDE* Hidden,
+	_In_ CONST UINT32 Control
+	)
+{
+	// What Hidden clears from the feature flags of Control's instruction (which every override has to clear, not set)
+	ULONG i;
+
+	for ( i = 0; i < VMX_PASSTHROUGH_CONTROL_COUNT; i++ )
+	{
+		TEST_CHECK_EQUAL( Hidden[i].Value, 0 );
+
+		if ( g_VMXPassThroughControls[i].Control == Control )
+		{
+			TEST_CHECK_EQUAL( Hidden[i].Leaf, g_VMXPassThroughControls[i].Leaf );
+			TEST_CHECK_EQUAL( Hidden[i].Subleaf, g_VMXPassThroughControls[i].Subleaf );
+			TEST_CHECK_EQUAL( Hidden[i].Register, g_VMXPassThroughControls[i].Register );
+			return Hidden[i].Mask;
+		}
+	}
+
+	TEST_CHECK( !"No such control" );
+	return 0;
+}
+
+static
+VOID
+TestPassThroughControls()
+{
+	VMX_CAPABILITIES caps;
+	MSR_DUMP dump = { g_CoffeeLake, ARRAYSIZE( g_CoffeeLake ), 0, 0 };
+	FAKE_CPUID cpuid;
+	CPUID_OVERRIDE hidden[VMX_PASSTHROUGH_CONTROL_COUNT];
+	CPUID_ENTRY entry;
+	UINT32 controls, unavailable;
+
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	// Everything a client part has a control for gets it; it has no WAITPKG or PCONFIG controls, so those are hidden
+	_FakeHost( &cpuid );
+	RtlFillMemory( hidden, sizeof(hidden), 0xCC );
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, &unavailable, hidden );
+
+	TEST_CHECK_EQUAL( controls, SECONDARY_CTRL_ENABLE_RDTSCP | SECONDARY_CTRL_ENABLE_INVPCID | SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS );
+	TEST_CHECK_EQUAL( unavailable, SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE | SECONDARY_CTRL_ENABLE_PCONFIG );
+	TEST_CHECK_EQUAL( cpuid.OutOfRange, 0 );
+
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_RDTSCP ), 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_INVPCID ), 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS ), 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE ), _CPUID_07_ECX_WAITPKG );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_PCONFIG ), _CPUID_07_EDX_PCONFIG );
+
+	// What the guest's leaf 07H ends up as; only the two instructions it can't run are gone
+	entry = cpuid.Leaf07;
+	CpuidApplyOverrides( hidden, VMX_PASSTHROUGH_CONTROL_COUNT, 0x07, 0, &entry );
+	TEST_CHECK_EQUAL( entry.Ebx, _CPUID_07_EBX_INVPCID | 0x1 );
+	TEST_CHECK_EQUAL( entry.Ecx, 0x4 );
+	TEST_CHECK_EQUAL( entry.Edx, 0x400 );
+
+	entry = cpuid.Leaf80000001;
+	CpuidApplyOverrides( hidden, VMX_PASSTHROUGH_CONTROL_COUNT, 0x80000001, 0, &entry );
+	TEST_CHECK_EQUAL( entry.Edx, _CPUID_EXT_EDX_RDTSCP | (1UL << 29) );
+
+	// A host without an instruction neither gets its control nor has anything hidden
+	_FakeHost( &cpuid );
+	cpuid.Leaf07.Ecx &= ~_CPUID_07_ECX_WAITPKG;
+	cpuid.Leaf0D.Eax &= ~_CPUID_0D_EAX_XSAVES;
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, &unavailable, hidden );
+
+	TEST_CHECK_EQUAL( controls, SECONDARY_CTRL_ENABLE_RDTSCP | SECONDARY_CTRL_ENABLE_INVPCID );
+	TEST_CHECK_EQUAL( unavailable, SECONDARY_CTRL_ENABLE_PCONFIG );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS ), 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE ), 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_PCONFIG ), _CPUID_07_EDX_PCONFIG );
+
+	// Leaves past the highest ones aren't asked for (or believed); without leaf 07H there's nothing in it to hide
+	_FakeHost( &cpuid );
+	cpuid.MaxBasic = 0x06;
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, &unavailable, hidden );
+
+	TEST_CHECK_EQUAL( controls, SECONDARY_CTRL_ENABLE_RDTSCP );
+	TEST_CHECK_EQUAL( unavailable, 0 );
+	TEST_CHECK_EQUAL( cpuid.OutOfRange, 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_PCONFIG ), 0 );
+
+	_FakeHost( &cpuid );
+	cpuid.MaxExtended = 0x80000000;
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, NULL, NULL );
+
+	TEST_CHECK_EQUAL( controls, SECONDARY_CTRL_ENABLE_INVPCID | SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS );
+	TEST_CHECK_EQUAL( cpuid.OutOfRange, 0 );
+
+	// A nested hypervisor with nothing but VPIDs; every instruction the host has is hidden, and nothing else
+	dump.Entries = g_NestedVPIDOnly;
+	dump.Count = ARRAYSIZE( g_NestedVPIDOnly );
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	_FakeHost( &cpuid );
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, &unavailable, hidden );
+
+	TEST_CHECK_EQUAL( controls, 0 );
+	TEST_CHECK_EQUAL( unavailable, SECONDARY_CTRL_ENABLE_RDTSCP | SECONDARY_CTRL_ENABLE_INVPCID | SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS |
+					  SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE | SECONDARY_CTRL_ENABLE_PCONFIG );
+
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_RDTSCP ), _CPUID_EXT_EDX_RDTSCP );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_INVPCID ), _CPUID_07_EBX_INVPCID );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_XSAVES_XRSTORS ), _CPUID_0D_EAX_XSAVES );
+
+	entry = cpuid.Leaf0D;
+	CpuidApplyOverrides( hidden, VMX_PASSTHROUGH_CONTROL_COUNT, 0x0D, 1, &entry );
+	TEST_CHECK_EQUAL( entry.Eax, 0x7 );
+
+	entry = cpuid.Leaf0D;
+	CpuidApplyOverrides( hidden, VMX_PASSTHROUGH_CONTROL_COUNT, 0x0D, 0, &entry );
+	TEST_CHECK_EQUAL( entry.Eax, _CPUID_0D_EAX_XSAVES | 0x7 );
+
+	entry = cpuid.Leaf80000001;
+	CpuidApplyOverrides( hidden, VMX_PASSTHROUGH_CONTROL_COUNT, 0x80000001, 0, &entry );
+	TEST_CHECK_EQUAL( entry.Edx, 1UL << 29 );
+
+	// And a processor with no secondary controls at all, likewise
+	dump.Entries = g_Merom;
+	dump.Count = ARRAYSIZE( g_Merom );
+	VMXCaptureCapabilities( &caps, _ReadDump, &dump );
+
+	controls = VMXPassThroughControls( &caps, _ReadFakeCPUID, &cpuid, &unavailable, hidden );
+
+	TEST_CHECK_EQUAL( controls, 0 );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_RDTSCP ), _CPUID_EXT_EDX_RDTSCP );
+	TEST_CHECK_EQUAL( _HiddenMask( hidden, SECONDARY_CTRL_ENABLE_USER_WAIT_PAUSE ), _CPUID_07_ECX_WAITPKG );
+	TEST_CHECK_EQUAL( dump.Faults, 0 );
+}
+
+// Which INVVPID types IA32_VMX_EPT_VPID_CAP reports ([A.10] "VPID and EPT Capabilities")
+#define _INVVPID_ADDRESS		0x1
+#define _INVVPID_CONTEXT		0x2
+#define _INVVPID_ALL			0x4
+#define _INVVPID_GLOBALS		0x8
+
+#define _INVVPID_NONE			((INVVPID_TYPE)-1)
+
+static
+INVVPID_TYPE
+_Invalidate(
+	_In_ ULONG Types,
+	_In_ VPID_INVALIDATION Scope
+	)
+{
+	// The INVVPID type VMXInvalidateVPID uses for Scope, with only Types supported; _INVVPID_NONE if it can't
+
+	VMX_STATUS_CODE status;
+
+	g_VMXCapabilities.EPTVPIDCap.All = 0;
+	g_VMXCapabilities.EPTVPIDCap.INVVPID = 1;
+	g_VMXCapabilities.EPTVPIDCap.INVVPIDIndividualAddress = ((Types & _INVVPID_ADDRESS) != 0);
+	g_VMXCapabilities.EPTVPIDCap.INVVPIDSingleContext = ((Types & _INVVPID_CONTEXT) != 0);
+	g_VMXCapabilities.EPTVPIDCap.INVVPIDAllContexts = ((Types & _INVVPID_ALL) != 0);
+	g_VMXCapabilities.EPTVPIDCap.INVVPIDSingleContextRetainGlobals = ((Types & _INVVPID_GLOBALS) != 0);
+
+	g_InvvpidCount = 0;
+	status = VMXInvalidateVPID( 0x1234, Scope, 0xFFFFF80000001000ULL );
+
+	if ( status != VMX_OK )
+	{
+		TEST_CHECK_EQUAL( g_InvvpidCount, 0 );
+		return _INVVPID_NONE;
+	}
+
+	TEST_CHECK_EQUAL( g_InvvpidCount, 1 );
+	TEST_CHECK_EQUAL( g_InvvpidDescriptor.VPID, 0x1234 );
+	TEST_CHECK_EQUAL( g_InvvpidDescriptor.Reserved0, 0 );
+	TEST_CHECK_EQUAL( g_InvvpidDescriptor.LinearAddress, 0xFFFFF80000001000ULL );
+
+	return g_InvvpidType;
+}
+
+static
+VOID
+TestInvalidateVPID()
+{
+	ULONG every = _INVVPID_ADDRESS | _INVVPID_CONTEXT | _INVVPID_ALL | _INVVPID_GLOBALS;
+
+	// Everything supported: each scope gets its own type
+	TEST_CHECK_EQUAL( _Invalidate( every, VPID_INVALIDATE_ADDRESS ), INVVPID_INDIVIDUAL_ADDRESS );
+	TEST_CHECK_EQUAL( _Invalidate( every, VPID_INVALIDATE_NON_GLOBAL ), INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS );
+	TEST_CHECK_EQUAL( _Invalidate( every, VPID_INVALIDATE_CONTEXT ), INVVPID_SINGLE_CONTEXT );
+	TEST_CHECK_EQUAL( _Invalidate( every, VPID_INVALIDATE_ALL ), INVVPID_ALL_CONTEXTS );
+
+	// An address whose translation may be global can't be left to the type that retains globals
+	TEST_CHECK_EQUAL( _Invalidate( every & ~_INVVPID_ADDRESS, VPID_INVALIDATE_ADDRESS ), INVVPID_SINGLE_CONTEXT );
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_GLOBALS | _INVVPID_ALL, VPID_INVALIDATE_ADDRESS ), INVVPID_ALL_CONTEXTS );
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_GLOBALS, VPID_INVALIDATE_ADDRESS ), _INVVPID_NONE );
+
+	// Without retaining globals, a MOV to CR3 flushes the whole context (or everything)
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_ADDRESS | _INVVPID_CONTEXT | _INVVPID_ALL, VPID_INVALIDATE_NON_GLOBAL ), INVVPID_SINGLE_CONTEXT );
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_ALL, VPID_INVALIDATE_NON_GLOBAL ), INVVPID_ALL_CONTEXTS );
+
+	// Nothing narrower ever stands in for a broader scope
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_ADDRESS | _INVVPID_GLOBALS, VPID_INVALIDATE_CONTEXT ), _INVVPID_NONE );
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_ADDRESS | _INVVPID_CONTEXT | _INVVPID_GLOBALS, VPID_INVALIDATE_ALL ), _INVVPID_NONE );
+	TEST_CHECK_EQUAL( _Invalidate( _INVVPID_ALL, VPID_INVALIDATE_CONTEXT ), INVVPID_ALL_CONTEXTS );
+
+	// No INVVPID at all
+	g_VMXCapabilities.EPTVPIDCap.All = 0;
+	g_InvvpidCount = 0;
+	TEST_CHECK_EQUAL( VMXInvalidateVPID( 1, VPID_INVALIDATE_ALL, 0 ), VMX_ERROR );
+	TEST_CHECK_EQUAL( g_InvvpidCount, 0 );
+}
+
+int
+main()
+{
+	TEST_RUN( TestCaptureTrueControls );
+	TEST_RUN( TestCaptureLegacyControls );
+	TEST_RUN( TestCaptureVPIDWithoutEPT );
+	TEST_RUN( TestFixControls );
+	TEST_RUN( TestPassThroughControls );
+	TEST_RUN( TestInvalidateVPID );
+
+	return TEST_EXIT_CODE();
+}
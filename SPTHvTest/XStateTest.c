@@ -0,0 +1,262 @@
+#include <stdlib.h>
+
+#include "XState.h"
+#include "CPU.h"
+#include "Test.h"
+
+/*
+ * Which extended state an exit handler borrows, and which XCR0 values the guest may set, as plain bit arithmetic;
+ *  then a real borrow on this machine, with XSAVE and XSAVEOPT (XSAVES only runs at CPL 0): a YMM register the
+ *  guest left a value in is clobbered by the "handler", and has to read that value again once it's given back.
+ */
+
+// The XCR0 Windows sets on a processor with AVX-512: x87, SSE, AVX and the three AVX-512 components
+#define XCR0_AVX512_GUEST				(XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_AVX512)
+
+static CR4 g_CR4;
+
+UINT64
+__readcr4(
+	VOID
+	)
+{
+	return g_CR4.All;
+}
+
+static
+VOID
+TestSelectMask()
+{
+	// A YMM register is its XMM register and its upper half; a ZMM register (0-15) is its YMM register and its upper half
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_AVX, MAXUINT64, MAXUINT64 ), XSTATE_SSE | XSTATE_AVX );
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_ZMM_HI256, MAXUINT64, MAXUINT64 ), XSTATE_SSE | XSTATE_AVX | XSTATE_ZMM_HI256 );
+
+	// ZMM16-31 and the opmasks don't need anything else
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_HI16_ZMM, MAXUINT64, MAXUINT64 ), XSTATE_HI16_ZMM );
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_OPMASK, MAXUINT64, MAXUINT64 ), XSTATE_OPMASK );
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_X87, MAXUINT64, MAXUINT64 ), XSTATE_X87 );
+
+	// Nothing a handler can't ask for (MPX, AMX, anything supervisor)
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_BNDREGS | XSTATE_TILEDATA | (1ULL << 8), MAXUINT64, MAXUINT64 ), 0 );
+	TEST_CHECK_EQUAL( XStateSelectMask( MAXUINT64, MAXUINT64, MAXUINT64 ), XSTATE_VMM_COMPONENTS );
+
+	// Only what the guest has enabled: a guest without AVX has no upper halves to save
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_AVX, XSTATE_X87 | XSTATE_SSE, MAXUINT64 ), XSTATE_SSE );
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_AVX512, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX, MAXUINT64 ), XSTATE_SSE | XSTATE_AVX );
+
+	// And only what fits our area
+	TEST_CHECK_EQUAL( XStateSelectMask( XSTATE_AVX512, XCR0_AVX512_GUEST, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX ), XSTATE_SSE | XSTATE_AVX );
+
+	TEST_CHECK_EQUAL( XStateSelectMask( 0, MAXUINT64, MAXUINT64 ), 0 );
+}
+
+static
+VOID
+TestIsValidXCR0()
+{
+	UINT64 supported = XCR0_AVX512_GUEST | XSTATE_BNDREGS | XSTATE_BNDCSR | XSTATE_TILECFG | XSTATE_TILEDATA;
+
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87, supported ) == TRUE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX, supported ) == TRUE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XCR0_AVX512_GUEST, supported ) == TRUE );
+	TEST_CHECK( XStateIsValidXCR0( 0, supported, supported ) == TRUE );
+
+	// XCR0 is the only XCR there is
+	TEST_CHECK( XStateIsValidXCR0( 1, XSTATE_X87, supported ) == FALSE );
+
+	// Nothing the processor doesn't support, and never without x87
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX, XSTATE_X87 | XSTATE_SSE ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | (1ULL << 9), supported | (1ULL << 9) ) == TRUE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | (1ULL << 9), supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_SSE, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, 0, supported ) == FALSE );
+
+	// AVX needs SSE
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_AVX, supported ) == FALSE );
+
+	// AVX-512 is all or nothing, and needs AVX
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_OPMASK, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_OPMASK | XSTATE_ZMM_HI256, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_SSE | XSTATE_AVX512, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_AVX | XSTATE_AVX512, supported ) == FALSE );
+
+	// MPX's and AMX's components come in pairs
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_BNDREGS, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_BNDCSR, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XSTATE_X87 | XSTATE_BNDREGS | XSTATE_BNDCSR, supported ) == TRUE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XCR0_AVX512_GUEST | XSTATE_TILECFG, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XCR0_AVX512_GUEST | XSTATE_TILEDATA, supported ) == FALSE );
+	TEST_CHECK( XStateIsValidXCR0( 0, XCR0_AVX512_GUEST | XSTATE_TILECFG | XSTATE_TILEDATA, supported ) == TRUE );
+}
+
+static
+VOID
+TestSelectInstruction()
+{
+	// CPUID.(EAX=0DH,ECX=1):EAX; bit 1 (XSAVEC) and 2 (XGETBV with ECX = 1) don't matter
+	TEST_CHECK_EQUAL( XStateSelectInstruction( 0 ), XSTATE_INSTRUCTION_XSAVE );
+	TEST_CHECK_EQUAL( XStateSelectInstruction( 0x6 ), XSTATE_INSTRUCTION_XSAVE );
+	TEST_CHECK_EQUAL( XStateSelectInstruction( 0x1 ), XSTATE_INSTRUCTION_XSAVEOPT );
+	TEST_CHECK_EQUAL( XStateSelectInstruction( 0x8 ), XSTATE_INSTRUCTION_XSAVES );
+	TEST_CHECK_EQUAL( XStateSelectInstruction( 0xF ), XSTATE_INSTRUCTION_XSAVES );
+}
+
+static
+VOID
+TestInitialize()
+{
+	int cpuInfo[4];
+	UINT64 supported;
+
+	// XSAVE is off in CR4; XGETBV would #UD
+	g_CR4.All = 0;
+	TEST_CHECK( XStateInitialize() == FALSE );
+	TEST_CHECK_EQUAL( g_XStateFeatures.Instruction, XSTATE_INSTRUCTION_NONE );
+	TEST_CHECK_EQUAL( g_XStateFeatures.Components, 0 );
+
+	__cpuid( 1, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3] );
+	if ( (cpuInfo[2] & (1 << 27)) == 0 )
+	{
+		printf( "(OSXSAVE is off on this machine)\n" );
+		return;
+	}
+
+	// Whatever this machine has, as the driver would find it
+	g_CR4.OSXSAVE = 1;
+	TEST_CHECK( XStateInitialize() == TRUE );
+
+	__cpuid_count( XSTATE_CPUID_LEAF, 0, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3] );
+	supported = ((UINT64)(UINT32)cpuInfo[3] << 32) | (UINT32)cpuInfo[0];
+
+	TEST_CHECK_EQUAL( g_XStateFeatures.SupportedXCR0, supported );
+	TEST_CHECK_EQUAL( g_XStateFeatures.Components & ~(XSTATE_VMM_COMPONENTS & supported), 0 );
+	TEST_CHECK_EQUAL( g_XStateFeatures.Components & (XSTATE_X87 | XSTATE_SSE), XSTATE_X87 | XSTATE_SSE );
+	TEST_CHECK( (g_XStateFeatures.Components & XSTATE_AVX512) == 0 || (g_XStateFeatures.Components & XSTATE_AVX512) == XSTATE_AVX512 );
+
+	// (Note: the standard-format VMM components all fit in a page, on anything that has them)
+	TEST_CHECK_EQUAL( g_XStateFeatures.Components, XSTATE_VMM_COMPONENTS & (supported | XSTATE_X87 | XSTATE_SSE) );
+
+	__cpuid_count( XSTATE_CPUID_LEAF, 1, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3] );
+	TEST_CHECK_EQUAL( g_XStateFeatures.Instruction, XStateSelectInstruction( (UINT32)cpuInfo[0] ) );
+}
+
+static
+VOID
+_SetYMM7(
+	_In_reads_bytes_(32) CONST UINT8* Value
+	)
+{
+	__asm__ volatile ( "vmovdqu %0, %%ymm7" : : "m"( *(CONST UINT8(*)[32])Value ) : "xmm7" );
+}
+
+static
+VOID
+_GetYMM7(
+	_Out_writes_bytes_(32) UINT8* Value
+	)
+{
+	__asm__ volatile ( "vmovdqu %%ymm7, %0" : "=m"( *(UINT8(*)[32])Value ) );
+}
+
+static
+VOID
+_BorrowYMM(
+	_In_ CONST XSTATE_INSTRUCTION Instruction
+	)
+{
+	/*
+	 * An exit handler that runs on the guest's vector registers; it asks for the AVX state, clobbers YMM7 and
+	 *  gives it back. YMM7 has to read what the guest left in it.
+	 */
+
+	XSTATE_CONTEXT context;
+	UINT8 guest[32], clobber[32], after[32];
+	UINT64 mask;
+	ULONG i;
+
+	for ( i = 0; i < 32; i++ )
+	{
+		guest[i] = (UINT8)(0xA0 + i);
+		clobber[i] = 0x5A;
+	}
+
+	context.Area = aligned_alloc( XSTATE_AREA_ALIGNMENT, XSTATE_AREA_SIZE );
+	context.SavedMask = 0;
+	RtlZeroMemory( context.Area, XSTATE_AREA_SIZE );
+
+	g_XStateFeatures.Instruction = Instruction;
+
+	_SetYMM7( guest );
+
+	mask = XStateSave( &context, XSTATE_AVX );
+	TEST_CHECK_EQUAL( mask, XSTATE_SSE | XSTATE_AVX );
+	TEST_CHECK_EQUAL( context.SavedMask, mask );
+
+	// A second ask in the same exit saves nothing more; what it gets is what was saved the first time
+	TEST_CHECK_EQUAL( XStateSave( &context, XSTATE_AVX | XSTATE_X87 ), XSTATE_SSE | XSTATE_AVX );
+	TEST_CHECK_EQUAL( XStateSave( &context, XSTATE_SSE ), XSTATE_SSE );
+
+	_SetYMM7( clobber );
+	XStateRestore( &context );
+	TEST_CHECK_EQUAL( context.SavedMask, 0 );
+
+	_GetYMM7( after );
+	TEST_CHECK( memcmp( after, guest, sizeof(guest) ) == 0 );
+
+	// Nothing saved, nothing restored
+	_SetYMM7( clobber );
+	XStateRestore( &context );
+	_GetYMM7( after );
+	TEST_CHECK( memcmp( after, clobber, sizeof(clobber) ) == 0 );
+
+	free( context.Area );
+}
+
+static
+VOID
+TestSaveRestore()
+{
+	XSTATE_CONTEXT context;
+
+	// Nothing to save with, or into
+	RtlZeroMemory( &g_XStateFeatures, sizeof(g_XStateFeatures) );
+	g_XStateFeatures.Components = XSTATE_VMM_COMPONENTS;
+
+	context.Area = &context;
+	context.SavedMask = 0;
+	TEST_CHECK_EQUAL( XStateSave( &context, XSTATE_AVX ), 0 );
+
+	g_XStateFeatures.Instruction = XSTATE_INSTRUCTION_XSAVE;
+	context.Area = NULL;
+	TEST_CHECK_EQUAL( XStateSave( &context, XSTATE_AVX ), 0 );
+	TEST_CHECK_EQUAL( context.SavedMask, 0 );
+
+	// Nothing asked for that the guest (or our area) has
+	g_XStateFeatures.Components = XSTATE_X87 | XSTATE_SSE;
+	context.Area = &context;
+	TEST_CHECK_EQUAL( XStateSave( &context, XSTATE_OPMASK ), 0 );
+	TEST_CHECK_EQUAL( context.SavedMask, 0 );
+
+	if ( (_xgetbv( 0 ) & (XSTATE_SSE | XSTATE_AVX)) != (XSTATE_SSE | XSTATE_AVX) )
+	{
+		printf( "(AVX is off on this machine)\n" );
+		return;
+	}
+
+	g_XStateFeatures.Components = XSTATE_VMM_COMPONENTS;
+
+	_BorrowYMM( XSTATE_INSTRUCTION_XSAVE );
+	_BorrowYMM( XSTATE_INSTRUCTION_XSAVEOPT );
+}
+
+int
+main()
+{
+	TEST_RUN( TestSelectMask );
+	TEST_RUN( TestIsValidXCR0 );
+	TEST_RUN( TestSelectInstruction );
+	TEST_RUN( TestInitialize );
+	TEST_RUN( TestSaveRestore );
+
+	return TEST_EXIT_CODE();
+}
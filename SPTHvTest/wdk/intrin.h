@@ -0,0 +1,70 @@
+#ifndef __SPTHV_TEST_INTRIN_H__
+#define __SPTHV_TEST_INTRIN_H__
+
+/*
+ * The MSVC intrinsics the driver's pure modules use, in terms of GCC's; see "ntddk.h".
+ *
+ *  The privileged ones (__readmsr, the control registers, VMX) are only declared; a test that builds a module
+ *  which calls one defines it, as a fake.
+ */
+
+#include <ntddk.h>                 // (Note: for the types; a header may include this before it, as "VMX.h" does)
+#include <x86intrin.h>
+#include <cpuid.h>                 // (Note: with __cpuidex, from GCC 11 on)
+
+FORCEINLINE
+BOOLEAN
+_BitScanForward64(
+	_Out_ ULONG* Index,
+	_In_ UINT64 Mask
+	)
+{
+	if ( Mask == 0 )
+	{
+		return FALSE;
+	}
+
+	*Index = (ULONG)__builtin_ctzll( Mask );
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+_BitScanReverse64(
+	_Out_ ULONG* Index,
+	_In_ UINT64 Mask
+	)
+{
+	if ( Mask == 0 )
+	{
+		return FALSE;
+	}
+
+	*Index = 63 - (ULONG)__builtin_clzll( Mask );
+	return TRUE;
+}
+
+FORCEINLINE
+UINT64
+_umul128(
+	_In_ UINT64 Multiplier,
+	_In_ UINT64 Multiplicand,
+	_Out_ UINT64* HighProduct
+	)
+{
+	unsigned __int128 product = (unsigned __int128)Multiplier * Multiplicand;
+
+	*HighProduct = (UINT64)(product >> 64);
+	return (UINT64)product;
+}
+
+UINT64 __readmsr( ULONG Register );
+UINT64 __readcr0( VOID );
+UINT64 __readcr3( VOID );
+UINT64 __readcr4( VOID );
+UINT64 __readdr( UINT Register );
+VOID __sidt( PVOID Destination );
+UCHAR __vmx_vmread( SIZE_T Field, SIZE_T* Value );
+UCHAR __vmx_vmwrite( SIZE_T Field, SIZE_T Value );
+
+#endif // __SPTHV_TEST_INTRIN_H__
@@ -0,0 +1,175 @@
+#ifndef __SPTHV_TEST_NTDDK_H__
+#define __SPTHV_TEST_NTDDK_H__
+
+/*
+ * Just enough of the WDK for the driver's pure modules (the ones that only include their own header) to build
+ *  and run as ordinary Linux processes; see "CMakeLists.txt".
+ *
+ *  Everything in here keeps the WDK's sizes (ULONG is 32 bits, and so on), so structures laid out for the driver
+ *  are laid out the same way here. Nothing that only makes sense in the kernel (pool, IRQLs, the VMX instructions)
+ *  is provided; a test that needs one of those fakes it itself.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// SAL
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(Count)
+#define _In_reads_bytes_(Size)
+#define _Out_writes_(Count)
+#define _Out_writes_opt_(Count)
+#define _Out_writes_bytes_(Size)
+#define _Out_writes_z_(Count)
+#define _Inout_updates_(Count)
+#define _Inout_updates_bytes_(Size)
+#define _Dispatch_type_(Major)
+
+// Types
+#define VOID								void
+#define CONST								const
+
+typedef uint8_t UINT8, UCHAR, BOOLEAN, *PUINT8, *PUCHAR, *PBOOLEAN;
+typedef char CHAR, *PCHAR;
+typedef int8_t INT8;
+typedef uint16_t UINT16, USHORT, WCHAR, *PUINT16, *PUSHORT, *PWCHAR;
+typedef int16_t INT16, SHORT;
+typedef uint32_t UINT32, ULONG, UINT, *PUINT32, *PULONG;
+typedef int32_t INT32, LONG, INT, NTSTATUS, *PLONG;
+// (Note: long long, as on Windows, so that the driver's %llu and %llx formats match)
+typedef unsigned long long UINT64, ULONG64, ULONGLONG, *PUINT64, *PULONG64;
+typedef uint64_t ULONG_PTR, SIZE_T, *PULONG_PTR, *PSIZE_T;
+typedef long long INT64, LONG64, LONGLONG;
+typedef int64_t LONG_PTR;
+typedef void* PVOID;
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS, *PLARGE_INTEGER, *PPHYSICAL_ADDRESS;
+
+#define TRUE								1
+#define FALSE								0
+
+#define MAXUINT16							((UINT16)~0)
+#define MAXUINT32							((UINT32)~0)
+#define MAXULONG							((ULONG)~0)
+#define MAXUINT64							((UINT64)~0ULL)
+#define MAXULONG64							((ULONG64)~0ULL)
+
+// NTSTATUS
+#define STATUS_SUCCESS						((NTSTATUS)0x00000000L)
+#define STATUS_DEVICE_BUSY					((NTSTATUS)0x80000011L)
+#define STATUS_UNSUCCESSFUL					((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER			((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST		((NTSTATUS)0xC0000010L)
+#define STATUS_NO_MEMORY					((NTSTATUS)0xC0000017L)
+#define STATUS_BUFFER_TOO_SMALL				((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES		((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED				((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_DEVICE_STATE			((NTSTATUS)0xC0000184L)
+#define NT_SUCCESS(Status)					(((NTSTATUS)(Status)) >= 0)
+
+// Macros
+#define ANYSIZE_ARRAY						1
+#define PAGE_SIZE							0x1000
+#define PAGE_SHIFT							12
+#define SYSTEM_CACHE_ALIGNMENT_SIZE			64
+
+#define DECLSPEC_ALIGN(Alignment)			__attribute__((aligned(Alignment)))
+#define DECLSPEC_CACHEALIGN					DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define DECLSPEC_NORETURN					__attribute__((noreturn))
+#define FORCEINLINE							static inline __attribute__((always_inline))
+#define C_ASSERT(Expression)				_Static_assert((Expression), #Expression)
+#define UNREFERENCED_PARAMETER(Parameter)	((void)(Parameter))
+#define NT_ASSERT(Expression)				assert(Expression)
+
+#define ARRAYSIZE(Array)					(sizeof(Array) / sizeof((Array)[0]))
+#define RTL_NUMBER_OF(Array)				ARRAYSIZE(Array)
+#define FIELD_OFFSET(Type, Field)			((LONG)offsetof(Type, Field))
+#define RTL_FIELD_SIZE(Type, Field)			(sizeof(((Type*)0)->Field))
+#define CONTAINING_RECORD(Address, Type, Field)	((Type*)((PUCHAR)(Address) - offsetof(Type, Field)))
+#define ALIGN_UP_BY(Length, Alignment)		((((ULONG_PTR)(Length)) + (Alignment) - 1) & ~((ULONG_PTR)(Alignment) - 1))
+#define ALIGN_DOWN_BY(Length, Alignment)	(((ULONG_PTR)(Length)) & ~((ULONG_PTR)(Alignment) - 1))
+#define BYTES_TO_PAGES(Size)				(((Size) >> PAGE_SHIFT) + (((Size) & (PAGE_SIZE - 1)) != 0))
+#define ROUND_TO_PAGES(Size)				ALIGN_UP_BY(Size, PAGE_SIZE)
+
+#ifndef min
+#define min(a, b)							(((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)							(((a) > (b)) ? (a) : (b))
+#endif
+
+#define KdPrint(Arguments)					((void)0)
+
+// Rtl
+#define RtlSecureZeroMemory(Destination, Length)	memset((Destination), 0, (Length))
+#define RtlZeroMemory(Destination, Length)			memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length)	memcpy((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill)	memset((Destination), (Fill), (Length))
+
+#include <intrin.h>
+
+// Interlocked operations, with the WDK's full-barrier semantics
+#define InterlockedIncrement(Target)				__atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target)				__atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Target)				__atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value)			__atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Target, Value)		__atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Target, Value)		__atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedOr64(Target, Value)				__atomic_fetch_or((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd64(Target, Value)				__atomic_fetch_and((Target), (Value), __ATOMIC_SEQ_CST)
+
+FORCEINLINE
+LONG64
+InterlockedCompareExchange64(
+	_Inout_ volatile LONG64* Destination,
+	_In_ LONG64 Exchange,
+	_In_ LONG64 Comperand
+	)
+{
+	__atomic_compare_exchange_n( Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+	return Comperand;
+}
+
+FORCEINLINE
+BOOLEAN
+InterlockedBitTestAndSet64(
+	_Inout_ volatile LONG64* Base,
+	_In_ LONG64 Offset
+	)
+{
+	return (BOOLEAN)((__atomic_fetch_or( &Base[Offset / 64], 1LL << (Offset % 64), __ATOMIC_SEQ_CST ) >> (Offset % 64)) & 1);
+}
+
+FORCEINLINE
+BOOLEAN
+InterlockedBitTestAndReset64(
+	_Inout_ volatile LONG64* Base,
+	_In_ LONG64 Offset
+	)
+{
+	return (BOOLEAN)((__atomic_fetch_and( &Base[Offset / 64], ~(1LL << (Offset % 64)), __ATOMIC_SEQ_CST ) >> (Offset % 64)) & 1);
+}
+
+#define ReadAcquire(Source)							__atomic_load_n((volatile LONG*)(Source), __ATOMIC_ACQUIRE)
+#define ReadNoFence64(Source)						__atomic_load_n((volatile LONG64*)(Source), __ATOMIC_RELAXED)
+#define ReadAcquire64(Source)						__atomic_load_n((volatile LONG64*)(Source), __ATOMIC_ACQUIRE)
+#define WriteNoFence64(Destination, Value)			__atomic_store_n((volatile LONG64*)(Destination), (Value), __ATOMIC_RELAXED)
+#define WriteRelease64(Destination, Value)			__atomic_store_n((volatile LONG64*)(Destination), (Value), __ATOMIC_RELEASE)
+#define KeMemoryBarrier()							__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif // __SPTHV_TEST_NTDDK_H__
@@ -0,0 +1 @@
+#include <ntddk.h>